@@ -17,6 +17,12 @@ cl /I%CRT_INC_PATH% /I..\include /DWIN32_LEAN_AND_MEAN winvblk.c winvblock.res /
 del winvblk.obj
 popd
 
+pushd .
+cd xfertest
+cl /I%CRT_INC_PATH% /DWIN32_LEAN_AND_MEAN xfertest.c /Fe..\..\bin\xfertest.exe /link /LIBPATH:%DDK_LIB_DEST%\i386 /LIBPATH:%Lib%\crt\i386 bufferoverflowU.lib
+del xfertest.obj
+popd
+
 pushd .
 cd httpdisk_util
 build
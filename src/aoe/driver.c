@@ -47,6 +47,9 @@
 
 #define AOEPROTOCOLVER 1
 
+/* The most requests an AoE disk has outstanding, each with its tags */
+#define AOE_M_DISK_QUEUE_DEPTH 32
+
 /* From aoe/bus.c */
 extern WVL_S_BUS_T AoeBusMain;
 extern NTSTATUS AoeBusCreate(IN PDRIVER_OBJECT);
@@ -1806,6 +1809,7 @@ static AOE_SP_DISK AoeDiskCreatePdo_(void) {
     RtlZeroMemory(aoe_disk, sizeof *aoe_disk);
     /* Populate non-zero device defaults. */
     WvlDiskInit(aoe_disk->disk);
+    aoe_disk->disk->Queue.Depth = AOE_M_DISK_QUEUE_DEPTH;
     aoe_disk->disk->Media = WvlDiskMediaTypeHard;
     aoe_disk->disk->disk_ops.Io = AoeDiskIo_;
     aoe_disk->disk->disk_ops.MaxXferLen = AoeDiskMaxXferLen_;
@@ -0,0 +1,323 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Compressed image packer.
+ *
+ * Packs a raw disk image into the compressed image container format
+ * which HTTPDisk can mount.  This is a portable, user-land program:
+ *
+ *   cc -O2 -I../include -o cimgpack cimgpack.c ../lz4/lz4.c
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cimage.h"
+#include "lz4.h"
+
+#define LZ4_HASH_BITS       14
+
+#define HEADER_SIZE         48
+#define ENTRY_SIZE          16
+
+typedef struct _DEDUP_SLOT {
+    unsigned long long  Hash;
+    unsigned int        Block;
+    int                 Used;
+} DEDUP_SLOT;
+
+static unsigned int Lz4Table[LZ4_M_TABLE_ENTRIES(LZ4_HASH_BITS)];
+
+int CimgPackSyntax(void)
+{
+    fprintf(stderr, "syntax:\n");
+    fprintf(stderr, "cimgpack [-b:<block_kb>] [-store] <raw_image> <compressed_image>\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "-b     sets the block size, a power of two from %u to %u KiB (default %u).\n",
+        (1 << WV_M_CIMAGE_MIN_BLOCK_SHIFT) / 1024,
+        (1 << WV_M_CIMAGE_MAX_BLOCK_SHIFT) / 1024,
+        (1 << WV_M_CIMAGE_DEFAULT_BLOCK_SHIFT) / 1024);
+    fprintf(stderr, "-store only elides zero and duplicate blocks, without compressing.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "example:\n");
+    fprintf(stderr, "cimgpack -b:128 diskimage.img diskimage.cimg\n");
+
+    return -1;
+}
+
+static unsigned long long Fnv1a(const unsigned char* p, unsigned int len)
+{
+    unsigned long long h = 14695981039346656037ULL;
+
+    while (len--)
+    {
+        h ^= *p++;
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+static void PutLe(unsigned char* p, unsigned long long v, int bytes)
+{
+    while (bytes--)
+    {
+        *p++ = (unsigned char) v;
+        v >>= 8;
+    }
+}
+
+static int WriteHeader(FILE* Out, unsigned int BlockShift, unsigned long long ImageSize,
+    unsigned long long IndexOffset, unsigned int BlockCount)
+{
+    unsigned char buf[HEADER_SIZE];
+
+    memset(buf, 0, sizeof buf);
+    memcpy(buf, WV_M_CIMAGE_MAGIC, WV_M_CIMAGE_MAGIC_LEN);
+    PutLe(buf + 8, WV_M_CIMAGE_VERSION, 4);
+    PutLe(buf + 12, BlockShift, 4);
+    PutLe(buf + 16, ImageSize, 8);
+    PutLe(buf + 24, IndexOffset, 8);
+    PutLe(buf + 32, BlockCount, 4);
+
+    return fseeko(Out, 0, SEEK_SET) || fwrite(buf, sizeof buf, 1, Out) != 1;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int        BlockShift = WV_M_CIMAGE_DEFAULT_BLOCK_SHIFT;
+    unsigned int        BlockSize;
+    int                 Store = 0;
+    int                 i;
+    FILE*               In;
+    FILE*               Out;
+    unsigned long long  ImageSize;
+    unsigned long long  DataOffset;
+    unsigned int        BlockCount;
+    unsigned int        Block;
+    unsigned int        Len;
+    unsigned char*      Data;
+    unsigned char*      Other;
+    unsigned char*      Packed;
+    unsigned char*      Entries;
+    unsigned char*      Entry;
+    DEDUP_SLOT*         Slots;
+    unsigned int        SlotCount;
+    unsigned int        Slot;
+    unsigned long long  Hash;
+    int                 PackedLen;
+    unsigned int        Dup;
+    unsigned int        Stats[WvCimageMethods];
+    unsigned int        DupCount = 0;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+        if (!strncmp(argv[i], "-b:", 3))
+        {
+            unsigned int kb = (unsigned int) atoi(argv[i] + 3);
+
+            for (BlockShift = WV_M_CIMAGE_MIN_BLOCK_SHIFT;
+                BlockShift <= WV_M_CIMAGE_MAX_BLOCK_SHIFT && (1U << BlockShift) != kb * 1024;
+                BlockShift++);
+
+            if (BlockShift > WV_M_CIMAGE_MAX_BLOCK_SHIFT)
+            {
+                fprintf(stderr, "%s: Invalid block size.\n", argv[i] + 3);
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[i], "-store"))
+        {
+            Store = 1;
+        }
+        else
+        {
+            return CimgPackSyntax();
+        }
+    }
+
+    if (argc - i != 2)
+    {
+        return CimgPackSyntax();
+    }
+
+    In = fopen(argv[i], "rb");
+    if (!In)
+    {
+        perror(argv[i]);
+        return -1;
+    }
+
+    if (fseeko(In, 0, SEEK_END) || (long long) (ImageSize = ftello(In)) < 0)
+    {
+        perror(argv[i]);
+        return -1;
+    }
+
+    BlockSize = 1U << BlockShift;
+    if (((ImageSize + BlockSize - 1) >> BlockShift) > 0xFFFFFFFFULL)
+    {
+        fprintf(stderr, "%s: Image too large for this block size.\n", argv[i]);
+        return -1;
+    }
+    BlockCount = (unsigned int) ((ImageSize + BlockSize - 1) >> BlockShift);
+
+    Out = fopen(argv[i + 1], "w+b");
+    if (!Out)
+    {
+        perror(argv[i + 1]);
+        return -1;
+    }
+
+    /* A power of two at least twice the block count keeps probes short */
+    for (SlotCount = 1024; SlotCount < BlockCount * 2ULL && SlotCount < 0x80000000U; SlotCount <<= 1);
+
+    Data = malloc(BlockSize);
+    Other = malloc(BlockSize);
+    Packed = malloc(BlockSize);
+    Entries = calloc(BlockCount ? BlockCount : 1, ENTRY_SIZE);
+    Slots = calloc(SlotCount, sizeof *Slots);
+    if (!Data || !Other || !Packed || !Entries || !Slots)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+
+    memset(Stats, 0, sizeof Stats);
+    DataOffset = HEADER_SIZE;
+
+    if (WriteHeader(Out, BlockShift, ImageSize, 0, BlockCount))
+    {
+        perror(argv[i + 1]);
+        return -1;
+    }
+
+    for (Block = 0; Block < BlockCount; Block++)
+    {
+        Entry = Entries + (unsigned long long) Block * ENTRY_SIZE;
+        Len = ImageSize - ((unsigned long long) Block << BlockShift) < BlockSize ?
+            (unsigned int) (ImageSize - ((unsigned long long) Block << BlockShift)) :
+            BlockSize;
+
+        if (fseeko(In, (off_t) Block << BlockShift, SEEK_SET) || fread(Data, Len, 1, In) != 1)
+        {
+            perror(argv[i]);
+            return -1;
+        }
+
+        /* Zero blocks need no data */
+        for (Dup = 0; Dup < Len && !Data[Dup]; Dup++);
+        if (Dup == Len)
+        {
+            PutLe(Entry + 12, WvCimageMethodZero, 4);
+            Stats[WvCimageMethodZero]++;
+            continue;
+        }
+
+        /* Identical blocks share data; hash collisions are ruled out by comparison */
+        Hash = Fnv1a(Data, Len);
+        for (Slot = (unsigned int) Hash & (SlotCount - 1); Slots[Slot].Used; Slot = (Slot + 1) & (SlotCount - 1))
+        {
+            unsigned int OtherLen;
+
+            if (Slots[Slot].Hash != Hash)
+            {
+                continue;
+            }
+
+            OtherLen = ImageSize - ((unsigned long long) Slots[Slot].Block << BlockShift) < BlockSize ?
+                (unsigned int) (ImageSize - ((unsigned long long) Slots[Slot].Block << BlockShift)) :
+                BlockSize;
+            if (OtherLen != Len ||
+                fseeko(In, (off_t) Slots[Slot].Block << BlockShift, SEEK_SET) ||
+                fread(Other, Len, 1, In) != 1 ||
+                memcmp(Data, Other, Len))
+            {
+                continue;
+            }
+
+            memcpy(Entry, Entries + (unsigned long long) Slots[Slot].Block * ENTRY_SIZE, ENTRY_SIZE);
+            DupCount++;
+            break;
+        }
+        if (Slots[Slot].Used)
+        {
+            continue;
+        }
+
+        PackedLen = Store ? -1 : Lz4Compress(Data, Len, Packed, Len - 1, Lz4Table, LZ4_HASH_BITS);
+
+        /* Never trust the compressor with the only copy of the data */
+        if (PackedLen > 0 &&
+            (Lz4Decompress(Packed, PackedLen, Other, Len) != (int) Len || memcmp(Data, Other, Len)))
+        {
+            fprintf(stderr, "Block %u: Compression check failed, storing it.\n", Block);
+            PackedLen = -1;
+        }
+
+        if (PackedLen > 0)
+        {
+            PutLe(Entry + 12, WvCimageMethodLz4, 4);
+            Stats[WvCimageMethodLz4]++;
+        }
+        else
+        {
+            memcpy(Packed, Data, Len);
+            PackedLen = (int) Len;
+            PutLe(Entry + 12, WvCimageMethodStored, 4);
+            Stats[WvCimageMethodStored]++;
+        }
+
+        PutLe(Entry, DataOffset, 8);
+        PutLe(Entry + 8, (unsigned int) PackedLen, 4);
+
+        if (fseeko(Out, (off_t) DataOffset, SEEK_SET) || fwrite(Packed, PackedLen, 1, Out) != 1)
+        {
+            perror(argv[i + 1]);
+            return -1;
+        }
+        DataOffset += PackedLen;
+
+        Slots[Slot].Hash = Hash;
+        Slots[Slot].Block = Block;
+        Slots[Slot].Used = 1;
+    }
+
+    if (fseeko(Out, (off_t) DataOffset, SEEK_SET) ||
+        (BlockCount && fwrite(Entries, ENTRY_SIZE, BlockCount, Out) != BlockCount) ||
+        WriteHeader(Out, BlockShift, ImageSize, DataOffset, BlockCount) ||
+        fclose(Out))
+    {
+        perror(argv[i + 1]);
+        return -1;
+    }
+    fclose(In);
+
+    printf("%u blocks of %u bytes: %u zero, %u duplicate, %u compressed, %u stored.\n",
+        BlockCount, BlockSize, Stats[WvCimageMethodZero], DupCount,
+        Stats[WvCimageMethodLz4], Stats[WvCimageMethodStored]);
+    printf("%llu bytes packed into %llu.\n",
+        ImageSize, DataOffset + (unsigned long long) BlockCount * ENTRY_SIZE);
+
+    return 0;
+}
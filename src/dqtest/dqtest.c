@@ -0,0 +1,326 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Disk submission queue tests and benchmark.
+ *
+ * Drives winvblock/libdisk/diskqueue.c the way the disk library does,
+ * serializing every call, and checks the depth bound, the order in
+ * which waiting requests get freed slots, and the counts of requests
+ * in flight and waiting.  Then it times submitting and completing
+ * requests against a full queue.  This is a portable, user-land
+ * program:
+ *
+ *   cc -O2 -I../include -o dqtest dqtest.c \
+ *     ../winvblock/libdisk/diskqueue.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "diskqueue.h"
+#include "usertest.h"
+
+#define MAX_REQUESTS        256
+
+/* The queue depth while timing */
+#define BENCH_DEPTH         32
+
+#define DEFAULT_CYCLES      10000000UL
+
+/* A request, which is found again from its link */
+typedef struct _REQUEST {
+    WVL_S_DISK_QUEUE_ENTRY Link;
+    unsigned int        List;
+    unsigned int        Seq;
+} REQUEST;
+
+static REQUEST          Requests[MAX_REQUESTS];
+
+int DqTestSyntax(void)
+{
+    fprintf(stderr, "syntax:\n");
+    fprintf(stderr, "dqtest [-b:<cycles>]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "-b     sets how many submit and complete cycles are timed\n");
+    fprintf(stderr, "       (default %lu).\n", DEFAULT_CYCLES);
+    return 1;
+}
+
+static double Now(void)
+{
+    struct timespec Time;
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return Time.tv_sec + Time.tv_nsec / 1e9;
+}
+
+/* Submit request i from a list; returns what the queue said */
+static int Submit(WVL_SP_DISK_QUEUE Queue, unsigned int i, unsigned int List, unsigned int Seq)
+{
+    Requests[i].List = List;
+    Requests[i].Seq = Seq;
+    return WvlDiskQueueSubmit(Queue, List, &Requests[i].Link);
+}
+
+/* Complete a request; returns the request given its slot, or NULL */
+static REQUEST* Complete(WVL_SP_DISK_QUEUE Queue)
+{
+    return (REQUEST*) WvlDiskQueueComplete(Queue);
+}
+
+static void TestUnbounded(void)
+{
+    WVL_S_DISK_QUEUE    Queue;
+    unsigned int        i;
+    int                 Failed;
+
+    Failed = TestBegin("unbounded");
+    WvlDiskQueueInit(&Queue, 0);
+
+    for (i = 0; i < MAX_REQUESTS; i++)
+    {
+        CHECK(Submit(&Queue, i, i % 3, i));
+    }
+    CHECK(Queue.InFlight == MAX_REQUESTS);
+    CHECK(Queue.Waiting == 0);
+
+    for (i = 0; i < MAX_REQUESTS; i++)
+    {
+        CHECK(Complete(&Queue) == NULL);
+    }
+    CHECK(Queue.InFlight == 0);
+    TestEnd(Failed);
+}
+
+static void TestDepth(void)
+{
+    WVL_S_DISK_QUEUE    Queue;
+    REQUEST*            Next;
+    unsigned int        i;
+    int                 Failed;
+
+    Failed = TestBegin("depth");
+    WvlDiskQueueInit(&Queue, 4);
+
+    /* The first four are issued, and the rest wait. */
+    for (i = 0; i < 10; i++)
+    {
+        CHECK(Submit(&Queue, i, 0, i) == (i < 4));
+        CHECK(Queue.InFlight == (i < 4 ? i + 1 : 4));
+        CHECK(Queue.Waiting == (i < 4 ? 0 : i - 3));
+    }
+
+    /* Each completion hands its slot on, oldest first, while any wait. */
+    for (i = 4; i < 10; i++)
+    {
+        Next = Complete(&Queue);
+        if (CHECK(Next != NULL))
+        {
+            CHECK(Next->Seq == i);
+        }
+        CHECK(Queue.InFlight == 4);
+        CHECK(Queue.Waiting == 9 - i);
+    }
+
+    /* Then the slots are freed. */
+    for (i = 0; i < 4; i++)
+    {
+        CHECK(Complete(&Queue) == NULL);
+        CHECK(Queue.InFlight == 3 - i);
+    }
+
+    /* An emptied list takes requests again. */
+    for (i = 0; i < 5; i++)
+    {
+        CHECK(Submit(&Queue, i, 0, i) == (i < 4));
+    }
+    Next = Complete(&Queue);
+    CHECK(Next != NULL && Next->Seq == 4);
+    CHECK(Queue.InFlight == 4 && Queue.Waiting == 0);
+    TestEnd(Failed);
+}
+
+static void TestRoundRobin(void)
+{
+    WVL_S_DISK_QUEUE    Queue;
+    REQUEST*            Next;
+    unsigned int        Order[][2] = {
+        /* List, Seq */
+        { 0, 0 }, { 2, 0 }, { 5, 0 },
+        { 0, 1 }, { 2, 1 },
+        { 0, 2 }, { 2, 2 },
+        { 0, 3 },
+        { 0, 4 },
+        { 0, 5 },
+    };
+    unsigned int        i;
+    int                 Failed;
+
+    Failed = TestBegin("round robin");
+    WvlDiskQueueInit(&Queue, 1);
+    CHECK(Submit(&Queue, 0, 0, 99));
+
+    /* A busy list, then two quieter ones. */
+    for (i = 0; i < 6; i++)
+    {
+        CHECK(!Submit(&Queue, 1 + i, 0, i));
+    }
+    for (i = 0; i < 3; i++)
+    {
+        CHECK(!Submit(&Queue, 7 + i, 2, i));
+    }
+    CHECK(!Submit(&Queue, 10, 5, 0));
+    CHECK(Queue.Waiting == 10);
+
+    for (i = 0; i < sizeof Order / sizeof *Order; i++)
+    {
+        Next = Complete(&Queue);
+        if (!CHECK(Next != NULL))
+        {
+            break;
+        }
+        CHECK(Next->List == Order[i][0] && Next->Seq == Order[i][1]);
+        CHECK(Queue.Waiting == sizeof Order / sizeof *Order - 1 - i);
+    }
+    CHECK(Complete(&Queue) == NULL);
+    CHECK(Queue.InFlight == 0 && Queue.Waiting == 0);
+
+    /* A list which starts waiting later gets the next slot in turn. */
+    WvlDiskQueueInit(&Queue, 1);
+    CHECK(Submit(&Queue, 0, 0, 99));
+    for (i = 0; i < 4; i++)
+    {
+        CHECK(!Submit(&Queue, 1 + i, 1, i));
+    }
+    Next = Complete(&Queue);
+    CHECK(Next != NULL && Next->List == 1 && Next->Seq == 0);
+    CHECK(!Submit(&Queue, 5, 0, 0));
+    Next = Complete(&Queue);
+    CHECK(Next != NULL && Next->List == 0);
+    Next = Complete(&Queue);
+    CHECK(Next != NULL && Next->List == 1 && Next->Seq == 1);
+    TestEnd(Failed);
+}
+
+static void TestWrap(void)
+{
+    WVL_S_DISK_QUEUE    Queue;
+    REQUEST*            Next;
+    unsigned int        Last = WVL_M_DISK_QUEUE_LISTS - 1;
+    int                 Failed;
+
+    Failed = TestBegin("wrap");
+    WvlDiskQueueInit(&Queue, 1);
+    CHECK(Submit(&Queue, 0, 0, 99));
+
+    /* Serving the last list moves on to the first. */
+    CHECK(!Submit(&Queue, 1, Last, 0));
+    CHECK(!Submit(&Queue, 2, Last, 1));
+    CHECK(!Submit(&Queue, 3, 0, 0));
+    Next = Complete(&Queue);
+    CHECK(Next != NULL && Next->List == 0);
+    CHECK(Queue.NextList == 1);
+    Next = Complete(&Queue);
+    CHECK(Next != NULL && Next->List == Last && Next->Seq == 0);
+    CHECK(Queue.NextList == 0);
+
+    /* Processors beyond the lists share them. */
+    CHECK(!Submit(&Queue, 4, WVL_M_DISK_QUEUE_LISTS + 1, 0));
+    CHECK(!Submit(&Queue, 5, 1, 1));
+    Next = Complete(&Queue);
+    CHECK(Next != NULL && Next->List == WVL_M_DISK_QUEUE_LISTS + 1);
+    CHECK(Queue.NextList == 2);
+    Next = Complete(&Queue);
+    CHECK(Next != NULL && Next->List == Last && Next->Seq == 1);
+    CHECK(Queue.NextList == 0);
+    Next = Complete(&Queue);
+    CHECK(Next != NULL && Next->List == 1 && Next->Seq == 1);
+    CHECK(Queue.NextList == 2);
+    CHECK(Complete(&Queue) == NULL);
+    CHECK(Queue.InFlight == 0 && Queue.Waiting == 0);
+    TestEnd(Failed);
+}
+
+/*
+ * Keep a full queue busy, as a disk with more submitters than slots.
+ * The oldest request in flight completes and is submitted again, to
+ * wait behind the others.
+ */
+static void Bench(unsigned long Cycles)
+{
+    WVL_S_DISK_QUEUE    Queue;
+    unsigned int        InFlight[BENCH_DEPTH];
+    unsigned int        Oldest = 0;
+    unsigned int        Done;
+    REQUEST*            Next;
+    unsigned long       i;
+    double              Start;
+
+    WvlDiskQueueInit(&Queue, BENCH_DEPTH);
+    for (i = 0; i < MAX_REQUESTS; i++)
+    {
+        if (Submit(&Queue, (unsigned int) i, (unsigned int) i, 0))
+        {
+            InFlight[i] = (unsigned int) i;
+        }
+    }
+
+    Start = Now();
+    for (i = 0; i < Cycles; i++)
+    {
+        Done = InFlight[Oldest];
+        Next = Complete(&Queue);
+        InFlight[Oldest] = (unsigned int) (Next - Requests);
+        Oldest = (Oldest + 1) % BENCH_DEPTH;
+        Submit(&Queue, Done, Requests[Done].List, 0);
+    }
+    printf("%-24s%.1f ns per completion and submission\n", "cycle",
+        (Now() - Start) * 1e9 / Cycles);
+
+    CHECK(Queue.InFlight == BENCH_DEPTH);
+    CHECK(Queue.Waiting == MAX_REQUESTS - BENCH_DEPTH);
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned long       Cycles = DEFAULT_CYCLES;
+    int                 a;
+
+    for (a = 1; a < argc; a++)
+    {
+        if (!strncmp(argv[a], "-b:", 3) && atol(argv[a] + 3) > 0)
+        {
+            Cycles = (unsigned long) atol(argv[a] + 3);
+        }
+        else
+        {
+            return DqTestSyntax();
+        }
+    }
+
+    TestUnbounded();
+    TestDepth();
+    TestRoundRobin();
+    TestWrap();
+    Bench(Cycles);
+    return TestSummary();
+}
@@ -0,0 +1,561 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * GRUB4DOS drive map table decoder tests and benchmark.
+ *
+ * Builds copies of low memory holding GRUB4DOS drive map tables and
+ * checks what winvblock/grub4dos/g4dmap.c makes of each kind of slot,
+ * then times scanning a full table.  Given dumps of the first MiB of
+ * physical memory taken while GRUB4DOS is resident, such as from the
+ * QEMU monitor's "pmemsave 0 0x100000 lowmem.bin", it instead finds
+ * the table in each dump the way the driver does, by following the
+ * chain of safe INT 0x13 hooks, prints the slots and times scanning
+ * them.  This is a portable, user-land program for POSIX:
+ *
+ *   cc -O2 -I../include -o g4dtest g4dtest.c \
+ *     ../winvblock/grub4dos/g4dmap.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "g4dmap.h"
+#include "usertest.h"
+
+#define LOW_MEM_SIZE        0x100000UL
+
+/* Where the INT 0x13 vector is */
+#define INT13_VECTOR        (0x13 * 4)
+
+/* The start of a safe hook, as winvblock/safehook/probe.c reads it */
+#define HOOK_SIGNATURE      "$INT13SF"
+#define HOOK_VENDOR         "GRUB4DOS"
+#define HOOK_SIGNATURE_AT   3
+#define HOOK_VENDOR_AT      11
+#define HOOK_PREV_AT        19
+#define HOOK_SIZE           31
+
+/* How far a chain of hooks is followed */
+#define MAX_HOOKS           16
+
+/* Where the built images put their hooks */
+#define TEST_SEGMENT        0x9F00
+#define TEST_OTHER_SEGMENT  0x9E00
+
+#define DEFAULT_SCANS       1000000UL
+
+int G4dTestSyntax(void)
+{
+    fprintf(stderr, "syntax:\n");
+    fprintf(stderr, "g4dtest [-b:<scans>] [-s:<segment>] [<lowmem>...]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "-b     sets how many scans are timed (default %lu).\n", DEFAULT_SCANS);
+    fprintf(stderr, "-s     gives the hex segment of the GRUB4DOS INT 0x13 handler,\n");
+    fprintf(stderr, "       instead of following the INT 0x13 vector.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Without dumps of low memory, the decoder is tested against built ones.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "example:\n");
+    fprintf(stderr, "g4dtest lowmem.bin\n");
+
+    return -1;
+}
+
+static double Now(void)
+{
+    struct timespec Time;
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return Time.tv_sec + Time.tv_nsec / 1e9;
+}
+
+static unsigned int Get16(const unsigned char* p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static void Put16(unsigned char* p, unsigned int Value)
+{
+    p[0] = (unsigned char) Value;
+    p[1] = (unsigned char) (Value >> 8);
+}
+
+static void Put64(unsigned char* p, unsigned long long Value)
+{
+    int                 i;
+
+    for (i = 0; i < 8; i++)
+    {
+        p[i] = (unsigned char) (Value >> i * 8);
+    }
+}
+
+/*
+ * Find the GRUB4DOS table by following the safe hooks from the INT 0x13
+ * vector.  Returns 0 if there is none
+ */
+static unsigned long FindTable(const unsigned char* LowMem, unsigned long Len)
+{
+    const unsigned char* Vector = LowMem + INT13_VECTOR;
+    unsigned long       Hook;
+    int                 i;
+
+    for (i = 0; i < MAX_HOOKS; i++)
+    {
+        Hook = (unsigned long) Get16(Vector + 2) * 16 + Get16(Vector);
+        if (Len < HOOK_SIZE || Hook > Len - HOOK_SIZE ||
+            memcmp(LowMem + Hook + HOOK_SIGNATURE_AT, HOOK_SIGNATURE, 8))
+        {
+            return 0;
+        }
+        if (!memcmp(LowMem + Hook + HOOK_VENDOR_AT, HOOK_VENDOR, 8))
+        {
+            return (unsigned long) Get16(Vector + 2) * 16 + WV_M_G4D_MAP_TABLE_OFFSET;
+        }
+        Vector = LowMem + Hook + HOOK_PREV_AT;
+    }
+
+    return 0;
+}
+
+/* Put a safe hook at Segment:0, chained to the current INT 0x13 vector */
+static void PutHook(unsigned char* LowMem, unsigned int Segment, const char* Vendor)
+{
+    unsigned char*      Hook = LowMem + Segment * 16UL;
+
+    memcpy(Hook + HOOK_SIGNATURE_AT, HOOK_SIGNATURE, 8);
+    memcpy(Hook + HOOK_VENDOR_AT, Vendor, 8);
+    memcpy(Hook + HOOK_PREV_AT, LowMem + INT13_VECTOR, 4);
+    Put16(LowMem + INT13_VECTOR, 0);
+    Put16(LowMem + INT13_VECTOR + 2, Segment);
+}
+
+static void PutSlot(unsigned char* LowMem, unsigned int Index,
+    unsigned int Source, unsigned int Dest, unsigned int Heads,
+    unsigned int Flags, unsigned int Sectors,
+    unsigned long long Start, unsigned long long Count)
+{
+    unsigned char*      Slot = LowMem + TEST_SEGMENT * 16UL +
+        WV_M_G4D_MAP_TABLE_OFFSET + Index * WV_M_G4D_MAP_SLOT_SIZE;
+
+    Slot[0] = (unsigned char) Source;
+    Slot[1] = (unsigned char) Dest;
+    Slot[2] = (unsigned char) Heads;
+    Slot[3] = (unsigned char) Sectors;
+    Put16(Slot + 4, Flags);
+    Slot[6] = (unsigned char) Heads;
+    Slot[7] = (unsigned char) Sectors;
+    Put64(Slot + 8, Start);
+    Put64(Slot + 16, Count);
+}
+
+/* A low memory image with an empty GRUB4DOS table */
+static unsigned char* NewLowMem(void)
+{
+    unsigned char*      LowMem = calloc(1, LOW_MEM_SIZE);
+
+    if (LowMem)
+    {
+        PutHook(LowMem, TEST_SEGMENT, HOOK_VENDOR);
+    }
+
+    return LowMem;
+}
+
+static unsigned int Scan(const unsigned char* LowMem, WV_SP_G4D_MAP Maps)
+{
+    return WvG4dMapScan(LowMem, LOW_MEM_SIZE, TEST_SEGMENT * 16UL + WV_M_G4D_MAP_TABLE_OFFSET, Maps);
+}
+
+static void TestRam(void)
+{
+    WV_S_G4D_MAP        Maps[WV_M_G4D_MAP_SLOTS];
+    unsigned char*      LowMem = NewLowMem();
+    int                 Failed;
+
+    Failed = TestBegin("ram");
+    if (!CHECK(LowMem != NULL))
+    {
+        TestEnd(Failed);
+        return;
+    }
+
+    PutSlot(LowMem, 0, 0x80, 0xFF, 254, 0, 63, 0x20000, 0x10000);
+    PutSlot(LowMem, 1, 0x00, 0xFF, 1, 0, 18, 0x1000, 2880);
+    /* In-situ doesn't mean anything for RAM */
+    PutSlot(LowMem, 2, 0x81, 0xFF, 15, 0, 0x80 | 63, 0x30000, 0x800);
+    /* No sector count makes a remap, whatever the destination */
+    PutSlot(LowMem, 3, 0x82, 0xFF, 254, 0, 63, 0x40000, 0);
+
+    if (CHECK(Scan(LowMem, Maps) == 4))
+    {
+        CHECK(Maps[0].Kind == WvG4dMapKindRam);
+        CHECK(Maps[0].Media == WvG4dMapMediaHard);
+        CHECK(Maps[0].SectorSize == 512);
+        CHECK(Maps[0].SourceDrive == 0x80 && Maps[0].DestDrive == 0xFF);
+        CHECK(Maps[0].Heads == 255 && Maps[0].Sectors == 63);
+        CHECK(Maps[0].Offset == 0x20000ULL * 512);
+        CHECK(Maps[0].Length == 0x10000ULL * 512);
+
+        CHECK(Maps[1].Slot == 1);
+        CHECK(Maps[1].Kind == WvG4dMapKindRam);
+        CHECK(Maps[1].Media == WvG4dMapMediaFloppy);
+        CHECK(Maps[1].Heads == 2 && Maps[1].Sectors == 18);
+        CHECK(Maps[1].Offset == 0x1000ULL * 512);
+        CHECK(Maps[1].Length == 2880ULL * 512);
+
+        CHECK(Maps[2].Kind == WvG4dMapKindRam);
+        CHECK(Maps[2].Sectors == 63);
+
+        CHECK(Maps[3].Kind == WvG4dMapKindRemap);
+        CHECK(Maps[3].Offset == 0 && Maps[3].Length == 0);
+    }
+
+    free(LowMem);
+    TestEnd(Failed);
+}
+
+static void TestDrives(void)
+{
+    WV_S_G4D_MAP        Maps[WV_M_G4D_MAP_SLOTS];
+    unsigned char*      LowMem = NewLowMem();
+    int                 Failed;
+
+    Failed = TestBegin("drives");
+    if (!CHECK(LowMem != NULL))
+    {
+        TestEnd(Failed);
+        return;
+    }
+
+    PutSlot(LowMem, 0, 0x80, 0x81, 254, 0x8000, 63, 2048, 100000);
+    /* An ISO image on an optical drive, as an optical drive */
+    PutSlot(LowMem, 1, 0xE0, 0x9F, 0, 0x6000, 0, 16, 300000);
+    /* An ISO image on a hard disk, as an optical drive */
+    PutSlot(LowMem, 2, 0xE1, 0x80, 254, 0x2000, 63, 4096, 1200000);
+    PutSlot(LowMem, 3, 0x80, 0x80, 254, 0x8000, 0x80 | 63, 63, 204800);
+    PutSlot(LowMem, 4, 0x00, 0x01, 1, 0, 18, 0, 0);
+
+    if (CHECK(Scan(LowMem, Maps) == 5))
+    {
+        CHECK(Maps[0].Kind == WvG4dMapKindSector);
+        CHECK(Maps[0].Media == WvG4dMapMediaHard);
+        CHECK(Maps[0].Offset == 2048ULL * 512);
+        CHECK(Maps[0].Length == 100000ULL * 512);
+
+        CHECK(Maps[1].Kind == WvG4dMapKindSector);
+        CHECK(Maps[1].Media == WvG4dMapMediaOptical);
+        CHECK(Maps[1].SectorSize == 2048);
+        CHECK(Maps[1].Heads == 1 && Maps[1].Sectors == 1);
+        CHECK(Maps[1].Offset == 16ULL * 2048);
+        CHECK(Maps[1].Length == 300000ULL * 2048);
+
+        CHECK(Maps[2].Kind == WvG4dMapKindSector);
+        CHECK(Maps[2].Media == WvG4dMapMediaOptical);
+        CHECK(Maps[2].SectorSize == 2048);
+        CHECK(Maps[2].Offset == 4096ULL * 512);
+        CHECK(Maps[2].Length == 1200000ULL * 512);
+
+        CHECK(Maps[3].Kind == WvG4dMapKindInSitu);
+        CHECK(Maps[3].Offset == 63ULL * 512);
+
+        CHECK(Maps[4].Kind == WvG4dMapKindRemap);
+        CHECK(Maps[4].Media == WvG4dMapMediaFloppy);
+        CHECK(Maps[4].DestDrive == 0x01);
+        CHECK(Maps[4].Offset == 0 && Maps[4].Length == 0);
+    }
+
+    free(LowMem);
+    TestEnd(Failed);
+}
+
+static void TestBounds(void)
+{
+    WV_S_G4D_MAP        Maps[WV_M_G4D_MAP_SLOTS];
+    unsigned char*      LowMem = NewLowMem();
+    const unsigned long Table = TEST_SEGMENT * 16UL + WV_M_G4D_MAP_TABLE_OFFSET;
+    const unsigned long Size = WV_M_G4D_MAP_SLOTS * WV_M_G4D_MAP_SLOT_SIZE;
+    int                 Failed;
+    unsigned int        i;
+
+    Failed = TestBegin("bounds");
+    if (!CHECK(LowMem != NULL))
+    {
+        TestEnd(Failed);
+        return;
+    }
+
+    CHECK(Scan(LowMem, Maps) == 0);
+
+    /* The first empty slot ends the table */
+    PutSlot(LowMem, 0, 0x80, 0xFF, 254, 0, 63, 0x20000, 0x10000);
+    PutSlot(LowMem, 2, 0x81, 0xFF, 254, 0, 63, 0x30000, 0x10000);
+    CHECK(Scan(LowMem, Maps) == 1);
+
+    for (i = 0; i < WV_M_G4D_MAP_SLOTS; i++)
+    {
+        PutSlot(LowMem, i, 0x80 + i, 0xFF, 254, 0, 63, 0x20000 + i * 0x10000, 0x10000);
+    }
+    /* Past the table, which must not be read */
+    PutSlot(LowMem, WV_M_G4D_MAP_SLOTS, 0x90, 0xFF, 254, 0, 63, 0x20000, 0x10000);
+    if (CHECK(Scan(LowMem, Maps) == WV_M_G4D_MAP_SLOTS))
+    {
+        CHECK(Maps[WV_M_G4D_MAP_SLOTS - 1].Slot == WV_M_G4D_MAP_SLOTS - 1);
+        CHECK(Maps[WV_M_G4D_MAP_SLOTS - 1].SourceDrive == 0x80 + WV_M_G4D_MAP_SLOTS - 1);
+    }
+
+    /* A table which doesn't fit within the copy */
+    CHECK(WvG4dMapScan(LowMem, Table + Size, Table, Maps) == WV_M_G4D_MAP_SLOTS);
+    CHECK(WvG4dMapScan(LowMem, Table + Size - 1, Table, Maps) == 0);
+    CHECK(WvG4dMapScan(LowMem, Table, Table, Maps) == 0);
+    CHECK(WvG4dMapScan(LowMem, Table - 1, Table, Maps) == 0);
+    CHECK(WvG4dMapScan(LowMem, LOW_MEM_SIZE, (unsigned long) -1, Maps) == 0);
+
+    free(LowMem);
+    TestEnd(Failed);
+}
+
+static void TestHooks(void)
+{
+    unsigned char*      LowMem = calloc(1, LOW_MEM_SIZE);
+    int                 Failed;
+
+    Failed = TestBegin("hooks");
+    if (!CHECK(LowMem != NULL))
+    {
+        TestEnd(Failed);
+        return;
+    }
+
+    CHECK(FindTable(LowMem, LOW_MEM_SIZE) == 0);
+
+    /* A BIOS handler, then GRUB4DOS, then MEMDISK */
+    Put16(LowMem + INT13_VECTOR, 0xE3FE);
+    Put16(LowMem + INT13_VECTOR + 2, 0xF000);
+    PutHook(LowMem, TEST_SEGMENT, HOOK_VENDOR);
+    CHECK(FindTable(LowMem, LOW_MEM_SIZE) == TEST_SEGMENT * 16UL + WV_M_G4D_MAP_TABLE_OFFSET);
+    PutHook(LowMem, TEST_OTHER_SEGMENT, "MEMDISK ");
+    CHECK(FindTable(LowMem, LOW_MEM_SIZE) == TEST_SEGMENT * 16UL + WV_M_G4D_MAP_TABLE_OFFSET);
+
+    /* A hook which is cut off */
+    CHECK(FindTable(LowMem, TEST_SEGMENT * 16UL + HOOK_SIZE - 1) == 0);
+
+    /* A loop of hooks without GRUB4DOS */
+    memcpy(LowMem + TEST_SEGMENT * 16UL + HOOK_VENDOR_AT, "MEMDISK ", 8);
+    memcpy(LowMem + TEST_SEGMENT * 16UL + HOOK_PREV_AT, LowMem + INT13_VECTOR, 4);
+    CHECK(FindTable(LowMem, LOW_MEM_SIZE) == 0);
+
+    free(LowMem);
+    TestEnd(Failed);
+}
+
+static unsigned char* LoadDump(const char* Name, unsigned long* Len)
+{
+    unsigned char*      LowMem = calloc(1, LOW_MEM_SIZE);
+    FILE*               File = fopen(Name, "rb");
+
+    if (!File || !LowMem)
+    {
+        fprintf(stderr, "%s: Couldn't open it.\n", Name);
+        if (File)
+        {
+            fclose(File);
+        }
+        free(LowMem);
+        return NULL;
+    }
+    *Len = (unsigned long) fread(LowMem, 1, LOW_MEM_SIZE, File);
+    fclose(File);
+
+    return LowMem;
+}
+
+/* Write an image out and decode it as a dump */
+static void TestDump(void)
+{
+    WV_S_G4D_MAP        Maps[WV_M_G4D_MAP_SLOTS];
+    WV_S_G4D_MAP        Loaded[WV_M_G4D_MAP_SLOTS];
+    char                Name[] = "/tmp/g4dtestXXXXXX";
+    unsigned char*      LowMem = NewLowMem();
+    unsigned char*      Dump = NULL;
+    unsigned long       Len = 0;
+    unsigned int        Count;
+    FILE*               File = NULL;
+    int                 Failed;
+    int                 Fd;
+
+    Failed = TestBegin("dump");
+    Fd = mkstemp(Name);
+    if (!CHECK(LowMem != NULL) || !CHECK(Fd >= 0) || !CHECK((File = fdopen(Fd, "wb")) != NULL))
+    {
+        if (Fd >= 0)
+        {
+            close(Fd);
+            unlink(Name);
+        }
+        free(LowMem);
+        TestEnd(Failed);
+        return;
+    }
+
+    PutHook(LowMem, TEST_OTHER_SEGMENT, "MEMDISK ");
+    PutSlot(LowMem, 0, 0x80, 0xFF, 254, 0, 63, 0x20000, 0x10000);
+    PutSlot(LowMem, 1, 0xE0, 0x9F, 0, 0x6000, 0, 16, 300000);
+    PutSlot(LowMem, 2, 0x00, 0x01, 1, 0, 18, 0, 0);
+    CHECK(fwrite(LowMem, 1, LOW_MEM_SIZE, File) == LOW_MEM_SIZE);
+    CHECK(!fclose(File));
+
+    Dump = LoadDump(Name, &Len);
+    if (CHECK(Dump != NULL) && CHECK(Len == LOW_MEM_SIZE))
+    {
+        /* The maps are compared whole, padding and all */
+        memset(Maps, 0, sizeof Maps);
+        memset(Loaded, 0, sizeof Loaded);
+        Count = Scan(LowMem, Maps);
+        CHECK(Count == 3);
+        CHECK(WvG4dMapScan(Dump, Len, FindTable(Dump, Len), Loaded) == Count);
+        CHECK(!memcmp(Maps, Loaded, Count * sizeof *Maps));
+    }
+
+    unlink(Name);
+    free(Dump);
+    free(LowMem);
+    TestEnd(Failed);
+}
+
+static void PrintMaps(const WV_S_G4D_MAP* Maps, unsigned int Count)
+{
+    static const char*  Kinds[] = { "remap", "ram", "sector", "in-situ" };
+    static const char*  Medias[] = { "floppy", "hard", "optical" };
+    unsigned int        i;
+
+    for (i = 0; i < Count; i++)
+    {
+        printf("  slot %u: %02X -> %02X %-7s %-7s %4u-byte sectors, CHS */%u/%u,"
+            " offset 0x%llX, length %llu\n",
+            Maps[i].Slot, Maps[i].SourceDrive, Maps[i].DestDrive,
+            Kinds[Maps[i].Kind], Medias[Maps[i].Media], Maps[i].SectorSize,
+            Maps[i].Heads, Maps[i].Sectors, Maps[i].Offset, Maps[i].Length);
+    }
+}
+
+static void Bench(const unsigned char* LowMem, unsigned long Len, unsigned long Table, unsigned long Scans)
+{
+    WV_S_G4D_MAP        Maps[WV_M_G4D_MAP_SLOTS];
+    volatile unsigned int Count = 0;
+    unsigned long       i;
+    double              Start;
+
+    Start = Now();
+    for (i = 0; i < Scans; i++)
+    {
+        Count += WvG4dMapScan(LowMem, Len, Table, Maps);
+    }
+    printf("%-24s%.1f ns per scan of %u slot(s)\n", "scan",
+        (Now() - Start) * 1e9 / Scans, Count / (unsigned int) Scans);
+}
+
+int main(int argc, char* argv[])
+{
+    WV_S_G4D_MAP        Maps[WV_M_G4D_MAP_SLOTS];
+    unsigned long       Scans = DEFAULT_SCANS;
+    unsigned long       Segment = 0;
+    unsigned long       Table;
+    unsigned long       Len;
+    unsigned char*      LowMem;
+    unsigned int        i;
+    int                 Dumps = 0;
+    int                 a;
+
+    for (a = 1; a < argc; a++)
+    {
+        if (!strncmp(argv[a], "-b:", 3) && atol(argv[a] + 3) > 0)
+        {
+            Scans = (unsigned long) atol(argv[a] + 3);
+        }
+        else if (!strncmp(argv[a], "-s:", 3) && strtoul(argv[a] + 3, NULL, 16) > 0 &&
+            strtoul(argv[a] + 3, NULL, 16) <= 0xFFFF)
+        {
+            Segment = strtoul(argv[a] + 3, NULL, 16);
+        }
+        else if (argv[a][0] != '-')
+        {
+            Dumps++;
+        }
+        else
+        {
+            return G4dTestSyntax();
+        }
+    }
+
+    if (!Dumps)
+    {
+        TestRam();
+        TestDrives();
+        TestBounds();
+        TestHooks();
+        TestDump();
+
+        LowMem = NewLowMem();
+        if (CHECK(LowMem != NULL))
+        {
+            for (i = 0; i < WV_M_G4D_MAP_SLOTS; i++)
+            {
+                PutSlot(LowMem, i, 0x80 + i, i & 1 ? 0xFF : 0x88, 254, 0x8000, 63, 0x20000, 0x10000);
+            }
+            Bench(LowMem, LOW_MEM_SIZE, TEST_SEGMENT * 16UL + WV_M_G4D_MAP_TABLE_OFFSET, Scans);
+            free(LowMem);
+        }
+
+        return TestSummary();
+    }
+
+    for (a = 1; a < argc; a++)
+    {
+        if (argv[a][0] == '-')
+        {
+            continue;
+        }
+        LowMem = LoadDump(argv[a], &Len);
+        if (!LowMem)
+        {
+            Failures++;
+            continue;
+        }
+        Table = Segment ? Segment * 16 + WV_M_G4D_MAP_TABLE_OFFSET : FindTable(LowMem, Len);
+        if (!Table)
+        {
+            fprintf(stderr, "%s: No GRUB4DOS INT 0x13 hook.\n", argv[a]);
+            Failures++;
+            free(LowMem);
+            continue;
+        }
+
+        printf("%s: table at 0x%05lX\n", argv[a], Table);
+        PrintMaps(Maps, WvG4dMapScan(LowMem, Len, Table, Maps));
+        Bench(LowMem, Len, Table, Scans);
+        free(LowMem);
+    }
+
+    return Failures ? 1 : 0;
+}
@@ -0,0 +1,393 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * HTTPDisk compressed image support.
+ *
+ * All compressed image operations are performed from the HTTPDisk's
+ * thread, at PASSIVE_LEVEL, so no locking is required and the buffers
+ * can be paged.
+ */
+
+#include <ntddk.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "bus.h"
+#include "disk.h"
+#include "httpdisk.h"
+#include "debug.h"
+#include "cimage.h"
+#include "lz4.h"
+#include "httprange.h"
+#include "mirror.h"
+#include "cimgread.h"
+
+/** Macros */
+
+/* The largest index we're willing to hold in memory */
+#define HTTPDISK_M_CIMAGE_MAX_INDEX (256 * 1024 * 1024)
+
+/** From httpdisk.c */
+extern PVOID HttpDiskPalloc(SIZE_T);
+
+/** Private function declarations */
+static BOOLEAN STDCALL HttpdiskCimageCheckIndex_(
+    IN HTTPDISK_SP_CIMAGE,
+    IN ULONGLONG
+  );
+static ULONG STDCALL HttpdiskCimageBlockLen_(IN HTTPDISK_SP_CIMAGE, IN ULONG);
+static HTTPRANGE_E_STATUS STDCALL HttpdiskCimageDecode_(
+    IN HTTPDISK_SP_CIMAGE,
+    IN ULONG,
+    IN PUCHAR,
+    OUT PUCHAR
+  );
+
+/** Function definitions */
+
+NTSTATUS STDCALL HttpdiskCimageOpen(
+    OUT HTTPDISK_SP_CIMAGE * cimage_ptr,
+    IN HTTPDISK_SP_MIRRORS mirrors,
+    IN ULONGLONG file_size
+  ) {
+    WV_S_CIMAGE_HEADER header;
+    HTTPDISK_SP_CIMAGE cimage;
+    ULONGLONG index_size;
+    HTTPRANGE_E_STATUS range_status;
+    NTSTATUS status;
+
+    ASSERT(cimage_ptr);
+    *cimage_ptr = NULL;
+
+    /* Anything without our signature is a plain image */
+    if (file_size < sizeof header)
+      return STATUS_SUCCESS;
+    range_status = HttpdiskMirrorsGet(mirrors, 0, sizeof header, &header);
+    if (range_status != HttpRangeStatusSuccess) {
+        DBG("Couldn't fetch header: %d\n", range_status);
+        status = STATUS_UNEXPECTED_NETWORK_ERROR;
+        goto err_header;
+      }
+    if (!RtlEqualMemory(
+        header.Magic,
+        WV_M_CIMAGE_MAGIC,
+        WV_M_CIMAGE_MAGIC_LEN
+      ))
+      return STATUS_SUCCESS;
+
+    index_size = (ULONGLONG) header.BlockCount * sizeof (WV_S_CIMAGE_ENTRY);
+    if (
+        header.Version != WV_M_CIMAGE_VERSION ||
+        header.BlockShift < WV_M_CIMAGE_MIN_BLOCK_SHIFT ||
+        header.BlockShift > WV_M_CIMAGE_MAX_BLOCK_SHIFT ||
+        header.BlockCount != (
+            (header.ImageSize + (1 << header.BlockShift) - 1) >>
+            header.BlockShift
+          ) ||
+        header.IndexOffset < sizeof header ||
+        header.IndexOffset > file_size ||
+        index_size > file_size - header.IndexOffset
+      ) {
+        DBG("Unsupported or corrupt compressed image!\n");
+        status = STATUS_DISK_CORRUPT_ERROR;
+        goto err_header;
+      }
+    if (index_size > HTTPDISK_M_CIMAGE_MAX_INDEX) {
+        DBG("Compressed image index too large!\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_header;
+      }
+
+    cimage = HttpDiskPalloc(sizeof *cimage);
+    if (!cimage) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_cimage;
+      }
+    RtlZeroMemory(cimage, sizeof *cimage);
+    cimage->Mirrors = mirrors;
+    cimage->BlockShift = header.BlockShift;
+    cimage->BlockSize = 1 << header.BlockShift;
+    cimage->ImageSize = header.ImageSize;
+    cimage->BlockCount = header.BlockCount;
+    cimage->FetchSize = HTTPDISK_M_CIMAGE_FETCH_SIZE;
+    if (cimage->FetchSize < cimage->BlockSize)
+      cimage->FetchSize = cimage->BlockSize;
+
+    /* At least one byte, for an empty image */
+    cimage->Index = HttpDiskPalloc((SIZE_T) index_size + 1);
+    if (!cimage->Index) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_index;
+      }
+    if (index_size) {
+        range_status = HttpdiskMirrorsGet(
+            mirrors,
+            header.IndexOffset,
+            (ULONG) index_size,
+            cimage->Index
+          );
+        if (range_status != HttpRangeStatusSuccess) {
+            DBG("Couldn't fetch index: %d\n", range_status);
+            status = STATUS_UNEXPECTED_NETWORK_ERROR;
+            goto err_fetch_index;
+          }
+      }
+    if (!HttpdiskCimageCheckIndex_(cimage, file_size)) {
+        status = STATUS_DISK_CORRUPT_ERROR;
+        goto err_check_index;
+      }
+
+    cimage->Fetch = HttpDiskPalloc(cimage->FetchSize);
+    if (!cimage->Fetch) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_fetch;
+      }
+
+    cimage->Cache = HttpDiskPalloc(cimage->BlockSize);
+    if (!cimage->Cache) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_cache;
+      }
+
+    DBG(
+        "Compressed image: %I64u bytes in %u blocks of %u\n",
+        cimage->ImageSize,
+        cimage->BlockCount,
+        cimage->BlockSize
+      );
+    *cimage_ptr = cimage;
+    return STATUS_SUCCESS;
+
+    err_cache:
+
+    ExFreePool(cimage->Fetch);
+    err_fetch:
+
+    err_check_index:
+
+    err_fetch_index:
+
+    ExFreePool(cimage->Index);
+    err_index:
+
+    ExFreePool(cimage);
+    err_cimage:
+
+    err_header:
+
+    return status;
+  }
+
+VOID STDCALL HttpdiskCimageFree(IN HTTPDISK_SP_CIMAGE cimage) {
+    if (!cimage)
+      return;
+
+    ExFreePool(cimage->Cache);
+    ExFreePool(cimage->Fetch);
+    ExFreePool(cimage->Index);
+    ExFreePool(cimage);
+    return;
+  }
+
+HTTPRANGE_E_STATUS STDCALL HttpdiskCimageRead(
+    IN HTTPDISK_SP_CIMAGE cimage,
+    IN LONGLONG offset,
+    IN ULONG length,
+    OUT PUCHAR buffer
+  ) {
+    ULONG block;
+    ULONG last;
+    ULONG within;
+    ULONG chunk;
+    ULONG block_len;
+    ULONG fetch_len;
+    WV_SP_CIMAGE_ENTRY entry;
+    WV_SP_CIMAGE_ENTRY next;
+    PUCHAR src;
+    HTTPRANGE_E_STATUS status;
+
+    if (
+        offset < 0 ||
+        (ULONGLONG) offset > cimage->ImageSize ||
+        length > cimage->ImageSize - offset
+      )
+      return HttpRangeStatusInvalid;
+
+    while (length) {
+        block = (ULONG) (offset >> cimage->BlockShift);
+        within = (ULONG) offset & (cimage->BlockSize - 1);
+        entry = cimage->Index + block;
+
+        /* Zero blocks and the cached block need no fetch */
+        if (
+            entry->Method == WvCimageMethodZero ||
+            (cimage->CacheValid && cimage->CacheOffset == entry->Offset)
+          ) {
+            chunk = HttpdiskCimageBlockLen_(cimage, block) - within;
+            if (chunk > length)
+              chunk = length;
+            if (entry->Method == WvCimageMethodZero)
+              RtlZeroMemory(buffer, chunk);
+              else
+              RtlCopyMemory(buffer, cimage->Cache + within, chunk);
+            offset += chunk;
+            length -= chunk;
+            buffer += chunk;
+            continue;
+          }
+
+        /*
+         * Gather the following blocks which are still wanted and whose
+         * data follow on from this one's, so they arrive in one request.
+         */
+        fetch_len = entry->Length;
+        for (last = block; last + 1 < cimage->BlockCount; ++last) {
+            next = cimage->Index + last + 1;
+            if (
+                ((ULONGLONG) (last + 1 - block) << cimage->BlockShift) >=
+                  (ULONGLONG) within + length ||
+                next->Method == WvCimageMethodZero ||
+                next->Offset != next[-1].Offset + next[-1].Length ||
+                fetch_len + next->Length > cimage->FetchSize
+              )
+              break;
+            fetch_len += next->Length;
+          }
+
+        status = HttpdiskMirrorsGet(
+            cimage->Mirrors,
+            entry->Offset,
+            fetch_len,
+            cimage->Fetch
+          );
+        if (status != HttpRangeStatusSuccess)
+          return status;
+
+        for (src = cimage->Fetch; block <= last; ++block) {
+            entry = cimage->Index + block;
+            block_len = HttpdiskCimageBlockLen_(cimage, block);
+            chunk = block_len - within;
+            if (chunk > length)
+              chunk = length;
+
+            if (!within && chunk == block_len) {
+                /* The whole block is wanted; decode it in place */
+                status = HttpdiskCimageDecode_(cimage, block, src, buffer);
+                if (status != HttpRangeStatusSuccess)
+                  return status;
+              } else {
+                /* Keep the block for the rest of it, which may follow */
+                cimage->CacheValid = FALSE;
+                status = HttpdiskCimageDecode_(
+                    cimage,
+                    block,
+                    src,
+                    cimage->Cache
+                  );
+                if (status != HttpRangeStatusSuccess)
+                  return status;
+                cimage->CacheOffset = entry->Offset;
+                cimage->CacheValid = TRUE;
+                RtlCopyMemory(buffer, cimage->Cache + within, chunk);
+              }
+
+            src += entry->Length;
+            offset += chunk;
+            length -= chunk;
+            buffer += chunk;
+            within = 0;
+          }
+      }
+    return HttpRangeStatusSuccess;
+  }
+
+/* Validate every index entry up-front, so reads needn't */
+static BOOLEAN STDCALL HttpdiskCimageCheckIndex_(
+    IN HTTPDISK_SP_CIMAGE cimage,
+    IN ULONGLONG file_size
+  ) {
+    WV_SP_CIMAGE_ENTRY entry;
+    ULONG i;
+
+    for (i = 0; i < cimage->BlockCount; ++i) {
+        entry = cimage->Index + i;
+        switch (entry->Method) {
+            case WvCimageMethodZero:
+              continue;
+
+            case WvCimageMethodStored:
+              if (entry->Length != HttpdiskCimageBlockLen_(cimage, i))
+                break;
+              goto check_range;
+
+            case WvCimageMethodLz4:
+              if (!entry->Length || entry->Length > cimage->BlockSize)
+                break;
+              goto check_range;
+
+            default:
+              break;
+          }
+        DBG("Bad index entry %u!\n", i);
+        return FALSE;
+
+        check_range:
+        if (
+            entry->Offset > file_size ||
+            entry->Length > file_size - entry->Offset
+          ) {
+            DBG("Index entry %u is beyond the end of the file!\n", i);
+            return FALSE;
+          }
+      }
+    return TRUE;
+  }
+
+/* The uncompressed length of a block; only the last can be short */
+static ULONG STDCALL HttpdiskCimageBlockLen_(
+    IN HTTPDISK_SP_CIMAGE cimage,
+    IN ULONG block
+  ) {
+    ULONGLONG start = (ULONGLONG) block << cimage->BlockShift;
+
+    if (cimage->ImageSize - start < cimage->BlockSize)
+      return (ULONG) (cimage->ImageSize - start);
+    return cimage->BlockSize;
+  }
+
+static HTTPRANGE_E_STATUS STDCALL HttpdiskCimageDecode_(
+    IN HTTPDISK_SP_CIMAGE cimage,
+    IN ULONG block,
+    IN PUCHAR src,
+    OUT PUCHAR dest
+  ) {
+    WV_SP_CIMAGE_ENTRY entry = cimage->Index + block;
+    ULONG block_len = HttpdiskCimageBlockLen_(cimage, block);
+
+    if (entry->Method == WvCimageMethodStored) {
+        RtlCopyMemory(dest, src, block_len);
+        return HttpRangeStatusSuccess;
+      }
+    if (Lz4Decompress(src, entry->Length, dest, block_len) != (int) block_len) {
+        DBG("Block %u is corrupt!\n", block);
+        return HttpRangeStatusBadResponse;
+      }
+    return HttpRangeStatusSuccess;
+  }
@@ -0,0 +1,100 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HTTPDISK_M_CIMGREAD_H_
+#  define HTTPDISK_M_CIMGREAD_H_
+
+/**
+ * @file
+ *
+ * HTTPDisk compressed image support.
+ *
+ * When the remote file is a compressed image (see cimage.h in the
+ * common includes), its index is fetched once at connect time and
+ * reads are then served by fetching and decompressing whole blocks.
+ * Blocks whose data are adjacent on the server are fetched together.
+ */
+
+/** Macros */
+
+/* The most compressed data fetched in one request */
+#define HTTPDISK_M_CIMAGE_FETCH_SIZE (256 * 1024)
+
+/** Object types */
+typedef struct HTTPDISK_CIMAGE HTTPDISK_S_CIMAGE, * HTTPDISK_SP_CIMAGE;
+
+/** Struct/union type definitions */
+
+/** An open compressed image */
+struct HTTPDISK_CIMAGE {
+    HTTPDISK_SP_MIRRORS Mirrors;
+    ULONG BlockShift;
+    ULONG BlockSize;
+    ULONGLONG ImageSize;
+    ULONG BlockCount;
+    WV_SP_CIMAGE_ENTRY Index;
+
+    /** Staging for compressed data */
+    PUCHAR Fetch;
+    ULONG FetchSize;
+
+    /** The last partially-read block, keyed by its data's offset */
+    PUCHAR Cache;
+    ULONGLONG CacheOffset;
+    BOOLEAN CacheValid;
+  };
+
+/** Function declarations */
+
+/**
+ * Open a compressed image, if the remote file is one.
+ *
+ * @v Cimage            Points to the image pointer to populate.  Set to
+ *                      NULL if the remote file is a plain image.
+ * @v Mirrors           The mirrors serving the file.
+ * @v FileSize          The size of the remote file.
+ * @ret NTSTATUS        The status of the operation.
+ */
+extern NTSTATUS STDCALL HttpdiskCimageOpen(
+    OUT HTTPDISK_SP_CIMAGE *,
+    IN HTTPDISK_SP_MIRRORS,
+    IN ULONGLONG
+  );
+
+/**
+ * Free a compressed image.
+ *
+ * @v Cimage            The image to free.  May be NULL.
+ */
+extern VOID STDCALL HttpdiskCimageFree(IN HTTPDISK_SP_CIMAGE);
+
+/**
+ * Read from a compressed image.
+ *
+ * @v Cimage            The image to read from.
+ * @v Offset            The offset in the uncompressed image.
+ * @v Length            The number of bytes to read.
+ * @v Buffer            Receives the uncompressed data.
+ * @ret HTTPRANGE_E_STATUS      HttpRangeStatusBadResponse for corrupt data.
+ */
+extern HTTPRANGE_E_STATUS STDCALL HttpdiskCimageRead(
+    IN HTTPDISK_SP_CIMAGE,
+    IN LONGLONG,
+    IN ULONG,
+    OUT PUCHAR
+  );
+
+#endif  /* HTTPDISK_M_CIMGREAD_H_ */
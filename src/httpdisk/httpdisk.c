@@ -113,6 +113,11 @@ MmGetSystemAddressForMdlPrettySafe (
 #include "httpdisk.h"
 #include "debug.h"
 #include "irp.h"
+#include "overlay.h"
+#include "httprange.h"
+#include "mirror.h"
+#include "cimage.h"
+#include "cimgread.h"
 
 /* From bus.c */
 extern NTSTATUS STDCALL HttpdiskBusEstablish(void);
@@ -131,14 +136,8 @@ extern DRIVER_DISPATCH HttpdiskBusIrp;
 
 #define TOC_DATA_TRACK          0x04
 
-#define BUFFER_SIZE             (4096 * 4)
-
 PDRIVER_OBJECT HttpdiskDriverObj = NULL;
 
-typedef struct _HTTP_HEADER {
-    LARGE_INTEGER ContentLength;
-} HTTP_HEADER, *PHTTP_HEADER;
-
 NTSTATUS
 DriverEntry (
     IN PDRIVER_OBJECT   DriverObject,
@@ -189,6 +188,8 @@ static WVL_F_DISK_PNP HttpdiskPnpQueryId_;
 
 static WVL_F_DISK_IO HttpdiskIo_;
 
+static WVL_F_DISK_UNMAP HttpdiskUnmap_;
+
 static WVL_F_DISK_UNIT_NUM HttpdiskUnitNum_;
 
 VOID
@@ -208,31 +209,19 @@ HttpDiskDisconnect (
     IN PIRP             Irp
 );
 
-NTSTATUS
-HttpDiskGetHeader (
-    IN ULONG                Address,
-    IN USHORT               Port,
-    IN PUCHAR               HostName,
-    IN PUCHAR               FileName,
-    OUT PIO_STATUS_BLOCK    IoStatus,
-    OUT PHTTP_HEADER        HttpHeader
-);
+static VOID HttpdiskFreeConnection_(IN HTTPDISK_SP_DEV);
 
-NTSTATUS
-HttpDiskGetBlock (
-    IN int                  *Socket,
-    IN ULONG                Address,
-    IN USHORT               Port,
-    IN PUCHAR               HostName,
-    IN PUCHAR               FileName,
-    IN PLARGE_INTEGER       Offset,
-    IN ULONG                Length,
-    OUT PIO_STATUS_BLOCK    IoStatus,
-    OUT PVOID               SystemBuffer
-);
+static NTSTATUS STDCALL HttpdiskGetBlock_(
+    IN HTTPDISK_SP_DEV,
+    IN LONGLONG,
+    IN ULONG,
+    OUT PVOID
+  );
+
+static NTSTATUS HttpdiskRangeStatus_(IN HTTPRANGE_E_STATUS);
+
+static const HTTPRANGE_S_TRANSPORT HttpdiskTransport_;
 
-__int64 __cdecl _atoi64(const char *);
-int __cdecl _snprintf(char *, size_t, const char *, ...);
 int __cdecl swprintf(wchar_t *, const wchar_t *, ...);
 
 /** Memory allocation functions. */
@@ -362,7 +351,11 @@ NTSTATUS STDCALL HttpdiskCreateDevice(
 
     device_extension->file_name = NULL;
 
-    device_extension->socket = -1;
+    device_extension->mirrors = NULL;
+
+    device_extension->cimage = NULL;
+
+    device_extension->overlay = NULL;
 
     device_object->Characteristics |= FILE_READ_ONLY_DEVICE;
 
@@ -388,6 +381,7 @@ NTSTATUS STDCALL HttpdiskCreateDevice(
     device_extension->Disk->DriverObj = HttpdiskDriverObj;
     device_extension->Disk->disk_ops.PnpQueryId = HttpdiskPnpQueryId_;
     device_extension->Disk->disk_ops.Io = HttpdiskIo_;
+    device_extension->Disk->disk_ops.Unmap = HttpdiskUnmap_;
     device_extension->Disk->disk_ops.UnitNum = HttpdiskUnitNum_;
 
     status = PsCreateSystemThread(
@@ -731,7 +725,9 @@ static NTSTATUS HttpdiskIrpDevCtl_(
 
     case IOCTL_DISK_IS_WRITABLE:
         {
-            status = STATUS_MEDIA_WRITE_PROTECTED;
+            status = device_extension->overlay ?
+                STATUS_SUCCESS :
+                STATUS_MEDIA_WRITE_PROTECTED;
             Irp->IoStatus.Information = 0;
             break;
         }
@@ -939,35 +935,90 @@ static NTSTATUS STDCALL HttpdiskIo_(
     IN PUCHAR buffer,
     IN PIRP irp
   ) {
-    UCHAR tries;
     HTTPDISK_SP_DEV dev = CONTAINING_RECORD(disk, HTTPDISK_S_DEV, Disk[0]);
-    LARGE_INTEGER offset;
-
-    if (mode == WvlDiskIoModeWrite)
-      return WvlIrpComplete(irp, 0, STATUS_MEDIA_WRITE_PROTECTED);
-
-    offset.QuadPart = start_sector * disk->SectorSize;
-    tries = 2;
-    while (tries--) {
-        HttpDiskGetBlock(
-            &dev->socket,
-            dev->address,
-            dev->port,
-            dev->host_name,
-            dev->file_name,
-            &offset,
-            sector_count * disk->SectorSize,
-            &irp->IoStatus,
+    NTSTATUS status;
+
+    /* Writes only ever land in the overlay, if there is one. */
+    if (mode == WvlDiskIoModeWrite) {
+        if (!dev->overlay)
+          return WvlIrpComplete(irp, 0, STATUS_MEDIA_WRITE_PROTECTED);
+        status = HttpdiskOverlayWrite(
+            dev->overlay,
+            start_sector,
+            sector_count,
             buffer
           );
-        if (NT_SUCCESS(irp->IoStatus.Status))
-          return WvlIrpComplete(
-              irp,
-              sector_count * disk->SectorSize,
-              STATUS_SUCCESS
-            );
+        return WvlIrpComplete(
+            irp,
+            NT_SUCCESS(status) ? sector_count * disk->SectorSize : 0,
+            status
+          );
+      }
+
+    /* Don't bother the server for sectors we've already overwritten. */
+    if (
+        dev->overlay &&
+        HttpdiskOverlayCovers(dev->overlay, start_sector, sector_count)
+      ) {
+        status = HttpdiskOverlayRead(
+            dev->overlay,
+            start_sector,
+            sector_count,
+            buffer
+          );
+        return WvlIrpComplete(
+            irp,
+            NT_SUCCESS(status) ? sector_count * disk->SectorSize : 0,
+            status
+          );
       }
-    return WvlIrpComplete(irp, 0, irp->IoStatus.Status);
+
+    status = HttpdiskGetBlock_(
+        dev,
+        start_sector * disk->SectorSize,
+        sector_count * disk->SectorSize,
+        buffer
+      );
+    if (!NT_SUCCESS(status))
+      return WvlIrpComplete(irp, 0, status);
+
+    /* Merge any overwritten sectors on top of the base image's data. */
+    if (dev->overlay) {
+        status = HttpdiskOverlayRead(
+            dev->overlay,
+            start_sector,
+            sector_count,
+            buffer
+          );
+        if (!NT_SUCCESS(status))
+          return WvlIrpComplete(irp, 0, status);
+      }
+    return WvlIrpComplete(
+        irp,
+        sector_count * disk->SectorSize,
+        STATUS_SUCCESS
+      );
+  }
+
+/* Unmapped sectors fall back to the base image. */
+static NTSTATUS STDCALL HttpdiskUnmap_(
+    IN WVL_SP_DISK_T disk,
+    IN WVL_SP_DISK_RANGE ranges,
+    IN UINT32 count,
+    IN PIRP irp
+  ) {
+    HTTPDISK_SP_DEV dev = CONTAINING_RECORD(disk, HTTPDISK_S_DEV, Disk[0]);
+
+    if (dev->overlay) {
+        for (; count--; ranges++) {
+            HttpdiskOverlayDrop(
+                dev->overlay,
+                ranges->StartSector,
+                ranges->SectorCount
+              );
+          }
+      }
+    return WvlIrpComplete(irp, 0, STATUS_SUCCESS);
   }
 
 static UCHAR STDCALL HttpdiskUnitNum_(IN WVL_SP_DISK_T disk) {
@@ -993,6 +1044,7 @@ HttpDiskThread (
     PLIST_ENTRY         request;
     PIRP                irp;
     PIO_STACK_LOCATION  io_stack;
+    PUCHAR              buffer;
 
     ASSERT(Context != NULL);
 
@@ -1032,34 +1084,68 @@ HttpDiskThread (
 
             io_stack = IoGetCurrentIrpStackLocation(irp);
 
+            /*
+             * With an overlay, reads and writes need merging, so
+             * they go through the same path as SCSI I/O.
+             */
+            if (device_extension->overlay &&
+                (io_stack->MajorFunction == IRP_MJ_READ ||
+                io_stack->MajorFunction == IRP_MJ_WRITE))
+            {
+                ULONG sector_size = device_extension->Disk->SectorSize;
+                LONGLONG offset = io_stack->Parameters.Read.ByteOffset.QuadPart;
+                ULONG length = io_stack->Parameters.Read.Length;
+
+                /* The overlay trusts its callers to stay on the disk */
+                if (offset % sector_size || length % sector_size ||
+                    offset < 0 ||
+                    offset > device_extension->file_size.QuadPart ||
+                    length > device_extension->file_size.QuadPart - offset)
+                {
+                    WvlIrpComplete(irp, 0, STATUS_INVALID_PARAMETER);
+                    continue;
+                }
+
+                buffer = MmGetSystemAddressForMdlSafe(irp->MdlAddress, NormalPagePriority);
+                if (!buffer)
+                {
+                    WvlIrpComplete(irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+                    continue;
+                }
+
+                HttpdiskIo_(
+                    device_extension->Disk,
+                    io_stack->MajorFunction == IRP_MJ_WRITE ?
+                        WvlDiskIoModeWrite :
+                        WvlDiskIoModeRead,
+                    offset / sector_size,
+                    length / sector_size,
+                    buffer,
+                    irp
+                    );
+                continue;
+            }
+
             switch (io_stack->MajorFunction)
             {
             case IRP_MJ_READ:
-                HttpDiskGetBlock(
-                    &device_extension->socket,
-                    device_extension->address,
-                    device_extension->port,
-                    device_extension->host_name,
-                    device_extension->file_name,
-                    &io_stack->Parameters.Read.ByteOffset,
-                    io_stack->Parameters.Read.Length,
-                    &irp->IoStatus,
-                    MmGetSystemAddressForMdlSafe(irp->MdlAddress, NormalPagePriority)
-                    );
-                if (!NT_SUCCESS(irp->IoStatus.Status))
+                buffer = MmGetSystemAddressForMdlSafe(irp->MdlAddress, NormalPagePriority);
+                if (!buffer)
                 {
-                    HttpDiskGetBlock(
-                        &device_extension->socket,
-                        device_extension->address,
-                        device_extension->port,
-                        device_extension->host_name,
-                        device_extension->file_name,
-                        &io_stack->Parameters.Read.ByteOffset,
-                        io_stack->Parameters.Read.Length,
-                        &irp->IoStatus,
-                        MmGetSystemAddressForMdlSafe(irp->MdlAddress, NormalPagePriority)
-                        );
+                    irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+                    irp->IoStatus.Information = 0;
+                    break;
                 }
+                irp->IoStatus.Status = HttpdiskGetBlock_(
+                    device_extension,
+                    io_stack->Parameters.Read.ByteOffset.QuadPart,
+                    io_stack->Parameters.Read.Length,
+                    buffer
+                    );
+                irp->IoStatus.Information =
+                    NT_SUCCESS(irp->IoStatus.Status) ?
+                    io_stack->Parameters.Read.Length :
+                    0;
                 break;
 
             case IRP_MJ_WRITE:
@@ -1100,7 +1186,7 @@ HttpDiskConnect (
 {
     HTTPDISK_SP_DEV       device_extension;
     PHTTP_DISK_INFORMATION  http_disk_information;
-    HTTP_HEADER             http_header;
+    ULONGLONG               size;
 
     ASSERT(DeviceObject != NULL);
     ASSERT(Irp != NULL);
@@ -1137,12 +1223,7 @@ HttpDiskConnect (
 
     if (device_extension->file_name == NULL)
     {
-        if (device_extension->host_name != NULL)
-        {
-            ExFreePool(device_extension->host_name);
-            device_extension->host_name = NULL;
-        }
-
+        HttpdiskFreeConnection_(device_extension);
         Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
         return Irp->IoStatus.Status;
     }
@@ -1155,46 +1236,64 @@ HttpDiskConnect (
 
     device_extension->file_name[http_disk_information->FileNameLength] = '\0';
 
-    HttpDiskGetHeader(
-        device_extension->address,
-        device_extension->port,
-        device_extension->host_name,
-        device_extension->file_name,
-        &Irp->IoStatus,
-        &http_header
+    Irp->IoStatus.Status = HttpdiskMirrorsCreate(
+        &device_extension->mirrors,
+        &HttpdiskTransport_,
+        http_disk_information,
+        &size
         );
 
     if (!NT_SUCCESS(Irp->IoStatus.Status))
     {
-        HttpDiskGetHeader(
-            device_extension->address,
-            device_extension->port,
-            device_extension->host_name,
-            device_extension->file_name,
-            &Irp->IoStatus,
-            &http_header
-            );
+        DbgPrint("HttpDisk: Couldn't get the size of %s: %#x\n", device_extension->file_name, Irp->IoStatus.Status);
+        HttpdiskFreeConnection_(device_extension);
+        return Irp->IoStatus.Status;
     }
 
+    Irp->IoStatus.Status = HttpdiskCimageOpen(
+        &device_extension->cimage,
+        device_extension->mirrors,
+        size
+        );
+
     if (!NT_SUCCESS(Irp->IoStatus.Status))
     {
-        if (device_extension->host_name != NULL)
-        {
-            ExFreePool(device_extension->host_name);
-            device_extension->host_name = NULL;
-        }
+        DbgPrint("HttpDisk: Couldn't open compressed image %s: %#x\n", device_extension->file_name, Irp->IoStatus.Status);
+        HttpdiskFreeConnection_(device_extension);
+        return Irp->IoStatus.Status;
+    }
+
+    if (device_extension->cimage != NULL)
+    {
+        size = device_extension->cimage->ImageSize;
+    }
+
+    device_extension->file_size.QuadPart = size;
 
-        if (device_extension->file_name != NULL)
+    if (http_disk_information->Overlay)
+    {
+        http_disk_information->OverlayFileName[
+            sizeof http_disk_information->OverlayFileName /
+            sizeof http_disk_information->OverlayFileName[0] - 1
+          ] = L'\0';
+
+        Irp->IoStatus.Status = HttpdiskOverlayCreate(
+            &device_extension->overlay,
+            device_extension->file_size.QuadPart,
+            device_extension->Disk->SectorSize,
+            http_disk_information->OverlayMaxMegabytes,
+            http_disk_information->OverlayFileName
+            );
+
+        if (!NT_SUCCESS(Irp->IoStatus.Status))
         {
-            ExFreePool(device_extension->file_name);
-            device_extension->file_name = NULL;
+            HttpdiskFreeConnection_(device_extension);
+            return Irp->IoStatus.Status;
         }
 
-        return Irp->IoStatus.Status;
+        DeviceObject->Characteristics &= ~FILE_READ_ONLY_DEVICE;
     }
 
-    device_extension->file_size.QuadPart = http_header.ContentLength.QuadPart;
-
     device_extension->media_in_device = TRUE;
 
     return Irp->IoStatus.Status;
@@ -1215,23 +1314,7 @@ HttpDiskDisconnect (
 
     device_extension->media_in_device = FALSE;
 
-    if (device_extension->host_name != NULL)
-    {
-        ExFreePool(device_extension->host_name);
-        device_extension->host_name = NULL;
-    }
-
-    if (device_extension->file_name != NULL)
-    {
-        ExFreePool(device_extension->file_name);
-        device_extension->file_name = NULL;
-    }
-
-    if (device_extension->socket > 0)
-    {
-        close(device_extension->socket);
-        device_extension->socket = -1;
-    }
+    HttpdiskFreeConnection_(device_extension);
 
     Irp->IoStatus.Status = STATUS_SUCCESS;
     Irp->IoStatus.Information = 0;
@@ -1239,411 +1322,241 @@ HttpDiskDisconnect (
     return STATUS_SUCCESS;
 }
 
-NTSTATUS
-HttpDiskGetHeader (
-    IN ULONG                Address,
-    IN USHORT               Port,
-    IN PUCHAR               HostName,
-    IN PUCHAR               FileName,
-    OUT PIO_STATUS_BLOCK    IoStatus,
-    OUT PHTTP_HEADER        HttpHeader
-    )
-{
-    int                 kSocket;
-    struct sockaddr_in  toAddr;
-    int                 status, nSent, nRecv;
-    char                *buffer, *pStr;
-
-    ASSERT(HostName != NULL);
-    ASSERT(FileName != NULL);
-    ASSERT(IoStatus != NULL);
-    ASSERT(HttpHeader != NULL);
-
-    buffer = HttpDiskPalloc(BUFFER_SIZE);
-
-    if (buffer == NULL)
-    {
-        IoStatus->Status = STATUS_INSUFFICIENT_RESOURCES;
-        return IoStatus->Status;
-    }
-
-    kSocket = socket(AF_INET, SOCK_STREAM, 0);
-
-    if (kSocket < 0)
-    {
-        DbgPrint("HttpDisk: socket() error: %#x\n", kSocket);
-        ExFreePool(buffer);
-        IoStatus->Status = kSocket;
-        return IoStatus->Status;
-    }
-
-    toAddr.sin_family = AF_INET;
-    toAddr.sin_port = Port;
-    toAddr.sin_addr.s_addr = Address;
-
-    status = connect(kSocket, (struct sockaddr*) &toAddr, sizeof(toAddr));
-
-    if (status < 0)
-    {
-        DbgPrint("HttpDisk: connect() error: %#x\n", status);
-        ExFreePool(buffer);
-        close(kSocket);
-        IoStatus->Status = status;
-        return IoStatus->Status;
-    }
-
-    // Example request:
-    //  HEAD 'FileName' HTTP/1.1
-    //  Host: 'HostName'
-    //  Accept: */*
-    //  User-Agent: HttpDisk/1.2
-    //  Connection: close
-    //
-    // Interesting lines in answer:
-    //  HTTP/1.1 200 OK
-    //  Accept-Ranges: bytes
-    //  Content-Length: 'total file size'
-
-    _snprintf(
-        buffer,
-        BUFFER_SIZE,
-        "HEAD %s HTTP/1.1\r\nHost: %s\r\nAccept: */*\r\nUser-Agent: HttpDisk/1.2\r\nConnection: close\r\n\r\n",
-        FileName,
-        HostName
-        );
-
-    nSent = send(kSocket, buffer, strlen(buffer), 0);
-
-    if (nSent < 0)
-    {
-        DbgPrint("HttpDisk: send() error: %#x\n", nSent);
-        ExFreePool(buffer);
-        close(kSocket);
-        IoStatus->Status = nSent;
-        return IoStatus->Status;
-    }
-
-    nRecv = recv(kSocket, buffer, BUFFER_SIZE, 0);
-
-    if (nRecv < 0)
-    {
-        DbgPrint("HttpDisk: recv() error: %#x\n", nRecv);
-        ExFreePool(buffer);
-        close(kSocket);
-        IoStatus->Status = nRecv;
-        return IoStatus->Status;
-    }
-
-    close(kSocket);
-
-    buffer[BUFFER_SIZE - 1] = '\0';
-
-    if (_strnicmp(buffer, "HTTP/1.1 200 OK", 15))
-    {
-        DbgPrint("HttpDisk: Invalid HTTP response:\n%s", buffer);
-        ExFreePool(buffer);
-        IoStatus->Status = STATUS_NO_SUCH_FILE;
-        return IoStatus->Status;
-    }
-
-    pStr = strstr(buffer, "Content-Length:");
-
-    if (pStr == NULL || pStr + 16 >= buffer + BUFFER_SIZE)
-    {
-        DbgPrint("HttpDisk: Invalid HTTP response:\n%s", buffer);
-        ExFreePool(buffer);
-        IoStatus->Status = STATUS_NO_SUCH_FILE;
-        return IoStatus->Status;
-    }
-
-    HttpHeader->ContentLength.QuadPart = _atoi64(pStr + 16);
-
-    if (HttpHeader->ContentLength.QuadPart == 0)
-    {
-        DbgPrint("HttpDisk: Invalid HTTP response:\n%s", buffer);
-        ExFreePool(buffer);
-        IoStatus->Status = STATUS_NO_SUCH_FILE;
-        return IoStatus->Status;
-    }
-
-    ExFreePool(buffer);
-
-    IoStatus->Status = STATUS_SUCCESS;
-    IoStatus->Information = 0;
+static VOID HttpdiskFreeConnection_(IN HTTPDISK_SP_DEV dev) {
+    if (dev->overlay) {
+        HttpdiskOverlayFree(dev->overlay);
+        dev->overlay = NULL;
+      }
+    if (dev->cimage) {
+        HttpdiskCimageFree(dev->cimage);
+        dev->cimage = NULL;
+      }
+    if (dev->mirrors) {
+        HttpdiskMirrorsFree(dev->mirrors);
+        dev->mirrors = NULL;
+      }
+    if (dev->host_name) {
+        ExFreePool(dev->host_name);
+        dev->host_name = NULL;
+      }
+    if (dev->file_name) {
+        ExFreePool(dev->file_name);
+        dev->file_name = NULL;
+      }
+    return;
+  }
 
+/**
+ * Read from the remote image.
+ *
+ * @v dev               The HTTPDisk to read from.
+ * @v offset            The byte offset to read from.
+ * @v length            The number of bytes to read.
+ * @v buffer            Receives exactly length bytes upon success.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Mirror failover and retries happen below us, so a failure here is final.
+ */
+static NTSTATUS STDCALL HttpdiskGetBlock_(
+    IN HTTPDISK_SP_DEV dev,
+    IN LONGLONG offset,
+    IN ULONG length,
+    OUT PVOID buffer
+  ) {
+    HTTPRANGE_E_STATUS status;
+
+    if (!buffer)
+      return STATUS_INSUFFICIENT_RESOURCES;
+
+    if (dev->cimage)
+      status = HttpdiskCimageRead(dev->cimage, offset, length, buffer);
+      else
+      status = HttpdiskMirrorsGet(dev->mirrors, offset, length, buffer);
+    if (status != HttpRangeStatusSuccess) {
+        DBG("Range %I64d+%u failed: %d\n", offset, length, status);
+        return HttpdiskRangeStatus_(status);
+      }
     return STATUS_SUCCESS;
-}
-
-NTSTATUS
-HttpDiskGetBlock (
-    IN int                  *Socket,
-    IN ULONG                Address,
-    IN USHORT               Port,
-    IN PUCHAR               HostName,
-    IN PUCHAR               FileName,
-    IN PLARGE_INTEGER       Offset,
-    IN ULONG                Length,
-    OUT PIO_STATUS_BLOCK    IoStatus,
-    OUT PVOID               SystemBuffer
-    )
-{
-    struct sockaddr_in  toAddr;
-    int                 status, nSent, nRecv;
-    unsigned int        dataLen;
-    char                *buffer, *pData;
-
-    ASSERT(Socket != NULL);
-    ASSERT(HostName != NULL);
-    ASSERT(FileName != NULL);
-    ASSERT(Offset != NULL);
-    ASSERT(IoStatus != NULL);
-    ASSERT(SystemBuffer != NULL);
-
-    IoStatus->Information = 0;
-
-    buffer = HttpDiskPalloc(BUFFER_SIZE + 1);
-
-    if (buffer == NULL)
-    {
-        IoStatus->Status = STATUS_INSUFFICIENT_RESOURCES;
-        return IoStatus->Status;
-    }
-
-    // Example request:
-    //  GET 'FileName' HTTP/1.1
-    //  Host: 'HostName'
-    //  Range: bytes='Offset'-'Offset + Length - 1'
-    //  Accept: */*
-    //  User-Agent: HttpDisk/1.2
-    //
-    // Interesting lines in answer:
-    //  HTTP/1.1 206 Partial content
-    //  Content-Length: 'requested size'
-    //  Content-Range: bytes 'start'-'end'/'total file size'
-    //  Data follows after '\r\n\r\n'
-
-    _snprintf(
-        buffer,
-        BUFFER_SIZE,
-        "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%I64u-%I64u\r\nAccept: */*\r\nUser-Agent: HttpDisk/1.2\r\n\r\n",
-        FileName,
-        HostName,
-        Offset->QuadPart,
-        Offset->QuadPart + Length - 1
-        );
-
-    if (*Socket < 0)
-    {
-        *Socket = socket(AF_INET, SOCK_STREAM, 0);
-
-        if (*Socket < 0)
-        {
-            ExFreePool(buffer);
-            *Socket = -1;
-            IoStatus->Status = STATUS_INSUFFICIENT_RESOURCES;
-            return IoStatus->Status;
-        }
-
-        toAddr.sin_family = AF_INET;
-        toAddr.sin_port = Port;
-        toAddr.sin_addr.s_addr = Address;
-
-        status = connect(*Socket, (struct sockaddr*) &toAddr, sizeof(toAddr));
-
-        if (status < 0)
-        {
-            DbgPrint("HttpDisk: connect() error: %#x\n", status);
-            ExFreePool(buffer);
-            close(*Socket);
-            *Socket = -1;
-            IoStatus->Status = status;
-            return IoStatus->Status;
-        }
-    }
-
-    nSent = send(*Socket, buffer, strlen(buffer), 0);
-
-    if (nSent < 0)
-    {
-        KdPrint(("HttpDisk: send() error: %#x\n", nSent));
-
-        close(*Socket);
-
-        *Socket = socket(AF_INET, SOCK_STREAM, 0);
-
-        if (*Socket < 0)
-        {
-            ExFreePool(buffer);
-            *Socket = -1;
-            IoStatus->Status = STATUS_INSUFFICIENT_RESOURCES;
-            return IoStatus->Status;
-        }
-
-        toAddr.sin_family = AF_INET;
-        toAddr.sin_port = Port;
-        toAddr.sin_addr.s_addr = Address;
-
-        status = connect(*Socket, (struct sockaddr*) &toAddr, sizeof(toAddr));
-
-        if (status < 0)
-        {
-            DbgPrint("HttpDisk: connect() error: %#x\n", status);
-            ExFreePool(buffer);
-            close(*Socket);
-            *Socket = -1;
-            IoStatus->Status = status;
-            return IoStatus->Status;
-        }
-
-        nSent = send(*Socket, buffer, strlen(buffer), 0);
-
-        if (nSent < 0)
-        {
-            DbgPrint("HttpDisk: send() error: %#x\n", nSent);
-            ExFreePool(buffer);
-            close(*Socket);
-            *Socket = -1;
-            IoStatus->Status = nSent;
-            return IoStatus->Status;
-        }
-    }
+  }
 
-    nRecv = recv(*Socket, buffer, BUFFER_SIZE, 0);
+static NTSTATUS HttpdiskRangeStatus_(IN HTTPRANGE_E_STATUS status) {
+    switch (status) {
+        case HttpRangeStatusSuccess:
+          return STATUS_SUCCESS;
 
-    if (nRecv < 0)
-    {
-        KdPrint(("HttpDisk: recv() error: %#x\n", nRecv));
+        case HttpRangeStatusNoMemory:
+          return STATUS_INSUFFICIENT_RESOURCES;
 
-        close(*Socket);
+        case HttpRangeStatusInvalid:
+          return STATUS_INVALID_PARAMETER;
 
-        *Socket = socket(AF_INET, SOCK_STREAM, 0);
+        case HttpRangeStatusConnect:
+          return STATUS_CONNECTION_REFUSED;
 
-        if (*Socket < 0)
-        {
-            ExFreePool(buffer);
-            *Socket = -1;
-            IoStatus->Status = STATUS_INSUFFICIENT_RESOURCES;
-            return IoStatus->Status;
-        }
+        case HttpRangeStatusSend:
+        case HttpRangeStatusRecv:
+          return STATUS_UNEXPECTED_NETWORK_ERROR;
 
-        toAddr.sin_family = AF_INET;
-        toAddr.sin_port = Port;
-        toAddr.sin_addr.s_addr = Address;
+        case HttpRangeStatusBadResponse:
+          return STATUS_UNSUCCESSFUL;
 
-        status = connect(*Socket, (struct sockaddr*) &toAddr, sizeof(toAddr));
+        default:
+          break;
+      }
+    return STATUS_DRIVER_INTERNAL_ERROR;
+  }
 
-        if (status < 0)
-        {
-            DbgPrint("HttpDisk: connect() error: %#x\n", status);
-            ExFreePool(buffer);
-            close(*Socket);
-            *Socket = -1;
-            IoStatus->Status = status;
-            return IoStatus->Status;
-        }
+/** The range-request engine's transport, over ksocket */
 
-        nSent = send(*Socket, buffer, strlen(buffer), 0);
+/* A send or receive which the transport has posted and waits for */
+typedef struct HTTPDISK_TRANSFER_ {
+    KEVENT Done;
+    NTSTATUS Status;
+    ULONG_PTR Information;
+  } HTTPDISK_S_TRANSFER_;
 
-        if (nSent < 0)
-        {
-            DbgPrint("HttpDisk: send() error: %#x\n", nSent);
-            ExFreePool(buffer);
-            close(*Socket);
-            *Socket = -1;
-            IoStatus->Status = nSent;
-            return IoStatus->Status;
-        }
+static void HttpdiskTransportDone_(
+    void * context,
+    NTSTATUS status,
+    ULONG_PTR information
+  ) {
+    HTTPDISK_S_TRANSFER_ * transfer = context;
 
-        nRecv = recv(*Socket, buffer, BUFFER_SIZE, 0);
+    transfer->Status = status;
+    transfer->Information = information;
+    KeSetEvent(&transfer->Done, 0, FALSE);
+  }
 
-        if (nRecv < 0)
-        {
-            DbgPrint("HttpDisk: recv() error: %#x\n", nRecv);
-            ExFreePool(buffer);
-            close(*Socket);
-            *Socket = -1;
-            IoStatus->Status = nRecv;
-            return IoStatus->Status;
-        }
-    }
+/*
+ * Post a send or receive straight from or into the engine's buffer,
+ * and wait for it.  Returns the bytes transferred, or -1
+ */
+static int HttpdiskTransportPost_(
+    int connection,
+    char * buf,
+    int len,
+    BOOLEAN send
+  ) {
+    HTTPDISK_S_TRANSFER_ transfer;
+    PMDL mdl;
+    int result;
+
+    if (len <= 0)
+      return -1;
+    mdl = IoAllocateMdl(buf, len, FALSE, FALSE, NULL);
+    if (!mdl)
+      return -1;
+    __try {
+        MmProbeAndLockPages(
+            mdl,
+            KernelMode,
+            send ? IoReadAccess : IoWriteAccess
+          );
+      } __except (EXCEPTION_EXECUTE_HANDLER) {
+        IoFreeMdl(mdl);
+        return -1;
+      }
 
-    buffer[BUFFER_SIZE] = '\0';
+    KeInitializeEvent(&transfer.Done, NotificationEvent, FALSE);
+    if (send)
+      result = send_async(
+          connection,
+          mdl,
+          len,
+          0,
+          HttpdiskTransportDone_,
+          &transfer
+        );
+      else
+      result = recv_async(
+          connection,
+          mdl,
+          len,
+          0,
+          HttpdiskTransportDone_,
+          &transfer
+        );
+    if (!result) {
+        KeWaitForSingleObject(
+            &transfer.Done,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL
+          );
+        result = NT_SUCCESS(transfer.Status) ?
+          (int) transfer.Information :
+          -1;
+      }
 
-    if (_strnicmp(buffer, "HTTP/1.1 206 Partial Content", 28))
-    {
-        DbgPrint("HttpDisk: Invalid HTTP response:\n%s", buffer);
-        ExFreePool(buffer);
-        close(*Socket);
-        *Socket = -1;
-        IoStatus->Status = STATUS_UNSUCCESSFUL;
-        return IoStatus->Status;
-    }
+    MmUnlockPages(mdl);
+    IoFreeMdl(mdl);
+    return result;
+  }
 
-    pData = strstr(buffer, "\r\n\r\n") + 4;
+static int HttpdiskTransportConnect_(
+    void * context,
+    unsigned long address,
+    unsigned short port
+  ) {
+    struct sockaddr_in to_addr;
+    int sock;
+    int status;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        DbgPrint("HttpDisk: socket() error: %#x\n", sock);
+        return -1;
+      }
 
-    if (pData == NULL || pData < buffer || pData >= buffer + BUFFER_SIZE)
-    {
-        DbgPrint("HttpDisk: Invalid HTTP response:\n%s", buffer);
-        ExFreePool(buffer);
-        close(*Socket);
-        *Socket = -1;
-        IoStatus->Status = STATUS_UNSUCCESSFUL;
-        return IoStatus->Status;
-    }
+    to_addr.sin_family = AF_INET;
+    to_addr.sin_port = port;
+    to_addr.sin_addr.s_addr = address;
+    status = connect(sock, (struct sockaddr *) &to_addr, sizeof to_addr);
+    if (status < 0) {
+        DbgPrint("HttpDisk: connect() error: %#x\n", status);
+        close(sock);
+        return -1;
+      }
+    return sock;
+  }
 
-    dataLen = nRecv - (pData - buffer);
+static int HttpdiskTransportSend_(
+    void * context,
+    int connection,
+    const char * buf,
+    int len
+  ) {
+    return HttpdiskTransportPost_(connection, (char *) buf, len, TRUE);
+  }
 
-    if (dataLen > Length || pData + dataLen > buffer + BUFFER_SIZE)
-    {
-        DbgPrint("HttpDisk: Invalid data length %u in HTTP response:\n%s", dataLen, buffer);
-        ExFreePool(buffer);
-        close(*Socket);
-        *Socket = -1;
-        IoStatus->Status = STATUS_UNSUCCESSFUL;
-        return IoStatus->Status;
-    }
+static int HttpdiskTransportRecv_(
+    void * context,
+    int connection,
+    char * buf,
+    int len
+  ) {
+    return HttpdiskTransportPost_(connection, buf, len, FALSE);
+  }
 
-    if (dataLen > 0)
-    {
-        RtlCopyMemory(
-            SystemBuffer,
-            pData,
-            dataLen
-            );
-    }
+static void HttpdiskTransportClose_(void * context, int connection) {
+    close(connection);
+  }
 
-    while (dataLen < Length)
-    {
-        nRecv = recv(*Socket, buffer, BUFFER_SIZE, 0);
-        if (nRecv < 0)
-        {
-            DbgPrint("HttpDisk: recv() error: %#x\n", nRecv);
-            close(*Socket);
-            *Socket = -1;
-            break;
-        }
-        if (nRecv < 1 || dataLen + nRecv > Length || nRecv > BUFFER_SIZE)
-        {
-            DbgPrint("HttpDisk: Invalid data length %u+%u\n", dataLen, nRecv);
-            close(*Socket);
-            *Socket = -1;
-            break;
-        }
-        RtlCopyMemory(
-            (PVOID)((PUCHAR) SystemBuffer + dataLen),
-            buffer,
-            nRecv
-        );
-        dataLen += nRecv;
-    }
+static void * HttpdiskTransportMalloc_(void * context, unsigned long size) {
+    return HttpDiskMalloc(size);
+  }
 
-    if (dataLen != Length)
-    {
-        DbgPrint("HttpDisk: received data length: %u, expected data length: %u\n", dataLen, Length);
-    }
+static void HttpdiskTransportFree_(void * context, void * ptr) {
+    ExFreePool(ptr);
+  }
 
-    ExFreePool(buffer);
-    IoStatus->Status = STATUS_SUCCESS;
-    IoStatus->Information = dataLen;
-    return IoStatus->Status;
-}
+static const HTTPRANGE_S_TRANSPORT HttpdiskTransport_ = {
+    HttpdiskTransportConnect_,
+    HttpdiskTransportSend_,
+    HttpdiskTransportRecv_,
+    HttpdiskTransportClose_,
+    HttpdiskTransportMalloc_,
+    HttpdiskTransportFree_,
+    NULL
+  };
@@ -0,0 +1,531 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * HTTP range-request engine.
+ */
+
+#include "httprange.h"
+
+/** Macros */
+
+/* The most digits of a Content-Length which can't overflow 64 bits */
+#define HTTPRANGE_M_MAX_LENGTH_DIGITS 19
+
+/** Private function declarations */
+static int HttpRangeAppend_(char *, unsigned int, unsigned int *, const char *);
+static int HttpRangeAppendU64_(
+    char *,
+    unsigned int,
+    unsigned int *,
+    unsigned long long
+  );
+static int HttpRangeMatch_(const char *, const char *, const char *);
+static const char * HttpRangeFind_(const char *, const char *, const char *);
+static HTTPRANGE_E_STATUS HttpRangeSendAll_(HTTPRANGE_SP, int, int);
+static HTTPRANGE_E_STATUS HttpRangeRecvHeader_(
+    HTTPRANGE_SP,
+    int,
+    HTTPRANGE_SP_RESPONSE,
+    unsigned int *
+  );
+static HTTPRANGE_E_STATUS HttpRangeGetOnce_(
+    HTTPRANGE_SP,
+    unsigned long long,
+    unsigned long,
+    char *
+  );
+static HTTPRANGE_E_STATUS HttpRangeGetSizeOnce_(
+    HTTPRANGE_SP,
+    unsigned long long *
+  );
+
+/** Function definitions */
+
+HTTPRANGE_E_STATUS HttpRangeInit(
+    HTTPRANGE_SP engine,
+    const HTTPRANGE_S_TRANSPORT * transport,
+    unsigned long address,
+    unsigned short port,
+    const char * host_name,
+    const char * file_name
+  ) {
+    if (!engine || !transport || !host_name || !file_name)
+      return HttpRangeStatusInvalid;
+
+    engine->Transport = transport;
+    engine->Address = address;
+    engine->Port = port;
+    engine->HostName = host_name;
+    engine->FileName = file_name;
+    engine->Connection = -1;
+    engine->Tries = HTTPRANGE_M_DEFAULT_TRIES;
+    /* One extra byte so the header can always be NUL-terminated */
+    engine->Buffer = transport->Malloc(
+        transport->Context,
+        HTTPRANGE_M_BUFFER_SIZE + 1
+      );
+    if (!engine->Buffer)
+      return HttpRangeStatusNoMemory;
+    return HttpRangeStatusSuccess;
+  }
+
+void HttpRangeCleanup(HTTPRANGE_SP engine) {
+    HttpRangeDisconnect(engine);
+    if (engine->Buffer)
+      engine->Transport->Free(engine->Transport->Context, engine->Buffer);
+    engine->Buffer = 0;
+  }
+
+void HttpRangeDisconnect(HTTPRANGE_SP engine) {
+    if (engine->Connection < 0)
+      return;
+    engine->Transport->Close(engine->Transport->Context, engine->Connection);
+    engine->Connection = -1;
+  }
+
+HTTPRANGE_E_STATUS HttpRangeGetSize(
+    HTTPRANGE_SP engine,
+    unsigned long long * size
+  ) {
+    HTTPRANGE_E_STATUS status = HttpRangeStatusInvalid;
+    unsigned int tries;
+
+    for (tries = engine->Tries; tries; --tries) {
+        status = HttpRangeGetSizeOnce_(engine, size);
+        if (status == HttpRangeStatusSuccess ||
+            status == HttpRangeStatusNoMemory ||
+            status == HttpRangeStatusInvalid)
+          break;
+      }
+    return status;
+  }
+
+HTTPRANGE_E_STATUS HttpRangeGet(
+    HTTPRANGE_SP engine,
+    unsigned long long offset,
+    unsigned long length,
+    void * buffer
+  ) {
+    HTTPRANGE_E_STATUS status = HttpRangeStatusInvalid;
+    unsigned int tries;
+
+    if (!length || !buffer)
+      return HttpRangeStatusInvalid;
+
+    for (tries = engine->Tries; tries; --tries) {
+        status = HttpRangeGetOnce_(engine, offset, length, buffer);
+        if (status == HttpRangeStatusSuccess)
+          break;
+        /*
+         * Whatever went wrong, the connection is in an unknown state.
+         * The most common case is a persistent connection which the
+         * server has timed out, so the next try reconnects.
+         */
+        HttpRangeDisconnect(engine);
+        if (status == HttpRangeStatusNoMemory ||
+            status == HttpRangeStatusInvalid)
+          break;
+      }
+    return status;
+  }
+
+int HttpRangeBuildRequest(
+    char * buf,
+    unsigned int size,
+    const char * method,
+    const char * host_name,
+    const char * file_name,
+    unsigned long long offset,
+    unsigned long length,
+    int keep_alive
+  ) {
+    unsigned int pos = 0;
+    int ok;
+
+    /*
+     * Example request:
+     *   GET 'FileName' HTTP/1.1
+     *   Host: 'HostName'
+     *   Range: bytes='Offset'-'Offset + Length - 1'
+     *   Accept: * / *
+     *   User-Agent: HttpDisk/1.2
+     */
+    ok =
+      HttpRangeAppend_(buf, size, &pos, method) &&
+      HttpRangeAppend_(buf, size, &pos, " ") &&
+      HttpRangeAppend_(buf, size, &pos, file_name) &&
+      HttpRangeAppend_(buf, size, &pos, " HTTP/1.1\r\nHost: ") &&
+      HttpRangeAppend_(buf, size, &pos, host_name) &&
+      HttpRangeAppend_(buf, size, &pos, "\r\n");
+    if (ok && length) {
+        ok =
+          HttpRangeAppend_(buf, size, &pos, "Range: bytes=") &&
+          HttpRangeAppendU64_(buf, size, &pos, offset) &&
+          HttpRangeAppend_(buf, size, &pos, "-") &&
+          HttpRangeAppendU64_(buf, size, &pos, offset + length - 1) &&
+          HttpRangeAppend_(buf, size, &pos, "\r\n");
+      }
+    ok = ok &&
+      HttpRangeAppend_(
+          buf,
+          size,
+          &pos,
+          "Accept: */*\r\nUser-Agent: HttpDisk/1.2\r\n"
+        ) &&
+      (keep_alive || HttpRangeAppend_(buf, size, &pos, "Connection: close\r\n")) &&
+      HttpRangeAppend_(buf, size, &pos, "\r\n");
+    return ok ? (int) pos : -1;
+  }
+
+HTTPRANGE_E_STATUS HttpRangeParseResponse(
+    const char * buf,
+    unsigned int len,
+    HTTPRANGE_SP_RESPONSE response
+  ) {
+    static const char content_length[] = "Content-Length:";
+    static const char connection[] = "Connection:";
+    const char * end = buf + len;
+    const char * line;
+    const char * eol;
+    const char * value;
+    const char * first;
+    unsigned long long digits;
+
+    /* Find the end of the header, first */
+    eol = HttpRangeFind_(buf, end, "\r\n\r\n");
+    if (!eol)
+      return HttpRangeStatusIncomplete;
+    end = eol + 2;
+    response->HeaderLength = (unsigned int) (eol + 4 - buf);
+
+    /* Status line, such as "HTTP/1.1 206 Partial Content" */
+    if (end - buf < 12 || !HttpRangeMatch_(buf, end, "HTTP/1."))
+      return HttpRangeStatusBadResponse;
+    if (buf[8] != ' ' ||
+        buf[9] < '0' || buf[9] > '9' ||
+        buf[10] < '0' || buf[10] > '9' ||
+        buf[11] < '0' || buf[11] > '9')
+      return HttpRangeStatusBadResponse;
+    response->StatusCode =
+      (buf[9] - '0') * 100 + (buf[10] - '0') * 10 + (buf[11] - '0');
+    /* HTTP/1.0 closes by default */
+    response->Close = buf[7] == '0';
+    response->HasContentLength = 0;
+    response->ContentLength = 0;
+
+    /* Header fields */
+    for (line = HttpRangeFind_(buf, end, "\r\n") + 2; line < end; line = eol + 2) {
+        eol = HttpRangeFind_(line, end, "\r\n");
+        if (HttpRangeMatch_(line, eol, content_length)) {
+            value = line + sizeof content_length - 1;
+            while (value < eol && (*value == ' ' || *value == '\t'))
+              ++value;
+            if (value == eol || *value < '0' || *value > '9')
+              return HttpRangeStatusBadResponse;
+            first = value;
+            for (digits = 0; value < eol && *value >= '0' && *value <= '9'; ++value)
+              digits = digits * 10 + (*value - '0');
+            /* Any more and it could overflow */
+            if (value - first > HTTPRANGE_M_MAX_LENGTH_DIGITS)
+              return HttpRangeStatusBadResponse;
+            response->ContentLength = digits;
+            response->HasContentLength = 1;
+          } else if (HttpRangeMatch_(line, eol, connection)) {
+            value = line + sizeof connection - 1;
+            while (value < eol && (*value == ' ' || *value == '\t'))
+              ++value;
+            if (HttpRangeMatch_(value, eol, "close"))
+              response->Close = 1;
+              else if (HttpRangeMatch_(value, eol, "keep-alive"))
+              response->Close = 0;
+          }
+      }
+    return HttpRangeStatusSuccess;
+  }
+
+/**
+ * Append a string to a buffer, keeping it NUL-terminated.
+ *
+ * @ret int             Non-zero upon success, 0 if it didn't fit.
+ */
+static int HttpRangeAppend_(
+    char * buf,
+    unsigned int size,
+    unsigned int * pos,
+    const char * str
+  ) {
+    while (*str) {
+        if (*pos + 1 >= size)
+          return 0;
+        buf[(*pos)++] = *str++;
+      }
+    buf[*pos] = '\0';
+    return 1;
+  }
+
+/** Append a decimal number to a buffer */
+static int HttpRangeAppendU64_(
+    char * buf,
+    unsigned int size,
+    unsigned int * pos,
+    unsigned long long val
+  ) {
+    char digits[21];
+    char * digit = digits + sizeof digits - 1;
+
+    *digit = '\0';
+    do {
+        *--digit = (char) ('0' + val % 10);
+        val /= 10;
+      } while (val);
+    return HttpRangeAppend_(buf, size, pos, digit);
+  }
+
+/**
+ * Case-insensitively check if [str, end) begins with a prefix.
+ *
+ * @ret int             Non-zero for a match.
+ */
+static int HttpRangeMatch_(
+    const char * str,
+    const char * end,
+    const char * prefix
+  ) {
+    char c1, c2;
+
+    for (; *prefix; ++str, ++prefix) {
+        if (str >= end)
+          return 0;
+        c1 = *str;
+        c2 = *prefix;
+        if (c1 >= 'A' && c1 <= 'Z')
+          c1 += 'a' - 'A';
+        if (c2 >= 'A' && c2 <= 'Z')
+          c2 += 'a' - 'A';
+        if (c1 != c2)
+          return 0;
+      }
+    return 1;
+  }
+
+/** Find a string within [str, end), which need not be NUL-terminated */
+static const char * HttpRangeFind_(
+    const char * str,
+    const char * end,
+    const char * needle
+  ) {
+    const char * n;
+    const char * s;
+
+    for (; str < end; ++str) {
+        for (s = str, n = needle; *n && s < end && *s == *n; ++s, ++n)
+          ;
+        if (!*n)
+          return str;
+      }
+    return 0;
+  }
+
+/** Send all of the request in the engine's buffer */
+static HTTPRANGE_E_STATUS HttpRangeSendAll_(
+    HTTPRANGE_SP engine,
+    int connection,
+    int len
+  ) {
+    const char * pos = engine->Buffer;
+    int sent;
+
+    while (len) {
+        sent = engine->Transport->Send(
+            engine->Transport->Context,
+            connection,
+            pos,
+            len
+          );
+        if (sent <= 0)
+          return HttpRangeStatusSend;
+        pos += sent;
+        len -= sent;
+      }
+    return HttpRangeStatusSuccess;
+  }
+
+/**
+ * Receive and parse a response header into the engine's buffer.
+ *
+ * @v received          Populated with how many bytes were received,
+ *                      which may include the start of the body.
+ */
+static HTTPRANGE_E_STATUS HttpRangeRecvHeader_(
+    HTTPRANGE_SP engine,
+    int connection,
+    HTTPRANGE_SP_RESPONSE response,
+    unsigned int * received
+  ) {
+    HTTPRANGE_E_STATUS status;
+    int len;
+
+    *received = 0;
+    do {
+        if (*received == HTTPRANGE_M_BUFFER_SIZE)
+          return HttpRangeStatusBadResponse;
+        len = engine->Transport->Recv(
+            engine->Transport->Context,
+            connection,
+            engine->Buffer + *received,
+            HTTPRANGE_M_BUFFER_SIZE - *received
+          );
+        if (len <= 0)
+          return HttpRangeStatusRecv;
+        *received += len;
+        status = HttpRangeParseResponse(engine->Buffer, *received, response);
+      } while (status == HttpRangeStatusIncomplete);
+    engine->Buffer[*received] = '\0';
+    return status;
+  }
+
+/** Try a single GET over the persistent connection */
+static HTTPRANGE_E_STATUS HttpRangeGetOnce_(
+    HTTPRANGE_SP engine,
+    unsigned long long offset,
+    unsigned long length,
+    char * buffer
+  ) {
+    HTTPRANGE_S_RESPONSE response;
+    HTTPRANGE_E_STATUS status;
+    unsigned int received;
+    unsigned long have;
+    int len;
+
+    if (engine->Connection < 0) {
+        engine->Connection = engine->Transport->Connect(
+            engine->Transport->Context,
+            engine->Address,
+            engine->Port
+          );
+        if (engine->Connection < 0) {
+            engine->Connection = -1;
+            return HttpRangeStatusConnect;
+          }
+      }
+
+    len = HttpRangeBuildRequest(
+        engine->Buffer,
+        HTTPRANGE_M_BUFFER_SIZE,
+        "GET",
+        engine->HostName,
+        engine->FileName,
+        offset,
+        length,
+        1
+      );
+    if (len < 0)
+      return HttpRangeStatusInvalid;
+    status = HttpRangeSendAll_(engine, engine->Connection, len);
+    if (status != HttpRangeStatusSuccess)
+      return status;
+
+    status = HttpRangeRecvHeader_(
+        engine,
+        engine->Connection,
+        &response,
+        &received
+      );
+    if (status != HttpRangeStatusSuccess)
+      return status;
+
+    /* Anything but exactly the requested range is no good to us */
+    if (response.StatusCode != 206 ||
+        !response.HasContentLength ||
+        response.ContentLength != length)
+      return HttpRangeStatusBadResponse;
+
+    /* Part of the body might have arrived along with the header */
+    have = received - response.HeaderLength;
+    if (have > length)
+      return HttpRangeStatusBadResponse;
+    for (len = 0; (unsigned long) len < have; ++len)
+      buffer[len] = engine->Buffer[response.HeaderLength + len];
+
+    /* The rest is received in place */
+    while (have < length) {
+        len = engine->Transport->Recv(
+            engine->Transport->Context,
+            engine->Connection,
+            buffer + have,
+            (int) (length - have)
+          );
+        if (len <= 0)
+          return HttpRangeStatusRecv;
+        have += len;
+      }
+
+    if (response.Close)
+      HttpRangeDisconnect(engine);
+    return HttpRangeStatusSuccess;
+  }
+
+/** Try a single HEAD over a connection of its own */
+static HTTPRANGE_E_STATUS HttpRangeGetSizeOnce_(
+    HTTPRANGE_SP engine,
+    unsigned long long * size
+  ) {
+    HTTPRANGE_S_RESPONSE response;
+    HTTPRANGE_E_STATUS status;
+    unsigned int received;
+    int connection;
+    int len;
+
+    len = HttpRangeBuildRequest(
+        engine->Buffer,
+        HTTPRANGE_M_BUFFER_SIZE,
+        "HEAD",
+        engine->HostName,
+        engine->FileName,
+        0,
+        0,
+        0
+      );
+    if (len < 0)
+      return HttpRangeStatusInvalid;
+
+    connection = engine->Transport->Connect(
+        engine->Transport->Context,
+        engine->Address,
+        engine->Port
+      );
+    if (connection < 0)
+      return HttpRangeStatusConnect;
+
+    status = HttpRangeSendAll_(engine, connection, len);
+    if (status == HttpRangeStatusSuccess)
+      status = HttpRangeRecvHeader_(engine, connection, &response, &received);
+    engine->Transport->Close(engine->Transport->Context, connection);
+    if (status != HttpRangeStatusSuccess)
+      return status;
+
+    if (response.StatusCode != 200 ||
+        !response.HasContentLength ||
+        !response.ContentLength)
+      return HttpRangeStatusBadResponse;
+
+    *size = response.ContentLength;
+    return HttpRangeStatusSuccess;
+  }
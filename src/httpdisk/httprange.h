@@ -0,0 +1,214 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HTTPRANGE_M_H_
+#  define HTTPRANGE_M_H_
+
+/**
+ * @file
+ *
+ * HTTP range-request engine.
+ *
+ * Request building, response parsing, persistent connection handling
+ * and retries for fetching byte ranges of a remote image.  This code
+ * includes no OS headers and does all of its networking and memory
+ * management through an HTTPRANGE_S_TRANSPORT, so it builds unchanged
+ * in the kernel (over ksocket) and in user-land (over BSD sockets).
+ */
+
+/** Macros */
+
+/* Size of the buffer used for requests and response headers */
+#define HTTPRANGE_M_BUFFER_SIZE (4096 * 4)
+
+/* How many times a request is attempted before giving up */
+#define HTTPRANGE_M_DEFAULT_TRIES 3
+
+/** Object types */
+typedef enum HTTPRANGE_STATUS HTTPRANGE_E_STATUS;
+typedef struct HTTPRANGE_TRANSPORT HTTPRANGE_S_TRANSPORT;
+typedef struct HTTPRANGE_RESPONSE
+  HTTPRANGE_S_RESPONSE, * HTTPRANGE_SP_RESPONSE;
+typedef struct HTTPRANGE HTTPRANGE_S, * HTTPRANGE_SP;
+
+/** Enumerations */
+enum HTTPRANGE_STATUS {
+    HttpRangeStatusSuccess,
+    HttpRangeStatusNoMemory,
+    HttpRangeStatusInvalid,
+    HttpRangeStatusConnect,
+    HttpRangeStatusSend,
+    HttpRangeStatusRecv,
+    HttpRangeStatusIncomplete,
+    HttpRangeStatusBadResponse,
+    HttpRangeStatuses
+  };
+
+/** Struct/union type definitions */
+
+/**
+ * The operations the engine needs from its environment.
+ *
+ * Connection handles are non-negative.  Send and Recv return the
+ * number of bytes transferred, 0 for a closed connection (Recv only)
+ * or a negative value upon error.
+ */
+struct HTTPRANGE_TRANSPORT {
+    int (*Connect)(void * Context, unsigned long Address, unsigned short Port);
+    int (*Send)(void * Context, int Connection, const char * Buf, int Len);
+    int (*Recv)(void * Context, int Connection, char * Buf, int Len);
+    void (*Close)(void * Context, int Connection);
+    void * (*Malloc)(void * Context, unsigned long Size);
+    void (*Free)(void * Context, void * Ptr);
+    void * Context;
+  };
+
+/** A parsed response header */
+struct HTTPRANGE_RESPONSE {
+    int StatusCode;
+    int HasContentLength;
+    unsigned long long ContentLength;
+    /** The length of the header, including the terminating blank line */
+    unsigned int HeaderLength;
+    /** Whether the server will close the connection after this response */
+    int Close;
+  };
+
+/** A range-request engine for one remote file */
+struct HTTPRANGE {
+    const HTTPRANGE_S_TRANSPORT * Transport;
+    /** Address and port in network byte order */
+    unsigned long Address;
+    unsigned short Port;
+    const char * HostName;
+    const char * FileName;
+    /** The persistent connection, or -1 */
+    int Connection;
+    unsigned int Tries;
+    char * Buffer;
+  };
+
+/** Function declarations */
+
+/**
+ * Initialize an engine.
+ *
+ * @v Engine            The engine to initialize.
+ * @v Transport         The transport to use.  Must outlive the engine.
+ * @v Address           The server's IPv4 address, in network byte order.
+ * @v Port              The server's TCP port, in network byte order.
+ * @v HostName          The value for the Host: header.
+ * @v FileName          The path of the file on the server.
+ * @ret HTTPRANGE_E_STATUS
+ *
+ * The host and file names are not copied and must outlive the engine.
+ */
+extern HTTPRANGE_E_STATUS HttpRangeInit(
+    HTTPRANGE_SP,
+    const HTTPRANGE_S_TRANSPORT *,
+    unsigned long,
+    unsigned short,
+    const char *,
+    const char *
+  );
+
+/**
+ * Close any connection and release an engine's resources.
+ *
+ * @v Engine            The engine to clean up.
+ */
+extern void HttpRangeCleanup(HTTPRANGE_SP);
+
+/**
+ * Close the persistent connection, if any.
+ *
+ * @v Engine            The engine whose connection should be dropped.
+ */
+extern void HttpRangeDisconnect(HTTPRANGE_SP);
+
+/**
+ * Fetch the size of the remote file with a HEAD request.
+ *
+ * @v Engine            The engine to use.
+ * @v Size              Populated with the file's size.
+ * @ret HTTPRANGE_E_STATUS
+ */
+extern HTTPRANGE_E_STATUS HttpRangeGetSize(
+    HTTPRANGE_SP,
+    unsigned long long *
+  );
+
+/**
+ * Fetch a byte range of the remote file.
+ *
+ * @v Engine            The engine to use.
+ * @v Offset            The offset of the first byte to fetch.
+ * @v Length            The number of bytes to fetch.
+ * @v Buffer            Receives exactly Length bytes upon success.
+ * @ret HTTPRANGE_E_STATUS
+ *
+ * The body is received straight into Buffer; only the part of it which
+ * arrives together with the response header is copied.
+ */
+extern HTTPRANGE_E_STATUS HttpRangeGet(
+    HTTPRANGE_SP,
+    unsigned long long,
+    unsigned long,
+    void *
+  );
+
+/**
+ * Build a request.
+ *
+ * @v Buf               The buffer to build the request in.
+ * @v Size              The size of the buffer.
+ * @v Method            "GET" or "HEAD".
+ * @v HostName          The value for the Host: header.
+ * @v FileName          The path of the file on the server.
+ * @v Offset            The first byte of the range.
+ * @v Length            The length of the range, or 0 for no Range: header.
+ * @v KeepAlive         Non-zero to ask for a persistent connection.
+ * @ret int             The length of the request, or -1 if it didn't fit.
+ */
+extern int HttpRangeBuildRequest(
+    char *,
+    unsigned int,
+    const char *,
+    const char *,
+    const char *,
+    unsigned long long,
+    unsigned long,
+    int
+  );
+
+/**
+ * Parse a response header.
+ *
+ * @v Buf               The received bytes.
+ * @v Len               The number of received bytes.
+ * @v Response          Populated with the parsed header.
+ * @ret HTTPRANGE_E_STATUS
+ *
+ * Returns HttpRangeStatusIncomplete if the blank line ending the
+ * header has not yet been received.
+ */
+extern HTTPRANGE_E_STATUS HttpRangeParseResponse(
+    const char *,
+    unsigned int,
+    HTTPRANGE_SP_RESPONSE
+  );
+
+#endif  /* HTTPRANGE_M_H_ */
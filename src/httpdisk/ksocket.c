@@ -358,6 +358,30 @@ int __cdecl recv(int socket, char *buf, int len, int flags)
     }
 }
 
+int __cdecl recv_async(int socket, PMDL mdl, int len, int flags, ksocket_completion completion, void *context)
+{
+    PSOCKET s = (PSOCKET) -socket;
+
+    if (s->type != SOCK_STREAM || !s->isConnected || len < 0 || completion == NULL)
+    {
+        return -1;
+    }
+
+    if (tdi_recv_stream_async(
+        s->streamSocket->connectionFileObject,
+        mdl,
+        len,
+        flags == MSG_OOB ? TDI_RECEIVE_EXPEDITED : TDI_RECEIVE_NORMAL,
+        completion,
+        context
+        ) != STATUS_PENDING)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
 int __cdecl recvfrom(int socket, char *buf, int len, int flags, struct sockaddr *addr, int *addrlen)
 {
     PSOCKET s = (PSOCKET) -socket;
@@ -432,6 +456,30 @@ int __cdecl send(int socket, const char *buf, int len, int flags)
     }
 }
 
+int __cdecl send_async(int socket, PMDL mdl, int len, int flags, ksocket_completion completion, void *context)
+{
+    PSOCKET s = (PSOCKET) -socket;
+
+    if (s->type != SOCK_STREAM || !s->isConnected || len < 0 || completion == NULL)
+    {
+        return -1;
+    }
+
+    if (tdi_send_stream_async(
+        s->streamSocket->connectionFileObject,
+        mdl,
+        len,
+        flags == MSG_OOB ? TDI_SEND_EXPEDITED : 0,
+        completion,
+        context
+        ) != STATUS_PENDING)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
 int __cdecl sendto(int socket, const char *buf, int len, int flags, const struct sockaddr *addr, int addrlen)
 {
     PSOCKET s = (PSOCKET) -socket;
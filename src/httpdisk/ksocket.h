@@ -139,6 +139,21 @@ int __cdecl setsockopt(int socket, int level, int optname, const char *optval, i
 int __cdecl shutdown(int socket, int how);
 int __cdecl socket(int af, int type, int protocol);
 
+//
+// Asynchronous extensions for stream sockets.
+//
+// send_async() and recv_async() transfer directly from or into a locked
+// MDL owned by the caller, without an intermediate copy.  They return 0
+// once the request is in flight, after which the completion is called
+// exactly once with the status and byte count, possibly at DISPATCH_LEVEL.
+// They return -1 if the request could not be issued, and the completion
+// is then not called.
+//
+typedef void (*ksocket_completion)(void *context, NTSTATUS status, ULONG_PTR information);
+
+int __cdecl send_async(int socket, PMDL mdl, int len, int flags, ksocket_completion completion, void *context);
+int __cdecl recv_async(int socket, PMDL mdl, int len, int flags, ksocket_completion completion, void *context);
+
 #if defined(__cplusplus)
 }
 #endif
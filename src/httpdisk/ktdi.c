@@ -22,6 +22,11 @@
 extern PVOID HttpDiskMalloc(SIZE_T);
 extern PVOID HttpDiskPalloc(SIZE_T);
 
+typedef struct _TDI_ASYNC_CONTEXT {
+    PTDI_ASYNC_COMPLETION   completion;
+    PVOID                   context;
+} TDI_ASYNC_CONTEXT, *PTDI_ASYNC_CONTEXT;
+
 NTSTATUS tdi_open_transport_address(PUNICODE_STRING devName, ULONG addr, USHORT port, BOOLEAN shared, PHANDLE addressHandle, PFILE_OBJECT *addressFileObject)
 {
     OBJECT_ATTRIBUTES           attr;
@@ -779,3 +784,73 @@ NTSTATUS tdi_query_address(PFILE_OBJECT addressFileObject, PULONG addr, PUSHORT
 
     return status;
 }
+
+static NTSTATUS tdi_async_complete(PDEVICE_OBJECT devObj, PIRP irp, PVOID context)
+{
+    PTDI_ASYNC_CONTEXT asyncContext = (PTDI_ASYNC_CONTEXT) context;
+
+    asyncContext->completion(asyncContext->context, irp->IoStatus.Status, irp->IoStatus.Information);
+
+    ExFreePool(asyncContext);
+
+    // The MDL belongs to the caller, so keep the I/O manager away from it.
+    irp->MdlAddress = NULL;
+
+    IoFreeIrp(irp);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+static NTSTATUS tdi_stream_async(PFILE_OBJECT connectionFileObject, BOOLEAN send, PMDL mdl, ULONG len, ULONG flags, PTDI_ASYNC_COMPLETION completion, PVOID context)
+{
+    PDEVICE_OBJECT      devObj;
+    PTDI_ASYNC_CONTEXT  asyncContext;
+    PIRP                irp;
+
+    ASSERT(completion != NULL);
+
+    devObj = IoGetRelatedDeviceObject(connectionFileObject);
+
+    asyncContext = HttpDiskMalloc(sizeof *asyncContext);
+
+    if (asyncContext == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    asyncContext->completion = completion;
+    asyncContext->context = context;
+
+    // Not associated with this thread, so the IRP may outlive the caller.
+    irp = IoAllocateIrp(devObj->StackSize, FALSE);
+
+    if (irp == NULL)
+    {
+        ExFreePool(asyncContext);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (send)
+    {
+        TdiBuildSend(irp, devObj, connectionFileObject, tdi_async_complete, asyncContext, len ? mdl : 0, flags, len);
+    }
+    else
+    {
+        TdiBuildReceive(irp, devObj, connectionFileObject, tdi_async_complete, asyncContext, len ? mdl : 0, flags, len);
+    }
+
+    // Whatever the transport says, the completion routine reports it.
+    IoCallDriver(devObj, irp);
+
+    return STATUS_PENDING;
+}
+
+NTSTATUS tdi_send_stream_async(PFILE_OBJECT connectionFileObject, PMDL mdl, ULONG len, ULONG flags, PTDI_ASYNC_COMPLETION completion, PVOID context)
+{
+    return tdi_stream_async(connectionFileObject, TRUE, mdl, len, flags, completion, context);
+}
+
+NTSTATUS tdi_recv_stream_async(PFILE_OBJECT connectionFileObject, PMDL mdl, ULONG len, ULONG flags, PTDI_ASYNC_COMPLETION completion, PVOID context)
+{
+    return tdi_stream_async(connectionFileObject, FALSE, mdl, len, flags, completion, context);
+}
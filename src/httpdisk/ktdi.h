@@ -27,3 +27,15 @@ NTSTATUS tdi_recv_dgram(PFILE_OBJECT addressFileObject, PULONG addr, PUSHORT por
 NTSTATUS tdi_send_stream(PFILE_OBJECT connectionFileObject, const char *buf, int len, ULONG flags);
 NTSTATUS tdi_recv_stream(PFILE_OBJECT connectionFileObject, char *buf, int len, ULONG flags);
 NTSTATUS tdi_query_address(PFILE_OBJECT addressFileObject, PULONG addr, PUSHORT port);
+
+//
+// Asynchronous stream I/O.  The caller supplies a locked MDL, which stays
+// owned by the caller, and a completion callback.  If the call returns
+// STATUS_PENDING the callback is called exactly once, possibly before the
+// call returns and possibly at DISPATCH_LEVEL.  Any other return value
+// means the request was never issued and the callback will not be called.
+//
+typedef VOID (*PTDI_ASYNC_COMPLETION)(PVOID context, NTSTATUS status, ULONG_PTR information);
+
+NTSTATUS tdi_send_stream_async(PFILE_OBJECT connectionFileObject, PMDL mdl, ULONG len, ULONG flags, PTDI_ASYNC_COMPLETION completion, PVOID context);
+NTSTATUS tdi_recv_stream_async(PFILE_OBJECT connectionFileObject, PMDL mdl, ULONG len, ULONG flags, PTDI_ASYNC_COMPLETION completion, PVOID context);
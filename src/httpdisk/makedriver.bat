@@ -1,6 +1,6 @@
 @echo off
 
-set c=ksocket.c ktdi.c httpdisk.c bus.c httpdisk.rc
+set c=ksocket.c ktdi.c httpdisk.c bus.c overlay.c httprange.c mirror.c cimgread.c ..\lz4\lz4.c httpdisk.rc
 
 set name=WvHTTP%bits%
 
@@ -0,0 +1,495 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * HTTPDisk mirror selection.
+ *
+ * All mirror operations are performed from the HTTPDisk's thread,
+ * so no locking is required.
+ */
+
+#include <ntddk.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "bus.h"
+#include "disk.h"
+#include "httpdisk.h"
+#include "debug.h"
+#include "httprange.h"
+#include "mirror.h"
+
+/** From httpdisk.c */
+extern PVOID HttpDiskMalloc(SIZE_T);
+
+/** Private function declarations */
+static NTSTATUS STDCALL HttpdiskMirrorInit_(
+    IN HTTPDISK_SP_MIRROR,
+    IN const HTTPRANGE_S_TRANSPORT *,
+    IN ULONG,
+    IN USHORT,
+    IN PUCHAR,
+    IN USHORT,
+    IN PUCHAR,
+    IN USHORT
+  );
+static HTTPDISK_SP_MIRROR STDCALL HttpdiskMirrorPick_(
+    IN HTTPDISK_SP_MIRRORS,
+    IN ULONG,
+    IN ULONG,
+    IN ULONGLONG
+  );
+static ULONGLONG STDCALL HttpdiskMirrorCost_(IN HTTPDISK_SP_MIRROR, IN ULONG);
+static ULONGLONG STDCALL HttpdiskMirrorRandom_(IN HTTPDISK_SP_MIRRORS);
+static VOID STDCALL HttpdiskMirrorSucceeded_(
+    IN HTTPDISK_SP_MIRROR,
+    IN ULONG,
+    IN LONGLONG
+  );
+static VOID STDCALL HttpdiskMirrorFailed_(IN HTTPDISK_SP_MIRROR, IN ULONGLONG);
+
+/** Function definitions */
+
+NTSTATUS STDCALL HttpdiskMirrorsCreate(
+    OUT HTTPDISK_SP_MIRRORS * mirrors_ptr,
+    IN const HTTPRANGE_S_TRANSPORT * transport,
+    IN PHTTP_DISK_INFORMATION info,
+    OUT PULONGLONG size
+  ) {
+    HTTPDISK_SP_MIRRORS mirrors;
+    HTTPDISK_SP_MIRROR mirror;
+    PHTTP_DISK_MIRROR extra;
+    ULONG count;
+    ULONG i;
+    ULONGLONG start;
+    ULONGLONG mirror_size;
+    BOOLEAN have_size;
+    HTTPRANGE_E_STATUS range_status;
+    NTSTATUS status;
+
+    ASSERT(mirrors_ptr);
+    ASSERT(info);
+    ASSERT(size);
+
+    if (info->MirrorCount > HTTP_DISK_MAX_MIRRORS) {
+        DBG("Too many mirrors: %u\n", info->MirrorCount);
+        status = STATUS_INVALID_PARAMETER;
+        goto err_count;
+      }
+    for (i = 0; i < info->MirrorCount; ++i) {
+        extra = info->Mirrors + i;
+        if (
+            extra->HostNameLength >= sizeof extra->HostName ||
+            extra->FileNameLength >= sizeof extra->FileName ||
+            !extra->FileNameLength
+          ) {
+            DBG("Invalid mirror %u!\n", i);
+            status = STATUS_INVALID_PARAMETER;
+            goto err_count;
+          }
+      }
+    count = 1 + info->MirrorCount;
+
+    mirrors = HttpDiskMalloc(
+        FIELD_OFFSET(HTTPDISK_S_MIRRORS, Mirror) +
+        sizeof mirrors->Mirror[0] * count
+      );
+    if (!mirrors) {
+        DBG("Couldn't allocate mirrors!\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_mirrors;
+      }
+    RtlZeroMemory(
+        mirrors,
+        FIELD_OFFSET(HTTPDISK_S_MIRRORS, Mirror) +
+        sizeof mirrors->Mirror[0] * count
+      );
+    /* Any non-zero seed will do */
+    mirrors->Seed = (ULONG) KeQueryInterruptTime() | 1;
+
+    /* The primary mirror comes from the original fields */
+    status = HttpdiskMirrorInit_(
+        mirrors->Mirror,
+        transport,
+        info->Address,
+        info->Port,
+        info->HostName,
+        info->HostNameLength,
+        info->FileName,
+        info->FileNameLength
+      );
+    if (!NT_SUCCESS(status))
+      goto err_init;
+    mirrors->Count = 1;
+
+    for (i = 0; i < info->MirrorCount; ++i) {
+        extra = info->Mirrors + i;
+        status = HttpdiskMirrorInit_(
+            mirrors->Mirror + mirrors->Count,
+            transport,
+            extra->Address,
+            extra->Port,
+            extra->HostName,
+            extra->HostNameLength,
+            extra->FileName,
+            extra->FileNameLength
+          );
+        if (!NT_SUCCESS(status))
+          goto err_init;
+        ++mirrors->Count;
+      }
+
+    /* With somewhere to fail over to, give up on a mirror sooner */
+    if (mirrors->Count > 1) {
+        for (i = 0; i < mirrors->Count; ++i)
+          mirrors->Mirror[i].Range.Tries = HTTPDISK_M_MIRROR_TRIES;
+      }
+
+    /* Fetch the size from each mirror, which also seeds its latency */
+    have_size = FALSE;
+    for (i = 0; i < mirrors->Count; ++i) {
+        mirror = mirrors->Mirror + i;
+        start = KeQueryInterruptTime();
+        range_status = HttpRangeGetSize(&mirror->Range, &mirror_size);
+        if (range_status != HttpRangeStatusSuccess) {
+            DBG(
+                "Mirror %s%s unavailable: %d\n",
+                mirror->HostName,
+                mirror->FileName,
+                range_status
+              );
+            HttpdiskMirrorFailed_(mirror, KeQueryInterruptTime());
+            continue;
+          }
+        mirror->Latency = (LONGLONG) (KeQueryInterruptTime() - start);
+
+        if (!have_size) {
+            *size = mirror_size;
+            have_size = TRUE;
+          }
+        if (mirror_size != *size) {
+            DBG(
+                "Mirror %s%s size %I64u doesn't match %I64u!\n",
+                mirror->HostName,
+                mirror->FileName,
+                mirror_size,
+                *size
+              );
+            mirror->Usable = FALSE;
+          }
+      }
+    if (!have_size) {
+        DBG("No mirror reported a size!\n");
+        status = STATUS_NO_SUCH_FILE;
+        goto err_size;
+      }
+
+    *mirrors_ptr = mirrors;
+    return STATUS_SUCCESS;
+
+    err_size:
+
+    err_init:
+
+    HttpdiskMirrorsFree(mirrors);
+    err_mirrors:
+
+    err_count:
+
+    return status;
+  }
+
+VOID STDCALL HttpdiskMirrorsFree(IN HTTPDISK_SP_MIRRORS mirrors) {
+    HTTPDISK_SP_MIRROR mirror;
+    ULONG i;
+
+    if (!mirrors)
+      return;
+
+    for (i = 0; i < mirrors->Count; ++i) {
+        mirror = mirrors->Mirror + i;
+        DBG(
+            "Mirror %s%s: %I64u requests, %I64u bytes\n",
+            mirror->HostName,
+            mirror->FileName,
+            mirror->Requests,
+            mirror->Bytes
+          );
+        HttpRangeCleanup(&mirror->Range);
+        ExFreePool(mirror->FileName);
+        ExFreePool(mirror->HostName);
+      }
+    ExFreePool(mirrors);
+    return;
+  }
+
+HTTPRANGE_E_STATUS STDCALL HttpdiskMirrorsGet(
+    IN HTTPDISK_SP_MIRRORS mirrors,
+    IN LONGLONG offset,
+    IN ULONG length,
+    OUT PVOID buffer
+  ) {
+    HTTPDISK_SP_MIRROR mirror;
+    ULONG tried;
+    ULONGLONG start;
+    ULONGLONG end;
+    HTTPRANGE_E_STATUS status;
+
+    ASSERT(mirrors);
+
+    status = HttpRangeStatusConnect;
+    tried = 0;
+    while (mirror = HttpdiskMirrorPick_(
+        mirrors,
+        tried,
+        length,
+        KeQueryInterruptTime()
+      )) {
+        tried |= 1 << (mirror - mirrors->Mirror);
+
+        start = KeQueryInterruptTime();
+        status = HttpRangeGet(&mirror->Range, offset, length, buffer);
+        end = KeQueryInterruptTime();
+        if (status == HttpRangeStatusSuccess) {
+            HttpdiskMirrorSucceeded_(mirror, length, (LONGLONG) (end - start));
+            return status;
+          }
+
+        DBG(
+            "Mirror %s%s failed: %d\n",
+            mirror->HostName,
+            mirror->FileName,
+            status
+          );
+        HttpdiskMirrorFailed_(mirror, end);
+
+        /* Another mirror won't cure these */
+        if (
+            status == HttpRangeStatusNoMemory ||
+            status == HttpRangeStatusInvalid
+          )
+          break;
+      }
+    return status;
+  }
+
+static NTSTATUS STDCALL HttpdiskMirrorInit_(
+    IN HTTPDISK_SP_MIRROR mirror,
+    IN const HTTPRANGE_S_TRANSPORT * transport,
+    IN ULONG address,
+    IN USHORT port,
+    IN PUCHAR host_name,
+    IN USHORT host_name_len,
+    IN PUCHAR file_name,
+    IN USHORT file_name_len
+  ) {
+    HTTPRANGE_E_STATUS range_status;
+    NTSTATUS status;
+
+    mirror->HostName = HttpDiskMalloc(host_name_len + 1);
+    if (!mirror->HostName) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_host_name;
+      }
+    RtlCopyMemory(mirror->HostName, host_name, host_name_len);
+    mirror->HostName[host_name_len] = '\0';
+
+    mirror->FileName = HttpDiskMalloc(file_name_len + 1);
+    if (!mirror->FileName) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_file_name;
+      }
+    RtlCopyMemory(mirror->FileName, file_name, file_name_len);
+    mirror->FileName[file_name_len] = '\0';
+
+    range_status = HttpRangeInit(
+        &mirror->Range,
+        transport,
+        address,
+        port,
+        (const char *) mirror->HostName,
+        (const char *) mirror->FileName
+      );
+    if (range_status != HttpRangeStatusSuccess) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_range;
+      }
+
+    mirror->Usable = TRUE;
+    return STATUS_SUCCESS;
+
+    err_range:
+
+    ExFreePool(mirror->FileName);
+    err_file_name:
+
+    ExFreePool(mirror->HostName);
+    err_host_name:
+
+    DBG("Couldn't initialize mirror!\n");
+    return status;
+  }
+
+/**
+ * Choose a mirror for a request.
+ *
+ * @v mirrors           The mirror set to choose from.
+ * @v tried             Bitmap of mirrors already tried for this request.
+ * @v length            The length of the request.
+ * @v now               The current interrupt time.
+ * @ret HTTPDISK_SP_MIRROR      The mirror to use, or NULL if none is left.
+ *
+ * Mirrors which are backed off are only chosen when there is nothing
+ * else, so that a disk whose only mirror hiccupped keeps working.
+ */
+static HTTPDISK_SP_MIRROR STDCALL HttpdiskMirrorPick_(
+    IN HTTPDISK_SP_MIRRORS mirrors,
+    IN ULONG tried,
+    IN ULONG length,
+    IN ULONGLONG now
+  ) {
+    ULONGLONG weights[1 + HTTP_DISK_MAX_MIRRORS];
+    ULONGLONG weight;
+    ULONGLONG total;
+    ULONGLONG pick;
+    HTTPDISK_SP_MIRROR mirror;
+    HTTPDISK_SP_MIRROR fallback;
+    ULONG i;
+
+    total = 0;
+    fallback = NULL;
+    for (i = 0; i < mirrors->Count; ++i) {
+        mirror = mirrors->Mirror + i;
+        weights[i] = 0;
+        if (!mirror->Usable || tried & (1 << i))
+          continue;
+
+        if (mirror->RetryAfter > now) {
+            if (!fallback || mirror->RetryAfter < fallback->RetryAfter)
+              fallback = mirror;
+            continue;
+          }
+
+        /*
+         * Squaring the inverse cost sends nearly all requests to the
+         * fastest mirrors, while the others still get the odd request
+         * which keeps their measurements fresh.
+         */
+        weight = HTTPDISK_M_MIRROR_WEIGHT_SCALE /
+          HttpdiskMirrorCost_(mirror, length);
+        if (!weight)
+          weight = 1;
+        weights[i] = weight * weight;
+        total += weights[i];
+      }
+    if (!total)
+      return fallback;
+
+    pick = HttpdiskMirrorRandom_(mirrors) % total;
+    for (i = 0; pick >= weights[i]; ++i)
+      pick -= weights[i];
+    return mirrors->Mirror + i;
+  }
+
+/* The expected time for a mirror to complete a request, in 100 ns units */
+static ULONGLONG STDCALL HttpdiskMirrorCost_(
+    IN HTTPDISK_SP_MIRROR mirror,
+    IN ULONG length
+  ) {
+    ULONGLONG throughput;
+    ULONGLONG cost;
+
+    throughput = mirror->Throughput ?
+      mirror->Throughput :
+      HTTPDISK_M_MIRROR_DEFAULT_THROUGHPUT;
+    cost = mirror->Latency + (ULONGLONG) length * 10000000 / throughput;
+    return cost ? cost : 1;
+  }
+
+/* xorshift32, twice over */
+static ULONGLONG STDCALL HttpdiskMirrorRandom_(IN HTTPDISK_SP_MIRRORS mirrors) {
+    ULONGLONG result;
+    int i;
+
+    result = 0;
+    for (i = 0; i < 2; ++i) {
+        mirrors->Seed ^= mirrors->Seed << 13;
+        mirrors->Seed ^= mirrors->Seed >> 17;
+        mirrors->Seed ^= mirrors->Seed << 5;
+        result = result << 32 | mirrors->Seed;
+      }
+    return result;
+  }
+
+static VOID STDCALL HttpdiskMirrorSucceeded_(
+    IN HTTPDISK_SP_MIRROR mirror,
+    IN ULONG length,
+    IN LONGLONG elapsed
+  ) {
+    LONGLONG transfer;
+    LONGLONG sample;
+
+    mirror->Failures = 0;
+    mirror->RetryAfter = 0;
+    ++mirror->Requests;
+    mirror->Bytes += length;
+
+    /* Small requests are all latency; large ones tell us throughput */
+    if (length <= HTTPDISK_M_MIRROR_SMALL_IO) {
+        if (mirror->Latency)
+          mirror->Latency += (elapsed - mirror->Latency) / 8;
+          else
+          mirror->Latency = elapsed;
+        return;
+      }
+
+    transfer = elapsed - mirror->Latency;
+    if (transfer < elapsed / 2)
+      transfer = elapsed / 2;
+    if (transfer < 1)
+      transfer = 1;
+    sample = (LONGLONG) length * 10000000 / transfer;
+    if (mirror->Throughput)
+      mirror->Throughput += (sample - mirror->Throughput) / 8;
+      else
+      mirror->Throughput = sample;
+    return;
+  }
+
+static VOID STDCALL HttpdiskMirrorFailed_(
+    IN HTTPDISK_SP_MIRROR mirror,
+    IN ULONGLONG now
+  ) {
+    ULONGLONG backoff;
+
+    /* Don't trust the connection after an error */
+    HttpRangeDisconnect(&mirror->Range);
+
+    backoff = HTTPDISK_M_MIRROR_BACKOFF_MIN;
+    if (mirror->Failures < 8)
+      backoff <<= mirror->Failures;
+      else
+      backoff = HTTPDISK_M_MIRROR_BACKOFF_MAX;
+    if (backoff > HTTPDISK_M_MIRROR_BACKOFF_MAX)
+      backoff = HTTPDISK_M_MIRROR_BACKOFF_MAX;
+
+    ++mirror->Failures;
+    mirror->RetryAfter = now + backoff;
+    return;
+  }
@@ -0,0 +1,131 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HTTPDISK_M_MIRROR_H_
+#  define HTTPDISK_M_MIRROR_H_
+
+/**
+ * @file
+ *
+ * HTTPDisk mirror selection.
+ *
+ * An HTTPDisk may be served by several mirrors of the same image.  Each
+ * request goes to one mirror, chosen at random with a bias towards the
+ * mirrors which are expected to complete it soonest, judging by their
+ * measured latency and throughput.  A mirror which fails is backed off
+ * for an exponentially growing period and the request is retried on
+ * another mirror.
+ */
+
+/** Macros */
+
+/* How many times each mirror's engine tries a request, when failover is possible */
+#define HTTPDISK_M_MIRROR_TRIES 2
+
+/* Requests up to this size are taken as latency samples */
+#define HTTPDISK_M_MIRROR_SMALL_IO (16 * 1024)
+
+/* Assumed throughput, in bytes per second, until one has been measured */
+#define HTTPDISK_M_MIRROR_DEFAULT_THROUGHPUT (10 * 1024 * 1024)
+
+/* Back-off after the first failure and the cap, in 100 ns units */
+#define HTTPDISK_M_MIRROR_BACKOFF_MIN (10 * 1000 * 1000)
+#define HTTPDISK_M_MIRROR_BACKOFF_MAX (60 * HTTPDISK_M_MIRROR_BACKOFF_MIN)
+
+/* Scale for turning an expected cost into a selection weight */
+#define HTTPDISK_M_MIRROR_WEIGHT_SCALE (1 << 24)
+
+/** Object types */
+typedef struct HTTPDISK_MIRROR HTTPDISK_S_MIRROR, * HTTPDISK_SP_MIRROR;
+typedef struct HTTPDISK_MIRRORS HTTPDISK_S_MIRRORS, * HTTPDISK_SP_MIRRORS;
+
+/** Struct/union type definitions */
+
+/** One mirror of the image */
+struct HTTPDISK_MIRROR {
+    HTTPRANGE_S Range;
+    PUCHAR HostName;
+    PUCHAR FileName;
+
+    /** FALSE if the mirror's image size didn't match */
+    BOOLEAN Usable;
+
+    /** Moving averages: 100 ns units and bytes per second */
+    LONGLONG Latency;
+    LONGLONG Throughput;
+
+    /** Consecutive failures, and when the mirror may be used again */
+    ULONG Failures;
+    ULONGLONG RetryAfter;
+
+    /** Statistics, for debugging */
+    ULONGLONG Requests;
+    ULONGLONG Bytes;
+  };
+
+/** The set of mirrors for one HTTPDisk */
+struct HTTPDISK_MIRRORS {
+    ULONG Count;
+    ULONG Seed;
+    HTTPDISK_S_MIRROR Mirror[1];
+  };
+
+/** Function declarations */
+
+/**
+ * Create the mirror set for a disk.
+ *
+ * @v Mirrors           Points to the mirror set pointer to populate.
+ * @v Transport         The transport for the mirrors' range engines.
+ * @v Info              The primary and any additional mirrors.
+ * @v Size              Populated with the image's size.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * The first mirror to report a size determines the image's size.  A
+ * mirror reporting a different size is never used.  A mirror which
+ * cannot be reached at all starts out backed off.
+ */
+extern NTSTATUS STDCALL HttpdiskMirrorsCreate(
+    OUT HTTPDISK_SP_MIRRORS *,
+    IN const HTTPRANGE_S_TRANSPORT *,
+    IN PHTTP_DISK_INFORMATION,
+    OUT PULONGLONG
+  );
+
+/**
+ * Free a mirror set.
+ *
+ * @v Mirrors           The mirror set to free.  May be NULL.
+ */
+extern VOID STDCALL HttpdiskMirrorsFree(IN HTTPDISK_SP_MIRRORS);
+
+/**
+ * Read a byte range from the best available mirror.
+ *
+ * @v Mirrors           The mirror set to read from.
+ * @v Offset            The offset of the first byte to read.
+ * @v Length            The number of bytes to read.
+ * @v Buffer            Receives exactly Length bytes upon success.
+ * @ret HTTPRANGE_E_STATUS      The status from the last mirror tried.
+ */
+extern HTTPRANGE_E_STATUS STDCALL HttpdiskMirrorsGet(
+    IN HTTPDISK_SP_MIRRORS,
+    IN LONGLONG,
+    IN ULONG,
+    OUT PVOID
+  );
+
+#endif  /* HTTPDISK_M_MIRROR_H_ */
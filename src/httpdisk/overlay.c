@@ -0,0 +1,566 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * HTTPDisk copy-on-write overlay.
+ *
+ * All overlay operations are performed from the HTTPDisk's thread,
+ * so no locking is required.
+ */
+
+#include <ntddk.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "debug.h"
+#include "overlay.h"
+
+/** From httpdisk.c */
+extern PVOID HttpDiskMalloc(SIZE_T);
+
+/** Private function declarations */
+static BOOLEAN STDCALL HttpdiskOverlayInRange_(
+    IN HTTPDISK_SP_OVERLAY,
+    IN LONGLONG,
+    IN UINT32
+  );
+static NTSTATUS STDCALL HttpdiskOverlayGetChunk_(
+    IN HTTPDISK_SP_OVERLAY,
+    IN ULONGLONG,
+    IN BOOLEAN,
+    OUT HTTPDISK_SP_OVERLAY_CHUNK *
+  );
+static NTSTATUS STDCALL HttpdiskOverlayChunkIo_(
+    IN HTTPDISK_SP_OVERLAY,
+    IN HTTPDISK_SP_OVERLAY_CHUNK,
+    IN BOOLEAN,
+    IN UINT32,
+    IN UINT32,
+    IN OUT PUCHAR
+  );
+
+/** Function definitions */
+
+NTSTATUS STDCALL HttpdiskOverlayCreate(
+    OUT HTTPDISK_SP_OVERLAY * overlay_ptr,
+    IN ULONGLONG disk_size,
+    IN UINT32 sector_size,
+    IN ULONG max_mb,
+    IN PWCHAR file_name
+  ) {
+    HTTPDISK_SP_OVERLAY overlay;
+    ULONGLONG ram_max;
+    NTSTATUS status;
+
+    ASSERT(overlay_ptr);
+
+    if (
+        sector_size < HTTPDISK_M_OVERLAY_MIN_SECTOR ||
+        HTTPDISK_M_OVERLAY_CHUNK_SIZE % sector_size
+      ) {
+        DBG("Unsupported sector size %u!\n", sector_size);
+        status = STATUS_INVALID_PARAMETER;
+        goto err_sector_size;
+      }
+
+    overlay = HttpDiskMalloc(sizeof *overlay);
+    if (!overlay) {
+        DBG("Couldn't allocate overlay!\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_overlay;
+      }
+    RtlZeroMemory(overlay, sizeof *overlay);
+
+    overlay->SectorSize = sector_size;
+    overlay->SectorsPerChunk = HTTPDISK_M_OVERLAY_CHUNK_SIZE / sector_size;
+    overlay->SectorCount = disk_size / sector_size;
+    overlay->ChunkCount =
+      (disk_size + HTTPDISK_M_OVERLAY_CHUNK_SIZE - 1) /
+      HTTPDISK_M_OVERLAY_CHUNK_SIZE;
+    overlay->TableCount = (ULONG) (
+        (overlay->ChunkCount + HTTPDISK_M_OVERLAY_TABLE_ENTRIES - 1) /
+        HTTPDISK_M_OVERLAY_TABLE_ENTRIES
+      );
+
+    /* Clamp the RAM cap to what SIZE_T can express. */
+    ram_max = max_mb ? max_mb : HTTPDISK_M_OVERLAY_DEFAULT_MAX_MB;
+    ram_max *= 1024 * 1024;
+    overlay->RamMax = (ram_max > (SIZE_T) -1) ? (SIZE_T) -1 : (SIZE_T) ram_max;
+
+    /* Only the first-level table is allocated up-front. */
+    overlay->Tables = HttpDiskMalloc(
+        sizeof *overlay->Tables * overlay->TableCount
+      );
+    if (!overlay->Tables) {
+        DBG("Couldn't allocate overlay tables!\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_tables;
+      }
+    RtlZeroMemory(
+        overlay->Tables,
+        sizeof *overlay->Tables * overlay->TableCount
+      );
+
+    if (file_name && *file_name) {
+        UNICODE_STRING path;
+        OBJECT_ATTRIBUTES obj_attrs;
+        IO_STATUS_BLOCK io_status;
+
+        RtlInitUnicodeString(&path, file_name);
+        InitializeObjectAttributes(
+            &obj_attrs,
+            &path,
+            OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+            NULL,
+            NULL
+          );
+        status = ZwCreateFile(
+            &overlay->File,
+            GENERIC_READ | GENERIC_WRITE | DELETE,
+            &obj_attrs,
+            &io_status,
+            NULL,
+            FILE_ATTRIBUTE_TEMPORARY,
+            0,
+            FILE_OVERWRITE_IF,
+            FILE_NON_DIRECTORY_FILE |
+              FILE_RANDOM_ACCESS |
+              FILE_SYNCHRONOUS_IO_NONALERT |
+              FILE_DELETE_ON_CLOSE,
+            NULL,
+            0
+          );
+        if (!NT_SUCCESS(status)) {
+            DBG("Couldn't create overlay delta file: 0x%08X\n", status);
+            overlay->File = NULL;
+            goto err_file;
+          }
+      }
+
+    DBG(
+        "Overlay %p: %I64u chunks, RAM cap %u KiB, delta file: %s\n",
+        (PVOID) overlay,
+        overlay->ChunkCount,
+        (UINT32) (overlay->RamMax / 1024),
+        overlay->File ? "yes" : "no"
+      );
+    *overlay_ptr = overlay;
+    return STATUS_SUCCESS;
+
+    err_file:
+
+    ExFreePool(overlay->Tables);
+    err_tables:
+
+    ExFreePool(overlay);
+    err_overlay:
+
+    err_sector_size:
+
+    return status;
+  }
+
+VOID STDCALL HttpdiskOverlayFree(IN HTTPDISK_SP_OVERLAY overlay) {
+    ULONG i, j;
+    HTTPDISK_SP_OVERLAY_CHUNK * table;
+    HTTPDISK_SP_OVERLAY_CHUNK chunk;
+
+    if (!overlay)
+      return;
+
+    for (i = 0; i < overlay->TableCount; ++i) {
+        table = overlay->Tables[i];
+        if (!table)
+          continue;
+        for (j = 0; j < HTTPDISK_M_OVERLAY_TABLE_ENTRIES; ++j) {
+            chunk = table[j];
+            if (!chunk)
+              continue;
+            if (chunk->Data)
+              ExFreePool(chunk->Data);
+            ExFreePool(chunk);
+          }
+        ExFreePool(table);
+      }
+    ExFreePool(overlay->Tables);
+
+    /* The delta file was opened for deletion on close. */
+    if (overlay->File)
+      ZwClose(overlay->File);
+
+    DBG(
+        "Overlay %p freed, %u KiB RAM, %I64d bytes of delta file\n",
+        (PVOID) overlay,
+        (UINT32) (overlay->RamUsed / 1024),
+        overlay->FileUsed
+      );
+    ExFreePool(overlay);
+    return;
+  }
+
+/**
+ * Find, and optionally create, an overlay chunk.
+ *
+ * @v overlay           The overlay to search.
+ * @v index             The index of the chunk.
+ * @v create            Whether or not to create a missing chunk.
+ * @v chunk_ptr         Populated with the chunk, or with NULL if it is
+ *                      missing and was not created.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * A new chunk is placed in RAM if the cap allows, else in the delta
+ * file.  STATUS_DISK_FULL is returned if neither has room.
+ */
+static NTSTATUS STDCALL HttpdiskOverlayGetChunk_(
+    IN HTTPDISK_SP_OVERLAY overlay,
+    IN ULONGLONG index,
+    IN BOOLEAN create,
+    OUT HTTPDISK_SP_OVERLAY_CHUNK * chunk_ptr
+  ) {
+    HTTPDISK_SP_OVERLAY_CHUNK * table;
+    HTTPDISK_SP_OVERLAY_CHUNK chunk;
+    ULONG table_index;
+    ULONG entry;
+
+    *chunk_ptr = NULL;
+    if (index >= overlay->ChunkCount)
+      return STATUS_INVALID_PARAMETER;
+    table_index = (ULONG) (index / HTTPDISK_M_OVERLAY_TABLE_ENTRIES);
+    entry = (ULONG) (index % HTTPDISK_M_OVERLAY_TABLE_ENTRIES);
+
+    table = overlay->Tables[table_index];
+    if (!table) {
+        if (!create)
+          return STATUS_SUCCESS;
+        table = HttpDiskMalloc(
+            sizeof *table * HTTPDISK_M_OVERLAY_TABLE_ENTRIES
+          );
+        if (!table)
+          return STATUS_INSUFFICIENT_RESOURCES;
+        RtlZeroMemory(table, sizeof *table * HTTPDISK_M_OVERLAY_TABLE_ENTRIES);
+        overlay->Tables[table_index] = table;
+      }
+
+    chunk = table[entry];
+    if (chunk || !create) {
+        *chunk_ptr = chunk;
+        return STATUS_SUCCESS;
+      }
+
+    chunk = HttpDiskMalloc(sizeof *chunk);
+    if (!chunk)
+      return STATUS_INSUFFICIENT_RESOURCES;
+    RtlZeroMemory(chunk, sizeof *chunk);
+
+    if (overlay->RamMax - overlay->RamUsed >= HTTPDISK_M_OVERLAY_CHUNK_SIZE) {
+        chunk->Data = HttpDiskMalloc(HTTPDISK_M_OVERLAY_CHUNK_SIZE);
+        if (chunk->Data)
+          overlay->RamUsed += HTTPDISK_M_OVERLAY_CHUNK_SIZE;
+      }
+    if (!chunk->Data) {
+        if (!overlay->File) {
+            DBG("Overlay %p is full!\n", (PVOID) overlay);
+            ExFreePool(chunk);
+            return STATUS_DISK_FULL;
+          }
+        chunk->FileOffset.QuadPart = overlay->FileUsed;
+        overlay->FileUsed += HTTPDISK_M_OVERLAY_CHUNK_SIZE;
+      }
+
+    table[entry] = chunk;
+    *chunk_ptr = chunk;
+    return STATUS_SUCCESS;
+  }
+
+/**
+ * Check that a range of sectors lies within the disk.
+ *
+ * @v overlay           The overlay for the disk.
+ * @v start_sector      The first sector of the range.
+ * @v sector_count      The number of sectors in the range.
+ * @ret BOOLEAN         TRUE if the whole range is on the disk.
+ */
+static BOOLEAN STDCALL HttpdiskOverlayInRange_(
+    IN HTTPDISK_SP_OVERLAY overlay,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count
+  ) {
+    if (start_sector < 0 || (ULONGLONG) start_sector > overlay->SectorCount)
+      return FALSE;
+    return sector_count <= overlay->SectorCount - start_sector;
+  }
+
+/**
+ * Transfer a run of sectors to or from an overlay chunk.
+ *
+ * @v overlay           The overlay owning the chunk.
+ * @v chunk             The chunk to transfer with.
+ * @v write             TRUE to write into the chunk, FALSE to read.
+ * @v first             The first sector, relative to the chunk.
+ * @v count             The number of sectors.
+ * @v buffer            The buffer to transfer with.
+ * @ret NTSTATUS        The status of the operation.
+ */
+static NTSTATUS STDCALL HttpdiskOverlayChunkIo_(
+    IN HTTPDISK_SP_OVERLAY overlay,
+    IN HTTPDISK_SP_OVERLAY_CHUNK chunk,
+    IN BOOLEAN write,
+    IN UINT32 first,
+    IN UINT32 count,
+    IN OUT PUCHAR buffer
+  ) {
+    ULONG offset = first * overlay->SectorSize;
+    ULONG length = count * overlay->SectorSize;
+    LARGE_INTEGER file_offset;
+    IO_STATUS_BLOCK io_status;
+    NTSTATUS status;
+
+    if (chunk->Data) {
+        if (write)
+          RtlCopyMemory(chunk->Data + offset, buffer, length);
+          else
+          RtlCopyMemory(buffer, chunk->Data + offset, length);
+        return STATUS_SUCCESS;
+      }
+
+    file_offset.QuadPart = chunk->FileOffset.QuadPart + offset;
+    if (write) {
+        status = ZwWriteFile(
+            overlay->File,
+            NULL,
+            NULL,
+            NULL,
+            &io_status,
+            buffer,
+            length,
+            &file_offset,
+            NULL
+          );
+      } else {
+        status = ZwReadFile(
+            overlay->File,
+            NULL,
+            NULL,
+            NULL,
+            &io_status,
+            buffer,
+            length,
+            &file_offset,
+            NULL
+          );
+      }
+    if (!NT_SUCCESS(status))
+      DBG("Overlay delta file I/O failed: 0x%08X\n", status);
+    return status;
+  }
+
+BOOLEAN STDCALL HttpdiskOverlayCovers(
+    IN HTTPDISK_SP_OVERLAY overlay,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count
+  ) {
+    HTTPDISK_SP_OVERLAY_CHUNK chunk;
+    RTL_BITMAP bitmap;
+    UINT32 first, count;
+
+    if (!HttpdiskOverlayInRange_(overlay, start_sector, sector_count))
+      return FALSE;
+    while (sector_count) {
+        first = (UINT32) (start_sector % overlay->SectorsPerChunk);
+        count = overlay->SectorsPerChunk - first;
+        if (count > sector_count)
+          count = sector_count;
+
+        HttpdiskOverlayGetChunk_(
+            overlay,
+            start_sector / overlay->SectorsPerChunk,
+            FALSE,
+            &chunk
+          );
+        if (!chunk)
+          return FALSE;
+        RtlInitializeBitMap(&bitmap, chunk->Bitmap, overlay->SectorsPerChunk);
+        if (!RtlAreBitsSet(&bitmap, first, count))
+          return FALSE;
+
+        start_sector += count;
+        sector_count -= count;
+      }
+    return TRUE;
+  }
+
+NTSTATUS STDCALL HttpdiskOverlayRead(
+    IN HTTPDISK_SP_OVERLAY overlay,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count,
+    IN OUT PUCHAR buffer
+  ) {
+    HTTPDISK_SP_OVERLAY_CHUNK chunk;
+    RTL_BITMAP bitmap;
+    UINT32 first, count, i, run;
+    NTSTATUS status;
+
+    if (!HttpdiskOverlayInRange_(overlay, start_sector, sector_count))
+      return STATUS_INVALID_PARAMETER;
+    while (sector_count) {
+        first = (UINT32) (start_sector % overlay->SectorsPerChunk);
+        count = overlay->SectorsPerChunk - first;
+        if (count > sector_count)
+          count = sector_count;
+
+        HttpdiskOverlayGetChunk_(
+            overlay,
+            start_sector / overlay->SectorsPerChunk,
+            FALSE,
+            &chunk
+          );
+        if (chunk) {
+            RtlInitializeBitMap(
+                &bitmap,
+                chunk->Bitmap,
+                overlay->SectorsPerChunk
+              );
+            /* Copy each run of present sectors over the base data. */
+            i = first;
+            while (i < first + count) {
+                if (!RtlCheckBit(&bitmap, i)) {
+                    ++i;
+                    continue;
+                  }
+                run = i;
+                while (i < first + count && RtlCheckBit(&bitmap, i))
+                  ++i;
+                status = HttpdiskOverlayChunkIo_(
+                    overlay,
+                    chunk,
+                    FALSE,
+                    run,
+                    i - run,
+                    buffer + (run - first) * overlay->SectorSize
+                  );
+                if (!NT_SUCCESS(status))
+                  return status;
+              }
+          }
+
+        buffer += count * overlay->SectorSize;
+        start_sector += count;
+        sector_count -= count;
+      }
+    return STATUS_SUCCESS;
+  }
+
+NTSTATUS STDCALL HttpdiskOverlayWrite(
+    IN HTTPDISK_SP_OVERLAY overlay,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count,
+    IN PUCHAR buffer
+  ) {
+    HTTPDISK_SP_OVERLAY_CHUNK chunk;
+    RTL_BITMAP bitmap;
+    UINT32 first, count;
+    NTSTATUS status;
+
+    if (!HttpdiskOverlayInRange_(overlay, start_sector, sector_count))
+      return STATUS_INVALID_PARAMETER;
+    while (sector_count) {
+        first = (UINT32) (start_sector % overlay->SectorsPerChunk);
+        count = overlay->SectorsPerChunk - first;
+        if (count > sector_count)
+          count = sector_count;
+
+        status = HttpdiskOverlayGetChunk_(
+            overlay,
+            start_sector / overlay->SectorsPerChunk,
+            TRUE,
+            &chunk
+          );
+        if (!NT_SUCCESS(status))
+          return status;
+
+        status = HttpdiskOverlayChunkIo_(
+            overlay,
+            chunk,
+            TRUE,
+            first,
+            count,
+            buffer
+          );
+        if (!NT_SUCCESS(status))
+          return status;
+
+        /* Only mark the sectors once their data is safely stored. */
+        RtlInitializeBitMap(&bitmap, chunk->Bitmap, overlay->SectorsPerChunk);
+        RtlSetBits(&bitmap, first, count);
+
+        buffer += count * overlay->SectorSize;
+        start_sector += count;
+        sector_count -= count;
+      }
+    return STATUS_SUCCESS;
+  }
+
+VOID STDCALL HttpdiskOverlayDrop(
+    IN HTTPDISK_SP_OVERLAY overlay,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count
+  ) {
+    HTTPDISK_SP_OVERLAY_CHUNK * table;
+    HTTPDISK_SP_OVERLAY_CHUNK chunk;
+    ULONGLONG index;
+    RTL_BITMAP bitmap;
+    UINT32 first, count;
+
+    if (!HttpdiskOverlayInRange_(overlay, start_sector, sector_count))
+      return;
+    while (sector_count) {
+        first = (UINT32) (start_sector % overlay->SectorsPerChunk);
+        count = overlay->SectorsPerChunk - first;
+        if (count > sector_count)
+          count = sector_count;
+
+        index = start_sector / overlay->SectorsPerChunk;
+        HttpdiskOverlayGetChunk_(overlay, index, FALSE, &chunk);
+        if (chunk) {
+            RtlInitializeBitMap(
+                &bitmap,
+                chunk->Bitmap,
+                overlay->SectorsPerChunk
+              );
+            RtlClearBits(&bitmap, first, count);
+
+            /* Give an empty RAM chunk back to the cap. */
+            if (
+                chunk->Data &&
+                RtlAreBitsClear(&bitmap, 0, overlay->SectorsPerChunk)
+              ) {
+                table = overlay->Tables[
+                    index / HTTPDISK_M_OVERLAY_TABLE_ENTRIES
+                  ];
+                table[index % HTTPDISK_M_OVERLAY_TABLE_ENTRIES] = NULL;
+                ExFreePool(chunk->Data);
+                ExFreePool(chunk);
+                overlay->RamUsed -= HTTPDISK_M_OVERLAY_CHUNK_SIZE;
+              }
+          }
+
+        start_sector += count;
+        sector_count -= count;
+      }
+  }
@@ -0,0 +1,190 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HTTPDISK_M_OVERLAY_H_
+#  define HTTPDISK_M_OVERLAY_H_
+
+/**
+ * @file
+ *
+ * HTTPDisk copy-on-write overlay.
+ *
+ * Writes to an HTTPDisk are captured in a local delta store and never
+ * sent to the server.  The delta is kept in fixed-size chunks, which
+ * are allocated on first write and carry a bitmap of which of their
+ * sectors have been written.  Chunks live in non-paged RAM until the
+ * configured cap is reached, after which they spill to an optional
+ * delta file.  Without a delta file, writes beyond the cap fail with
+ * STATUS_DISK_FULL.
+ */
+
+/** Macros */
+
+/* The size of an overlay chunk, in bytes */
+#define HTTPDISK_M_OVERLAY_CHUNK_SIZE (64 * 1024)
+
+/* The smallest sector size we support for the chunk bitmap */
+#define HTTPDISK_M_OVERLAY_MIN_SECTOR 512
+
+/* How many chunk pointers each second-level table holds */
+#define HTTPDISK_M_OVERLAY_TABLE_ENTRIES 1024
+
+/* The default RAM cap, when the caller does not specify one */
+#define HTTPDISK_M_OVERLAY_DEFAULT_MAX_MB 128
+
+/** Object types */
+typedef struct HTTPDISK_OVERLAY_CHUNK
+  HTTPDISK_S_OVERLAY_CHUNK, * HTTPDISK_SP_OVERLAY_CHUNK;
+typedef struct HTTPDISK_OVERLAY HTTPDISK_S_OVERLAY, * HTTPDISK_SP_OVERLAY;
+
+/** Struct/union type definitions */
+
+/** A chunk of overlay data */
+struct HTTPDISK_OVERLAY_CHUNK {
+    /** One bit per sector.  A set bit means the sector is in the overlay */
+    ULONG Bitmap[
+        HTTPDISK_M_OVERLAY_CHUNK_SIZE /
+        HTTPDISK_M_OVERLAY_MIN_SECTOR /
+        (sizeof (ULONG) * 8)
+      ];
+
+    /** RAM-backed chunk data, or NULL for a file-backed chunk */
+    PUCHAR Data;
+
+    /** The byte offset of a file-backed chunk within the delta file */
+    LARGE_INTEGER FileOffset;
+  };
+
+/** The overlay for one HTTPDisk */
+struct HTTPDISK_OVERLAY {
+    UINT32 SectorSize;
+    UINT32 SectorsPerChunk;
+    ULONGLONG SectorCount;
+    ULONGLONG ChunkCount;
+
+    /** First-level table of lazily-allocated chunk pointer tables */
+    ULONG TableCount;
+    HTTPDISK_SP_OVERLAY_CHUNK ** Tables;
+
+    /** RAM usage policy */
+    SIZE_T RamMax;
+    SIZE_T RamUsed;
+
+    /** The optional delta file and how much of it is in use */
+    HANDLE File;
+    LONGLONG FileUsed;
+  };
+
+/** Function declarations */
+
+/**
+ * Create an overlay for a disk.
+ *
+ * @v Overlay           Points to the overlay pointer to populate.
+ * @v DiskSize          The size of the base image, in bytes.
+ * @v SectorSize        The sector size of the disk.
+ * @v MaxMegabytes      RAM cap, in MiB.  0 selects the default.
+ * @v FileName          NT path of a delta file to spill to, or NULL.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * The delta file, if any, is created afresh and deleted when the
+ * overlay is freed, so that every connection starts from the
+ * pristine base image.
+ */
+extern NTSTATUS STDCALL HttpdiskOverlayCreate(
+    OUT HTTPDISK_SP_OVERLAY *,
+    IN ULONGLONG,
+    IN UINT32,
+    IN ULONG,
+    IN PWCHAR
+  );
+
+/**
+ * Free an overlay and discard its delta.
+ *
+ * @v Overlay           The overlay to free.  May be NULL.
+ */
+extern VOID STDCALL HttpdiskOverlayFree(IN HTTPDISK_SP_OVERLAY);
+
+/**
+ * Check if a range of sectors is entirely held in the overlay.
+ *
+ * @v Overlay           The overlay to check.
+ * @v StartSector       The first sector of the range.
+ * @v SectorCount       The number of sectors in the range.
+ * @ret BOOLEAN         TRUE if every sector in the range is present.
+ */
+extern BOOLEAN STDCALL HttpdiskOverlayCovers(
+    IN HTTPDISK_SP_OVERLAY,
+    IN LONGLONG,
+    IN UINT32
+  );
+
+/**
+ * Copy overlay sectors on top of a buffer read from the base image.
+ *
+ * @v Overlay           The overlay to read from.
+ * @v StartSector       The first sector of the range.
+ * @v SectorCount       The number of sectors in the range.
+ * @v Buffer            The buffer to merge into.  Sectors which are
+ *                      absent from the overlay are left untouched.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * A range outside of the disk yields STATUS_INVALID_PARAMETER.
+ */
+extern NTSTATUS STDCALL HttpdiskOverlayRead(
+    IN HTTPDISK_SP_OVERLAY,
+    IN LONGLONG,
+    IN UINT32,
+    IN OUT PUCHAR
+  );
+
+/**
+ * Write sectors to the overlay.
+ *
+ * @v Overlay           The overlay to write to.
+ * @v StartSector       The first sector of the range.
+ * @v SectorCount       The number of sectors in the range.
+ * @v Buffer            The data to write.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * A range outside of the disk yields STATUS_INVALID_PARAMETER.
+ */
+extern NTSTATUS STDCALL HttpdiskOverlayWrite(
+    IN HTTPDISK_SP_OVERLAY,
+    IN LONGLONG,
+    IN UINT32,
+    IN PUCHAR
+  );
+
+/**
+ * Drop sectors from the overlay.
+ *
+ * @v Overlay           The overlay to drop from.
+ * @v StartSector       The first sector of the range.
+ * @v SectorCount       The number of sectors in the range.
+ *
+ * The dropped sectors read back from the base image again.  A RAM
+ * chunk left without any sectors is freed and counts against the cap
+ * no more.  A file-backed chunk keeps its place in the delta file.
+ */
+extern VOID STDCALL HttpdiskOverlayDrop(
+    IN HTTPDISK_SP_OVERLAY,
+    IN LONGLONG,
+    IN UINT32
+  );
+
+#endif  /* HTTPDISK_M_OVERLAY_H_ */
@@ -0,0 +1,370 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * HTTP range test server.
+ *
+ * Serves one file to HEAD and ranged GET requests over persistent
+ * connections, with injectable faults, for exercising the range-request
+ * engine in httprange.c.  It prints the TCP port it listens on to
+ * standard output.  This is a portable, user-land program for POSIX:
+ *
+ *   cc -O2 -o rangesrv rangesrv.c
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define REQUEST_SIZE        (4096 * 4)
+#define CHUNK_SIZE          (64 * 1024)
+
+typedef struct RANGESRV_OPTIONS
+{
+    unsigned int        Latency;
+    unsigned int        Chunk;
+    unsigned int        Requests;
+} RANGESRV_OPTIONS;
+
+int RangeSrvSyntax(void)
+{
+    fprintf(stderr, "syntax:\n");
+    fprintf(stderr, "rangesrv [-p:<port>] [-l:<ms>] [-c:<bytes>] [-k:<n>] <file>\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "-p     sets the TCP port, 0 for any free one (default 0).\n");
+    fprintf(stderr, "-l     delays each response by this many milliseconds.\n");
+    fprintf(stderr, "-c     sends responses in pieces of at most this many bytes.\n");
+    fprintf(stderr, "-k     closes a connection unannounced after this many responses.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "example:\n");
+    fprintf(stderr, "rangesrv -p:8080 -l:2 diskimage.img\n");
+
+    return -1;
+}
+
+static void Sleep(unsigned int Ms)
+{
+    struct timespec Time;
+
+    Time.tv_sec = Ms / 1000;
+    Time.tv_nsec = (long) (Ms % 1000) * 1000000;
+    while (nanosleep(&Time, &Time) && errno == EINTR);
+}
+
+static int SendAll(int Socket, const char* Buf, size_t Len, unsigned int Chunk)
+{
+    ssize_t Sent;
+
+    while (Len)
+    {
+        Sent = send(Socket, Buf, Chunk && Len > Chunk ? Chunk : Len, MSG_NOSIGNAL);
+        if (Sent <= 0)
+        {
+            if (Sent < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        Buf += Sent;
+        Len -= (size_t) Sent;
+    }
+
+    return 0;
+}
+
+/* Case-insensitively find a header field's value within a request */
+static const char* FindField(const char* Request, const char* Name)
+{
+    size_t NameLen = strlen(Name);
+    const char* Line;
+
+    for (Line = strstr(Request, "\r\n"); Line && Line[2] != '\r'; Line = strstr(Line + 2, "\r\n"))
+    {
+        if (!strncasecmp(Line + 2, Name, NameLen))
+        {
+            for (Line += 2 + NameLen; *Line == ' ' || *Line == '\t'; Line++);
+            return Line;
+        }
+    }
+
+    return NULL;
+}
+
+static int Respond(int Socket, int File, unsigned long long Size, char* Request, const RANGESRV_OPTIONS* Options, int* Close)
+{
+    char                Header[512];
+    char*               Body;
+    const char*         Value;
+    unsigned long long  First;
+    unsigned long long  Last;
+    unsigned long long  Pos;
+    size_t              Len;
+    ssize_t             Read;
+    int                 HeaderLen;
+    int                 Head;
+
+    Head = !strncmp(Request, "HEAD ", 5);
+    if (!Head && strncmp(Request, "GET ", 4))
+    {
+        HeaderLen = snprintf(Header, sizeof Header,
+            "HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        *Close = 1;
+        return SendAll(Socket, Header, (size_t) HeaderLen, Options->Chunk);
+    }
+
+    Value = FindField(Request, "Connection:");
+    if (Value && !strncasecmp(Value, "close", 5))
+    {
+        *Close = 1;
+    }
+
+    if (Options->Latency)
+    {
+        Sleep(Options->Latency);
+    }
+
+    Value = FindField(Request, "Range:");
+    if (Head || !Value)
+    {
+        HeaderLen = snprintf(Header, sizeof Header,
+            "HTTP/1.1 200 OK\r\nContent-Length: %llu\r\nAccept-Ranges: bytes\r\n%s\r\n",
+            Size, *Close ? "Connection: close\r\n" : "");
+        if (SendAll(Socket, Header, (size_t) HeaderLen, Options->Chunk))
+        {
+            return -1;
+        }
+        if (Head)
+        {
+            return 0;
+        }
+        First = 0;
+        Last = Size - 1;
+    }
+    else
+    {
+        if (sscanf(Value, "bytes=%llu-%llu", &First, &Last) != 2 || First > Last || Last >= Size)
+        {
+            HeaderLen = snprintf(Header, sizeof Header,
+                "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%llu\r\nContent-Length: 0\r\n%s\r\n",
+                Size, *Close ? "Connection: close\r\n" : "");
+            return SendAll(Socket, Header, (size_t) HeaderLen, Options->Chunk);
+        }
+        HeaderLen = snprintf(Header, sizeof Header,
+            "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %llu-%llu/%llu\r\nContent-Length: %llu\r\n%s\r\n",
+            First, Last, Size, Last - First + 1, *Close ? "Connection: close\r\n" : "");
+        if (SendAll(Socket, Header, (size_t) HeaderLen, Options->Chunk))
+        {
+            return -1;
+        }
+    }
+
+    Body = malloc(CHUNK_SIZE);
+    if (!Body)
+    {
+        return -1;
+    }
+    for (Pos = First; Pos <= Last; Pos += (unsigned long long) Read)
+    {
+        Len = Last - Pos + 1 < CHUNK_SIZE ? (size_t) (Last - Pos + 1) : CHUNK_SIZE;
+        Read = pread(File, Body, Len, (off_t) Pos);
+        if (Read <= 0 || SendAll(Socket, Body, (size_t) Read, Options->Chunk))
+        {
+            free(Body);
+            return -1;
+        }
+    }
+    free(Body);
+
+    return 0;
+}
+
+static void Serve(int Socket, int File, unsigned long long Size, const RANGESRV_OPTIONS* Options)
+{
+    char*               Request;
+    char*               End;
+    size_t              Have = 0;
+    size_t              Used;
+    ssize_t             Len;
+    unsigned int        Responses = 0;
+    int                 Close = 0;
+
+    Request = malloc(REQUEST_SIZE + 1);
+    if (!Request)
+    {
+        return;
+    }
+
+    while (!Close)
+    {
+        /* Pipelined requests might already be in the buffer */
+        Request[Have] = '\0';
+        while (!(End = strstr(Request, "\r\n\r\n")))
+        {
+            if (Have == REQUEST_SIZE)
+            {
+                goto out;
+            }
+            Len = recv(Socket, Request + Have, REQUEST_SIZE - Have, 0);
+            if (Len <= 0)
+            {
+                if (Len < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                goto out;
+            }
+            Have += (size_t) Len;
+            Request[Have] = '\0';
+        }
+
+        if (Options->Requests && Responses == Options->Requests)
+        {
+            /* Behave like a server whose keep-alive timeout has expired */
+            break;
+        }
+
+        if (Respond(Socket, File, Size, Request, Options, &Close))
+        {
+            break;
+        }
+        Responses++;
+
+        Used = (size_t) (End + 4 - Request);
+        memmove(Request, End + 4, Have - Used);
+        Have -= Used;
+    }
+
+out:
+    free(Request);
+}
+
+int main(int argc, char* argv[])
+{
+    RANGESRV_OPTIONS    Options = { 0, 0, 0 };
+    unsigned short      Port = 0;
+    struct sockaddr_in  Address;
+    socklen_t           AddressLen;
+    struct stat         Stat;
+    int                 Listener;
+    int                 Socket;
+    int                 File;
+    int                 One = 1;
+    int                 i;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+        if (!strncmp(argv[i], "-p:", 3))
+        {
+            Port = (unsigned short) atoi(argv[i] + 3);
+        }
+        else if (!strncmp(argv[i], "-l:", 3))
+        {
+            Options.Latency = (unsigned int) atoi(argv[i] + 3);
+        }
+        else if (!strncmp(argv[i], "-c:", 3))
+        {
+            Options.Chunk = (unsigned int) atoi(argv[i] + 3);
+        }
+        else if (!strncmp(argv[i], "-k:", 3))
+        {
+            Options.Requests = (unsigned int) atoi(argv[i] + 3);
+        }
+        else
+        {
+            return RangeSrvSyntax();
+        }
+    }
+
+    if (argc - i != 1)
+    {
+        return RangeSrvSyntax();
+    }
+
+    File = open(argv[i], O_RDONLY);
+    if (File < 0 || fstat(File, &Stat))
+    {
+        perror(argv[i]);
+        return -1;
+    }
+
+    Listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (Listener < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(Listener, SOL_SOCKET, SO_REUSEADDR, &One, sizeof One);
+
+    memset(&Address, 0, sizeof Address);
+    Address.sin_family = AF_INET;
+    Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    Address.sin_port = htons(Port);
+    AddressLen = sizeof Address;
+    if (bind(Listener, (struct sockaddr*) &Address, sizeof Address) ||
+        listen(Listener, 16) ||
+        getsockname(Listener, (struct sockaddr*) &Address, &AddressLen))
+    {
+        perror("bind");
+        return -1;
+    }
+
+    printf("%u\n", ntohs(Address.sin_port));
+    fflush(stdout);
+
+    /* One process per connection; nobody waits for them */
+    signal(SIGCHLD, SIG_IGN);
+    for (;;)
+    {
+        Socket = accept(Listener, NULL, NULL);
+        if (Socket < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("accept");
+            return -1;
+        }
+        setsockopt(Socket, IPPROTO_TCP, TCP_NODELAY, &One, sizeof One);
+
+        if (!fork())
+        {
+            close(Listener);
+            Serve(Socket, File, (unsigned long long) Stat.st_size, &Options);
+            close(Socket);
+            _exit(0);
+        }
+        close(Socket);
+    }
+}
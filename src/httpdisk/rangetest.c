@@ -0,0 +1,552 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * HTTP range-request engine tests and benchmark.
+ *
+ * Runs the engine in httprange.c over a BSD socket transport against
+ * rangesrv, checking every byte it fetches, or measures its throughput
+ * with the -bench option.  This is a portable, user-land program for
+ * POSIX:
+ *
+ *   cc -O2 -o rangesrv rangesrv.c
+ *   cc -O2 -I../include -o rangetest rangetest.c httprange.c
+ *   ./rangetest -s:./rangesrv
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "httprange.h"
+#include "usertest.h"
+
+#define TEST_FILE_SIZE      (3 * 1024 * 1024 + 777)
+#define TEST_GETS           200
+#define BENCH_FILE_SIZE     (64 * 1024 * 1024)
+
+typedef struct RANGETEST_SERVER
+{
+    pid_t               Pid;
+    unsigned short      Port;
+} RANGETEST_SERVER;
+
+static const char*      Server = "./rangesrv";
+static char             FileName[] = "/tmp/rangetestXXXXXX";
+static unsigned char*   Data;
+static unsigned long    DataSize;
+
+int RangeTestSyntax(void)
+{
+    fprintf(stderr, "syntax:\n");
+    fprintf(stderr, "rangetest [-s:<rangesrv>] [-bench [-l:<ms>] [-r:<kb>] [-m:<mb>]]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "-s     sets the path of the test server (default ./rangesrv).\n");
+    fprintf(stderr, "-bench measures throughput instead of running the tests.\n");
+    fprintf(stderr, "-l     sets the latency the server adds to each response.\n");
+    fprintf(stderr, "-r     sets the size of each request in KiB (default 64).\n");
+    fprintf(stderr, "-m     sets how many MiB to fetch (default 256).\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "example:\n");
+    fprintf(stderr, "rangetest -s:./rangesrv -bench -l:1 -r:256\n");
+
+    return -1;
+}
+
+/** The BSD socket transport */
+
+static int PosixConnect(void* Context, unsigned long Address, unsigned short Port)
+{
+    struct sockaddr_in  Sin;
+    int                 Socket;
+    int                 One = 1;
+
+    (void) Context;
+    Socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (Socket < 0)
+    {
+        return -1;
+    }
+    setsockopt(Socket, IPPROTO_TCP, TCP_NODELAY, &One, sizeof One);
+
+    memset(&Sin, 0, sizeof Sin);
+    Sin.sin_family = AF_INET;
+    Sin.sin_addr.s_addr = (in_addr_t) Address;
+    Sin.sin_port = Port;
+    if (connect(Socket, (struct sockaddr*) &Sin, sizeof Sin))
+    {
+        close(Socket);
+        return -1;
+    }
+
+    return Socket;
+}
+
+static int PosixSend(void* Context, int Connection, const char* Buf, int Len)
+{
+    ssize_t Sent;
+
+    (void) Context;
+    do
+    {
+        Sent = send(Connection, Buf, (size_t) Len, MSG_NOSIGNAL);
+    } while (Sent < 0 && errno == EINTR);
+
+    return (int) Sent;
+}
+
+static int PosixRecv(void* Context, int Connection, char* Buf, int Len)
+{
+    ssize_t Received;
+
+    (void) Context;
+    do
+    {
+        Received = recv(Connection, Buf, (size_t) Len, 0);
+    } while (Received < 0 && errno == EINTR);
+
+    return (int) Received;
+}
+
+static void PosixClose(void* Context, int Connection)
+{
+    (void) Context;
+    close(Connection);
+}
+
+static void* PosixMalloc(void* Context, unsigned long Size)
+{
+    (void) Context;
+    return malloc(Size);
+}
+
+static void PosixFree(void* Context, void* Ptr)
+{
+    (void) Context;
+    free(Ptr);
+}
+
+static const HTTPRANGE_S_TRANSPORT PosixTransport =
+{
+    PosixConnect,
+    PosixSend,
+    PosixRecv,
+    PosixClose,
+    PosixMalloc,
+    PosixFree,
+    NULL
+};
+
+/** Test helpers */
+
+static double Now(void)
+{
+    struct timespec Time;
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return Time.tv_sec + Time.tv_nsec / 1e9;
+}
+
+static int MakeFile(unsigned long Size)
+{
+    unsigned long long  Seed = 0x9E3779B97F4A7C15ULL;
+    unsigned long       i;
+    FILE*               File;
+    int                 Fd;
+
+    Data = malloc(Size);
+    Fd = mkstemp(FileName);
+    if (!Data || Fd < 0)
+    {
+        perror(FileName);
+        return -1;
+    }
+    for (i = 0; i < Size; i++)
+    {
+        Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        Data[i] = (unsigned char) (Seed >> 56);
+    }
+    File = fdopen(Fd, "wb");
+    if (!File || fwrite(Data, 1, Size, File) != Size || fclose(File))
+    {
+        perror(FileName);
+        return -1;
+    }
+    DataSize = Size;
+
+    return 0;
+}
+
+/* Start rangesrv with up to three options and read back its port */
+static int StartServer(RANGETEST_SERVER* Srv, const char* Opt1, const char* Opt2, const char* Opt3)
+{
+    const char*         Argv[6];
+    int                 Argc = 0;
+    int                 Pipe[2];
+    char                Line[16];
+    ssize_t             Len;
+    ssize_t             Have = 0;
+
+    Argv[Argc++] = Server;
+    if (Opt1)
+        Argv[Argc++] = Opt1;
+    if (Opt2)
+        Argv[Argc++] = Opt2;
+    if (Opt3)
+        Argv[Argc++] = Opt3;
+    Argv[Argc++] = FileName;
+    Argv[Argc] = NULL;
+
+    if (pipe(Pipe))
+    {
+        return -1;
+    }
+    Srv->Pid = fork();
+    if (Srv->Pid < 0)
+    {
+        return -1;
+    }
+    if (!Srv->Pid)
+    {
+        dup2(Pipe[1], STDOUT_FILENO);
+        close(Pipe[0]);
+        close(Pipe[1]);
+        execv(Server, (char* const*) Argv);
+        perror(Server);
+        _exit(127);
+    }
+    close(Pipe[1]);
+
+    while (Have < (ssize_t) sizeof Line - 1 && (Len = read(Pipe[0], Line + Have, sizeof Line - 1 - Have)) > 0)
+    {
+        Have += Len;
+        if (memchr(Line, '\n', (size_t) Have))
+        {
+            break;
+        }
+    }
+    close(Pipe[0]);
+    Line[Have] = '\0';
+    Srv->Port = (unsigned short) atoi(Line);
+    if (!Srv->Port)
+    {
+        fprintf(stderr, "%s didn't start.\n", Server);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void StopServer(RANGETEST_SERVER* Srv)
+{
+    kill(Srv->Pid, SIGTERM);
+    waitpid(Srv->Pid, NULL, 0);
+}
+
+static int Open(HTTPRANGE_SP Engine, const RANGETEST_SERVER* Srv)
+{
+    return HttpRangeInit(Engine, &PosixTransport, htonl(INADDR_LOOPBACK), htons(Srv->Port), "127.0.0.1", "/image.hdd");
+}
+
+/** Tests */
+
+static void TestBuildRequest(void)
+{
+    char Buf[256];
+    int  Len;
+
+    Len = HttpRangeBuildRequest(Buf, sizeof Buf, "GET", "host", "/f", 512, 1024, 1);
+    CHECK(Len > 0);
+    CHECK(!strcmp(Buf,
+        "GET /f HTTP/1.1\r\nHost: host\r\nRange: bytes=512-1535\r\n"
+        "Accept: */*\r\nUser-Agent: HttpDisk/1.2\r\n\r\n"));
+    CHECK(Len == (int) strlen(Buf));
+
+    Len = HttpRangeBuildRequest(Buf, sizeof Buf, "HEAD", "host", "/f", 0, 0, 0);
+    CHECK(Len > 0);
+    CHECK(!strcmp(Buf,
+        "HEAD /f HTTP/1.1\r\nHost: host\r\n"
+        "Accept: */*\r\nUser-Agent: HttpDisk/1.2\r\nConnection: close\r\n\r\n"));
+
+    Len = HttpRangeBuildRequest(Buf, sizeof Buf, "GET", "host", "/f", 0xFFFFFFFFFFULL, 1, 1);
+    CHECK(Len > 0 && strstr(Buf, "Range: bytes=1099511627775-1099511627775\r\n"));
+
+    CHECK(HttpRangeBuildRequest(Buf, 40, "GET", "host", "/f", 0, 512, 1) == -1);
+}
+
+static void TestParseResponse(void)
+{
+    static const char   Partial[] =
+        "HTTP/1.1 206 Partial Content\r\ncontent-length:  4096\r\n\r\nbody";
+    static const char   Old[] = "HTTP/1.0 200 OK\r\nContent-Length: 7\r\n\r\n";
+    static const char   KeepAlive[] =
+        "HTTP/1.0 200 OK\r\nConnection: Keep-Alive\r\n\r\n";
+    static const char   Closing[] = "HTTP/1.1 206 OK\r\nConnection: close\r\n\r\n";
+    static const char   Longest[] =
+        "HTTP/1.1 200 OK\r\nContent-Length: 9999999999999999999\r\n\r\n";
+    static const char   TooLong[] =
+        "HTTP/1.1 200 OK\r\nContent-Length: 18446744073709551617\r\n\r\n";
+    HTTPRANGE_S_RESPONSE Response;
+
+    CHECK(HttpRangeParseResponse(Partial, sizeof Partial - 1, &Response) == HttpRangeStatusSuccess);
+    CHECK(Response.StatusCode == 206);
+    CHECK(Response.HasContentLength && Response.ContentLength == 4096);
+    CHECK(Response.HeaderLength == sizeof Partial - 1 - 4);
+    CHECK(!Response.Close);
+
+    CHECK(HttpRangeParseResponse(Old, sizeof Old - 1, &Response) == HttpRangeStatusSuccess);
+    CHECK(Response.StatusCode == 200 && Response.Close);
+    CHECK(HttpRangeParseResponse(KeepAlive, sizeof KeepAlive - 1, &Response) == HttpRangeStatusSuccess);
+    CHECK(!Response.Close && !Response.HasContentLength);
+    CHECK(HttpRangeParseResponse(Closing, sizeof Closing - 1, &Response) == HttpRangeStatusSuccess);
+    CHECK(Response.Close);
+
+    /* Every truncation of a header is incomplete */
+    CHECK(HttpRangeParseResponse(Partial, 30, &Response) == HttpRangeStatusIncomplete);
+    CHECK(HttpRangeParseResponse(Partial, sizeof Partial - 1 - 6, &Response) == HttpRangeStatusIncomplete);
+
+    CHECK(HttpRangeParseResponse("HTTP/1.1 2x6 OK\r\n\r\n", 19, &Response) == HttpRangeStatusBadResponse);
+    CHECK(HttpRangeParseResponse("SPDY/3 200 OK\r\n\r\n", 17, &Response) == HttpRangeStatusBadResponse);
+    CHECK(HttpRangeParseResponse("HTTP/1.1 200 OK\r\nContent-Length: x\r\n\r\n", 38, &Response) ==
+        HttpRangeStatusBadResponse);
+
+    /* 19 digits always fit in 64 bits, and 20 might not */
+    CHECK(HttpRangeParseResponse(Longest, sizeof Longest - 1, &Response) == HttpRangeStatusSuccess);
+    CHECK(Response.ContentLength == 9999999999999999999ULL);
+    CHECK(HttpRangeParseResponse(TooLong, sizeof TooLong - 1, &Response) == HttpRangeStatusBadResponse);
+}
+
+/* Fetch random ranges from a server started with the given options */
+static void TestGets(const char* Name, const char* Opt1, const char* Opt2, const char* Opt3)
+{
+    RANGETEST_SERVER    Srv;
+    HTTPRANGE_S         Engine;
+    unsigned long long  Size = 0;
+    unsigned long long  Seed = 12345;
+    unsigned long       Offset;
+    unsigned long       Length;
+    unsigned char*      Buf;
+    int                 Failed;
+    int                 i;
+
+    Failed = TestBegin(Name);
+    Buf = malloc(DataSize);
+    if (!CHECK(Buf != NULL) || !CHECK(!StartServer(&Srv, Opt1, Opt2, Opt3)))
+    {
+        free(Buf);
+        TestEnd(Failed);
+        return;
+    }
+    if (CHECK(Open(&Engine, &Srv) == HttpRangeStatusSuccess))
+    {
+        CHECK(HttpRangeGetSize(&Engine, &Size) == HttpRangeStatusSuccess);
+        CHECK(Size == DataSize);
+
+        /* The first and last sector, the whole file, then random ranges */
+        CHECK(HttpRangeGet(&Engine, 0, 512, Buf) == HttpRangeStatusSuccess && !memcmp(Buf, Data, 512));
+        CHECK(HttpRangeGet(&Engine, DataSize - 1, 1, Buf) == HttpRangeStatusSuccess &&
+            Buf[0] == Data[DataSize - 1]);
+        CHECK(HttpRangeGet(&Engine, 0, DataSize, Buf) == HttpRangeStatusSuccess && !memcmp(Buf, Data, DataSize));
+        for (i = 0; i < TEST_GETS && Failures == Failed; i++)
+        {
+            Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            Offset = (unsigned long) ((Seed >> 20) % DataSize);
+            Length = 1 + (unsigned long) ((Seed >> 44) % 262144);
+            if (Length > DataSize - Offset)
+            {
+                Length = DataSize - Offset;
+            }
+            CHECK(HttpRangeGet(&Engine, Offset, Length, Buf) == HttpRangeStatusSuccess);
+            CHECK(!memcmp(Buf, Data + Offset, Length));
+        }
+
+        /* Past the end is a 416, which isn't retried into success */
+        CHECK(HttpRangeGet(&Engine, DataSize, 512, Buf) == HttpRangeStatusBadResponse);
+        CHECK(HttpRangeGet(&Engine, 0, 1, NULL) == HttpRangeStatusInvalid);
+        /* And the engine recovers from it */
+        CHECK(HttpRangeGet(&Engine, 4096, 4096, Buf) == HttpRangeStatusSuccess &&
+            !memcmp(Buf, Data + 4096, 4096));
+        HttpRangeCleanup(&Engine);
+    }
+    StopServer(&Srv);
+    free(Buf);
+    TestEnd(Failed);
+}
+
+/* With no server listening, every try fails to connect */
+static void TestNoServer(void)
+{
+    RANGETEST_SERVER    Srv;
+    HTTPRANGE_S         Engine;
+    unsigned long long  Size;
+    char                Buf[16];
+    int                 Failed;
+
+    Failed = TestBegin("no server");
+    if (!CHECK(!StartServer(&Srv, NULL, NULL, NULL)))
+    {
+        TestEnd(Failed);
+        return;
+    }
+    StopServer(&Srv);
+    if (CHECK(Open(&Engine, &Srv) == HttpRangeStatusSuccess))
+    {
+        CHECK(HttpRangeGetSize(&Engine, &Size) == HttpRangeStatusConnect);
+        CHECK(HttpRangeGet(&Engine, 0, sizeof Buf, Buf) == HttpRangeStatusConnect);
+        CHECK(Engine.Connection == -1);
+        HttpRangeCleanup(&Engine);
+    }
+    TestEnd(Failed);
+}
+
+static int RunTests(void)
+{
+    int                 Failed;
+
+    if (MakeFile(TEST_FILE_SIZE))
+    {
+        return -1;
+    }
+
+    Failed = TestBegin("build request");
+    TestBuildRequest();
+    TestEnd(Failed);
+    Failed = TestBegin("parse response");
+    TestParseResponse();
+    TestEnd(Failed);
+
+    TestGets("persistent", NULL, NULL, NULL);
+    TestGets("trickled response", "-c:7", NULL, NULL);
+    TestGets("closed after 1", "-k:1", NULL, NULL);
+    TestGets("closed after 3", "-k:3", "-c:1000", NULL);
+    TestGets("latency", "-l:1", NULL, NULL);
+    TestNoServer();
+
+    unlink(FileName);
+
+    return TestSummary();
+}
+
+static int RunBench(const char* Latency, unsigned long RequestSize, unsigned long long Total)
+{
+    RANGETEST_SERVER    Srv;
+    HTTPRANGE_S         Engine;
+    unsigned long long  Done;
+    unsigned long long  Offset = 0;
+    unsigned char*      Buf;
+    double              Start;
+    double              Time;
+    unsigned long       Requests = 0;
+
+    if (MakeFile(BENCH_FILE_SIZE))
+    {
+        return -1;
+    }
+    Buf = malloc(RequestSize);
+    if (!Buf || StartServer(&Srv, Latency, NULL, NULL))
+    {
+        unlink(FileName);
+        return -1;
+    }
+    if (Open(&Engine, &Srv) != HttpRangeStatusSuccess)
+    {
+        StopServer(&Srv);
+        unlink(FileName);
+        return -1;
+    }
+
+    Start = Now();
+    for (Done = 0; Done < Total; Done += RequestSize)
+    {
+        if (Offset + RequestSize > DataSize)
+        {
+            Offset = 0;
+        }
+        if (HttpRangeGet(&Engine, Offset, RequestSize, Buf) != HttpRangeStatusSuccess)
+        {
+            fprintf(stderr, "GET failed at %llu.\n", Offset);
+            break;
+        }
+        Offset += RequestSize;
+        Requests++;
+    }
+    Time = Now() - Start;
+
+    printf("%lu requests of %lu KiB in %.3f s: %.1f MB/s, %.1f us/request\n",
+        Requests, RequestSize / 1024, Time, Done / Time / 1e6, Time * 1e6 / Requests);
+
+    HttpRangeCleanup(&Engine);
+    StopServer(&Srv);
+    unlink(FileName);
+    free(Buf);
+
+    return Done < Total ? 1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    const char*         Latency = NULL;
+    unsigned long       RequestSize = 64 * 1024;
+    unsigned long long  Total = 256ULL * 1024 * 1024;
+    int                 Bench = 0;
+    int                 i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strncmp(argv[i], "-s:", 3))
+        {
+            Server = argv[i] + 3;
+        }
+        else if (!strcmp(argv[i], "-bench"))
+        {
+            Bench = 1;
+        }
+        else if (!strncmp(argv[i], "-l:", 3))
+        {
+            Latency = argv[i];
+        }
+        else if (!strncmp(argv[i], "-r:", 3) && atol(argv[i] + 3) > 0 && atol(argv[i] + 3) <= 16384)
+        {
+            RequestSize = (unsigned long) atol(argv[i] + 3) * 1024;
+        }
+        else if (!strncmp(argv[i], "-m:", 3) && atol(argv[i] + 3) > 0)
+        {
+            Total = (unsigned long long) atol(argv[i] + 3) * 1024 * 1024;
+        }
+        else
+        {
+            return RangeTestSyntax();
+        }
+    }
+
+    return Bench ? RunBench(Latency, RequestSize, Total) : RunTests();
+}
@@ -27,12 +27,24 @@ typedef char KEVENT, WVL_S_BUS_NODE, WVL_S_DISK_T;
 int HttpDiskSyntax(void)
 {
     fprintf(stderr, "syntax:\n");
-    fprintf(stderr, "httpdisk /mount  <url> [/cd]\n");
+    fprintf(stderr, "httpdisk /mount  <url> [/cd] [/cow[:<max_mb>[:<delta_file>]]] [/mirror:<url>]...\n");
     fprintf(stderr, "httpdisk /umount <unit_num>\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "/cow keeps writes in a local copy-on-write overlay, never sent to the\n");
+    fprintf(stderr, "server and discarded at unmount.  At most <max_mb> MiB of RAM are used\n");
+    fprintf(stderr, "for the overlay, then writes spill to <delta_file>, if given.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "/mirror adds another server with the same image, up to %d of them.\n", HTTP_DISK_MAX_MIRRORS);
+    fprintf(stderr, "Requests are spread over the mirrors, favouring the fastest ones, and\n");
+    fprintf(stderr, "a failing mirror is avoided until it recovers.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Images packed with cimgpack are recognized and decompressed on the fly.\n");
+    fprintf(stderr, "\n");
     fprintf(stderr, "example:\n");
     fprintf(stderr, "httpdisk /mount  http://server.domain.com/path/diskimage.img\n");
+    fprintf(stderr, "httpdisk /mount  http://server.domain.com/path/diskimage.img /cow:256:C:\\delta.bin\n");
     fprintf(stderr, "httpdisk /mount  http://server.domain.com/path/cdimage.iso /cd\n");
+    fprintf(stderr, "httpdisk /mount  http://server1.domain.com/path/diskimage.img /mirror:http://server2.domain.com/diskimage.img\n");
     fprintf(stderr, "...\n");
     fprintf(stderr, "httpdisk /umount 0\n");
     fprintf(stderr, "httpdisk /umount 1\n");
@@ -63,6 +75,109 @@ void PrintLastError(char* Prefix)
 
 static char HTTPDiskBus[] = "\\\\.\\HTTPDisk";
 
+int
+HttpDiskParseUrl(
+    char*   Url,
+    PULONG  Address,
+    PUSHORT Port,
+    PUCHAR  HostName,
+    PUSHORT HostNameLength,
+    PUCHAR  FileName,
+    size_t  FileNameSize,
+    PUSHORT FileNameLength
+)
+{
+    char*           Path;
+    char*           PortStr;
+    struct hostent* HostEnt;
+    WSADATA         wsaData;
+
+    if (strstr(Url, "//"))
+    {
+        if (strlen(Url) > 7 && !strncmp(Url, "http://", 7))
+        {
+            Url += 7;
+        }
+        else
+        {
+            fprintf(stderr, "Invalid protocol.\n");
+            return -1;
+        }
+    }
+
+    Path = strstr(Url, "/");
+
+    if (!Path)
+    {
+        fprintf(stderr, "%s: Invalid url.\n", Url);
+        return -1;
+    }
+
+    if (strlen(Path) >= FileNameSize)
+    {
+        fprintf(stderr, "%s: File name to long.\n", Path);
+        return -1;
+    }
+
+    strcpy(FileName, Path);
+
+    *FileNameLength = (USHORT) strlen(FileName);
+
+    *Path = '\0';
+
+    PortStr = strstr(Url, ":");
+
+    if (PortStr)
+    {
+        *Port = htons((USHORT) atoi(PortStr + 1));
+
+        if (*Port == 0)
+        {
+            fprintf(stderr, "%s: Invalid port.\n", PortStr + 1);
+            return -1;
+        }
+
+        *PortStr = '\0';
+    }
+    else
+    {
+        *Port = htons(80);
+    }
+
+    *HostNameLength = (USHORT) strlen(Url);
+
+    if (*HostNameLength > 255)
+    {
+        fprintf(stderr, "%s: Host name to long.\n", Url);
+        return -1;
+    }
+
+    strcpy(HostName, Url);
+
+    *Address = inet_addr(Url);
+
+    if (*Address == INADDR_NONE)
+    {
+        if (WSAStartup(MAKEWORD(1, 1), &wsaData) != 0)
+        {
+            PrintLastError("HttpDisk");
+            return -1;
+        }
+
+        HostEnt = gethostbyname(Url);
+
+        if (!HostEnt)
+        {
+            PrintLastError(Url);
+            return -1;
+        }
+
+        *Address = ((struct in_addr*) HostEnt->h_addr)->s_addr;
+    }
+
+    return 0;
+}
+
 int
 HttpDiskMount(
     PHTTP_DISK_INFORMATION  HttpDiskInformation
@@ -154,15 +269,13 @@ int __cdecl main(int argc, char* argv[])
     char*                   Url;
     char*                   Option;
     PHTTP_DISK_INFORMATION  HttpDiskInformation;
-    char*                   FileName;
-    char*                   PortStr;
-    struct hostent*         HostEnt;
-    WSADATA                 wsaData;
+    PHTTP_DISK_MIRROR       Mirror;
     int                     rc;
+    int                     i;
 
     Command = argv[1];
 
-    if ((argc == 3 || argc == 4) && !strcmp(Command, "/mount"))
+    if (argc >= 3 && !strcmp(Command, "/mount"))
     {
         Url = argv[2];
 
@@ -174,109 +287,93 @@ int __cdecl main(int argc, char* argv[])
             sizeof *HttpDiskInformation + strlen(Url)
           );
 
-        if (argc > 3)
+        HttpDiskInformation->Optical = FALSE;
+        HttpDiskInformation->Overlay = FALSE;
+
+        for (i = 3; i < argc; i++)
         {
-            Option = argv[3];
+            Option = argv[i];
 
             if (!strcmp(Option, "/cd"))
             {
                 HttpDiskInformation->Optical = TRUE;
             }
-            else
+            else if (!strncmp(Option, "/cow", 4) &&
+                (Option[4] == '\0' || Option[4] == ':'))
             {
-                free(HttpDiskInformation);
-                return HttpDiskSyntax();
+                HttpDiskInformation->Overlay = TRUE;
+
+                if (Option[4] == ':')
+                {
+                    char* DeltaFile;
+
+                    HttpDiskInformation->OverlayMaxMegabytes = atoi(Option + 5);
+
+                    DeltaFile = strchr(Option + 5, ':');
+
+                    if (DeltaFile && DeltaFile[1])
+                    {
+                        /* The driver wants an NT path. */
+                        _snwprintf(
+                            HttpDiskInformation->OverlayFileName,
+                            sizeof HttpDiskInformation->OverlayFileName /
+                                sizeof HttpDiskInformation->OverlayFileName[0] - 1,
+                            L"\\??\\%S",
+                            DeltaFile + 1
+                            );
+                    }
+                }
             }
-        }
-        else
-        {
-            Option = NULL;
-            HttpDiskInformation->Optical = FALSE;
-        }
-
-        if (strstr(Url, "//"))
-        {
-            if (strlen(Url) > 7 && !strncmp(Url, "http://", 7))
+            else if (!strncmp(Option, "/mirror:", 8) && Option[8])
             {
-                Url += 7;
+                if (HttpDiskInformation->MirrorCount == HTTP_DISK_MAX_MIRRORS)
+                {
+                    fprintf(stderr, "Too many mirrors.\n");
+                    free(HttpDiskInformation);
+                    return -1;
+                }
+
+                Mirror = HttpDiskInformation->Mirrors + HttpDiskInformation->MirrorCount;
+
+                if (HttpDiskParseUrl(
+                    Option + 8,
+                    &Mirror->Address,
+                    &Mirror->Port,
+                    Mirror->HostName,
+                    &Mirror->HostNameLength,
+                    Mirror->FileName,
+                    sizeof Mirror->FileName,
+                    &Mirror->FileNameLength
+                    ))
+                {
+                    free(HttpDiskInformation);
+                    return -1;
+                }
+
+                HttpDiskInformation->MirrorCount++;
             }
             else
             {
-                fprintf(stderr, "Invalid protocol.\n");
-                free(HttpDiskInformation);
-                return -1;
-            }
-        }
-
-        FileName = strstr(Url, "/");
-
-        if (!FileName)
-        {
-            fprintf(stderr, "%s: Invalid url.\n", Url);
-            free(HttpDiskInformation);
-            return -1;
-        }
-
-        strcpy(HttpDiskInformation->FileName, FileName);
-
-        HttpDiskInformation->FileNameLength = (USHORT) strlen(HttpDiskInformation->FileName);
-
-        *FileName = '\0';
-
-        PortStr = strstr(Url, ":");
-
-        if (PortStr)
-        {
-            HttpDiskInformation->Port = htons((USHORT) atoi(PortStr + 1));
-
-            if (HttpDiskInformation->Port == 0)
-            {
-                fprintf(stderr, "%s: Invalid port.\n", PortStr + 1);
                 free(HttpDiskInformation);
-                return -1;
+                return HttpDiskSyntax();
             }
-
-            *PortStr = '\0';
         }
-        else
-        {
-            HttpDiskInformation->Port = htons(80);
-        }
-
-        HttpDiskInformation->HostNameLength = (USHORT) strlen(Url);
 
-        if (HttpDiskInformation->HostNameLength > 255)
+        if (HttpDiskParseUrl(
+            Url,
+            &HttpDiskInformation->Address,
+            &HttpDiskInformation->Port,
+            HttpDiskInformation->HostName,
+            &HttpDiskInformation->HostNameLength,
+            HttpDiskInformation->FileName,
+            strlen(Url) + 1,
+            &HttpDiskInformation->FileNameLength
+            ))
         {
-            fprintf(stderr, "%s: Host name to long.\n", Url);
             free(HttpDiskInformation);
             return -1;
         }
 
-        strcpy(HttpDiskInformation->HostName, Url);
-
-        HttpDiskInformation->Address = inet_addr(Url);
-
-        if (HttpDiskInformation->Address == INADDR_NONE)
-        {
-            if (WSAStartup(MAKEWORD(1, 1), &wsaData) != 0)
-            {
-                PrintLastError("HttpDisk");
-                free(HttpDiskInformation);
-                return -1;
-            }
-
-            HostEnt = gethostbyname(Url);
-
-            if (!HostEnt)
-            {
-                PrintLastError(Url);
-                free(HttpDiskInformation);
-                return -1;
-            }
-
-            HttpDiskInformation->Address = ((struct in_addr*) HostEnt->h_addr)->s_addr;
-        }
-
         rc = HttpDiskMount(HttpDiskInformation);
         free(HttpDiskInformation);
         return rc;
@@ -0,0 +1,783 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * Image format engine tests.
+ *
+ * Builds small VHDX and QCOW2 images, then drives the engines in
+ * winvblock/filedisk through random writes and reads against a model
+ * of the disk's contents, reopens the images to check what reached
+ * the file, and checks the QCOW2 engine's L2 table cache.  This is a
+ * portable, user-land program for POSIX:
+ *
+ *   cc -O2 -I../include -I../winvblock/filedisk -o imgtest imgtest.c \
+ *     ../winvblock/filedisk/imgfmt.c ../winvblock/filedisk/vhdx.c \
+ *     ../winvblock/filedisk/qcow2.c
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "imgfmt.h"
+#include "usertest.h"
+
+#define SECTOR              512ULL
+#define KIB                 1024ULL
+#define MIB                 (1024ULL * 1024)
+#define GIB                 (1024ULL * MIB)
+
+/* Sectors the model of a disk's contents can track */
+#define MODEL_SIZE          (1 << 18)
+
+/* The largest single write or read */
+#define MAX_IO              (192 * KIB)
+
+#define VHDX_BLOCK          MIB
+#define VHDX_DISK           (6 * GIB)
+#define VHDX_META           (2 * MIB)
+#define VHDX_BAT            (3 * MIB)
+#define VHDX_DATA           (4 * MIB)
+
+#define QCOW2_CLUSTER       (4 * KIB)
+#define QCOW2_L2_SPAN       (QCOW2_CLUSTER / 8 * QCOW2_CLUSTER)
+#define QCOW2_DISK          (256 * MIB)
+#define QCOW2_L1            (3 * QCOW2_CLUSTER)
+#define QCOW2_L2            (4 * QCOW2_CLUSTER)
+#define QCOW2_OWN           (5 * QCOW2_CLUSTER)
+#define QCOW2_SHARED        (6 * QCOW2_CLUSTER)
+#define QCOW2_COPIED        0x8000000000000000ULL
+#define QCOW2_ZERO          1ULL
+/* Regions, each covered by one L2 table, which the tests write to */
+#define QCOW2_REGIONS       40
+
+/* The file an engine performs I/O on */
+typedef struct IMGTEST_FILE
+{
+    IMGFMT_S_FILE       File;
+    int                 Fd;
+    unsigned long       Reads;
+    unsigned long       ClusterReads;
+    int                 Misaligned;
+} IMGTEST_FILE;
+
+/* What each written sector of a disk should hold */
+typedef struct IMGTEST_MODEL
+{
+    unsigned long long  Sector[MODEL_SIZE];
+    unsigned long       Tag[MODEL_SIZE];
+    unsigned long       Count;
+} IMGTEST_MODEL;
+
+static IMGTEST_MODEL    Model;
+static unsigned long long Seed = 1;
+
+static unsigned long long Random(void)
+{
+    Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return Seed >> 16;
+}
+
+/** The file operations */
+
+static int FileRead(void* Context, unsigned long long Offset, unsigned long Length, void* Buffer)
+{
+    IMGTEST_FILE* File = Context;
+
+    if ((Offset | Length) % SECTOR)
+    {
+        File->Misaligned++;
+    }
+    File->Reads++;
+    if (Length == QCOW2_CLUSTER)
+    {
+        File->ClusterReads++;
+    }
+    memset(Buffer, 0, Length);
+
+    return pread(File->Fd, Buffer, Length, (off_t) Offset) < 0;
+}
+
+static int FileWrite(void* Context, unsigned long long Offset, unsigned long Length, const void* Buffer)
+{
+    IMGTEST_FILE* File = Context;
+
+    if ((Offset | Length) % SECTOR)
+    {
+        File->Misaligned++;
+    }
+
+    return pwrite(File->Fd, Buffer, Length, (off_t) Offset) != (ssize_t) Length;
+}
+
+static void* FileMalloc(void* Context, unsigned long Size)
+{
+    (void) Context;
+    return malloc(Size);
+}
+
+static void FileFree(void* Context, void* Ptr)
+{
+    (void) Context;
+    free(Ptr);
+}
+
+static void FileRandom(void* Context, void* Buffer, unsigned long Length)
+{
+    unsigned char* p = Buffer;
+
+    (void) Context;
+    while (Length--)
+    {
+        *p++ = (unsigned char) Random();
+    }
+}
+
+static int FileOpen(IMGTEST_FILE* File, const char* Name)
+{
+    struct stat Stat;
+
+    memset(File, 0, sizeof *File);
+    File->Fd = open(Name, O_RDWR);
+    if (File->Fd < 0 || fstat(File->Fd, &Stat))
+    {
+        perror(Name);
+        return -1;
+    }
+    File->File.Read = FileRead;
+    File->File.Write = FileWrite;
+    File->File.Malloc = FileMalloc;
+    File->File.Free = FileFree;
+    File->File.Random = FileRandom;
+    File->File.Size = (unsigned long long) Stat.st_size;
+    File->File.Context = File;
+
+    return 0;
+}
+
+/** The model of a disk's contents */
+
+static void ModelReset(void)
+{
+    memset(&Model, 0, sizeof Model);
+}
+
+static unsigned long* ModelFind(unsigned long long Sector, int Add)
+{
+    unsigned long i = (unsigned long) (Sector * 0x9E3779B97F4A7C15ULL >> 46) % MODEL_SIZE;
+
+    /* Sector numbers are stored plus one, so zero means empty */
+    while (Model.Sector[i] && Model.Sector[i] != Sector + 1)
+    {
+        i = (i + 1) % MODEL_SIZE;
+    }
+    if (!Model.Sector[i])
+    {
+        if (!Add || Model.Count == MODEL_SIZE / 2)
+        {
+            return NULL;
+        }
+        Model.Sector[i] = Sector + 1;
+        Model.Count++;
+    }
+
+    return Model.Tag + i;
+}
+
+/* Fill sectors with the pattern for a tag, or with zeroes for tag 0 */
+static void Pattern(unsigned char* Buf, unsigned long long Sector, unsigned long Tag)
+{
+    unsigned long long  v = Sector * 0x9E3779B97F4A7C15ULL ^ Tag * 0xC2B2AE3D27D4EB4FULL;
+    unsigned int        i;
+
+    for (i = 0; i < SECTOR; i++)
+    {
+        v = v * 6364136223846793005ULL + 1442695040888963407ULL;
+        Buf[i] = Tag ? (unsigned char) (v >> 56) : 0;
+    }
+}
+
+static void ModelSet(unsigned long long Offset, unsigned long Length, unsigned long Tag, unsigned char* Buf)
+{
+    unsigned long long Sector;
+
+    for (Sector = Offset / SECTOR; Sector < (Offset + Length) / SECTOR; Sector++)
+    {
+        *ModelFind(Sector, 1) = Tag;
+        if (Buf)
+        {
+            Pattern(Buf + (Sector * SECTOR - Offset), Sector, Tag);
+        }
+    }
+}
+
+static int ModelCheck(unsigned long long Offset, unsigned long Length, const unsigned char* Buf)
+{
+    unsigned char       Expect[SECTOR];
+    unsigned long long  Sector;
+    unsigned long*      Tag;
+
+    for (Sector = Offset / SECTOR; Sector < (Offset + Length) / SECTOR; Sector++)
+    {
+        Tag = ModelFind(Sector, 0);
+        Pattern(Expect, Sector, Tag ? *Tag : 0);
+        if (memcmp(Expect, Buf + (Sector * SECTOR - Offset), SECTOR))
+        {
+            fprintf(stderr, "Sector %llu differs.\n", Sector);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/** Test drivers */
+
+/* Write random runs at offsets picked by Pick, checking each by reading it back */
+static void RandomWrites(IMGFMT_SP Image, unsigned long long (*Pick)(void), int Count, unsigned long Tag)
+{
+    unsigned char*      Buf = malloc(MAX_IO);
+    unsigned long long  Offset;
+    unsigned long       Length;
+    int                 i;
+
+    for (i = 0; i < Count && CHECK(Buf != NULL); i++)
+    {
+        Offset = Pick();
+        Length = (unsigned long) (1 + Random() % (MAX_IO / SECTOR)) * SECTOR;
+        if (Length > Image->Size - Offset)
+        {
+            Length = (unsigned long) (Image->Size - Offset);
+        }
+        ModelSet(Offset, Length, Tag + i, Buf);
+        if (!CHECK(ImgFmtWrite(Image, Offset, Length, Buf) == ImgFmtStatusSuccess) ||
+            !CHECK(ImgFmtRead(Image, Offset, Length, Buf) == ImgFmtStatusSuccess) ||
+            !CHECK(ModelCheck(Offset, Length, Buf)))
+        {
+            break;
+        }
+    }
+    free(Buf);
+}
+
+/* Read every sector the model knows about, plus random ranges */
+static void VerifyAll(IMGFMT_SP Image, unsigned long long (*Pick)(void))
+{
+    unsigned char*      Buf = malloc(MAX_IO);
+    unsigned long long  Offset;
+    unsigned long       Length;
+    unsigned long       i;
+
+    if (!CHECK(Buf != NULL))
+    {
+        return;
+    }
+    for (i = 0; i < MODEL_SIZE; i++)
+    {
+        if (!Model.Sector[i])
+        {
+            continue;
+        }
+        Offset = (Model.Sector[i] - 1) * SECTOR;
+        if (!CHECK(ImgFmtRead(Image, Offset, SECTOR, Buf) == ImgFmtStatusSuccess) ||
+            !CHECK(ModelCheck(Offset, SECTOR, Buf)))
+        {
+            break;
+        }
+    }
+    for (i = 0; i < 200; i++)
+    {
+        Offset = Pick();
+        Length = (unsigned long) (1 + Random() % (MAX_IO / SECTOR)) * SECTOR;
+        if (Length > Image->Size - Offset)
+        {
+            Length = (unsigned long) (Image->Size - Offset);
+        }
+        if (!CHECK(ImgFmtRead(Image, Offset, Length, Buf) == ImgFmtStatusSuccess) ||
+            !CHECK(ModelCheck(Offset, Length, Buf)))
+        {
+            break;
+        }
+    }
+    free(Buf);
+}
+
+static int OpenImage(IMGTEST_FILE* File, IMGFMT_SP Image, const char* Name, const IMGFMT_S_FORMAT* Format)
+{
+    if (FileOpen(File, Name))
+    {
+        return 0;
+    }
+    if (!CHECK(ImgFmtOpen(&File->File, Image) == ImgFmtStatusSuccess) || !CHECK(Image->Format == Format))
+    {
+        close(File->Fd);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void CloseImage(IMGTEST_FILE* File, IMGFMT_SP Image)
+{
+    ImgFmtClose(Image);
+    CHECK(!File->Misaligned);
+    close(File->Fd);
+}
+
+static int WriteFile(const char* Name, const unsigned char* Buf, size_t Len, unsigned long long Size)
+{
+    int Fd = open(Name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (Fd < 0 || write(Fd, Buf, Len) != (ssize_t) Len || ftruncate(Fd, (off_t) Size) || close(Fd))
+    {
+        perror(Name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/** VHDX */
+
+static const unsigned char VhdxBatGuid[16] =
+{
+    0x66, 0x77, 0xC2, 0x2D, 0x23, 0xF6, 0x00, 0x42,
+    0x9D, 0x64, 0x11, 0x5E, 0x9B, 0xFD, 0x4A, 0x08,
+};
+static const unsigned char VhdxMetadataGuid[16] =
+{
+    0x06, 0xA2, 0x7C, 0x8B, 0x90, 0x47, 0x9A, 0x4B,
+    0xB8, 0xFE, 0x57, 0x5F, 0x05, 0x0F, 0x88, 0x6E,
+};
+static const unsigned char VhdxFileParamsGuid[16] =
+{
+    0x37, 0x67, 0xA1, 0xCA, 0x36, 0xFA, 0x43, 0x4D,
+    0xB3, 0xB6, 0x33, 0xF0, 0xAA, 0x44, 0xE7, 0x6B,
+};
+static const unsigned char VhdxDiskSizeGuid[16] =
+{
+    0x24, 0x42, 0xA5, 0x2F, 0x1B, 0xCD, 0x76, 0x48,
+    0xB2, 0x11, 0x5D, 0xBE, 0xD8, 0x3B, 0xF4, 0xB8,
+};
+static const unsigned char VhdxSectorSizeGuid[16] =
+{
+    0x1D, 0xBF, 0x41, 0x81, 0x6F, 0xA9, 0x09, 0x47,
+    0xBA, 0x47, 0xF2, 0x33, 0xA8, 0xFA, 0xAB, 0x5F,
+};
+
+static void VhdxChecksum(unsigned char* Buf, unsigned long Len)
+{
+    ImgFmtPutLe32(Buf + 4, 0);
+    ImgFmtPutLe32(Buf + 4, ImgFmtCrc32c(Buf, Len));
+}
+
+/*
+ * Build a 6 GiB dynamic VHDX with 1 MiB blocks, so the BAT has a
+ * sector bitmap entry after the first 4096 blocks.  Block 0 is
+ * present and holds tag 1.
+ */
+static int VhdxBuild(const char* Name)
+{
+    unsigned char*      Buf;
+    unsigned char*      p;
+    unsigned long long  Sector;
+    int                 i;
+    int                 Ret;
+
+    Buf = calloc(1, VHDX_DATA + VHDX_BLOCK);
+    if (!Buf)
+    {
+        return -1;
+    }
+    memcpy(Buf, "vhdxfile", 8);
+
+    /* Two headers; the second is current */
+    for (i = 1; i <= 2; i++)
+    {
+        p = Buf + i * 64 * KIB;
+        memcpy(p, "head", 4);
+        ImgFmtPutLe64(p + 8, (unsigned long long) i);
+        ImgFmtPutLe32(p + 64, 1UL << 16);
+        ImgFmtPutLe32(p + 68, (unsigned long) MIB);
+        ImgFmtPutLe64(p + 72, MIB);
+        VhdxChecksum(p, 4 * KIB);
+    }
+
+    /* Two copies of the region table */
+    for (i = 0; i < 2; i++)
+    {
+        p = Buf + (192 + i * 64) * KIB;
+        memcpy(p, "regi", 4);
+        ImgFmtPutLe32(p + 8, 2);
+        memcpy(p + 16, VhdxBatGuid, 16);
+        ImgFmtPutLe64(p + 32, VHDX_BAT);
+        ImgFmtPutLe32(p + 40, (unsigned long) MIB);
+        ImgFmtPutLe32(p + 44, 1);
+        memcpy(p + 48, VhdxMetadataGuid, 16);
+        ImgFmtPutLe64(p + 64, VHDX_META);
+        ImgFmtPutLe32(p + 72, (unsigned long) MIB);
+        ImgFmtPutLe32(p + 76, 1);
+        VhdxChecksum(p, 64 * KIB);
+    }
+
+    /* The metadata table and its items */
+    p = Buf + VHDX_META;
+    memcpy(p, "metadata", 8);
+    ImgFmtPutLe32(p + 8, 3UL << 16);
+    memcpy(p + 32, VhdxFileParamsGuid, 16);
+    ImgFmtPutLe32(p + 48, (unsigned long) (64 * KIB));
+    ImgFmtPutLe32(p + 52, 8);
+    ImgFmtPutLe32(p + 56, 4);
+    memcpy(p + 64, VhdxDiskSizeGuid, 16);
+    ImgFmtPutLe32(p + 80, (unsigned long) (64 * KIB + 8));
+    ImgFmtPutLe32(p + 84, 8);
+    ImgFmtPutLe32(p + 88, 6);
+    memcpy(p + 96, VhdxSectorSizeGuid, 16);
+    ImgFmtPutLe32(p + 112, (unsigned long) (64 * KIB + 16));
+    ImgFmtPutLe32(p + 116, 4);
+    ImgFmtPutLe32(p + 120, 6);
+    ImgFmtPutLe32(p + 64 * KIB, (unsigned long) VHDX_BLOCK);
+    ImgFmtPutLe64(p + 64 * KIB + 8, VHDX_DISK);
+    ImgFmtPutLe32(p + 64 * KIB + 16, (unsigned long) SECTOR);
+
+    /* Block 0 is fully present */
+    ImgFmtPutLe64(Buf + VHDX_BAT, (VHDX_DATA / MIB) << 20 | 6);
+    for (Sector = 0; Sector < VHDX_BLOCK / SECTOR; Sector++)
+    {
+        Pattern(Buf + VHDX_DATA + Sector * SECTOR, Sector, 1);
+    }
+
+    Ret = WriteFile(Name, Buf, VHDX_DATA + VHDX_BLOCK, VHDX_DATA + VHDX_BLOCK);
+    free(Buf);
+
+    return Ret;
+}
+
+/* Somewhere around block 0, the first bitmap entry or the end */
+static unsigned long long VhdxPick(void)
+{
+    static const unsigned long long Blocks[] = { 0, 1, 2, 17, 4094, 4095, 4096, 4097, 6142 };
+    unsigned long long Block = Blocks[Random() % (sizeof Blocks / sizeof *Blocks)];
+
+    return Block * VHDX_BLOCK + Random() % (VHDX_BLOCK / SECTOR) * SECTOR;
+}
+
+static void TestVhdx(const char* Name)
+{
+    IMGTEST_FILE        File;
+    IMGFMT_S            Image;
+    unsigned char       Buf[SECTOR];
+    unsigned char       Header[4 * KIB];
+    int                 Failed;
+    int                 Pass;
+
+    Failed = TestBegin("vhdx");
+    ModelReset();
+    ModelSet(0, (unsigned long) VHDX_BLOCK, 1, NULL);
+    if (!CHECK(!VhdxBuild(Name)) || !OpenImage(&File, &Image, Name, &ImgFmtVhdx))
+    {
+        TestEnd(Failed);
+        return;
+    }
+    CHECK(Image.Size == VHDX_DISK);
+    VerifyAll(&Image, VhdxPick);
+
+    /* Bad requests */
+    CHECK(ImgFmtRead(&Image, 100, SECTOR, Buf) == ImgFmtStatusInvalid);
+    CHECK(ImgFmtRead(&Image, VHDX_DISK, SECTOR, Buf) == ImgFmtStatusInvalid);
+    CHECK(ImgFmtWrite(&Image, VHDX_DISK - SECTOR, 2 * SECTOR, Buf) == ImgFmtStatusInvalid);
+
+    /* Write, reopen and check, twice, so each header gets updated */
+    for (Pass = 0; Pass < 2 && Failures == Failed; Pass++)
+    {
+        RandomWrites(&Image, VhdxPick, 150, 1000 + Pass * 1000);
+        CloseImage(&File, &Image);
+        if (!OpenImage(&File, &Image, Name, &ImgFmtVhdx))
+        {
+            TestEnd(Failed);
+            return;
+        }
+        VerifyAll(&Image, VhdxPick);
+    }
+    CloseImage(&File, &Image);
+
+    /* The engine's header update went to the other header's place */
+    if (!FileOpen(&File, Name))
+    {
+        CHECK(!FileRead(&File, 64 * KIB, sizeof Header, Header));
+        CHECK(ImgFmtGetLe64(Header + 8) == 3);
+        CHECK(!FileRead(&File, 128 * KIB, sizeof Header, Header));
+        CHECK(ImgFmtGetLe64(Header + 8) == 4);
+        close(File.Fd);
+    }
+
+    TestEnd(Failed);
+}
+
+/** QCOW2 */
+
+/*
+ * Build a 256 MiB version 3 QCOW2 with 4 KiB clusters, so each L2
+ * table covers 2 MiB.  Cluster 0 is the image's own and holds tag 1,
+ * cluster 1 is shared (say, with a snapshot) and holds tag 2, and
+ * cluster 2 is a zero cluster.
+ */
+static int Qcow2Build(const char* Name, unsigned long Version)
+{
+    unsigned char       Buf[7 * QCOW2_CLUSTER];
+    unsigned long long  Sector;
+
+    memset(Buf, 0, sizeof Buf);
+    ImgFmtPutBe32(Buf, 0x514649FBUL);
+    ImgFmtPutBe32(Buf + 4, Version);
+    ImgFmtPutBe32(Buf + 20, 12);
+    ImgFmtPutBe64(Buf + 24, QCOW2_DISK);
+    ImgFmtPutBe32(Buf + 36, (unsigned long) (QCOW2_DISK / QCOW2_L2_SPAN));
+    ImgFmtPutBe64(Buf + 40, QCOW2_L1);
+    ImgFmtPutBe64(Buf + 48, QCOW2_CLUSTER);
+    ImgFmtPutBe32(Buf + 56, 1);
+    if (Version >= 3)
+    {
+        ImgFmtPutBe32(Buf + 96, 4);
+        ImgFmtPutBe32(Buf + 100, 104);
+    }
+    ImgFmtPutBe64(Buf + QCOW2_CLUSTER, 2 * QCOW2_CLUSTER);
+
+    ImgFmtPutBe64(Buf + QCOW2_L1, QCOW2_L2 | QCOW2_COPIED);
+    ImgFmtPutBe64(Buf + QCOW2_L2, QCOW2_OWN | QCOW2_COPIED);
+    ImgFmtPutBe64(Buf + QCOW2_L2 + 8, QCOW2_SHARED);
+    ImgFmtPutBe64(Buf + QCOW2_L2 + 16, Version >= 3 ? QCOW2_ZERO : 0);
+    for (Sector = 0; Sector < QCOW2_CLUSTER / SECTOR; Sector++)
+    {
+        Pattern(Buf + QCOW2_OWN + Sector * SECTOR, Sector, 1);
+        Pattern(Buf + QCOW2_SHARED + Sector * SECTOR, QCOW2_CLUSTER / SECTOR + Sector, 2);
+    }
+
+    return WriteFile(Name, Buf, sizeof Buf, sizeof Buf);
+}
+
+static void Qcow2Model(void)
+{
+    ModelReset();
+    ModelSet(0, (unsigned long) QCOW2_CLUSTER, 1, NULL);
+    ModelSet(QCOW2_CLUSTER, (unsigned long) QCOW2_CLUSTER, 2, NULL);
+}
+
+/* Somewhere in the first QCOW2_REGIONS L2 tables' regions */
+static unsigned long long Qcow2Pick(void)
+{
+    return Random() % QCOW2_REGIONS * QCOW2_L2_SPAN + Random() % (QCOW2_L2_SPAN / SECTOR) * SECTOR;
+}
+
+static void TestQcow2(const char* Name)
+{
+    IMGTEST_FILE        File;
+    IMGFMT_S            Image;
+    unsigned char       Buf[QCOW2_CLUSTER];
+    unsigned char       Shared[QCOW2_CLUSTER];
+    int                 Failed;
+
+    Failed = TestBegin("qcow2");
+    Qcow2Model();
+    if (!CHECK(!Qcow2Build(Name, 3)) || !OpenImage(&File, &Image, Name, &ImgFmtQcow2))
+    {
+        TestEnd(Failed);
+        return;
+    }
+    CHECK(Image.Size == QCOW2_DISK);
+    VerifyAll(&Image, Qcow2Pick);
+
+    /* A partial write to the shared cluster copies it */
+    ModelSet(QCOW2_CLUSTER + SECTOR, (unsigned long) SECTOR, 3, Buf);
+    CHECK(ImgFmtWrite(&Image, QCOW2_CLUSTER + SECTOR, SECTOR, Buf) == ImgFmtStatusSuccess);
+    CHECK(!FileRead(&File, QCOW2_SHARED, sizeof Shared, Shared));
+    CHECK(ModelCheck(QCOW2_CLUSTER, (unsigned long) SECTOR, Shared));
+    Pattern(Buf, QCOW2_CLUSTER / SECTOR + 1, 2);
+    CHECK(!memcmp(Buf, Shared + SECTOR, SECTOR));
+
+    /* The first allocation marked the image dirty */
+    CHECK(!FileRead(&File, 0, SECTOR, Buf));
+    CHECK(ImgFmtGetBe64(Buf + 72) & 1);
+
+    RandomWrites(&Image, Qcow2Pick, 300, 1000);
+    CloseImage(&File, &Image);
+
+    if (Failures == Failed && OpenImage(&File, &Image, Name, &ImgFmtQcow2))
+    {
+        VerifyAll(&Image, Qcow2Pick);
+        CloseImage(&File, &Image);
+    }
+
+    TestEnd(Failed);
+}
+
+/* Count the L2 tables read for one sector of a region */
+static unsigned long Qcow2Touch(IMGTEST_FILE* File, IMGFMT_SP Image, unsigned long Region)
+{
+    unsigned char Buf[SECTOR];
+    unsigned long Before = File->ClusterReads;
+
+    CHECK(ImgFmtRead(Image, Region * QCOW2_L2_SPAN, SECTOR, Buf) == ImgFmtStatusSuccess);
+    CHECK(ModelCheck(Region * QCOW2_L2_SPAN, (unsigned long) SECTOR, Buf));
+
+    return File->ClusterReads - Before;
+}
+
+static void TestQcow2Cache(const char* Name)
+{
+    IMGTEST_FILE        File;
+    IMGFMT_S            Image;
+    unsigned long       i;
+    unsigned long       Misses;
+    int                 Failed;
+
+    Failed = TestBegin("qcow2 L2 cache");
+    Qcow2Model();
+    if (!CHECK(!Qcow2Build(Name, 3)) || !OpenImage(&File, &Image, Name, &ImgFmtQcow2))
+    {
+        TestEnd(Failed);
+        return;
+    }
+
+    /* Give every region an L2 table */
+    for (i = 0; i < QCOW2_REGIONS; i++)
+    {
+        unsigned char Buf[SECTOR];
+
+        ModelSet(i * QCOW2_L2_SPAN + SECTOR, (unsigned long) SECTOR, 100 + i, Buf);
+        CHECK(ImgFmtWrite(&Image, i * QCOW2_L2_SPAN + SECTOR, SECTOR, Buf) == ImgFmtStatusSuccess);
+    }
+    CloseImage(&File, &Image);
+    if (!OpenImage(&File, &Image, Name, &ImgFmtQcow2))
+    {
+        TestEnd(Failed);
+        return;
+    }
+
+    /* A cold cache reads each of 16 tables once, and then not again */
+    for (Misses = 0, i = 0; i < 16; i++)
+    {
+        Misses += Qcow2Touch(&File, &Image, i);
+    }
+    CHECK(Misses == 16);
+    for (Misses = 0, i = 0; i < 16; i++)
+    {
+        Misses += Qcow2Touch(&File, &Image, i);
+    }
+    CHECK(Misses == 0);
+
+    /* Region 0 was used last of all but region 1, which goes first */
+    CHECK(Qcow2Touch(&File, &Image, 0) == 0);
+    CHECK(Qcow2Touch(&File, &Image, 16) == 1);
+    CHECK(Qcow2Touch(&File, &Image, 0) == 0);
+    CHECK(Qcow2Touch(&File, &Image, 1) == 1);
+    CHECK(Qcow2Touch(&File, &Image, 2) == 1);
+    CHECK(Qcow2Touch(&File, &Image, 16) == 0);
+
+    /* Cycling through more regions than the cache holds always misses */
+    for (Misses = 0, i = 0; i < 2 * QCOW2_REGIONS; i++)
+    {
+        Misses += Qcow2Touch(&File, &Image, (17 + i) % QCOW2_REGIONS);
+    }
+    CHECK(Misses == 2 * QCOW2_REGIONS);
+    CloseImage(&File, &Image);
+
+    TestEnd(Failed);
+}
+
+static void TestQcow2Version2(const char* Name)
+{
+    IMGTEST_FILE        File;
+    IMGFMT_S            Image;
+    unsigned char       Buf[SECTOR];
+    int                 Failed;
+
+    Failed = TestBegin("qcow2 version 2");
+    Qcow2Model();
+    if (!CHECK(!Qcow2Build(Name, 2)) || !OpenImage(&File, &Image, Name, &ImgFmtQcow2))
+    {
+        TestEnd(Failed);
+        return;
+    }
+
+    /* Its own cluster is written in place; anything else can't be */
+    ModelSet(SECTOR, (unsigned long) SECTOR, 5, Buf);
+    CHECK(ImgFmtWrite(&Image, SECTOR, SECTOR, Buf) == ImgFmtStatusSuccess);
+    CHECK(ImgFmtWrite(&Image, QCOW2_CLUSTER, SECTOR, Buf) == ImgFmtStatusReadOnly);
+    CHECK(ImgFmtWrite(&Image, 64 * MIB, SECTOR, Buf) == ImgFmtStatusReadOnly);
+    CHECK(File.File.Size == 7 * QCOW2_CLUSTER);
+    VerifyAll(&Image, Qcow2Pick);
+    CloseImage(&File, &Image);
+
+    TestEnd(Failed);
+}
+
+static void TestRaw(const char* Name)
+{
+    unsigned char       Buf[MIB];
+    IMGTEST_FILE        File;
+    IMGFMT_S            Image;
+    int                 Failed;
+
+    Failed = TestBegin("raw");
+    memset(Buf, 0xA5, sizeof Buf);
+    if (CHECK(!WriteFile(Name, Buf, sizeof Buf, sizeof Buf)) && !FileOpen(&File, Name))
+    {
+        CHECK(ImgFmtOpen(&File.File, &Image) == ImgFmtStatusSuccess);
+        CHECK(!Image.Format);
+        close(File.Fd);
+    }
+    TestEnd(Failed);
+}
+
+int main(int argc, char* argv[])
+{
+    char                Name[] = "/tmp/imgtestXXXXXX";
+    int                 Fd;
+
+    if (argc > 1)
+    {
+        fprintf(stderr, "%s: No options are taken.\n", argv[1]);
+        return -1;
+    }
+
+    Fd = mkstemp(Name);
+    if (Fd < 0)
+    {
+        perror(Name);
+        return -1;
+    }
+    close(Fd);
+
+    TestVhdx(Name);
+    TestQcow2(Name);
+    TestQcow2Cache(Name);
+    TestQcow2Version2(Name);
+    TestRaw(Name);
+
+    unlink(Name);
+
+    return TestSummary();
+}
@@ -0,0 +1,89 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef WV_M_CIMAGE_H_
+#  define WV_M_CIMAGE_H_
+
+/**
+ * @file
+ *
+ * Compressed image container format.
+ *
+ * A seekable, block-compressed disk image for serving over the network.
+ * The file starts with a WV_S_CIMAGE_HEADER, followed by block data
+ * and, at IndexOffset, one WV_S_CIMAGE_ENTRY per block of the image.
+ * All-zero blocks have no data at all, and identical blocks share the
+ * same data.  All fields are little-endian.
+ *
+ * Only standard C types are used, so this header can be shared by the
+ * driver and by the user-land packer on any platform with a 32-bit int.
+ */
+
+/** Macros */
+
+/* The signature at the start of every compressed image */
+#define WV_M_CIMAGE_MAGIC "WVCIMAGE"
+#define WV_M_CIMAGE_MAGIC_LEN 8
+
+#define WV_M_CIMAGE_VERSION 1
+
+/* The range of block sizes, as powers of two */
+#define WV_M_CIMAGE_MIN_BLOCK_SHIFT 12
+#define WV_M_CIMAGE_MAX_BLOCK_SHIFT 20
+#define WV_M_CIMAGE_DEFAULT_BLOCK_SHIFT 16
+
+/** Object types */
+typedef enum WV_CIMAGE_METHOD WV_E_CIMAGE_METHOD;
+typedef struct WV_CIMAGE_HEADER WV_S_CIMAGE_HEADER, * WV_SP_CIMAGE_HEADER;
+typedef struct WV_CIMAGE_ENTRY WV_S_CIMAGE_ENTRY, * WV_SP_CIMAGE_ENTRY;
+
+/** Enumerations */
+
+/** How a block's data is stored */
+enum WV_CIMAGE_METHOD {
+    /** The block is all zeroes and has no data */
+    WvCimageMethodZero,
+    /** The block's data is stored as-is */
+    WvCimageMethodStored,
+    /** The block's data is an LZ4 block */
+    WvCimageMethodLz4,
+    WvCimageMethods
+  };
+
+/** Struct/union type definitions */
+
+/** The image header, at offset 0 */
+struct WV_CIMAGE_HEADER {
+    char Magic[WV_M_CIMAGE_MAGIC_LEN];
+    unsigned int Version;
+    unsigned int BlockShift;
+    /** The size of the uncompressed image, in bytes */
+    unsigned long long ImageSize;
+    unsigned long long IndexOffset;
+    unsigned int BlockCount;
+    unsigned int Reserved[3];
+  };
+
+/** An index entry */
+struct WV_CIMAGE_ENTRY {
+    /** Where the block's data is, and its length */
+    unsigned long long Offset;
+    unsigned int Length;
+    /** A WV_E_CIMAGE_METHOD */
+    unsigned int Method;
+  };
+
+#endif  /* WV_M_CIMAGE_H_ */
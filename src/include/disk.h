@@ -27,6 +27,9 @@
  * Disk device specifics.
  */
 
+#include "diskqueue.h"
+#include "thread.h"
+
 typedef enum WVL_DISK_MEDIA_TYPE {
     WvlDiskMediaTypeFloppy,
     WvlDiskMediaTypeHard,
@@ -101,6 +104,37 @@ typedef NTSTATUS STDCALL WVL_F_DISK_IO(
 typedef WVL_F_DISK_IO * WVL_FP_DISK_IO;
 extern WVL_M_LIB WVL_F_DISK_IO WvlDiskIo;
 
+/**
+ * I/O request routine for a buffer described by an MDL.
+ *
+ * @v disk              Points to the disk's structure.
+ * @v mode              Read/write mode.
+ * @v start_sector      First sector for request.
+ * @v sector_count      Number of sectors to work with.
+ * @v mdl               The locked pages of the buffer.
+ * @v offset            The buffer's byte offset from the MDL's start.
+ * @v irp               Interrupt request packet for this request.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * The buffer needn't be mapped into system space, so a disk can map or
+ * post I/O for as little of it at a time as it likes.  A disk without
+ * this operation is given the whole buffer mapped, via its I/O routine.
+ * WvlDiskIoMdl splits a request larger than the disk's maximum transfer
+ * length, so a disk never sees one, and holds back requests beyond the
+ * disk's queue depth.
+ */
+typedef NTSTATUS STDCALL WVL_F_DISK_IO_MDL(
+    IN WVL_SP_DISK_T,
+    IN WVL_E_DISK_IO_MODE,
+    IN LONGLONG,
+    IN UINT32,
+    IN PMDL,
+    IN UINT32,
+    IN PIRP
+  );
+typedef WVL_F_DISK_IO_MDL * WVL_FP_DISK_IO_MDL;
+extern WVL_M_LIB WVL_F_DISK_IO_MDL WvlDiskIoMdl;
+
 /**
  * Maximum transfer length response routine.
  *
@@ -129,6 +163,50 @@ typedef UCHAR STDCALL WVL_F_DISK_UNIT_NUM(IN WVL_SP_DISK_T);
 typedef WVL_F_DISK_UNIT_NUM * WVL_FP_DISK_UNIT_NUM;
 extern WVL_M_LIB WVL_F_DISK_UNIT_NUM WvlDiskUnitNum;
 
+/**
+ * Disk flush routine.
+ *
+ * @v disk              The disk whose written data should reach its
+ *                      backing store.
+ * @v irp               Interrupt request packet for this request.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Like the I/O routine, this completes the IRP or returns STATUS_PENDING
+ * and completes it later.
+ */
+typedef NTSTATUS STDCALL WVL_F_DISK_FLUSH(IN WVL_SP_DISK_T, IN PIRP);
+typedef WVL_F_DISK_FLUSH * WVL_FP_DISK_FLUSH;
+extern WVL_M_LIB WVL_F_DISK_FLUSH WvlDiskFlush;
+
+/* A run of sectors, such as for an unmap */
+typedef struct WVL_DISK_RANGE {
+    ULONGLONG StartSector;
+    UINT32 SectorCount;
+  } WVL_S_DISK_RANGE, * WVL_SP_DISK_RANGE;
+
+/**
+ * Disk unmap routine.
+ *
+ * @v disk              The disk whose sectors are no longer needed.
+ * @v ranges            The runs of sectors, all within the disk.
+ * @v count             The number of runs.
+ * @v irp               Interrupt request packet for this request.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * The runs are only valid during the call.  Like the I/O routine, this
+ * completes the IRP or returns STATUS_PENDING and completes it later;
+ * a disk which pends must keep its own copy of the runs.  Unmapped
+ * sectors may read back as anything.
+ */
+typedef NTSTATUS STDCALL WVL_F_DISK_UNMAP(
+    IN WVL_SP_DISK_T,
+    IN WVL_SP_DISK_RANGE,
+    IN UINT32,
+    IN PIRP
+  );
+typedef WVL_F_DISK_UNMAP * WVL_FP_DISK_UNMAP;
+extern WVL_M_LIB WVL_F_DISK_UNMAP WvlDiskUnmap;
+
 typedef struct WVL_DISK_OPS {
     WVL_FP_DISK_IO Io;
     WVL_FP_DISK_MAX_XFER_LEN MaxXferLen;
@@ -136,6 +214,11 @@ typedef struct WVL_DISK_OPS {
     WVL_FP_DISK_UNIT_NUM UnitNum;
     WVL_FP_DISK_PNP PnpQueryId;
     WVL_FP_DISK_PNP PnpQueryDevText;
+    WVL_FP_DISK_FLUSH Flush;
+    /* Thin provisioning is reported for a disk with this */
+    WVL_FP_DISK_UNMAP Unmap;
+    /* Optional.  Io is used with a mapped buffer, otherwise */
+    WVL_FP_DISK_IO_MDL IoMdl;
   } WVL_S_DISK_OPS, * WVL_SP_DISK_OPS;
 
 struct WVL_DISK_T {
@@ -154,6 +237,26 @@ struct WVL_DISK_T {
     WVL_E_DISK_STATE State;
     /* Do we allow page files? */
     BOOLEAN DenyPageFile;
+    /* Does the medium lack a seek penalty? */
+    BOOLEAN NonRotational;
+    /* The preferred transfer granularity, in bytes.  0 for none */
+    UINT32 XferGranularity;
+    /*
+     * Bounds the disk's outstanding requests, if its depth is set.
+     * Waiting requests are issued from a pool worker as others complete,
+     * so such a disk should complete its requests asynchronously.  It
+     * must accept them at DISPATCH_LEVEL.
+     */
+    KSPIN_LOCK QueueLock;
+    WVL_S_DISK_QUEUE Queue;
+    /*
+     * Requests which completions have given slots, to be issued by
+     * IssueItem in a pool worker.  Issuing is set while it's scheduled
+     * or running, so only one caller issues them at a time.
+     */
+    WVL_S_DISK_QUEUE_LIST Ready;
+    BOOLEAN Issuing;
+    WVL_S_THREAD_ITEM IssueItem;
   };
 
 /* An MBR C/H/S address and ways to access its components. */
@@ -0,0 +1,105 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WVL_M_DISKQUEUE_H_
+#  define WVL_M_DISKQUEUE_H_
+
+/**
+ * @file
+ *
+ * Disk submission queue.
+ *
+ * Bounds how many requests a disk has outstanding.  A request beyond
+ * the bound waits on a list for the processor which submitted it, and
+ * each freed slot goes to the next waiting request in turn across the
+ * lists, so one busy processor can't starve the others.  This code
+ * includes no OS headers and does no locking of its own; the caller
+ * serializes every call for a given queue.
+ */
+
+/** Macros */
+
+/* The number of submission lists.  Processors beyond this share */
+#define WVL_M_DISK_QUEUE_LISTS 32
+
+/** Object types */
+typedef struct WVL_DISK_QUEUE_ENTRY
+  WVL_S_DISK_QUEUE_ENTRY, * WVL_SP_DISK_QUEUE_ENTRY;
+typedef struct WVL_DISK_QUEUE_LIST
+  WVL_S_DISK_QUEUE_LIST, * WVL_SP_DISK_QUEUE_LIST;
+typedef struct WVL_DISK_QUEUE WVL_S_DISK_QUEUE, * WVL_SP_DISK_QUEUE;
+
+/** Struct/union type definitions */
+
+/** A request's link, while it waits for a slot */
+struct WVL_DISK_QUEUE_ENTRY {
+    WVL_SP_DISK_QUEUE_ENTRY Next;
+  };
+
+/** The requests waiting from one processor, oldest first */
+struct WVL_DISK_QUEUE_LIST {
+    WVL_SP_DISK_QUEUE_ENTRY Head;
+    WVL_SP_DISK_QUEUE_ENTRY Tail;
+  };
+
+/** A disk's submission queue */
+struct WVL_DISK_QUEUE {
+    /** The most requests outstanding at once, or 0 for no bound */
+    unsigned int Depth;
+    unsigned int InFlight;
+    unsigned int Waiting;
+    /** The list to look at first for the next waiting request */
+    unsigned int NextList;
+    WVL_S_DISK_QUEUE_LIST Lists[WVL_M_DISK_QUEUE_LISTS];
+  };
+
+/** Function declarations */
+
+/**
+ * Initialize a queue.
+ *
+ * @v Queue             The queue to initialize.
+ * @v Depth             The most requests outstanding at once, or 0.
+ */
+extern void WvlDiskQueueInit(WVL_SP_DISK_QUEUE, unsigned int);
+
+/**
+ * Submit a request.
+ *
+ * @v Queue             The queue to submit to.
+ * @v List              The submitting processor's number.
+ * @v Entry             The request's link.
+ * @ret int             Non-zero if the request has a slot and should be
+ *                      issued now, or 0 if it was put on a list.
+ */
+extern int WvlDiskQueueSubmit(
+    WVL_SP_DISK_QUEUE,
+    unsigned int,
+    WVL_SP_DISK_QUEUE_ENTRY
+  );
+
+/**
+ * Note that an issued request has completed.
+ *
+ * @v Queue             The queue the request was submitted to.
+ * @ret WVL_SP_DISK_QUEUE_ENTRY A waiting request which now has the
+ *                      completed request's slot and should be issued,
+ *                      or NULL if none was waiting.
+ */
+extern WVL_SP_DISK_QUEUE_ENTRY WvlDiskQueueComplete(WVL_SP_DISK_QUEUE);
+
+#endif  /* WVL_M_DISKQUEUE_H_ */
@@ -773,6 +773,7 @@ struct S_WVL_DEVICE_THREAD_WORK_ITEM {
 extern DRIVER_OBJECT * WvDriverObj;
 extern UINT32 WvFindDisk;
 extern KSPIN_LOCK WvFindDiskLock;
+extern KEVENT WvFindDiskDone;
 extern S_WVL_RESOURCE_TRACKER WvDriverUsage[1];
 extern WVL_M_LIB BOOLEAN WvlCddbDone;
 
@@ -27,6 +27,12 @@
  * File-backed disk specifics
  */
 
+/** Macros */
+
+/* The default and largest number of concurrent file I/Os per filedisk */
+#define WV_M_FILEDISK_DEFAULT_QUEUE_DEPTH 16
+#define WV_M_FILEDISK_MAX_QUEUE_DEPTH 256
+
 /** Constants */
 
 /** Device flags for the Flags member of an S_WVL_FILEDISK */
@@ -53,24 +59,203 @@ enum E_WVL_FILEDISK_MEDIA_TYPE {
 typedef struct S_WVL_FILEDISK S_WVL_FILEDISK;
 typedef enum E_WVL_FILEDISK_MEDIA_TYPE E_WVL_FILEDISK_MEDIA_TYPE;
 
+typedef struct WV_FILEDISK_FORMAT WV_S_FILEDISK_FORMAT;
+typedef struct WV_FILEDISK_SNAPSHOT
+  WV_S_FILEDISK_SNAPSHOT, * WV_SP_FILEDISK_SNAPSHOT;
+typedef struct WV_FILEDISK_SECTION
+  WV_S_FILEDISK_SECTION, * WV_SP_FILEDISK_SECTION;
+typedef struct WV_FILEDISK_RAM WV_S_FILEDISK_RAM, * WV_SP_FILEDISK_RAM;
+
+/**
+ * Image format open routine.
+ *
+ * @v file              The filedisk's file.
+ * @v path              The path the file was opened with.
+ * @v state             Populated with the format's state for the image,
+ *                      or with NULL if the file isn't of this format.
+ * @v size              Populated with the virtual disk's size, in bytes.
+ * @ret NTSTATUS        The status of the operation.
+ */
+typedef NTSTATUS STDCALL WV_F_FILEDISK_FORMAT_OPEN(
+    IN HANDLE,
+    IN PUNICODE_STRING,
+    OUT PVOID *,
+    OUT PULONGLONG
+  );
+typedef WV_F_FILEDISK_FORMAT_OPEN * WV_FP_FILEDISK_FORMAT_OPEN;
+
+/**
+ * Image format I/O routine.
+ *
+ * @v state             The format's state for the image.
+ * @v mode              The direction of the I/O.
+ * @v offset            The byte offset into the virtual disk.
+ * @v length            The number of bytes to transfer.
+ * @v buffer            The buffer to transfer to or from.
+ * @ret NTSTATUS        The status of the operation.
+ */
+typedef NTSTATUS STDCALL WV_F_FILEDISK_FORMAT_IO(
+    IN PVOID,
+    IN WVL_E_DISK_IO_MODE,
+    IN ULONGLONG,
+    IN UINT32,
+    IN OUT PUCHAR
+  );
+typedef WV_F_FILEDISK_FORMAT_IO * WV_FP_FILEDISK_FORMAT_IO;
+
+/**
+ * Image format free routine.
+ *
+ * @v state             The format's state for the image.
+ */
+typedef VOID STDCALL WV_F_FILEDISK_FORMAT_FREE(IN PVOID);
+typedef WV_F_FILEDISK_FORMAT_FREE * WV_FP_FILEDISK_FORMAT_FREE;
+
 typedef struct WV_FILEDISK_T {
     WV_S_DEV_EXT DevExt;
     WV_S_DEV_T Dev[1];
     WVL_S_DISK_T disk[1];
     HANDLE file;
+    /* The file object for the handle.  Protected by IrpsLock */
+    PFILE_OBJECT FileObj;
     UINT32 hash;
     LARGE_INTEGER offset;
-    WVL_S_THREAD Thread[1];
+    /* Work for the disk, run in order by the shared worker pool */
+    WVL_S_THREAD_QUEUE Queue[1];
     LIST_ENTRY Irps[1];
     KSPIN_LOCK IrpsLock[1];
+    /* Queued to process Irps; IrpsScheduled is non-zero while it is */
+    WVL_S_THREAD_ITEM IrpsItem[1];
+    volatile LONG IrpsScheduled;
     PVOID impersonation;
+    /* File I/Os in flight, and how many may be */
+    volatile LONG Outstanding;
+    LONG QueueDepth;
+    /*
+     * Holds the disk's I/O machinery: one for the disk itself, one for
+     * each file I/O in flight and one while IrpsItem is scheduled.
+     * IoIdle is signalled when it drops to zero, which only happens
+     * once WvFilediskFree_() has dropped the disk's own.
+     */
+    volatile LONG IoRefs;
+    KEVENT IoIdle;
+    /* For an image format other than raw, the format and its state */
+    const WV_S_FILEDISK_FORMAT * Format;
+    PVOID FormatState;
+    /* For a snapshot, the overlay which receives all writes */
+    WV_SP_FILEDISK_SNAPSHOT Snapshot;
+    /* For a raw image accessed through mapped views, the mapping */
+    WV_SP_FILEDISK_SECTION Section;
+    /* For a raw image served from RAM, the image */
+    WV_SP_FILEDISK_RAM Ram;
+    /* Backing file switches, and how long the last held up new I/O (100 ns) */
+    ULONG Swaps;
+    LONGLONG SwapStallTime;
+    /* How long the last hot-swap took to find its file (100 ns) */
+    ULONGLONG HotSwapLookupTime;
+    /* Whether the file is sparse, so unmapped ranges can be released */
+    BOOLEAN Sparse;
   } WV_S_FILEDISK_T, * WV_SP_FILEDISK_T;
 
 extern NTSTATUS STDCALL WvFilediskAttach(IN PIRP);
 extern WV_SP_FILEDISK_T STDCALL WvFilediskCreatePdo(IN WVL_E_DISK_MEDIA_TYPE);
 extern VOID STDCALL WvFilediskHotSwap(IN WV_SP_FILEDISK_T, IN PCHAR);
+extern NTSTATUS STDCALL WvFilediskSetFile(IN WV_SP_FILEDISK_T, IN HANDLE);
+extern NTSTATUS STDCALL WvFilediskSwapFile(
+    IN WV_SP_FILEDISK_T,
+    IN HANDLE,
+    IN PLARGE_INTEGER
+  );
+extern WV_SP_FILEDISK_T STDCALL WvFilediskFromDev(IN WV_SP_DEV_T);
+
+/* From format.c */
+extern NTSTATUS STDCALL WvFilediskFormatOpen(
+    IN WV_SP_FILEDISK_T,
+    IN HANDLE,
+    IN PUNICODE_STRING,
+    OUT PULONGLONG
+  );
+extern NTSTATUS STDCALL WvFilediskFileIo(
+    IN PFILE_OBJECT,
+    IN WVL_E_DISK_IO_MODE,
+    IN LONGLONG,
+    IN UINT32,
+    IN OUT PVOID
+  );
+extern NTSTATUS STDCALL WvFilediskFileFlush(IN PFILE_OBJECT);
+extern NTSTATUS STDCALL WvFilediskFileZero(
+    IN PFILE_OBJECT,
+    IN LONGLONG,
+    IN LONGLONG
+  );
+
+/* From vhd.c */
+extern const WV_S_FILEDISK_FORMAT WvFilediskVhdFormat;
+
+/* From snapshot.c */
+extern NTSTATUS STDCALL WvFilediskSnapshotOpen(
+    IN WV_SP_FILEDISK_T,
+    IN PUNICODE_STRING,
+    IN PUNICODE_STRING
+  );
+extern VOID STDCALL WvFilediskSnapshotFree(IN WV_SP_FILEDISK_SNAPSHOT);
+extern NTSTATUS STDCALL WvFilediskSnapshotIo(
+    IN WV_SP_FILEDISK_T,
+    IN WVL_E_DISK_IO_MODE,
+    IN ULONGLONG,
+    IN UINT32,
+    IN OUT PUCHAR
+  );
+extern NTSTATUS STDCALL WvFilediskSnapshotControl(
+    IN WV_SP_FILEDISK_T,
+    IN UINT32
+  );
+extern NTSTATUS STDCALL WvFilediskSnapshotUnmap(
+    IN WV_SP_FILEDISK_T,
+    IN ULONGLONG,
+    IN ULONGLONG
+  );
+
+/* From section.c */
+extern NTSTATUS STDCALL WvFilediskSectionOpen(IN WV_SP_FILEDISK_T);
+extern VOID STDCALL WvFilediskSectionFree(IN WV_SP_FILEDISK_SECTION);
+extern NTSTATUS STDCALL WvFilediskSectionIo(
+    IN WV_SP_FILEDISK_T,
+    IN WVL_E_DISK_IO_MODE,
+    IN ULONGLONG,
+    IN UINT32,
+    IN OUT PUCHAR
+  );
+extern NTSTATUS STDCALL WvFilediskSectionFlush(IN WV_SP_FILEDISK_T);
+
+/* From ram.c */
+extern NTSTATUS STDCALL WvFilediskRamOpen(IN WV_SP_FILEDISK_T, IN BOOLEAN);
+extern VOID STDCALL WvFilediskRamStop(IN WV_SP_FILEDISK_RAM);
+extern VOID STDCALL WvFilediskRamFree(IN WV_SP_FILEDISK_RAM);
+extern BOOLEAN STDCALL WvFilediskRamLoaded(IN WV_SP_FILEDISK_RAM);
+extern NTSTATUS STDCALL WvFilediskRamIo(
+    IN WV_SP_FILEDISK_T,
+    IN WVL_E_DISK_IO_MODE,
+    IN ULONGLONG,
+    IN UINT32,
+    IN OUT PUCHAR
+  );
+extern VOID STDCALL WvFilediskRamUnmap(
+    IN WV_SP_FILEDISK_T,
+    IN ULONGLONG,
+    IN ULONGLONG
+  );
 
 /** Struct/union type definitions */
+
+/** An image format which is translated to file I/O */
+struct WV_FILEDISK_FORMAT {
+    PCHAR Name;
+    WV_FP_FILEDISK_FORMAT_OPEN Open;
+    WV_FP_FILEDISK_FORMAT_IO Io;
+    WV_FP_FILEDISK_FORMAT_FREE Free;
+  };
+
 struct S_WVL_FILEDISK {
     /** This must be the first member of all extension types */
     WV_S_DEV_EXT DeviceExtension[1];
@@ -0,0 +1,120 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WV_M_G4DMAP_H_
+#  define WV_M_G4DMAP_H_
+
+/**
+ * @file
+ *
+ * GRUB4DOS drive map table decoder.
+ *
+ * GRUB4DOS keeps its drive mappings in a table just past the start of
+ * its INT 0x13 handler's segment.  This decodes every slot of such a
+ * table from a copy of low memory, working out what kind of disk each
+ * one describes and where that disk's data lives.  This code includes
+ * no OS headers, so it can be run against a dump of low memory taken
+ * from any machine.
+ */
+
+/** Macros */
+
+/* The number of slots in the table, from GRUB4DOS' stage2/shared.h */
+#define WV_M_G4D_MAP_SLOTS 8
+
+/* The size of each slot */
+#define WV_M_G4D_MAP_SLOT_SIZE 24
+
+/* Where the table is, relative to the INT 0x13 handler's segment */
+#define WV_M_G4D_MAP_TABLE_OFFSET 0x20
+
+/** Object types */
+typedef enum WV_G4D_MAP_KIND WV_E_G4D_MAP_KIND;
+typedef enum WV_G4D_MAP_MEDIA WV_E_G4D_MAP_MEDIA;
+typedef struct WV_G4D_MAP WV_S_G4D_MAP, * WV_SP_G4D_MAP;
+
+/** Enumerations */
+
+/* What a slot maps its source drive to */
+enum WV_G4D_MAP_KIND {
+    /* Another whole drive, which the OS can already see */
+    WvG4dMapKindRemap,
+    /* An image in RAM */
+    WvG4dMapKindRam,
+    /* A run of sectors on another drive */
+    WvG4dMapKindSector,
+    /* A partition on another drive, in place */
+    WvG4dMapKindInSitu,
+    WvG4dMapKinds
+  };
+
+/* The kind of drive a slot emulates */
+enum WV_G4D_MAP_MEDIA {
+    WvG4dMapMediaFloppy,
+    WvG4dMapMediaHard,
+    WvG4dMapMediaOptical,
+    WvG4dMapMedias
+  };
+
+/** Struct/union type definitions */
+
+/** A decoded drive map slot */
+struct WV_G4D_MAP {
+    /** The slot's index within the table */
+    unsigned int Slot;
+    WV_E_G4D_MAP_KIND Kind;
+    WV_E_G4D_MAP_MEDIA Media;
+    /** The emulated drive's sector size */
+    unsigned int SectorSize;
+    /** The BIOS drive numbers of the emulated and the backing drive */
+    unsigned char SourceDrive;
+    unsigned char DestDrive;
+    /** The emulated drive's geometry.  Never 0 */
+    unsigned int Heads;
+    unsigned int Sectors;
+    /**
+     * Where the data starts, in bytes: a physical address for a RAM
+     * mapping, else an offset into the backing drive.  0 for a remap
+     */
+    unsigned long long Offset;
+    /** The length of the data, in bytes.  0 for a remap */
+    unsigned long long Length;
+  };
+
+/** Function declarations */
+
+/**
+ * Decode a GRUB4DOS drive map table.
+ *
+ * @v LowMem            A copy of low memory.
+ * @v LowMemLen         The length of the copy.
+ * @v Table             The physical address of the table.
+ * @v Maps              Populated with the used slots, in table order.
+ *                      Must have room for WV_M_G4D_MAP_SLOTS.
+ * @ret unsigned int    The number of used slots.
+ *
+ * GRUB4DOS keeps the table packed, so the first empty slot ends it.
+ * A table which doesn't fit within the copy yields no slots.
+ */
+extern unsigned int WvG4dMapScan(
+    const unsigned char *,
+    unsigned long,
+    unsigned long,
+    WV_SP_G4D_MAP
+  );
+
+#endif  /* WV_M_G4DMAP_H_ */
@@ -25,47 +25,39 @@
  * GRUB4DOS mini-driver
  */
 
-/** Macros */
-#define M_G4D_SLOTS 8
-
 /** Object types */
-typedef struct S_WV_G4D_DRIVE_MAPPING_
-  S_WV_G4D_DRIVE_MAPPING,
-  * SP_WV_G4D_DRIVE_MAPPING;
 typedef struct S_WV_G4D_BUS S_WV_G4D_BUS;
 
-/** Function declarations */
-extern DEVICE_OBJECT * WvFilediskCreateG4dDisk(
-    SP_WV_G4D_DRIVE_MAPPING,
-    DEVICE_OBJECT * BusDeviceObject,
-    WVL_E_DISK_MEDIA_TYPE,
-    UINT32
-  );
-extern DEVICE_OBJECT * WvRamdiskCreateG4dDisk(
-    SP_WV_G4D_DRIVE_MAPPING,
+/** Function types */
+typedef DEVICE_OBJECT * F_WV_G4D_CREATE_DISK(
+    WV_SP_G4D_MAP,
     DEVICE_OBJECT * BusDeviceObject,
     WVL_E_DISK_MEDIA_TYPE,
     UINT32
   );
 
+/** Function declarations */
+extern F_WV_G4D_CREATE_DISK WvFilediskCreateG4dDisk;
+extern F_WV_G4D_CREATE_DISK WvRamdiskCreateG4dDisk;
+
 /* From ../src/winvblock/grub4dos/g4dbus.c */
 
 /**
- * Process a GRUB4DOS drive mapping slot and produce a PDO
+ * Process a decoded GRUB4DOS drive mapping and produce a PDO
  *
  * @param BusDeviceObject
  *   The intended parent bus device for the resulting PDO
  *
- * @param Slot
- *   Points to a G4D drive mapping slot near the G4D INT 0x13 hook
+ * @param Map
+ *   Points to a drive mapping decoded from the G4D drive map table
  *
  * @return
  *   A pointer to the resulting DEVICE_OBJECT, or a null pointer,
- *   upon failure
+ *   upon failure or for a mapping which needs no PDO
  */
 extern DEVICE_OBJECT * WvG4dProcessSlot(
     IN DEVICE_OBJECT * BusDeviceObject,
-    IN S_WV_G4D_DRIVE_MAPPING * Slot
+    IN WV_S_G4D_MAP * Map
   );
 
 /* From ../src/winvblock/grub4dos/fdo.c */
@@ -75,25 +67,6 @@ extern DRIVER_DISPATCH WvG4dIrpDispatch;
 
 /** Struct/union type definitions */
 
-/* From GRUB4DOS 0.4.4's stage2/shared.h */
-struct S_WV_G4D_DRIVE_MAPPING_ {
-    UCHAR SourceDrive;
-    UCHAR DestDrive;
-    UCHAR MaxHead;
-    UCHAR MaxSector:6;
-    UCHAR RestrictionX:1;
-    UINT16 DestMaxCylinder:13;
-    UINT16 SourceODD:1;
-    UINT16 DestODD:1;
-    UINT16 DestLBASupport:1;
-    UCHAR DestMaxHead;
-    UCHAR DestMaxSector:6;
-    UCHAR RestrictionY:1;
-    UCHAR InSituOption:1;
-    UINT64 SectorStart;
-    UINT64 SectorCount;
-  };
-
 /** A GRUB4DOS FDO device extension */
 struct S_WV_G4D_BUS {
     /** This must be the first member of all extension types */
@@ -106,17 +79,20 @@ struct S_WV_G4D_BUS {
     DEVICE_OBJECT * PhysicalDeviceObject;
 
     /**
-     * PnP bus relations.
-     * A GRUB4DOS FDO can have only 9 children, at most
+     * PnP bus relations, with room for a child per drive mapping
+     * plus one for the previous INT 0x13 handler
      */
-    DEVICE_RELATIONS BusRelations[1];
-    DEVICE_OBJECT * Padding_[M_G4D_SLOTS];
+    DEVICE_RELATIONS * BusRelations;
 
-    /** A copy of the drive mappings */
-    S_WV_G4D_DRIVE_MAPPING DriveMappings[M_G4D_SLOTS];
+    /** The drive mappings, decoded when the bus was started */
+    ULONG MapCount;
+    WV_S_G4D_MAP Maps[WV_M_G4D_MAP_SLOTS];
 
-    /** Tracks which of the 9 possible nodes need a PDO */
-    USHORT NodesNeeded;
+    /**
+     * Tracks which nodes need a PDO.  Bit MapCount is for the
+     * previous INT 0x13 handler
+     */
+    ULONG NodesNeeded;
 
     /** A record of the previous INT 0x13 handler in the chain */
     S_X86_SEG16OFF16 PreviousInt13hHandler[1];
@@ -35,12 +35,28 @@
 #define IOCTL_HTTP_DISK_CONNECT     CTL_CODE(FILE_DEVICE_HTTP_DISK, 0x800, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
 #define IOCTL_HTTP_DISK_DISCONNECT  CTL_CODE(FILE_DEVICE_HTTP_DISK, 0x801, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
 
+#define HTTP_DISK_MAX_MIRRORS       7
+
+typedef struct _HTTP_DISK_MIRROR {
+    ULONG   Address;
+    USHORT  Port;
+    USHORT  HostNameLength;
+    UCHAR   HostName[256];
+    USHORT  FileNameLength;
+    UCHAR   FileName[256];
+} HTTP_DISK_MIRROR, *PHTTP_DISK_MIRROR;
+
 typedef struct _HTTP_DISK_INFORMATION {
     BOOLEAN Optical;
     ULONG   Address;
     USHORT  Port;
     USHORT  HostNameLength;
     UCHAR   HostName[256];
+    BOOLEAN Overlay;
+    ULONG   OverlayMaxMegabytes;
+    WCHAR   OverlayFileName[260];
+    USHORT  MirrorCount;
+    HTTP_DISK_MIRROR Mirrors[HTTP_DISK_MAX_MIRRORS];
     USHORT  FileNameLength;
     UCHAR   FileName[1];
 } HTTP_DISK_INFORMATION, *PHTTP_DISK_INFORMATION;
@@ -52,7 +68,9 @@ typedef struct HTTPDISK_DEV {
     PUCHAR          host_name;
     PUCHAR          file_name;
     LARGE_INTEGER   file_size;
-    int             socket;
+    struct HTTPDISK_MIRRORS * mirrors;
+    struct HTTPDISK_CIMAGE * cimage;
+    struct HTTPDISK_OVERLAY * overlay;
     LIST_ENTRY      list_head;
     KSPIN_LOCK      list_lock;
     KEVENT          request_event;
@@ -0,0 +1,85 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef WV_M_LZ4_H_
+#  define WV_M_LZ4_H_
+
+/**
+ * @file
+ *
+ * LZ4 block compression and decompression.
+ *
+ * A codec for the LZ4 block format, without the frame format around
+ * it.  This code includes no OS headers, so that the packer, the
+ * benchmarks and the drivers can all share it, from src/lz4.
+ */
+
+/** Macros */
+
+/* The largest hash table size, as a power of two */
+#define LZ4_M_MAX_HASH_BITS 16
+
+/* The number of entries in a compressor's hash table */
+#define LZ4_M_TABLE_ENTRIES(HashBits) ((1 << (HashBits)) + 1)
+
+/** Function declarations */
+
+/**
+ * Decompress an LZ4 block.
+ *
+ * @v Src               The compressed data.
+ * @v SrcLen            The length of the compressed data.
+ * @v Dst               The buffer to decompress into.
+ * @v DstLen            The size of the destination buffer.
+ * @ret int             The decompressed length, or -1 if the data is
+ *                      corrupt or would overrun the destination.
+ */
+extern int Lz4Decompress(
+    const unsigned char *,
+    unsigned int,
+    unsigned char *,
+    unsigned int
+  );
+
+/**
+ * Compress an LZ4 block.
+ *
+ * @v Src               The data to compress.
+ * @v SrcLen            The length of the data.
+ * @v Dst               The buffer to compress into.
+ * @v DstCap            The size of the destination buffer.
+ * @v Table             A hash table of LZ4_M_TABLE_ENTRIES(HashBits)
+ *                      entries, kept between calls.
+ * @v HashBits          The size of the hash table, as a power of two,
+ *                      from 8 to LZ4_M_MAX_HASH_BITS.
+ * @ret int             The compressed length, or -1 if the result
+ *                      would not fit in DstCap bytes.
+ *
+ * A bigger table finds more matches in bigger inputs.  The table is
+ * the caller's, so that the compressor is re-entrant.  It needn't be
+ * cleared between calls.  A table which starts zeroed gives the same
+ * output for the same input, every time; any other still works.
+ */
+extern int Lz4Compress(
+    const unsigned char *,
+    unsigned int,
+    unsigned char *,
+    unsigned int,
+    unsigned int *,
+    unsigned int
+  );
+
+#endif  /* WV_M_LZ4_H_ */
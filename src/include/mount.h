@@ -42,6 +42,62 @@
     FILE_READ_DATA | FILE_WRITE_DATA    \
     )
 
+/*
+ * Like IOCTL_FILE_ATTACH, but the base file's path is followed by the
+ * path of an overlay file, which receives all writes.
+ */
+#  define IOCTL_FILE_ATTACH_SNAPSHOT    \
+  CTL_CODE(                             \
+    FILE_DEVICE_CONTROLLER,             \
+    0x806,                              \
+    METHOD_BUFFERED,                    \
+    FILE_READ_DATA | FILE_WRITE_DATA    \
+    )
+/* Commit or discard a snapshot's overlay.  Takes a WV_S_MOUNT_SNAPSHOT */
+#  define IOCTL_FILE_SNAPSHOT           \
+  CTL_CODE(                             \
+    FILE_DEVICE_CONTROLLER,             \
+    0x807,                              \
+    METHOD_BUFFERED,                    \
+    FILE_READ_DATA | FILE_WRITE_DATA    \
+    )
+
+/*
+ * Like IOCTL_FILE_ATTACH, but takes a WV_S_MOUNT_DISK_EX, which
+ * carries WV_MOUNT_FLAG options, followed by the file's path.
+ */
+#  define IOCTL_FILE_ATTACH_EX          \
+  CTL_CODE(                             \
+    FILE_DEVICE_CONTROLLER,             \
+    0x808,                              \
+    METHOD_BUFFERED,                    \
+    FILE_READ_DATA | FILE_WRITE_DATA    \
+    )
+
+/*
+ * Create a RAM disk of a given size, whose memory is allocated as it
+ * is written.  Takes a WV_S_MOUNT_RAMDISK.
+ */
+#  define IOCTL_RAM_ATTACH              \
+  CTL_CODE(                             \
+    FILE_DEVICE_CONTROLLER,             \
+    0x809,                              \
+    METHOD_BUFFERED,                    \
+    FILE_READ_DATA | FILE_WRITE_DATA    \
+    )
+
+/*
+ * Fetch the statistics of a compressed RAM disk.  Takes and returns a
+ * WV_S_MOUNT_RAMDISK_STATS, whose unit_num selects the RAM disk.
+ */
+#  define IOCTL_RAM_STATS               \
+  CTL_CODE(                             \
+    FILE_DEVICE_CONTROLLER,             \
+    0x80A,                              \
+    METHOD_BUFFERED,                    \
+    FILE_READ_DATA | FILE_WRITE_DATA    \
+    )
+
 typedef struct WV_MOUNT_DISK {
     char type;
     int cylinders;
@@ -49,4 +105,54 @@ typedef struct WV_MOUNT_DISK {
     int sectors;
   } WV_S_MOUNT_DISK, * WV_SP_MOUNT_DISK;
 
+enum WV_MOUNT_FLAG {
+    /* Access the file through mapped views, rather than file I/O */
+    WvMountFlagMapped = 1 << 0,
+    /* Serve the file from RAM, loading it in the background */
+    WvMountFlagRam = 1 << 1,
+    /* With WvMountFlagRam, write changes back to the file upon detach */
+    WvMountFlagWriteBack = 1 << 2,
+    /* Keep a RAM disk's contents compressed */
+    WvMountFlagCompressed = 1 << 3,
+    WvMountFlagZero = 0
+  };
+
+typedef struct WV_MOUNT_DISK_EX {
+    WV_S_MOUNT_DISK disk;
+    UINT32 flags;
+  } WV_S_MOUNT_DISK_EX, * WV_SP_MOUNT_DISK_EX;
+
+typedef struct WV_MOUNT_RAMDISK {
+    WV_S_MOUNT_DISK disk;
+    /* The size of the disk, in bytes */
+    UINT64 size;
+    /* WV_MOUNT_FLAG options */
+    UINT32 flags;
+  } WV_S_MOUNT_RAMDISK, * WV_SP_MOUNT_RAMDISK;
+
+typedef struct WV_MOUNT_RAMDISK_STATS {
+    UINT32 unit_num;
+    /* Pages kept as a single repeated word */
+    UINT64 same_pages;
+    /* Pages kept compressed, and pages which wouldn't compress */
+    UINT64 packed_pages;
+    UINT64 stored_pages;
+    /* The size of the packed and stored pages, before and after */
+    UINT64 orig_bytes;
+    UINT64 compr_bytes;
+    /* All memory held for the disk's contents */
+    UINT64 mem_used;
+  } WV_S_MOUNT_RAMDISK_STATS, * WV_SP_MOUNT_RAMDISK_STATS;
+
+enum WV_MOUNT_SNAPSHOT_ACTION {
+    WvMountSnapshotCommit,
+    WvMountSnapshotDiscard,
+    WvMountSnapshotActions
+  };
+
+typedef struct WV_MOUNT_SNAPSHOT {
+    UINT32 unit_num;
+    UINT32 action;
+  } WV_S_MOUNT_SNAPSHOT, * WV_SP_MOUNT_SNAPSHOT;
+
 #endif  /* WV_M_MOUNT_H_ */
@@ -79,4 +79,80 @@ msvhd__footer_swap_endian (
   byte__rev_array_union ( footer_ptr->checksum );
 }
 
+/* .VHD disk types */
+enum WV_MSVHD_DISK_TYPE {
+    WvMsvhdDiskTypeNone = 0,
+    WvMsvhdDiskTypeFixed = 2,
+    WvMsvhdDiskTypeDynamic = 3,
+    WvMsvhdDiskTypeDifferencing = 4
+  };
+
+/* BAT entry for a block which hasn't been allocated */
+#define WV_M_MSVHD_BAT_UNUSED 0xFFFFFFFF
+
+/* Parent locator platform codes, as they read in host byte order */
+#define WV_M_MSVHD_PLAT_W2RU 0x57327275
+#define WV_M_MSVHD_PLAT_W2KU 0x57326B75
+
+/* A parent locator entry in the dynamic disk header */
+#ifdef _MSC_VER
+#  pragma pack(1)
+#endif
+struct WV_MSVHD_PARENT_LOC {
+    byte__array_union(UINT32, platform_code);
+    byte__array_union(UINT32, platform_data_space);
+    byte__array_union(UINT32, platform_data_len);
+    byte__array_union(UINT32, reserved);
+    byte__array_union(ULONGLONG, platform_data_offset);
+  } __attribute__((__packed__));
+typedef struct WV_MSVHD_PARENT_LOC
+  WV_S_MSVHD_PARENT_LOC, * WV_SP_MSVHD_PARENT_LOC;
+
+/* The dynamic (and differencing) disk header format */
+struct WV_MSVHD_DYN_HEADER {
+    char cookie[8];
+    byte__array_union(ULONGLONG, data_offset);
+    byte__array_union(ULONGLONG, table_offset);
+    byte__array_union(UINT32, header_ver);
+    byte__array_union(UINT32, max_table_entries);
+    byte__array_union(UINT32, block_size);
+    byte__array_union(UINT32, checksum);
+    char parent_uid[16];
+    byte__array_union(UINT32, parent_timestamp);
+    byte__array_union(UINT32, reserved1);
+    /* Big-endian UTF-16 */
+    char parent_name[512];
+    WV_S_MSVHD_PARENT_LOC parent_loc[8];
+    char reserved2[256];
+  } __attribute__((__packed__));
+typedef struct WV_MSVHD_DYN_HEADER
+  WV_S_MSVHD_DYN_HEADER, * WV_SP_MSVHD_DYN_HEADER;
+#ifdef _MSC_VER
+#  pragma pack()
+#endif
+
+/* Function body in header so user-land utility links without WinVBlock */
+static VOID STDCALL
+msvhd__dyn_header_swap_endian (
+  WV_SP_MSVHD_DYN_HEADER header_ptr
+ )
+{
+  int i;
+
+  byte__rev_array_union ( header_ptr->data_offset );
+  byte__rev_array_union ( header_ptr->table_offset );
+  byte__rev_array_union ( header_ptr->header_ver );
+  byte__rev_array_union ( header_ptr->max_table_entries );
+  byte__rev_array_union ( header_ptr->block_size );
+  byte__rev_array_union ( header_ptr->checksum );
+  byte__rev_array_union ( header_ptr->parent_timestamp );
+  for ( i = 0; i < 8; i++ )
+    {
+      byte__rev_array_union ( header_ptr->parent_loc[i].platform_code );
+      byte__rev_array_union ( header_ptr->parent_loc[i].platform_data_space );
+      byte__rev_array_union ( header_ptr->parent_loc[i].platform_data_len );
+      byte__rev_array_union ( header_ptr->parent_loc[i].platform_data_offset );
+    }
+}
+
 #endif  /* WV_M_MSVHD_H_ */
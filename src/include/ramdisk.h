@@ -25,15 +25,90 @@
  * RAM disk specifics.
  */
 
+/* The size of a chunk of a RAM disk allocated at runtime */
+#define WV_M_RAMDISK_CHUNK_SIZE (2 * 1024 * 1024)
+
+/* The number of locks guarding the users of a RAM disk's chunks */
+#define WV_M_RAMDISK_CHUNK_STRIPES 64
+
+/* The disk's memory is mapped in windows of this size */
+#define WV_M_RAMDISK_WINDOW_SIZE (4 * 1024 * 1024)
+
+typedef struct WV_RAMDISK_ZSTORE
+  WV_S_RAMDISK_ZSTORE, * WV_SP_RAMDISK_ZSTORE;
+typedef struct WV_RAMDISK_VERIFY
+  WV_S_RAMDISK_VERIFY, * WV_SP_RAMDISK_VERIFY;
+struct WV_MOUNT_RAMDISK_STATS;
+
 typedef struct WV_RAMDISK_T {
     WV_S_DEV_EXT DevExt;
     WV_S_DEV_T Dev[1];
     WVL_S_DISK_T disk[1];
-    UINT32 DiskBuf;
-    UINT32 DiskSize;
+    /* The physical address of the disk's memory */
+    ULONGLONG DiskBuf;
+    /* The size of the disk, in sectors */
+    ULONGLONG DiskSize;
     WV_FP_DEV_FREE prev_free;
+    /* Cached mappings of the disk's memory, made upon first use */
+    PUCHAR * Windows;
+    /* Whether large writes may use non-temporal stores */
+    BOOLEAN Stream;
+    /* For a RAM disk allocated at runtime, its chunks, or NULL */
+    PUCHAR * Chunks;
+    ULONGLONG ChunkCount;
+    /*
+     * How many transfers are using each chunk, which an unmap won't
+     * free.  Guarded by the chunk's lock, from ChunkLocks.
+     */
+    PLONG ChunkUsers;
+    KSPIN_LOCK ChunkLocks[WV_M_RAMDISK_CHUNK_STRIPES];
+    /* For a compressed RAM disk, its store, or NULL */
+    WV_SP_RAMDISK_ZSTORE ZStore;
+    /* For a RAM disk with a hash manifest, its state, or NULL */
+    WV_SP_RAMDISK_VERIFY Verify;
   } WV_S_RAMDISK_T, * WV_SP_RAMDISK_T;
 
 extern WV_SP_RAMDISK_T WvRamdiskCreatePdo(IN WVL_E_DISK_MEDIA_TYPE);
+extern PUCHAR STDCALL WvRamdiskWindow(IN WV_SP_RAMDISK_T, IN UINT32);
+
+/* From dynamic.c */
+extern NTSTATUS STDCALL WvRamdiskAttach(IN PIRP);
+extern WV_SP_RAMDISK_T STDCALL WvRamdiskFromDev(IN WV_SP_DEV_T);
+extern NTSTATUS STDCALL WvRamdiskChunkIo(
+    IN WV_SP_RAMDISK_T,
+    IN WVL_E_DISK_IO_MODE,
+    IN ULONGLONG,
+    IN UINT32,
+    IN OUT PUCHAR
+  );
+
+/* From compress.c */
+extern NTSTATUS STDCALL WvRamdiskZCreate(IN WV_SP_RAMDISK_T);
+extern VOID STDCALL WvRamdiskZFree(IN WV_SP_RAMDISK_T);
+extern NTSTATUS STDCALL WvRamdiskZIo(
+    IN WV_SP_RAMDISK_T,
+    IN WVL_E_DISK_IO_MODE,
+    IN ULONGLONG,
+    IN UINT32,
+    IN OUT PUCHAR
+  );
+extern VOID STDCALL WvRamdiskZUnmap(
+    IN WV_SP_RAMDISK_T,
+    IN ULONGLONG,
+    IN ULONGLONG
+  );
+extern VOID STDCALL WvRamdiskZStats(
+    IN WV_SP_RAMDISK_T,
+    OUT struct WV_MOUNT_RAMDISK_STATS *
+  );
+
+/* From verify.c */
+extern NTSTATUS STDCALL WvRamdiskVerifyOpen(IN WV_SP_RAMDISK_T);
+extern NTSTATUS STDCALL WvRamdiskVerifyRange(
+    IN WV_SP_RAMDISK_T,
+    IN ULONGLONG,
+    IN UINT32
+  );
+extern VOID STDCALL WvRamdiskVerifyFree(IN WV_SP_RAMDISK_T);
 
 #endif  /* WV_M_RAMDISK_H_ */
@@ -0,0 +1,90 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WV_M_RAMHASH_H_
+#  define WV_M_RAMHASH_H_
+
+/**
+ * @file
+ *
+ * RAM disk hash manifest format.
+ *
+ * A disk image which a boot loader copies into RAM can carry a hash of
+ * each of its blocks, so that WinVBlock can check every block before
+ * it is used.  The image's data, padded with zeroes to a whole number
+ * of blocks, is followed by one 64-bit hash per block, then by zeroes
+ * and finally by a 512-byte sector holding a WV_S_RAMHASH_FOOTER,
+ * which ends the image.  The hashes are XXH64 with a seed of 0, and
+ * the footer's ManifestHash is the XXH64 of the hashes themselves.
+ * All fields are little-endian.
+ *
+ * Only standard C types are used, so this header can be shared by the
+ * driver and by the user-land tool on any platform with a 32-bit int.
+ */
+
+/** Macros */
+
+/* The signature at the start of the footer */
+#define WV_M_RAMHASH_MAGIC "WVRAMHSH"
+#define WV_M_RAMHASH_MAGIC_LEN 8
+
+#define WV_M_RAMHASH_VERSION 1
+
+/* The footer fills the image's last sector */
+#define WV_M_RAMHASH_FOOTER_SIZE 512
+
+/* The range of block sizes, as powers of two */
+#define WV_M_RAMHASH_MIN_BLOCK_SHIFT 12
+#define WV_M_RAMHASH_MAX_BLOCK_SHIFT 22
+#define WV_M_RAMHASH_DEFAULT_BLOCK_SHIFT 16
+
+/* So that the hashes' length fits in 31 bits */
+#define WV_M_RAMHASH_MAX_BLOCKS 0x0FFFFFFF
+
+/** Object types */
+typedef struct WV_RAMHASH_FOOTER WV_S_RAMHASH_FOOTER, * WV_SP_RAMHASH_FOOTER;
+
+/** Struct/union type definitions */
+
+/** The footer, at the start of the image's last sector */
+struct WV_RAMHASH_FOOTER {
+    char Magic[WV_M_RAMHASH_MAGIC_LEN];
+    unsigned int Version;
+    unsigned int BlockShift;
+    /** The hashes start at BlockCount << BlockShift */
+    unsigned int BlockCount;
+    unsigned int Reserved;
+    unsigned long long ManifestHash;
+  };
+
+/** Function declarations */
+
+/**
+ * Hash a buffer with XXH64.
+ *
+ * @v Buf               The data to hash.
+ * @v Len               The length of the data.
+ * @v Seed              The seed.
+ * @ret unsigned long long The hash.
+ */
+extern unsigned long long WvRamhashXxh64(
+    const void *,
+    unsigned long,
+    unsigned long long
+  );
+
+#endif  /* WV_M_RAMHASH_H_ */
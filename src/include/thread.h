@@ -27,6 +27,18 @@
 /*** Macros */
 #define M_THREAD_H_
 
+/* The most worker threads the shared pool will start */
+#define WVL_M_THREAD_POOL_MAX_WORKERS 64
+
+/* The most workers started for the processors; the rest are reserved */
+#define WVL_M_THREAD_POOL_MAX_BASE_WORKERS 16
+
+/* How long a worker started for a reservation idles before it's reaped */
+#define WVL_M_THREAD_POOL_IDLE_SECONDS 10
+
+/* How many items a queue runs before yielding its pool worker */
+#define WVL_M_THREAD_QUEUE_BATCH 32
+
 /*** Constants */
 enum E_WVL_THREAD_STATE_ {
     WvlThreadStateNotStarted,
@@ -41,6 +53,7 @@ enum E_WVL_THREAD_STATE_ {
 typedef struct S_WVL_THREAD_ITEM_ WVL_S_THREAD_ITEM, * WVL_SP_THREAD_ITEM;
 typedef enum E_WVL_THREAD_STATE_ WVL_E_THREAD_STATE, * WVL_EP_THREAD_STATE;
 typedef struct S_WVL_THREAD_ WVL_S_THREAD, * WVL_SP_THREAD;
+typedef struct S_WVL_THREAD_QUEUE_ WVL_S_THREAD_QUEUE, * WVL_SP_THREAD_QUEUE;
 
 /*** Function types */
 typedef VOID STDCALL WVL_F_THREAD_ITEM(IN OUT WVL_SP_THREAD_ITEM);
@@ -57,6 +70,20 @@ extern WVL_M_LIB BOOLEAN STDCALL WvlThreadAddItem(
 extern WVL_M_LIB WVL_SP_THREAD_ITEM STDCALL WvlThreadGetItem(IN WVL_SP_THREAD);
 extern WVL_M_LIB VOID STDCALL WvlThreadTest(IN OUT WVL_SP_THREAD_ITEM);
 extern WVL_M_LIB VOID WvlThreadTestMsg(IN PCHAR);
+extern WVL_M_LIB NTSTATUS STDCALL WvlThreadPoolStart(void);
+extern WVL_M_LIB VOID STDCALL WvlThreadPoolStop(void);
+extern WVL_M_LIB VOID STDCALL WvlThreadPoolReserve(void);
+extern WVL_M_LIB VOID STDCALL WvlThreadPoolRelease(void);
+extern WVL_M_LIB BOOLEAN STDCALL WvlThreadPoolAddItem(IN WVL_SP_THREAD_ITEM);
+extern WVL_M_LIB VOID STDCALL WvlThreadQueueInit(
+    OUT WVL_SP_THREAD_QUEUE,
+    IN BOOLEAN
+  );
+extern WVL_M_LIB BOOLEAN STDCALL WvlThreadQueueAddItem(
+    IN WVL_SP_THREAD_QUEUE,
+    IN WVL_SP_THREAD_ITEM
+  );
+extern WVL_M_LIB VOID STDCALL WvlThreadQueueFlush(IN WVL_SP_THREAD_QUEUE);
 
 /*** Struct/union definitions */
 struct S_WVL_THREAD_ITEM_ {
@@ -73,4 +100,15 @@ struct S_WVL_THREAD_ {
     PETHREAD Thread;
   };
 
+/* Items added to a queue are run in order, one at a time, by the pool. */
+struct S_WVL_THREAD_QUEUE_ {
+    WVL_S_THREAD_ITEM Main;
+    LIST_ENTRY Items;
+    KSPIN_LOCK Lock;
+    BOOLEAN Scheduled;
+    /* Holds a pool reservation while it's scheduled */
+    BOOLEAN Blocking;
+    PKEVENT Idle;
+  };
+
 #endif  /* M_THREAD_H_ */
@@ -0,0 +1,75 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WV_M_USERTEST_H_
+#  define WV_M_USERTEST_H_
+
+/**
+ * @file
+ *
+ * A small harness shared by the user-land test tools.
+ *
+ * A test calls TestBegin() with its name, makes its checks with
+ * CHECK(), then hands what TestBegin() returned to TestEnd(), which
+ * reports "ok" or "FAILED" for that test alone.  TestSummary() prints
+ * the total and returns the exit status for main().  Each tool
+ * includes this header once, from a single source file.
+ */
+
+#include <stdio.h>
+
+/** Macros */
+
+#define CHECK(Cond) Check((Cond), #Cond, __FILE__, __LINE__)
+
+/** Objects */
+
+static int              Failures;
+
+/** Function definitions */
+
+static int Check(int Cond, const char* Text, const char* File, int Line)
+{
+    if (!Cond)
+    {
+        fprintf(stderr, "%s:%d: check failed: %s\n", File, Line, Text);
+        Failures++;
+    }
+
+    return Cond;
+}
+
+/* Name a test on stdout; returns the count to hand to TestEnd() */
+static int TestBegin(const char* Name)
+{
+    printf("%-24s", Name);
+    fflush(stdout);
+    return Failures;
+}
+
+static void TestEnd(int Failed)
+{
+    printf("%s\n", Failures == Failed ? "ok" : "FAILED");
+}
+
+static int TestSummary(void)
+{
+    printf("%d failure(s)\n", Failures);
+    return Failures ? 1 : 0;
+}
+
+#endif  /* WV_M_USERTEST_H_ */
@@ -0,0 +1,167 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WV_M_ZPAGE_H_
+#  define WV_M_ZPAGE_H_
+
+/**
+ * @file
+ *
+ * Compressed RAM disk pages and their slab allocator.
+ *
+ * A compressed RAM disk keeps each 4 KiB page LZ4-compressed, filled
+ * with one repeated word, or as-is.  Compressed and as-is pages live in
+ * slab objects whose sizes are multiples of 64 bytes.  This code does
+ * no locking and includes no OS headers, so the driver wraps it with
+ * its own locks and memory, and it can be measured in user-land.
+ */
+
+/** Macros */
+
+/* The unit of compression */
+#define WV_M_ZPAGE_SIZE 4096
+
+/* The hash table size for compressing a page, as a power of two */
+#define WV_M_ZPAGE_HASH_BITS 12
+
+/* The number of entries in that hash table, as LZ4_M_TABLE_ENTRIES() */
+#define WV_M_ZPAGE_TABLE_ENTRIES ((1 << WV_M_ZPAGE_HASH_BITS) + 1)
+
+/* Slab object sizes are multiples of this */
+#define WV_M_ZPAGE_CLASS_SIZE 64
+#define WV_M_ZPAGE_CLASSES (WV_M_ZPAGE_SIZE / WV_M_ZPAGE_CLASS_SIZE)
+
+/* The size class for an object of a given size, from 1 to a page */
+#define WV_M_ZPAGE_CLASS(Size) (((Size) - 1) / WV_M_ZPAGE_CLASS_SIZE)
+
+/* The size of each slab, whose first class-size bytes link the slabs */
+#define WV_M_ZPAGE_SLAB_SIZE (64 * 1024)
+
+/* A page compressing to more than this is kept as-is */
+#define WV_M_ZPAGE_MAX_PACKED (WV_M_ZPAGE_SIZE - WV_M_ZPAGE_CLASS_SIZE)
+
+/** Object types */
+typedef enum WV_ZPAGE_KIND WV_E_ZPAGE_KIND;
+typedef struct WV_ZPAGE WV_S_ZPAGE, * WV_SP_ZPAGE;
+typedef struct WV_ZPAGE_CLASS WV_S_ZPAGE_CLASS, * WV_SP_ZPAGE_CLASS;
+
+/** Enumerations */
+
+/* How a page is kept */
+enum WV_ZPAGE_KIND {
+    /* Never written, so it reads as zeroes */
+    WvZpageKindEmpty,
+    /* Value.Fill holds the word the page is filled with */
+    WvZpageKindSame,
+    /* Value.Data points to Length bytes of LZ4 data */
+    WvZpageKindPacked,
+    /* Value.Data points to the page's data, as-is */
+    WvZpageKindStored,
+    WvZpageKinds
+  };
+
+/** Struct/union type definitions */
+
+/** A page table entry.  All zeroes is an empty page */
+struct WV_ZPAGE {
+    union {
+        void * Data;
+        unsigned int Fill;
+      } Value;
+    unsigned short Length;
+    unsigned short Kind;
+  };
+
+/** A slab size class */
+struct WV_ZPAGE_CLASS {
+    /** Free objects, each linked through its first pointer */
+    void * Free;
+    /** The slabs, each linked through its first pointer */
+    void * Slabs;
+    /** Where the next object in the newest slab is, and its end */
+    unsigned char * Next;
+    unsigned char * End;
+    unsigned long SlabCount;
+  };
+
+/** Function declarations */
+
+/**
+ * Work out how to keep a page.
+ *
+ * @v Page              The page's contents.
+ * @v Packed            Receives any compressed data.  Must have room
+ *                      for WV_M_ZPAGE_MAX_PACKED bytes.
+ * @v Table             An LZ4 hash table, with room for
+ *                      WV_M_ZPAGE_TABLE_ENTRIES entries.  It needn't
+ *                      be cleared between calls.
+ * @v Entry             Populated with the page's kind, and with its
+ *                      length or fill value.  Its data is not set.
+ */
+extern void WvZpagePack(
+    const unsigned char *,
+    unsigned char *,
+    unsigned int *,
+    WV_SP_ZPAGE
+  );
+
+/**
+ * Produce a page's contents.
+ *
+ * @v Entry             The page's entry.
+ * @v Page              Populated with the page's contents.
+ * @ret int             0 for success, or -1 for corrupt LZ4 data.
+ */
+extern int WvZpageUnpack(const WV_S_ZPAGE *, unsigned char *);
+
+/**
+ * Allocate a slab object.
+ *
+ * @v Class             The size class to allocate from.
+ * @v Size              The size of the object, from 1 to a page.  The
+ *                      class must be WV_M_ZPAGE_CLASS(Size).
+ * @ret void *          The object, or NULL if the class needs a slab.
+ */
+extern void * WvZpageAlloc(WV_SP_ZPAGE_CLASS, unsigned int);
+
+/**
+ * Give a size class a new slab.
+ *
+ * @v Class             The size class.
+ * @v Slab              WV_M_ZPAGE_SLAB_SIZE bytes of memory.
+ */
+extern void WvZpageAddSlab(WV_SP_ZPAGE_CLASS, void *);
+
+/**
+ * Return a slab object to its size class.
+ *
+ * @v Class             The size class which the object came from.
+ * @v Obj               The object.
+ */
+extern void WvZpageFree(WV_SP_ZPAGE_CLASS, void *);
+
+/**
+ * Take a slab back from a size class, for freeing the class.
+ *
+ * @v Class             The size class.
+ * @ret void *          A slab, or NULL once the class has none.
+ *
+ * Any objects within the slab must no longer be in use.
+ */
+extern void * WvZpageTakeSlab(WV_SP_ZPAGE_CLASS);
+
+#endif  /* WV_M_ZPAGE_H_ */
@@ -0,0 +1,336 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * LZ4 block compression and decompression.
+ *
+ * Each sequence is a token, whose high nibble is a literal count and
+ * whose low nibble is a match length less 4, either of which is
+ * extended by following bytes when it is 15.  The literals follow,
+ * then a two-byte match offset.  The last sequence has literals only.
+ *
+ * Where there's room, copies are made eight bytes at a time and may
+ * run up to seven bytes past their end, into space which is later
+ * overwritten or is still within the buffer.  Matches are compared a
+ * word at a time, which assumes a little-endian processor, as x86 is.
+ */
+
+#include <string.h>
+#ifdef _MSC_VER
+#  include <intrin.h>
+#endif
+
+#include "lz4.h"
+
+/** Macros */
+#define LZ4_M_MIN_MATCH 4
+#define LZ4_M_LAST_LITERALS 5
+#define LZ4_M_MATCH_LIMIT 12
+#define LZ4_M_MAX_OFFSET 65535
+#define LZ4_M_WILD 8
+
+/* After each 1 << this many bytes without a match, search more sparsely */
+#define LZ4_M_SKIP_SHIFT 6
+
+/** Private function declarations */
+static int Lz4Length_(
+    const unsigned char **,
+    const unsigned char *,
+    unsigned int *
+  );
+static unsigned int Lz4Read32_(const unsigned char *);
+static unsigned int Lz4Ctz_(unsigned int);
+static void Lz4WildCopy_(
+    unsigned char *,
+    const unsigned char *,
+    const unsigned char *
+  );
+static unsigned char * Lz4PutLength_(unsigned char *, unsigned int);
+static unsigned char * Lz4PutLiterals_(
+    unsigned char *,
+    const unsigned char *,
+    unsigned int
+  );
+
+/** Function definitions */
+
+int Lz4Decompress(
+    const unsigned char * src,
+    unsigned int src_len,
+    unsigned char * dst,
+    unsigned int dst_len
+  ) {
+    const unsigned char * ip = src;
+    const unsigned char * const ip_end = src + src_len;
+    unsigned char * op = dst;
+    unsigned char * const op_end = dst + dst_len;
+    const unsigned char * match;
+    unsigned int token;
+    unsigned int len;
+    unsigned int offset;
+
+    while (ip < ip_end) {
+        token = *ip++;
+
+        /* Literals */
+        len = token >> 4;
+        if (len == 15 && Lz4Length_(&ip, ip_end, &len))
+          return -1;
+        if (len > (unsigned int) (ip_end - ip) || len > (unsigned int) (op_end - op))
+          return -1;
+        if (
+            (unsigned int) (ip_end - ip) - len >= LZ4_M_WILD &&
+            (unsigned int) (op_end - op) - len >= LZ4_M_WILD
+          )
+          Lz4WildCopy_(op, ip, op + len);
+          else
+          memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        /* The last sequence ends after its literals */
+        if (ip == ip_end)
+          break;
+
+        /* Match */
+        if (ip_end - ip < 2)
+          return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (!offset || offset > (unsigned int) (op - dst))
+          return -1;
+        match = op - offset;
+
+        len = token & 15;
+        if (len == 15 && Lz4Length_(&ip, ip_end, &len))
+          return -1;
+        len += 4;
+        if (len > (unsigned int) (op_end - op))
+          return -1;
+        /*
+         * A match at least a word back can be copied a word at a time,
+         * but a closer one overlaps its own output.
+         */
+        if (
+            offset >= LZ4_M_WILD &&
+            (unsigned int) (op_end - op) - len >= LZ4_M_WILD
+          ) {
+            Lz4WildCopy_(op, match, op + len);
+            op += len;
+          } else {
+            while (len--)
+              *op++ = *match++;
+          }
+      }
+    return (int) (op - dst);
+  }
+
+/*
+ * A greedy compressor.  Each sequence needs at most 1 + LitLen +
+ * LitLen / 255 + 1 + 2 + MatchLen / 255 + 1 bytes, so checking for
+ * LitLen + LitLen / 255 + MatchLen / 255 + 16 bytes before each is
+ * enough, even with the literals' wild copy.
+ *
+ * The table's last entry is a base, which is added to each position
+ * entered into the table, and which is then moved past the input.  An
+ * entry from an earlier call is thus below the base, and is ignored
+ * without the table having to be cleared.  Only when the base would
+ * wrap around is the table cleared.
+ */
+int Lz4Compress(
+    const unsigned char * src,
+    unsigned int len,
+    unsigned char * dst,
+    unsigned int dst_cap,
+    unsigned int * table,
+    unsigned int hash_bits
+  ) {
+    unsigned char * op = dst;
+    unsigned char * token;
+    unsigned int ip = 0;
+    unsigned int anchor = 0;
+    unsigned int base;
+    unsigned int seq;
+    unsigned int ref;
+    unsigned int h;
+    unsigned int lit;
+    unsigned int mlen;
+    unsigned int mlimit;
+    unsigned int diff = 0;
+    unsigned int i;
+
+    base = table[1u << hash_bits];
+    if (!base || len > 0xFFFFFFFFu - base) {
+        for (i = 0; i < 1u << hash_bits; i++)
+          table[i] = 0;
+        base = 1;
+      }
+    table[1u << hash_bits] = base + len;
+
+    if (len > LZ4_M_MATCH_LIMIT) {
+        while (ip < len - LZ4_M_MATCH_LIMIT) {
+            seq = Lz4Read32_(src + ip);
+            h = seq * 2654435761U >> (32 - hash_bits);
+            ref = table[h] - base;
+            table[h] = base + ip;
+
+            /* A stale entry's position wraps around, past this one. */
+            if (
+                ref >= ip ||
+                ip - ref > LZ4_M_MAX_OFFSET ||
+                Lz4Read32_(src + ref) != seq
+              ) {
+                ip += 1 + ((ip - anchor) >> LZ4_M_SKIP_SHIFT);
+                continue;
+              }
+
+            /* The first differing bit is in the first differing byte. */
+            mlen = LZ4_M_MIN_MATCH;
+            mlimit = len - LZ4_M_LAST_LITERALS - ip;
+            while (mlen + 4 <= mlimit) {
+                diff =
+                  Lz4Read32_(src + ref + mlen) ^ Lz4Read32_(src + ip + mlen);
+                if (diff)
+                  break;
+                mlen += 4;
+              }
+            if (mlen + 4 <= mlimit) {
+                mlen += Lz4Ctz_(diff) >> 3;
+              } else {
+                while (mlen < mlimit && src[ref + mlen] == src[ip + mlen])
+                  mlen++;
+              }
+
+            lit = ip - anchor;
+            if (
+                (unsigned int) (op - dst) + lit + lit / 255 + mlen / 255 + 16 >
+                dst_cap
+              )
+              return -1;
+
+            /* The source and the check above leave room to be wild. */
+            token = op++;
+            if (lit >= 15) {
+                *token = 15 << 4;
+                op = Lz4PutLength_(op, lit - 15);
+              } else {
+                *token = (unsigned char) (lit << 4);
+              }
+            Lz4WildCopy_(op, src + anchor, op + lit);
+            op += lit;
+
+            *op++ = (unsigned char) (ip - ref);
+            *op++ = (unsigned char) ((ip - ref) >> 8);
+
+            if (mlen - LZ4_M_MIN_MATCH >= 15) {
+                *token |= 15;
+                op = Lz4PutLength_(op, mlen - LZ4_M_MIN_MATCH - 15);
+              } else {
+                *token |= (unsigned char) (mlen - LZ4_M_MIN_MATCH);
+              }
+
+            ip += mlen;
+            anchor = ip;
+          }
+      }
+
+    lit = len - anchor;
+    if ((unsigned int) (op - dst) + lit + lit / 255 + 2 > dst_cap)
+      return -1;
+    op = Lz4PutLiterals_(op, src + anchor, lit);
+    return (int) (op - dst);
+  }
+
+/* Add a length's extension bytes; non-zero upon error */
+static int Lz4Length_(
+    const unsigned char ** ip,
+    const unsigned char * ip_end,
+    unsigned int * len
+  ) {
+    unsigned int byte;
+
+    do {
+        if (*ip >= ip_end)
+          return 1;
+        byte = *(*ip)++;
+        if (*len > 0x7FFFFFFF - byte)
+          return 1;
+        *len += byte;
+      } while (byte == 255);
+    return 0;
+  }
+
+/* Fetch four bytes, which needn't be aligned */
+static unsigned int Lz4Read32_(const unsigned char * p) {
+    unsigned int word;
+
+    memcpy(&word, p, sizeof word);
+    return word;
+  }
+
+/* Count the trailing zero bits of a non-zero word */
+static unsigned int Lz4Ctz_(unsigned int word) {
+#ifdef _MSC_VER
+    unsigned long bit;
+
+    _BitScanForward(&bit, word);
+    return (unsigned int) bit;
+#else
+    return (unsigned int) __builtin_ctz(word);
+#endif
+  }
+
+/* Copy a word at a time, up to seven bytes past the end */
+static void Lz4WildCopy_(
+    unsigned char * op,
+    const unsigned char * ip,
+    const unsigned char * op_end
+  ) {
+    do {
+        memcpy(op, ip, LZ4_M_WILD);
+        op += LZ4_M_WILD;
+        ip += LZ4_M_WILD;
+      } while (op < op_end);
+    return;
+  }
+
+/* Emit a length's extension bytes */
+static unsigned char * Lz4PutLength_(unsigned char * op, unsigned int len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+      }
+    *op++ = (unsigned char) len;
+    return op;
+  }
+
+/* Emit a token with a literal count, and the literals */
+static unsigned char * Lz4PutLiterals_(
+    unsigned char * op,
+    const unsigned char * lit,
+    unsigned int len
+  ) {
+    unsigned char * token = op++;
+
+    *token = (unsigned char) ((len >= 15 ? 15 : len) << 4);
+    if (len >= 15)
+      op = Lz4PutLength_(op, len - 15);
+    memcpy(op, lit, len);
+    return op + len;
+  }
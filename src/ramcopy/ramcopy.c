@@ -0,0 +1,269 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * RAM disk copy benchmark.
+ *
+ * Times the two copy kernels which the RAM disk uses: the rep movsd
+ * copy used for reads and small writes, and the non-temporal stream
+ * copy used for writes of WV_M_RAMDISK_STREAM_MIN_XFER or more.  For
+ * each transfer size it reports the throughput of each, and how long
+ * re-reading a working set takes after each transfer, which shows how
+ * much of the caches the transfer displaced.  The kernels here must be
+ * kept the same as WvRamdiskFastCopy_() and WvRamdiskStreamCopy_() in
+ * winvblock/ramdisk/ramdisk.c.  This is a user-land program for POSIX
+ * on x86 and x86-64:
+ *
+ *   cc -O2 -o ramcopy ramcopy.c
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <emmintrin.h>
+
+/* The RAM disk's memory, which should be much larger than the caches */
+#define DEFAULT_DISK_MB     256
+#define DEFAULT_TOTAL_MB    2048
+#define DEFAULT_WORKING_KB  1024
+
+typedef void RAMCOPY_KERNEL(void* Dest, const void* Src, size_t Count);
+
+int RamCopySyntax(void)
+{
+    fprintf(stderr, "syntax:\n");
+    fprintf(stderr, "ramcopy [-d:<disk_mb>] [-m:<total_mb>] [-w:<working_kb>] [<xfer_kb>...]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "-d     sets the size of the RAM disk (default %u MiB).\n", DEFAULT_DISK_MB);
+    fprintf(stderr, "-m     sets how much each case copies (default %u MiB).\n", DEFAULT_TOTAL_MB);
+    fprintf(stderr, "-w     sets the working set re-read after each transfer (default %u KiB).\n",
+        DEFAULT_WORKING_KB);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "example:\n");
+    fprintf(stderr, "ramcopy -w:2048 64 256 1024\n");
+
+    return -1;
+}
+
+/* WvRamdiskFastCopy_() */
+static void FastCopy(void* Dest, const void* Src, size_t Count)
+{
+    size_t Dwords = Count >> 2;
+
+    __asm__ __volatile__("rep movsl" : "+D" (Dest), "+S" (Src), "+c" (Dwords) : : "memory");
+}
+
+/* WvRamdiskStreamCopy_() */
+static void StreamCopy(void* Dest, const void* Src, size_t Count)
+{
+    int*        d = Dest;
+    const int*  s = Src;
+
+    for (Count >>= 2; Count; --Count)
+    {
+        _mm_stream_si32(d++, *s++);
+    }
+    _mm_sfence();
+}
+
+static double Now(void)
+{
+    struct timespec Time;
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return Time.tv_sec + Time.tv_nsec / 1e9;
+}
+
+/* Read a working set, as the rest of the system would */
+static unsigned long Touch(const unsigned char* Working, size_t Len)
+{
+    unsigned long   Sum = 0;
+    size_t          i;
+
+    for (i = 0; i < Len; i += 64)
+    {
+        Sum += Working[i];
+    }
+
+    return Sum;
+}
+
+/*
+ * Copy Total bytes between the disk and a caller's buffer, Xfer at a
+ * time, moving through the disk as sequential I/O would.  With a
+ * working set, it is re-read after each transfer and the time taken
+ * is returned in *Reread, in ns per transfer.
+ */
+static double Run(RAMCOPY_KERNEL* Kernel, int Write, unsigned char* Disk, size_t DiskLen,
+    unsigned char* Buf, size_t Xfer, size_t Total, const unsigned char* Working, size_t WorkingLen,
+    double* Reread)
+{
+    volatile unsigned long  Sink = 0;
+    size_t                  Offset = 0;
+    size_t                  Done;
+    double                  Start;
+    double                  Time;
+    double                  Touched = 0;
+    double                  t;
+
+    /* Warm up the caller's buffer and the working set */
+    memset(Buf, 0x5A, Xfer);
+    Sink += Touch(Working, WorkingLen);
+
+    Start = Now();
+    for (Done = 0; Done < Total; Done += Xfer)
+    {
+        if (Offset + Xfer > DiskLen)
+        {
+            Offset = 0;
+        }
+        if (Write)
+        {
+            Kernel(Disk + Offset, Buf, Xfer);
+        }
+        else
+        {
+            Kernel(Buf, Disk + Offset, Xfer);
+        }
+        Offset += Xfer;
+
+        if (WorkingLen)
+        {
+            t = Now();
+            Sink += Touch(Working, WorkingLen);
+            Touched += Now() - t;
+        }
+    }
+    Time = Now() - Start - Touched;
+
+    *Reread = Touched * 1e9 / (Total / Xfer);
+    (void) Sink;
+
+    return Total / Time / 1e6;
+}
+
+int main(int argc, char* argv[])
+{
+    static const unsigned int DefaultXfers[] = { 4, 64, 128, 256, 1024, 4096 };
+    size_t              DiskLen = DEFAULT_DISK_MB * 1024UL * 1024;
+    size_t              Total = DEFAULT_TOTAL_MB * 1024UL * 1024;
+    size_t              WorkingLen = DEFAULT_WORKING_KB * 1024UL;
+    unsigned int        Xfers[32];
+    unsigned int        XferCount = 0;
+    unsigned char*      Disk;
+    unsigned char*      Buf;
+    unsigned char*      Working;
+    size_t              Xfer;
+    size_t              MaxXfer = 0;
+    double              Rate[3];
+    double              Reread[3];
+    unsigned int        i;
+    int                 a;
+
+    for (a = 1; a < argc; a++)
+    {
+        if (!strncmp(argv[a], "-d:", 3) && atol(argv[a] + 3) > 0)
+        {
+            DiskLen = (size_t) atol(argv[a] + 3) * 1024 * 1024;
+        }
+        else if (!strncmp(argv[a], "-m:", 3) && atol(argv[a] + 3) > 0)
+        {
+            Total = (size_t) atol(argv[a] + 3) * 1024 * 1024;
+        }
+        else if (!strncmp(argv[a], "-w:", 3) && atol(argv[a] + 3) >= 0)
+        {
+            WorkingLen = (size_t) atol(argv[a] + 3) * 1024;
+        }
+        else if (argv[a][0] != '-' && atol(argv[a]) > 0 && XferCount < sizeof Xfers / sizeof *Xfers)
+        {
+            Xfers[XferCount++] = (unsigned int) atol(argv[a]);
+        }
+        else
+        {
+            return RamCopySyntax();
+        }
+    }
+    if (!XferCount)
+    {
+        memcpy(Xfers, DefaultXfers, sizeof DefaultXfers);
+        XferCount = sizeof DefaultXfers / sizeof *DefaultXfers;
+    }
+    for (i = 0; i < XferCount; i++)
+    {
+        if (Xfers[i] * 1024UL > DiskLen)
+        {
+            fprintf(stderr, "%u: Larger than the disk.\n", Xfers[i]);
+            return -1;
+        }
+        if (Xfers[i] * 1024UL > MaxXfer)
+        {
+            MaxXfer = Xfers[i] * 1024UL;
+        }
+    }
+
+    Disk = aligned_alloc(4096, DiskLen);
+    Buf = aligned_alloc(4096, MaxXfer);
+    Working = aligned_alloc(4096, WorkingLen ? WorkingLen : 4096);
+    if (!Disk || !Buf || !Working)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+    /* Fault everything in before timing */
+    memset(Disk, 0xA5, DiskLen);
+    memset(Working, 0x3C, WorkingLen);
+
+    printf("disk %zu MiB, %zu MiB per case, %zu KiB working set\n",
+        DiskLen >> 20, Total >> 20, WorkingLen >> 10);
+    printf("%10s %12s %12s %12s %12s %12s %12s\n", "xfer KiB",
+        "movsd wr", "stream wr", "movsd rd", "reread ns", "reread ns", "reread ns");
+    printf("%10s %12s %12s %12s %12s %12s %12s\n", "",
+        "MB/s", "MB/s", "MB/s", "movsd wr", "stream wr", "movsd rd");
+
+    for (i = 0; i < XferCount; i++)
+    {
+        Xfer = Xfers[i] * 1024UL;
+        Rate[0] = Run(FastCopy, 1, Disk, DiskLen, Buf, Xfer, Total, Working, 0, Reread);
+        Rate[1] = Run(StreamCopy, 1, Disk, DiskLen, Buf, Xfer, Total, Working, 0, Reread);
+        Rate[2] = Run(FastCopy, 0, Disk, DiskLen, Buf, Xfer, Total, Working, 0, Reread);
+        if (WorkingLen)
+        {
+            Run(FastCopy, 1, Disk, DiskLen, Buf, Xfer, Total, Working, WorkingLen, Reread + 0);
+            Run(StreamCopy, 1, Disk, DiskLen, Buf, Xfer, Total, Working, WorkingLen, Reread + 1);
+            Run(FastCopy, 0, Disk, DiskLen, Buf, Xfer, Total, Working, WorkingLen, Reread + 2);
+        }
+        else
+        {
+            Reread[0] = Reread[1] = Reread[2] = 0;
+        }
+        printf("%10u %12.0f %12.0f %12.0f %12.0f %12.0f %12.0f\n", Xfers[i],
+            Rate[0], Rate[1], Rate[2], Reread[0], Reread[1], Reread[2]);
+        fflush(stdout);
+    }
+
+    free(Working);
+    free(Buf);
+    free(Disk);
+
+    return 0;
+}
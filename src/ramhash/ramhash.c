@@ -0,0 +1,213 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * RAM disk hash manifest writer.
+ *
+ * Appends a hash manifest to a raw disk image, so that WinVBlock will
+ * verify the image after MEMDISK or GRUB4DOS has loaded it into RAM.
+ * The image grows to a whole number of 4 KiB pages, so a floppy image
+ * which relies upon its size for its geometry needs explicit geometry.
+ * This is a portable, user-land program:
+ *
+ *   cc -O2 -I../include -o ramhash ramhash.c ../winvblock/ramdisk/ramhash.c
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ramhash.h"
+
+/* The image is padded to a multiple of this, for any sector size */
+#define IMAGE_ALIGN         4096
+
+int RamHashSyntax(void)
+{
+    fprintf(stderr, "syntax:\n");
+    fprintf(stderr, "ramhash [-b:<block_kb>] <image>\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "-b     sets the block size, a power of two from %u to %u KiB (default %u).\n",
+        (1 << WV_M_RAMHASH_MIN_BLOCK_SHIFT) / 1024,
+        (1 << WV_M_RAMHASH_MAX_BLOCK_SHIFT) / 1024,
+        (1 << WV_M_RAMHASH_DEFAULT_BLOCK_SHIFT) / 1024);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "example:\n");
+    fprintf(stderr, "ramhash -b:64 diskimage.img\n");
+
+    return -1;
+}
+
+static void PutLe(unsigned char* p, unsigned long long v, int bytes)
+{
+    while (bytes--)
+    {
+        *p++ = (unsigned char) v;
+        v >>= 8;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int        BlockShift = WV_M_RAMHASH_DEFAULT_BLOCK_SHIFT;
+    unsigned int        BlockSize;
+    int                 i;
+    FILE*               Image;
+    unsigned long long  ImageSize;
+    unsigned long long  DataSize;
+    unsigned long long  End;
+    unsigned int        BlockCount;
+    unsigned int        Block;
+    unsigned int        Len;
+    unsigned char*      Data;
+    unsigned char*      Hashes;
+    unsigned char       Footer[WV_M_RAMHASH_FOOTER_SIZE];
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+        if (!strncmp(argv[i], "-b:", 3))
+        {
+            unsigned int kb = (unsigned int) atoi(argv[i] + 3);
+
+            for (BlockShift = WV_M_RAMHASH_MIN_BLOCK_SHIFT;
+                BlockShift <= WV_M_RAMHASH_MAX_BLOCK_SHIFT && (1U << BlockShift) != kb * 1024;
+                BlockShift++);
+
+            if (BlockShift > WV_M_RAMHASH_MAX_BLOCK_SHIFT)
+            {
+                fprintf(stderr, "%s: Invalid block size.\n", argv[i] + 3);
+                return -1;
+            }
+        }
+        else
+        {
+            return RamHashSyntax();
+        }
+    }
+
+    if (argc - i != 1)
+    {
+        return RamHashSyntax();
+    }
+
+    Image = fopen(argv[i], "r+b");
+    if (!Image)
+    {
+        perror(argv[i]);
+        return -1;
+    }
+
+    if (fseeko(Image, 0, SEEK_END) || (long long) (ImageSize = ftello(Image)) < 0)
+    {
+        perror(argv[i]);
+        return -1;
+    }
+
+    /* Hashing the manifest too would leave the image unverifiable */
+    if (ImageSize >= WV_M_RAMHASH_FOOTER_SIZE)
+    {
+        if (fseeko(Image, (off_t) (ImageSize - WV_M_RAMHASH_FOOTER_SIZE), SEEK_SET) ||
+            fread(Footer, WV_M_RAMHASH_MAGIC_LEN, 1, Image) != 1)
+        {
+            perror(argv[i]);
+            return -1;
+        }
+        if (!memcmp(Footer, WV_M_RAMHASH_MAGIC, WV_M_RAMHASH_MAGIC_LEN))
+        {
+            fprintf(stderr, "%s: Image already has a manifest.\n", argv[i]);
+            return -1;
+        }
+    }
+
+    BlockSize = 1U << BlockShift;
+    if (!ImageSize || ((ImageSize + BlockSize - 1) >> BlockShift) > WV_M_RAMHASH_MAX_BLOCKS)
+    {
+        fprintf(stderr, "%s: Image size unsuitable for this block size.\n", argv[i]);
+        return -1;
+    }
+    BlockCount = (unsigned int) ((ImageSize + BlockSize - 1) >> BlockShift);
+    DataSize = (unsigned long long) BlockCount << BlockShift;
+    End = DataSize + (unsigned long long) BlockCount * 8 + WV_M_RAMHASH_FOOTER_SIZE;
+    End = (End + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+
+    Data = malloc(BlockSize);
+    Hashes = malloc((size_t) BlockCount * 8);
+    if (!Data || !Hashes)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+
+    for (Block = 0; Block < BlockCount; Block++)
+    {
+        Len = ImageSize - ((unsigned long long) Block << BlockShift) < BlockSize ?
+            (unsigned int) (ImageSize - ((unsigned long long) Block << BlockShift)) :
+            BlockSize;
+
+        if (fseeko(Image, (off_t) Block << BlockShift, SEEK_SET) || fread(Data, Len, 1, Image) != 1)
+        {
+            perror(argv[i]);
+            return -1;
+        }
+
+        /* The last block is hashed as it will be after padding */
+        memset(Data + Len, 0, BlockSize - Len);
+        PutLe(Hashes + (size_t) Block * 8, WvRamhashXxh64(Data, BlockSize, 0), 8);
+    }
+
+    memset(Footer, 0, sizeof Footer);
+    memcpy(Footer, WV_M_RAMHASH_MAGIC, WV_M_RAMHASH_MAGIC_LEN);
+    PutLe(Footer + 8, WV_M_RAMHASH_VERSION, 4);
+    PutLe(Footer + 12, BlockShift, 4);
+    PutLe(Footer + 16, BlockCount, 4);
+    PutLe(Footer + 24, WvRamhashXxh64(Hashes, (unsigned long) BlockCount * 8, 0), 8);
+
+    /* Pad the data, then everything up to the footer */
+    memset(Data, 0, BlockSize);
+    if (fseeko(Image, (off_t) ImageSize, SEEK_SET) ||
+        (DataSize > ImageSize && fwrite(Data, (size_t) (DataSize - ImageSize), 1, Image) != 1) ||
+        fwrite(Hashes, 8, BlockCount, Image) != BlockCount)
+    {
+        perror(argv[i]);
+        return -1;
+    }
+    for (ImageSize = DataSize + (unsigned long long) BlockCount * 8;
+        ImageSize < End - WV_M_RAMHASH_FOOTER_SIZE;
+        ImageSize++)
+    {
+        if (fputc(0, Image) == EOF)
+        {
+            perror(argv[i]);
+            return -1;
+        }
+    }
+    if (fwrite(Footer, sizeof Footer, 1, Image) != 1 || fclose(Image))
+    {
+        perror(argv[i]);
+        return -1;
+    }
+
+    printf("%u blocks of %u bytes hashed; image is now %llu bytes.\n",
+        BlockCount, BlockSize, End);
+
+    return 0;
+}
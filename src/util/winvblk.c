@@ -92,6 +92,30 @@ static WVU_S_OPTION opt_uri = {
     "U", NULL, 1
   };
 
+static WVU_S_OPTION opt_overlay = {
+    "O", NULL, 1
+  };
+
+static WVU_S_OPTION opt_map = {
+    "MAP", NULL, 0
+  };
+
+static WVU_S_OPTION opt_ram = {
+    "RAM", NULL, 0
+  };
+
+static WVU_S_OPTION opt_writeback = {
+    "WRITEBACK", NULL, 0
+  };
+
+static WVU_S_OPTION opt_size = {
+    "SIZE", NULL, 1
+  };
+
+static WVU_S_OPTION opt_compress = {
+    "COMPRESS", NULL, 0
+  };
+
 static WVU_S_OPTION opt_mac = {
     "MAC", NULL, 1
   };
@@ -114,6 +138,12 @@ static WVU_SP_OPTION options[] = {
     &opt_disknum,
     &opt_media,
     &opt_uri,
+    &opt_overlay,
+    &opt_map,
+    &opt_ram,
+    &opt_writeback,
+    &opt_size,
+    &opt_compress,
     &opt_mac,
     &opt_service,
     &opt_regsvr,
@@ -218,7 +248,9 @@ WinVBlock user-land utility for disk control. (C) 2006-2008 V.,\n\
                                               (C) 2009-2010 Shao Miller\n\
 Usage:\n\
   winvblk -cmd <command> [-d <disk number>] [-m <media>] [-u <uri or path>]\n\
-    [-mac <client mac address>] [-c <cyls>] [-h <heads>] [-s <sects per track>]\n\
+    [-o <overlay path>] [-map | -ram [-writeback]]\n\
+    [-mac <client mac address>] [-c <cyls>] [-h <heads>]\n\
+    [-s <sects per track>] [-size <megabytes> [-compress]]\n\
     [-service <service>]\n\
   winvblk -?\n\
 \n\
@@ -229,8 +261,23 @@ Parameters:\n\
     mount   - Mounts an AoE target.  Requires -mac and -u\n\
     umount  - Unmounts an AoE disk.  Requires -d\n\
     attach  - Attaches <filepath> disk image file.  Requires -u and -m.\n\
-              -c, -h, -s are optional.\n\
-    detach  - Detaches file-backed disk.  Requires -d\n\
+              -c, -h, -s are optional.  With -o, <filepath> is only\n\
+              read and all writes go to <overlay path>, which is kept\n\
+              with a .map file for attaching again later.  With -map,\n\
+              a raw image is accessed through mapped views, which\n\
+              suits images which are mostly read.  With -ram, a raw\n\
+              image is loaded into memory and served from there, and\n\
+              its changes are lost upon detach, unless -writeback is\n\
+              given, too.\n\
+    ramdisk - Creates an empty RAM disk.  Requires -size and -m.\n\
+              -c, -h, -s are optional.  Memory is only taken as the\n\
+              disk is written, and is returned upon detach.  With\n\
+              -compress, the disk's contents are kept compressed.\n\
+    ramstats - Shows a compressed RAM disk's statistics.  Requires -d\n\
+    detach  - Detaches a file-backed disk or RAM disk.  Requires -d\n\
+    commit  - Writes a snapshot's overlay to its base file, then empties\n\
+              the overlay.  Requires -d\n\
+    discard - Empties a snapshot's overlay.  Requires -d\n\
     install - Install a service.  Requires -service\n\
     start   - Start the WinVBlock service.\n\
   <uri or path> is something like:\n\
@@ -480,36 +527,90 @@ static int STDCALL cmd_umount(void) {
   }
 
 static int STDCALL cmd_attach(void) {
-    WV_S_MOUNT_DISK filedisk;
+    WV_S_MOUNT_DISK_EX filedisk;
     char obj_path_prefix[] = "\\??\\";
-    UCHAR in_buf[sizeof (WV_S_MOUNT_DISK) + 1024];
+    UCHAR in_buf[sizeof (WV_S_MOUNT_DISK_EX) + 2048];
+    UCHAR * overlay;
+    size_t params_size;
+    DWORD code;
     DWORD bytes_returned;
 
     if (opt_uri.value == NULL || opt_media.value == NULL) {
         printf("-u and -m options required.  See -? for help.\n");
         return 1;
       }
-    filedisk.type = opt_media.value[0];
+    filedisk.flags = 0;
+    if (opt_map.value)
+      filedisk.flags |= WvMountFlagMapped;
+    if (opt_ram.value)
+      filedisk.flags |= WvMountFlagRam;
+    if (opt_writeback.value)
+      filedisk.flags |= WvMountFlagWriteBack;
+    if (filedisk.flags && opt_overlay.value) {
+        printf("-o can't be used with -map or -ram.\n");
+        return 1;
+      }
+    if (opt_map.value && opt_ram.value) {
+        printf("-map can't be used with -ram.\n");
+        return 1;
+      }
+    if (opt_writeback.value && !opt_ram.value) {
+        printf("-writeback requires -ram.\n");
+        return 1;
+      }
+    /* Options need the extended parameters. */
+    code = IOCTL_FILE_ATTACH;
+    params_size = sizeof (WV_S_MOUNT_DISK);
+    if (opt_overlay.value) {
+        code = IOCTL_FILE_ATTACH_SNAPSHOT;
+      } else if (filedisk.flags) {
+        code = IOCTL_FILE_ATTACH_EX;
+        params_size = sizeof (WV_S_MOUNT_DISK_EX);
+      }
+    if (
+        strlen(opt_uri.value) +
+        (opt_overlay.value ? strlen(opt_overlay.value) : 0) +
+        2 * sizeof (obj_path_prefix) >
+        sizeof in_buf - params_size
+      ) {
+        printf("Paths are too long.\n");
+        return 1;
+      }
+    filedisk.disk.type = opt_media.value[0];
     if (opt_cyls.value != NULL)
-      sscanf(opt_cyls.value, "%d", (int *) &filedisk.cylinders);
+      sscanf(opt_cyls.value, "%d", (int *) &filedisk.disk.cylinders);
     if (opt_heads.value != NULL)
-      sscanf(opt_heads.value, "%d", (int *) &filedisk.heads);
+      sscanf(opt_heads.value, "%d", (int *) &filedisk.disk.heads);
     if (opt_spt.value != NULL)
-      sscanf(opt_spt.value, "%d", (int *) &filedisk.sectors);
-    memcpy(in_buf, &filedisk, sizeof (WV_S_MOUNT_DISK));
+      sscanf(opt_spt.value, "%d", (int *) &filedisk.disk.sectors);
+    memcpy(in_buf, &filedisk, params_size);
     memcpy(
-        in_buf + sizeof (WV_S_MOUNT_DISK),
+        in_buf + params_size,
         obj_path_prefix,
         sizeof (obj_path_prefix)
       );
     memcpy(
-        in_buf + sizeof (WV_S_MOUNT_DISK) + sizeof (obj_path_prefix) - 1,
+        in_buf + params_size + sizeof (obj_path_prefix) - 1,
         opt_uri.value,
         strlen(opt_uri.value) + 1
       );
+    /* A snapshot's overlay path follows. */
+    if (opt_overlay.value != NULL) {
+        overlay =
+          in_buf +
+          params_size +
+          sizeof (obj_path_prefix) +
+          strlen(opt_uri.value);
+        memcpy(overlay, obj_path_prefix, sizeof (obj_path_prefix));
+        memcpy(
+            overlay + sizeof (obj_path_prefix) - 1,
+            opt_overlay.value,
+            strlen(opt_overlay.value) + 1
+          );
+      }
     if (!DeviceIoControl(
         boot_bus,
-        IOCTL_FILE_ATTACH,
+        code,
         in_buf,
         sizeof (in_buf),
         NULL,
@@ -523,6 +624,91 @@ static int STDCALL cmd_attach(void) {
     return 0;
   }
 
+static int STDCALL cmd_ramdisk(void) {
+    WV_S_MOUNT_RAMDISK ramdisk;
+    unsigned long megabytes;
+    DWORD bytes_returned;
+
+    if (opt_size.value == NULL || opt_media.value == NULL) {
+        printf("-size and -m options required.  See -? for help.\n");
+        return 1;
+      }
+    if (sscanf(opt_size.value, "%lu", &megabytes) != 1 || !megabytes) {
+        printf("Invalid size: %s\n", opt_size.value);
+        return 1;
+      }
+    memset(&ramdisk, 0, sizeof ramdisk);
+    ramdisk.disk.type = opt_media.value[0];
+    if (opt_cyls.value != NULL)
+      sscanf(opt_cyls.value, "%d", &ramdisk.disk.cylinders);
+    if (opt_heads.value != NULL)
+      sscanf(opt_heads.value, "%d", &ramdisk.disk.heads);
+    if (opt_spt.value != NULL)
+      sscanf(opt_spt.value, "%d", &ramdisk.disk.sectors);
+    ramdisk.size = (UINT64) megabytes * 1024 * 1024;
+    if (opt_compress.value)
+      ramdisk.flags |= WvMountFlagCompressed;
+    if (!DeviceIoControl(
+        boot_bus,
+        IOCTL_RAM_ATTACH,
+        &ramdisk,
+        sizeof ramdisk,
+        NULL,
+        0,
+        &bytes_returned,
+        (LPOVERLAPPED) NULL
+      )) {
+        WvuShowLastErr();
+        return 2;
+      }
+    return 0;
+  }
+
+static int STDCALL cmd_ramstats(void) {
+    WV_S_MOUNT_RAMDISK_STATS stats;
+    DWORD bytes_returned;
+
+    if (opt_disknum.value == NULL) {
+        printf("-d option required.  See -? for help.\n");
+        return 1;
+      }
+    memset(&stats, 0, sizeof stats);
+    sscanf(opt_disknum.value, "%d", (int *) &stats.unit_num);
+    if (!DeviceIoControl(
+        boot_bus,
+        IOCTL_RAM_STATS,
+        &stats,
+        sizeof stats,
+        &stats,
+        sizeof stats,
+        &bytes_returned,
+        (LPOVERLAPPED) NULL
+      )) {
+        WvuShowLastErr();
+        return 2;
+      }
+    printf(
+        "Same-filled pages: %I64u\n"
+          "Compressed pages:  %I64u\n"
+          "Stored pages:      %I64u\n"
+          "Data:              %I64u bytes, compressed to %I64u\n"
+          "Memory used:       %I64u bytes\n",
+        stats.same_pages,
+        stats.packed_pages,
+        stats.stored_pages,
+        stats.orig_bytes,
+        stats.compr_bytes,
+        stats.mem_used
+      );
+    if (stats.compr_bytes) {
+        printf(
+            "Compression ratio: %.2f\n",
+            (double) stats.orig_bytes / (double) stats.compr_bytes
+          );
+      }
+    return 0;
+  }
+
 static int STDCALL cmd_detach(void) {
     UINT32 disk_num;
     UCHAR in_buf[sizeof (WV_S_MOUNT_DISK) + 1024];
@@ -551,6 +737,40 @@ static int STDCALL cmd_detach(void) {
     return 0;
   }
 
+static int STDCALL cmd_snapshot(UINT32 action) {
+    WV_S_MOUNT_SNAPSHOT snapshot;
+    DWORD bytes_returned;
+
+    if (opt_disknum.value == NULL) {
+        printf("-d option required.  See -? for help.\n");
+        return 1;
+      }
+    sscanf(opt_disknum.value, "%d", (int *) &snapshot.unit_num);
+    snapshot.action = action;
+    if (!DeviceIoControl(
+        boot_bus,
+        IOCTL_FILE_SNAPSHOT,
+        &snapshot,
+        sizeof snapshot,
+        NULL,
+        0,
+        &bytes_returned,
+        (LPOVERLAPPED) NULL
+      )) {
+        WvuShowLastErr();
+        return 2;
+      }
+    return 0;
+  }
+
+static int STDCALL cmd_commit(void) {
+    return cmd_snapshot(WvMountSnapshotCommit);
+  }
+
+static int STDCALL cmd_discard(void) {
+    return cmd_snapshot(WvMountSnapshotDiscard);
+  }
+
 static int STDCALL cmd_install(void) {
     SC_HANDLE scm, svc;
     int rc = EXIT_FAILURE, which;
@@ -699,10 +919,26 @@ int main(int argc, char **argv, char **envp) {
         cmd = cmd_attach;
         bus_name = winvblock;
       }
+    if (strcmp(opt_cmd.value, "ramdisk") == 0) {
+        cmd = cmd_ramdisk;
+        bus_name = winvblock;
+      }
+    if (strcmp(opt_cmd.value, "ramstats") == 0) {
+        cmd = cmd_ramstats;
+        bus_name = winvblock;
+      }
     if (strcmp(opt_cmd.value, "detach") == 0) {
         cmd = cmd_detach;
         bus_name = winvblock;
       }
+    if (strcmp(opt_cmd.value, "commit") == 0) {
+        cmd = cmd_commit;
+        bus_name = winvblock;
+      }
+    if (strcmp(opt_cmd.value, "discard") == 0) {
+        cmd = cmd_discard;
+        bus_name = winvblock;
+      }
     if (strcmp(opt_cmd.value, "install") == 0) {
         return cmd_install();
       }
@@ -66,6 +66,8 @@ extern DRIVER_INITIALIZE WvFilediskDriverEntry;
 DRIVER_OBJECT * WvDriverObj;
 UINT32 WvFindDisk;
 KSPIN_LOCK WvFindDiskLock;
+/* Signalled while WvFindDisk is zero */
+KEVENT WvFindDiskDone;
 S_WVL_RESOURCE_TRACKER WvDriverUsage[1];
 WVL_M_LIB BOOLEAN WvlCddbDone;
 
@@ -216,9 +218,15 @@ static VOID STDCALL WvDriverReinitialize(
         WvDriverReinitialize,
         NULL
       );
-    /* Sleep. */
-    DBG("Sleeping...");
-    KeDelayExecutionThread(KernelMode, FALSE, &delay_time.large_int);
+    /* Wait until the disks are found, but no more than a while. */
+    DBG("Waiting...");
+    KeWaitForSingleObject(
+        &WvFindDiskDone,
+        Executive,
+        KernelMode,
+        FALSE,
+        &delay_time.large_int
+      );
     return;
   }
 
@@ -283,6 +291,17 @@ NTSTATUS STDCALL DriverEntry(
       DBG("Could not set system state to ES_CONTINUOUS!!\n");
 
     KeInitializeSpinLock(&WvFindDiskLock);
+    KeInitializeEvent(&WvFindDiskDone, NotificationEvent, TRUE);
+
+    /* Start the worker pool shared by the disks */
+    status = WvlThreadPoolStart();
+    if (!NT_SUCCESS(status)) {
+        if (WvDriverStateHandle != NULL)
+          PoUnregisterSystemState(WvDriverStateHandle);
+        wv_free(WvOsLoadOpts);
+        WvlDebugModuleUnload();
+        return WvlError("WvlThreadPoolStart", status);
+      }
 
     /*
      * Set up IRP MajorFunction function table for devices
@@ -441,6 +460,7 @@ static VOID STDCALL WvUnload(IN DRIVER_OBJECT * drv_obj) {
     DBG("Unloading...\n");
 
     WvDeregisterMiniDrivers();
+    WvlThreadPoolStop();
 
     if (WvDriverStateHandle != NULL)
       PoUnregisterSystemState(WvDriverStateHandle);
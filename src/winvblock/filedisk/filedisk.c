@@ -44,6 +44,7 @@
 #include "thread.h"
 #include "filedisk.h"
 #include "debug.h"
+#include "registry.h"
 
 /* From ../mainbus/mainbus.c */
 extern NTSTATUS STDCALL WvBusRemoveDev(IN WV_SP_DEV_T);
@@ -57,29 +58,76 @@ extern VOID STDCALL WvFilediskDeleteClientSecurity(IN OUT PVOID *);
 /** Function declarations */
 DRIVER_INITIALIZE WvFilediskDriverEntry;
 
+/** Object types */
+typedef struct WV_FILEDISK_IO_ WV_S_FILEDISK_IO_, * WV_SP_FILEDISK_IO_;
+
+/** Function types */
+
+/* Perform a queued request, from a pool worker.  Completes the IRP */
+typedef VOID STDCALL WV_F_FILEDISK_IO_RUN_(IN WV_SP_FILEDISK_IO_);
+typedef WV_F_FILEDISK_IO_RUN_ * WV_FP_FILEDISK_IO_RUN_;
+
 /** Private function declarations. */
 static DRIVER_ADD_DEVICE WvFilediskDriveDevice;
 static DRIVER_UNLOAD WvFilediskUnload;
 static WVL_F_DISK_IO WvFilediskIo_;
+static NTSTATUS STDCALL WvFilediskIoSync_(
+    IN WV_SP_FILEDISK_T,
+    IN WVL_E_DISK_IO_MODE,
+    IN LONGLONG,
+    IN UINT32,
+    IN PUCHAR,
+    IN PIRP
+  );
+static NTSTATUS STDCALL WvFilediskEnqueue_(IN WV_SP_FILEDISK_IO_);
+static WV_F_FILEDISK_IO_RUN_ WvFilediskIoRun_;
+static WVL_F_DISK_FLUSH WvFilediskFlush_;
+static WV_F_FILEDISK_IO_RUN_ WvFilediskFlushRun_;
+static WVL_F_DISK_UNMAP WvFilediskUnmap_;
+static WV_F_FILEDISK_IO_RUN_ WvFilediskUnmapRun_;
 static NTSTATUS STDCALL WvFilediskPnpQueryId_(
     IN PDEVICE_OBJECT,
     IN PIRP,
     IN WVL_SP_DISK_T
   );
 static WVL_F_THREAD_ITEM WvFilediskOpenInThread_;
-static NTSTATUS STDCALL WvFilediskOpen_(IN WV_SP_FILEDISK_T, IN PANSI_STRING);
-static WVL_F_DISK_UNIT_NUM WvFilediskUnitNum_;
-static WVL_F_THREAD_ITEM WvFilediskThread_;
-static WV_F_DEV_FREE WvFilediskFree_;
-static BOOLEAN STDCALL WvFilediskHotSwap_(
+static NTSTATUS STDCALL WvFilediskOpen_(
     IN WV_SP_FILEDISK_T,
-    IN PUNICODE_STRING
+    IN PANSI_STRING,
+    IN PANSI_STRING,
+    IN UINT32
   );
-static WVL_F_THREAD_ITEM WvFilediskHotSwapThread_;
+static WVL_F_DISK_UNIT_NUM WvFilediskUnitNum_;
+static WVL_F_THREAD_ITEM WvFilediskProcessIrps_;
+static VOID STDCALL WvFilediskScheduleIrps_(IN WV_SP_FILEDISK_T);
+static VOID STDCALL WvFilediskIoPut_(IN WV_SP_FILEDISK_T);
+static WV_F_DEV_FREE WvFilediskFree_;
+static IO_COMPLETION_ROUTINE WvFilediskIoCompletion_;
 
 /** Objects */
 static S_WVL_MINI_DRIVER * WvFilediskMiniDriver;
 
+/* The queue depth for new filedisks, from the Registry */
+static LONG WvFilediskQueueDepth = WV_M_FILEDISK_DEFAULT_QUEUE_DEPTH;
+
+/** Struct/union type definitions */
+
+/* A request queued to be run from a pool worker, and any file I/O */
+struct WV_FILEDISK_IO_ {
+    WV_FP_FILEDISK_IO_RUN_ Run;
+    WV_SP_FILEDISK_T filedisk;
+    PIRP irp;
+    /* For a read or write */
+    PFILE_OBJECT file_obj;
+    WVL_E_DISK_IO_MODE mode;
+    LONGLONG start_sector;
+    UINT32 length;
+    PUCHAR buffer;
+    /* For an unmap, the ranges, which follow the record */
+    WVL_SP_DISK_RANGE ranges;
+    UINT32 count;
+  };
+
 /** Exported function definitions. */
 
 /**
@@ -99,6 +147,21 @@ NTSTATUS WvFilediskDriverEntry(
     IN UNICODE_STRING * reg_path
   ) {
     NTSTATUS status;
+    HANDLE reg_key;
+    UINT32 queue_depth;
+
+    /* Fetch the optional queue depth */
+    status = WvlRegOpenKey(reg_path->Buffer, &reg_key);
+    if (NT_SUCCESS(status)) {
+        status = WvlRegFetchDword(reg_key, L"FilediskQueueDepth", &queue_depth);
+        if (NT_SUCCESS(status) && queue_depth) {
+            if (queue_depth > WV_M_FILEDISK_MAX_QUEUE_DEPTH)
+              queue_depth = WV_M_FILEDISK_MAX_QUEUE_DEPTH;
+            WvFilediskQueueDepth = (LONG) queue_depth;
+          }
+        WvlRegCloseKey(reg_key);
+      }
+    DBG("Filedisk queue depth: %d\n", WvFilediskQueueDepth);
 
     /* Register this mini-driver */
     status = WvlRegisterMiniDriver(
@@ -153,15 +216,69 @@ static VOID STDCALL WvFilediskUnload(IN DRIVER_OBJECT * drv_obj) {
     WvlDeregisterMiniDriver(WvFilediskMiniDriver);
   }
 
-/* Attach a file as a disk, based on an IRP. */
+/**
+ * Attach a file as a disk, based on an IRP.
+ *
+ * For IOCTL_FILE_ATTACH_SNAPSHOT, the file's path is followed by the
+ * path of an overlay, and the file is only opened for reading.  For
+ * IOCTL_FILE_ATTACH_EX, the parameters carry WV_MOUNT_FLAG options.
+ */
 NTSTATUS STDCALL WvFilediskAttach(IN PIRP irp) {
+    PIO_STACK_LOCATION io_stack_loc = IoGetCurrentIrpStackLocation(irp);
     PCHAR buf = irp->AssociatedIrp.SystemBuffer;
+    ULONG buf_len;
     WV_SP_MOUNT_DISK params = (WV_SP_MOUNT_DISK) buf;
     WVL_E_DISK_MEDIA_TYPE media_type;
     UINT32 sector_size;
     WV_SP_FILEDISK_T filedisk;
     NTSTATUS status;
     ANSI_STRING ansi_path;
+    ANSI_STRING ansi_overlay_path;
+    PANSI_STRING overlay_path = NULL;
+    ULONG path = sizeof *params;
+    UINT32 flags = 0;
+
+    buf_len = io_stack_loc->Parameters.DeviceIoControl.InputBufferLength;
+    if (
+        io_stack_loc->Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_FILE_ATTACH_EX
+      ) {
+        if (buf_len <= sizeof (WV_S_MOUNT_DISK_EX)) {
+            DBG("Invalid extended attach request!\n");
+            status = STATUS_INVALID_PARAMETER;
+            goto err_params;
+          }
+        flags = ((WV_SP_MOUNT_DISK_EX) buf)->flags;
+        path = sizeof (WV_S_MOUNT_DISK_EX);
+        if ((flags & WvMountFlagMapped) && (flags & WvMountFlagRam)) {
+            DBG("A file can't be both mapped and in RAM!\n");
+            status = STATUS_INVALID_PARAMETER;
+            goto err_params;
+          }
+      }
+
+    /* Find the overlay path, which must be terminated within the buffer. */
+    if (
+        io_stack_loc->Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_FILE_ATTACH_SNAPSHOT
+      ) {
+        ULONG i = path;
+        ULONG overlay;
+
+        /* Skip the base file's path. */
+        while (i < buf_len && buf[i])
+          i++;
+        overlay = ++i;
+        while (i < buf_len && buf[i])
+          i++;
+        if (i >= buf_len || i == overlay) {
+            DBG("Invalid snapshot attach request!\n");
+            status = STATUS_INVALID_PARAMETER;
+            goto err_overlay_path;
+          }
+        RtlInitAnsiString(&ansi_overlay_path, buf + overlay);
+        overlay_path = &ansi_overlay_path;
+      }
 
     switch (params->type) {
         case 'f':
@@ -197,10 +314,10 @@ NTSTATUS STDCALL WvFilediskAttach(IN PIRP irp) {
     filedisk->disk->Sectors = params->sectors;
 
     /* Populate the file path into a counted ANSI string. */
-    RtlInitAnsiString(&ansi_path, buf + sizeof *params);
+    RtlInitAnsiString(&ansi_path, buf + path);
 
-    /* Attempt to open the file from within the filedisk's thread. */
-    status = WvFilediskOpen_(filedisk, &ansi_path);
+    /* Attempt to open the file from within the filedisk's queue. */
+    status = WvFilediskOpen_(filedisk, &ansi_path, overlay_path, flags);
     if (!NT_SUCCESS(status))
       goto err_file_open;
 
@@ -216,15 +333,32 @@ NTSTATUS STDCALL WvFilediskAttach(IN PIRP irp) {
     WvBusRemoveDev(filedisk->Dev);
     err_add_child:
 
-    /* Any open file handle will be closed upon thread exit. */
+    /* Any open file handle will be closed by WvFilediskFree_(). */
     err_file_open:
 
     WvFilediskFree_(filedisk->Dev);
     err_pdo:
 
+    err_overlay_path:
+
+    err_params:
+
     return status;
   }
 
+/**
+ * Find the filedisk for a device.
+ *
+ * @v dev                       The device.
+ * @ret WV_SP_FILEDISK_T        The filedisk, or NULL if the device
+ *                              isn't one.
+ */
+WV_SP_FILEDISK_T STDCALL WvFilediskFromDev(IN WV_SP_DEV_T dev) {
+    if (dev->Ops.Free != WvFilediskFree_)
+      return NULL;
+    return CONTAINING_RECORD(dev, WV_S_FILEDISK_T, Dev[0]);
+  }
+
 /* Handle an IRP. */
 static NTSTATUS WvFilediskIrpDispatch(
     IN PDEVICE_OBJECT dev_obj,
@@ -315,6 +449,8 @@ WV_SP_FILEDISK_T STDCALL WvFilediskCreatePdo(
     filedisk->Dev->Ops.Free = WvFilediskFree_;
     filedisk->Dev->ext = filedisk->disk;
     filedisk->disk->disk_ops.Io = WvFilediskIo_;
+    filedisk->disk->disk_ops.Flush = WvFilediskFlush_;
+    filedisk->disk->disk_ops.Unmap = WvFilediskUnmap_;
     filedisk->disk->disk_ops.UnitNum = WvFilediskUnitNum_;
     filedisk->disk->disk_ops.PnpQueryId = WvFilediskPnpQueryId_;
     filedisk->disk->disk_ops.PnpQueryDevText = WvDiskPnpQueryDevText;
@@ -323,14 +459,17 @@ WV_SP_FILEDISK_T STDCALL WvFilediskCreatePdo(
     filedisk->disk->DenyPageFile = TRUE;
     InitializeListHead(filedisk->Irps);
     KeInitializeSpinLock(filedisk->IrpsLock);
+    filedisk->QueueDepth = WvFilediskQueueDepth;
+    filedisk->IoRefs = 1;
+    KeInitializeEvent(&filedisk->IoIdle, NotificationEvent, FALSE);
 
-    /* Start the thread. */
-    filedisk->Thread->Main.Func = WvFilediskThread_;
-    status = WvlThreadStart(filedisk->Thread);
-    if (!NT_SUCCESS(status)) {
-        DBG("Couldn't create thread!\n");
-        goto err_thread;
-      }
+    /*
+     * Work is done by the shared worker pool.  It does file I/O, which
+     * can block for the work of another WinVBlock disk, so the queue
+     * is a blocking one.
+     */
+    WvlThreadQueueInit(filedisk->Queue, TRUE);
+    filedisk->IrpsItem->Func = WvFilediskProcessIrps_;
 
     /* Set associations for the PDO, device, disk. */
     WvDevForDevObj(pdo, filedisk->Dev);
@@ -344,75 +483,88 @@ WV_SP_FILEDISK_T STDCALL WvFilediskCreatePdo(
     DBG("New PDO: %p\n", pdo);
     return filedisk;
 
-    WvlThreadSendStopAndWait(filedisk->Thread);
-    err_thread:
-
-    IoDeleteDevice(pdo);
     err_pdo:
 
     return NULL;
   }
 
-/* A work item for a filedisk thread to hot-swap to a file. */
-typedef struct WV_FILEDISK_HOT_SWAPPER_ {
-    WVL_S_THREAD_ITEM item[1];
-    WV_SP_FILEDISK_T filedisk;
-    UNICODE_STRING filename[1];
-  } WV_S_FILEDISK_HOT_SWAPPER_, * WV_SP_FILEDISK_HOT_SWAPPER_;
+/**
+ * Set the backing file for a filedisk.
+ *
+ * @v filedisk          The filedisk to set the backing file for.
+ * @v file              The handle of the new backing file.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Upon success, the filedisk owns the handle and any previous backing
+ * file is closed.  I/O already in flight keeps its own reference to
+ * the previous file object and completes against it.
+ */
+NTSTATUS STDCALL WvFilediskSetFile(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN HANDLE file
+  ) {
+    return WvFilediskSwapFile(filedisk, file, NULL);
+  }
 
 /**
- * Initiate a filedisk hot-swap to another file.
+ * Switch a filedisk to another backing file.
  *
- * @v filedisk          The filedisk to be hot-swapped.
- * @v file              The ANSI filename for swapping to.
+ * @v filedisk          The filedisk to switch.
+ * @v file              The handle of the new backing file.
+ * @v offset            The disk's offset into the new file, or NULL
+ *                      to keep the current offset.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * As for WvFilediskSetFile(), but the file and the offset are switched
+ * at once, so no I/O sees one without the other.  How long new I/O
+ * was held up is noted in SwapStallTime.
  */
-VOID STDCALL WvFilediskHotSwap(IN WV_SP_FILEDISK_T filedisk, IN PCHAR file) {
-    static WVL_S_THREAD thread = {
-        /* Main */
-        {
-            /* Link */
-            {0},
-            /* Func */
-            WvFilediskHotSwapThread_,
-          },
-        /* State */
-        WvlThreadStateNotStarted,
-      };
-    WV_SP_FILEDISK_HOT_SWAPPER_ hot_swapper;
-    ANSI_STRING file_ansi;
+NTSTATUS STDCALL WvFilediskSwapFile(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN HANDLE file,
+    IN PLARGE_INTEGER offset
+  ) {
+    PFILE_OBJECT file_obj;
+    HANDLE old_file;
+    PFILE_OBJECT old_file_obj;
+    LARGE_INTEGER freq;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    KIRQL irql;
     NTSTATUS status;
 
-    hot_swapper = wv_malloc(sizeof *hot_swapper);
-    if (!hot_swapper) {
-        DBG("Non-critical: Couldn't allocate work item.\n");
-        return;
-      }
-    /* Build the Unicode string. */
-    RtlInitAnsiString(&file_ansi, file);
-    hot_swapper->filename->Buffer = NULL;
-    status = RtlAnsiStringToUnicodeString(
-        hot_swapper->filename,
-        &file_ansi,
-        TRUE
+    status = ObReferenceObjectByHandle(
+        file,
+        0,
+        *IoFileObjectType,
+        KernelMode,
+        &file_obj,
+        NULL
       );
     if (!NT_SUCCESS(status)) {
-        DBG("Non-critical: Couldn't allocate unicode string.\n");
-        wv_free(hot_swapper);
-        return;
+        DBG("Couldn't reference file object!\n");
+        return status;
       }
-    /* Build the rest of the work item. */
-    hot_swapper->item->Func = WvFilediskHotSwapThread_;
-    hot_swapper->filedisk = filedisk;
-    /* Start the thread.  If it's already been started, no matter. */
-    WvlThreadStart(&thread);
-    /* Add the hot-swapper work item. */
-    if (!WvlThreadAddItem(&thread, hot_swapper->item)) {
-        DBG("Non-critical: Couldn't add work item.\n");
-        RtlFreeUnicodeString(hot_swapper->filename);
-        wv_free(hot_swapper);
-      }
-    /* The thread is responsible for freeing the work item and file path. */
-    return;
+
+    start = KeQueryPerformanceCounter(&freq);
+    KeAcquireSpinLock(filedisk->IrpsLock, &irql);
+    old_file = filedisk->file;
+    old_file_obj = filedisk->FileObj;
+    filedisk->file = file;
+    filedisk->FileObj = file_obj;
+    if (offset)
+      filedisk->offset = *offset;
+    KeReleaseSpinLock(filedisk->IrpsLock, irql);
+    end = KeQueryPerformanceCounter(NULL);
+    filedisk->SwapStallTime =
+      (end.QuadPart - start.QuadPart) * 10000000LL / freq.QuadPart;
+    filedisk->Swaps++;
+
+    if (old_file_obj)
+      ObDereferenceObject(old_file_obj);
+    if (old_file)
+      ZwClose(old_file);
+    return STATUS_SUCCESS;
   }
 
 /** Private function definitions. */
@@ -427,9 +579,7 @@ static NTSTATUS STDCALL WvFilediskIo_(
     IN PIRP irp
   ) {
     WV_SP_FILEDISK_T filedisk_ptr;
-    LARGE_INTEGER offset;
-    NTSTATUS status;
-    IO_STATUS_BLOCK io_status;
+    WV_SP_FILEDISK_IO_ io;
 
     if (sector_count < 1) {
         /* A silly request. */
@@ -440,56 +590,378 @@ static NTSTATUS STDCALL WvFilediskIo_(
     /* Establish pointer to the filedisk. */
     filedisk_ptr = CONTAINING_RECORD(disk_ptr, WV_S_FILEDISK_T, disk);
 
-    /*
-     * These SCSI read/write IRPs should be completed in the thread context.
-     * Check if the IRP was already marked pending.
-     */
-    if (!(IoGetCurrentIrpStackLocation(irp)->Control & SL_PENDING_RETURNED)) {
-        /* Enqueue and signal work. */
-        IoMarkIrpPending(irp);
-        ExInterlockedInsertTailList(
-            filedisk_ptr->Irps,
-            &irp->Tail.Overlay.ListEntry,
-            filedisk_ptr->IrpsLock
+    /* A RAM image which has been loaded is simply copied. */
+    if (filedisk_ptr->Ram && WvFilediskRamLoaded(filedisk_ptr->Ram)) {
+        return WvFilediskIoSync_(
+            filedisk_ptr,
+            mode,
+            start_sector,
+            sector_count,
+            buffer,
+            irp
           );
-        KeSetEvent(&filedisk_ptr->Thread->Signal, 0, FALSE);
-        return STATUS_PENDING;
       }
 
-    /* Calculate the offset. */
-    offset.QuadPart = start_sector * disk_ptr->SectorSize;
-    offset.QuadPart += filedisk_ptr->offset.QuadPart;
+    /*
+     * Anything else is done from a pool worker.  The IRP might be a
+     * SCSI IRP or a part of a split request, so the request's details
+     * go with it rather than being decoded from it again.
+     */
+    io = wv_mallocz(sizeof *io);
+    if (!io)
+      return WvlIrpComplete(irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+    io->Run = WvFilediskIoRun_;
+    io->filedisk = filedisk_ptr;
+    io->irp = irp;
+    io->mode = mode;
+    io->start_sector = start_sector;
+    io->length = sector_count * disk_ptr->SectorSize;
+    io->buffer = buffer;
+    return WvFilediskEnqueue_(io);
+  }
 
-    /* Perform the read/write. */
-    if (mode == WvlDiskIoModeWrite) {
-        status = ZwWriteFile(
-            filedisk_ptr->file,
-            NULL,
-            NULL,
-            NULL,
-            &io_status,
-            buffer,
+/* Enqueue a request with its IRP and schedule work.  Pends the IRP. */
+static NTSTATUS STDCALL WvFilediskEnqueue_(IN WV_SP_FILEDISK_IO_ io) {
+    WV_SP_FILEDISK_T filedisk = io->filedisk;
+
+    io->irp->Tail.Overlay.DriverContext[0] = io;
+    IoMarkIrpPending(io->irp);
+    ExInterlockedInsertTailList(
+        filedisk->Irps,
+        &io->irp->Tail.Overlay.ListEntry,
+        filedisk->IrpsLock
+      );
+    WvFilediskScheduleIrps_(filedisk);
+    return STATUS_PENDING;
+  }
+
+/*
+ * Perform I/O with a snapshot, an image format, a mapped file or a RAM
+ * image, which is done synchronously.  Completes the IRP.
+ */
+static NTSTATUS STDCALL WvFilediskIoSync_(
+    IN WV_SP_FILEDISK_T filedisk_ptr,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count,
+    IN PUCHAR buffer,
+    IN PIRP irp
+  ) {
+    WVL_SP_DISK_T disk_ptr = filedisk_ptr->disk;
+    NTSTATUS status;
+
+    if (filedisk_ptr->Snapshot) {
+        status = WvFilediskSnapshotIo(
+            filedisk_ptr,
+            mode,
+            (ULONGLONG) start_sector * disk_ptr->SectorSize,
             sector_count * disk_ptr->SectorSize,
-            &offset,
-            NULL
+            buffer
+          );
+      } else if (filedisk_ptr->Ram) {
+        status = WvFilediskRamIo(
+            filedisk_ptr,
+            mode,
+            (ULONGLONG) start_sector * disk_ptr->SectorSize,
+            sector_count * disk_ptr->SectorSize,
+            buffer
+          );
+      } else if (filedisk_ptr->Section) {
+        status = WvFilediskSectionIo(
+            filedisk_ptr,
+            mode,
+            (ULONGLONG) start_sector * disk_ptr->SectorSize,
+            sector_count * disk_ptr->SectorSize,
+            buffer
           );
       } else {
-        status = ZwReadFile(
-            filedisk_ptr->file,
-            NULL,
-            NULL,
-            NULL,
-            &io_status,
-            buffer,
+        status = filedisk_ptr->Format->Io(
+            filedisk_ptr->FormatState,
+            mode,
+            (ULONGLONG) start_sector * disk_ptr->SectorSize,
             sector_count * disk_ptr->SectorSize,
-            &offset,
-            NULL
+            buffer
+          );
+      }
+    /* When the MBR is read, re-determine the disk geometry. */
+    if (NT_SUCCESS(status) && mode == WvlDiskIoModeRead && !start_sector)
+      WvlDiskGuessGeometry((WVL_AP_DISK_BOOT_SECT) buffer, disk_ptr);
+    return WvlIrpComplete(
+        irp,
+        NT_SUCCESS(status) ? sector_count * disk_ptr->SectorSize : 0,
+        status
+      );
+  }
+
+/* Perform a queued read or write, from a pool worker. */
+static VOID STDCALL WvFilediskIoRun_(IN WV_SP_FILEDISK_IO_ io) {
+    WV_SP_FILEDISK_T filedisk_ptr = io->filedisk;
+    WVL_SP_DISK_T disk_ptr = filedisk_ptr->disk;
+    LARGE_INTEGER offset;
+    PDEVICE_OBJECT file_dev;
+    PIRP file_irp;
+    PIO_STACK_LOCATION io_stack_loc;
+    KIRQL irql;
+
+    if (
+        filedisk_ptr->Snapshot ||
+        filedisk_ptr->Format ||
+        filedisk_ptr->Section ||
+        filedisk_ptr->Ram
+      ) {
+        WvFilediskIoSync_(
+            filedisk_ptr,
+            io->mode,
+            io->start_sector,
+            io->length / disk_ptr->SectorSize,
+            io->buffer,
+            io->irp
+          );
+        wv_free(io);
+        return;
+      }
+
+    /*
+     * Send the read/write straight to the file's driver and let the
+     * completion routine complete the IRP, so that up to QueueDepth of
+     * them can be in flight at once.
+     */
+
+    /* Hold the file object, in case of a hot-swap. */
+    KeAcquireSpinLock(filedisk_ptr->IrpsLock, &irql);
+    io->file_obj = filedisk_ptr->FileObj;
+    if (io->file_obj)
+      ObReferenceObject(io->file_obj);
+    offset.QuadPart = io->start_sector * disk_ptr->SectorSize;
+    offset.QuadPart += filedisk_ptr->offset.QuadPart;
+    KeReleaseSpinLock(filedisk_ptr->IrpsLock, irql);
+    if (!io->file_obj) {
+        DBG("No backing file yet!\n");
+        WvlIrpComplete(io->irp, 0, STATUS_DEVICE_NOT_READY);
+        wv_free(io);
+        return;
+      }
+
+    file_dev = IoGetRelatedDeviceObject(io->file_obj);
+    file_irp = IoAllocateIrp(file_dev->StackSize, FALSE);
+    if (!file_irp) {
+        ObDereferenceObject(io->file_obj);
+        WvlIrpComplete(io->irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+        wv_free(io);
+        return;
+      }
+    file_irp->UserBuffer = io->buffer;
+    file_irp->RequestorMode = KernelMode;
+    file_irp->Tail.Overlay.Thread = PsGetCurrentThread();
+    file_irp->Tail.Overlay.OriginalFileObject = io->file_obj;
+    file_irp->Flags = IRP_NOCACHE;
+    io_stack_loc = IoGetNextIrpStackLocation(file_irp);
+    io_stack_loc->FileObject = io->file_obj;
+    if (io->mode == WvlDiskIoModeWrite) {
+        file_irp->Flags |= IRP_WRITE_OPERATION;
+        io_stack_loc->MajorFunction = IRP_MJ_WRITE;
+        io_stack_loc->Parameters.Write.Length = io->length;
+        io_stack_loc->Parameters.Write.ByteOffset = offset;
+      } else {
+        file_irp->Flags |= IRP_READ_OPERATION;
+        io_stack_loc->MajorFunction = IRP_MJ_READ;
+        io_stack_loc->Parameters.Read.Length = io->length;
+        io_stack_loc->Parameters.Read.ByteOffset = offset;
+      }
+    IoSetCompletionRoutine(
+        file_irp,
+        WvFilediskIoCompletion_,
+        io,
+        TRUE,
+        TRUE,
+        TRUE
+      );
+
+    InterlockedIncrement(&filedisk_ptr->Outstanding);
+    InterlockedIncrement(&filedisk_ptr->IoRefs);
+    IoCallDriver(file_dev, file_irp);
+    return;
+  }
+
+/* Filedisk flush routine. */
+static NTSTATUS STDCALL WvFilediskFlush_(
+    IN WVL_SP_DISK_T disk,
+    IN PIRP irp
+  ) {
+    WV_SP_FILEDISK_T filedisk = CONTAINING_RECORD(
+        disk,
+        WV_S_FILEDISK_T,
+        disk[0]
+      );
+    WV_SP_FILEDISK_IO_ io;
+
+    /* Writes made with file I/O are left to the file system. */
+    if (!filedisk->Section)
+      return WvlIrpComplete(irp, 0, STATUS_SUCCESS);
+
+    /* As for I/O, the views are only touched from the queue. */
+    io = wv_mallocz(sizeof *io);
+    if (!io)
+      return WvlIrpComplete(irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+    io->Run = WvFilediskFlushRun_;
+    io->filedisk = filedisk;
+    io->irp = irp;
+    return WvFilediskEnqueue_(io);
+  }
+
+/* Perform a queued flush, from a pool worker. */
+static VOID STDCALL WvFilediskFlushRun_(IN WV_SP_FILEDISK_IO_ io) {
+    WvlIrpComplete(io->irp, 0, WvFilediskSectionFlush(io->filedisk));
+    wv_free(io);
+    return;
+  }
+
+/* Filedisk unmap routine. */
+static NTSTATUS STDCALL WvFilediskUnmap_(
+    IN WVL_SP_DISK_T disk,
+    IN WVL_SP_DISK_RANGE ranges,
+    IN UINT32 count,
+    IN PIRP irp
+  ) {
+    WV_SP_FILEDISK_T filedisk = CONTAINING_RECORD(
+        disk,
+        WV_S_FILEDISK_T,
+        disk[0]
+      );
+    WV_SP_FILEDISK_IO_ io;
+
+    /*
+     * A snapshot's overlay or a RAM image drops blocks.  A plain file
+     * has holes punched, if it's sparse.  An image format keeps its
+     * blocks.
+     */
+    if (
+        !filedisk->Snapshot &&
+        !filedisk->Ram &&
+        (filedisk->Format || !filedisk->Sparse)
+      )
+      return WvlIrpComplete(irp, 0, STATUS_SUCCESS);
+
+    /*
+     * This is file I/O, so it's done from the queue, in order.  The
+     * ranges mightn't outlive this call, so they go with the record.
+     */
+    io = wv_mallocz(sizeof *io + sizeof *ranges * count);
+    if (!io)
+      return WvlIrpComplete(irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+    io->Run = WvFilediskUnmapRun_;
+    io->filedisk = filedisk;
+    io->irp = irp;
+    io->ranges = (WVL_SP_DISK_RANGE) (io + 1);
+    io->count = count;
+    RtlCopyMemory(io->ranges, ranges, sizeof *ranges * count);
+    return WvFilediskEnqueue_(io);
+  }
+
+/* Perform a queued unmap, from a pool worker. */
+static VOID STDCALL WvFilediskUnmapRun_(IN WV_SP_FILEDISK_IO_ io) {
+    WV_SP_FILEDISK_T filedisk = io->filedisk;
+    WVL_SP_DISK_T disk = filedisk->disk;
+    WVL_SP_DISK_RANGE range;
+    PFILE_OBJECT file_obj;
+    LONGLONG file_offset;
+    ULONGLONG offset;
+    ULONGLONG length;
+    KIRQL irql;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (filedisk->Snapshot || filedisk->Ram) {
+        for (range = io->ranges; range < io->ranges + io->count; range++) {
+            offset = range->StartSector * disk->SectorSize;
+            length = (ULONGLONG) range->SectorCount * disk->SectorSize;
+            if (filedisk->Snapshot) {
+                status = WvFilediskSnapshotUnmap(filedisk, offset, length);
+                if (!NT_SUCCESS(status))
+                  break;
+              } else {
+                WvFilediskRamUnmap(filedisk, offset, length);
+              }
+          }
+        goto out;
+      }
+
+    /* The file system won't release what's mapped into a view. */
+    if (filedisk->Section) {
+        status = WvFilediskSectionFlush(filedisk);
+        if (!NT_SUCCESS(status))
+          goto out;
+      }
+
+    /* Hold the file object, in case of a hot-swap. */
+    KeAcquireSpinLock(filedisk->IrpsLock, &irql);
+    file_obj = filedisk->FileObj;
+    if (file_obj)
+      ObReferenceObject(file_obj);
+    file_offset = filedisk->offset.QuadPart;
+    KeReleaseSpinLock(filedisk->IrpsLock, irql);
+    if (!file_obj) {
+        status = STATUS_DEVICE_NOT_READY;
+        goto out;
+      }
+
+    for (range = io->ranges; range < io->ranges + io->count; range++) {
+        status = WvFilediskFileZero(
+            file_obj,
+            file_offset + range->StartSector * disk->SectorSize,
+            (LONGLONG) range->SectorCount * disk->SectorSize
           );
-        /* When the MBR is read, re-determine the disk geometry. */
-        if (!start_sector)
-          WvlDiskGuessGeometry((WVL_AP_DISK_BOOT_SECT) buffer, disk_ptr);
+        if (!NT_SUCCESS(status)) {
+            DBG("Couldn't punch file: %08X\n", status);
+            break;
+          }
+      }
+    ObDereferenceObject(file_obj);
+
+    out:
+
+    WvlIrpComplete(io->irp, 0, status);
+    wv_free(io);
+    return;
+  }
+
+/* Complete a SCSI IRP when its file I/O completes. */
+static NTSTATUS WvFilediskIoCompletion_(
+    IN PDEVICE_OBJECT dev_obj,
+    IN PIRP file_irp,
+    IN PVOID context
+  ) {
+    WV_SP_FILEDISK_IO_ io = context;
+    WV_SP_FILEDISK_T filedisk = io->filedisk;
+    NTSTATUS status = file_irp->IoStatus.Status;
+    PMDL mdl;
+
+    /* The file system might have locked our buffer; undo that. */
+    while (mdl = file_irp->MdlAddress) {
+        file_irp->MdlAddress = mdl->Next;
+        MmUnlockPages(mdl);
+        IoFreeMdl(mdl);
       }
-    return WvlIrpComplete(irp, sector_count * disk_ptr->SectorSize, status);
+    IoFreeIrp(file_irp);
+    ObDereferenceObject(io->file_obj);
+
+    /* When the MBR is read, re-determine the disk geometry. */
+    if (NT_SUCCESS(status) && io->mode == WvlDiskIoModeRead && !io->start_sector)
+      WvlDiskGuessGeometry((WVL_AP_DISK_BOOT_SECT) io->buffer, filedisk->disk);
+
+    WvlIrpComplete(io->irp, NT_SUCCESS(status) ? io->length : 0, status);
+    wv_free(io);
+
+    /*
+     * Issue more, if any were held back.  Our reference keeps the
+     * filedisk until then, and dropping it must be the last thing we
+     * do with the filedisk.
+     */
+    InterlockedDecrement(&filedisk->Outstanding);
+    WvFilediskScheduleIrps_(filedisk);
+    WvFilediskIoPut_(filedisk);
+
+    /* We freed the IRP; stop the I/O manager from touching it. */
+    return STATUS_MORE_PROCESSING_REQUIRED;
   }
 
 /* Filedisk PnP ID query-response routine. */
@@ -554,11 +1026,15 @@ static NTSTATUS STDCALL WvFilediskPnpQueryId_(
     return WvlIrpComplete(irp, 0, status);
   }
 
-/* A filedisk thread file-opening work item. */
+/* A filedisk file-opening work item. */
 typedef struct WV_FILEDISK_OPENER_ {
     WVL_S_THREAD_ITEM item[1];
     WV_SP_FILEDISK_T filedisk;
     UNICODE_STRING file_path[1];
+    /* For a snapshot; otherwise, its Buffer is NULL */
+    UNICODE_STRING overlay_path[1];
+    /* WV_MOUNT_FLAG options */
+    UINT32 flags;
     NTSTATUS status;
     KEVENT completion[1];
   } WV_S_FILEDISK_OPENER_, * WV_SP_FILEDISK_OPENER_;
@@ -574,6 +1050,8 @@ static VOID STDCALL WvFilediskOpenInThread_(IN OUT WVL_SP_THREAD_ITEM item) {
     HANDLE file = NULL;
     IO_STATUS_BLOCK io_status;
     FILE_STANDARD_INFORMATION file_info;
+    FILE_BASIC_INFORMATION basic_info;
+    ULONGLONG disk_size;
 
     /* Impersonate the user creating the filedisk. */
     opener->status = WvFilediskImpersonate(opener->filedisk->impersonation);
@@ -590,10 +1068,16 @@ static VOID STDCALL WvFilediskOpenInThread_(IN OUT WVL_SP_THREAD_ITEM item) {
         NULL,
         NULL
       );
-    /* Open the file.  The handle is closed when the thread finishes. */
+    /*
+     * Open the file.  The handle is closed when the filedisk is freed.
+     * A snapshot's base is only read, and through the cache.  A mapped
+     * file's pages are the cache's, so it is opened for caching, too.
+     */
     opener->status = ZwCreateFile(
         &file,
-        GENERIC_READ | GENERIC_WRITE,
+        opener->overlay_path->Buffer ?
+          GENERIC_READ :
+          GENERIC_READ | GENERIC_WRITE,
         &obj_attrs,
         &io_status,
         NULL,
@@ -602,8 +1086,12 @@ static VOID STDCALL WvFilediskOpenInThread_(IN OUT WVL_SP_THREAD_ITEM item) {
         FILE_OPEN,
         FILE_NON_DIRECTORY_FILE |
           FILE_RANDOM_ACCESS |
-          FILE_NO_INTERMEDIATE_BUFFERING |
-          FILE_SYNCHRONOUS_IO_NONALERT,
+          (
+              opener->overlay_path->Buffer ||
+              (opener->flags & WvMountFlagMapped) ?
+              0 :
+              FILE_NO_INTERMEDIATE_BUFFERING
+            ),
         NULL,
         0
       );
@@ -612,7 +1100,10 @@ static VOID STDCALL WvFilediskOpenInThread_(IN OUT WVL_SP_THREAD_ITEM item) {
         goto err_open;
       }
 
-    /* Determine the disk's size. */
+    /*
+     * Determine the disk's size.  The handle is for asynchronous I/O,
+     * but this query is always satisfied at once.
+     */
     opener->status = ZwQueryInformationFile(
         file,
         &io_status,
@@ -624,24 +1115,101 @@ static VOID STDCALL WvFilediskOpenInThread_(IN OUT WVL_SP_THREAD_ITEM item) {
         DBG("Couldn't query file size!\n");
         goto err_query_info;
       }
+    disk_size = file_info.EndOfFile.QuadPart;
+
+    /* A sparse file can give back the space of what's unmapped. */
+    if (NT_SUCCESS(ZwQueryInformationFile(
+        file,
+        &io_status,
+        &basic_info,
+        sizeof basic_info,
+        FileBasicInformation
+      )))
+      opener->filedisk->Sparse = (BOOLEAN) (
+          (basic_info.FileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0
+        );
+
+    /* Opened. */
+    opener->status = WvFilediskSetFile(opener->filedisk, file);
+    if (!NT_SUCCESS(opener->status))
+      goto err_set_file;
+
+    /*
+     * An image format presents its virtual size.  Any parents are
+     * opened now, while we're impersonating.
+     */
+    opener->status = WvFilediskFormatOpen(
+        opener->filedisk,
+        file,
+        opener->file_path,
+        &disk_size
+      );
+    if (!NT_SUCCESS(opener->status)) {
+        /* The filedisk owns the file, now. */
+        DBG("Couldn't open image format!\n");
+        goto out;
+      }
     opener->filedisk->disk->LBADiskSize =
-      file_info.EndOfFile.QuadPart / opener->filedisk->disk->SectorSize;
+      disk_size / opener->filedisk->disk->SectorSize;
+
+    if (opener->overlay_path->Buffer) {
+        opener->status = WvFilediskSnapshotOpen(
+            opener->filedisk,
+            opener->file_path,
+            opener->overlay_path
+          );
+        if (!NT_SUCCESS(opener->status)) {
+            DBG("Couldn't open snapshot!\n");
+            goto out;
+          }
+      }
+
+    /* Only a raw image can be mapped or loaded into RAM. */
+    if (opener->flags & WvMountFlagRam) {
+        if (opener->filedisk->Format) {
+            DBG("Not loading %s image\n", opener->filedisk->Format->Name);
+          } else {
+            opener->status = WvFilediskRamOpen(
+                opener->filedisk,
+                (BOOLEAN) ((opener->flags & WvMountFlagWriteBack) != 0)
+              );
+            if (!NT_SUCCESS(opener->status)) {
+                DBG("Couldn't load file into RAM!\n");
+                goto out;
+              }
+          }
+      }
+    if (opener->flags & WvMountFlagMapped) {
+        if (opener->filedisk->Format) {
+            DBG("Not mapping %s image\n", opener->filedisk->Format->Name);
+          } else {
+            opener->status = WvFilediskSectionOpen(opener->filedisk);
+            if (!NT_SUCCESS(opener->status)) {
+                DBG("Couldn't map file!\n");
+                goto out;
+              }
+          }
+      }
 
     /*
      * A really stupid "hash".  RtlHashUnicodeString() would have been
-     * good, but is only available >= Windows XP.
+     * good, but is only available >= Windows XP.  Snapshots of one base
+     * are told apart by their overlays.
      */
     opener->filedisk->hash = (UINT32) opener->filedisk->disk->LBADiskSize;
     {   PWCHAR path_iterator = opener->file_path->Buffer;
     
         while (*path_iterator)
           opener->filedisk->hash += *path_iterator++;
+        path_iterator = opener->overlay_path->Buffer;
+        while (path_iterator && *path_iterator)
+          opener->filedisk->hash += *path_iterator++;
       }
 
-    /* Opened. */
-    opener->filedisk->file = file;
     goto out;
 
+    err_set_file:
+
     err_query_info:
 
     ZwClose(file);
@@ -656,10 +1224,21 @@ static VOID STDCALL WvFilediskOpenInThread_(IN OUT WVL_SP_THREAD_ITEM item) {
     return;
   }
 
-/* Attempt to impersonate a client and open a file for the filedisk. */
+/**
+ * Attempt to impersonate a client and open a file for the filedisk.
+ *
+ * @v filedisk          The filedisk to open the file for.
+ * @v file_path         The file's path.
+ * @v overlay_path      For a snapshot, the overlay's path.  Otherwise,
+ *                      NULL.
+ * @v flags             WV_MOUNT_FLAG options.
+ * @ret NTSTATUS        The status of the operation.
+ */
 static NTSTATUS STDCALL WvFilediskOpen_(
     IN WV_SP_FILEDISK_T filedisk,
-    IN PANSI_STRING file_path
+    IN PANSI_STRING file_path,
+    IN PANSI_STRING overlay_path,
+    IN UINT32 flags
   ) {
     WV_S_FILEDISK_OPENER_ opener;
 
@@ -673,6 +1252,18 @@ static NTSTATUS STDCALL WvFilediskOpen_(
         DBG("Couldn't allocate Unicode file path!\n");
         goto err_ansi_to_unicode;
       }
+    opener.overlay_path->Buffer = NULL;
+    if (overlay_path) {
+        opener.status = RtlAnsiStringToUnicodeString(
+            opener.overlay_path,
+            overlay_path,
+            TRUE
+          );
+        if (!NT_SUCCESS(opener.status)) {
+            DBG("Couldn't allocate Unicode overlay path!\n");
+            goto err_overlay_path;
+          }
+      }
 
     /* Build the impersonation context. */
     opener.status = WvFilediskCreateClientSecurity(&filedisk->impersonation);
@@ -684,11 +1275,12 @@ static NTSTATUS STDCALL WvFilediskOpen_(
     /* Build the rest of the work item. */
     opener.item->Func = WvFilediskOpenInThread_;
     opener.filedisk = filedisk;
+    opener.flags = flags;
     KeInitializeEvent(opener.completion, SynchronizationEvent, FALSE);
 
-    /* Attempt to open the file from within the filedisk's thread. */
-    if (!(WvlThreadAddItem(filedisk->Thread, opener.item))) {
-        DBG("Filedisk thread not active!\n");
+    /* Attempt to open the file in the filedisk's queue. */
+    if (!(WvlThreadQueueAddItem(filedisk->Queue, opener.item))) {
+        DBG("Couldn't queue the opener!\n");
         goto err_add_item;
       }
     KeWaitForSingleObject(
@@ -704,6 +1296,10 @@ static NTSTATUS STDCALL WvFilediskOpen_(
 
     err_impersonation:
 
+    if (opener.overlay_path->Buffer)
+      RtlFreeUnicodeString(opener.overlay_path);
+    err_overlay_path:
+
     RtlFreeUnicodeString(opener.file_path);
     err_ansi_to_unicode:
 
@@ -722,63 +1318,67 @@ static UCHAR STDCALL WvFilediskUnitNum_(IN WVL_SP_DISK_T disk) {
     return (UCHAR) WvlBusGetNodeNum(&filedisk->Dev->BusNode);
   }
 
-/* A filedisk's thread routine. */
-static VOID STDCALL WvFilediskThread_(IN OUT WVL_SP_THREAD_ITEM item) {
+/* Schedule the processing of queued SCSI IRPs, if it's needed. */
+static VOID STDCALL WvFilediskScheduleIrps_(IN WV_SP_FILEDISK_T filedisk) {
+    if (
+        filedisk->Outstanding >= filedisk->QueueDepth ||
+        IsListEmpty(filedisk->Irps)
+      )
+      return;
+    /* Already scheduled? */
+    if (InterlockedExchange(&filedisk->IrpsScheduled, 1))
+      return;
+    /* The scheduled work holds the disk's I/O until it has run. */
+    InterlockedIncrement(&filedisk->IoRefs);
+    if (!WvlThreadQueueAddItem(filedisk->Queue, filedisk->IrpsItem)) {
+        DBG("Couldn't schedule IRPs for filedisk %p!\n", (PVOID) filedisk);
+        InterlockedExchange(&filedisk->IrpsScheduled, 0);
+        WvFilediskIoPut_(filedisk);
+      }
+    return;
+  }
+
+/* Drop a reference to a filedisk's I/O, signalling IoIdle for the last. */
+static VOID STDCALL WvFilediskIoPut_(IN WV_SP_FILEDISK_T filedisk) {
+    if (!InterlockedDecrement(&filedisk->IoRefs))
+      KeSetEvent(&filedisk->IoIdle, 0, FALSE);
+    return;
+  }
+
+/*
+ * Process queued IRPs in a pool worker.  Each carries a record of its
+ * request, which says how to run it.
+ */
+static VOID STDCALL WvFilediskProcessIrps_(IN OUT WVL_SP_THREAD_ITEM item) {
     WV_SP_FILEDISK_T filedisk = CONTAINING_RECORD(
         item,
         WV_S_FILEDISK_T,
-        Thread[0].Main
+        IrpsItem[0]
       );
-    LARGE_INTEGER timeout;
-    WVL_SP_THREAD_ITEM work_item;
     PLIST_ENTRY irp_item;
 
-    /* Wake up at least every 30 seconds. */
-    timeout.QuadPart = -300000000LL;
+    /* From here on, a completion or a new IRP may schedule us again. */
+    InterlockedExchange(&filedisk->IrpsScheduled, 0);
 
+    /*
+     * Leave the rest queued once QueueDepth file I/Os are in flight.
+     * A completion will schedule us again.
+     */
     while (
-        (filedisk->Thread->State == WvlThreadStateStarted) ||
-        (filedisk->Thread->State == WvlThreadStateStopping)
-      ) {
-        /* Wait for the work signal or the timeout. */
-        KeWaitForSingleObject(
-            &filedisk->Thread->Signal,
-            Executive,
-            KernelMode,
-            FALSE,
-            &timeout
-          );
-        /* Reset the work signal. */
-        KeResetEvent(&filedisk->Thread->Signal);
-
-        /* Process work items.  One of these might be a stopper. */
-        while (work_item = WvlThreadGetItem(filedisk->Thread))
-          work_item->Func(work_item);
-
-        /* Process SCSI IRPs. */
-        while (irp_item = ExInterlockedRemoveHeadList(
+        filedisk->Outstanding < filedisk->QueueDepth &&
+        (irp_item = ExInterlockedRemoveHeadList(
             filedisk->Irps,
             filedisk->IrpsLock
-          )) {
-            PIRP irp;
-            PIO_STACK_LOCATION io_stack_loc;
-
-            irp = CONTAINING_RECORD(irp_item, IRP, Tail.Overlay.ListEntry);
-            io_stack_loc = IoGetCurrentIrpStackLocation(irp);
-            if (io_stack_loc->MajorFunction != IRP_MJ_SCSI) {
-                DBG("Non-SCSI IRP!\n");
-                continue;
-              }
-            WvlDiskScsi(filedisk->Dev->Self, irp, filedisk->disk);
-          }
+          ))
+      ) {
+        PIRP irp;
+        WV_SP_FILEDISK_IO_ io;
 
-        /* Are we finished? */
-        if (filedisk->Thread->State == WvlThreadStateStopping)
-          filedisk->Thread->State = WvlThreadStateStopped;
-      } /* while thread started or stopping. */
-    /* Close any open file handle. */
-    if (filedisk->file)
-      ZwClose(filedisk->file);
+        irp = CONTAINING_RECORD(irp_item, IRP, Tail.Overlay.ListEntry);
+        io = irp->Tail.Overlay.DriverContext[0];
+        io->Run(io);
+      }
+    WvFilediskIoPut_(filedisk);
     return;
   }
 
@@ -794,212 +1394,49 @@ static VOID STDCALL WvFilediskFree_(IN WV_SP_DEV_T dev) {
         Dev[0]
       );
     PDEVICE_OBJECT pdo = dev->Self;
-
-    WvlThreadSendStopAndWait(filedisk->Thread);
-    /* It's ok to pass this even if the field is still NULL. */
-    WvFilediskDeleteClientSecurity(&filedisk->impersonation);
-    IoDeleteDevice(pdo);
-    DBG("Deleted PDO: %p\n", pdo);
-    return;
-  }
-
-/**
- * Find and hot-swap to a backing file.  Internal.
- *
- * We search all filesystems for a particular filename, then swap
- * to using it as the backing store.  This is currently useful for
- * sector-mapped disks which should really have a file-in-use lock
- * for the file they represent.  Once the backing file is established,
- * the work item is freed.  Otherwise, it is re-enqueued and the
- * thread will keep trying.
- */
-static BOOLEAN STDCALL WvFilediskHotSwap_(
-    IN WV_SP_FILEDISK_T filedisk,
-    IN PUNICODE_STRING filename
-  ) {
-    NTSTATUS status;
-    GUID vol_guid = GUID_DEVINTERFACE_VOLUME;
-    PWSTR sym_links;
-    PWCHAR pos;
     KIRQL irql;
 
-    /* Do we currently have a backing disk?  If not, re-enqueue for later. */
-    if (filedisk->file == NULL)
-      return FALSE;
     /*
-     * Find the backing volume and use it.  We walk a list
-     * of unicode volume device names and check each one for the file.
+     * Wait for queued work, then drop the disk's own reference to its
+     * I/O and wait for any file I/O in flight and the work it schedules.
      */
-    status = IoGetDeviceInterfaces(&vol_guid, NULL, 0, &sym_links);
-    if (!NT_SUCCESS(status))
-      return FALSE;
-    pos = sym_links;
-    status = STATUS_UNSUCCESSFUL;
-    while (*pos != UNICODE_NULL) {
-        UNICODE_STRING path;
-        PFILE_OBJECT vol_file_obj;
-        PDEVICE_OBJECT vol_dev_obj;
-        UNICODE_STRING vol_dos_name;
-        UNICODE_STRING filepath;
-        static const WCHAR obj_path_prefix[] = L"\\??\\";
-        static const WCHAR path_sep = L'\\';
-        OBJECT_ATTRIBUTES obj_attrs;
-        HANDLE file = 0;
-        IO_STATUS_BLOCK io_status;
-
-        RtlInitUnicodeString(&path, pos);
-        /* Get some object pointers for the volume. */
-        status = IoGetDeviceObjectPointer(
-            &path,
-            FILE_READ_DATA,
-            &vol_file_obj,
-            &vol_dev_obj
-          );
-        if (!NT_SUCCESS(status))
-          goto err_obj_ptrs;
-        /* Get the DOS name. */
-        vol_dos_name.Buffer = NULL;
-        vol_dos_name.Length = vol_dos_name.MaximumLength = 0;
-        status = RtlVolumeDeviceToDosName(
-            vol_file_obj->DeviceObject,
-            &vol_dos_name
-          );
-        if (!NT_SUCCESS(status))
-          goto err_dos_name;
-        /* Build the file path.  Ugh, what a mess. */
-        filepath.Length = filepath.MaximumLength =
-          sizeof obj_path_prefix -
-          sizeof UNICODE_NULL +
-          vol_dos_name.Length +
-          sizeof path_sep +
-          filename->Length;
-        filepath.Buffer = wv_malloc(filepath.Length);
-        if (filepath.Buffer == NULL) {
-            status = STATUS_UNSUCCESSFUL;
-            goto err_alloc_buf;
-          }
-        {   PCHAR buf = (PCHAR) filepath.Buffer;
-
-            RtlCopyMemory(
-                buf,
-                obj_path_prefix,
-                sizeof obj_path_prefix - sizeof UNICODE_NULL
-              );
-            buf += sizeof obj_path_prefix - sizeof UNICODE_NULL;
-            RtlCopyMemory(buf, vol_dos_name.Buffer, vol_dos_name.Length);
-            buf += vol_dos_name.Length;
-            RtlCopyMemory(buf, &path_sep, sizeof path_sep);
-            buf += sizeof path_sep;
-            RtlCopyMemory(buf, filename->Buffer, filename->Length);
-          } /* buf scope */
-        InitializeObjectAttributes(
-            &obj_attrs,
-            &filepath,
-            OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
-            NULL,
-            NULL
-          );
-        /* Look for the file on this volume. */
-        status = ZwCreateFile(
-            &file,
-            GENERIC_READ | GENERIC_WRITE,
-            &obj_attrs,
-            &io_status,
-            NULL,
-            FILE_ATTRIBUTE_NORMAL,
-            FILE_SHARE_READ | FILE_SHARE_DELETE | FILE_SHARE_WRITE,
-            FILE_OPEN,
-            FILE_NON_DIRECTORY_FILE |
-              FILE_RANDOM_ACCESS |
-              FILE_SYNCHRONOUS_IO_NONALERT,
-            NULL,
-            0
-          );
-        if (!NT_SUCCESS(status))
-          goto err_open;
-        /* We could open it.  Do the hot-swap. */
-        {   HANDLE old = filedisk->file;
-  
-            filedisk->file = 0;
-            filedisk->offset.QuadPart = 0;
-            filedisk->file = file;
-            ZwClose(old);
-          } /* old scope */
-  
-        err_open:
-  
-        wv_free(filepath.Buffer);
-        err_alloc_buf:
-  
-        wv_free(vol_dos_name.Buffer);
-        err_dos_name:
-  
-        ObDereferenceObject(vol_file_obj);
-        err_obj_ptrs:
-        /* Walk to the next terminator. */
-        while (*pos != UNICODE_NULL)
-          pos++;
-        /* If everything succeeded, stop.  Otherwise try the next volume. */
-        if (!NT_SUCCESS(status))
-          pos++;
-      } /* while */
-    wv_free(sym_links);
-    /* Success? */
-    if (NT_SUCCESS(status)) {
-        DBG("Finished hot-swapping.\n");
-        return TRUE;
-      }
-    return FALSE;
-  }
-
-/* The thread responsible for hot-swapping filedisks. */
-static VOID STDCALL WvFilediskHotSwapThread_(IN OUT WVL_SP_THREAD_ITEM item) {
-    LARGE_INTEGER timeout;
-    WVL_SP_THREAD thread = CONTAINING_RECORD(item, WVL_S_THREAD, Main);
-    WVL_SP_THREAD_ITEM work_item;
-    WV_SP_FILEDISK_HOT_SWAPPER_ info;
-
-    /* Wake up at least every 10 seconds. */
-    timeout.QuadPart = -100000000LL;
-
-    while (
-        (thread->State == WvlThreadStateStarted) ||
-        (thread->State == WvlThreadStateStopping)
-      ) {
-        /* Wait for the work signal or the timeout. */
+    WvFilediskRamStop(filedisk->Ram);
+    WvlThreadQueueFlush(filedisk->Queue);
+    if (InterlockedDecrement(&filedisk->IoRefs)) {
         KeWaitForSingleObject(
-            &thread->Signal,
+            &filedisk->IoIdle,
             Executive,
             KernelMode,
             FALSE,
-            &timeout
-          );
-
-        work_item = WvlThreadGetItem(thread);
-        if (!work_item)
-          continue;
-
-        if (work_item->Func != WvFilediskHotSwapThread_) {
-            DBG("Unknown work item.\n");
-            continue;
-          }
-        info = CONTAINING_RECORD(
-            work_item,
-            WV_S_FILEDISK_HOT_SWAPPER_,
-            item[0]
+            NULL
           );
-        /* Attempt a hot swap. */
-        if (WvFilediskHotSwap_(info->filedisk, info->filename)) {
-            /* Success. */
-            RtlFreeUnicodeString(info->filename);
-            wv_free(info);
-          } else {
-            /* Re-enqueue. */
-            WvlThreadAddItem(thread, info->item);
-          }
+      }
+    /* The pool might still be finishing with the queue. */
+    WvlThreadQueueFlush(filedisk->Queue);
+    WvFilediskSectionFree(filedisk->Section);
+    filedisk->Section = NULL;
+    WvFilediskRamFree(filedisk->Ram);
+    filedisk->Ram = NULL;
+    WvFilediskSnapshotFree(filedisk->Snapshot);
+    filedisk->Snapshot = NULL;
+    if (filedisk->Format)
+      filedisk->Format->Free(filedisk->FormatState);
+    filedisk->Format = NULL;
+    filedisk->FormatState = NULL;
+
+    /* Close any open file. */
+    KeAcquireSpinLock(filedisk->IrpsLock, &irql);
+    if (filedisk->FileObj)
+      ObDereferenceObject(filedisk->FileObj);
+    filedisk->FileObj = NULL;
+    KeReleaseSpinLock(filedisk->IrpsLock, irql);
+    if (filedisk->file)
+      ZwClose(filedisk->file);
+    filedisk->file = NULL;
 
-        /* Reset the work signal. */
-        KeResetEvent(&thread->Signal);
-      } /* while thread is running. */
+    /* It's ok to pass this even if the field is still NULL. */
+    WvFilediskDeleteClientSecurity(&filedisk->impersonation);
+    IoDeleteDevice(pdo);
+    DBG("Deleted PDO: %p\n", pdo);
     return;
   }
@@ -0,0 +1,537 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Filedisk image formats.
+ *
+ * When a filedisk is attached, each known format is offered its file.
+ * If one claims it, the filedisk's I/O is translated by the format
+ * instead of going straight to the file.  Formats implemented by the
+ * portable engines in imgfmt.h are bridged here.
+ */
+
+#include <ntifs.h>
+#include <ntddk.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "wv_stdlib.h"
+#include "wv_string.h"
+#include "irp.h"
+#include "driver.h"
+#include "bus.h"
+#include "device.h"
+#include "disk.h"
+#include "thread.h"
+#include "filedisk.h"
+#include "imgfmt.h"
+#include "debug.h"
+
+/** Object types */
+typedef struct WV_FILEDISK_IMGFMT WV_S_FILEDISK_IMGFMT, * WV_SP_FILEDISK_IMGFMT;
+
+/** Struct/union type definitions */
+
+/* An image opened by one of the portable engines */
+struct WV_FILEDISK_IMGFMT {
+    PFILE_OBJECT FileObj;
+    ULONG Seed;
+    IMGFMT_S_FILE File[1];
+    IMGFMT_S Image[1];
+  };
+
+/** Private function declarations */
+static IO_COMPLETION_ROUTINE WvFilediskFileIoDone_;
+static WV_F_FILEDISK_FORMAT_OPEN WvFilediskImgFmtOpen_;
+static WV_F_FILEDISK_FORMAT_IO WvFilediskImgFmtIo_;
+static WV_F_FILEDISK_FORMAT_FREE WvFilediskImgFmtFree_;
+static NTSTATUS STDCALL WvFilediskImgFmtStatus_(IN IMGFMT_E_STATUS);
+static int WvFilediskImgFmtRead_(
+    void *,
+    unsigned long long,
+    unsigned long,
+    void *
+  );
+static int WvFilediskImgFmtWrite_(
+    void *,
+    unsigned long long,
+    unsigned long,
+    const void *
+  );
+static void * WvFilediskImgFmtMalloc_(void *, unsigned long);
+static void WvFilediskImgFmtFreeMem_(void *, void *);
+static void WvFilediskImgFmtRandom_(void *, void *, unsigned long);
+
+/** Objects */
+
+/* VHDX and QCOW2, through the portable engines */
+static const WV_S_FILEDISK_FORMAT WvFilediskImgFmtFormat_ = {
+    "ImgFmt",
+    WvFilediskImgFmtOpen_,
+    WvFilediskImgFmtIo_,
+    WvFilediskImgFmtFree_,
+  };
+
+/* The formats to try, in order */
+static const WV_S_FILEDISK_FORMAT * const WvFilediskFormats_[] = {
+    &WvFilediskVhdFormat,
+    &WvFilediskImgFmtFormat_,
+  };
+
+/** Exported function definitions */
+
+/**
+ * Check a filedisk's file for a known image format.
+ *
+ * @v filedisk          The filedisk whose file to check.
+ * @v file              The filedisk's file.
+ * @v path              The path the file was opened with.
+ * @v size              Populated with the virtual disk's size, in bytes,
+ *                      if the file is of a known format.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * If a format claims the file, the filedisk's Format and FormatState
+ * are set.  Otherwise, the file is a raw image.  Must be called at
+ * PASSIVE_LEVEL.
+ */
+NTSTATUS STDCALL WvFilediskFormatOpen(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN HANDLE file,
+    IN PUNICODE_STRING path,
+    OUT PULONGLONG size
+  ) {
+    PVOID state;
+    ULONG i;
+    NTSTATUS status;
+
+    for (
+        i = 0;
+        i < sizeof WvFilediskFormats_ / sizeof *WvFilediskFormats_;
+        i++
+      ) {
+        status = WvFilediskFormats_[i]->Open(file, path, &state, size);
+        if (!NT_SUCCESS(status))
+          return status;
+        if (state) {
+            filedisk->FormatState = state;
+            filedisk->Format = WvFilediskFormats_[i];
+            return STATUS_SUCCESS;
+          }
+      }
+    return STATUS_SUCCESS;
+  }
+
+/**
+ * Perform a synchronous, non-cached file I/O.
+ *
+ * @v file_obj          The file to perform I/O on.
+ * @v mode              The direction of the I/O.
+ * @v offset            The byte offset into the file.
+ * @v length            The number of bytes to transfer.
+ * @v buffer            The buffer to transfer to or from.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * The file may be open for asynchronous I/O.  A short transfer fails
+ * with STATUS_END_OF_FILE.  Must be called at PASSIVE_LEVEL.
+ */
+NTSTATUS STDCALL WvFilediskFileIo(
+    IN PFILE_OBJECT file_obj,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN LONGLONG offset,
+    IN UINT32 length,
+    IN OUT PVOID buffer
+  ) {
+    PDEVICE_OBJECT dev_obj;
+    PIRP irp;
+    PIO_STACK_LOCATION io_stack_loc;
+    KEVENT done;
+    PMDL mdl;
+    NTSTATUS status;
+
+    dev_obj = IoGetRelatedDeviceObject(file_obj);
+    irp = IoAllocateIrp(dev_obj->StackSize, FALSE);
+    if (!irp)
+      return STATUS_INSUFFICIENT_RESOURCES;
+    KeInitializeEvent(&done, NotificationEvent, FALSE);
+
+    irp->UserBuffer = buffer;
+    irp->RequestorMode = KernelMode;
+    irp->Tail.Overlay.Thread = PsGetCurrentThread();
+    irp->Tail.Overlay.OriginalFileObject = file_obj;
+    irp->Flags = IRP_NOCACHE;
+    io_stack_loc = IoGetNextIrpStackLocation(irp);
+    io_stack_loc->FileObject = file_obj;
+    if (mode == WvlDiskIoModeWrite) {
+        irp->Flags |= IRP_WRITE_OPERATION;
+        io_stack_loc->MajorFunction = IRP_MJ_WRITE;
+        io_stack_loc->Parameters.Write.Length = length;
+        io_stack_loc->Parameters.Write.ByteOffset.QuadPart = offset;
+      } else {
+        irp->Flags |= IRP_READ_OPERATION;
+        io_stack_loc->MajorFunction = IRP_MJ_READ;
+        io_stack_loc->Parameters.Read.Length = length;
+        io_stack_loc->Parameters.Read.ByteOffset.QuadPart = offset;
+      }
+    IoSetCompletionRoutine(
+        irp,
+        WvFilediskFileIoDone_,
+        &done,
+        TRUE,
+        TRUE,
+        TRUE
+      );
+
+    IoCallDriver(dev_obj, irp);
+    KeWaitForSingleObject(&done, Executive, KernelMode, FALSE, NULL);
+
+    status = irp->IoStatus.Status;
+    if (NT_SUCCESS(status) && irp->IoStatus.Information != length)
+      status = STATUS_END_OF_FILE;
+    while (mdl = irp->MdlAddress) {
+        irp->MdlAddress = mdl->Next;
+        MmUnlockPages(mdl);
+        IoFreeMdl(mdl);
+      }
+    IoFreeIrp(irp);
+    return status;
+  }
+
+/**
+ * Flush a file's cached data to its storage.
+ *
+ * @v file_obj          The file to flush.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * The file may be open for asynchronous I/O.  Must be called at
+ * PASSIVE_LEVEL.
+ */
+NTSTATUS STDCALL WvFilediskFileFlush(IN PFILE_OBJECT file_obj) {
+    PDEVICE_OBJECT dev_obj;
+    PIRP irp;
+    PIO_STACK_LOCATION io_stack_loc;
+    KEVENT done;
+    NTSTATUS status;
+
+    dev_obj = IoGetRelatedDeviceObject(file_obj);
+    irp = IoAllocateIrp(dev_obj->StackSize, FALSE);
+    if (!irp)
+      return STATUS_INSUFFICIENT_RESOURCES;
+    KeInitializeEvent(&done, NotificationEvent, FALSE);
+
+    irp->RequestorMode = KernelMode;
+    irp->Tail.Overlay.Thread = PsGetCurrentThread();
+    irp->Tail.Overlay.OriginalFileObject = file_obj;
+    io_stack_loc = IoGetNextIrpStackLocation(irp);
+    io_stack_loc->MajorFunction = IRP_MJ_FLUSH_BUFFERS;
+    io_stack_loc->FileObject = file_obj;
+    IoSetCompletionRoutine(
+        irp,
+        WvFilediskFileIoDone_,
+        &done,
+        TRUE,
+        TRUE,
+        TRUE
+      );
+
+    IoCallDriver(dev_obj, irp);
+    KeWaitForSingleObject(&done, Executive, KernelMode, FALSE, NULL);
+
+    status = irp->IoStatus.Status;
+    IoFreeIrp(irp);
+    return status;
+  }
+
+/**
+ * Zero a range of a file, releasing its space if the file is sparse.
+ *
+ * @v file_obj          The file's file object.
+ * @v offset            The byte offset of the range.
+ * @v length            The length of the range.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Must be called at PASSIVE_LEVEL.
+ */
+NTSTATUS STDCALL WvFilediskFileZero(
+    IN PFILE_OBJECT file_obj,
+    IN LONGLONG offset,
+    IN LONGLONG length
+  ) {
+    FILE_ZERO_DATA_INFORMATION zero_info;
+    PDEVICE_OBJECT dev_obj;
+    PIRP irp;
+    PIO_STACK_LOCATION io_stack_loc;
+    KEVENT done;
+    NTSTATUS status;
+
+    zero_info.FileOffset.QuadPart = offset;
+    zero_info.BeyondFinalZero.QuadPart = offset + length;
+
+    dev_obj = IoGetRelatedDeviceObject(file_obj);
+    irp = IoAllocateIrp(dev_obj->StackSize, FALSE);
+    if (!irp)
+      return STATUS_INSUFFICIENT_RESOURCES;
+    KeInitializeEvent(&done, NotificationEvent, FALSE);
+
+    /* The FSCTL is buffered, but the buffer is ours to free. */
+    irp->AssociatedIrp.SystemBuffer = &zero_info;
+    irp->Flags = IRP_BUFFERED_IO;
+    irp->RequestorMode = KernelMode;
+    irp->Tail.Overlay.Thread = PsGetCurrentThread();
+    irp->Tail.Overlay.OriginalFileObject = file_obj;
+    io_stack_loc = IoGetNextIrpStackLocation(irp);
+    io_stack_loc->MajorFunction = IRP_MJ_FILE_SYSTEM_CONTROL;
+    io_stack_loc->MinorFunction = IRP_MN_USER_FS_REQUEST;
+    io_stack_loc->FileObject = file_obj;
+    io_stack_loc->Parameters.FileSystemControl.FsControlCode =
+      FSCTL_SET_ZERO_DATA;
+    io_stack_loc->Parameters.FileSystemControl.InputBufferLength =
+      sizeof zero_info;
+    IoSetCompletionRoutine(
+        irp,
+        WvFilediskFileIoDone_,
+        &done,
+        TRUE,
+        TRUE,
+        TRUE
+      );
+
+    IoCallDriver(dev_obj, irp);
+    KeWaitForSingleObject(&done, Executive, KernelMode, FALSE, NULL);
+
+    status = irp->IoStatus.Status;
+    IoFreeIrp(irp);
+    return status;
+  }
+
+/** Private function definitions */
+
+/* Signal the completion of a synchronous file I/O. */
+static NTSTATUS WvFilediskFileIoDone_(
+    IN PDEVICE_OBJECT dev_obj,
+    IN PIRP irp,
+    IN PVOID context
+  ) {
+    KeSetEvent(context, 0, FALSE);
+    return STATUS_MORE_PROCESSING_REQUIRED;
+  }
+
+/* Map a portable engine's status to an NTSTATUS. */
+static NTSTATUS STDCALL WvFilediskImgFmtStatus_(IN IMGFMT_E_STATUS status) {
+    switch (status) {
+        case ImgFmtStatusSuccess:
+          return STATUS_SUCCESS;
+
+        case ImgFmtStatusNoMemory:
+          return STATUS_INSUFFICIENT_RESOURCES;
+
+        case ImgFmtStatusInvalid:
+          return STATUS_INVALID_PARAMETER;
+
+        case ImgFmtStatusCorrupt:
+          return STATUS_DISK_CORRUPT_ERROR;
+
+        case ImgFmtStatusUnsupported:
+          return STATUS_NOT_SUPPORTED;
+
+        case ImgFmtStatusReadOnly:
+          return STATUS_MEDIA_WRITE_PROTECTED;
+
+        case ImgFmtStatusFull:
+          return STATUS_DISK_FULL;
+
+        default:
+          return STATUS_IO_DEVICE_ERROR;
+      }
+  }
+
+/* Offer the file to the portable engines. */
+static NTSTATUS STDCALL WvFilediskImgFmtOpen_(
+    IN HANDLE file,
+    IN PUNICODE_STRING path,
+    OUT PVOID * state,
+    OUT PULONGLONG size
+  ) {
+    WV_SP_FILEDISK_IMGFMT imgfmt;
+    IO_STATUS_BLOCK io_status;
+    FILE_STANDARD_INFORMATION file_info;
+    LARGE_INTEGER seed;
+    NTSTATUS status;
+
+    *state = NULL;
+    imgfmt = wv_mallocz(sizeof *imgfmt);
+    if (!imgfmt) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_imgfmt;
+      }
+
+    status = ObReferenceObjectByHandle(
+        file,
+        0,
+        *IoFileObjectType,
+        KernelMode,
+        &imgfmt->FileObj,
+        NULL
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't reference file object!\n");
+        goto err_file_obj;
+      }
+
+    status = ZwQueryInformationFile(
+        file,
+        &io_status,
+        &file_info,
+        sizeof file_info,
+        FileStandardInformation
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't query file size!\n");
+        goto err_open;
+      }
+
+    seed = KeQueryPerformanceCounter(NULL);
+    imgfmt->Seed = seed.LowPart;
+    imgfmt->File->Read = WvFilediskImgFmtRead_;
+    imgfmt->File->Write = WvFilediskImgFmtWrite_;
+    imgfmt->File->Malloc = WvFilediskImgFmtMalloc_;
+    imgfmt->File->Free = WvFilediskImgFmtFreeMem_;
+    imgfmt->File->Random = WvFilediskImgFmtRandom_;
+    imgfmt->File->Size = file_info.EndOfFile.QuadPart;
+    imgfmt->File->Context = imgfmt;
+
+    status = WvFilediskImgFmtStatus_(ImgFmtOpen(imgfmt->File, imgfmt->Image));
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't open image: %08X\n", status);
+        goto err_open;
+      }
+    /* Not ours?  status is STATUS_SUCCESS. */
+    if (!imgfmt->Image->Format)
+      goto err_open;
+
+    DBG(
+        "%s image of %I64u bytes\n",
+        imgfmt->Image->Format->Name,
+        imgfmt->Image->Size
+      );
+    *size = imgfmt->Image->Size;
+    *state = imgfmt;
+    return STATUS_SUCCESS;
+
+    err_open:
+
+    ObDereferenceObject(imgfmt->FileObj);
+    err_file_obj:
+
+    wv_free(imgfmt);
+    err_imgfmt:
+
+    return status;
+  }
+
+/* Read from or write to an image.  PASSIVE_LEVEL only. */
+static NTSTATUS STDCALL WvFilediskImgFmtIo_(
+    IN PVOID state,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN ULONGLONG offset,
+    IN UINT32 length,
+    IN OUT PUCHAR buffer
+  ) {
+    WV_SP_FILEDISK_IMGFMT imgfmt = state;
+
+    if (mode == WvlDiskIoModeWrite)
+      return WvFilediskImgFmtStatus_(
+          ImgFmtWrite(imgfmt->Image, offset, length, buffer)
+        );
+    return WvFilediskImgFmtStatus_(
+        ImgFmtRead(imgfmt->Image, offset, length, buffer)
+      );
+  }
+
+static VOID STDCALL WvFilediskImgFmtFree_(IN PVOID state) {
+    WV_SP_FILEDISK_IMGFMT imgfmt = state;
+
+    if (!imgfmt)
+      return;
+    ImgFmtClose(imgfmt->Image);
+    ObDereferenceObject(imgfmt->FileObj);
+    wv_free(imgfmt);
+    return;
+  }
+
+/* The file operations for the portable engines */
+
+static int WvFilediskImgFmtRead_(
+    void * context,
+    unsigned long long offset,
+    unsigned long length,
+    void * buffer
+  ) {
+    WV_SP_FILEDISK_IMGFMT imgfmt = context;
+
+    return !NT_SUCCESS(
+        WvFilediskFileIo(
+            imgfmt->FileObj,
+            WvlDiskIoModeRead,
+            offset,
+            length,
+            buffer
+          )
+      );
+  }
+
+static int WvFilediskImgFmtWrite_(
+    void * context,
+    unsigned long long offset,
+    unsigned long length,
+    const void * buffer
+  ) {
+    WV_SP_FILEDISK_IMGFMT imgfmt = context;
+
+    return !NT_SUCCESS(
+        WvFilediskFileIo(
+            imgfmt->FileObj,
+            WvlDiskIoModeWrite,
+            offset,
+            length,
+            (PVOID) buffer
+          )
+      );
+  }
+
+/* Translation tables are only used at PASSIVE_LEVEL, so can be paged. */
+static void * WvFilediskImgFmtMalloc_(void * context, unsigned long size) {
+    return wv_palloc(size);
+  }
+
+static void WvFilediskImgFmtFreeMem_(void * context, void * ptr) {
+    wv_free(ptr);
+  }
+
+static void WvFilediskImgFmtRandom_(
+    void * context,
+    void * buffer,
+    unsigned long length
+  ) {
+    WV_SP_FILEDISK_IMGFMT imgfmt = context;
+    PUCHAR buf = buffer;
+
+    while (length--)
+      *buf++ = (UCHAR) RtlRandom(&imgfmt->Seed);
+    return;
+  }
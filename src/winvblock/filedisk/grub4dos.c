@@ -29,6 +29,7 @@
 #include <ntddk.h>
 #include <initguid.h>
 #include <ntddstor.h>
+#include <wdmguid.h>
 
 #include "portable.h"
 #include "winvblock.h"
@@ -44,162 +45,196 @@
 #include "debug.h"
 #include "x86.h"
 #include "safehook.h"
+#include "g4dmap.h"
 #include "grub4dos.h"
 #include "byte.h"
 #include "msvhd.h"
 
-/**
- * Check if a disk might be the matching backing disk for
- * a GRUB4DOS sector-mapped disk by checking for an MBR signature.
- *
- * @v file              HANDLE to an open disk.
- * @v filedisk          Points to the filedisk to match against.
+/** Macros */
+
+/* How long a sector-mapped disk's I/O is held for its backing disk */
+#define WV_M_FILEDISK_G4D_WAIT (-10 * 10000000LL)
+
+/** Object types */
+typedef enum WV_FILEDISK_G4D_CHECK_ WV_E_FILEDISK_G4D_CHECK_;
+typedef struct WV_FILEDISK_G4D_FINDER_
+  WV_S_FILEDISK_G4D_FINDER_, * WV_SP_FILEDISK_G4D_FINDER_;
+typedef struct WV_FILEDISK_G4D_CANDIDATE_
+  WV_S_FILEDISK_G4D_CANDIDATE_, * WV_SP_FILEDISK_G4D_CANDIDATE_;
+typedef struct WV_FILEDISK_G4D_PROBE_
+  WV_S_FILEDISK_G4D_PROBE_, * WV_SP_FILEDISK_G4D_PROBE_;
+typedef struct WV_FILEDISK_G4D_ARRIVAL_
+  WV_S_FILEDISK_G4D_ARRIVAL_, * WV_SP_FILEDISK_G4D_ARRIVAL_;
+
+/** Enumerations */
+
+/* The ways a disk is checked for being a backing disk */
+enum WV_FILEDISK_G4D_CHECK_ {
+    WvFilediskG4dCheckMbrSig_,
+    WvFilediskG4dCheckVhd_,
+    WvFilediskG4dCheckIsoSig_,
+    WvFilediskG4dChecks_
+  };
+
+/** Struct/union type definitions */
+
+/* A sector-mapped disk whose backing disk is being looked for */
+struct WV_FILEDISK_G4D_FINDER_ {
+    /* Holds the disk's I/O until Found is signalled or we give up */
+    WVL_S_THREAD_ITEM item[1];
+    LIST_ENTRY Link;
+    WV_SP_FILEDISK_T filedisk;
+    KEVENT Found;
+    /* The item and the pending list each hold a reference */
+    volatile LONG Refs;
+  };
+
+/* A disk which might be a backing disk */
+struct WV_FILEDISK_G4D_CANDIDATE_ {
+    PWCHAR Path;
+    /* NULL if it couldn't be opened or has been handed over */
+    HANDLE File;
+  };
+
+/* A read checking a candidate for a sector-mapped disk */
+struct WV_FILEDISK_G4D_PROBE_ {
+    ULONG Candidate;
+    ULONG Finder;
+    WV_E_FILEDISK_G4D_CHECK_ Check;
+    LARGE_INTEGER Offset;
+    ULONG Length;
+    PUCHAR Buf;
+    HANDLE Event;
+    IO_STATUS_BLOCK IoStatus;
+    NTSTATUS Status;
+  };
+
+/* A disk which has arrived, to be probed */
+struct WV_FILEDISK_G4D_ARRIVAL_ {
+    WVL_S_THREAD_ITEM item[1];
+    /* A list of one path, as from IoGetDeviceInterfaces() */
+    WCHAR Path[1];
+  };
+
+/** Private function declarations */
+static BOOLEAN STDCALL WvFilediskG4dCheckRead_(
+    IN WV_SP_FILEDISK_T,
+    IN WV_E_FILEDISK_G4D_CHECK_,
+    OUT PLARGE_INTEGER,
+    OUT PULONG
+  );
+static BOOLEAN STDCALL WvFilediskG4dCheckOk_(
+    IN WV_SP_FILEDISK_T,
+    IN WV_E_FILEDISK_G4D_CHECK_,
+    IN OUT PUCHAR
+  );
+static HANDLE STDCALL WvFilediskG4dOpenDisk_(IN PWCHAR);
+static VOID STDCALL WvFilediskG4dStartProbe_(
+    IN HANDLE,
+    IN OUT WV_SP_FILEDISK_G4D_PROBE_
+  );
+static VOID STDCALL WvFilediskG4dProbe_(IN PWCHAR);
+static VOID STDCALL WvFilediskG4dFound_(IN WV_SP_FILEDISK_G4D_FINDER_);
+static VOID STDCALL WvFilediskG4dPut_(IN WV_SP_FILEDISK_G4D_FINDER_);
+static VOID STDCALL WvFilediskG4dScheduleScan_(void);
+static WVL_F_THREAD_ITEM WvFilediskG4dScan_;
+static WVL_F_THREAD_ITEM WvFilediskG4dProbeArrival_;
+static WVL_F_THREAD_ITEM WvFilediskG4dWait_;
+static DRIVER_NOTIFICATION_CALLBACK_ROUTINE WvFilediskG4dArrival_;
+
+/** Objects */
+
+/* Finders whose backing disk hasn't been found.  Protected by WvFindDiskLock */
+static LIST_ENTRY WvFilediskG4dPending_ = {
+    &WvFilediskG4dPending_,
+    &WvFilediskG4dPending_
+  };
+
+/*
+ * Probes are run here, one at a time, so they never race each other.
+ * They open and read disks, so the queue is a blocking one.
  */
-static BOOLEAN STDCALL WvFilediskG4dCheckDiskMatchMbrSig_(
-    IN HANDLE file,
-    IN WV_SP_FILEDISK_T filedisk
-  ) {
-    BOOLEAN ok = FALSE;
-    WVL_SP_DISK_MBR buf;
-    NTSTATUS status;
-    IO_STATUS_BLOCK io_status;
+static WVL_S_THREAD_QUEUE WvFilediskG4dQueue_[1];
+static BOOLEAN WvFilediskG4dQueueInit_;
 
-    /* Allocate a buffer for testing for an MBR signature. */
-    buf = wv_malloc(sizeof *buf);
-    if (buf == NULL) {
-        goto err_alloc;
-      }
+/* Scans all disks.  ScanQueued is non-zero while it is queued */
+static WVL_S_THREAD_ITEM WvFilediskG4dScanItem_[1];
+static volatile LONG WvFilediskG4dScanQueued_;
 
-    /* Read a potential MBR. */
-    status = ZwReadFile(
-        file,
-        NULL,
-        NULL,
-        NULL,
-        &io_status,
-        buf,
-        sizeof *buf,
-        &filedisk->offset,
-        NULL
-      );
-    if (!NT_SUCCESS(status))
-      goto err_read;
-
-    /* Check for the MBR signature. */
-    if (buf->mbr_sig == 0xAA55)
-      ok = TRUE;
-
-    err_read:
+/* For disk arrivals, while any finders are pending */
+static PVOID WvFilediskG4dNotification_;
 
-    wv_free(buf);
-    err_alloc:
-
-    return ok;
-  }
+/** Private function definitions */
 
 /**
- * Check if a disk might be the matching backing disk for
- * a GRUB4DOS sector-mapped disk by checking for a .VHD footer.
+ * Find where to read to check if a disk might be the backing disk for
+ * a GRUB4DOS sector-mapped disk.
  *
- * @v file              HANDLE to an open disk.
- * @v filedisk_ptr      Points to the filedisk to match against.
+ * @v filedisk          The sector-mapped disk.
+ * @v check             The check to make.
+ * @v offset            Populated with the offset of the read.
+ * @v length            Populated with the length of the read.
+ * @ret BOOLEAN         FALSE if the check isn't made for this disk.
  */
-static BOOLEAN STDCALL WvFilediskG4dCheckDiskMatchVHD_(
-    IN HANDLE file,
-    IN WV_SP_FILEDISK_T filedisk_ptr
+static BOOLEAN STDCALL WvFilediskG4dCheckRead_(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN WV_E_FILEDISK_G4D_CHECK_ check,
+    OUT PLARGE_INTEGER offset,
+    OUT PULONG length
   ) {
-    BOOLEAN ok = FALSE;
-    WV_SP_MSVHD_FOOTER buf;
-    NTSTATUS status;
-    LARGE_INTEGER end_part;
-    IO_STATUS_BLOCK io_status;
+    enum { first_vol_desc_byte_offset = 32768 };
 
-    /* Allocate a buffer for testing for a MS .VHD footer. */
-    buf = wv_malloc(sizeof *buf);
-    if (buf == NULL) {
-        goto err_alloc;
+    switch (check) {
+        case WvFilediskG4dCheckMbrSig_:
+          if (filedisk->disk->Media != WvlDiskMediaTypeHard)
+            return FALSE;
+          /* A potential MBR. */
+          *offset = filedisk->offset;
+          *length = sizeof (WVL_S_DISK_MBR);
+          return TRUE;
+
+        case WvFilediskG4dCheckVhd_:
+          if (filedisk->disk->Media != WvlDiskMediaTypeHard)
+            return FALSE;
+          /*
+           * A potential .VHD footer.  Note that we adjust for the .VHD
+           * footer (plus prefixed padding for an .ISO) that we truncated
+           * from the reported disk size earlier when the disk mapping
+           * was found.
+           */
+          offset->QuadPart =
+            filedisk->offset.QuadPart +
+            (filedisk->disk->LBADiskSize * filedisk->disk->SectorSize) +
+            filedisk->disk->SectorSize -
+            sizeof (WV_S_MSVHD_FOOTER);
+          *length = sizeof (WV_S_MSVHD_FOOTER);
+          return TRUE;
+
+        case WvFilediskG4dCheckIsoSig_:
+          if (filedisk->disk->Media != WvlDiskMediaTypeOptical)
+            return FALSE;
+          /* A potential ISO9660 volume descriptor. */
+          offset->QuadPart =
+            filedisk->offset.QuadPart + first_vol_desc_byte_offset;
+          *length = filedisk->disk->SectorSize;
+          return TRUE;
       }
-
-    /*
-     * Read in the buffer.  Note that we adjust for the .VHD footer (plus
-     * prefixed padding for an .ISO) that we truncated from the reported disk
-     * size earlier when the disk mapping was found.
-     */
-    end_part.QuadPart =
-      filedisk_ptr->offset.QuadPart +
-      (filedisk_ptr->disk->LBADiskSize * filedisk_ptr->disk->SectorSize) +
-      filedisk_ptr->disk->SectorSize -
-      sizeof *buf;
-    status = ZwReadFile(
-        file,
-        NULL,
-        NULL,
-        NULL,
-        &io_status,
-        buf,
-        sizeof *buf,
-        &end_part,
-        NULL
-      );
-    if (!NT_SUCCESS(status))
-      goto err_read;
-
-    /* Adjust the footer's byte ordering. */
-    msvhd__footer_swap_endian(buf);
-
-    /* Examine .VHD fields for validity. */
-    if (!wv_memcmpeq(&buf->cookie, "conectix", sizeof buf->cookie))
-      goto err_cookie;
-    if (buf->file_ver.val != 0x10000)
-      goto err_ver;
-    if (buf->data_offset.val != 0xffffffff)
-      goto err_data_offset;
-    if (buf->orig_size.val != buf->cur_size.val)
-      goto err_size;
-    if (buf->type.val != 2)
-      goto err_type;
-
-    /* Match against our expected disk size. */
-    if (
-        (filedisk_ptr->disk->LBADiskSize * filedisk_ptr->disk->SectorSize ) !=
-        buf->cur_size.val
-      )
-      goto err_real_size;
-
-    /* Passed the tests.  We expect it to be our backing disk. */
-    ok = TRUE;
-
-    err_real_size:
-
-    err_type:
-
-    err_size:
-
-    err_data_offset:
-
-    err_ver:
-
-    err_cookie:
-
-    err_read:
-
-    wv_free(buf);
-    err_alloc:
-
-    return ok;
+    return FALSE;
   }
 
 /**
- * Check if a disk might be the matching backing disk for
- * a GRUB4DOS sector-mapped disk by checking for some ISO9660
- * filesystem magic (in the first volume descriptor).
+ * Check if a disk might be the backing disk for a GRUB4DOS
+ * sector-mapped disk by what was read from it.
  *
- * @v file              HANDLE to an open disk.
- * @v filedisk          Points to the filedisk to match against.
+ * @v filedisk          The sector-mapped disk.
+ * @v check             The check made.
+ * @v buf               What was read.  Might be modified.
+ * @ret BOOLEAN         TRUE if the disk might be the backing disk.
  */
-static BOOLEAN STDCALL WvFilediskG4dCheckDiskMatchIsoSig_(
-    IN HANDLE file,
-    IN WV_SP_FILEDISK_T filedisk
+static BOOLEAN STDCALL WvFilediskG4dCheckOk_(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN WV_E_FILEDISK_G4D_CHECK_ check,
+    IN OUT PUCHAR buf
   ) {
     #ifdef _MSC_VER
     #  pragma pack(1)
@@ -211,228 +246,494 @@ static BOOLEAN STDCALL WvFilediskG4dCheckDiskMatchIsoSig_(
     #ifdef _MSC_VER
     #  pragma pack()
     #endif
-    enum { first_vol_desc_byte_offset = 32768 };
     static CHAR iso_magic[] = "CD001";
-    BOOLEAN ok = FALSE;
-    struct vol_desc * buf;
-    LARGE_INTEGER start;
-    NTSTATUS status;
-    IO_STATUS_BLOCK io_status;
-
-    /* Allocate a buffer for testing for some ISO9660 magic. */
-    buf = wv_malloc(filedisk->disk->SectorSize);
-    if (buf == NULL) {
-        goto err_alloc;
+    WV_SP_MSVHD_FOOTER footer;
+
+    switch (check) {
+        case WvFilediskG4dCheckMbrSig_:
+          return ((WVL_SP_DISK_MBR) buf)->mbr_sig == 0xAA55;
+
+        case WvFilediskG4dCheckVhd_:
+          footer = (WV_SP_MSVHD_FOOTER) buf;
+          /* Adjust the footer's byte ordering. */
+          msvhd__footer_swap_endian(footer);
+
+          /* Examine .VHD fields for validity. */
+          if (!wv_memcmpeq(&footer->cookie, "conectix", sizeof footer->cookie))
+            return FALSE;
+          if (footer->file_ver.val != 0x10000)
+            return FALSE;
+          if (footer->data_offset.val != 0xffffffff)
+            return FALSE;
+          if (footer->orig_size.val != footer->cur_size.val)
+            return FALSE;
+          if (footer->type.val != 2)
+            return FALSE;
+
+          /* Match against our expected disk size. */
+          return
+            filedisk->disk->LBADiskSize * filedisk->disk->SectorSize ==
+            footer->cur_size.val;
+
+        case WvFilediskG4dCheckIsoSig_:
+          return wv_memcmpeq(
+              ((struct vol_desc *) buf)->id,
+              iso_magic,
+              sizeof iso_magic - 1
+            );
       }
+    return FALSE;
+  }
 
-    /* Calculate where a volume descriptor might be. */
-    start.QuadPart = filedisk->offset.QuadPart + first_vol_desc_byte_offset;
+/* Open a disk for probing and, if it's the one, for a filedisk's I/O. */
+static HANDLE STDCALL WvFilediskG4dOpenDisk_(IN PWCHAR path) {
+    UNICODE_STRING path_str;
+    OBJECT_ATTRIBUTES obj_attrs;
+    IO_STATUS_BLOCK io_status;
+    HANDLE file;
+    NTSTATUS status;
 
-    /* Read a potential ISO9660 volume descriptor. */
-    status = ZwReadFile(
-        file,
+    RtlInitUnicodeString(&path_str, path);
+    InitializeObjectAttributes(
+        &obj_attrs,
+        &path_str,
+        OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
         NULL,
+        NULL
+      );
+    /* For asynchronous I/O, so that all probes can be in flight. */
+    status = ZwCreateFile(
+        &file,
+        GENERIC_READ | GENERIC_WRITE,
+        &obj_attrs,
+        &io_status,
         NULL,
+        FILE_ATTRIBUTE_NORMAL,
+        FILE_SHARE_READ | FILE_SHARE_DELETE | FILE_SHARE_WRITE,
+        FILE_OPEN,
+        FILE_NON_DIRECTORY_FILE | FILE_RANDOM_ACCESS,
         NULL,
-        &io_status,
-        buf,
-        filedisk->disk->SectorSize,
-        &start,
-        NULL
+        0
       );
     if (!NT_SUCCESS(status))
-      goto err_read;
-
-    /* Check for the ISO9660 magic. */
-    if (wv_memcmpeq(buf->id, iso_magic, sizeof iso_magic - 1))
-      ok = TRUE;
-
-    err_read:
+      return NULL;
+    return file;
+  }
 
-    wv_free(buf);
-    err_alloc:
+/* Issue a probe's read.  Its Status is STATUS_PENDING if it's in flight. */
+static VOID STDCALL WvFilediskG4dStartProbe_(
+    IN HANDLE file,
+    IN OUT WV_SP_FILEDISK_G4D_PROBE_ probe
+  ) {
+    OBJECT_ATTRIBUTES obj_attrs;
 
-    return ok;
+    probe->Buf = wv_malloc(probe->Length);
+    if (!probe->Buf) {
+        probe->Status = STATUS_INSUFFICIENT_RESOURCES;
+        return;
+      }
+    InitializeObjectAttributes(
+        &obj_attrs,
+        NULL,
+        OBJ_KERNEL_HANDLE,
+        NULL,
+        NULL
+      );
+    probe->Status = ZwCreateEvent(
+        &probe->Event,
+        EVENT_ALL_ACCESS,
+        &obj_attrs,
+        NotificationEvent,
+        FALSE
+      );
+    if (!NT_SUCCESS(probe->Status)) {
+        probe->Event = NULL;
+        return;
+      }
+    probe->Status = ZwReadFile(
+        file,
+        probe->Event,
+        NULL,
+        NULL,
+        &probe->IoStatus,
+        probe->Buf,
+        probe->Length,
+        &probe->Offset,
+        NULL
+      );
+    return;
   }
 
 /**
- * Check if a disk might be the matching backing disk for
- * a GRUB4DOS sector-mapped disk.
+ * Probe disks for the backing disks of pending GRUB4DOS sector-mapped
+ * disks.
+ *
+ * @v paths             A list of disk paths, as from
+ *                      IoGetDeviceInterfaces().
  *
- * @v file              HANDLE to an open disk.
- * @v filedisk          Points to the filedisk to match against.
+ * Every disk is opened and every read needed to check it for every
+ * pending sector-mapped disk is issued before any is waited for.
+ * Then, in order, each sector-mapped disk is given the first disk
+ * which it matches.  Must be called from WvFilediskG4dQueue_.
  */
-static BOOLEAN STDCALL WvFilediskG4dCheckDiskMatch_(
-    IN HANDLE file,
-    IN WV_SP_FILEDISK_T filedisk
-  ) {
-    BOOLEAN ok = FALSE;
+static VOID STDCALL WvFilediskG4dProbe_(IN PWCHAR paths) {
+    WV_SP_FILEDISK_G4D_FINDER_ * finders;
+    ULONG finder_count;
+    WV_SP_FILEDISK_G4D_CANDIDATE_ candidates;
+    ULONG candidate_count;
+    WV_SP_FILEDISK_G4D_PROBE_ probes;
+    WV_SP_FILEDISK_G4D_PROBE_ probe;
+    ULONG probe_count;
+    WV_SP_FILEDISK_T filedisk;
+    PLIST_ENTRY link;
+    PWCHAR pos;
+    HANDLE file;
+    KIRQL irql;
+    ULONG i;
+    ULONG j;
+    int check;
+    NTSTATUS status;
 
-    switch (filedisk->disk->Media) {
-        case WvlDiskMediaTypeFloppy:
-          break;
+    /*
+     * Note the pending finders.  Only we remove them, so more might be
+     * added meanwhile, but none will go away.
+     */
+    finder_count = 0;
+    KeAcquireSpinLock(&WvFindDiskLock, &irql);
+    for (
+        link = WvFilediskG4dPending_.Flink;
+        link != &WvFilediskG4dPending_;
+        link = link->Flink
+      )
+      finder_count++;
+    KeReleaseSpinLock(&WvFindDiskLock, irql);
+    if (!finder_count)
+      return;
+    finders = wv_malloc(sizeof *finders * finder_count);
+    if (!finders) {
+        DBG("Couldn't allocate finders!\n");
+        goto err_finders;
+      }
+    KeAcquireSpinLock(&WvFindDiskLock, &irql);
+    link = WvFilediskG4dPending_.Flink;
+    for (i = 0; i < finder_count; i++) {
+        finders[i] = CONTAINING_RECORD(link, WV_S_FILEDISK_G4D_FINDER_, Link);
+        link = link->Flink;
+      }
+    KeReleaseSpinLock(&WvFindDiskLock, irql);
+
+    /* Note the disks. */
+    candidate_count = 0;
+    for (pos = paths; *pos != UNICODE_NULL; pos += wcslen(pos) + 1)
+      candidate_count++;
+    if (!candidate_count)
+      goto err_no_candidates;
+    candidates = wv_mallocz(sizeof *candidates * candidate_count);
+    if (!candidates) {
+        DBG("Couldn't allocate candidates!\n");
+        goto err_candidates;
+      }
+    pos = paths;
+    for (i = 0; i < candidate_count; i++) {
+        candidates[i].Path = pos;
+        pos += wcslen(pos) + 1;
+      }
+    probes = wv_mallocz(
+        sizeof *probes * candidate_count * finder_count * WvFilediskG4dChecks_
+      );
+    if (!probes) {
+        DBG("Couldn't allocate probes!\n");
+        goto err_probes;
+      }
+
+    /* Open every disk and start every read. */
+    probe_count = 0;
+    for (i = 0; i < candidate_count; i++) {
+        candidates[i].File = WvFilediskG4dOpenDisk_(candidates[i].Path);
+        if (!candidates[i].File)
+          continue;
+        for (j = 0; j < finder_count; j++) {
+            for (check = 0; check < WvFilediskG4dChecks_; check++) {
+                probe = probes + probe_count;
+                if (!WvFilediskG4dCheckRead_(
+                    finders[j]->filedisk,
+                    check,
+                    &probe->Offset,
+                    &probe->Length
+                  ))
+                  continue;
+                probe->Candidate = i;
+                probe->Finder = j;
+                probe->Check = check;
+                WvFilediskG4dStartProbe_(candidates[i].File, probe);
+                probe_count++;
+              }
+          }
+      }
 
-        case WvlDiskMediaTypeHard:
-          ok = WvFilediskG4dCheckDiskMatchMbrSig_(file, filedisk);
-          if (ok)
+    /* Collect the results. */
+    for (probe = probes; probe < probes + probe_count; probe++) {
+        if (probe->Status == STATUS_PENDING) {
+            ZwWaitForSingleObject(probe->Event, FALSE, NULL);
+            probe->Status = probe->IoStatus.Status;
+          }
+        if (!NT_SUCCESS(probe->Status))
+          continue;
+        filedisk = finders[probe->Finder]->filedisk;
+        if (!WvFilediskG4dCheckOk_(filedisk, probe->Check, probe->Buf))
+          probe->Status = STATUS_UNSUCCESSFUL;
+      }
+
+    /* Give each sector-mapped disk the first disk it matches. */
+    for (j = 0; j < finder_count; j++) {
+        filedisk = finders[j]->filedisk;
+        for (probe = probes; probe < probes + probe_count; probe++) {
+            if (probe->Finder != j || !NT_SUCCESS(probe->Status))
+              continue;
+            /* A disk might back more than one sector-mapped disk. */
+            file = candidates[probe->Candidate].File;
+            candidates[probe->Candidate].File = NULL;
+            if (!file)
+              file = WvFilediskG4dOpenDisk_(candidates[probe->Candidate].Path);
+            if (!file)
+              continue;
+            status = WvFilediskSetFile(filedisk, file);
+            if (!NT_SUCCESS(status)) {
+                ZwClose(file);
+                continue;
+              }
+            DBG("Found backing disk for filedisk %p\n", (PVOID) filedisk);
+            WvFilediskG4dFound_(finders[j]);
             break;
-          ok = WvFilediskG4dCheckDiskMatchVHD_(file, filedisk);
-          break;
-        case WvlDiskMediaTypeOptical:
-          ok = WvFilediskG4dCheckDiskMatchIsoSig_(file, filedisk);
-          break;
+          }
       }
-    return ok;
-  }
 
-/* A work item for a filedisk thread to find the backing disk. */
-typedef struct S_WV_FILEDISK_G4D_FIND_BACKING_DISK_ {
-    WVL_S_THREAD_ITEM item[1];
-    WV_SP_FILEDISK_T filedisk;
+    for (probe = probes; probe < probes + probe_count; probe++) {
+        if (probe->Event)
+          ZwClose(probe->Event);
+        wv_free(probe->Buf);
+      }
+    for (i = 0; i < candidate_count; i++) {
+        if (candidates[i].File)
+          ZwClose(candidates[i].File);
+      }
+    wv_free(probes);
+    err_probes:
+
+    wv_free(candidates);
+    err_candidates:
+
+    err_no_candidates:
+
+    wv_free(finders);
+    err_finders:
+
+    return;
   }
-  S_WV_FILEDISK_G4D_FIND_BACKING_DISK,
-  * SP_WV_FILEDISK_G4D_FIND_BACKING_DISK;
 
-/**
- * Stalls the arrival of a GRUB4DOS sector-mapped disk until
- * the backing disk is found, and stalls driver re-initialization.
- */
-static VOID STDCALL WvFilediskG4dFindBackingDisk_(
-    IN OUT WVL_SP_THREAD_ITEM item
+/* Note that a finder's backing disk has been found. */
+static VOID STDCALL WvFilediskG4dFound_(
+    IN WV_SP_FILEDISK_G4D_FINDER_ finder
   ) {
-    static U_WV_LARGE_INT delay_time = {-10000000LL};
-    SP_WV_FILEDISK_G4D_FIND_BACKING_DISK finder = CONTAINING_RECORD(
-        item,
-        S_WV_FILEDISK_G4D_FIND_BACKING_DISK,
-        item[0]
-      );
-    WV_SP_FILEDISK_T filedisk_ptr;
-    NTSTATUS status;
-    GUID disk_guid = GUID_DEVINTERFACE_DISK;
-    PWSTR sym_links;
-    PWCHAR pos;
-    HANDLE file;
-    int count = 0;
     KIRQL irql;
 
-    /* Establish pointer to the filedisk. */
-    filedisk_ptr = finder->filedisk;
+    /* Release the driver re-initialization stall. */
+    KeAcquireSpinLock(&WvFindDiskLock, &irql);
+    RemoveEntryList(&finder->Link);
+    if (!--WvFindDisk)
+      KeSetEvent(&WvFindDiskDone, 0, FALSE);
+    KeReleaseSpinLock(&WvFindDiskLock, irql);
 
-    /* Free the work item. */
-    wv_free(item);
+    /* Release the disk's I/O. */
+    KeSetEvent(&finder->Found, 0, FALSE);
+    WvFilediskG4dPut_(finder);
+    return;
+  }
 
-    do {
-    /*
-     * Find the backing disk and use it.  We walk a list
-     * of unicode disk device names and check each one.
-     */
-    status = IoGetDeviceInterfaces(&disk_guid, NULL, 0, &sym_links);
-    if (!NT_SUCCESS(status))
-      goto retry;
-    pos = sym_links;
-    while (*pos != UNICODE_NULL) {
-        UNICODE_STRING path;
-        OBJECT_ATTRIBUTES obj_attrs;
-        IO_STATUS_BLOCK io_status;
-
-        RtlInitUnicodeString(&path, pos);
-        InitializeObjectAttributes(
-            &obj_attrs,
-            &path,
-            OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
-            NULL,
-            NULL
-          );
-        /* Try this disk. */
-        file = 0;
-        status = ZwCreateFile(
-            &file,
-            GENERIC_READ | GENERIC_WRITE,
-            &obj_attrs,
-            &io_status,
-            NULL,
-            FILE_ATTRIBUTE_NORMAL,
-            FILE_SHARE_READ | FILE_SHARE_DELETE | FILE_SHARE_WRITE,
-            FILE_OPEN,
-            FILE_NON_DIRECTORY_FILE |
-              FILE_RANDOM_ACCESS |
-              FILE_SYNCHRONOUS_IO_NONALERT,
+/* Drop a reference to a finder. */
+static VOID STDCALL WvFilediskG4dPut_(IN WV_SP_FILEDISK_G4D_FINDER_ finder) {
+    if (!InterlockedDecrement(&finder->Refs))
+      wv_free(finder);
+    return;
+  }
+
+/* Schedule a scan of all disks, if one isn't already scheduled. */
+static VOID STDCALL WvFilediskG4dScheduleScan_(void) {
+    if (InterlockedExchange(&WvFilediskG4dScanQueued_, 1))
+      return;
+    WvFilediskG4dScanItem_->Func = WvFilediskG4dScan_;
+    if (!WvlThreadQueueAddItem(WvFilediskG4dQueue_, WvFilediskG4dScanItem_)) {
+        DBG("Couldn't schedule disk scan!\n");
+        InterlockedExchange(&WvFilediskG4dScanQueued_, 0);
+      }
+    return;
+  }
+
+/* Probe all disks, and watch for more to arrive. */
+static VOID STDCALL WvFilediskG4dScan_(IN OUT WVL_SP_THREAD_ITEM item) {
+    GUID disk_guid = GUID_DEVINTERFACE_DISK;
+    PWSTR sym_links;
+    BOOLEAN pending;
+    KIRQL irql;
+    NTSTATUS status;
+
+    /* From here on, a new finder may schedule us again. */
+    InterlockedExchange(&WvFilediskG4dScanQueued_, 0);
+
+    /* Listen first, so that a disk can't slip in before we do. */
+    if (!WvFilediskG4dNotification_) {
+        status = IoRegisterPlugPlayNotification(
+            EventCategoryDeviceInterfaceChange,
+            0,
+            &disk_guid,
+            WvDriverObj,
+            WvFilediskG4dArrival_,
             NULL,
-            0
+            &WvFilediskG4dNotification_
           );
-        /* If we could open it, check it out. */
-        if (NT_SUCCESS(status)) {
-            /* If we liked this disk as our backing disk, stop looking. */
-            if (WvFilediskG4dCheckDiskMatch_(file, filedisk_ptr))
-              break;
+        if (!NT_SUCCESS(status)) {
+            DBG("Couldn't register for disk arrivals: %08X\n", status);
+            WvFilediskG4dNotification_ = NULL;
           }
-        /* We could not open this disk or didn't like it.  Try the next one. */
-        if (file)
-          ZwClose(file);
-        while (*pos != UNICODE_NULL)
-          pos++;
-        pos++;
-      } /* while */
-    wv_free(sym_links);
-    /* If we did not find the backing disk, we are a dud. */
-    if (!NT_SUCCESS(status))
-      goto retry;
-    /* Use the backing disk and report the sector-mapped disk. */
-    filedisk_ptr->file = file;
+      }
 
-    /* Release the driver re-initialization stall. */
+    status = IoGetDeviceInterfaces(&disk_guid, NULL, 0, &sym_links);
+    if (NT_SUCCESS(status)) {
+        WvFilediskG4dProbe_(sym_links);
+        wv_free(sym_links);
+      }
+
+    /* Stop listening once there's nothing to look for. */
     KeAcquireSpinLock(&WvFindDiskLock, &irql);
-    --WvFindDisk;
+    pending = !IsListEmpty(&WvFilediskG4dPending_);
     KeReleaseSpinLock(&WvFindDiskLock, irql);
+    if (!pending && WvFilediskG4dNotification_) {
+        IoUnregisterPlugPlayNotification(WvFilediskG4dNotification_);
+        WvFilediskG4dNotification_ = NULL;
+      }
+    return;
+  }
 
-    DBG("Found backing disk for filedisk %p\n", (PVOID) filedisk_ptr);
+/* Probe a disk which has arrived. */
+static VOID STDCALL WvFilediskG4dProbeArrival_(
+    IN OUT WVL_SP_THREAD_ITEM item
+  ) {
+    WV_SP_FILEDISK_G4D_ARRIVAL_ arrival = CONTAINING_RECORD(
+        item,
+        WV_S_FILEDISK_G4D_ARRIVAL_,
+        item[0]
+      );
+
+    DBG("Probing arrival %ws\n", arrival->Path);
+    WvFilediskG4dProbe_(arrival->Path);
+    wv_free(arrival);
     return;
+  }
 
-    retry:
-    /* Sleep. */
-    DBG("Sleeping...");
-    KeDelayExecutionThread(KernelMode, FALSE, &delay_time.large_int);
-    } while (count++ < 10);
+/* Hold a sector-mapped disk's I/O until its backing disk is found. */
+static VOID STDCALL WvFilediskG4dWait_(IN OUT WVL_SP_THREAD_ITEM item) {
+    static U_WV_LARGE_INT wait_time = {WV_M_FILEDISK_G4D_WAIT};
+    WV_SP_FILEDISK_G4D_FINDER_ finder = CONTAINING_RECORD(
+        item,
+        WV_S_FILEDISK_G4D_FINDER_,
+        item[0]
+      );
+    NTSTATUS status;
+
+    status = KeWaitForSingleObject(
+        &finder->Found,
+        Executive,
+        KernelMode,
+        FALSE,
+        &wait_time.large_int
+      );
+    if (status == STATUS_TIMEOUT) {
+        DBG(
+            "No backing disk yet for filedisk %p; still watching\n",
+            (PVOID) finder->filedisk
+          );
+      }
+    WvFilediskG4dPut_(finder);
+    return;
+  }
+
+/* Queue a probe of a disk which has arrived. */
+static NTSTATUS WvFilediskG4dArrival_(
+    IN PVOID notification,
+    IN PVOID context
+  ) {
+    PDEVICE_INTERFACE_CHANGE_NOTIFICATION change = notification;
+    GUID arrival_guid = GUID_DEVICE_INTERFACE_ARRIVAL;
+    WV_SP_FILEDISK_G4D_ARRIVAL_ arrival;
+    USHORT len;
+
+    if (!wv_memcmpeq(&change->Event, &arrival_guid, sizeof arrival_guid))
+      return STATUS_SUCCESS;
+
+    /* The path, a terminator, and another for the end of the list. */
+    len = change->SymbolicLinkName->Length;
+    arrival = wv_malloc(sizeof *arrival + len + sizeof (WCHAR));
+    if (!arrival) {
+        DBG("Couldn't allocate arrival!\n");
+        return STATUS_SUCCESS;
+      }
+    RtlCopyMemory(arrival->Path, change->SymbolicLinkName->Buffer, len);
+    arrival->Path[len / sizeof (WCHAR)] = UNICODE_NULL;
+    arrival->Path[len / sizeof (WCHAR) + 1] = UNICODE_NULL;
+    arrival->item->Func = WvFilediskG4dProbeArrival_;
+    if (!WvlThreadQueueAddItem(WvFilediskG4dQueue_, arrival->item)) {
+        DBG("Couldn't queue arrival!\n");
+        wv_free(arrival);
+      }
+    return STATUS_SUCCESS;
   }
 
 /**
  * Initiate a search for a GRUB4DOS backing disk.
  *
  * @v filedisk          The filedisk whose backing disk we need.
+ *
+ * The filedisk's I/O is held, and driver re-initialization is stalled,
+ * until the backing disk is found or for a while.  The search goes on
+ * as disks arrive.
  */
 static BOOLEAN STDCALL WvFilediskG4dFindBackingDisk(
     IN WV_SP_FILEDISK_T filedisk
   ) {
-    SP_WV_FILEDISK_G4D_FIND_BACKING_DISK finder;
+    WV_SP_FILEDISK_G4D_FINDER_ finder;
     KIRQL irql;
 
     finder = wv_malloc(sizeof *finder);
     if (!finder) {
-        DBG("Couldn't allocate work item!\n");
+        DBG("Couldn't allocate finder!\n");
         goto err_finder;
       }
-
-    KeAcquireSpinLock(&WvFindDiskLock, &irql);
-    ++WvFindDisk;
-    KeReleaseSpinLock(&WvFindDiskLock, irql);
-
-    finder->item->Func = WvFilediskG4dFindBackingDisk_;
+    finder->item->Func = WvFilediskG4dWait_;
     finder->filedisk = filedisk;
-    /* Add the hot-swapper work item. */
-    if (!WvlThreadAddItem(filedisk->Thread, finder->item)) {
+    KeInitializeEvent(&finder->Found, NotificationEvent, FALSE);
+    finder->Refs = 2;
+
+    /* Hold the disk's I/O. */
+    if (!WvlThreadQueueAddItem(filedisk->Queue, finder->item)) {
         DBG("Couldn't add work item!\n");
         goto err_work_item;
       }
 
-    /* The thread is responsible for freeing the work item. */
+    KeAcquireSpinLock(&WvFindDiskLock, &irql);
+    if (!WvFilediskG4dQueueInit_) {
+        WvlThreadQueueInit(WvFilediskG4dQueue_, TRUE);
+        WvFilediskG4dQueueInit_ = TRUE;
+      }
+    if (!WvFindDisk++)
+      KeClearEvent(&WvFindDiskDone);
+    InsertTailList(&WvFilediskG4dPending_, &finder->Link);
+    KeReleaseSpinLock(&WvFindDiskLock, irql);
+
+    WvFilediskG4dScheduleScan_();
     return TRUE;
 
     err_work_item:
 
-    KeAcquireSpinLock(&WvFindDiskLock, &irql);
-    --WvFindDisk;
-    KeReleaseSpinLock(&WvFindDiskLock, irql);
-
     wv_free(finder);
     err_finder:
 
@@ -516,7 +817,7 @@ static VOID STDCALL process_param_block(
 
 /** Create a GRUB4DOS sector-mapped disk and sets its parent bus */
 DEVICE_OBJECT * WvFilediskCreateG4dDisk(
-    SP_WV_G4D_DRIVE_MAPPING slot,
+    WV_SP_G4D_MAP map,
     DEVICE_OBJECT * bus_dev_obj,
     WVL_E_DISK_MEDIA_TYPE media_type,
     UINT32 sector_size
@@ -549,7 +850,7 @@ DEVICE_OBJECT * WvFilediskCreateG4dDisk(
 
         while (j--) {
             if (
-                (sets[j].int13_drive_num == slot->SourceDrive) &&
+                (sets[j].int13_drive_num == map->SourceDrive) &&
                 (sets[j].filepath != NULL)
               )
               WvFilediskHotSwap(filedisk_ptr, sets[j].filepath);
@@ -558,22 +859,20 @@ DEVICE_OBJECT * WvFilediskCreateG4dDisk(
     #endif
 
     /* Note the offset of the disk image from the backing disk's start. */
-    filedisk_ptr->offset.QuadPart =
-      slot->SectorStart * (slot->DestODD ? 2048 : 512);
+    filedisk_ptr->offset.QuadPart = map->Offset;
     /*
      * Size and geometry.  Please note that since we require a .VHD
      * footer, we exclude this from the LBA disk size by truncating
      * a 512-byte sector for HDD images, or a 2048-byte sector for .ISO.
      */
-    {   ULONGLONG total_size =
-          slot->SectorCount * (slot->DestODD ? 2048 : 512);
+    {   ULONGLONG total_size = map->Length;
 
         filedisk_ptr->disk->LBADiskSize =
           (total_size - filedisk_ptr->disk->SectorSize) /
           filedisk_ptr->disk->SectorSize;
       } /* total_size scope. */
-    filedisk_ptr->disk->Heads = slot->MaxHead + 1;
-    filedisk_ptr->disk->Sectors = slot->DestMaxSector;
+    filedisk_ptr->disk->Heads = map->Heads;
+    filedisk_ptr->disk->Sectors = map->Sectors;
     filedisk_ptr->disk->Cylinders = (
         filedisk_ptr->disk->LBADiskSize /
         (filedisk_ptr->disk->Heads * filedisk_ptr->disk->Sectors)
@@ -585,7 +884,7 @@ DEVICE_OBJECT * WvFilediskCreateG4dDisk(
      * cause a "hash" collision!  Too bad for now.
      */
     filedisk_ptr->hash = 'G4DX';
-    ((PUCHAR) &filedisk_ptr->hash)[0] = slot->SourceDrive;
+    ((PUCHAR) &filedisk_ptr->hash)[0] = map->SourceDrive;
     filedisk_ptr->Dev->Boot = TRUE;
     if (!WvFilediskG4dFindBackingDisk(filedisk_ptr)) {
         WvDevFree(filedisk_ptr->Dev);
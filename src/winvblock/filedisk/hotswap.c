@@ -0,0 +1,561 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * Filedisk hot-swap to a file.
+ *
+ * A sector-mapped disk is served from its backing disk until the file
+ * it represents can be opened on some volume; then the filedisk is
+ * switched to that file.  The lookup runs on the hot-swap thread, not
+ * the filedisk's queue, so the disk's I/O carries on meanwhile.  The
+ * file is looked for on every volume at once, by pool workers, and the
+ * volumes' DOS names are kept from one lookup to the next.
+ */
+
+#include <ntifs.h>
+#include <ntddk.h>
+#include <initguid.h>
+#include <ntddstor.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "wv_stdlib.h"
+#include "irp.h"
+#include "driver.h"
+#include "bus.h"
+#include "device.h"
+#include "disk.h"
+#include "thread.h"
+#include "filedisk.h"
+#include "debug.h"
+
+/** Macros */
+
+/* How often the hot-swap thread looks again for files not yet found */
+#define WV_M_FILEDISK_HOT_SWAP_RETRY (-10 * 10000000LL)
+
+/** Object types */
+typedef struct WV_FILEDISK_HOT_SWAPPER_
+  WV_S_FILEDISK_HOT_SWAPPER_, * WV_SP_FILEDISK_HOT_SWAPPER_;
+typedef struct WV_FILEDISK_HOT_SWAP_VOLUME_
+  WV_S_FILEDISK_HOT_SWAP_VOLUME_, * WV_SP_FILEDISK_HOT_SWAP_VOLUME_;
+typedef struct WV_FILEDISK_HOT_SWAP_PROBE_
+  WV_S_FILEDISK_HOT_SWAP_PROBE_, * WV_SP_FILEDISK_HOT_SWAP_PROBE_;
+
+/** Struct/union type definitions */
+
+/* A work item for the hot-swap thread to hot-swap to a file */
+struct WV_FILEDISK_HOT_SWAPPER_ {
+    WVL_S_THREAD_ITEM item[1];
+    WV_SP_FILEDISK_T filedisk;
+    UNICODE_STRING filename[1];
+  };
+
+/* A volume, as last seen by the hot-swap thread */
+struct WV_FILEDISK_HOT_SWAP_VOLUME_ {
+    LIST_ENTRY Link;
+    /* Whether the volume was in the latest list of volumes */
+    BOOLEAN Seen;
+    UNICODE_STRING SymLink;
+    /* Such as "\??\C:" */
+    UNICODE_STRING DosPath;
+  };
+
+/* An attempt to open a file on one volume, run by a pool worker */
+struct WV_FILEDISK_HOT_SWAP_PROBE_ {
+    WVL_S_THREAD_ITEM item[1];
+    /* The probes not yet done, and what the last one signals */
+    volatile LONG * Pending;
+    PKEVENT Done;
+    UNICODE_STRING Path;
+    HANDLE File;
+    NTSTATUS Status;
+  };
+
+/** Private function declarations */
+static WV_SP_FILEDISK_HOT_SWAP_VOLUME_ STDCALL WvFilediskHotSwapVolume_(
+    IN PWCHAR
+  );
+static ULONG STDCALL WvFilediskHotSwapRefresh_(void);
+static VOID STDCALL WvFilediskHotSwapProbeDone_(
+    IN WV_SP_FILEDISK_HOT_SWAP_PROBE_
+  );
+static BOOLEAN STDCALL WvFilediskHotSwap_(
+    IN WV_SP_FILEDISK_T,
+    IN PUNICODE_STRING
+  );
+static WVL_F_THREAD_ITEM WvFilediskHotSwapProbe_;
+static WVL_F_THREAD_ITEM WvFilediskHotSwapThread_;
+
+/** Objects */
+
+/* Volumes and their DOS names.  Only used by the hot-swap thread */
+static LIST_ENTRY WvFilediskHotSwapVolumes_ = {
+    &WvFilediskHotSwapVolumes_,
+    &WvFilediskHotSwapVolumes_
+  };
+
+/** Exported function definitions */
+
+/**
+ * Initiate a filedisk hot-swap to another file.
+ *
+ * @v filedisk          The filedisk to be hot-swapped.
+ * @v file              The ANSI filename for swapping to.
+ */
+VOID STDCALL WvFilediskHotSwap(IN WV_SP_FILEDISK_T filedisk, IN PCHAR file) {
+    static WVL_S_THREAD thread = {
+        /* Main */
+        {
+            /* Link */
+            {0},
+            /* Func */
+            WvFilediskHotSwapThread_,
+          },
+        /* State */
+        WvlThreadStateNotStarted,
+      };
+    WV_SP_FILEDISK_HOT_SWAPPER_ hot_swapper;
+    ANSI_STRING file_ansi;
+    NTSTATUS status;
+
+    hot_swapper = wv_malloc(sizeof *hot_swapper);
+    if (!hot_swapper) {
+        DBG("Non-critical: Couldn't allocate work item.\n");
+        return;
+      }
+    /* Build the Unicode string. */
+    RtlInitAnsiString(&file_ansi, file);
+    hot_swapper->filename->Buffer = NULL;
+    status = RtlAnsiStringToUnicodeString(
+        hot_swapper->filename,
+        &file_ansi,
+        TRUE
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Non-critical: Couldn't allocate unicode string.\n");
+        wv_free(hot_swapper);
+        return;
+      }
+    /* Build the rest of the work item. */
+    hot_swapper->item->Func = WvFilediskHotSwapThread_;
+    hot_swapper->filedisk = filedisk;
+    /* Start the thread.  If it's already been started, no matter. */
+    WvlThreadStart(&thread);
+    /* Add the hot-swapper work item. */
+    if (!WvlThreadAddItem(&thread, hot_swapper->item)) {
+        DBG("Non-critical: Couldn't add work item.\n");
+        RtlFreeUnicodeString(hot_swapper->filename);
+        wv_free(hot_swapper);
+      }
+    /* The thread is responsible for freeing the work item and file path. */
+    return;
+  }
+
+/** Private function definitions */
+
+/* Note a volume which isn't in the cache.  Returns NULL upon failure. */
+static WV_SP_FILEDISK_HOT_SWAP_VOLUME_ STDCALL WvFilediskHotSwapVolume_(
+    IN PWCHAR sym_link
+  ) {
+    static const WCHAR obj_path_prefix[] = L"\\??\\";
+    WV_SP_FILEDISK_HOT_SWAP_VOLUME_ volume;
+    UNICODE_STRING path;
+    PFILE_OBJECT vol_file_obj;
+    PDEVICE_OBJECT vol_dev_obj;
+    UNICODE_STRING vol_dos_name;
+    PCHAR buf;
+    NTSTATUS status;
+
+    RtlInitUnicodeString(&path, sym_link);
+    volume = wv_malloc(sizeof *volume + path.Length);
+    if (!volume)
+      goto err_volume;
+    volume->SymLink.Buffer = (PWCHAR) (volume + 1);
+    volume->SymLink.Length = volume->SymLink.MaximumLength = path.Length;
+    RtlCopyMemory(volume->SymLink.Buffer, path.Buffer, path.Length);
+
+    /* Get some object pointers for the volume. */
+    status = IoGetDeviceObjectPointer(
+        &path,
+        FILE_READ_DATA,
+        &vol_file_obj,
+        &vol_dev_obj
+      );
+    if (!NT_SUCCESS(status))
+      goto err_obj_ptrs;
+    /* Get the DOS name. */
+    vol_dos_name.Buffer = NULL;
+    vol_dos_name.Length = vol_dos_name.MaximumLength = 0;
+    status = RtlVolumeDeviceToDosName(
+        vol_file_obj->DeviceObject,
+        &vol_dos_name
+      );
+    if (!NT_SUCCESS(status))
+      goto err_dos_name;
+
+    volume->DosPath.Length = volume->DosPath.MaximumLength =
+      sizeof obj_path_prefix - sizeof UNICODE_NULL + vol_dos_name.Length;
+    volume->DosPath.Buffer = wv_palloc(volume->DosPath.Length);
+    if (!volume->DosPath.Buffer)
+      goto err_dos_path;
+    buf = (PCHAR) volume->DosPath.Buffer;
+    RtlCopyMemory(
+        buf,
+        obj_path_prefix,
+        sizeof obj_path_prefix - sizeof UNICODE_NULL
+      );
+    buf += sizeof obj_path_prefix - sizeof UNICODE_NULL;
+    RtlCopyMemory(buf, vol_dos_name.Buffer, vol_dos_name.Length);
+
+    wv_free(vol_dos_name.Buffer);
+    ObDereferenceObject(vol_file_obj);
+    return volume;
+
+    err_dos_path:
+
+    wv_free(vol_dos_name.Buffer);
+    err_dos_name:
+
+    ObDereferenceObject(vol_file_obj);
+    err_obj_ptrs:
+
+    wv_free(volume);
+    err_volume:
+
+    return NULL;
+  }
+
+/**
+ * Bring the volume cache up-to-date.
+ *
+ * @ret ULONG           The number of volumes in the cache.
+ *
+ * Only volumes not seen before have their DOS names looked up.  Those
+ * which have gone are dropped.
+ */
+static ULONG STDCALL WvFilediskHotSwapRefresh_(void) {
+    GUID vol_guid = GUID_DEVINTERFACE_VOLUME;
+    WV_SP_FILEDISK_HOT_SWAP_VOLUME_ volume;
+    UNICODE_STRING path;
+    PLIST_ENTRY link;
+    PWSTR sym_links;
+    PWCHAR pos;
+    ULONG count;
+    NTSTATUS status;
+
+    status = IoGetDeviceInterfaces(&vol_guid, NULL, 0, &sym_links);
+    if (!NT_SUCCESS(status))
+      sym_links = NULL;
+
+    for (
+        link = WvFilediskHotSwapVolumes_.Flink;
+        link != &WvFilediskHotSwapVolumes_;
+        link = link->Flink
+      ) {
+        volume = CONTAINING_RECORD(
+            link,
+            WV_S_FILEDISK_HOT_SWAP_VOLUME_,
+            Link
+          );
+        volume->Seen = FALSE;
+      }
+
+    for (pos = sym_links; pos && *pos != UNICODE_NULL; pos += wcslen(pos) + 1) {
+        RtlInitUnicodeString(&path, pos);
+        for (
+            link = WvFilediskHotSwapVolumes_.Flink;
+            link != &WvFilediskHotSwapVolumes_;
+            link = link->Flink
+          ) {
+            volume = CONTAINING_RECORD(
+                link,
+                WV_S_FILEDISK_HOT_SWAP_VOLUME_,
+                Link
+              );
+            if (RtlEqualUnicodeString(&volume->SymLink, &path, TRUE))
+              break;
+          }
+        if (link == &WvFilediskHotSwapVolumes_) {
+            volume = WvFilediskHotSwapVolume_(pos);
+            if (!volume)
+              continue;
+            InsertTailList(&WvFilediskHotSwapVolumes_, &volume->Link);
+          }
+        volume->Seen = TRUE;
+      }
+    wv_free(sym_links);
+
+    /* Drop the volumes which have gone away. */
+    count = 0;
+    link = WvFilediskHotSwapVolumes_.Flink;
+    while (link != &WvFilediskHotSwapVolumes_) {
+        volume = CONTAINING_RECORD(
+            link,
+            WV_S_FILEDISK_HOT_SWAP_VOLUME_,
+            Link
+          );
+        link = link->Flink;
+        if (volume->Seen) {
+            count++;
+            continue;
+          }
+        RemoveEntryList(&volume->Link);
+        wv_free(volume->DosPath.Buffer);
+        wv_free(volume);
+      }
+    return count;
+  }
+
+/* Try to open a file on one volume. */
+static VOID STDCALL WvFilediskHotSwapProbe_(IN OUT WVL_SP_THREAD_ITEM item) {
+    WV_SP_FILEDISK_HOT_SWAP_PROBE_ probe = CONTAINING_RECORD(
+        item,
+        WV_S_FILEDISK_HOT_SWAP_PROBE_,
+        item[0]
+      );
+    OBJECT_ATTRIBUTES obj_attrs;
+    IO_STATUS_BLOCK io_status;
+
+    InitializeObjectAttributes(
+        &obj_attrs,
+        &probe->Path,
+        OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+        NULL,
+        NULL
+      );
+    probe->Status = ZwCreateFile(
+        &probe->File,
+        GENERIC_READ | GENERIC_WRITE,
+        &obj_attrs,
+        &io_status,
+        NULL,
+        FILE_ATTRIBUTE_NORMAL,
+        FILE_SHARE_READ | FILE_SHARE_DELETE | FILE_SHARE_WRITE,
+        FILE_OPEN,
+        FILE_NON_DIRECTORY_FILE |
+          FILE_RANDOM_ACCESS,
+        NULL,
+        0
+      );
+    if (!NT_SUCCESS(probe->Status))
+      probe->File = NULL;
+    WvFilediskHotSwapProbeDone_(probe);
+    return;
+  }
+
+/* Note that a probe is done.  The probe mustn't be touched afterwards. */
+static VOID STDCALL WvFilediskHotSwapProbeDone_(
+    IN WV_SP_FILEDISK_HOT_SWAP_PROBE_ probe
+  ) {
+    if (!InterlockedDecrement(probe->Pending))
+      KeSetEvent(probe->Done, 0, FALSE);
+    return;
+  }
+
+/**
+ * Find and hot-swap to a backing file.  Internal.
+ *
+ * @v filedisk          The filedisk to be hot-swapped.
+ * @v filename          The file's path, relative to a volume's root.
+ * @ret BOOLEAN         TRUE if the filedisk was hot-swapped.
+ *
+ * We search all filesystems for a particular filename, then swap
+ * to using it as the backing store.  This is currently useful for
+ * sector-mapped disks which should really have a file-in-use lock
+ * for the file they represent.  The file is opened on every volume
+ * at once and the first volume which has it is used.
+ */
+static BOOLEAN STDCALL WvFilediskHotSwap_(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN PUNICODE_STRING filename
+  ) {
+    static const WCHAR path_sep = L'\\';
+    WV_SP_FILEDISK_HOT_SWAP_PROBE_ * probes;
+    WV_SP_FILEDISK_HOT_SWAP_PROBE_ probe;
+    WV_SP_FILEDISK_HOT_SWAP_VOLUME_ volume;
+    PLIST_ENTRY link;
+    ULONG count;
+    ULONG reserved;
+    ULONG i;
+    volatile LONG pending;
+    KEVENT done;
+    HANDLE file;
+    LARGE_INTEGER offset;
+    ULONGLONG start;
+    ULONGLONG lookup_time;
+    NTSTATUS status;
+
+    /* Do we currently have a backing disk?  If not, re-enqueue for later. */
+    if (filedisk->file == NULL)
+      return FALSE;
+
+    start = KeQueryInterruptTime();
+    count = WvFilediskHotSwapRefresh_();
+    if (!count)
+      return FALSE;
+    probes = wv_mallocz(sizeof *probes * count);
+    if (!probes)
+      return FALSE;
+
+    /*
+     * Start a probe of each volume.  We hold a count of our own, so
+     * that done isn't signalled until they've all been started.
+     */
+    pending = 1;
+    KeInitializeEvent(&done, NotificationEvent, FALSE);
+    i = 0;
+    reserved = 0;
+    for (
+        link = WvFilediskHotSwapVolumes_.Flink;
+        link != &WvFilediskHotSwapVolumes_;
+        link = link->Flink
+      ) {
+        volume = CONTAINING_RECORD(
+            link,
+            WV_S_FILEDISK_HOT_SWAP_VOLUME_,
+            Link
+          );
+        probe = wv_malloc(
+            sizeof *probe +
+            volume->DosPath.Length +
+            sizeof path_sep +
+            filename->Length
+          );
+        if (!probe)
+          continue;
+        probe->item->Func = WvFilediskHotSwapProbe_;
+        probe->Pending = &pending;
+        probe->Done = &done;
+        probe->Path.Buffer = (PWCHAR) (probe + 1);
+        probe->Path.Length = probe->Path.MaximumLength =
+          volume->DosPath.Length + sizeof path_sep + filename->Length;
+        {   PCHAR buf = (PCHAR) probe->Path.Buffer;
+
+            RtlCopyMemory(buf, volume->DosPath.Buffer, volume->DosPath.Length);
+            buf += volume->DosPath.Length;
+            RtlCopyMemory(buf, &path_sep, sizeof path_sep);
+            buf += sizeof path_sep;
+            RtlCopyMemory(buf, filename->Buffer, filename->Length);
+          } /* buf scope */
+        probes[i++] = probe;
+        InterlockedIncrement(&pending);
+        /* A probe blocks in ZwCreateFile, so it needs a reserved worker. */
+        WvlThreadPoolReserve();
+        if (WvlThreadPoolAddItem(probe->item)) {
+            reserved++;
+            continue;
+          }
+        /* Otherwise, just do it ourselves. */
+        WvlThreadPoolRelease();
+        WvFilediskHotSwapProbe_(probe->item);
+      }
+    if (InterlockedDecrement(&pending))
+      KeWaitForSingleObject(&done, Executive, KernelMode, FALSE, NULL);
+    for (; reserved; reserved--)
+      WvlThreadPoolRelease();
+    lookup_time = KeQueryInterruptTime() - start;
+
+    /* Use the first volume which has the file. */
+    file = NULL;
+    for (i = 0; i < count; i++) {
+        probe = probes[i];
+        if (!probe)
+          continue;
+        if (probe->File && !file) {
+            DBG("Found %wZ\n", &probe->Path);
+            file = probe->File;
+            probe->File = NULL;
+          }
+        if (probe->File)
+          ZwClose(probe->File);
+        wv_free(probe);
+      }
+    wv_free(probes);
+    if (!file)
+      return FALSE;
+
+    /* Switch the file and the offset together. */
+    offset.QuadPart = 0;
+    status = WvFilediskSwapFile(filedisk, file, &offset);
+    if (!NT_SUCCESS(status)) {
+        ZwClose(file);
+        return FALSE;
+      }
+    filedisk->HotSwapLookupTime = lookup_time;
+    DBG(
+        "Finished hot-swapping: lookup %I64u us, I/O held %I64u us\n",
+        filedisk->HotSwapLookupTime / 10,
+        filedisk->SwapStallTime / 10
+      );
+    return TRUE;
+  }
+
+/* The thread responsible for hot-swapping filedisks. */
+static VOID STDCALL WvFilediskHotSwapThread_(IN OUT WVL_SP_THREAD_ITEM item) {
+    LARGE_INTEGER timeout;
+    WVL_SP_THREAD thread = CONTAINING_RECORD(item, WVL_S_THREAD, Main);
+    WVL_SP_THREAD_ITEM work_item;
+    WV_SP_FILEDISK_HOT_SWAPPER_ info;
+
+    /* Wake up at least every so often. */
+    timeout.QuadPart = WV_M_FILEDISK_HOT_SWAP_RETRY;
+
+    while (
+        (thread->State == WvlThreadStateStarted) ||
+        (thread->State == WvlThreadStateStopping)
+      ) {
+        /* Wait for the work signal or the timeout. */
+        KeWaitForSingleObject(
+            &thread->Signal,
+            Executive,
+            KernelMode,
+            FALSE,
+            &timeout
+          );
+
+        work_item = WvlThreadGetItem(thread);
+        if (!work_item)
+          continue;
+
+        if (work_item->Func != WvFilediskHotSwapThread_) {
+            DBG("Unknown work item.\n");
+            continue;
+          }
+        info = CONTAINING_RECORD(
+            work_item,
+            WV_S_FILEDISK_HOT_SWAPPER_,
+            item[0]
+          );
+        /* Attempt a hot swap. */
+        if (WvFilediskHotSwap_(info->filedisk, info->filename)) {
+            /* Success. */
+            RtlFreeUnicodeString(info->filename);
+            wv_free(info);
+          } else {
+            /* Re-enqueue. */
+            WvlThreadAddItem(thread, info->item);
+          }
+
+        /* Reset the work signal. */
+        KeResetEvent(&thread->Signal);
+      } /* while thread is running. */
+    return;
+  }
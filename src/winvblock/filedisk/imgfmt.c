@@ -0,0 +1,211 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Portable image format engines: dispatch and shared helpers.
+ */
+
+#include "imgfmt.h"
+
+/** Objects */
+
+/* Formats are tried in this order */
+static const IMGFMT_S_FORMAT * const ImgFmtFormats_[] = {
+    &ImgFmtVhdx,
+    &ImgFmtQcow2,
+  };
+
+/** Function definitions */
+
+IMGFMT_E_STATUS ImgFmtOpen(const IMGFMT_S_FILE * file, IMGFMT_SP image) {
+    IMGFMT_E_STATUS status;
+    unsigned int i;
+
+    if (!file || !image)
+      return ImgFmtStatusInvalid;
+
+    image->Format = 0;
+    image->Image = 0;
+    image->Size = 0;
+    for (i = 0; i < sizeof ImgFmtFormats_ / sizeof *ImgFmtFormats_; i++) {
+        status = ImgFmtFormats_[i]->Open(file, &image->Image, &image->Size);
+        if (status != ImgFmtStatusSuccess)
+          return status;
+        if (image->Image) {
+            image->Format = ImgFmtFormats_[i];
+            break;
+          }
+      }
+    return ImgFmtStatusSuccess;
+  }
+
+IMGFMT_E_STATUS ImgFmtRead(
+    IMGFMT_SP image,
+    unsigned long long offset,
+    unsigned long length,
+    void * buffer
+  ) {
+    if (
+        (offset | length) & (IMGFMT_M_ALIGN - 1) ||
+        offset > image->Size ||
+        length > image->Size - offset
+      )
+      return ImgFmtStatusInvalid;
+    return image->Format->Read(image->Image, offset, length, buffer);
+  }
+
+IMGFMT_E_STATUS ImgFmtWrite(
+    IMGFMT_SP image,
+    unsigned long long offset,
+    unsigned long length,
+    const void * buffer
+  ) {
+    if (
+        (offset | length) & (IMGFMT_M_ALIGN - 1) ||
+        offset > image->Size ||
+        length > image->Size - offset
+      )
+      return ImgFmtStatusInvalid;
+    return image->Format->Write(image->Image, offset, length, buffer);
+  }
+
+void ImgFmtClose(IMGFMT_SP image) {
+    if (image->Format)
+      image->Format->Close(image->Image);
+    image->Format = 0;
+    image->Image = 0;
+  }
+
+unsigned long ImgFmtCrc32c(const void * buf, unsigned long len) {
+    static unsigned long table[256];
+    static int have_table;
+    const unsigned char * p = buf;
+    unsigned long crc = 0xFFFFFFFFUL;
+    unsigned long c;
+    int i;
+    int j;
+
+    /* Racing initializers compute identical tables. */
+    if (!have_table) {
+        for (i = 0; i < 256; i++) {
+            c = i;
+            for (j = 0; j < 8; j++)
+              c = c & 1 ? (c >> 1) ^ 0x82F63B78UL : c >> 1;
+            table[i] = c;
+          }
+        have_table = 1;
+      }
+    while (len--)
+      crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return (crc ^ 0xFFFFFFFFUL) & 0xFFFFFFFFUL;
+  }
+
+unsigned long ImgFmtGetLe32(const void * buf) {
+    const unsigned char * p = buf;
+
+    return
+      (unsigned long) p[0] |
+      (unsigned long) p[1] << 8 |
+      (unsigned long) p[2] << 16 |
+      (unsigned long) p[3] << 24;
+  }
+
+unsigned long long ImgFmtGetLe64(const void * buf) {
+    const unsigned char * p = buf;
+
+    return
+      ImgFmtGetLe32(p) |
+      (unsigned long long) ImgFmtGetLe32(p + 4) << 32;
+  }
+
+void ImgFmtPutLe32(void * buf, unsigned long val) {
+    unsigned char * p = buf;
+
+    p[0] = (unsigned char) val;
+    p[1] = (unsigned char) (val >> 8);
+    p[2] = (unsigned char) (val >> 16);
+    p[3] = (unsigned char) (val >> 24);
+  }
+
+void ImgFmtPutLe64(void * buf, unsigned long long val) {
+    unsigned char * p = buf;
+
+    ImgFmtPutLe32(p, (unsigned long) val);
+    ImgFmtPutLe32(p + 4, (unsigned long) (val >> 32));
+  }
+
+unsigned long ImgFmtGetBe32(const void * buf) {
+    const unsigned char * p = buf;
+
+    return
+      (unsigned long) p[0] << 24 |
+      (unsigned long) p[1] << 16 |
+      (unsigned long) p[2] << 8 |
+      (unsigned long) p[3];
+  }
+
+unsigned long long ImgFmtGetBe64(const void * buf) {
+    const unsigned char * p = buf;
+
+    return
+      (unsigned long long) ImgFmtGetBe32(p) << 32 |
+      ImgFmtGetBe32(p + 4);
+  }
+
+void ImgFmtPutBe32(void * buf, unsigned long val) {
+    unsigned char * p = buf;
+
+    p[0] = (unsigned char) (val >> 24);
+    p[1] = (unsigned char) (val >> 16);
+    p[2] = (unsigned char) (val >> 8);
+    p[3] = (unsigned char) val;
+  }
+
+void ImgFmtPutBe64(void * buf, unsigned long long val) {
+    unsigned char * p = buf;
+
+    ImgFmtPutBe32(p, (unsigned long) (val >> 32));
+    ImgFmtPutBe32(p + 4, (unsigned long) val);
+  }
+
+void ImgFmtFill(void * buf, int val, unsigned long len) {
+    unsigned char * p = buf;
+
+    while (len--)
+      *p++ = (unsigned char) val;
+  }
+
+void ImgFmtCopy(void * dest, const void * src, unsigned long len) {
+    unsigned char * d = dest;
+    const unsigned char * s = src;
+
+    while (len--)
+      *d++ = *s++;
+  }
+
+int ImgFmtEqual(const void * a, const void * b, unsigned long len) {
+    const unsigned char * p = a;
+    const unsigned char * q = b;
+
+    while (len--) {
+        if (*p++ != *q++)
+          return 0;
+      }
+    return 1;
+  }
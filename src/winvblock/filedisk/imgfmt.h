@@ -0,0 +1,192 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef WV_M_IMGFMT_H_
+#  define WV_M_IMGFMT_H_
+
+/**
+ * @file
+ *
+ * Portable image format engines.
+ *
+ * Each engine translates virtual disk I/O into I/O on an image file,
+ * keeping the image's block translation tables cached in memory.
+ * The engines include no OS headers and do all of their file I/O and
+ * memory management through an IMGFMT_S_FILE, so they build unchanged
+ * in the kernel and in user-land.
+ *
+ * Every file I/O an engine issues starts at a multiple of
+ * IMGFMT_M_ALIGN and is a multiple of IMGFMT_M_ALIGN in length, so the
+ * file may be opened for non-cached I/O.  Callers must respect the same
+ * granularity for virtual disk I/O.
+ */
+
+/** Macros */
+
+/* The granularity of all I/O */
+#define IMGFMT_M_ALIGN 512
+
+/** Object types */
+typedef enum IMGFMT_STATUS IMGFMT_E_STATUS;
+typedef struct IMGFMT_FILE IMGFMT_S_FILE;
+typedef struct IMGFMT_FORMAT IMGFMT_S_FORMAT;
+typedef struct IMGFMT IMGFMT_S, * IMGFMT_SP;
+
+/** Enumerations */
+enum IMGFMT_STATUS {
+    ImgFmtStatusSuccess,
+    ImgFmtStatusNoMemory,
+    ImgFmtStatusInvalid,
+    ImgFmtStatusIo,
+    ImgFmtStatusCorrupt,
+    ImgFmtStatusUnsupported,
+    ImgFmtStatusReadOnly,
+    ImgFmtStatusFull,
+    ImgFmtStatuses
+  };
+
+/** Struct/union type definitions */
+
+/**
+ * The operations an engine needs from its environment.
+ *
+ * Read and Write return 0 upon success.  Random fills a buffer with
+ * bytes which needn't be cryptographically strong.
+ */
+struct IMGFMT_FILE {
+    int (*Read)(
+        void * Context,
+        unsigned long long Offset,
+        unsigned long Length,
+        void * Buffer
+      );
+    int (*Write)(
+        void * Context,
+        unsigned long long Offset,
+        unsigned long Length,
+        const void * Buffer
+      );
+    void * (*Malloc)(void * Context, unsigned long Size);
+    void (*Free)(void * Context, void * Ptr);
+    void (*Random)(void * Context, void * Buffer, unsigned long Length);
+    /** The size of the file when it is opened, in bytes */
+    unsigned long long Size;
+    void * Context;
+  };
+
+/** An image format engine */
+struct IMGFMT_FORMAT {
+    const char * Name;
+
+    /**
+     * Open an image.
+     *
+     * Returns ImgFmtStatusSuccess with *Image set to 0 if the file
+     * isn't of this format.
+     */
+    IMGFMT_E_STATUS (*Open)(
+        const IMGFMT_S_FILE * File,
+        void ** Image,
+        unsigned long long * Size
+      );
+    IMGFMT_E_STATUS (*Read)(
+        void * Image,
+        unsigned long long Offset,
+        unsigned long Length,
+        void * Buffer
+      );
+    IMGFMT_E_STATUS (*Write)(
+        void * Image,
+        unsigned long long Offset,
+        unsigned long Length,
+        const void * Buffer
+      );
+    void (*Close)(void * Image);
+  };
+
+/** An open image */
+struct IMGFMT {
+    const IMGFMT_S_FORMAT * Format;
+    void * Image;
+    /** The virtual disk's size, in bytes */
+    unsigned long long Size;
+  };
+
+/** Objects */
+extern const IMGFMT_S_FORMAT ImgFmtVhdx;
+extern const IMGFMT_S_FORMAT ImgFmtQcow2;
+
+/** Function declarations */
+
+/**
+ * Open an image of any known format.
+ *
+ * @v File              The file to open.  Must outlive the image.
+ * @v Image             Populated with the open image.  Its Format is 0
+ *                      if the file isn't of any known format.
+ * @ret IMGFMT_E_STATUS
+ */
+extern IMGFMT_E_STATUS ImgFmtOpen(const IMGFMT_S_FILE *, IMGFMT_SP);
+
+/**
+ * Read from or write to an open image.
+ *
+ * @v Image             The image to perform I/O on.
+ * @v Offset            The byte offset into the virtual disk.
+ * @v Length            The number of bytes to transfer.
+ * @v Buffer            The buffer to transfer to or from.
+ * @ret IMGFMT_E_STATUS
+ */
+extern IMGFMT_E_STATUS ImgFmtRead(
+    IMGFMT_SP,
+    unsigned long long,
+    unsigned long,
+    void *
+  );
+extern IMGFMT_E_STATUS ImgFmtWrite(
+    IMGFMT_SP,
+    unsigned long long,
+    unsigned long,
+    const void *
+  );
+
+/**
+ * Close an open image.
+ *
+ * @v Image             The image to close.
+ */
+extern void ImgFmtClose(IMGFMT_SP);
+
+/** Helpers for the engines */
+
+/* CRC-32C (Castagnoli), as used by VHDX */
+extern unsigned long ImgFmtCrc32c(const void *, unsigned long);
+
+extern unsigned long ImgFmtGetLe32(const void *);
+extern unsigned long long ImgFmtGetLe64(const void *);
+extern void ImgFmtPutLe32(void *, unsigned long);
+extern void ImgFmtPutLe64(void *, unsigned long long);
+extern unsigned long ImgFmtGetBe32(const void *);
+extern unsigned long long ImgFmtGetBe64(const void *);
+extern void ImgFmtPutBe32(void *, unsigned long);
+extern void ImgFmtPutBe64(void *, unsigned long long);
+
+/* Fill memory without the C library */
+extern void ImgFmtFill(void *, int, unsigned long);
+extern void ImgFmtCopy(void *, const void *, unsigned long);
+extern int ImgFmtEqual(const void *, const void *, unsigned long);
+
+#endif  /* WV_M_IMGFMT_H_ */
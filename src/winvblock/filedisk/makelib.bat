@@ -2,7 +2,7 @@
 
 set libname=filedisk
 
-set c=filedisk.c grub4dos.c security.c pnp.c scsi.c
+set c=filedisk.c grub4dos.c security.c pnp.c scsi.c vhd.c format.c imgfmt.c qcow2.c vhdx.c snapshot.c section.c ram.c hotswap.c
 
 echo !INCLUDE $(NTMAKEENV)\makefile.def	> makefile
 
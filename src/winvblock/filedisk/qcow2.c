@@ -0,0 +1,638 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * QCOW2 image format engine.
+ *
+ * The L1 table is kept in memory and L2 tables are kept in a small LRU
+ * cache, so a lookup costs no file I/O once its L2 table is cached.
+ * Runs of clusters which are contiguous in the file are read with a
+ * single I/O.
+ *
+ * Writes go in place to clusters which the image alone references.
+ * Anything else is copied to a new cluster at the end of the file.
+ * The refcount tables are not maintained.  Instead, before the first
+ * allocation, the image is marked dirty.  QEMU rebuilds the refcounts
+ * of a dirty image when it next opens it, just as it does for images
+ * with lazy refcounts.  Because version 2 images can't be marked
+ * dirty, they only take writes to existing clusters.
+ *
+ * Backing files, encryption, compressed clusters, external data files
+ * and extended L2 entries aren't supported.
+ */
+
+#include "imgfmt.h"
+
+/** Macros */
+
+#define QCOW2_M_MAGIC 0x514649FBUL
+#define QCOW2_M_MIN_CLUSTER_BITS 9
+#define QCOW2_M_MAX_CLUSTER_BITS 21
+
+/* How many L2 tables to cache */
+#define QCOW2_M_L2_CACHE 16
+
+/* L1 and L2 entry fields */
+#define QCOW2_M_OFFSET_MASK 0x00FFFFFFFFFFFE00ULL
+#define QCOW2_M_COPIED 0x8000000000000000ULL
+#define QCOW2_M_COMPRESSED 0x4000000000000000ULL
+#define QCOW2_M_ZERO 0x1ULL
+
+/* Incompatible feature bits */
+#define QCOW2_M_INCOMPAT_DIRTY 0x1ULL
+#define QCOW2_M_INCOMPAT_CORRUPT 0x2ULL
+#define QCOW2_M_INCOMPAT_COMPRESSION 0x8ULL
+
+/* Header field offsets */
+#define QCOW2_M_HDR_VERSION 4
+#define QCOW2_M_HDR_BACKING 8
+#define QCOW2_M_HDR_CLUSTER_BITS 20
+#define QCOW2_M_HDR_SIZE 24
+#define QCOW2_M_HDR_CRYPT 32
+#define QCOW2_M_HDR_L1_SIZE 36
+#define QCOW2_M_HDR_L1_OFFSET 40
+#define QCOW2_M_HDR_INCOMPAT 72
+
+/* Round up to the I/O granularity */
+#define QCOW2_M_ALIGN(x) \
+  (((x) + IMGFMT_M_ALIGN - 1) & ~(unsigned long long) (IMGFMT_M_ALIGN - 1))
+
+/** Object types */
+typedef struct QCOW2_L2 QCOW2_S_L2, * QCOW2_SP_L2;
+typedef struct QCOW2 QCOW2_S, * QCOW2_SP;
+
+/** Struct/union type definitions */
+
+/* A cached L2 table */
+struct QCOW2_L2 {
+    /** The table's offset in the file, or 0 for an empty slot */
+    unsigned long long Offset;
+    /** When the table was last used */
+    unsigned long Used;
+    /** The table, in file byte order */
+    unsigned char * Table;
+  };
+
+struct QCOW2 {
+    const IMGFMT_S_FILE * File;
+    unsigned long Version;
+    unsigned long ClusterBits;
+    unsigned long ClusterSize;
+    unsigned long L2Bits;
+    unsigned long long Size;
+    unsigned long L1Size;
+    unsigned long long L1Offset;
+    /** The L1 table, in file byte order, padded to the I/O granularity */
+    unsigned char * L1;
+    /** The first sector of the header */
+    unsigned char * Header;
+    int Dirty;
+    /** Where the next cluster goes */
+    unsigned long long End;
+    unsigned long Clock;
+    QCOW2_S_L2 Cache[QCOW2_M_L2_CACHE];
+  };
+
+/** Private function declarations */
+static IMGFMT_E_STATUS Qcow2Open_(
+    const IMGFMT_S_FILE *,
+    void **,
+    unsigned long long *
+  );
+static IMGFMT_E_STATUS Qcow2Read_(
+    void *,
+    unsigned long long,
+    unsigned long,
+    void *
+  );
+static IMGFMT_E_STATUS Qcow2Write_(
+    void *,
+    unsigned long long,
+    unsigned long,
+    const void *
+  );
+static void Qcow2Close_(void *);
+static IMGFMT_E_STATUS Qcow2GetL2_(
+    QCOW2_SP,
+    unsigned long long,
+    unsigned char **
+  );
+static IMGFMT_E_STATUS Qcow2Lookup_(
+    QCOW2_SP,
+    unsigned long long,
+    unsigned long long *
+  );
+static IMGFMT_E_STATUS Qcow2MarkDirty_(QCOW2_SP);
+static IMGFMT_E_STATUS Qcow2PrepareL2_(
+    QCOW2_SP,
+    unsigned long,
+    unsigned char *,
+    unsigned char **,
+    unsigned long long *
+  );
+
+/** Objects */
+const IMGFMT_S_FORMAT ImgFmtQcow2 = {
+    "QCOW2",
+    Qcow2Open_,
+    Qcow2Read_,
+    Qcow2Write_,
+    Qcow2Close_,
+  };
+
+/** Function definitions */
+
+static IMGFMT_E_STATUS Qcow2Open_(
+    const IMGFMT_S_FILE * file,
+    void ** image,
+    unsigned long long * size
+  ) {
+    QCOW2_SP qcow2;
+    unsigned char * hdr;
+    unsigned long long l1_needed;
+    unsigned long long incompat;
+    unsigned long l1_bytes;
+    IMGFMT_E_STATUS status;
+
+    *image = 0;
+    if (file->Size < IMGFMT_M_ALIGN)
+      return ImgFmtStatusSuccess;
+
+    qcow2 = file->Malloc(file->Context, sizeof *qcow2);
+    if (!qcow2)
+      return ImgFmtStatusNoMemory;
+    ImgFmtFill(qcow2, 0, sizeof *qcow2);
+    qcow2->File = file;
+
+    hdr = qcow2->Header = file->Malloc(file->Context, IMGFMT_M_ALIGN);
+    if (!hdr) {
+        status = ImgFmtStatusNoMemory;
+        goto err_header;
+      }
+    if (file->Read(file->Context, 0, IMGFMT_M_ALIGN, hdr)) {
+        status = ImgFmtStatusIo;
+        goto err_check;
+      }
+    if (ImgFmtGetBe32(hdr) != QCOW2_M_MAGIC) {
+        /* Not ours. */
+        status = ImgFmtStatusSuccess;
+        goto err_check;
+      }
+
+    status = ImgFmtStatusUnsupported;
+    qcow2->Version = ImgFmtGetBe32(hdr + QCOW2_M_HDR_VERSION);
+    if (qcow2->Version != 2 && qcow2->Version != 3)
+      goto err_check;
+    if (ImgFmtGetBe64(hdr + QCOW2_M_HDR_BACKING))
+      goto err_check;
+    if (ImgFmtGetBe32(hdr + QCOW2_M_HDR_CRYPT))
+      goto err_check;
+    if (qcow2->Version >= 3) {
+        incompat = ImgFmtGetBe64(hdr + QCOW2_M_HDR_INCOMPAT);
+        if (incompat & QCOW2_M_INCOMPAT_CORRUPT) {
+            status = ImgFmtStatusCorrupt;
+            goto err_check;
+          }
+        if (
+            incompat &
+            ~(QCOW2_M_INCOMPAT_DIRTY | QCOW2_M_INCOMPAT_COMPRESSION)
+          )
+          goto err_check;
+        qcow2->Dirty = !!(incompat & QCOW2_M_INCOMPAT_DIRTY);
+      }
+
+    status = ImgFmtStatusCorrupt;
+    qcow2->ClusterBits = ImgFmtGetBe32(hdr + QCOW2_M_HDR_CLUSTER_BITS);
+    if (
+        qcow2->ClusterBits < QCOW2_M_MIN_CLUSTER_BITS ||
+        qcow2->ClusterBits > QCOW2_M_MAX_CLUSTER_BITS
+      )
+      goto err_check;
+    qcow2->ClusterSize = 1UL << qcow2->ClusterBits;
+    qcow2->L2Bits = qcow2->ClusterBits - 3;
+    qcow2->Size = ImgFmtGetBe64(hdr + QCOW2_M_HDR_SIZE);
+    qcow2->L1Size = ImgFmtGetBe32(hdr + QCOW2_M_HDR_L1_SIZE);
+    qcow2->L1Offset = ImgFmtGetBe64(hdr + QCOW2_M_HDR_L1_OFFSET);
+    l1_needed =
+      (qcow2->Size + (1ULL << (qcow2->ClusterBits + qcow2->L2Bits)) - 1) >>
+      (qcow2->ClusterBits + qcow2->L2Bits);
+    if (
+        qcow2->L1Size < l1_needed ||
+        qcow2->L1Size > 0x10000000UL ||
+        qcow2->L1Offset & (qcow2->ClusterSize - 1)
+      )
+      goto err_check;
+
+    /* Read the L1 table. */
+    l1_bytes = (unsigned long) QCOW2_M_ALIGN(qcow2->L1Size * 8ULL);
+    qcow2->L1 = file->Malloc(file->Context, l1_bytes ? l1_bytes : 1);
+    if (!qcow2->L1) {
+        status = ImgFmtStatusNoMemory;
+        goto err_check;
+      }
+    if (
+        l1_bytes &&
+        file->Read(file->Context, qcow2->L1Offset, l1_bytes, qcow2->L1)
+      ) {
+        status = ImgFmtStatusIo;
+        goto err_read_l1;
+      }
+
+    qcow2->End =
+      (file->Size + qcow2->ClusterSize - 1) &
+      ~(unsigned long long) (qcow2->ClusterSize - 1);
+    *size = qcow2->Size;
+    *image = qcow2;
+    return ImgFmtStatusSuccess;
+
+    err_read_l1:
+
+    file->Free(file->Context, qcow2->L1);
+    err_check:
+
+    file->Free(file->Context, hdr);
+    err_header:
+
+    file->Free(file->Context, qcow2);
+    return status;
+  }
+
+static void Qcow2Close_(void * image) {
+    QCOW2_SP qcow2 = image;
+    const IMGFMT_S_FILE * file = qcow2->File;
+    unsigned int i;
+
+    for (i = 0; i < QCOW2_M_L2_CACHE; i++) {
+        if (qcow2->Cache[i].Table)
+          file->Free(file->Context, qcow2->Cache[i].Table);
+      }
+    file->Free(file->Context, qcow2->L1);
+    file->Free(file->Context, qcow2->Header);
+    file->Free(file->Context, qcow2);
+  }
+
+/* Fetch an L2 table through the cache. */
+static IMGFMT_E_STATUS Qcow2GetL2_(
+    QCOW2_SP qcow2,
+    unsigned long long offset,
+    unsigned char ** table
+  ) {
+    const IMGFMT_S_FILE * file = qcow2->File;
+    QCOW2_SP_L2 slot = qcow2->Cache;
+    unsigned int i;
+
+    for (i = 0; i < QCOW2_M_L2_CACHE; i++) {
+        if (qcow2->Cache[i].Offset == offset) {
+            qcow2->Cache[i].Used = ++qcow2->Clock;
+            *table = qcow2->Cache[i].Table;
+            return ImgFmtStatusSuccess;
+          }
+        if (qcow2->Cache[i].Used < slot->Used)
+          slot = qcow2->Cache + i;
+      }
+
+    /* Miss.  Replace the least recently used table. */
+    if (!slot->Table) {
+        slot->Table = file->Malloc(file->Context, qcow2->ClusterSize);
+        if (!slot->Table)
+          return ImgFmtStatusNoMemory;
+      }
+    slot->Offset = 0;
+    slot->Used = 0;
+    if (file->Read(file->Context, offset, qcow2->ClusterSize, slot->Table))
+      return ImgFmtStatusIo;
+    slot->Offset = offset;
+    slot->Used = ++qcow2->Clock;
+    *table = slot->Table;
+    return ImgFmtStatusSuccess;
+  }
+
+/* Fetch the L2 entry for a virtual offset, or 0 for none. */
+static IMGFMT_E_STATUS Qcow2Lookup_(
+    QCOW2_SP qcow2,
+    unsigned long long offset,
+    unsigned long long * l2_entry
+  ) {
+    unsigned long long l1_index;
+    unsigned long l2_index;
+    unsigned long long l2_offset;
+    unsigned char * table;
+    IMGFMT_E_STATUS status;
+
+    l1_index = offset >> (qcow2->ClusterBits + qcow2->L2Bits);
+    l2_index =
+      (unsigned long) (offset >> qcow2->ClusterBits) &
+      ((1UL << qcow2->L2Bits) - 1);
+    *l2_entry = 0;
+
+    l2_offset = ImgFmtGetBe64(qcow2->L1 + l1_index * 8) & QCOW2_M_OFFSET_MASK;
+    if (!l2_offset)
+      return ImgFmtStatusSuccess;
+    status = Qcow2GetL2_(qcow2, l2_offset, &table);
+    if (status != ImgFmtStatusSuccess)
+      return status;
+    *l2_entry = ImgFmtGetBe64(table + l2_index * 8);
+    return ImgFmtStatusSuccess;
+  }
+
+static IMGFMT_E_STATUS Qcow2Read_(
+    void * image,
+    unsigned long long offset,
+    unsigned long length,
+    void * buffer
+  ) {
+    QCOW2_SP qcow2 = image;
+    const IMGFMT_S_FILE * file = qcow2->File;
+    unsigned char * buf = buffer;
+    unsigned long long l2_entry;
+    unsigned long long host;
+    unsigned long in_cluster;
+    unsigned long chunk;
+    /* A pending run of data which is contiguous in the file */
+    unsigned long long run_host = 0;
+    unsigned char * run_buf = 0;
+    unsigned long run_len = 0;
+    IMGFMT_E_STATUS status;
+
+    while (length) {
+        in_cluster = (unsigned long) offset & (qcow2->ClusterSize - 1);
+        chunk = qcow2->ClusterSize - in_cluster;
+        if (chunk > length)
+          chunk = length;
+
+        status = Qcow2Lookup_(qcow2, offset, &l2_entry);
+        if (status != ImgFmtStatusSuccess)
+          return status;
+        if (l2_entry & QCOW2_M_COMPRESSED)
+          return ImgFmtStatusUnsupported;
+        host = l2_entry & QCOW2_M_OFFSET_MASK;
+        if (qcow2->Version >= 3 && l2_entry & QCOW2_M_ZERO)
+          host = 0;
+
+        /* Flush the pending run if this doesn't extend it. */
+        if (run_len && (!host || host + in_cluster != run_host + run_len)) {
+            if (file->Read(file->Context, run_host, run_len, run_buf))
+              return ImgFmtStatusIo;
+            run_len = 0;
+          }
+        if (host) {
+            if (!run_len) {
+                run_host = host + in_cluster;
+                run_buf = buf;
+              }
+            run_len += chunk;
+          } else {
+            ImgFmtFill(buf, 0, chunk);
+          }
+
+        offset += chunk;
+        buf += chunk;
+        length -= chunk;
+      }
+    if (run_len && file->Read(file->Context, run_host, run_len, run_buf))
+      return ImgFmtStatusIo;
+    return ImgFmtStatusSuccess;
+  }
+
+/* Mark the image dirty before its first allocation. */
+static IMGFMT_E_STATUS Qcow2MarkDirty_(QCOW2_SP qcow2) {
+    const IMGFMT_S_FILE * file = qcow2->File;
+    unsigned long long incompat;
+
+    if (qcow2->Dirty)
+      return ImgFmtStatusSuccess;
+    if (qcow2->Version < 3)
+      return ImgFmtStatusReadOnly;
+    incompat = ImgFmtGetBe64(qcow2->Header + QCOW2_M_HDR_INCOMPAT);
+    ImgFmtPutBe64(
+        qcow2->Header + QCOW2_M_HDR_INCOMPAT,
+        incompat | QCOW2_M_INCOMPAT_DIRTY
+      );
+    if (file->Write(file->Context, 0, IMGFMT_M_ALIGN, qcow2->Header)) {
+        ImgFmtPutBe64(qcow2->Header + QCOW2_M_HDR_INCOMPAT, incompat);
+        return ImgFmtStatusIo;
+      }
+    qcow2->Dirty = 1;
+    return ImgFmtStatusSuccess;
+  }
+
+/**
+ * Make sure that an L2 table exists and belongs to the image alone.
+ *
+ * @v cluster           Scratch space of one cluster.
+ * @v table             Populated with the cached table.
+ * @v table_offset      Populated with the table's offset in the file.
+ */
+static IMGFMT_E_STATUS Qcow2PrepareL2_(
+    QCOW2_SP qcow2,
+    unsigned long l1_index,
+    unsigned char * cluster,
+    unsigned char ** table,
+    unsigned long long * table_offset
+  ) {
+    const IMGFMT_S_FILE * file = qcow2->File;
+    unsigned char * l1_entry = qcow2->L1 + l1_index * 8ULL;
+    unsigned long long l1_sector = (l1_index * 8ULL) & ~(IMGFMT_M_ALIGN - 1ULL);
+    unsigned long long old_entry;
+    unsigned long long old_offset;
+    unsigned long long new_offset;
+    IMGFMT_E_STATUS status;
+
+    old_entry = ImgFmtGetBe64(l1_entry);
+    old_offset = old_entry & QCOW2_M_OFFSET_MASK;
+    if (old_offset && old_entry & QCOW2_M_COPIED) {
+        *table_offset = old_offset;
+        return Qcow2GetL2_(qcow2, old_offset, table);
+      }
+
+    /* Write a new table: empty, or a copy of a shared one. */
+    status = Qcow2MarkDirty_(qcow2);
+    if (status != ImgFmtStatusSuccess)
+      return status;
+    if (old_offset) {
+        status = Qcow2GetL2_(qcow2, old_offset, table);
+        if (status != ImgFmtStatusSuccess)
+          return status;
+        ImgFmtCopy(cluster, *table, qcow2->ClusterSize);
+      } else {
+        ImgFmtFill(cluster, 0, qcow2->ClusterSize);
+      }
+    new_offset = qcow2->End;
+    if (file->Write(file->Context, new_offset, qcow2->ClusterSize, cluster))
+      return ImgFmtStatusIo;
+    qcow2->End += qcow2->ClusterSize;
+
+    ImgFmtPutBe64(l1_entry, new_offset | QCOW2_M_COPIED);
+    if (
+        file->Write(
+            file->Context,
+            qcow2->L1Offset + l1_sector,
+            IMGFMT_M_ALIGN,
+            qcow2->L1 + l1_sector
+          )
+      ) {
+        ImgFmtPutBe64(l1_entry, old_entry);
+        return ImgFmtStatusIo;
+      }
+    *table_offset = new_offset;
+    return Qcow2GetL2_(qcow2, new_offset, table);
+  }
+
+static IMGFMT_E_STATUS Qcow2Write_(
+    void * image,
+    unsigned long long offset,
+    unsigned long length,
+    const void * buffer
+  ) {
+    QCOW2_SP qcow2 = image;
+    const IMGFMT_S_FILE * file = qcow2->File;
+    const unsigned char * buf = buffer;
+    unsigned char * cluster = 0;
+    unsigned char * table;
+    unsigned long long table_offset;
+    unsigned long long l2_entry;
+    unsigned long long host;
+    unsigned long long new_host;
+    unsigned long l1_index;
+    unsigned long l2_index;
+    unsigned long l2_sector;
+    unsigned long in_cluster;
+    unsigned long chunk;
+    int zero;
+    IMGFMT_E_STATUS status = ImgFmtStatusSuccess;
+
+    while (length) {
+        in_cluster = (unsigned long) offset & (qcow2->ClusterSize - 1);
+        chunk = qcow2->ClusterSize - in_cluster;
+        if (chunk > length)
+          chunk = length;
+
+        status = Qcow2Lookup_(qcow2, offset, &l2_entry);
+        if (status != ImgFmtStatusSuccess)
+          break;
+        host = l2_entry & QCOW2_M_OFFSET_MASK;
+        zero = qcow2->Version >= 3 && l2_entry & QCOW2_M_ZERO;
+
+        if (
+            host &&
+            l2_entry & QCOW2_M_COPIED &&
+            !(l2_entry & QCOW2_M_COMPRESSED) &&
+            !zero
+          ) {
+            /* The cluster is ours alone.  Write in place. */
+            if (file->Write(file->Context, host + in_cluster, chunk, buf)) {
+                status = ImgFmtStatusIo;
+                break;
+              }
+            goto next;
+          }
+        if (l2_entry & QCOW2_M_COMPRESSED) {
+            status = ImgFmtStatusUnsupported;
+            break;
+          }
+
+        /* We need a new cluster.  Build its contents. */
+        if (!cluster) {
+            cluster = file->Malloc(file->Context, qcow2->ClusterSize);
+            if (!cluster) {
+                status = ImgFmtStatusNoMemory;
+                break;
+              }
+          }
+        l1_index = (unsigned long) (
+            offset >> (qcow2->ClusterBits + qcow2->L2Bits)
+          );
+        status = Qcow2PrepareL2_(
+            qcow2,
+            l1_index,
+            cluster,
+            &table,
+            &table_offset
+          );
+        if (status != ImgFmtStatusSuccess)
+          break;
+        if (chunk != qcow2->ClusterSize) {
+            if (host && !zero) {
+                if (
+                    file->Read(
+                        file->Context,
+                        host,
+                        qcow2->ClusterSize,
+                        cluster
+                      )
+                  ) {
+                    status = ImgFmtStatusIo;
+                    break;
+                  }
+              } else {
+                ImgFmtFill(cluster, 0, qcow2->ClusterSize);
+              }
+            ImgFmtCopy(cluster + in_cluster, buf, chunk);
+          }
+        /* A preallocated zero cluster which is ours may be reused. */
+        if (zero && host && l2_entry & QCOW2_M_COPIED) {
+            new_host = host;
+          } else {
+            status = Qcow2MarkDirty_(qcow2);
+            if (status != ImgFmtStatusSuccess)
+              break;
+            new_host = qcow2->End;
+            qcow2->End += qcow2->ClusterSize;
+          }
+        if (
+            file->Write(
+                file->Context,
+                new_host,
+                qcow2->ClusterSize,
+                chunk == qcow2->ClusterSize ? buf : cluster
+              )
+          ) {
+            status = ImgFmtStatusIo;
+            break;
+          }
+
+        /* Point the L2 entry at it. */
+        l2_index =
+          (unsigned long) (offset >> qcow2->ClusterBits) &
+          ((1UL << qcow2->L2Bits) - 1);
+        l2_sector = (l2_index * 8) & ~(IMGFMT_M_ALIGN - 1UL);
+        ImgFmtPutBe64(table + l2_index * 8, new_host | QCOW2_M_COPIED);
+        if (
+            file->Write(
+                file->Context,
+                table_offset + l2_sector,
+                IMGFMT_M_ALIGN,
+                table + l2_sector
+              )
+          ) {
+            ImgFmtPutBe64(table + l2_index * 8, l2_entry);
+            status = ImgFmtStatusIo;
+            break;
+          }
+
+        next:
+        offset += chunk;
+        buf += chunk;
+        length -= chunk;
+      }
+
+    if (cluster)
+      file->Free(file->Context, cluster);
+    return status;
+  }
@@ -0,0 +1,559 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Filedisks served from RAM.
+ *
+ * The whole image is read into non-paged memory, in runs of up to
+ * WV_M_FILEDISK_RAM_RUN bytes, by a loader which queues itself again
+ * after each run, so the disk's I/O is served in between.  Until a
+ * block of WV_M_FILEDISK_RAM_BLOCK bytes is loaded, reads of it go to
+ * the file, and a write to it loads it first.  Once everything is
+ * loaded, I/O is just copying, and is done without a trip through the
+ * filedisk's queue.
+ *
+ * Writes stay in RAM.  With write-back, the blocks written are written
+ * to the file when the disk is freed.
+ *
+ * Until the image is loaded, these routines are only called from the
+ * filedisk's queue, which runs one item at a time.
+ */
+
+#include <ntifs.h>
+#include <ntddk.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "wv_stdlib.h"
+#include "irp.h"
+#include "driver.h"
+#include "bus.h"
+#include "device.h"
+#include "disk.h"
+#include "thread.h"
+#include "filedisk.h"
+#include "debug.h"
+
+/** Macros */
+
+/* The granularity of loading and of write-back */
+#define WV_M_FILEDISK_RAM_BLOCK (64 * 1024)
+
+/* The largest file I/O for loading or write-back */
+#define WV_M_FILEDISK_RAM_RUN (4 * 1024 * 1024)
+
+#define WV_M_FILEDISK_RAM_RUN_BLOCKS \
+  (WV_M_FILEDISK_RAM_RUN / WV_M_FILEDISK_RAM_BLOCK)
+
+/** Struct/union type definitions */
+
+struct WV_FILEDISK_RAM {
+    PUCHAR Data;
+    SIZE_T Size;
+    SIZE_T Blocks;
+    /* One byte per block, non-zero once the block is in Data */
+    PUCHAR Present;
+    /* One byte per block, non-zero once the block is written, or NULL */
+    PUCHAR Dirty;
+    /* For loading and write-back */
+    PFILE_OBJECT FileObj;
+    LONGLONG FileOffset;
+    /* The loader and the first block it hasn't looked at */
+    WVL_S_THREAD_ITEM LoadItem[1];
+    WVL_SP_THREAD_QUEUE Queue;
+    SIZE_T NextLoad;
+    /* Non-zero once every block is present */
+    volatile LONG Loaded;
+    /* Non-zero once the loader should stop queueing itself */
+    volatile LONG Stopping;
+  };
+
+/** Private function declarations */
+static WVL_F_THREAD_ITEM WvFilediskRamLoad_;
+static NTSTATUS STDCALL WvFilediskRamLoadRun_(
+    IN WV_SP_FILEDISK_RAM,
+    IN SIZE_T,
+    IN SIZE_T
+  );
+static NTSTATUS STDCALL WvFilediskRamFileIo_(
+    IN WV_SP_FILEDISK_RAM,
+    IN WVL_E_DISK_IO_MODE,
+    IN SIZE_T,
+    IN SIZE_T
+  );
+static NTSTATUS STDCALL WvFilediskRamRead_(
+    IN WV_SP_FILEDISK_RAM,
+    IN SIZE_T,
+    IN UINT32,
+    OUT PUCHAR
+  );
+static NTSTATUS STDCALL WvFilediskRamWrite_(
+    IN WV_SP_FILEDISK_RAM,
+    IN SIZE_T,
+    IN UINT32,
+    IN PUCHAR
+  );
+static VOID STDCALL WvFilediskRamWriteBack_(IN WV_SP_FILEDISK_RAM);
+
+/** Exported function definitions */
+
+/**
+ * Serve a filedisk from RAM.
+ *
+ * @v filedisk          The filedisk, whose raw file is open and whose
+ *                      size is known.
+ * @v write_back        Whether to write the blocks written back to the
+ *                      file when the filedisk is freed.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Allocates the memory for the image and starts the loader.  Must be
+ * called from the filedisk's queue.
+ */
+NTSTATUS STDCALL WvFilediskRamOpen(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN BOOLEAN write_back
+  ) {
+    WV_SP_FILEDISK_RAM ram;
+    ULONGLONG size;
+    NTSTATUS status;
+
+    size = filedisk->disk->LBADiskSize * filedisk->disk->SectorSize;
+    if (!size || size != (SIZE_T) size) {
+        DBG("Disk size won't fit in memory!\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_size;
+      }
+
+    ram = wv_mallocz(sizeof *ram);
+    if (!ram) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_ram;
+      }
+    ram->Size = (SIZE_T) size;
+    ram->Blocks =
+      (ram->Size + WV_M_FILEDISK_RAM_BLOCK - 1) / WV_M_FILEDISK_RAM_BLOCK;
+
+    ram->Data = wv_malloc(ram->Size);
+    if (!ram->Data) {
+        DBG("Couldn't allocate %Iu bytes for the image!\n", ram->Size);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_data;
+      }
+    ram->Present = wv_pallocz(ram->Blocks);
+    if (!ram->Present) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_present;
+      }
+    /* Blocks are marked dirty by writes at any IRQL. */
+    if (write_back) {
+        ram->Dirty = wv_mallocz(ram->Blocks);
+        if (!ram->Dirty) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto err_dirty;
+          }
+      }
+
+    ram->FileObj = filedisk->FileObj;
+    ObReferenceObject(ram->FileObj);
+    ram->FileOffset = filedisk->offset.QuadPart;
+
+    /* Start loading, after the I/O already queued. */
+    ram->LoadItem->Func = WvFilediskRamLoad_;
+    ram->Queue = filedisk->Queue;
+    if (!WvlThreadQueueAddItem(ram->Queue, ram->LoadItem)) {
+        DBG("Couldn't queue the loader!\n");
+        status = STATUS_UNSUCCESSFUL;
+        goto err_queue;
+      }
+
+    filedisk->Ram = ram;
+    filedisk->disk->NonRotational = TRUE;
+    return STATUS_SUCCESS;
+
+    err_queue:
+
+    ObDereferenceObject(ram->FileObj);
+    wv_free(ram->Dirty);
+    err_dirty:
+
+    wv_free(ram->Present);
+    err_present:
+
+    wv_free(ram->Data);
+    err_data:
+
+    wv_free(ram);
+    err_ram:
+
+    err_size:
+
+    return status;
+  }
+
+/**
+ * Stop loading a filedisk's image.
+ *
+ * @v ram               The RAM image.  May be NULL.
+ *
+ * The loader will not queue itself again, so that the filedisk's
+ * queue can be flushed.
+ */
+VOID STDCALL WvFilediskRamStop(IN WV_SP_FILEDISK_RAM ram) {
+    if (ram)
+      InterlockedExchange(&ram->Stopping, 1);
+    return;
+  }
+
+/**
+ * Free a filedisk's RAM image, writing it back first if asked to.
+ *
+ * @v ram               The RAM image to free.  May be NULL.
+ *
+ * The filedisk's queue must have been stopped and flushed.  Must be
+ * called at PASSIVE_LEVEL.
+ */
+VOID STDCALL WvFilediskRamFree(IN WV_SP_FILEDISK_RAM ram) {
+    if (!ram)
+      return;
+    if (ram->Dirty)
+      WvFilediskRamWriteBack_(ram);
+    ObDereferenceObject(ram->FileObj);
+    wv_free(ram->Dirty);
+    wv_free(ram->Present);
+    wv_free(ram->Data);
+    wv_free(ram);
+    return;
+  }
+
+/**
+ * Check whether a filedisk's image has been loaded.
+ *
+ * @v ram               The RAM image.
+ * @ret BOOLEAN         TRUE once every block is in RAM.
+ */
+BOOLEAN STDCALL WvFilediskRamLoaded(IN WV_SP_FILEDISK_RAM ram) {
+    return ram->Loaded ? TRUE : FALSE;
+  }
+
+/**
+ * Read from or write to a filedisk's RAM image.
+ *
+ * @v filedisk          The filedisk with the RAM image.
+ * @v mode              The direction of the I/O.
+ * @v offset            The byte offset into the disk.
+ * @v length            The number of bytes to transfer.
+ * @v buffer            The buffer to transfer to or from.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Once WvFilediskRamLoaded() returns TRUE, this may be called at
+ * DISPATCH_LEVEL from any thread.  Until then, it must be called from
+ * the filedisk's queue.
+ */
+NTSTATUS STDCALL WvFilediskRamIo(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN ULONGLONG offset,
+    IN UINT32 length,
+    IN OUT PUCHAR buffer
+  ) {
+    WV_SP_FILEDISK_RAM ram = filedisk->Ram;
+    SIZE_T block;
+    SIZE_T end;
+
+    if (offset > ram->Size || length > ram->Size - offset) {
+        DBG("I/O beyond the end of the disk!\n");
+        return STATUS_INVALID_PARAMETER;
+      }
+    if (!length)
+      return STATUS_SUCCESS;
+
+    if (!ram->Loaded) {
+        if (mode == WvlDiskIoModeWrite)
+          return WvFilediskRamWrite_(ram, (SIZE_T) offset, length, buffer);
+        return WvFilediskRamRead_(ram, (SIZE_T) offset, length, buffer);
+      }
+
+    if (mode == WvlDiskIoModeWrite) {
+        RtlCopyMemory(ram->Data + offset, buffer, length);
+        if (ram->Dirty) {
+            block = (SIZE_T) offset / WV_M_FILEDISK_RAM_BLOCK;
+            end = ((SIZE_T) offset + length - 1) / WV_M_FILEDISK_RAM_BLOCK;
+            while (block <= end)
+              ram->Dirty[block++] = 1;
+          }
+      } else {
+        RtlCopyMemory(buffer, ram->Data + offset, length);
+      }
+    return STATUS_SUCCESS;
+  }
+
+/**
+ * Drop the blocks of a filedisk's RAM image within a range.
+ *
+ * @v filedisk          The filedisk with the RAM image.
+ * @v offset            The byte offset into the disk.
+ * @v length            The number of bytes no longer needed.
+ *
+ * The image is one allocation, so a dropped block is just zeroed and
+ * won't be loaded.  Blocks only partly within the range are left as
+ * they are.  Must be called from the filedisk's queue.
+ */
+VOID STDCALL WvFilediskRamUnmap(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN ULONGLONG offset,
+    IN ULONGLONG length
+  ) {
+    WV_SP_FILEDISK_RAM ram = filedisk->Ram;
+    SIZE_T block;
+    SIZE_T end;
+    SIZE_T block_len;
+
+    if (offset >= ram->Size)
+      return;
+    if (length > ram->Size - offset)
+      length = ram->Size - offset;
+
+    block = (SIZE_T) (
+        (offset + WV_M_FILEDISK_RAM_BLOCK - 1) / WV_M_FILEDISK_RAM_BLOCK
+      );
+    /* The last block might be short, but it's still whole. */
+    if (offset + length == ram->Size)
+      end = ram->Blocks;
+      else
+      end = (SIZE_T) ((offset + length) / WV_M_FILEDISK_RAM_BLOCK);
+    for (; block < end; block++) {
+        block_len = WV_M_FILEDISK_RAM_BLOCK;
+        if (block_len > ram->Size - block * WV_M_FILEDISK_RAM_BLOCK)
+          block_len = ram->Size - block * WV_M_FILEDISK_RAM_BLOCK;
+        RtlZeroMemory(ram->Data + block * WV_M_FILEDISK_RAM_BLOCK, block_len);
+        ram->Present[block] = 1;
+        /* The file still has the old data. */
+        if (ram->Dirty)
+          ram->Dirty[block] = 1;
+      }
+    return;
+  }
+
+/** Private function definitions */
+
+/* Load the next run of blocks, then queue ourselves again. */
+static VOID STDCALL WvFilediskRamLoad_(IN OUT WVL_SP_THREAD_ITEM item) {
+    WV_SP_FILEDISK_RAM ram = CONTAINING_RECORD(
+        item,
+        WV_S_FILEDISK_RAM,
+        LoadItem[0]
+      );
+    SIZE_T count;
+    NTSTATUS status;
+
+    if (ram->Stopping)
+      return;
+
+    /* Skip what writes have loaded. */
+    while (ram->NextLoad < ram->Blocks && ram->Present[ram->NextLoad])
+      ram->NextLoad++;
+    count = 0;
+    while (
+        count < WV_M_FILEDISK_RAM_RUN_BLOCKS &&
+        ram->NextLoad + count < ram->Blocks &&
+        !ram->Present[ram->NextLoad + count]
+      )
+      count++;
+    if (count) {
+        status = WvFilediskRamLoadRun_(ram, ram->NextLoad, count);
+        if (!NT_SUCCESS(status)) {
+            /* The rest will be read from the file. */
+            DBG("Couldn't load image: %08X\n", status);
+            return;
+          }
+        ram->NextLoad += count;
+      }
+
+    if (ram->NextLoad >= ram->Blocks) {
+        DBG("Loaded %Iu bytes\n", ram->Size);
+        InterlockedExchange(&ram->Loaded, 1);
+        return;
+      }
+    if (!WvlThreadQueueAddItem(ram->Queue, ram->LoadItem))
+      DBG("Couldn't queue the loader!\n");
+    return;
+  }
+
+/* Load blocks from the file. */
+static NTSTATUS STDCALL WvFilediskRamLoadRun_(
+    IN WV_SP_FILEDISK_RAM ram,
+    IN SIZE_T first,
+    IN SIZE_T count
+  ) {
+    NTSTATUS status;
+
+    status = WvFilediskRamFileIo_(ram, WvlDiskIoModeRead, first, count);
+    if (!NT_SUCCESS(status))
+      return status;
+    RtlFillMemory(ram->Present + first, count, 1);
+    return STATUS_SUCCESS;
+  }
+
+/* Transfer blocks between RAM and the file. */
+static NTSTATUS STDCALL WvFilediskRamFileIo_(
+    IN WV_SP_FILEDISK_RAM ram,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN SIZE_T first,
+    IN SIZE_T count
+  ) {
+    SIZE_T pos = first * WV_M_FILEDISK_RAM_BLOCK;
+    SIZE_T length = count * WV_M_FILEDISK_RAM_BLOCK;
+
+    /* The last block might be short. */
+    if (length > ram->Size - pos)
+      length = ram->Size - pos;
+    return WvFilediskFileIo(
+        ram->FileObj,
+        mode,
+        ram->FileOffset + pos,
+        (UINT32) length,
+        ram->Data + pos
+      );
+  }
+
+/* Read while loading, from RAM or from the file. */
+static NTSTATUS STDCALL WvFilediskRamRead_(
+    IN WV_SP_FILEDISK_RAM ram,
+    IN SIZE_T offset,
+    IN UINT32 length,
+    OUT PUCHAR buffer
+  ) {
+    SIZE_T block;
+    SIZE_T end;
+    SIZE_T run_end;
+    UCHAR present;
+    NTSTATUS status;
+
+    /* Transfer runs of blocks which are all present or all absent. */
+    while (length) {
+        block = offset / WV_M_FILEDISK_RAM_BLOCK;
+        present = ram->Present[block];
+        end = offset + length;
+        do {
+            run_end = (++block) * WV_M_FILEDISK_RAM_BLOCK;
+          } while (
+            run_end < end &&
+            block < ram->Blocks &&
+            ram->Present[block] == present
+          );
+        if (run_end > end)
+          run_end = end;
+
+        if (present) {
+            RtlCopyMemory(buffer, ram->Data + offset, run_end - offset);
+          } else {
+            status = WvFilediskFileIo(
+                ram->FileObj,
+                WvlDiskIoModeRead,
+                ram->FileOffset + offset,
+                (UINT32) (run_end - offset),
+                buffer
+              );
+            if (!NT_SUCCESS(status)) {
+                DBG("Couldn't read file: %08X\n", status);
+                return status;
+              }
+          }
+        buffer += run_end - offset;
+        length -= (UINT32) (run_end - offset);
+        offset = run_end;
+      }
+    return STATUS_SUCCESS;
+  }
+
+/* Write while loading.  Partly-written blocks are loaded first. */
+static NTSTATUS STDCALL WvFilediskRamWrite_(
+    IN WV_SP_FILEDISK_RAM ram,
+    IN SIZE_T offset,
+    IN UINT32 length,
+    IN PUCHAR buffer
+  ) {
+    SIZE_T block;
+    SIZE_T end;
+    SIZE_T block_start;
+    SIZE_T block_end;
+    NTSTATUS status;
+
+    end = (offset + length - 1) / WV_M_FILEDISK_RAM_BLOCK;
+    for (block = offset / WV_M_FILEDISK_RAM_BLOCK; block <= end; block++) {
+        if (ram->Present[block])
+          continue;
+        block_start = block * WV_M_FILEDISK_RAM_BLOCK;
+        block_end = block_start + WV_M_FILEDISK_RAM_BLOCK;
+        if (block_end > ram->Size)
+          block_end = ram->Size;
+        /* A block which is wholly overwritten needn't be read. */
+        if (offset <= block_start && offset + length >= block_end) {
+            ram->Present[block] = 1;
+            continue;
+          }
+        status = WvFilediskRamLoadRun_(ram, block, 1);
+        if (!NT_SUCCESS(status)) {
+            DBG("Couldn't load block: %08X\n", status);
+            return status;
+          }
+      }
+
+    RtlCopyMemory(ram->Data + offset, buffer, length);
+    if (ram->Dirty) {
+        block = offset / WV_M_FILEDISK_RAM_BLOCK;
+        RtlFillMemory(ram->Dirty + block, end - block + 1, 1);
+      }
+    return STATUS_SUCCESS;
+  }
+
+/* Write the dirty blocks back to the file. */
+static VOID STDCALL WvFilediskRamWriteBack_(IN WV_SP_FILEDISK_RAM ram) {
+    SIZE_T block;
+    SIZE_T count;
+    SIZE_T written = 0;
+    NTSTATUS status;
+
+    for (block = 0; block < ram->Blocks; block += count) {
+        count = 0;
+        while (
+            count < WV_M_FILEDISK_RAM_RUN_BLOCKS &&
+            block + count < ram->Blocks &&
+            ram->Dirty[block + count]
+          )
+          count++;
+        if (!count) {
+            count = 1;
+            continue;
+          }
+        status = WvFilediskRamFileIo_(
+            ram,
+            WvlDiskIoModeWrite,
+            block,
+            count
+          );
+        if (!NT_SUCCESS(status)) {
+            DBG("Couldn't write back blocks at %Iu: %08X\n", block, status);
+            continue;
+          }
+        written += count;
+      }
+    DBG("Wrote back %Iu blocks\n", written);
+    return;
+  }
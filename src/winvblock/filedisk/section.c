@@ -0,0 +1,359 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Filedisk access through mapped views of a section.
+ *
+ * A raw image which is mostly read can be served more cheaply by
+ * copying to and from views of the file than by a file I/O for each
+ * request.  The file is mapped in windows of
+ * WV_M_FILEDISK_SECTION_WINDOW bytes, a few of which are kept mapped
+ * and replaced least-recently-used first.  Writes land in the views
+ * and reach the file when the views are unmapped, which a flush does.
+ *
+ * The views are mapped into the System process, where the shared
+ * worker pool's threads run, and these routines are only called from
+ * the filedisk's queue, which runs one item at a time.
+ */
+
+#include <ntifs.h>
+#include <ntddk.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "wv_stdlib.h"
+#include "irp.h"
+#include "driver.h"
+#include "bus.h"
+#include "device.h"
+#include "disk.h"
+#include "thread.h"
+#include "filedisk.h"
+#include "debug.h"
+
+/** Macros */
+
+/* The size of a view, which is a multiple of the allocation granularity */
+#define WV_M_FILEDISK_SECTION_WINDOW (64 * 1024 * 1024)
+
+/* How many views are kept mapped */
+#define WV_M_FILEDISK_SECTION_VIEWS 4
+
+/** Object types */
+typedef struct WV_FILEDISK_SECTION_VIEW_
+  WV_S_FILEDISK_SECTION_VIEW_, * WV_SP_FILEDISK_SECTION_VIEW_;
+
+/** Struct/union type definitions */
+
+/* A mapped window of the file */
+struct WV_FILEDISK_SECTION_VIEW_ {
+    /* NULL if nothing is mapped */
+    PUCHAR Base;
+    ULONGLONG Offset;
+    SIZE_T Size;
+    ULONG LastUse;
+  };
+
+struct WV_FILEDISK_SECTION {
+    HANDLE Handle;
+    /* For flushing the file */
+    PFILE_OBJECT FileObj;
+    /* The end of the disk in the file; nothing beyond it is mapped */
+    ULONGLONG End;
+    ULONG Clock;
+    WV_S_FILEDISK_SECTION_VIEW_ Views[WV_M_FILEDISK_SECTION_VIEWS];
+  };
+
+/** Private function declarations */
+static NTSTATUS STDCALL WvFilediskSectionView_(
+    IN WV_SP_FILEDISK_SECTION,
+    IN ULONGLONG,
+    OUT WV_SP_FILEDISK_SECTION_VIEW_ *
+  );
+static VOID STDCALL WvFilediskSectionUnmapAll_(IN WV_SP_FILEDISK_SECTION);
+static NTSTATUS STDCALL WvFilediskSectionCopy_(
+    IN WVL_E_DISK_IO_MODE,
+    IN PUCHAR,
+    IN OUT PUCHAR,
+    IN SIZE_T
+  );
+
+/** Exported function definitions */
+
+/**
+ * Access a filedisk's file through mapped views.
+ *
+ * @v filedisk          The filedisk, whose raw file is open and whose
+ *                      size is known.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Nothing is mapped until the disk is accessed.  Must be called from
+ * the filedisk's queue.
+ */
+NTSTATUS STDCALL WvFilediskSectionOpen(IN WV_SP_FILEDISK_T filedisk) {
+    WV_SP_FILEDISK_SECTION section;
+    OBJECT_ATTRIBUTES obj_attrs;
+    NTSTATUS status;
+
+    section = wv_mallocz(sizeof *section);
+    if (!section) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_section;
+      }
+    section->End = filedisk->offset.QuadPart +
+      filedisk->disk->LBADiskSize * filedisk->disk->SectorSize;
+
+    InitializeObjectAttributes(
+        &obj_attrs,
+        NULL,
+        OBJ_KERNEL_HANDLE,
+        NULL,
+        NULL
+      );
+    status = ZwCreateSection(
+        &section->Handle,
+        SECTION_MAP_READ | SECTION_MAP_WRITE | SECTION_QUERY,
+        &obj_attrs,
+        NULL,
+        PAGE_READWRITE,
+        SEC_COMMIT,
+        filedisk->file
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't create section: %08X\n", status);
+        goto err_create;
+      }
+
+    section->FileObj = filedisk->FileObj;
+    ObReferenceObject(section->FileObj);
+    filedisk->Section = section;
+    return STATUS_SUCCESS;
+
+    ZwClose(section->Handle);
+    err_create:
+
+    wv_free(section);
+    err_section:
+
+    return status;
+  }
+
+/**
+ * Unmap a filedisk's views, write back what they dirtied and close
+ * the section.
+ *
+ * @v section           The section to free.  May be NULL.
+ *
+ * Must be called at PASSIVE_LEVEL.
+ */
+VOID STDCALL WvFilediskSectionFree(IN WV_SP_FILEDISK_SECTION section) {
+    KAPC_STATE apc_state;
+    NTSTATUS status;
+
+    if (!section)
+      return;
+    /* We might not be in a pool worker, here. */
+    KeStackAttachProcess(PsInitialSystemProcess, &apc_state);
+    WvFilediskSectionUnmapAll_(section);
+    KeUnstackDetachProcess(&apc_state);
+    status = WvFilediskFileFlush(section->FileObj);
+    if (!NT_SUCCESS(status))
+      DBG("Couldn't flush file: %08X\n", status);
+    ObDereferenceObject(section->FileObj);
+    ZwClose(section->Handle);
+    wv_free(section);
+    return;
+  }
+
+/**
+ * Read from or write to a filedisk through its mapped views.
+ *
+ * @v filedisk          The filedisk with the section.
+ * @v mode              The direction of the I/O.
+ * @v offset            The byte offset into the disk.
+ * @v length            The number of bytes to transfer.
+ * @v buffer            The buffer to transfer to or from.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Must be called from the filedisk's queue.
+ */
+NTSTATUS STDCALL WvFilediskSectionIo(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN ULONGLONG offset,
+    IN UINT32 length,
+    IN OUT PUCHAR buffer
+  ) {
+    WV_SP_FILEDISK_SECTION section = filedisk->Section;
+    WV_SP_FILEDISK_SECTION_VIEW_ view;
+    ULONGLONG pos;
+    SIZE_T within;
+    SIZE_T chunk;
+    NTSTATUS status;
+
+    pos = filedisk->offset.QuadPart + offset;
+    if (pos > section->End || length > section->End - pos) {
+        DBG("I/O beyond the end of the disk!\n");
+        return STATUS_INVALID_PARAMETER;
+      }
+
+    /* A request might straddle windows. */
+    while (length) {
+        status = WvFilediskSectionView_(section, pos, &view);
+        if (!NT_SUCCESS(status))
+          return status;
+        within = (SIZE_T) (pos - view->Offset);
+        chunk = view->Size - within;
+        if (chunk > length)
+          chunk = length;
+        status = WvFilediskSectionCopy_(
+            mode,
+            view->Base + within,
+            buffer,
+            chunk
+          );
+        if (!NT_SUCCESS(status)) {
+            DBG("Couldn't access view: %08X\n", status);
+            return status;
+          }
+        pos += chunk;
+        buffer += chunk;
+        length -= (UINT32) chunk;
+      }
+    return STATUS_SUCCESS;
+  }
+
+/**
+ * Write back what a filedisk's views have dirtied.
+ *
+ * @v filedisk          The filedisk with the section.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Unmapping a view hands its dirty pages to the file's data section,
+ * and flushing the file then writes them.  The views are mapped again
+ * as they're needed.  Must be called from the filedisk's queue.
+ */
+NTSTATUS STDCALL WvFilediskSectionFlush(IN WV_SP_FILEDISK_T filedisk) {
+    WvFilediskSectionUnmapAll_(filedisk->Section);
+    return WvFilediskFileFlush(filedisk->Section->FileObj);
+  }
+
+/** Private function definitions */
+
+/* Find or map the view holding a file offset. */
+static NTSTATUS STDCALL WvFilediskSectionView_(
+    IN WV_SP_FILEDISK_SECTION section,
+    IN ULONGLONG pos,
+    OUT WV_SP_FILEDISK_SECTION_VIEW_ * view_out
+  ) {
+    WV_SP_FILEDISK_SECTION_VIEW_ view;
+    WV_SP_FILEDISK_SECTION_VIEW_ victim;
+    ULONGLONG window;
+    LARGE_INTEGER map_offset;
+    PVOID base;
+    SIZE_T size;
+    NTSTATUS status;
+    int i;
+
+    window = pos - pos % WV_M_FILEDISK_SECTION_WINDOW;
+    victim = section->Views;
+    for (i = 0; i < WV_M_FILEDISK_SECTION_VIEWS; i++) {
+        view = section->Views + i;
+        if (view->Base && view->Offset == window) {
+            view->LastUse = ++section->Clock;
+            *view_out = view;
+            return STATUS_SUCCESS;
+          }
+        /* Prefer an unused view, then the least-recently-used. */
+        if (!victim->Base)
+          continue;
+        if (!view->Base || view->LastUse < victim->LastUse)
+          victim = view;
+      }
+
+    if (victim->Base) {
+        ZwUnmapViewOfSection(NtCurrentProcess(), victim->Base);
+        victim->Base = NULL;
+      }
+    base = NULL;
+    size = WV_M_FILEDISK_SECTION_WINDOW;
+    if (section->End - window < size)
+      size = (SIZE_T) (section->End - window);
+    map_offset.QuadPart = window;
+    status = ZwMapViewOfSection(
+        section->Handle,
+        NtCurrentProcess(),
+        &base,
+        0,
+        0,
+        &map_offset,
+        &size,
+        ViewUnmap,
+        0,
+        PAGE_READWRITE
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't map view: %08X\n", status);
+        return status;
+      }
+    victim->Base = base;
+    victim->Offset = window;
+    /* The size might have been rounded up to a whole page. */
+    if (section->End - window < size)
+      size = (SIZE_T) (section->End - window);
+    victim->Size = size;
+    victim->LastUse = ++section->Clock;
+    *view_out = victim;
+    return STATUS_SUCCESS;
+  }
+
+/* Unmap all of a section's views. */
+static VOID STDCALL WvFilediskSectionUnmapAll_(
+    IN WV_SP_FILEDISK_SECTION section
+  ) {
+    int i;
+
+    for (i = 0; i < WV_M_FILEDISK_SECTION_VIEWS; i++) {
+        if (!section->Views[i].Base)
+          continue;
+        ZwUnmapViewOfSection(NtCurrentProcess(), section->Views[i].Base);
+        section->Views[i].Base = NULL;
+      }
+    return;
+  }
+
+/* Copy to or from a view.  A failed page-in raises an exception. */
+static NTSTATUS STDCALL WvFilediskSectionCopy_(
+    IN WVL_E_DISK_IO_MODE mode,
+    IN PUCHAR view,
+    IN OUT PUCHAR buffer,
+    IN SIZE_T length
+  ) {
+    NTSTATUS status = STATUS_SUCCESS;
+
+    __try {
+        if (mode == WvlDiskIoModeWrite)
+          RtlCopyMemory(view, buffer, length);
+          else
+          RtlCopyMemory(buffer, view, length);
+      } __except (EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+      }
+    return status;
+  }
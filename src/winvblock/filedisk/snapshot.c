@@ -0,0 +1,1008 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Copy-on-write snapshots of filedisks.
+ *
+ * A snapshot pairs a read-only base file with an overlay file, which
+ * receives every write.  The overlay mirrors the disk's layout in
+ * blocks of WV_M_FILEDISK_SNAPSHOT_BLOCK bytes and is sparse where
+ * possible, so it only takes up space for the blocks written.  Which
+ * blocks are in the overlay is tracked by a bitmap, kept in memory and
+ * persisted in a sidecar map file next to the overlay.  Nothing the
+ * size of the disk is read or written at attach time.
+ *
+ * The base is read through the cache, so many snapshots of one base
+ * share its pages.  A base in an image format is read through the
+ * format, instead.
+ *
+ * These routines are only called from the filedisk's queue, which
+ * runs one item at a time, so there is no locking here.
+ */
+
+#include <ntifs.h>
+#include <ntddk.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "wv_stdlib.h"
+#include "wv_string.h"
+#include "irp.h"
+#include "driver.h"
+#include "bus.h"
+#include "device.h"
+#include "disk.h"
+#include "mount.h"
+#include "thread.h"
+#include "filedisk.h"
+#include "debug.h"
+
+/* From filedisk/security.c */
+extern NTSTATUS STDCALL WvFilediskImpersonate(IN PVOID);
+extern VOID WvFilediskStopImpersonating(void);
+
+/** Macros */
+
+/* The overlay's allocation granularity */
+#define WV_M_FILEDISK_SNAPSHOT_BLOCK (64 * 1024)
+
+/* The map file's I/O granularity */
+#define WV_M_FILEDISK_SNAPSHOT_SECTOR 512
+
+#define WV_M_FILEDISK_SNAPSHOT_MAGIC "WVSNAPMP"
+#define WV_M_FILEDISK_SNAPSHOT_VERSION 1
+
+/* Round up to a whole number of map file sectors */
+#define WV_M_FILEDISK_SNAPSHOT_ROUND_UP(x) \
+  (((x) + WV_M_FILEDISK_SNAPSHOT_SECTOR - 1) & \
+    ~(WV_M_FILEDISK_SNAPSHOT_SECTOR - 1))
+
+/** Object types */
+typedef struct WV_FILEDISK_SNAPSHOT_HEADER_
+  WV_S_FILEDISK_SNAPSHOT_HEADER_, * WV_SP_FILEDISK_SNAPSHOT_HEADER_;
+typedef struct WV_FILEDISK_SNAPSHOT_CONTROL_
+  WV_S_FILEDISK_SNAPSHOT_CONTROL_, * WV_SP_FILEDISK_SNAPSHOT_CONTROL_;
+
+/** Struct/union type definitions */
+
+/* The map file's first sector.  The bitmap follows in the next */
+struct WV_FILEDISK_SNAPSHOT_HEADER_ {
+    UCHAR Magic[8];
+    UINT32 Version;
+    UINT32 BlockSize;
+    ULONGLONG DiskSize;
+  };
+
+struct WV_FILEDISK_SNAPSHOT {
+    /* The base file's path, for committing */
+    UNICODE_STRING BasePath;
+    /* For waiting on I/O through handles, which are all asynchronous */
+    HANDLE Event;
+    HANDLE Overlay;
+    PFILE_OBJECT OverlayObj;
+    HANDLE Map;
+    PFILE_OBJECT MapObj;
+    ULONGLONG Size;
+    ULONGLONG Blocks;
+    /* The map file's contents: the header sector, then the bitmap */
+    PUCHAR MapBuf;
+    ULONG MapBytes;
+    PUCHAR Bitmap;
+    /* One block, for merging partial writes */
+    PUCHAR Scratch;
+  };
+
+/* A commit or discard, run in the filedisk's queue */
+struct WV_FILEDISK_SNAPSHOT_CONTROL_ {
+    WVL_S_THREAD_ITEM item[1];
+    WV_SP_FILEDISK_T filedisk;
+    UINT32 action;
+    NTSTATUS status;
+    KEVENT completion[1];
+  };
+
+/** Private function declarations */
+static NTSTATUS STDCALL WvFilediskSnapshotOpenFile_(
+    IN PUNICODE_STRING,
+    OUT PHANDLE,
+    OUT PFILE_OBJECT *
+  );
+static NTSTATUS STDCALL WvFilediskSnapshotSetEof_(IN HANDLE, IN ULONGLONG);
+static NTSTATUS STDCALL WvFilediskSnapshotLoadMap_(
+    IN WV_SP_FILEDISK_SNAPSHOT
+  );
+static NTSTATUS STDCALL WvFilediskSnapshotReset_(IN WV_SP_FILEDISK_SNAPSHOT);
+static NTSTATUS STDCALL WvFilediskSnapshotBaseRead_(
+    IN WV_SP_FILEDISK_T,
+    IN ULONGLONG,
+    IN UINT32,
+    OUT PUCHAR
+  );
+static BOOLEAN STDCALL WvFilediskSnapshotHas_(
+    IN WV_SP_FILEDISK_SNAPSHOT,
+    IN ULONGLONG
+  );
+static NTSTATUS STDCALL WvFilediskSnapshotRead_(
+    IN WV_SP_FILEDISK_T,
+    IN ULONGLONG,
+    IN UINT32,
+    OUT PUCHAR
+  );
+static NTSTATUS STDCALL WvFilediskSnapshotWrite_(
+    IN WV_SP_FILEDISK_T,
+    IN ULONGLONG,
+    IN UINT32,
+    IN PUCHAR
+  );
+static NTSTATUS STDCALL WvFilediskSnapshotCommit_(IN WV_SP_FILEDISK_T);
+static WVL_F_THREAD_ITEM WvFilediskSnapshotControlInThread_;
+
+/** Exported function definitions */
+
+/**
+ * Give a filedisk a snapshot overlay.
+ *
+ * @v filedisk          The filedisk, whose base file is open and whose
+ *                      size is known.
+ * @v base_path         The path the base file was opened with.
+ * @v overlay_path      The path of the overlay file.  The map file's
+ *                      path is the same, with ".map" appended.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * The overlay and map files are created if they don't exist.  If the
+ * map file doesn't describe an overlay for a disk of this size, the
+ * overlay starts out empty.  Must be called at PASSIVE_LEVEL, in the
+ * context which should open the files.
+ */
+NTSTATUS STDCALL WvFilediskSnapshotOpen(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN PUNICODE_STRING base_path,
+    IN PUNICODE_STRING overlay_path
+  ) {
+    WV_SP_FILEDISK_SNAPSHOT snapshot;
+    OBJECT_ATTRIBUTES obj_attrs;
+    IO_STATUS_BLOCK io_status;
+    UNICODE_STRING map_path;
+    NTSTATUS status;
+
+    snapshot = wv_mallocz(sizeof *snapshot);
+    if (!snapshot) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_snapshot;
+      }
+    snapshot->Size =
+      filedisk->disk->LBADiskSize * filedisk->disk->SectorSize;
+    snapshot->Blocks =
+      (snapshot->Size + WV_M_FILEDISK_SNAPSHOT_BLOCK - 1) /
+      WV_M_FILEDISK_SNAPSHOT_BLOCK;
+    if (snapshot->Blocks / 8 > 0x7FFFFFFF - WV_M_FILEDISK_SNAPSHOT_SECTOR * 2) {
+        DBG("Disk is too large for a snapshot!\n");
+        status = STATUS_INVALID_PARAMETER;
+        goto err_size;
+      }
+
+    /* Keep the base file's path. */
+    snapshot->BasePath.MaximumLength = base_path->Length + sizeof (WCHAR);
+    snapshot->BasePath.Buffer = wv_palloc(snapshot->BasePath.MaximumLength);
+    if (!snapshot->BasePath.Buffer) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_base_path;
+      }
+    RtlCopyUnicodeString(&snapshot->BasePath, base_path);
+
+    /* Allocate the map and scratch space. */
+    snapshot->MapBytes = (ULONG) WV_M_FILEDISK_SNAPSHOT_ROUND_UP(
+        WV_M_FILEDISK_SNAPSHOT_SECTOR + (snapshot->Blocks + 7) / 8
+      );
+    snapshot->MapBuf = wv_pallocz(snapshot->MapBytes);
+    if (!snapshot->MapBuf) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_map_buf;
+      }
+    snapshot->Bitmap = snapshot->MapBuf + WV_M_FILEDISK_SNAPSHOT_SECTOR;
+    snapshot->Scratch = wv_palloc(WV_M_FILEDISK_SNAPSHOT_BLOCK);
+    if (!snapshot->Scratch) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_scratch;
+      }
+
+    InitializeObjectAttributes(
+        &obj_attrs,
+        NULL,
+        OBJ_KERNEL_HANDLE,
+        NULL,
+        NULL
+      );
+    status = ZwCreateEvent(
+        &snapshot->Event,
+        EVENT_ALL_ACCESS,
+        &obj_attrs,
+        NotificationEvent,
+        FALSE
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't create event!\n");
+        goto err_event;
+      }
+
+    /* Open the overlay. */
+    status = WvFilediskSnapshotOpenFile_(
+        overlay_path,
+        &snapshot->Overlay,
+        &snapshot->OverlayObj
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't open overlay %wZ!\n", overlay_path);
+        goto err_overlay;
+      }
+    /* Only blocks which are written should take up space. */
+    status = ZwFsControlFile(
+        snapshot->Overlay,
+        snapshot->Event,
+        NULL,
+        NULL,
+        &io_status,
+        FSCTL_SET_SPARSE,
+        NULL,
+        0,
+        NULL,
+        0
+      );
+    if (status == STATUS_PENDING) {
+        ZwWaitForSingleObject(snapshot->Event, FALSE, NULL);
+        status = io_status.Status;
+      }
+    if (!NT_SUCCESS(status))
+      DBG("Non-critical: Overlay can't be sparse: %08X\n", status);
+
+    /* Open the map. */
+    map_path.Length = 0;
+    map_path.MaximumLength = overlay_path->Length + sizeof L".map";
+    map_path.Buffer = wv_palloc(map_path.MaximumLength);
+    if (!map_path.Buffer) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_map_path;
+      }
+    RtlCopyUnicodeString(&map_path, overlay_path);
+    RtlAppendUnicodeToString(&map_path, L".map");
+    status = WvFilediskSnapshotOpenFile_(
+        &map_path,
+        &snapshot->Map,
+        &snapshot->MapObj
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't open map %wZ!\n", &map_path);
+        goto err_map;
+      }
+
+    status = WvFilediskSnapshotLoadMap_(snapshot);
+    if (!NT_SUCCESS(status))
+      goto err_load_map;
+
+    wv_free(map_path.Buffer);
+    filedisk->Snapshot = snapshot;
+    return STATUS_SUCCESS;
+
+    err_load_map:
+
+    ObDereferenceObject(snapshot->MapObj);
+    ZwClose(snapshot->Map);
+    err_map:
+
+    wv_free(map_path.Buffer);
+    err_map_path:
+
+    ObDereferenceObject(snapshot->OverlayObj);
+    ZwClose(snapshot->Overlay);
+    err_overlay:
+
+    ZwClose(snapshot->Event);
+    err_event:
+
+    wv_free(snapshot->Scratch);
+    err_scratch:
+
+    wv_free(snapshot->MapBuf);
+    err_map_buf:
+
+    wv_free(snapshot->BasePath.Buffer);
+    err_base_path:
+
+    err_size:
+
+    wv_free(snapshot);
+    err_snapshot:
+
+    return status;
+  }
+
+/**
+ * Free a snapshot.  Its overlay and map files are kept.
+ *
+ * @v snapshot          The snapshot to free.  May be NULL.
+ */
+VOID STDCALL WvFilediskSnapshotFree(IN WV_SP_FILEDISK_SNAPSHOT snapshot) {
+    if (!snapshot)
+      return;
+    ObDereferenceObject(snapshot->MapObj);
+    ZwClose(snapshot->Map);
+    ObDereferenceObject(snapshot->OverlayObj);
+    ZwClose(snapshot->Overlay);
+    ZwClose(snapshot->Event);
+    wv_free(snapshot->Scratch);
+    wv_free(snapshot->MapBuf);
+    wv_free(snapshot->BasePath.Buffer);
+    wv_free(snapshot);
+    return;
+  }
+
+/**
+ * Read from or write to a snapshot.
+ *
+ * @v filedisk          The filedisk with the snapshot.
+ * @v mode              The direction of the I/O.
+ * @v offset            The byte offset into the disk.
+ * @v length            The number of bytes to transfer.
+ * @v buffer            The buffer to transfer to or from.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Must be called at PASSIVE_LEVEL.
+ */
+NTSTATUS STDCALL WvFilediskSnapshotIo(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN ULONGLONG offset,
+    IN UINT32 length,
+    IN OUT PUCHAR buffer
+  ) {
+    WV_SP_FILEDISK_SNAPSHOT snapshot = filedisk->Snapshot;
+
+    if (offset > snapshot->Size || length > snapshot->Size - offset) {
+        DBG("I/O beyond the end of the disk!\n");
+        return STATUS_INVALID_PARAMETER;
+      }
+    if (mode == WvlDiskIoModeWrite)
+      return WvFilediskSnapshotWrite_(filedisk, offset, length, buffer);
+    return WvFilediskSnapshotRead_(filedisk, offset, length, buffer);
+  }
+
+/**
+ * Commit or discard a snapshot's overlay.
+ *
+ * @v filedisk          The filedisk with the snapshot.
+ * @v action            A WV_MOUNT_SNAPSHOT_ACTION.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Committing writes the overlay's blocks to the base file, then
+ * discards them.  Either way, the overlay is empty afterwards.  The
+ * work is done in the filedisk's queue, so it is ordered with respect
+ * to the disk's I/O.  Must be called at PASSIVE_LEVEL.
+ */
+NTSTATUS STDCALL WvFilediskSnapshotControl(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN UINT32 action
+  ) {
+    WV_S_FILEDISK_SNAPSHOT_CONTROL_ control;
+
+    if (!filedisk->Snapshot)
+      return STATUS_INVALID_DEVICE_REQUEST;
+    if (action >= WvMountSnapshotActions)
+      return STATUS_INVALID_PARAMETER;
+
+    control.item->Func = WvFilediskSnapshotControlInThread_;
+    control.filedisk = filedisk;
+    control.action = action;
+    KeInitializeEvent(control.completion, SynchronizationEvent, FALSE);
+    if (!WvlThreadQueueAddItem(filedisk->Queue, control.item)) {
+        DBG("Couldn't queue the snapshot control!\n");
+        return STATUS_UNSUCCESSFUL;
+      }
+    KeWaitForSingleObject(
+        control.completion,
+        Executive,
+        KernelMode,
+        FALSE,
+        NULL
+      );
+    return control.status;
+  }
+
+/**
+ * Drop a snapshot's overlay blocks within a range.
+ *
+ * @v filedisk          The filedisk with the snapshot.
+ * @v offset            The byte offset into the disk.
+ * @v length            The number of bytes no longer needed.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Dropped blocks read from the base again and give their space in the
+ * overlay back.  Blocks only partly within the range are kept.  Must
+ * be called from the filedisk's queue.
+ */
+NTSTATUS STDCALL WvFilediskSnapshotUnmap(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN ULONGLONG offset,
+    IN ULONGLONG length
+  ) {
+    WV_SP_FILEDISK_SNAPSHOT snapshot = filedisk->Snapshot;
+    ULONGLONG block;
+    ULONGLONG end;
+    ULONGLONG first = 0;
+    ULONGLONG last = 0;
+    ULONG map_start;
+    ULONG map_end;
+    NTSTATUS status;
+
+    if (offset >= snapshot->Size)
+      return STATUS_SUCCESS;
+    if (length > snapshot->Size - offset)
+      length = snapshot->Size - offset;
+
+    block =
+      (offset + WV_M_FILEDISK_SNAPSHOT_BLOCK - 1) /
+      WV_M_FILEDISK_SNAPSHOT_BLOCK;
+    /* The last block might be short, but it's still whole. */
+    if (offset + length == snapshot->Size)
+      end = snapshot->Blocks;
+      else
+      end = (offset + length) / WV_M_FILEDISK_SNAPSHOT_BLOCK;
+    for (; block < end; block++) {
+        if (!WvFilediskSnapshotHas_(snapshot, block))
+          continue;
+        snapshot->Bitmap[block / 8] &= ~(1 << (block % 8));
+        if (!last)
+          first = block;
+        last = block + 1;
+      }
+    if (!last)
+      return STATUS_SUCCESS;
+
+    /* The map goes first, so it never claims a block we're dropping. */
+    map_start = (ULONG) (snapshot->Bitmap - snapshot->MapBuf + first / 8);
+    map_end = (ULONG) (snapshot->Bitmap - snapshot->MapBuf + (last - 1) / 8);
+    map_start &= ~(WV_M_FILEDISK_SNAPSHOT_SECTOR - 1);
+    map_end = WV_M_FILEDISK_SNAPSHOT_ROUND_UP(map_end + 1);
+    status = WvFilediskFileIo(
+        snapshot->MapObj,
+        WvlDiskIoModeWrite,
+        map_start,
+        map_end - map_start,
+        snapshot->MapBuf + map_start
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't write map!\n");
+        return status;
+      }
+
+    /* The blocks in between that weren't in the overlay are holes. */
+    last *= WV_M_FILEDISK_SNAPSHOT_BLOCK;
+    if (last > snapshot->Size)
+      last = snapshot->Size;
+    status = WvFilediskFileZero(
+        snapshot->OverlayObj,
+        first * WV_M_FILEDISK_SNAPSHOT_BLOCK,
+        last - first * WV_M_FILEDISK_SNAPSHOT_BLOCK
+      );
+    if (!NT_SUCCESS(status))
+      DBG("Non-critical: Couldn't punch overlay: %08X\n", status);
+    return STATUS_SUCCESS;
+  }
+
+/** Private function definitions */
+
+/* Open or create an overlay or map file. */
+static NTSTATUS STDCALL WvFilediskSnapshotOpenFile_(
+    IN PUNICODE_STRING path,
+    OUT PHANDLE file,
+    OUT PFILE_OBJECT * file_obj
+  ) {
+    OBJECT_ATTRIBUTES obj_attrs;
+    IO_STATUS_BLOCK io_status;
+    NTSTATUS status;
+
+    InitializeObjectAttributes(
+        &obj_attrs,
+        path,
+        OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+        NULL,
+        NULL
+      );
+    status = ZwCreateFile(
+        file,
+        GENERIC_READ | GENERIC_WRITE,
+        &obj_attrs,
+        &io_status,
+        NULL,
+        FILE_ATTRIBUTE_NORMAL,
+        FILE_SHARE_READ,
+        FILE_OPEN_IF,
+        FILE_NON_DIRECTORY_FILE |
+          FILE_RANDOM_ACCESS |
+          FILE_NO_INTERMEDIATE_BUFFERING,
+        NULL,
+        0
+      );
+    if (!NT_SUCCESS(status))
+      return status;
+
+    status = ObReferenceObjectByHandle(
+        *file,
+        0,
+        *IoFileObjectType,
+        KernelMode,
+        file_obj,
+        NULL
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't reference file object!\n");
+        ZwClose(*file);
+      }
+    return status;
+  }
+
+/*
+ * Set the size of a file.  The handle is for asynchronous I/O, but
+ * this is always satisfied at once.
+ */
+static NTSTATUS STDCALL WvFilediskSnapshotSetEof_(
+    IN HANDLE file,
+    IN ULONGLONG size
+  ) {
+    IO_STATUS_BLOCK io_status;
+    FILE_END_OF_FILE_INFORMATION eof;
+
+    eof.EndOfFile.QuadPart = size;
+    return ZwSetInformationFile(
+        file,
+        &io_status,
+        &eof,
+        sizeof eof,
+        FileEndOfFileInformation
+      );
+  }
+
+/* Load the map, or start afresh if it doesn't match the disk. */
+static NTSTATUS STDCALL WvFilediskSnapshotLoadMap_(
+    IN WV_SP_FILEDISK_SNAPSHOT snapshot
+  ) {
+    WV_SP_FILEDISK_SNAPSHOT_HEADER_ header;
+    IO_STATUS_BLOCK io_status;
+    FILE_STANDARD_INFORMATION file_info;
+    NTSTATUS status;
+
+    header = (WV_SP_FILEDISK_SNAPSHOT_HEADER_) snapshot->MapBuf;
+    status = ZwQueryInformationFile(
+        snapshot->Map,
+        &io_status,
+        &file_info,
+        sizeof file_info,
+        FileStandardInformation
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't query map size!\n");
+        return status;
+      }
+    if (file_info.EndOfFile.QuadPart < snapshot->MapBytes)
+      return WvFilediskSnapshotReset_(snapshot);
+
+    status = WvFilediskFileIo(
+        snapshot->MapObj,
+        WvlDiskIoModeRead,
+        0,
+        snapshot->MapBytes,
+        snapshot->MapBuf
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't read map!\n");
+        return status;
+      }
+    if (
+        !wv_memcmpeq(
+            header->Magic,
+            WV_M_FILEDISK_SNAPSHOT_MAGIC,
+            sizeof header->Magic
+          ) ||
+        header->Version != WV_M_FILEDISK_SNAPSHOT_VERSION ||
+        header->BlockSize != WV_M_FILEDISK_SNAPSHOT_BLOCK ||
+        header->DiskSize != snapshot->Size
+      ) {
+        DBG("Map doesn't match the disk; starting afresh\n");
+        return WvFilediskSnapshotReset_(snapshot);
+      }
+    DBG("Resuming snapshot overlay\n");
+    return STATUS_SUCCESS;
+  }
+
+/* Empty the overlay. */
+static NTSTATUS STDCALL WvFilediskSnapshotReset_(
+    IN WV_SP_FILEDISK_SNAPSHOT snapshot
+  ) {
+    WV_SP_FILEDISK_SNAPSHOT_HEADER_ header;
+    NTSTATUS status;
+
+    header = (WV_SP_FILEDISK_SNAPSHOT_HEADER_) snapshot->MapBuf;
+    RtlZeroMemory(snapshot->MapBuf, snapshot->MapBytes);
+    RtlCopyMemory(
+        header->Magic,
+        WV_M_FILEDISK_SNAPSHOT_MAGIC,
+        sizeof header->Magic
+      );
+    header->Version = WV_M_FILEDISK_SNAPSHOT_VERSION;
+    header->BlockSize = WV_M_FILEDISK_SNAPSHOT_BLOCK;
+    header->DiskSize = snapshot->Size;
+
+    /* The map goes first, so it never claims a block we're dropping. */
+    status = WvFilediskFileIo(
+        snapshot->MapObj,
+        WvlDiskIoModeWrite,
+        0,
+        snapshot->MapBytes,
+        snapshot->MapBuf
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't write map!\n");
+        return status;
+      }
+
+    /* Release the overlay's space, then give it the disk's size. */
+    status = WvFilediskSnapshotSetEof_(snapshot->Overlay, 0);
+    if (NT_SUCCESS(status))
+      status = WvFilediskSnapshotSetEof_(snapshot->Overlay, snapshot->Size);
+    if (!NT_SUCCESS(status))
+      DBG("Couldn't size overlay!\n");
+    return status;
+  }
+
+/* Read from the base. */
+static NTSTATUS STDCALL WvFilediskSnapshotBaseRead_(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN ULONGLONG offset,
+    IN UINT32 length,
+    OUT PUCHAR buffer
+  ) {
+    WV_SP_FILEDISK_SNAPSHOT snapshot = filedisk->Snapshot;
+    IO_STATUS_BLOCK io_status;
+    LARGE_INTEGER file_offset;
+    NTSTATUS status;
+
+    if (filedisk->Format) {
+        return filedisk->Format->Io(
+            filedisk->FormatState,
+            WvlDiskIoModeRead,
+            offset,
+            length,
+            buffer
+          );
+      }
+
+    /* Through the cache, which other snapshots of the base share. */
+    file_offset.QuadPart = offset + filedisk->offset.QuadPart;
+    status = ZwReadFile(
+        filedisk->file,
+        snapshot->Event,
+        NULL,
+        NULL,
+        &io_status,
+        buffer,
+        length,
+        &file_offset,
+        NULL
+      );
+    if (status == STATUS_PENDING) {
+        ZwWaitForSingleObject(snapshot->Event, FALSE, NULL);
+        status = io_status.Status;
+      }
+    if (NT_SUCCESS(status) && io_status.Information != length)
+      status = STATUS_END_OF_FILE;
+    return status;
+  }
+
+/* Check if a block is in the overlay. */
+static BOOLEAN STDCALL WvFilediskSnapshotHas_(
+    IN WV_SP_FILEDISK_SNAPSHOT snapshot,
+    IN ULONGLONG block
+  ) {
+    return (snapshot->Bitmap[block / 8] >> (block % 8)) & 1;
+  }
+
+static NTSTATUS STDCALL WvFilediskSnapshotRead_(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN ULONGLONG offset,
+    IN UINT32 length,
+    OUT PUCHAR buffer
+  ) {
+    WV_SP_FILEDISK_SNAPSHOT snapshot = filedisk->Snapshot;
+    BOOLEAN in_overlay;
+    UINT32 run;
+    UINT32 chunk;
+    NTSTATUS status;
+
+    while (length) {
+        /* Gather a run of blocks which are all in one place. */
+        in_overlay = WvFilediskSnapshotHas_(
+            snapshot,
+            offset / WV_M_FILEDISK_SNAPSHOT_BLOCK
+          );
+        run = 0;
+        do {
+            chunk =
+              WV_M_FILEDISK_SNAPSHOT_BLOCK -
+              (UINT32) ((offset + run) % WV_M_FILEDISK_SNAPSHOT_BLOCK);
+            if (chunk > length - run)
+              chunk = length - run;
+            run += chunk;
+          } while (
+            run < length &&
+            WvFilediskSnapshotHas_(
+                snapshot,
+                (offset + run) / WV_M_FILEDISK_SNAPSHOT_BLOCK
+              ) == in_overlay
+          );
+
+        if (in_overlay) {
+            status = WvFilediskFileIo(
+                snapshot->OverlayObj,
+                WvlDiskIoModeRead,
+                offset,
+                run,
+                buffer
+              );
+          } else {
+            status = WvFilediskSnapshotBaseRead_(
+                filedisk,
+                offset,
+                run,
+                buffer
+              );
+          }
+        if (!NT_SUCCESS(status))
+          return status;
+
+        offset += run;
+        buffer += run;
+        length -= run;
+      }
+    return STATUS_SUCCESS;
+  }
+
+static NTSTATUS STDCALL WvFilediskSnapshotWrite_(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN ULONGLONG offset,
+    IN UINT32 length,
+    IN PUCHAR buffer
+  ) {
+    WV_SP_FILEDISK_SNAPSHOT snapshot = filedisk->Snapshot;
+    ULONGLONG block;
+    ULONGLONG block_offset;
+    UINT32 in_block;
+    UINT32 chunk;
+    UINT32 block_len;
+    /* The range of the map which needs writing, or 0 and 0 */
+    ULONG map_start = 0;
+    ULONG map_end = 0;
+    ULONG map_byte;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    while (length) {
+        block = offset / WV_M_FILEDISK_SNAPSHOT_BLOCK;
+        block_offset = block * WV_M_FILEDISK_SNAPSHOT_BLOCK;
+        in_block = (UINT32) (offset - block_offset);
+        chunk = WV_M_FILEDISK_SNAPSHOT_BLOCK - in_block;
+        if (chunk > length)
+          chunk = length;
+
+        if (WvFilediskSnapshotHas_(snapshot, block)) {
+            status = WvFilediskFileIo(
+                snapshot->OverlayObj,
+                WvlDiskIoModeWrite,
+                offset,
+                chunk,
+                buffer
+              );
+            if (!NT_SUCCESS(status))
+              break;
+            goto next;
+          }
+
+        /* Copy the block up from the base, unless it's all overwritten. */
+        block_len = WV_M_FILEDISK_SNAPSHOT_BLOCK;
+        if (block_len > snapshot->Size - block_offset)
+          block_len = (UINT32) (snapshot->Size - block_offset);
+        if (chunk == block_len) {
+            status = WvFilediskFileIo(
+                snapshot->OverlayObj,
+                WvlDiskIoModeWrite,
+                offset,
+                chunk,
+                buffer
+              );
+          } else {
+            status = WvFilediskSnapshotBaseRead_(
+                filedisk,
+                block_offset,
+                block_len,
+                snapshot->Scratch
+              );
+            if (!NT_SUCCESS(status))
+              break;
+            RtlCopyMemory(snapshot->Scratch + in_block, buffer, chunk);
+            status = WvFilediskFileIo(
+                snapshot->OverlayObj,
+                WvlDiskIoModeWrite,
+                block_offset,
+                block_len,
+                snapshot->Scratch
+              );
+          }
+        if (!NT_SUCCESS(status))
+          break;
+
+        /* The block is in the overlay, now. */
+        snapshot->Bitmap[block / 8] |= 1 << (block % 8);
+        map_byte = (ULONG) (snapshot->Bitmap - snapshot->MapBuf + block / 8);
+        if (!map_end)
+          map_start = map_byte;
+        map_end = map_byte + 1;
+
+        next:
+        offset += chunk;
+        buffer += chunk;
+        length -= chunk;
+      }
+
+    /* Persist the map for the blocks we copied up, even upon error. */
+    if (map_end) {
+        NTSTATUS map_status;
+
+        map_start &= ~(WV_M_FILEDISK_SNAPSHOT_SECTOR - 1);
+        map_end = WV_M_FILEDISK_SNAPSHOT_ROUND_UP(map_end);
+        map_status = WvFilediskFileIo(
+            snapshot->MapObj,
+            WvlDiskIoModeWrite,
+            map_start,
+            map_end - map_start,
+            snapshot->MapBuf + map_start
+          );
+        if (!NT_SUCCESS(map_status)) {
+            DBG("Couldn't write map!\n");
+            if (NT_SUCCESS(status))
+              status = map_status;
+          }
+      }
+    return status;
+  }
+
+/* Write the overlay's blocks to the base file. */
+static NTSTATUS STDCALL WvFilediskSnapshotCommit_(
+    IN WV_SP_FILEDISK_T filedisk
+  ) {
+    WV_SP_FILEDISK_SNAPSHOT snapshot = filedisk->Snapshot;
+    OBJECT_ATTRIBUTES obj_attrs;
+    IO_STATUS_BLOCK io_status;
+    HANDLE base;
+    ULONGLONG block;
+    LARGE_INTEGER offset;
+    UINT32 block_len;
+    NTSTATUS status;
+
+    /* Only a raw base can be written to. */
+    if (filedisk->Format) {
+        DBG("Can't commit to a %s image!\n", filedisk->Format->Name);
+        return STATUS_NOT_SUPPORTED;
+      }
+
+    status = WvFilediskImpersonate(filedisk->impersonation);
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't impersonate!\n");
+        goto err_impersonate;
+      }
+    InitializeObjectAttributes(
+        &obj_attrs,
+        &snapshot->BasePath,
+        OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+        NULL,
+        NULL
+      );
+    status = ZwCreateFile(
+        &base,
+        GENERIC_WRITE,
+        &obj_attrs,
+        &io_status,
+        NULL,
+        FILE_ATTRIBUTE_NORMAL,
+        FILE_SHARE_READ | FILE_SHARE_DELETE | FILE_SHARE_WRITE,
+        FILE_OPEN,
+        FILE_NON_DIRECTORY_FILE |
+          FILE_SYNCHRONOUS_IO_NONALERT |
+          FILE_WRITE_THROUGH,
+        NULL,
+        0
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't open %wZ for writing!\n", &snapshot->BasePath);
+        goto err_open;
+      }
+
+    /*
+     * Writes go through the cache, which readers of the base share,
+     * and are written through to the file before they complete.
+     */
+    for (block = 0; block < snapshot->Blocks; block++) {
+        if (!WvFilediskSnapshotHas_(snapshot, block))
+          continue;
+        offset.QuadPart = block * WV_M_FILEDISK_SNAPSHOT_BLOCK;
+        block_len = WV_M_FILEDISK_SNAPSHOT_BLOCK;
+        if (block_len > snapshot->Size - offset.QuadPart)
+          block_len = (UINT32) (snapshot->Size - offset.QuadPart);
+        status = WvFilediskFileIo(
+            snapshot->OverlayObj,
+            WvlDiskIoModeRead,
+            offset.QuadPart,
+            block_len,
+            snapshot->Scratch
+          );
+        if (!NT_SUCCESS(status))
+          goto err_copy;
+        offset.QuadPart += filedisk->offset.QuadPart;
+        status = ZwWriteFile(
+            base,
+            NULL,
+            NULL,
+            NULL,
+            &io_status,
+            snapshot->Scratch,
+            block_len,
+            &offset,
+            NULL
+          );
+        if (!NT_SUCCESS(status))
+          goto err_copy;
+      }
+
+    err_copy:
+
+    ZwClose(base);
+    err_open:
+
+    WvFilediskStopImpersonating();
+    err_impersonate:
+
+    if (!NT_SUCCESS(status))
+      DBG("Commit failed: %08X\n", status);
+    return status;
+  }
+
+/* Commit or discard a snapshot's overlay, in the filedisk's queue. */
+static VOID STDCALL WvFilediskSnapshotControlInThread_(
+    IN OUT WVL_SP_THREAD_ITEM item
+  ) {
+    WV_SP_FILEDISK_SNAPSHOT_CONTROL_ control = CONTAINING_RECORD(
+        item,
+        WV_S_FILEDISK_SNAPSHOT_CONTROL_,
+        item[0]
+      );
+
+    control->status = STATUS_SUCCESS;
+    if (control->action == WvMountSnapshotCommit)
+      control->status = WvFilediskSnapshotCommit_(control->filedisk);
+    if (NT_SUCCESS(control->status))
+      control->status = WvFilediskSnapshotReset_(control->filedisk->Snapshot);
+    KeSetEvent(control->completion, 0, FALSE);
+    return;
+  }
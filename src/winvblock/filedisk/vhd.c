@@ -0,0 +1,958 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Dynamic and differencing .VHD support for filedisks.
+ *
+ * The BAT of each image in a chain is read once, at attach time, and
+ * kept in memory.  I/O is translated to file offsets block by block.
+ * Blocks which haven't been allocated read as zeroes (or from the
+ * parent, for a differencing image) without touching the file, and
+ * are allocated at the end of the file upon first write.  The sector
+ * bitmaps of a differencing image are cached as they are needed.
+ *
+ * These routines are only called from the filedisk's queue, which
+ * runs one item at a time, so there is no locking here.
+ */
+
+#include <ntifs.h>
+#include <ntddk.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "wv_stdlib.h"
+#include "wv_string.h"
+#include "irp.h"
+#include "driver.h"
+#include "bus.h"
+#include "device.h"
+#include "disk.h"
+#include "thread.h"
+#include "filedisk.h"
+#include "byte.h"
+#include "msvhd.h"
+#include "debug.h"
+
+/** Macros */
+
+/* .VHD sectors are always this size */
+#define WV_M_FILEDISK_VHD_SECTOR 512
+
+/* How many BAT entries fit in a sector */
+#define WV_M_FILEDISK_VHD_BAT_PER_SECTOR \
+  (WV_M_FILEDISK_VHD_SECTOR / sizeof (UINT32))
+
+/* How deep a chain of differencing images may be */
+#define WV_M_FILEDISK_VHD_MAX_DEPTH 16
+
+/* The largest block size we accept */
+#define WV_M_FILEDISK_VHD_MAX_BLOCK (256 * 1024 * 1024)
+
+/* The size of the zeroed buffer used when allocating a block */
+#define WV_M_FILEDISK_VHD_ZERO_SIZE (64 * 1024)
+
+/* The longest parent locator we'll read */
+#define WV_M_FILEDISK_VHD_MAX_LOCATOR 4096
+
+/* Round up to a whole number of .VHD sectors */
+#define WV_M_FILEDISK_VHD_ROUND_UP(x) \
+  (((x) + WV_M_FILEDISK_VHD_SECTOR - 1) & ~(WV_M_FILEDISK_VHD_SECTOR - 1))
+
+/** Object types */
+typedef struct WV_FILEDISK_VHD WV_S_FILEDISK_VHD, * WV_SP_FILEDISK_VHD;
+
+/** Struct/union type definitions */
+
+/* One image in a chain */
+struct WV_FILEDISK_VHD {
+    /* The image's file.  File is NULL for the filedisk's own file */
+    HANDLE File;
+    PFILE_OBJECT FileObj;
+    UINT32 Type;
+    ULONGLONG Size;
+    UINT32 BlockSize;
+    UINT32 BitmapSize;
+    UINT32 BatEntries;
+    /* In host byte order, padded to a whole sector with unused entries */
+    PUINT32 Bat;
+    LONGLONG BatOffset;
+    /* Where the trailing footer is, which is where the next block goes */
+    LONGLONG End;
+    /* The footer, as found in the file */
+    UCHAR Footer[WV_M_FILEDISK_VHD_SECTOR];
+    /* Differencing only: each block's cached sector bitmap, or NULL */
+    PUCHAR * Bitmaps;
+    WV_SP_FILEDISK_VHD Parent;
+  };
+
+/** Private function declarations */
+static WV_F_FILEDISK_FORMAT_OPEN WvFilediskVhdOpen_;
+static WV_F_FILEDISK_FORMAT_IO WvFilediskVhdIo_;
+static WV_F_FILEDISK_FORMAT_FREE WvFilediskVhdFree_;
+static NTSTATUS STDCALL WvFilediskVhdOpenImage_(
+    IN HANDLE,
+    IN PUNICODE_STRING,
+    IN ULONG,
+    OUT WV_SP_FILEDISK_VHD *
+  );
+static NTSTATUS STDCALL WvFilediskVhdOpenParent_(
+    IN WV_SP_FILEDISK_VHD,
+    IN WV_SP_MSVHD_DYN_HEADER,
+    IN PUNICODE_STRING,
+    IN ULONG
+  );
+static NTSTATUS STDCALL WvFilediskVhdGetBitmap_(
+    IN WV_SP_FILEDISK_VHD,
+    IN UINT32,
+    OUT PUCHAR *
+  );
+static NTSTATUS STDCALL WvFilediskVhdRead_(
+    IN WV_SP_FILEDISK_VHD,
+    IN ULONGLONG,
+    IN UINT32,
+    OUT PUCHAR
+  );
+static NTSTATUS STDCALL WvFilediskVhdWrite_(
+    IN WV_SP_FILEDISK_VHD,
+    IN ULONGLONG,
+    IN UINT32,
+    IN PUCHAR
+  );
+static NTSTATUS STDCALL WvFilediskVhdAllocate_(
+    IN WV_SP_FILEDISK_VHD,
+    IN UINT32
+  );
+
+/** Objects */
+
+/* Dynamic and differencing .VHDs */
+const WV_S_FILEDISK_FORMAT WvFilediskVhdFormat = {
+    "VHD",
+    WvFilediskVhdOpen_,
+    WvFilediskVhdIo_,
+    WvFilediskVhdFree_,
+  };
+
+/** Private function definitions */
+
+/**
+ * Check a filedisk's file for a dynamic or differencing .VHD.
+ *
+ * Relative parent locators are resolved against the path.  Fixed
+ * .VHDs aren't claimed; they are used as raw images, as before.  The
+ * file's handle remains the filedisk's.  Must be called at
+ * PASSIVE_LEVEL, in the context which should open any parents.
+ */
+static NTSTATUS STDCALL WvFilediskVhdOpen_(
+    IN HANDLE file,
+    IN PUNICODE_STRING path,
+    OUT PVOID * state,
+    OUT PULONGLONG size
+  ) {
+    WV_SP_FILEDISK_VHD vhd;
+    NTSTATUS status;
+
+    *state = NULL;
+    status = WvFilediskVhdOpenImage_(file, path, 0, &vhd);
+    if (!NT_SUCCESS(status))
+      return status;
+    if (vhd)
+      *size = vhd->Size;
+    *state = vhd;
+    return STATUS_SUCCESS;
+  }
+
+/* Free an image chain.  May be NULL. */
+static VOID STDCALL WvFilediskVhdFree_(IN PVOID state) {
+    WV_SP_FILEDISK_VHD vhd = state;
+    WV_SP_FILEDISK_VHD parent;
+    UINT32 i;
+
+    while (vhd) {
+        parent = vhd->Parent;
+        if (vhd->Bitmaps) {
+            for (i = 0; i < vhd->BatEntries; i++)
+              wv_free(vhd->Bitmaps[i]);
+            wv_free(vhd->Bitmaps);
+          }
+        wv_free(vhd->Bat);
+        if (vhd->FileObj)
+          ObDereferenceObject(vhd->FileObj);
+        if (vhd->File)
+          ZwClose(vhd->File);
+        wv_free(vhd);
+        vhd = parent;
+      }
+    return;
+  }
+
+/* Read from or write to a .VHD image chain.  PASSIVE_LEVEL only. */
+static NTSTATUS STDCALL WvFilediskVhdIo_(
+    IN PVOID state,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN ULONGLONG offset,
+    IN UINT32 length,
+    IN OUT PUCHAR buffer
+  ) {
+    WV_SP_FILEDISK_VHD vhd = state;
+
+    if (offset > vhd->Size || length > vhd->Size - offset) {
+        DBG("I/O beyond the end of the disk!\n");
+        return STATUS_INVALID_PARAMETER;
+      }
+    if (mode == WvlDiskIoModeWrite)
+      return WvFilediskVhdWrite_(vhd, offset, length, buffer);
+    return WvFilediskVhdRead_(vhd, offset, length, buffer);
+  }
+
+/**
+ * Open one image of a chain.
+ *
+ * @v file              The image's file.  Upon success, a parent's
+ *                      handle (depth > 0) belongs to the image.
+ * @v path              The path the file was opened with.
+ * @v depth             0 for the filedisk's own file, 1 for its parent...
+ * @v vhd               Populated with the image, or with NULL if the
+ *                      filedisk's own file isn't a sparse .VHD.
+ * @ret NTSTATUS        The status of the operation.
+ */
+static NTSTATUS STDCALL WvFilediskVhdOpenImage_(
+    IN HANDLE file,
+    IN PUNICODE_STRING path,
+    IN ULONG depth,
+    OUT WV_SP_FILEDISK_VHD * vhd_out
+  ) {
+    WV_SP_FILEDISK_VHD vhd;
+    IO_STATUS_BLOCK io_status;
+    FILE_STANDARD_INFORMATION file_info;
+    WV_S_MSVHD_FOOTER footer;
+    WV_SP_MSVHD_DYN_HEADER header;
+    ULONGLONG blocks;
+    UINT32 bat_size;
+    UINT32 i;
+    NTSTATUS status;
+
+    *vhd_out = NULL;
+    vhd = wv_mallocz(sizeof *vhd);
+    if (!vhd) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_vhd;
+      }
+
+    status = ObReferenceObjectByHandle(
+        file,
+        0,
+        *IoFileObjectType,
+        KernelMode,
+        &vhd->FileObj,
+        NULL
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't reference file object!\n");
+        goto err_file_obj;
+      }
+
+    status = ZwQueryInformationFile(
+        file,
+        &io_status,
+        &file_info,
+        sizeof file_info,
+        FileStandardInformation
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't query file size!\n");
+        goto err_query_info;
+      }
+    if (file_info.EndOfFile.QuadPart < WV_M_FILEDISK_VHD_SECTOR)
+      goto not_vhd;
+
+    /* Read and check the footer. */
+    vhd->End =
+      (file_info.EndOfFile.QuadPart - WV_M_FILEDISK_VHD_SECTOR) &
+      ~(LONGLONG) (WV_M_FILEDISK_VHD_SECTOR - 1);
+    status = WvFilediskFileIo(
+        vhd->FileObj,
+        WvlDiskIoModeRead,
+        vhd->End,
+        sizeof vhd->Footer,
+        vhd->Footer
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't read footer!\n");
+        goto err_footer;
+      }
+    RtlCopyMemory(&footer, vhd->Footer, sizeof footer);
+    msvhd__footer_swap_endian(&footer);
+    if (!wv_memcmpeq(footer.cookie, "conectix", sizeof footer.cookie))
+      goto not_vhd;
+    if (footer.file_ver.val != 0x10000)
+      goto not_vhd;
+    vhd->Type = footer.type.val;
+    vhd->Size = footer.cur_size.val;
+
+    switch (vhd->Type) {
+        case WvMsvhdDiskTypeFixed:
+          /* Only a parent needs us to read it for it. */
+          if (!depth)
+            goto not_vhd;
+          if (vhd->Size > (ULONGLONG) vhd->End) {
+              DBG("Fixed .VHD is truncated!\n");
+              status = STATUS_DISK_CORRUPT_ERROR;
+              goto err_fixed;
+            }
+          goto done;
+
+        case WvMsvhdDiskTypeDynamic:
+        case WvMsvhdDiskTypeDifferencing:
+          break;
+
+        default:
+          goto not_vhd;
+      }
+
+    /* Read and check the dynamic disk header. */
+    header = wv_palloc(sizeof *header);
+    if (!header) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_header;
+      }
+    status = WvFilediskFileIo(
+        vhd->FileObj,
+        WvlDiskIoModeRead,
+        footer.data_offset.val,
+        sizeof *header,
+        header
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't read dynamic disk header!\n");
+        goto err_read_header;
+      }
+    msvhd__dyn_header_swap_endian(header);
+    status = STATUS_DISK_CORRUPT_ERROR;
+    if (
+        !wv_memcmpeq(header->cookie, "cxsparse", sizeof header->cookie) ||
+        header->header_ver.val != 0x10000
+      ) {
+        DBG("Bad dynamic disk header!\n");
+        goto err_bad_header;
+      }
+    vhd->BlockSize = header->block_size.val;
+    if (
+        vhd->BlockSize < WV_M_FILEDISK_VHD_SECTOR * 8 ||
+        vhd->BlockSize > WV_M_FILEDISK_VHD_MAX_BLOCK ||
+        (vhd->BlockSize & (vhd->BlockSize - 1))
+      ) {
+        DBG("Unsupported block size %u!\n", vhd->BlockSize);
+        goto err_bad_header;
+      }
+    vhd->BitmapSize = WV_M_FILEDISK_VHD_ROUND_UP(
+        vhd->BlockSize / WV_M_FILEDISK_VHD_SECTOR / 8
+      );
+    vhd->BatEntries = header->max_table_entries.val;
+    blocks = (vhd->Size + vhd->BlockSize - 1) / vhd->BlockSize;
+    if (
+        blocks > vhd->BatEntries ||
+        vhd->BatEntries > (ULONG) -1 / sizeof (UINT32) / 2
+      ) {
+        DBG("BAT doesn't match the disk size!\n");
+        goto err_bad_header;
+      }
+
+    /* Read the BAT. */
+    vhd->BatOffset = header->table_offset.val;
+    bat_size = WV_M_FILEDISK_VHD_ROUND_UP(vhd->BatEntries * sizeof (UINT32));
+    vhd->Bat = wv_palloc(bat_size);
+    if (!vhd->Bat) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_bat;
+      }
+    status = WvFilediskFileIo(
+        vhd->FileObj,
+        WvlDiskIoModeRead,
+        vhd->BatOffset,
+        bat_size,
+        vhd->Bat
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't read BAT!\n");
+        goto err_read_bat;
+      }
+    for (i = 0; i < bat_size / sizeof (UINT32); i++)
+      byte__order_swap((char *) (vhd->Bat + i), sizeof (UINT32));
+
+    if (vhd->Type == WvMsvhdDiskTypeDifferencing) {
+        vhd->Bitmaps = wv_pallocz(vhd->BatEntries * sizeof *vhd->Bitmaps);
+        if (!vhd->Bitmaps) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto err_bitmaps;
+          }
+        status = WvFilediskVhdOpenParent_(vhd, header, path, depth);
+        if (!NT_SUCCESS(status))
+          goto err_parent;
+      }
+
+    wv_free(header);
+    DBG(
+        "Opened %s .VHD: %I64u bytes, %u-byte blocks\n",
+        vhd->Parent ? "differencing" : "dynamic",
+        vhd->Size,
+        vhd->BlockSize
+      );
+
+    done:
+    if (depth)
+      vhd->File = file;
+    *vhd_out = vhd;
+    return STATUS_SUCCESS;
+
+    not_vhd:
+    status = depth ? STATUS_UNRECOGNIZED_MEDIA : STATUS_SUCCESS;
+    goto err_not_vhd;
+
+    err_parent:
+
+    wv_free(vhd->Bitmaps);
+    err_bitmaps:
+
+    err_read_bat:
+
+    wv_free(vhd->Bat);
+    err_bat:
+
+    err_bad_header:
+
+    err_read_header:
+
+    wv_free(header);
+    err_header:
+
+    err_fixed:
+
+    err_not_vhd:
+
+    err_footer:
+
+    err_query_info:
+
+    ObDereferenceObject(vhd->FileObj);
+    err_file_obj:
+
+    wv_free(vhd);
+    err_vhd:
+
+    return status;
+  }
+
+/* Find, open and check a differencing image's parent. */
+static NTSTATUS STDCALL WvFilediskVhdOpenParent_(
+    IN WV_SP_FILEDISK_VHD vhd,
+    IN WV_SP_MSVHD_DYN_HEADER header,
+    IN PUNICODE_STRING path,
+    IN ULONG depth
+  ) {
+    static const UINT32 platforms[] = {
+        WV_M_MSVHD_PLAT_W2RU,
+        WV_M_MSVHD_PLAT_W2KU,
+      };
+    static const WCHAR dos_devices[] = L"\\??\\";
+    PWCHAR locator;
+    UNICODE_STRING parent_path;
+    OBJECT_ATTRIBUTES obj_attrs;
+    IO_STATUS_BLOCK io_status;
+    HANDLE file;
+    USHORT dir_len;
+    UINT32 len;
+    int p;
+    int i;
+    NTSTATUS status = STATUS_OBJECT_PATH_NOT_FOUND;
+
+    if (depth + 1 >= WV_M_FILEDISK_VHD_MAX_DEPTH) {
+        DBG("Differencing chain is too deep!\n");
+        return STATUS_NOT_SUPPORTED;
+      }
+
+    /* The directory part of our own path, for relative locators. */
+    for (dir_len = path->Length / sizeof (WCHAR); dir_len; dir_len--) {
+        if (path->Buffer[dir_len - 1] == L'\\')
+          break;
+      }
+
+    locator = wv_palloc(WV_M_FILEDISK_VHD_MAX_LOCATOR);
+    if (!locator)
+      return STATUS_INSUFFICIENT_RESOURCES;
+    parent_path.MaximumLength = (USHORT) (
+        path->Length + sizeof dos_devices + WV_M_FILEDISK_VHD_MAX_LOCATOR
+      );
+    parent_path.Buffer = wv_palloc(parent_path.MaximumLength);
+    if (!parent_path.Buffer) {
+        wv_free(locator);
+        return STATUS_INSUFFICIENT_RESOURCES;
+      }
+
+    /* Try relative locators, then absolute ones. */
+    for (p = 0; p < sizeof platforms / sizeof *platforms; p++) {
+        for (i = 0; i < 8; i++) {
+            WV_SP_MSVHD_PARENT_LOC loc = header->parent_loc + i;
+            PWCHAR name = locator;
+
+            if (loc->platform_code.val != platforms[p])
+              continue;
+            len = loc->platform_data_len.val;
+            if (!len || len > WV_M_FILEDISK_VHD_MAX_LOCATOR - sizeof (WCHAR))
+              continue;
+            status = WvFilediskFileIo(
+                vhd->FileObj,
+                WvlDiskIoModeRead,
+                loc->platform_data_offset.val,
+                WV_M_FILEDISK_VHD_ROUND_UP(len),
+                locator
+              );
+            if (!NT_SUCCESS(status))
+              continue;
+            len /= sizeof (WCHAR);
+            while (len && !name[len - 1])
+              len--;
+
+            /* Build the NT path. */
+            parent_path.Length = 0;
+            if (platforms[p] == WV_M_MSVHD_PLAT_W2RU) {
+                if (len >= 2 && name[0] == L'.' && name[1] == L'\\') {
+                    name += 2;
+                    len -= 2;
+                  }
+                RtlCopyMemory(
+                    parent_path.Buffer,
+                    path->Buffer,
+                    dir_len * sizeof (WCHAR)
+                  );
+                parent_path.Length = dir_len * sizeof (WCHAR);
+              } else {
+                RtlCopyMemory(
+                    parent_path.Buffer,
+                    dos_devices,
+                    sizeof dos_devices - sizeof (WCHAR)
+                  );
+                parent_path.Length = sizeof dos_devices - sizeof (WCHAR);
+              }
+            RtlCopyMemory(
+                (PUCHAR) parent_path.Buffer + parent_path.Length,
+                name,
+                len * sizeof (WCHAR)
+              );
+            parent_path.Length += (USHORT) (len * sizeof (WCHAR));
+
+            InitializeObjectAttributes(
+                &obj_attrs,
+                &parent_path,
+                OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+                NULL,
+                NULL
+              );
+            status = ZwCreateFile(
+                &file,
+                GENERIC_READ,
+                &obj_attrs,
+                &io_status,
+                NULL,
+                FILE_ATTRIBUTE_NORMAL,
+                FILE_SHARE_READ,
+                FILE_OPEN,
+                FILE_NON_DIRECTORY_FILE |
+                  FILE_RANDOM_ACCESS |
+                  FILE_NO_INTERMEDIATE_BUFFERING,
+                NULL,
+                0
+              );
+            if (!NT_SUCCESS(status)) {
+                DBG("Couldn't open parent %wZ\n", &parent_path);
+                continue;
+              }
+            status = WvFilediskVhdOpenImage_(
+                file,
+                &parent_path,
+                depth + 1,
+                &vhd->Parent
+              );
+            if (!NT_SUCCESS(status)) {
+                ZwClose(file);
+                continue;
+              }
+
+            /* Is it really our parent? */
+            if (
+                !wv_memcmpeq(
+                    ((WV_SP_MSVHD_FOOTER) vhd->Parent->Footer)->uid,
+                    header->parent_uid,
+                    sizeof header->parent_uid
+                  ) ||
+                vhd->Parent->Size < vhd->Size
+              ) {
+                DBG("Parent %wZ doesn't match!\n", &parent_path);
+                WvFilediskVhdFree_(vhd->Parent);
+                vhd->Parent = NULL;
+                status = STATUS_OBJECT_NAME_NOT_FOUND;
+                continue;
+              }
+
+            DBG("Using parent %wZ\n", &parent_path);
+            goto out;
+          }
+      }
+    DBG("No usable parent locator!\n");
+
+    out:
+    wv_free(parent_path.Buffer);
+    wv_free(locator);
+    return status;
+  }
+
+/* Fetch a differencing image's sector bitmap for a block. */
+static NTSTATUS STDCALL WvFilediskVhdGetBitmap_(
+    IN WV_SP_FILEDISK_VHD vhd,
+    IN UINT32 block,
+    OUT PUCHAR * bitmap
+  ) {
+    NTSTATUS status;
+
+    *bitmap = vhd->Bitmaps[block];
+    if (*bitmap)
+      return STATUS_SUCCESS;
+
+    *bitmap = wv_palloc(vhd->BitmapSize);
+    if (!*bitmap)
+      return STATUS_INSUFFICIENT_RESOURCES;
+    status = WvFilediskFileIo(
+        vhd->FileObj,
+        WvlDiskIoModeRead,
+        (LONGLONG) vhd->Bat[block] * WV_M_FILEDISK_VHD_SECTOR,
+        vhd->BitmapSize,
+        *bitmap
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't read bitmap for block %u!\n", block);
+        wv_free(*bitmap);
+        *bitmap = NULL;
+        return status;
+      }
+    vhd->Bitmaps[block] = *bitmap;
+    return STATUS_SUCCESS;
+  }
+
+/* Read from an image, falling back to its parent where needed. */
+static NTSTATUS STDCALL WvFilediskVhdRead_(
+    IN WV_SP_FILEDISK_VHD vhd,
+    IN ULONGLONG offset,
+    IN UINT32 length,
+    OUT PUCHAR buffer
+  ) {
+    UINT32 block;
+    UINT32 in_block;
+    UINT32 chunk;
+    LONGLONG data;
+    PUCHAR bitmap;
+    UINT32 sector;
+    UINT32 end;
+    UINT32 run;
+    BOOLEAN present;
+    NTSTATUS status;
+
+    if (vhd->Type == WvMsvhdDiskTypeFixed) {
+        return WvFilediskFileIo(
+            vhd->FileObj,
+            WvlDiskIoModeRead,
+            offset,
+            length,
+            buffer
+          );
+      }
+
+    while (length) {
+        block = (UINT32) (offset / vhd->BlockSize);
+        in_block = (UINT32) (offset % vhd->BlockSize);
+        chunk = vhd->BlockSize - in_block;
+        if (chunk > length)
+          chunk = length;
+        data =
+          (LONGLONG) vhd->Bat[block] * WV_M_FILEDISK_VHD_SECTOR +
+          vhd->BitmapSize;
+
+        if (vhd->Bat[block] == WV_M_MSVHD_BAT_UNUSED) {
+            /* Not allocated. */
+            if (vhd->Parent)
+              status = WvFilediskVhdRead_(vhd->Parent, offset, chunk, buffer);
+              else {
+                RtlZeroMemory(buffer, chunk);
+                status = STATUS_SUCCESS;
+              }
+          } else if (!vhd->Bitmaps) {
+            /* A dynamic image's allocated blocks are entirely its own. */
+            status = WvFilediskFileIo(
+                vhd->FileObj,
+                WvlDiskIoModeRead,
+                data + in_block,
+                chunk,
+                buffer
+              );
+          } else {
+            /* Read runs of sectors from the image or from the parent. */
+            status = WvFilediskVhdGetBitmap_(vhd, block, &bitmap);
+            sector = in_block / WV_M_FILEDISK_VHD_SECTOR;
+            end = (in_block + chunk) / WV_M_FILEDISK_VHD_SECTOR;
+            while (NT_SUCCESS(status) && sector < end) {
+                present = !!(bitmap[sector >> 3] & (0x80 >> (sector & 7)));
+                for (run = 1; sector + run < end; run++) {
+                    UINT32 next = sector + run;
+
+                    if (
+                        !!(bitmap[next >> 3] & (0x80 >> (next & 7))) !=
+                        present
+                      )
+                      break;
+                  }
+                if (present) {
+                    status = WvFilediskFileIo(
+                        vhd->FileObj,
+                        WvlDiskIoModeRead,
+                        data + (LONGLONG) sector * WV_M_FILEDISK_VHD_SECTOR,
+                        run * WV_M_FILEDISK_VHD_SECTOR,
+                        buffer +
+                          (sector * WV_M_FILEDISK_VHD_SECTOR - in_block)
+                      );
+                  } else {
+                    status = WvFilediskVhdRead_(
+                        vhd->Parent,
+                        offset - in_block +
+                          (ULONGLONG) sector * WV_M_FILEDISK_VHD_SECTOR,
+                        run * WV_M_FILEDISK_VHD_SECTOR,
+                        buffer +
+                          (sector * WV_M_FILEDISK_VHD_SECTOR - in_block)
+                      );
+                  }
+                sector += run;
+              }
+          }
+        if (!NT_SUCCESS(status))
+          return status;
+
+        offset += chunk;
+        buffer += chunk;
+        length -= chunk;
+      }
+    return STATUS_SUCCESS;
+  }
+
+/* Write to the top image, allocating blocks as needed. */
+static NTSTATUS STDCALL WvFilediskVhdWrite_(
+    IN WV_SP_FILEDISK_VHD vhd,
+    IN ULONGLONG offset,
+    IN UINT32 length,
+    IN PUCHAR buffer
+  ) {
+    UINT32 block;
+    UINT32 in_block;
+    UINT32 chunk;
+    LONGLONG bitmap_offset;
+    PUCHAR bitmap;
+    UINT32 sector;
+    UINT32 end;
+    BOOLEAN changed;
+    NTSTATUS status;
+
+    while (length) {
+        block = (UINT32) (offset / vhd->BlockSize);
+        in_block = (UINT32) (offset % vhd->BlockSize);
+        chunk = vhd->BlockSize - in_block;
+        if (chunk > length)
+          chunk = length;
+
+        if (vhd->Bat[block] == WV_M_MSVHD_BAT_UNUSED) {
+            status = WvFilediskVhdAllocate_(vhd, block);
+            if (!NT_SUCCESS(status))
+              return status;
+          }
+        bitmap_offset = (LONGLONG) vhd->Bat[block] * WV_M_FILEDISK_VHD_SECTOR;
+
+        status = WvFilediskFileIo(
+            vhd->FileObj,
+            WvlDiskIoModeWrite,
+            bitmap_offset + vhd->BitmapSize + in_block,
+            chunk,
+            buffer
+          );
+        if (!NT_SUCCESS(status))
+          return status;
+
+        /* A differencing image must note the sectors it now holds. */
+        if (vhd->Bitmaps) {
+            status = WvFilediskVhdGetBitmap_(vhd, block, &bitmap);
+            if (!NT_SUCCESS(status))
+              return status;
+            changed = FALSE;
+            end = (in_block + chunk) / WV_M_FILEDISK_VHD_SECTOR;
+            sector = in_block / WV_M_FILEDISK_VHD_SECTOR;
+            for (; sector < end; sector++) {
+                if (bitmap[sector >> 3] & (0x80 >> (sector & 7)))
+                  continue;
+                bitmap[sector >> 3] |= 0x80 >> (sector & 7);
+                changed = TRUE;
+              }
+            if (changed) {
+                status = WvFilediskFileIo(
+                    vhd->FileObj,
+                    WvlDiskIoModeWrite,
+                    bitmap_offset,
+                    vhd->BitmapSize,
+                    bitmap
+                  );
+                if (!NT_SUCCESS(status)) {
+                    /* Re-read it next time. */
+                    wv_free(bitmap);
+                    vhd->Bitmaps[block] = NULL;
+                    return status;
+                  }
+              }
+          }
+
+        offset += chunk;
+        buffer += chunk;
+        length -= chunk;
+      }
+    return STATUS_SUCCESS;
+  }
+
+/**
+ * Allocate a block at the end of the top image.
+ *
+ * The block is written first, then the footer after it, and only then
+ * the BAT entry, so that an interruption leaves a consistent image
+ * with, at worst, an unreferenced block.
+ */
+static NTSTATUS STDCALL WvFilediskVhdAllocate_(
+    IN WV_SP_FILEDISK_VHD vhd,
+    IN UINT32 block
+  ) {
+    LONGLONG block_offset = vhd->End;
+    LONGLONG end;
+    PUCHAR zeroes;
+    PUCHAR bitmap = NULL;
+    UINT32 done;
+    UINT32 chunk;
+    UINT32 first;
+    UINT32 bat_sector[WV_M_FILEDISK_VHD_BAT_PER_SECTOR];
+    UINT32 i;
+    NTSTATUS status;
+
+    end = block_offset + vhd->BitmapSize + vhd->BlockSize;
+    if (end / WV_M_FILEDISK_VHD_SECTOR >= WV_M_MSVHD_BAT_UNUSED) {
+        DBG(".VHD is full!\n");
+        return STATUS_DISK_FULL;
+      }
+
+    zeroes = wv_pallocz(WV_M_FILEDISK_VHD_ZERO_SIZE);
+    if (!zeroes) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_zeroes;
+      }
+
+    /*
+     * A dynamic image's new block holds zeroes in every sector.  A
+     * differencing image's holds none of its sectors, yet.
+     */
+    bitmap = wv_palloc(vhd->BitmapSize);
+    if (!bitmap) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_bitmap;
+      }
+    RtlFillMemory(bitmap, vhd->BitmapSize, vhd->Bitmaps ? 0 : 0xFF);
+    status = WvFilediskFileIo(
+        vhd->FileObj,
+        WvlDiskIoModeWrite,
+        block_offset,
+        vhd->BitmapSize,
+        bitmap
+      );
+    if (!NT_SUCCESS(status))
+      goto err_write;
+
+    for (done = 0; done < vhd->BlockSize; done += chunk) {
+        chunk = vhd->BlockSize - done;
+        if (chunk > WV_M_FILEDISK_VHD_ZERO_SIZE)
+          chunk = WV_M_FILEDISK_VHD_ZERO_SIZE;
+        status = WvFilediskFileIo(
+            vhd->FileObj,
+            WvlDiskIoModeWrite,
+            block_offset + vhd->BitmapSize + done,
+            chunk,
+            zeroes
+          );
+        if (!NT_SUCCESS(status))
+          goto err_write;
+      }
+
+    status = WvFilediskFileIo(
+        vhd->FileObj,
+        WvlDiskIoModeWrite,
+        end,
+        sizeof vhd->Footer,
+        vhd->Footer
+      );
+    if (!NT_SUCCESS(status))
+      goto err_write;
+    vhd->End = end;
+
+    /* Update the BAT sector holding the entry. */
+    vhd->Bat[block] = (UINT32) (block_offset / WV_M_FILEDISK_VHD_SECTOR);
+    first = block & ~(WV_M_FILEDISK_VHD_BAT_PER_SECTOR - 1);
+    for (i = 0; i < WV_M_FILEDISK_VHD_BAT_PER_SECTOR; i++) {
+        bat_sector[i] = vhd->Bat[first + i];
+        byte__order_swap((char *) (bat_sector + i), sizeof (UINT32));
+      }
+    status = WvFilediskFileIo(
+        vhd->FileObj,
+        WvlDiskIoModeWrite,
+        vhd->BatOffset + first * sizeof (UINT32),
+        sizeof bat_sector,
+        bat_sector
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't update BAT!\n");
+        vhd->Bat[block] = WV_M_MSVHD_BAT_UNUSED;
+        goto err_bat;
+      }
+
+    /* Keep the fresh bitmap for a differencing image. */
+    if (vhd->Bitmaps) {
+        wv_free(vhd->Bitmaps[block]);
+        vhd->Bitmaps[block] = bitmap;
+        bitmap = NULL;
+      }
+    status = STATUS_SUCCESS;
+
+    err_bat:
+
+    err_write:
+
+    wv_free(bitmap);
+    err_bitmap:
+
+    wv_free(zeroes);
+    err_zeroes:
+
+    return status;
+  }
@@ -0,0 +1,714 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * VHDX image format engine.
+ *
+ * The whole BAT is kept in memory, so translating a virtual offset
+ * costs no file I/O.  Blocks which aren't present read as zeros and
+ * are allocated at the end of the file upon their first write.
+ *
+ * The log is not implemented.  An image whose log holds entries which
+ * haven't been replayed is refused; opening it once in Windows replays
+ * the log.  Since our metadata updates are single-sector writes which
+ * are ordered after the data they refer to, we don't need the log for
+ * our own writes.
+ *
+ * Differencing images aren't supported.
+ */
+
+#include "imgfmt.h"
+
+/** Macros */
+
+#define VHDX_M_KIB 1024UL
+#define VHDX_M_MIB (1024UL * 1024)
+
+#define VHDX_M_HEADER_SIZE (4 * VHDX_M_KIB)
+#define VHDX_M_REGION_SIZE (64 * VHDX_M_KIB)
+#define VHDX_M_METADATA_TABLE_SIZE (64 * VHDX_M_KIB)
+
+/* Headers and region tables both keep their checksum here */
+#define VHDX_M_CHECKSUM 4
+
+/* Header field offsets */
+#define VHDX_M_HDR_SEQUENCE 8
+#define VHDX_M_HDR_FILE_WRITE 16
+#define VHDX_M_HDR_DATA_WRITE 32
+#define VHDX_M_HDR_LOG 48
+#define VHDX_M_HDR_VERSION 66
+
+/* Region table field offsets */
+#define VHDX_M_REG_COUNT 8
+#define VHDX_M_REG_ENTRIES 16
+#define VHDX_M_REG_ENTRY_SIZE 32
+#define VHDX_M_REG_MAX_ENTRIES 2047
+
+/* Metadata table field offsets */
+/* The entry count is the high half of this */
+#define VHDX_M_META_COUNT 8
+#define VHDX_M_META_ENTRIES 32
+#define VHDX_M_META_ENTRY_SIZE 32
+#define VHDX_M_META_MAX_ENTRIES 2047
+#define VHDX_M_META_IS_USER 0x1UL
+#define VHDX_M_META_IS_REQUIRED 0x4UL
+
+/* File parameters flags */
+#define VHDX_M_HAS_PARENT 0x2UL
+
+/* BAT entry fields */
+#define VHDX_M_BAT_STATE_MASK 0x7ULL
+#define VHDX_M_BAT_OFFSET_SHIFT 20
+#define VHDX_M_BAT_FULLY_PRESENT 6ULL
+
+#define VHDX_M_MIN_BLOCK VHDX_M_MIB
+#define VHDX_M_MAX_BLOCK (256 * VHDX_M_MIB)
+
+/* The most zeroes we write at once when allocating a block */
+#define VHDX_M_ZERO_CHUNK (64 * VHDX_M_KIB)
+
+/** Object types */
+typedef struct VHDX VHDX_S, * VHDX_SP;
+
+/** Struct/union type definitions */
+struct VHDX {
+    const IMGFMT_S_FILE * File;
+    unsigned long long Size;
+    unsigned long BlockSize;
+    unsigned long LogicalSectorSize;
+    unsigned long ChunkRatio;
+    unsigned long long BatOffset;
+    unsigned long BatEntries;
+    /** The BAT, in file byte order, padded to the I/O granularity */
+    unsigned char * Bat;
+    /** The current header */
+    unsigned char * Header;
+    unsigned long long HeaderOffset;
+    /** Whether the header has been updated for writing */
+    int Writing;
+    /** Where the next block goes */
+    unsigned long long End;
+    /** Zeroes for block allocation */
+    unsigned char * Zero;
+  };
+
+/** Private function declarations */
+static IMGFMT_E_STATUS VhdxOpen_(
+    const IMGFMT_S_FILE *,
+    void **,
+    unsigned long long *
+  );
+static IMGFMT_E_STATUS VhdxRead_(
+    void *,
+    unsigned long long,
+    unsigned long,
+    void *
+  );
+static IMGFMT_E_STATUS VhdxWrite_(
+    void *,
+    unsigned long long,
+    unsigned long,
+    const void *
+  );
+static void VhdxClose_(void *);
+static int VhdxChecksumOk_(unsigned char *, unsigned long);
+static void VhdxChecksumSet_(unsigned char *, unsigned long);
+static IMGFMT_E_STATUS VhdxReadHeaders_(VHDX_SP, unsigned char *);
+static IMGFMT_E_STATUS VhdxReadRegions_(
+    VHDX_SP,
+    unsigned char *,
+    unsigned long long *,
+    unsigned long *
+  );
+static IMGFMT_E_STATUS VhdxReadMetadata_(
+    VHDX_SP,
+    unsigned char *,
+    unsigned long long
+  );
+static unsigned char * VhdxBatEntry_(VHDX_SP, unsigned long long);
+static IMGFMT_E_STATUS VhdxBeginWriting_(VHDX_SP);
+static IMGFMT_E_STATUS VhdxAllocate_(
+    VHDX_SP,
+    unsigned long long,
+    unsigned long,
+    unsigned long,
+    const unsigned char *
+  );
+
+/** Objects */
+const IMGFMT_S_FORMAT ImgFmtVhdx = {
+    "VHDX",
+    VhdxOpen_,
+    VhdxRead_,
+    VhdxWrite_,
+    VhdxClose_,
+  };
+
+static const char VhdxFileSig_[] = "vhdxfile";
+static const char VhdxHeaderSig_[] = "head";
+static const char VhdxRegionSig_[] = "regi";
+static const char VhdxMetadataSig_[] = "metadata";
+
+/* GUIDs, in file byte order */
+static const unsigned char VhdxBatGuid_[16] = {
+    0x66, 0x77, 0xC2, 0x2D, 0x23, 0xF6, 0x00, 0x42,
+    0x9D, 0x64, 0x11, 0x5E, 0x9B, 0xFD, 0x4A, 0x08,
+  };
+static const unsigned char VhdxMetadataGuid_[16] = {
+    0x06, 0xA2, 0x7C, 0x8B, 0x90, 0x47, 0x9A, 0x4B,
+    0xB8, 0xFE, 0x57, 0x5F, 0x05, 0x0F, 0x88, 0x6E,
+  };
+static const unsigned char VhdxFileParamsGuid_[16] = {
+    0x37, 0x67, 0xA1, 0xCA, 0x36, 0xFA, 0x43, 0x4D,
+    0xB3, 0xB6, 0x33, 0xF0, 0xAA, 0x44, 0xE7, 0x6B,
+  };
+static const unsigned char VhdxDiskSizeGuid_[16] = {
+    0x24, 0x42, 0xA5, 0x2F, 0x1B, 0xCD, 0x76, 0x48,
+    0xB2, 0x11, 0x5D, 0xBE, 0xD8, 0x3B, 0xF4, 0xB8,
+  };
+static const unsigned char VhdxSectorSizeGuid_[16] = {
+    0x1D, 0xBF, 0x41, 0x81, 0x6F, 0xA9, 0x09, 0x47,
+    0xBA, 0x47, 0xF2, 0x33, 0xA8, 0xFA, 0xAB, 0x5F,
+  };
+
+/** Function definitions */
+
+static int VhdxChecksumOk_(unsigned char * buf, unsigned long len) {
+    unsigned long sum;
+    unsigned long crc;
+
+    sum = ImgFmtGetLe32(buf + VHDX_M_CHECKSUM);
+    ImgFmtPutLe32(buf + VHDX_M_CHECKSUM, 0);
+    crc = ImgFmtCrc32c(buf, len);
+    ImgFmtPutLe32(buf + VHDX_M_CHECKSUM, sum);
+    return crc == sum;
+  }
+
+static void VhdxChecksumSet_(unsigned char * buf, unsigned long len) {
+    ImgFmtPutLe32(buf + VHDX_M_CHECKSUM, 0);
+    ImgFmtPutLe32(buf + VHDX_M_CHECKSUM, ImgFmtCrc32c(buf, len));
+  }
+
+/**
+ * Find the current header.
+ *
+ * @v scratch           Scratch space of VHDX_M_HEADER_SIZE bytes.
+ */
+static IMGFMT_E_STATUS VhdxReadHeaders_(VHDX_SP vhdx, unsigned char * scratch) {
+    const IMGFMT_S_FILE * file = vhdx->File;
+    unsigned long long offset;
+    unsigned long long best_seq = 0;
+    int found = 0;
+    int i;
+
+    for (i = 1; i <= 2; i++) {
+        offset = i * 64ULL * VHDX_M_KIB;
+        if (file->Read(file->Context, offset, VHDX_M_HEADER_SIZE, scratch))
+          return ImgFmtStatusIo;
+        if (
+            !ImgFmtEqual(scratch, VhdxHeaderSig_, 4) ||
+            !VhdxChecksumOk_(scratch, VHDX_M_HEADER_SIZE)
+          )
+          continue;
+        if (found && ImgFmtGetLe64(scratch + VHDX_M_HDR_SEQUENCE) <= best_seq)
+          continue;
+        best_seq = ImgFmtGetLe64(scratch + VHDX_M_HDR_SEQUENCE);
+        ImgFmtCopy(vhdx->Header, scratch, VHDX_M_HEADER_SIZE);
+        vhdx->HeaderOffset = offset;
+        found = 1;
+      }
+    if (!found)
+      return ImgFmtStatusCorrupt;
+    if ((ImgFmtGetLe32(vhdx->Header + VHDX_M_HDR_VERSION) & 0xFFFF) != 1)
+      return ImgFmtStatusUnsupported;
+
+    /* A log which hasn't been replayed */
+    ImgFmtFill(scratch, 0, 16);
+    if (!ImgFmtEqual(vhdx->Header + VHDX_M_HDR_LOG, scratch, 16))
+      return ImgFmtStatusUnsupported;
+    return ImgFmtStatusSuccess;
+  }
+
+/**
+ * Find the BAT and metadata regions.
+ *
+ * @v scratch           Scratch space of VHDX_M_REGION_SIZE bytes.
+ */
+static IMGFMT_E_STATUS VhdxReadRegions_(
+    VHDX_SP vhdx,
+    unsigned char * scratch,
+    unsigned long long * metadata_offset,
+    unsigned long * bat_length
+  ) {
+    const IMGFMT_S_FILE * file = vhdx->File;
+    unsigned char * entry;
+    unsigned long count;
+    unsigned long i;
+    int table;
+
+    /* Use the first table which is intact. */
+    for (table = 0; table < 2; table++) {
+        if (
+            file->Read(
+                file->Context,
+                (192ULL + table * 64ULL) * VHDX_M_KIB,
+                VHDX_M_REGION_SIZE,
+                scratch
+              )
+          )
+          return ImgFmtStatusIo;
+        if (
+            ImgFmtEqual(scratch, VhdxRegionSig_, 4) &&
+            VhdxChecksumOk_(scratch, VHDX_M_REGION_SIZE)
+          )
+          break;
+      }
+    if (table == 2)
+      return ImgFmtStatusCorrupt;
+
+    count = ImgFmtGetLe32(scratch + VHDX_M_REG_COUNT);
+    if (count > VHDX_M_REG_MAX_ENTRIES)
+      return ImgFmtStatusCorrupt;
+    *metadata_offset = 0;
+    vhdx->BatOffset = 0;
+    for (i = 0; i < count; i++) {
+        entry = scratch + VHDX_M_REG_ENTRIES + i * VHDX_M_REG_ENTRY_SIZE;
+        if (ImgFmtEqual(entry, VhdxBatGuid_, 16)) {
+            vhdx->BatOffset = ImgFmtGetLe64(entry + 16);
+            *bat_length = ImgFmtGetLe32(entry + 24);
+          } else if (ImgFmtEqual(entry, VhdxMetadataGuid_, 16)) {
+            *metadata_offset = ImgFmtGetLe64(entry + 16);
+          } else if (ImgFmtGetLe32(entry + 28) & 1) {
+            /* A required region we don't know */
+            return ImgFmtStatusUnsupported;
+          }
+      }
+    if (!vhdx->BatOffset || !*metadata_offset)
+      return ImgFmtStatusCorrupt;
+    return ImgFmtStatusSuccess;
+  }
+
+/**
+ * Read the disk parameters from the metadata region.
+ *
+ * @v scratch           Scratch space of VHDX_M_METADATA_TABLE_SIZE bytes,
+ *                      followed by one sector for reading items.
+ */
+static IMGFMT_E_STATUS VhdxReadMetadata_(
+    VHDX_SP vhdx,
+    unsigned char * scratch,
+    unsigned long long metadata_offset
+  ) {
+    const IMGFMT_S_FILE * file = vhdx->File;
+    unsigned char * entry;
+    unsigned char * item = scratch + VHDX_M_METADATA_TABLE_SIZE;
+    unsigned long count;
+    unsigned long item_offset;
+    unsigned long in_sector;
+    unsigned long flags;
+    unsigned long i;
+    int found = 0;
+
+    if (
+        file->Read(
+            file->Context,
+            metadata_offset,
+            VHDX_M_METADATA_TABLE_SIZE,
+            scratch
+          )
+      )
+      return ImgFmtStatusIo;
+    if (!ImgFmtEqual(scratch, VhdxMetadataSig_, 8))
+      return ImgFmtStatusCorrupt;
+    count = ImgFmtGetLe32(scratch + VHDX_M_META_COUNT) >> 16;
+    if (count > VHDX_M_META_MAX_ENTRIES)
+      return ImgFmtStatusCorrupt;
+
+    for (i = 0; i < count; i++) {
+        entry = scratch + VHDX_M_META_ENTRIES + i * VHDX_M_META_ENTRY_SIZE;
+        flags = ImgFmtGetLe32(entry + 24);
+        if (flags & VHDX_M_META_IS_USER)
+          continue;
+        if (
+            !ImgFmtEqual(entry, VhdxFileParamsGuid_, 16) &&
+            !ImgFmtEqual(entry, VhdxDiskSizeGuid_, 16) &&
+            !ImgFmtEqual(entry, VhdxSectorSizeGuid_, 16)
+          ) {
+            if (flags & VHDX_M_META_IS_REQUIRED)
+              return ImgFmtStatusUnsupported;
+            continue;
+          }
+
+        /* The items we need are at most 8 bytes and 8-byte aligned. */
+        item_offset = ImgFmtGetLe32(entry + 16);
+        in_sector = item_offset & (IMGFMT_M_ALIGN - 1);
+        if (item_offset & 7)
+          return ImgFmtStatusCorrupt;
+        if (
+            file->Read(
+                file->Context,
+                metadata_offset + item_offset - in_sector,
+                IMGFMT_M_ALIGN,
+                item
+              )
+          )
+          return ImgFmtStatusIo;
+
+        if (ImgFmtEqual(entry, VhdxFileParamsGuid_, 16)) {
+            vhdx->BlockSize = ImgFmtGetLe32(item + in_sector);
+            if (ImgFmtGetLe32(item + in_sector + 4) & VHDX_M_HAS_PARENT)
+              return ImgFmtStatusUnsupported;
+            found |= 1;
+          } else if (ImgFmtEqual(entry, VhdxDiskSizeGuid_, 16)) {
+            vhdx->Size = ImgFmtGetLe64(item + in_sector);
+            found |= 2;
+          } else {
+            vhdx->LogicalSectorSize = ImgFmtGetLe32(item + in_sector);
+            found |= 4;
+          }
+      }
+    if (found != 7)
+      return ImgFmtStatusCorrupt;
+    if (
+        vhdx->BlockSize < VHDX_M_MIN_BLOCK ||
+        vhdx->BlockSize > VHDX_M_MAX_BLOCK ||
+        vhdx->BlockSize & (vhdx->BlockSize - 1) ||
+        (
+            vhdx->LogicalSectorSize != 512 &&
+            vhdx->LogicalSectorSize != 4096
+          ) ||
+        vhdx->Size & (vhdx->LogicalSectorSize - 1)
+      )
+      return ImgFmtStatusUnsupported;
+    return ImgFmtStatusSuccess;
+  }
+
+static IMGFMT_E_STATUS VhdxOpen_(
+    const IMGFMT_S_FILE * file,
+    void ** image,
+    unsigned long long * size
+  ) {
+    VHDX_SP vhdx;
+    unsigned char * scratch;
+    unsigned long long metadata_offset;
+    unsigned long long blocks;
+    unsigned long long entries;
+    unsigned long bat_length = 0;
+    unsigned long bat_bytes;
+    IMGFMT_E_STATUS status;
+
+    *image = 0;
+    if (file->Size < VHDX_M_MIB)
+      return ImgFmtStatusSuccess;
+
+    scratch = file->Malloc(
+        file->Context,
+        VHDX_M_REGION_SIZE + IMGFMT_M_ALIGN
+      );
+    if (!scratch)
+      return ImgFmtStatusNoMemory;
+    if (file->Read(file->Context, 0, IMGFMT_M_ALIGN, scratch)) {
+        status = ImgFmtStatusIo;
+        goto err_sig;
+      }
+    if (!ImgFmtEqual(scratch, VhdxFileSig_, 8)) {
+        /* Not ours. */
+        status = ImgFmtStatusSuccess;
+        goto err_sig;
+      }
+
+    vhdx = file->Malloc(file->Context, sizeof *vhdx);
+    if (!vhdx) {
+        status = ImgFmtStatusNoMemory;
+        goto err_sig;
+      }
+    ImgFmtFill(vhdx, 0, sizeof *vhdx);
+    vhdx->File = file;
+
+    vhdx->Header = file->Malloc(file->Context, VHDX_M_HEADER_SIZE);
+    if (!vhdx->Header) {
+        status = ImgFmtStatusNoMemory;
+        goto err_header;
+      }
+    status = VhdxReadHeaders_(vhdx, scratch);
+    if (status != ImgFmtStatusSuccess)
+      goto err_check;
+    status = VhdxReadRegions_(vhdx, scratch, &metadata_offset, &bat_length);
+    if (status != ImgFmtStatusSuccess)
+      goto err_check;
+    status = VhdxReadMetadata_(vhdx, scratch, metadata_offset);
+    if (status != ImgFmtStatusSuccess)
+      goto err_check;
+
+    /* Every chunk of payload blocks is followed by a bitmap entry. */
+    vhdx->ChunkRatio = (unsigned long) (
+        (1ULL << 23) * vhdx->LogicalSectorSize / vhdx->BlockSize
+      );
+    blocks = (vhdx->Size + vhdx->BlockSize - 1) / vhdx->BlockSize;
+    entries = blocks ? blocks + (blocks - 1) / vhdx->ChunkRatio : 0;
+    status = ImgFmtStatusCorrupt;
+    if (entries * 8 > bat_length || vhdx->BatOffset & (VHDX_M_MIB - 1))
+      goto err_check;
+    vhdx->BatEntries = (unsigned long) entries;
+
+    bat_bytes = (unsigned long) (
+        (entries * 8 + IMGFMT_M_ALIGN - 1) & ~(IMGFMT_M_ALIGN - 1ULL)
+      );
+    vhdx->Bat = file->Malloc(file->Context, bat_bytes ? bat_bytes : 1);
+    if (!vhdx->Bat) {
+        status = ImgFmtStatusNoMemory;
+        goto err_check;
+      }
+    if (
+        bat_bytes &&
+        file->Read(file->Context, vhdx->BatOffset, bat_bytes, vhdx->Bat)
+      ) {
+        status = ImgFmtStatusIo;
+        goto err_read_bat;
+      }
+
+    vhdx->End = (file->Size + VHDX_M_MIB - 1) & ~(VHDX_M_MIB - 1ULL);
+    file->Free(file->Context, scratch);
+    *size = vhdx->Size;
+    *image = vhdx;
+    return ImgFmtStatusSuccess;
+
+    err_read_bat:
+
+    file->Free(file->Context, vhdx->Bat);
+    err_check:
+
+    file->Free(file->Context, vhdx->Header);
+    err_header:
+
+    file->Free(file->Context, vhdx);
+    err_sig:
+
+    file->Free(file->Context, scratch);
+    return status;
+  }
+
+static void VhdxClose_(void * image) {
+    VHDX_SP vhdx = image;
+    const IMGFMT_S_FILE * file = vhdx->File;
+
+    if (vhdx->Zero)
+      file->Free(file->Context, vhdx->Zero);
+    file->Free(file->Context, vhdx->Bat);
+    file->Free(file->Context, vhdx->Header);
+    file->Free(file->Context, vhdx);
+  }
+
+/* Find the BAT entry for a payload block. */
+static unsigned char * VhdxBatEntry_(VHDX_SP vhdx, unsigned long long block) {
+    return vhdx->Bat + (block + block / vhdx->ChunkRatio) * 8;
+  }
+
+static IMGFMT_E_STATUS VhdxRead_(
+    void * image,
+    unsigned long long offset,
+    unsigned long length,
+    void * buffer
+  ) {
+    VHDX_SP vhdx = image;
+    const IMGFMT_S_FILE * file = vhdx->File;
+    unsigned char * buf = buffer;
+    unsigned long long entry;
+    unsigned long in_block;
+    unsigned long chunk;
+
+    while (length) {
+        in_block = (unsigned long) (offset & (vhdx->BlockSize - 1));
+        chunk = vhdx->BlockSize - in_block;
+        if (chunk > length)
+          chunk = length;
+
+        entry = ImgFmtGetLe64(VhdxBatEntry_(vhdx, offset / vhdx->BlockSize));
+        if ((entry & VHDX_M_BAT_STATE_MASK) == VHDX_M_BAT_FULLY_PRESENT) {
+            if (
+                file->Read(
+                    file->Context,
+                    (entry >> VHDX_M_BAT_OFFSET_SHIFT) * VHDX_M_MIB + in_block,
+                    chunk,
+                    buf
+                  )
+              )
+              return ImgFmtStatusIo;
+          } else if ((entry & VHDX_M_BAT_STATE_MASK) <= 3) {
+            /* Not present, undefined, zero or unmapped */
+            ImgFmtFill(buf, 0, chunk);
+          } else {
+            return ImgFmtStatusCorrupt;
+          }
+
+        offset += chunk;
+        buf += chunk;
+        length -= chunk;
+      }
+    return ImgFmtStatusSuccess;
+  }
+
+/**
+ * Update the header before the first write.
+ *
+ * The new header goes to the other header's location, so a torn write
+ * leaves the current header in place.
+ */
+static IMGFMT_E_STATUS VhdxBeginWriting_(VHDX_SP vhdx) {
+    const IMGFMT_S_FILE * file = vhdx->File;
+    unsigned long long offset;
+
+    if (vhdx->Writing)
+      return ImgFmtStatusSuccess;
+    ImgFmtPutLe64(
+        vhdx->Header + VHDX_M_HDR_SEQUENCE,
+        ImgFmtGetLe64(vhdx->Header + VHDX_M_HDR_SEQUENCE) + 1
+      );
+    file->Random(file->Context, vhdx->Header + VHDX_M_HDR_FILE_WRITE, 16);
+    file->Random(file->Context, vhdx->Header + VHDX_M_HDR_DATA_WRITE, 16);
+    VhdxChecksumSet_(vhdx->Header, VHDX_M_HEADER_SIZE);
+    offset = vhdx->HeaderOffset == 64 * VHDX_M_KIB ?
+      128 * VHDX_M_KIB :
+      64 * VHDX_M_KIB;
+    if (file->Write(file->Context, offset, VHDX_M_HEADER_SIZE, vhdx->Header))
+      return ImgFmtStatusIo;
+    vhdx->HeaderOffset = offset;
+    vhdx->Writing = 1;
+    return ImgFmtStatusSuccess;
+  }
+
+/**
+ * Allocate a block at the end of the file and write to it.
+ *
+ * @v block             The payload block to allocate.
+ * @v in_block          The offset of the data within the block.
+ * @v length            The length of the data.
+ * @v buf               The data.  The rest of the block is zeroed.
+ */
+static IMGFMT_E_STATUS VhdxAllocate_(
+    VHDX_SP vhdx,
+    unsigned long long block,
+    unsigned long in_block,
+    unsigned long length,
+    const unsigned char * buf
+  ) {
+    const IMGFMT_S_FILE * file = vhdx->File;
+    unsigned char * entry = VhdxBatEntry_(vhdx, block);
+    unsigned long long old_entry;
+    unsigned long long host = vhdx->End;
+    unsigned long long bat_sector;
+    unsigned long pos;
+    unsigned long chunk;
+
+    if (!vhdx->Zero) {
+        vhdx->Zero = file->Malloc(file->Context, VHDX_M_ZERO_CHUNK);
+        if (!vhdx->Zero)
+          return ImgFmtStatusNoMemory;
+        ImgFmtFill(vhdx->Zero, 0, VHDX_M_ZERO_CHUNK);
+      }
+
+    /* Write the block: zeroes, the data, then zeroes. */
+    for (pos = 0; pos < vhdx->BlockSize; pos += chunk) {
+        if (pos == in_block) {
+            if (file->Write(file->Context, host + pos, length, buf))
+              return ImgFmtStatusIo;
+            chunk = length;
+            continue;
+          }
+        chunk = (in_block > pos ? in_block : vhdx->BlockSize) - pos;
+        if (chunk > VHDX_M_ZERO_CHUNK)
+          chunk = VHDX_M_ZERO_CHUNK;
+        if (file->Write(file->Context, host + pos, chunk, vhdx->Zero))
+          return ImgFmtStatusIo;
+      }
+    vhdx->End += vhdx->BlockSize;
+
+    /* Point the BAT at it. */
+    old_entry = ImgFmtGetLe64(entry);
+    ImgFmtPutLe64(
+        entry,
+        (host / VHDX_M_MIB) << VHDX_M_BAT_OFFSET_SHIFT |
+          VHDX_M_BAT_FULLY_PRESENT
+      );
+    bat_sector = (entry - vhdx->Bat) & ~(IMGFMT_M_ALIGN - 1ULL);
+    if (
+        file->Write(
+            file->Context,
+            vhdx->BatOffset + bat_sector,
+            IMGFMT_M_ALIGN,
+            vhdx->Bat + bat_sector
+          )
+      ) {
+        ImgFmtPutLe64(entry, old_entry);
+        return ImgFmtStatusIo;
+      }
+    return ImgFmtStatusSuccess;
+  }
+
+static IMGFMT_E_STATUS VhdxWrite_(
+    void * image,
+    unsigned long long offset,
+    unsigned long length,
+    const void * buffer
+  ) {
+    VHDX_SP vhdx = image;
+    const IMGFMT_S_FILE * file = vhdx->File;
+    const unsigned char * buf = buffer;
+    unsigned long long entry;
+    unsigned long long block;
+    unsigned long in_block;
+    unsigned long chunk;
+    IMGFMT_E_STATUS status;
+
+    status = VhdxBeginWriting_(vhdx);
+    if (status != ImgFmtStatusSuccess)
+      return status;
+
+    while (length) {
+        in_block = (unsigned long) (offset & (vhdx->BlockSize - 1));
+        chunk = vhdx->BlockSize - in_block;
+        if (chunk > length)
+          chunk = length;
+
+        block = offset / vhdx->BlockSize;
+        entry = ImgFmtGetLe64(VhdxBatEntry_(vhdx, block));
+        if ((entry & VHDX_M_BAT_STATE_MASK) == VHDX_M_BAT_FULLY_PRESENT) {
+            if (
+                file->Write(
+                    file->Context,
+                    (entry >> VHDX_M_BAT_OFFSET_SHIFT) * VHDX_M_MIB + in_block,
+                    chunk,
+                    buf
+                  )
+              )
+              return ImgFmtStatusIo;
+          } else if ((entry & VHDX_M_BAT_STATE_MASK) <= 3) {
+            status = VhdxAllocate_(vhdx, block, in_block, chunk, buf);
+            if (status != ImgFmtStatusSuccess)
+              return status;
+          } else {
+            return ImgFmtStatusCorrupt;
+          }
+
+        offset += chunk;
+        buf += chunk;
+        length -= chunk;
+      }
+    return ImgFmtStatusSuccess;
+  }
@@ -33,6 +33,7 @@
 #include "x86.h"
 #include "safehook.h"
 #include "disk.h"
+#include "g4dmap.h"
 #include "grub4dos.h"
 
 /** Function declarations */
@@ -189,11 +190,11 @@ static NTSTATUS STDCALL WvG4dPnpQueryDeviceRelations(
         case BusRelations:
 
         /* Have we already created PDOs for the GRUB4DOS disks? */
-        for (i = 0; i < M_G4D_SLOTS; ++i) {
+        for (i = 0; i < bus->MapCount; ++i) {
             if (!(bus->NodesNeeded & (1 << i)))
               continue;
 
-            child = WvG4dProcessSlot(dev_obj, bus->DriveMappings + i);
+            child = WvG4dProcessSlot(dev_obj, bus->Maps + i);
             if (child) {
                 bus->BusRelations->Objects[bus->BusRelations->Count] = child;
                 bus->BusRelations->Count++;
@@ -315,6 +316,8 @@ static NTSTATUS STDCALL WvG4dPnpRemoveDevice(
         WvlDeleteDevice(child);
       }
     bus->BusRelations->Count -= i;
+    wv_free(bus->BusRelations);
+    bus->BusRelations = NULL;
 
     /* Send the IRP down */
     status = WvlPassIrpDown(dev_obj, irp);
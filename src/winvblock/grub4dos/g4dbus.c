@@ -37,11 +37,15 @@
 #include "debug.h"
 #include "x86.h"
 #include "safehook.h"
+#include "g4dmap.h"
 #include "grub4dos.h"
 
 /** Macros */
 #define M_WV_G4D_SAFE_HOOK_SIGNATURE "GRUB4DOS"
 
+/* How much of low memory WvlMapUnmapLowMemory() maps */
+#define M_WV_G4D_LOW_MEM_SIZE 0x100000
+
 /** Public function declarations */
 DRIVER_INITIALIZE WvG4dDriverEntry;
 
@@ -51,6 +55,30 @@ static DRIVER_UNLOAD WvG4dUnload;
 /** Objects */
 static S_WVL_MINI_DRIVER * WvG4dMiniDriver;
 
+/* The media type for each kind of emulated drive */
+static const WVL_E_DISK_MEDIA_TYPE WvG4dMediaTypes[WvG4dMapMedias] = {
+    WvlDiskMediaTypeFloppy,
+    WvlDiskMediaTypeHard,
+    WvlDiskMediaTypeOptical,
+  };
+
+/* What creates the disk for each kind of mapping, if anything */
+static F_WV_G4D_CREATE_DISK * const WvG4dCreators[WvG4dMapKinds] = {
+    /* WvG4dMapKindRemap */
+    NULL,
+    /* WvG4dMapKindRam */
+    WvRamdiskCreateG4dDisk,
+    /* WvG4dMapKindSector */
+    WvFilediskCreateG4dDisk,
+    /*
+     * WvG4dMapKindInSitu.  GRUB4DOS emulates these by patching the
+     * partition table of the backing drive as it is read, and the OS
+     * already sees that drive.  A run of sectors wouldn't carry the
+     * patched MBR, so there is nothing useful to create
+     */
+    NULL,
+  };
+
 /** Function definitions */
 
 /**
@@ -114,6 +142,9 @@ static NTSTATUS STDCALL WvG4dDriveDevice(
     LONG flags;
     DEVICE_OBJECT * fdo;
     S_WV_G4D_BUS * bus;
+    WV_S_G4D_MAP maps[WV_M_G4D_MAP_SLOTS];
+    ULONG map_count;
+    DEVICE_RELATIONS * relations;
     UINT i;
 
     ASSERT(drv_obj);
@@ -158,6 +189,24 @@ static NTSTATUS STDCALL WvG4dDriveDevice(
         hook->VendorId[6] = '0';
       }
 
+    /* Decode the drive map table, once and for all */
+    map_count = WvG4dMapScan(
+        phys_mem,
+        M_WV_G4D_LOW_MEM_SIZE,
+        (((UINT32) safe_hook->Segment) << 4) + WV_M_G4D_MAP_TABLE_OFFSET,
+        maps
+      );
+    DBG("GRUB4DOS drive mappings: %u\n", map_count);
+
+    /* Room for each mapping's PDO and one for the previous handler */
+    relations = wv_mallocz(
+        sizeof *relations + map_count * sizeof relations->Objects[0]
+      );
+    if (!relations) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_relations;
+      }
+
     fdo = NULL;
     status = WvlCreateDevice(
         WvG4dMiniDriver,
@@ -178,20 +227,16 @@ static NTSTATUS STDCALL WvG4dDriveDevice(
     bus->DeviceExtension->IrpDispatch = WvG4dIrpDispatch;
     bus->Flags = 0;
     bus->PhysicalDeviceObject = pdo;
-    bus->BusRelations->Count = 0;
-    bus->BusRelations->Objects[0] = NULL;
-    RtlCopyMemory(
-        bus->DriveMappings,
-        phys_mem + (((UINT32) safe_hook->Segment) << 4) + 0x20,
-        sizeof bus->DriveMappings
-      );
+    bus->BusRelations = relations;
+    bus->MapCount = map_count;
+    RtlCopyMemory(bus->Maps, maps, map_count * sizeof *maps);
     /* Always try to create a PDO for the previous INT 0x13 handler */
-    bus->NodesNeeded = 1 << M_G4D_SLOTS;
+    bus->NodesNeeded = 1 << map_count;
     bus->PreviousInt13hHandler[0] = hook->PrevHook;
 
-    /* Examine the drive mappings and note which of them need a PDO */
-    for (i = 0; i < M_G4D_SLOTS; ++i) {
-        if (!bus->DriveMappings[i].SectorCount)
+    /* Note which of the drive mappings need a PDO */
+    for (i = 0; i < map_count; ++i) {
+        if (!WvG4dCreators[maps[i].Kind])
           continue;
         bus->NodesNeeded |= 1 << i;
       }
@@ -213,6 +258,9 @@ static NTSTATUS STDCALL WvG4dDriveDevice(
     WvlDeleteDevice(fdo);
     err_fdo:
 
+    wv_free(relations);
+    err_relations:
+
     flags = InterlockedAnd(&hook->Flags, ~1);
 
     err_sig:
@@ -243,53 +291,28 @@ static VOID STDCALL WvG4dUnload(IN DRIVER_OBJECT * drv_obj) {
 
 DEVICE_OBJECT * WvG4dProcessSlot(
     IN DEVICE_OBJECT * bus_dev_obj,
-    IN S_WV_G4D_DRIVE_MAPPING * slot
+    IN WV_S_G4D_MAP * map
   ) {
-    WVL_E_DISK_MEDIA_TYPE media_type;
-    UINT32 sector_size;
-    DEVICE_OBJECT * new_dev_obj;
-
-    ASSERT(slot->SectorCount);
-
-    DBG("GRUB4DOS SourceDrive: 0x%02x\n", slot->SourceDrive);
-    DBG("GRUB4DOS DestDrive: 0x%02x\n", slot->DestDrive);
-    DBG("GRUB4DOS MaxHead: %d\n", slot->MaxHead);
-    DBG("GRUB4DOS MaxSector: %d\n", slot->MaxSector);
-    DBG("GRUB4DOS DestMaxCylinder: %d\n", slot->DestMaxCylinder);
-    DBG("GRUB4DOS DestMaxHead: %d\n", slot->DestMaxHead);
-    DBG("GRUB4DOS DestMaxSector: %d\n", slot->DestMaxSector);
-    DBG("GRUB4DOS SectorStart: 0x%08x\n", slot->SectorStart);
-    DBG("GRUB4DOS SectorCount: %d\n", slot->SectorCount);
-
-    if (slot->SourceODD) {
-        media_type = WvlDiskMediaTypeOptical;
-        sector_size = 2048;
-      } else {
-        media_type =
-          (slot->SourceDrive & 0x80) ?
-          WvlDiskMediaTypeHard :
-          WvlDiskMediaTypeFloppy;
-        sector_size = 512;
-      }
-
-    /* Check for a RAM disk mapping */
-    if (slot->DestDrive == 0xFF) {
-        new_dev_obj = WvRamdiskCreateG4dDisk(
-            slot,
-            bus_dev_obj,
-            media_type,
-            sector_size
-          );
-      } else {
-        new_dev_obj = WvFilediskCreateG4dDisk(
-            slot,
-            bus_dev_obj,
-            media_type,
-            sector_size
-          );
-      }
-
-    return new_dev_obj;
+    F_WV_G4D_CREATE_DISK * create;
+
+    DBG("GRUB4DOS Slot: %u\n", map->Slot);
+    DBG("GRUB4DOS Kind: %d\n", map->Kind);
+    DBG("GRUB4DOS SourceDrive: 0x%02x\n", map->SourceDrive);
+    DBG("GRUB4DOS DestDrive: 0x%02x\n", map->DestDrive);
+    DBG("GRUB4DOS Heads: %u\n", map->Heads);
+    DBG("GRUB4DOS Sectors: %u\n", map->Sectors);
+    DBG("GRUB4DOS Offset: 0x%08I64X\n", map->Offset);
+    DBG("GRUB4DOS Length: %I64u\n", map->Length);
+
+    create = WvG4dCreators[map->Kind];
+    if (!create)
+      return NULL;
+    return create(
+        map,
+        bus_dev_obj,
+        WvG4dMediaTypes[map->Media],
+        map->SectorSize
+      );
   }
 
 NTSTATUS WvG4dCreateDisk(
@@ -0,0 +1,230 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * GRUB4DOS drive map table decoder.
+ *
+ * Each slot is laid out as GRUB4DOS 0.4.4's stage2/shared.h has it:
+ *
+ *   0    source drive
+ *   1    destination drive; 0xFF for RAM
+ *   2    source maximum head
+ *   3    bits 0-5: source maximum sector; bit 6: restriction
+ *   4-5  bits 0-12: destination maximum cylinder; bit 13: source is
+ *        an optical drive; bit 14: destination is an optical drive;
+ *        bit 15: destination supports LBA
+ *   6    destination maximum head
+ *   7    bits 0-5: destination maximum sector; bit 6: restriction;
+ *        bit 7: in-situ
+ *   8    start sector, 64-bit
+ *   16   sector count, 64-bit
+ *
+ * A slot is decoded into a set of traits, which are then matched
+ * against the rule tables below.  Within a table, the first rule whose
+ * traits match wins.
+ */
+
+#include "g4dmap.h"
+
+/** Macros */
+
+/* Slot traits */
+#define WV_M_G4D_MAP_SOURCE_ODD 0x01
+#define WV_M_G4D_MAP_SOURCE_HARD 0x02
+#define WV_M_G4D_MAP_DEST_ODD 0x04
+#define WV_M_G4D_MAP_DEST_RAM 0x08
+#define WV_M_G4D_MAP_IN_SITU 0x10
+#define WV_M_G4D_MAP_SECTORS 0x20
+
+/* Memory is addressed in 512-byte sectors */
+#define WV_M_G4D_MAP_RAM_SECTOR 512
+
+/** Object types */
+typedef struct WV_G4D_MAP_RULE_ WV_S_G4D_MAP_RULE_;
+
+/** Struct/union type definitions */
+
+/* Slots whose traits, masked with Mask, equal Traits get Value */
+struct WV_G4D_MAP_RULE_ {
+    unsigned int Mask;
+    unsigned int Traits;
+    unsigned int Value;
+    unsigned int SectorSize;
+  };
+
+/** Objects */
+
+/*
+ * What the source drive is mapped to.  A slot without a sector count
+ * is a remap whatever its destination, so that rule comes first
+ */
+static const WV_S_G4D_MAP_RULE_ WvG4dMapKindRules_[] = {
+    { WV_M_G4D_MAP_SECTORS, 0, WvG4dMapKindRemap, 0 },
+    { WV_M_G4D_MAP_DEST_RAM, WV_M_G4D_MAP_DEST_RAM, WvG4dMapKindRam, 0 },
+    { WV_M_G4D_MAP_IN_SITU, WV_M_G4D_MAP_IN_SITU, WvG4dMapKindInSitu, 0 },
+    { 0, 0, WvG4dMapKindSector, 0 },
+  };
+
+/* What the source drive is, and its sector size */
+static const WV_S_G4D_MAP_RULE_ WvG4dMapMediaRules_[] = {
+    {
+        WV_M_G4D_MAP_SOURCE_ODD,
+        WV_M_G4D_MAP_SOURCE_ODD,
+        WvG4dMapMediaOptical,
+        2048,
+      },
+    {
+        WV_M_G4D_MAP_SOURCE_HARD,
+        WV_M_G4D_MAP_SOURCE_HARD,
+        WvG4dMapMediaHard,
+        512,
+      },
+    { 0, 0, WvG4dMapMediaFloppy, 512 },
+  };
+
+/* The units of the start sector and sector count */
+static const WV_S_G4D_MAP_RULE_ WvG4dMapUnitRules_[] = {
+    {
+        WV_M_G4D_MAP_DEST_RAM,
+        WV_M_G4D_MAP_DEST_RAM,
+        0,
+        WV_M_G4D_MAP_RAM_SECTOR,
+      },
+    { WV_M_G4D_MAP_DEST_ODD, WV_M_G4D_MAP_DEST_ODD, 0, 2048 },
+    { 0, 0, 0, 512 },
+  };
+
+/** Private function declarations */
+static unsigned long long WvG4dMapGet_(const unsigned char *, unsigned int);
+static int WvG4dMapIsEmpty_(const unsigned char *);
+static const WV_S_G4D_MAP_RULE_ * WvG4dMapMatch_(
+    const WV_S_G4D_MAP_RULE_ *,
+    unsigned int
+  );
+static unsigned int WvG4dMapTraits_(const unsigned char *);
+
+/** Private function definitions */
+
+/* Fetch a little-endian value */
+static unsigned long long WvG4dMapGet_(
+    const unsigned char * p,
+    unsigned int len
+  ) {
+    unsigned long long value = 0;
+
+    while (len--)
+      value = value << 8 | p[len];
+    return value;
+  }
+
+/* Is a slot all zeroes? */
+static int WvG4dMapIsEmpty_(const unsigned char * slot) {
+    unsigned int i;
+
+    for (i = 0; i < WV_M_G4D_MAP_SLOT_SIZE; ++i) {
+        if (slot[i])
+          return 0;
+      }
+    return 1;
+  }
+
+/* Find the first rule matching some traits */
+static const WV_S_G4D_MAP_RULE_ * WvG4dMapMatch_(
+    const WV_S_G4D_MAP_RULE_ * rule,
+    unsigned int traits
+  ) {
+    /* Every table ends with a rule which matches anything. */
+    while ((traits & rule->Mask) != rule->Traits)
+      ++rule;
+    return rule;
+  }
+
+/* Work out a slot's traits */
+static unsigned int WvG4dMapTraits_(const unsigned char * slot) {
+    unsigned int flags = (unsigned int) WvG4dMapGet_(slot + 4, 2);
+    unsigned int traits = 0;
+
+    if (flags & 0x2000)
+      traits |= WV_M_G4D_MAP_SOURCE_ODD;
+    if (slot[0] & 0x80)
+      traits |= WV_M_G4D_MAP_SOURCE_HARD;
+    if (flags & 0x4000)
+      traits |= WV_M_G4D_MAP_DEST_ODD;
+    if (slot[1] == 0xFF)
+      traits |= WV_M_G4D_MAP_DEST_RAM;
+    if (slot[7] & 0x80)
+      traits |= WV_M_G4D_MAP_IN_SITU;
+    if (WvG4dMapGet_(slot + 16, 8))
+      traits |= WV_M_G4D_MAP_SECTORS;
+    return traits;
+  }
+
+/** Exported function definitions */
+
+/* See the header for details. */
+unsigned int WvG4dMapScan(
+    const unsigned char * low_mem,
+    unsigned long low_mem_len,
+    unsigned long table,
+    WV_SP_G4D_MAP maps
+  ) {
+    const unsigned char * slot;
+    const WV_S_G4D_MAP_RULE_ * media;
+    unsigned int traits;
+    unsigned int unit;
+    unsigned int count;
+    unsigned int i;
+
+    if (
+        table > low_mem_len ||
+        low_mem_len - table < WV_M_G4D_MAP_SLOTS * WV_M_G4D_MAP_SLOT_SIZE
+      )
+      return 0;
+
+    count = 0;
+    for (i = 0; i < WV_M_G4D_MAP_SLOTS; ++i) {
+        slot = low_mem + table + i * WV_M_G4D_MAP_SLOT_SIZE;
+        if (WvG4dMapIsEmpty_(slot))
+          break;
+
+        traits = WvG4dMapTraits_(slot);
+        media = WvG4dMapMatch_(WvG4dMapMediaRules_, traits);
+        unit = WvG4dMapMatch_(WvG4dMapUnitRules_, traits)->SectorSize;
+
+        maps->Slot = i;
+        maps->Kind = WvG4dMapMatch_(WvG4dMapKindRules_, traits)->Value;
+        maps->Media = media->Value;
+        maps->SectorSize = media->SectorSize;
+        maps->SourceDrive = slot[0];
+        maps->DestDrive = slot[1];
+        maps->Heads = slot[2] + 1;
+        /* An optical drive has no geometry, so make one up. */
+        maps->Sectors = slot[7] & 0x3F;
+        if (!maps->Sectors)
+          maps->Sectors = 1;
+        maps->Offset = WvG4dMapGet_(slot + 8, 8) * unit;
+        maps->Length = WvG4dMapGet_(slot + 16, 8) * unit;
+        if (maps->Kind == WvG4dMapKindRemap)
+          maps->Offset = 0;
+        ++maps;
+        ++count;
+      }
+    return count;
+  }
@@ -2,7 +2,7 @@
 
 set libname=grub4dos
 
-set c=g4dbus.c fdo.c
+set c=g4dbus.c fdo.c g4dmap.c
 
 echo !INCLUDE $(NTMAKEENV)\makefile.def	> makefile
 
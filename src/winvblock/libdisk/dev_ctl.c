@@ -43,6 +43,17 @@
 #include "disk.h"
 #include "debug.h"
 
+/* Not defined by older DDKs */
+#define WVL_M_DISK_DEVCTL_SEEK_PENALTY_PROP ((STORAGE_PROPERTY_ID) 7)
+#define WVL_M_DISK_DEVCTL_TRIM_PROP ((STORAGE_PROPERTY_ID) 8)
+
+/* The layout of both the seek penalty and the trim descriptors */
+typedef struct WVL_DISK_DEVCTL_FLAG_DESC_ {
+    ULONG Version;
+    ULONG Size;
+    BOOLEAN Flag;
+  } WVL_S_DISK_DEVCTL_FLAG_DESC_;
+
 static NTSTATUS STDCALL WvlDiskDevCtlStorageQueryProp_(
     IN WVL_SP_DISK_T disk,
     IN PIRP irp
@@ -53,6 +64,7 @@ static NTSTATUS STDCALL WvlDiskDevCtlStorageQueryProp_(
     UINT32 copy_size;
     STORAGE_ADAPTER_DESCRIPTOR storage_adapter_desc;
     STORAGE_DEVICE_DESCRIPTOR storage_dev_desc;
+    WVL_S_DISK_DEVCTL_FLAG_DESC_ flag_desc;
 
     if (
         storage_prop_query->PropertyId == StorageAdapterProperty &&
@@ -116,6 +128,37 @@ static NTSTATUS STDCALL WvlDiskDevCtlStorageQueryProp_(
         status = STATUS_SUCCESS;
       }
 
+    if (
+        (
+            storage_prop_query->PropertyId ==
+              WVL_M_DISK_DEVCTL_SEEK_PENALTY_PROP ||
+            storage_prop_query->PropertyId == WVL_M_DISK_DEVCTL_TRIM_PROP
+          ) &&
+        storage_prop_query->QueryType == PropertyStandardQuery
+      ) {
+        copy_size = (
+            io_stack_loc->Parameters.DeviceIoControl.OutputBufferLength <
+            sizeof flag_desc ?
+            io_stack_loc->Parameters.DeviceIoControl.OutputBufferLength :
+            sizeof flag_desc
+          );
+        flag_desc.Version = sizeof flag_desc;
+        flag_desc.Size = sizeof flag_desc;
+        if (
+            storage_prop_query->PropertyId ==
+            WVL_M_DISK_DEVCTL_SEEK_PENALTY_PROP
+          )
+          flag_desc.Flag = (BOOLEAN) !disk->NonRotational;
+          else
+          flag_desc.Flag = (BOOLEAN) (disk->disk_ops.Unmap != NULL);
+        RtlCopyMemory(
+            irp->AssociatedIrp.SystemBuffer,
+            &flag_desc,
+            copy_size
+          );
+        status = STATUS_SUCCESS;
+      }
+
     if (status == STATUS_INVALID_PARAMETER) {
         DBG(
             "!!Invalid IOCTL_STORAGE_QUERY_PROPERTY "
@@ -0,0 +1,96 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * Disk submission queue.
+ */
+
+#include "diskqueue.h"
+
+/** Exported function definitions */
+
+/* See the header for details. */
+void WvlDiskQueueInit(WVL_SP_DISK_QUEUE queue, unsigned int depth) {
+    unsigned int i;
+
+    queue->Depth = depth;
+    queue->InFlight = 0;
+    queue->Waiting = 0;
+    queue->NextList = 0;
+    for (i = 0; i < WVL_M_DISK_QUEUE_LISTS; ++i)
+      queue->Lists[i].Head = queue->Lists[i].Tail = 0;
+    return;
+  }
+
+/* See the header for details. */
+int WvlDiskQueueSubmit(
+    WVL_SP_DISK_QUEUE queue,
+    unsigned int list_num,
+    WVL_SP_DISK_QUEUE_ENTRY entry
+  ) {
+    WVL_SP_DISK_QUEUE_LIST list;
+
+    /* Nobody waits while there's a free slot. */
+    if (!queue->Depth || queue->InFlight < queue->Depth) {
+        ++queue->InFlight;
+        return 1;
+      }
+
+    list = queue->Lists + list_num % WVL_M_DISK_QUEUE_LISTS;
+    entry->Next = 0;
+    if (list->Tail)
+      list->Tail->Next = entry;
+      else
+      list->Head = entry;
+    list->Tail = entry;
+    ++queue->Waiting;
+    return 0;
+  }
+
+/* See the header for details. */
+WVL_SP_DISK_QUEUE_ENTRY WvlDiskQueueComplete(WVL_SP_DISK_QUEUE queue) {
+    WVL_SP_DISK_QUEUE_LIST list;
+    WVL_SP_DISK_QUEUE_ENTRY entry;
+    unsigned int i;
+
+    if (!queue->Waiting) {
+        --queue->InFlight;
+        return 0;
+      }
+
+    /* Hand the slot on, taking the lists in turn. */
+    for (i = 0; i < WVL_M_DISK_QUEUE_LISTS; ++i) {
+        list = queue->Lists +
+          (queue->NextList + i) % WVL_M_DISK_QUEUE_LISTS;
+        entry = list->Head;
+        if (!entry)
+          continue;
+        list->Head = entry->Next;
+        if (!list->Head)
+          list->Tail = 0;
+        --queue->Waiting;
+        queue->NextList = (queue->NextList + i + 1) % WVL_M_DISK_QUEUE_LISTS;
+        return entry;
+      }
+
+    /* Not reached while the count of waiting requests is right. */
+    --queue->InFlight;
+    return 0;
+  }
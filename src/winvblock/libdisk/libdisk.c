@@ -43,6 +43,56 @@ static long long __divdi3(long long u, long long v) {
   }
 #endif
 
+/** Private. */
+
+typedef struct WVL_DISK_SPLIT_ WVL_S_DISK_SPLIT_, * WVL_SP_DISK_SPLIT_;
+
+/* A part of a request, issued with its own IRP */
+typedef struct WVL_DISK_PART_ {
+    WVL_S_DISK_QUEUE_ENTRY Entry;
+    WVL_SP_DISK_SPLIT_ Split;
+    LONGLONG StartSector;
+    UINT32 SectorCount;
+    UINT32 Offset;
+    PIRP Irp;
+  } WVL_S_DISK_PART_, * WVL_SP_DISK_PART_;
+
+/*
+ * A request in parts, none larger than its disk can take.  A request
+ * for a disk with a queue depth is issued this way even if it fits,
+ * so that its completion frees its slot.
+ */
+struct WVL_DISK_SPLIT_ {
+    WVL_SP_DISK_T Disk;
+    WVL_E_DISK_IO_MODE Mode;
+    PMDL Mdl;
+    PIRP Parent;
+    /* The number of parts not yet completed, plus one while issuing */
+    LONG Outstanding;
+    /* The first failure, if any */
+    NTSTATUS Status;
+    UINT32 Bytes;
+    WVL_S_DISK_PART_ Parts[1];
+  };
+
+static NTSTATUS STDCALL WvlDiskIoMdlWhole_(
+    IN WVL_SP_DISK_T,
+    IN WVL_E_DISK_IO_MODE,
+    IN LONGLONG,
+    IN UINT32,
+    IN PMDL,
+    IN UINT32,
+    IN PIRP
+  );
+static VOID STDCALL WvlDiskPartIssue_(IN WVL_SP_DISK_PART_);
+static WVL_F_THREAD_ITEM WvlDiskIssueReady_;
+static VOID STDCALL WvlDiskSplitPut_(IN WVL_SP_DISK_SPLIT_);
+static NTSTATUS STDCALL WvlDiskSplitDone_(
+    IN PDEVICE_OBJECT,
+    IN PIRP,
+    IN PVOID
+  );
+
 /** Exports. */
 WVL_M_LIB BOOLEAN WvlDiskIsRemovable[WvlDiskMediaTypes] = {TRUE, FALSE, TRUE};
 WVL_M_LIB PWCHAR WvlDiskCompatIds[WvlDiskMediaTypes] = {
@@ -322,6 +372,9 @@ WVL_M_LIB VOID WvlDiskGuessGeometry(
  */
 WVL_M_LIB VOID STDCALL WvlDiskInit(IN OUT WVL_SP_DISK_T Disk) {
     RtlZeroMemory(Disk, sizeof *Disk);
+    KeInitializeSpinLock(&Disk->QueueLock);
+    WvlDiskQueueInit(&Disk->Queue, 0);
+    Disk->IssueItem.Func = WvlDiskIssueReady_;
     return;
   }
 
@@ -347,6 +400,259 @@ WVL_M_LIB NTSTATUS STDCALL WvlDiskIo(
     return WvlIrpComplete(Irp, 0, STATUS_DRIVER_INTERNAL_ERROR);
   }
 
+/* See WVL_F_DISK_IO_MDL in the header for details. */
+WVL_M_LIB NTSTATUS STDCALL WvlDiskIoMdl(
+    IN WVL_SP_DISK_T Disk,
+    IN WVL_E_DISK_IO_MODE Mode,
+    IN LONGLONG StartSector,
+    IN UINT32 SectorCount,
+    IN PMDL Mdl,
+    IN UINT32 Offset,
+    IN PIRP Irp
+  ) {
+    WVL_SP_DISK_SPLIT_ split;
+    WVL_SP_DISK_PART_ part;
+    UINT32 max;
+    UINT32 parts;
+    UINT32 done;
+    UINT32 count;
+    UINT32 i;
+    KIRQL irql;
+    BOOLEAN now;
+
+    max = WvlDiskMaxXferLen(Disk) / Disk->SectorSize;
+    if (!max)
+      max = 1;
+    if (SectorCount <= max && !Disk->Queue.Depth) {
+        return WvlDiskIoMdlWhole_(
+            Disk,
+            Mode,
+            StartSector,
+            SectorCount,
+            Mdl,
+            Offset,
+            Irp
+          );
+      }
+
+    /*
+     * Issue the request in parts, each with its own IRP.  The request's
+     * IRP is completed when the last part is.
+     */
+    parts = SectorCount / max + (SectorCount % max ? 1 : 0);
+    if (!parts)
+      parts = 1;
+    split = wv_malloc(sizeof *split + (parts - 1) * sizeof *split->Parts);
+    if (!split)
+      return WvlIrpComplete(Irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+    split->Disk = Disk;
+    split->Mode = Mode;
+    split->Mdl = Mdl;
+    split->Parent = Irp;
+    split->Outstanding = 1;
+    split->Status = STATUS_SUCCESS;
+    split->Bytes = SectorCount * Disk->SectorSize;
+    IoMarkIrpPending(Irp);
+
+    for (i = done = 0; i < parts; ++i, done += count) {
+        count = SectorCount - done;
+        if (count > max)
+          count = max;
+
+        part = split->Parts + i;
+        part->Split = split;
+        part->StartSector = StartSector + done;
+        part->SectorCount = count;
+        part->Offset = Offset + done * Disk->SectorSize;
+        part->Irp = IoAllocateIrp(1, FALSE);
+        if (!part->Irp) {
+            DBG("Couldn't allocate IRP for part of request!\n");
+            split->Status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+          }
+        IoSetCompletionRoutine(
+            part->Irp,
+            WvlDiskSplitDone_,
+            part,
+            TRUE,
+            TRUE,
+            TRUE
+          );
+        /* The disk sees the stack location with our completion routine. */
+        IoSetNextIrpStackLocation(part->Irp);
+        InterlockedIncrement(&split->Outstanding);
+
+        /* Wait for a slot, if the disk has a queue depth. */
+        now = TRUE;
+        if (Disk->Queue.Depth) {
+            KeAcquireSpinLock(&Disk->QueueLock, &irql);
+            now = (BOOLEAN) WvlDiskQueueSubmit(
+                &Disk->Queue,
+                KeGetCurrentProcessorNumber(),
+                &part->Entry
+              );
+            KeReleaseSpinLock(&Disk->QueueLock, irql);
+          }
+        if (now)
+          WvlDiskPartIssue_(part);
+      }
+    WvlDiskSplitPut_(split);
+    return STATUS_PENDING;
+  }
+
+/* Issue an MDL request which the disk can take in one go. */
+static NTSTATUS STDCALL WvlDiskIoMdlWhole_(
+    IN WVL_SP_DISK_T Disk,
+    IN WVL_E_DISK_IO_MODE Mode,
+    IN LONGLONG StartSector,
+    IN UINT32 SectorCount,
+    IN PMDL Mdl,
+    IN UINT32 Offset,
+    IN PIRP Irp
+  ) {
+    PUCHAR buffer;
+
+    if (Disk->disk_ops.IoMdl) {
+        return Disk->disk_ops.IoMdl(
+            Disk,
+            Mode,
+            StartSector,
+            SectorCount,
+            Mdl,
+            Offset,
+            Irp
+          );
+      }
+
+    /* Map the whole buffer for the disk's plain I/O routine. */
+    buffer = MmGetSystemAddressForMdlSafe(Mdl, HighPagePriority);
+    if (!buffer)
+      return WvlIrpComplete(Irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+    return WvlDiskIo(
+        Disk,
+        Mode,
+        StartSector,
+        SectorCount,
+        buffer + Offset,
+        Irp
+      );
+  }
+
+/* Hand a part of a request to its disk. */
+static VOID STDCALL WvlDiskPartIssue_(IN WVL_SP_DISK_PART_ part) {
+    WVL_SP_DISK_SPLIT_ split = part->Split;
+
+    WvlDiskIoMdlWhole_(
+        split->Disk,
+        split->Mode,
+        part->StartSector,
+        part->SectorCount,
+        split->Mdl,
+        part->Offset,
+        part->Irp
+      );
+    return;
+  }
+
+/*
+ * Issue the parts which completions have given slots, in a pool worker.
+ * The disk's Issuing flag is set, so nothing else issues them meanwhile.
+ */
+static VOID STDCALL WvlDiskIssueReady_(IN OUT WVL_SP_THREAD_ITEM item) {
+    WVL_SP_DISK_T disk = CONTAINING_RECORD(item, WVL_S_DISK_T, IssueItem);
+    WVL_SP_DISK_QUEUE_ENTRY entry;
+    BOOLEAN last;
+    KIRQL irql;
+
+    do {
+        KeAcquireSpinLock(&disk->QueueLock, &irql);
+        entry = disk->Ready.Head;
+        disk->Ready.Head = entry->Next;
+        /*
+         * Once the list is empty, a completion must schedule us again.
+         * Our last part might complete the last request, so we mustn't
+         * touch the disk after issuing it.
+         */
+        last = !disk->Ready.Head;
+        if (last) {
+            disk->Ready.Tail = NULL;
+            disk->Issuing = FALSE;
+          }
+        KeReleaseSpinLock(&disk->QueueLock, irql);
+
+        WvlDiskPartIssue_(CONTAINING_RECORD(entry, WVL_S_DISK_PART_, Entry));
+      } while (!last);
+    return;
+  }
+
+/* Note that a part of a split request is done. */
+static VOID STDCALL WvlDiskSplitPut_(IN WVL_SP_DISK_SPLIT_ split) {
+    NTSTATUS status;
+
+    if (InterlockedDecrement(&split->Outstanding))
+      return;
+
+    status = split->Status;
+    WvlIrpComplete(
+        split->Parent,
+        NT_SUCCESS(status) ? split->Bytes : 0,
+        status
+      );
+    wv_free(split);
+    return;
+  }
+
+/* Completion routine for a part of a split request. */
+static NTSTATUS STDCALL WvlDiskSplitDone_(
+    IN PDEVICE_OBJECT dev_obj,
+    IN PIRP irp,
+    IN PVOID context
+  ) {
+    WVL_SP_DISK_PART_ part = context;
+    WVL_SP_DISK_SPLIT_ split = part->Split;
+    WVL_SP_DISK_T disk = split->Disk;
+    WVL_SP_DISK_QUEUE_ENTRY next;
+    BOOLEAN schedule = FALSE;
+    KIRQL irql;
+
+    /* Keep the first failure. */
+    if (!NT_SUCCESS(irp->IoStatus.Status)) {
+        InterlockedCompareExchange(
+            &split->Status,
+            irp->IoStatus.Status,
+            STATUS_SUCCESS
+          );
+      }
+    IoFreeIrp(irp);
+
+    /*
+     * Our slot goes to the next waiting part, of whichever request.  It
+     * isn't issued from here: a disk might complete it at once, so we'd
+     * recurse, and we might be called with the disk's own locks held.
+     */
+    if (disk->Queue.Depth) {
+        KeAcquireSpinLock(&disk->QueueLock, &irql);
+        next = WvlDiskQueueComplete(&disk->Queue);
+        if (next) {
+            next->Next = NULL;
+            if (disk->Ready.Tail)
+              disk->Ready.Tail->Next = next;
+              else
+              disk->Ready.Head = next;
+            disk->Ready.Tail = next;
+            if (!disk->Issuing)
+              schedule = disk->Issuing = TRUE;
+          }
+        KeReleaseSpinLock(&disk->QueueLock, irql);
+        /* Without the pool, the part must still be issued somehow. */
+        if (schedule && !WvlThreadPoolAddItem(&disk->IssueItem))
+          WvlDiskIssueReady_(&disk->IssueItem);
+      }
+    WvlDiskSplitPut_(split);
+    /* The IRP is gone, so the I/O manager mustn't touch it. */
+    return STATUS_MORE_PROCESSING_REQUIRED;
+  }
+
 /* See WVL_F_DISK_MAX_XFER_LEN in the header for details. */
 WVL_M_LIB UINT32 WvlDiskMaxXferLen(IN WVL_SP_DISK_T Disk) {
     /* Use the disk operation, if there is one. */
@@ -354,3 +660,24 @@ WVL_M_LIB UINT32 WvlDiskMaxXferLen(IN WVL_SP_DISK_T Disk) {
       return Disk->disk_ops.MaxXferLen(Disk);
     return 1024 * 1024;
   }
+
+/* See WVL_F_DISK_FLUSH in the header for details. */
+WVL_M_LIB NTSTATUS STDCALL WvlDiskFlush(IN WVL_SP_DISK_T Disk, IN PIRP Irp) {
+    /* Without a flush operation, every write is already durable. */
+    if (Disk->disk_ops.Flush)
+      return Disk->disk_ops.Flush(Disk, Irp);
+    return WvlIrpComplete(Irp, 0, STATUS_SUCCESS);
+  }
+
+/* See WVL_F_DISK_UNMAP in the header for details. */
+WVL_M_LIB NTSTATUS STDCALL WvlDiskUnmap(
+    IN WVL_SP_DISK_T Disk,
+    IN WVL_SP_DISK_RANGE Ranges,
+    IN UINT32 Count,
+    IN PIRP Irp
+  ) {
+    /* An unmap is only advice, so ignoring it is fine. */
+    if (Disk->disk_ops.Unmap)
+      return Disk->disk_ops.Unmap(Disk, Ranges, Count, Irp);
+    return WvlIrpComplete(Irp, 0, STATUS_SUCCESS);
+  }
@@ -32,6 +32,7 @@
 
 #include "portable.h"
 #include "winvblock.h"
+#include "wv_stdlib.h"
 #include "driver.h"
 #include "bus.h"
 #include "device.h"
@@ -65,8 +66,75 @@ WVL_F_DISK_SCSI_ WvlDiskScsiReadCapacity_;
 WVL_F_DISK_SCSI_ WvlDiskScsiReadCapacity16_;
 WVL_F_DISK_SCSI_ WvlDiskScsiModeSense_;
 WVL_F_DISK_SCSI_ WvlDiskScsiReadToc_;
+WVL_F_DISK_SCSI_ WvlDiskScsiSynchronizeCache_;
+WVL_F_DISK_SCSI_ WvlDiskScsiInquiry_;
+WVL_F_DISK_SCSI_ WvlDiskScsiUnmap_;
+WVL_F_DISK_SCSI_ WvlDiskScsiWriteSame_;
+WVL_F_DISK_SCSI_ WvlDiskScsiReportLuns_;
+static BOOLEAN WvlDiskScsiCdbRange_(IN PCDB, OUT PULONGLONG, OUT PUINT32);
 WV_F_DEV_SCSI disk_scsi__dispatch;
 
+/* Not defined by older DDKs */
+#ifndef SCSIOP_SYNCHRONIZE_CACHE16
+#  define SCSIOP_SYNCHRONIZE_CACHE16 0x91
+#endif
+#ifndef SCSIOP_UNMAP
+#  define SCSIOP_UNMAP 0x42
+#endif
+#ifndef SCSIOP_READ12
+#  define SCSIOP_READ12 0xA8
+#endif
+#ifndef SCSIOP_WRITE12
+#  define SCSIOP_WRITE12 0xAA
+#endif
+#ifndef SCSIOP_VERIFY12
+#  define SCSIOP_VERIFY12 0xAF
+#endif
+#ifndef SCSIOP_REPORT_LUNS
+#  define SCSIOP_REPORT_LUNS 0xA0
+#endif
+#ifndef SCSIOP_WRITE_SAME
+#  define SCSIOP_WRITE_SAME 0x41
+#endif
+#ifndef SCSIOP_WRITE_SAME16
+#  define SCSIOP_WRITE_SAME16 0x93
+#endif
+#ifndef VPD_SUPPORTED_PAGES
+#  define VPD_SUPPORTED_PAGES 0x00
+#endif
+#ifndef VPD_BLOCK_LIMITS
+#  define VPD_BLOCK_LIMITS 0xB0
+#endif
+#ifndef VPD_BLOCK_DEVICE_CHARACTERISTICS
+#  define VPD_BLOCK_DEVICE_CHARACTERISTICS 0xB1
+#endif
+#ifndef VPD_LOGICAL_BLOCK_PROVISIONING
+#  define VPD_LOGICAL_BLOCK_PROVISIONING 0xB2
+#endif
+
+/* The INQUIRY CDB's bit asking for a vital product data page */
+#define WVL_M_DISK_SCSI_EVPD 0x01
+
+/* Big enough for any vital product data page we produce */
+#define WVL_M_DISK_SCSI_VPD_SIZE 64
+
+/* The size of the standard inquiry data we produce */
+#define WVL_M_DISK_SCSI_INQUIRY_SIZE 36
+
+/* The WRITE SAME CDB's bit asking for the blocks to be unmapped */
+#define WVL_M_DISK_SCSI_WRITE_SAME_UNMAP 0x08
+
+/* The size of a REPORT LUNS header and of each LUN in its list */
+#define WVL_M_DISK_SCSI_LUN_HEADER 8
+#define WVL_M_DISK_SCSI_LUN_SIZE 8
+
+/* The most block descriptors we accept in one UNMAP */
+#define WVL_M_DISK_SCSI_MAX_UNMAP_DESCS 256
+
+/* The sizes of an UNMAP parameter list's header and block descriptors */
+#define WVL_M_DISK_SCSI_UNMAP_HEADER 8
+#define WVL_M_DISK_SCSI_UNMAP_DESC 16
+
 #if _WIN32_WINNT <= 0x0600
 #  if 0        /* FIXME: To build with WINDDK 6001.18001 */
 #    ifdef _MSC_VER
@@ -141,6 +209,61 @@ typedef struct _DISK_CDB16 DISK_CDB16, * PDISK_CDB16;
 }
 #endif          /* if _WIN32_WINNT <= 0x0600 */
 
+/**
+ * Fetch the range of blocks a CDB addresses.
+ *
+ * @v cdb               The command descriptor block.
+ * @v start_sector      Populated with the first block.
+ * @v sector_count      Populated with the number of blocks.
+ * @ret BOOLEAN         FALSE if the CDB's size is unknown.
+ *
+ * The CDB's size is taken from its operation code's group.
+ */
+static BOOLEAN WvlDiskScsiCdbRange_(
+    IN PCDB cdb,
+    OUT PULONGLONG start_sector,
+    OUT PUINT32 sector_count
+  ) {
+    PUCHAR bytes = cdb->AsByte;
+    UINT32 temp;
+
+    switch (bytes[0] >> 5) {
+        case 0:
+          /* 6-byte CDB.  A transfer length of 0 means 256 blocks */
+          *start_sector = ((bytes[1] & 0x1F) << 16) |
+            (bytes[2] << 8) |
+            bytes[3];
+          *sector_count = bytes[4] ? bytes[4] : 256;
+          return TRUE;
+
+        case 1:
+        case 2:
+          /* 10-byte CDB */
+          REVERSE_BYTES(&temp, bytes + 2);
+          *start_sector = temp;
+          *sector_count = (bytes[7] << 8) | bytes[8];
+          return TRUE;
+
+        case 4:
+          /* 16-byte CDB */
+          REVERSE_BYTES_QUAD(start_sector, bytes + 2);
+          REVERSE_BYTES(sector_count, bytes + 10);
+          return TRUE;
+
+        case 5:
+          /* 12-byte CDB */
+          REVERSE_BYTES(&temp, bytes + 2);
+          *start_sector = temp;
+          REVERSE_BYTES(sector_count, bytes + 6);
+          return TRUE;
+
+        default:
+          *start_sector = 0;
+          *sector_count = 0;
+          return FALSE;
+      }
+  }
+
 static NTSTATUS STDCALL WvlDiskScsiReadWrite_(
     IN WVL_SP_DISK_T disk,
     IN PIRP irp,
@@ -150,24 +273,20 @@ static NTSTATUS STDCALL WvlDiskScsiReadWrite_(
   ) {
     ULONGLONG start_sector;
     UINT32 sector_count;
+    WVL_E_DISK_IO_MODE mode;
     NTSTATUS status = STATUS_SUCCESS;
 
-    if (cdb->AsByte[0] == SCSIOP_READ16 || cdb->AsByte[0] == SCSIOP_WRITE16) {
-        REVERSE_BYTES_QUAD(
-            &start_sector,
-            &(((PDISK_CDB16) cdb)->LogicalBlock[0])
-          );
-        REVERSE_BYTES(
-            &sector_count,
-            &(((PDISK_CDB16) cdb )->TransferLength[0])
-          );
-      } else {
-        start_sector = (cdb->CDB10.LogicalBlockByte0 << 24) +
-          (cdb->CDB10.LogicalBlockByte1 << 16) +
-          (cdb->CDB10.LogicalBlockByte2 << 8 ) +
-          cdb->CDB10.LogicalBlockByte3;
-        sector_count = (cdb->CDB10.TransferBlocksMsb << 8) +
-          cdb->CDB10.TransferBlocksLsb;
+    WvlDiskScsiCdbRange_(cdb, &start_sector, &sector_count);
+    switch (cdb->AsByte[0]) {
+        case SCSIOP_READ6:
+        case SCSIOP_READ:
+        case SCSIOP_READ12:
+        case SCSIOP_READ16:
+          mode = WvlDiskIoModeRead;
+          break;
+
+        default:
+          mode = WvlDiskIoModeWrite;
       }
     if (start_sector >= disk->LBADiskSize) {
         DBG("Fixed sector_count (start_sector off disk)!!\n");
@@ -196,51 +315,20 @@ static NTSTATUS STDCALL WvlDiskScsiReadWrite_(
         return status;
       }
 
-    if ((
-        (
+    /* The disk decides how much of the buffer to map, and when. */
+    *completion = TRUE;
+    return WvlDiskIoMdl(
+        disk,
+        mode,
+        start_sector,
+        sector_count,
+        irp->MdlAddress,
+        (UINT32) (
             (PUCHAR) srb->DataBuffer -
             (PUCHAR) MmGetMdlVirtualAddress(irp->MdlAddress)
-          ) + (PUCHAR) MmGetSystemAddressForMdlSafe(
-              irp->MdlAddress,
-              HighPagePriority
-      )) == NULL) {
-        status = STATUS_INSUFFICIENT_RESOURCES;
-        irp->IoStatus.Information = 0;
-        return status;
-      }
-
-    if (cdb->AsByte[0] == SCSIOP_READ || cdb->AsByte[0] == SCSIOP_READ16) {
-        status = WvlDiskIo(
-            disk,
-            WvlDiskIoModeRead,
-            start_sector,
-            sector_count,
-            ((PUCHAR) srb->DataBuffer -
-              (PUCHAR) MmGetMdlVirtualAddress(irp->MdlAddress)) +
-              (PUCHAR) MmGetSystemAddressForMdlSafe(
-                  irp->MdlAddress,
-                  HighPagePriority
-              ),
-            irp
-          );
-      } else {
-        status = WvlDiskIo(
-            disk,
-            WvlDiskIoModeWrite,
-            start_sector,
-            sector_count,
-            ((PUCHAR) srb->DataBuffer -
-              (PUCHAR) MmGetMdlVirtualAddress(irp->MdlAddress)) +
-              (PUCHAR) MmGetSystemAddressForMdlSafe(
-                  irp->MdlAddress,
-                  HighPagePriority
-              ),
-            irp
-          );
-      }
-    if (status != STATUS_PENDING)
-      *completion = TRUE;
-    return status;
+          ),
+        irp
+      );
   }
 
 static NTSTATUS STDCALL WvlDiskScsiVerify_(
@@ -250,26 +338,10 @@ static NTSTATUS STDCALL WvlDiskScsiVerify_(
     IN PCDB cdb,
     OUT PBOOLEAN completion
   ) {
-    LONGLONG start_sector;
+    ULONGLONG start_sector;
     UINT32 sector_count;
 
-    if (cdb->AsByte[0] == SCSIOP_VERIFY16) {
-        REVERSE_BYTES_QUAD(
-            &start_sector,
-            &(((PDISK_CDB16) cdb)->LogicalBlock[0])
-          );
-        REVERSE_BYTES(
-            &sector_count,
-            &(((PDISK_CDB16) cdb)->TransferLength[0])
-          );
-      } else {
-        start_sector = (cdb->CDB10.LogicalBlockByte0 << 24) +
-          (cdb->CDB10.LogicalBlockByte1 << 16) +
-          (cdb->CDB10.LogicalBlockByte2 << 8) +
-          cdb->CDB10.LogicalBlockByte3;
-        sector_count = (cdb->CDB10.TransferBlocksMsb << 8) +
-          cdb->CDB10.TransferBlocksLsb;
-      }
+    WvlDiskScsiCdbRange_(cdb, &start_sector, &sector_count);
     #if 0
     srb->DataTransferLength = sector_count * SECTORSIZE;
     #endif
@@ -321,6 +393,22 @@ static NTSTATUS STDCALL WvlDiskScsiReadCapacity16_(
         &big_temp
       );
     irp->IoStatus.Information = sizeof (READ_CAPACITY_DATA_EX);
+
+    /*
+     * The next four bytes hold protection and alignment details, none
+     * of which we have, and the LBPME bit for thin provisioning.
+     */
+    if (
+        disk->disk_ops.Unmap &&
+        srb->DataTransferLength >= sizeof (READ_CAPACITY_DATA_EX) + 4
+      ) {
+        PUCHAR extra = srb->DataBuffer;
+
+        extra += sizeof (READ_CAPACITY_DATA_EX);
+        RtlZeroMemory(extra, 4);
+        extra[2] = 0x80;
+        irp->IoStatus.Information += 4;
+      }
     srb->SrbStatus = SRB_STATUS_SUCCESS;
     return STATUS_SUCCESS;
   }
@@ -376,6 +464,299 @@ static NTSTATUS STDCALL WvlDiskScsiReadToc_(
     return STATUS_SUCCESS;
   }
 
+/*
+ * Handle a cache flush.  This is also used for SRB_FUNCTION_FLUSH and
+ * SRB_FUNCTION_SHUTDOWN, whose CDB is not looked at.
+ */
+static NTSTATUS STDCALL WvlDiskScsiSynchronizeCache_(
+    IN WVL_SP_DISK_T disk,
+    IN PIRP irp,
+    IN PSCSI_REQUEST_BLOCK srb,
+    IN PCDB cdb,
+    OUT PBOOLEAN completion
+  ) {
+    srb->SrbStatus = SRB_STATUS_SUCCESS;
+    /* The flush completes the IRP, possibly from another thread. */
+    *completion = TRUE;
+    return WvlDiskFlush(disk, irp);
+  }
+
+/*
+ * Handle an INQUIRY.  The standard inquiry data and the vital product
+ * data pages both describe what the disk's backend can do.
+ */
+static NTSTATUS STDCALL WvlDiskScsiInquiry_(
+    IN WVL_SP_DISK_T disk,
+    IN PIRP irp,
+    IN PSCSI_REQUEST_BLOCK srb,
+    IN PCDB cdb,
+    OUT PBOOLEAN completion
+  ) {
+    static const char * products[WvlDiskMediaTypes] = {
+        "Floppy Disk     ",
+        "Hard Disk       ",
+        "Optical Disc    ",
+      };
+    UCHAR page[WVL_M_DISK_SCSI_VPD_SIZE];
+    BOOLEAN thin = (BOOLEAN) (disk->disk_ops.Unmap != NULL);
+    UINT32 len;
+    UINT32 temp;
+
+    irp->IoStatus.Information = 0;
+    srb->SrbStatus = SRB_STATUS_SUCCESS;
+
+    RtlZeroMemory(page, sizeof page);
+    page[0] = (UCHAR) (
+        disk->Media == WvlDiskMediaTypeOptical ?
+        READ_ONLY_DIRECT_ACCESS_DEVICE :
+        DIRECT_ACCESS_DEVICE
+      );
+
+    if (!(cdb->AsByte[1] & WVL_M_DISK_SCSI_EVPD)) {
+        if (cdb->AsByte[2])
+          goto err_page;
+        len = WVL_M_DISK_SCSI_INQUIRY_SIZE;
+        if (WvlDiskIsRemovable[disk->Media])
+          page[1] = 0x80;
+        /* SPC-3, with the standard response data format */
+        page[2] = 0x05;
+        page[3] = 0x02;
+        page[4] = (UCHAR) (len - 5);
+        /* CmdQue: we accept more than one request at a time */
+        page[7] = 0x02;
+        RtlCopyMemory(page + 8, "WinVBlk ", 8);
+        RtlCopyMemory(page + 16, products[disk->Media], 16);
+        RtlCopyMemory(page + 32, "0018", 4);
+        goto out;
+      }
+
+    page[1] = cdb->AsByte[2];
+    /* The page's contents follow a 4-byte header. */
+    len = 4;
+    switch (cdb->AsByte[2]) {
+        case VPD_SUPPORTED_PAGES:
+          page[len++] = VPD_SUPPORTED_PAGES;
+          page[len++] = VPD_BLOCK_LIMITS;
+          page[len++] = VPD_BLOCK_DEVICE_CHARACTERISTICS;
+          if (thin)
+            page[len++] = VPD_LOGICAL_BLOCK_PROVISIONING;
+          break;
+
+        case VPD_BLOCK_LIMITS:
+          len = 0x40;
+          /* The optimal transfer length granularity, in blocks */
+          temp = disk->XferGranularity / disk->SectorSize;
+          if (temp > 0xFFFF)
+            temp = 0xFFFF;
+          page[6] = (UCHAR) (temp >> 8);
+          page[7] = (UCHAR) temp;
+          /* The maximum and optimal transfer lengths, in blocks */
+          temp = WvlDiskMaxXferLen(disk) / disk->SectorSize;
+          REVERSE_BYTES(page + 8, &temp);
+          REVERSE_BYTES(page + 12, &temp);
+          if (thin) {
+              /* The most blocks and block descriptors per UNMAP */
+              temp = (UINT32) -1;
+              REVERSE_BYTES(page + 20, &temp);
+              temp = WVL_M_DISK_SCSI_MAX_UNMAP_DESCS;
+              REVERSE_BYTES(page + 24, &temp);
+              /* The optimal unmap granularity, in blocks */
+              temp = disk->XferGranularity / disk->SectorSize;
+              REVERSE_BYTES(page + 28, &temp);
+              /* The most blocks per WRITE SAME */
+              temp = (UINT32) -1;
+              REVERSE_BYTES(page + 40, &temp);
+            }
+          break;
+
+        case VPD_BLOCK_DEVICE_CHARACTERISTICS:
+          len = 0x40;
+          /* A medium rotation rate of 1 means a non-rotating medium */
+          if (disk->NonRotational)
+            page[5] = 0x01;
+          break;
+
+        case VPD_LOGICAL_BLOCK_PROVISIONING:
+          if (!thin)
+            goto err_page;
+          len = 8;
+          /* LBPU, LBPWS and LBPWS10: UNMAP and WRITE SAME can unmap */
+          page[5] = 0xE0;
+          /* Thin provisioned */
+          page[6] = 0x02;
+          break;
+
+        default:
+          goto err_page;
+      }
+    page[2] = (UCHAR) ((len - 4) >> 8);
+    page[3] = (UCHAR) (len - 4);
+
+    out:
+
+    /* Only as much as was asked for and as fits. */
+    temp = (cdb->AsByte[3] << 8) | cdb->AsByte[4];
+    if (len > temp)
+      len = temp;
+    if (len > srb->DataTransferLength)
+      len = srb->DataTransferLength;
+    RtlCopyMemory(srb->DataBuffer, page, len);
+    srb->DataTransferLength = len;
+    irp->IoStatus.Information = len;
+    return STATUS_SUCCESS;
+
+    err_page:
+
+    DBG("Unsupported VPD page (%02x)!!\n", cdb->AsByte[2]);
+    srb->SrbStatus = SRB_STATUS_ERROR;
+    return STATUS_NOT_IMPLEMENTED;
+  }
+
+/* Handle an UNMAP by handing its block descriptors to the disk. */
+static NTSTATUS STDCALL WvlDiskScsiUnmap_(
+    IN WVL_SP_DISK_T disk,
+    IN PIRP irp,
+    IN PSCSI_REQUEST_BLOCK srb,
+    IN PCDB cdb,
+    OUT PBOOLEAN completion
+  ) {
+    PUCHAR list;
+    PUCHAR desc;
+    UINT32 list_len;
+    UINT32 desc_len;
+    WVL_SP_DISK_RANGE ranges;
+    UINT32 count;
+    UINT32 i;
+    ULONGLONG start_sector;
+    UINT32 sector_count;
+    NTSTATUS status;
+
+    srb->SrbStatus = SRB_STATUS_SUCCESS;
+    list_len = (cdb->AsByte[7] << 8) | cdb->AsByte[8];
+    if (list_len > srb->DataTransferLength)
+      list_len = srb->DataTransferLength;
+    if (list_len < WVL_M_DISK_SCSI_UNMAP_HEADER)
+      return STATUS_SUCCESS;
+
+    /* The disk might look at the runs from another thread. */
+    list = MmGetSystemAddressForMdlSafe(irp->MdlAddress, HighPagePriority);
+    if (!list) {
+        srb->SrbStatus = SRB_STATUS_ERROR;
+        return STATUS_INSUFFICIENT_RESOURCES;
+      }
+    list += (PUCHAR) srb->DataBuffer -
+      (PUCHAR) MmGetMdlVirtualAddress(irp->MdlAddress);
+
+    desc_len = (list[2] << 8) | list[3];
+    if (desc_len > list_len - WVL_M_DISK_SCSI_UNMAP_HEADER)
+      desc_len = list_len - WVL_M_DISK_SCSI_UNMAP_HEADER;
+    count = desc_len / WVL_M_DISK_SCSI_UNMAP_DESC;
+    if (count > WVL_M_DISK_SCSI_MAX_UNMAP_DESCS) {
+        DBG("Too many UNMAP block descriptors!!\n");
+        srb->SrbStatus = SRB_STATUS_ERROR;
+        return STATUS_INVALID_PARAMETER;
+      }
+    if (!count)
+      return STATUS_SUCCESS;
+
+    ranges = wv_malloc(sizeof *ranges * count);
+    if (!ranges) {
+        srb->SrbStatus = SRB_STATUS_ERROR;
+        return STATUS_INSUFFICIENT_RESOURCES;
+      }
+    desc = list + WVL_M_DISK_SCSI_UNMAP_HEADER;
+    for (i = 0; count--; desc += WVL_M_DISK_SCSI_UNMAP_DESC) {
+        REVERSE_BYTES_QUAD(&start_sector, desc);
+        REVERSE_BYTES(&sector_count, desc + 8);
+        if (start_sector >= disk->LBADiskSize)
+          continue;
+        if (sector_count > disk->LBADiskSize - start_sector)
+          sector_count = (UINT32) (disk->LBADiskSize - start_sector);
+        if (!sector_count)
+          continue;
+        ranges[i].StartSector = start_sector;
+        ranges[i].SectorCount = sector_count;
+        i++;
+      }
+
+    status = STATUS_SUCCESS;
+    if (i) {
+        /* The unmap completes the IRP, possibly from another thread. */
+        *completion = TRUE;
+        status = WvlDiskUnmap(disk, ranges, i, irp);
+      }
+    wv_free(ranges);
+    return status;
+  }
+
+/*
+ * Handle a WRITE SAME.  Only the form which asks for the blocks to be
+ * unmapped is supported, and only by a thin-provisioned disk.
+ */
+static NTSTATUS STDCALL WvlDiskScsiWriteSame_(
+    IN WVL_SP_DISK_T disk,
+    IN PIRP irp,
+    IN PSCSI_REQUEST_BLOCK srb,
+    IN PCDB cdb,
+    OUT PBOOLEAN completion
+  ) {
+    WVL_S_DISK_RANGE range;
+    ULONGLONG sector_count;
+
+    if (
+        !disk->disk_ops.Unmap ||
+        !(cdb->AsByte[1] & WVL_M_DISK_SCSI_WRITE_SAME_UNMAP)
+      ) {
+        DBG("WRITE SAME without UNMAP!!\n");
+        srb->SrbStatus = SRB_STATUS_ERROR;
+        return STATUS_NOT_IMPLEMENTED;
+      }
+
+    srb->SrbStatus = SRB_STATUS_SUCCESS;
+    WvlDiskScsiCdbRange_(cdb, &range.StartSector, &range.SectorCount);
+    if (range.StartSector >= disk->LBADiskSize)
+      return STATUS_SUCCESS;
+    /* A count of 0 means through to the end of the disk. */
+    sector_count = disk->LBADiskSize - range.StartSector;
+    if (range.SectorCount && range.SectorCount < sector_count)
+      sector_count = range.SectorCount;
+    if (sector_count > (UINT32) -1)
+      sector_count = (UINT32) -1;
+    range.SectorCount = (UINT32) sector_count;
+
+    /* The unmap completes the IRP, possibly from another thread. */
+    *completion = TRUE;
+    return WvlDiskUnmap(disk, &range, 1, irp);
+  }
+
+/* Handle a REPORT LUNS.  We only ever have LUN 0. */
+static NTSTATUS STDCALL WvlDiskScsiReportLuns_(
+    IN WVL_SP_DISK_T disk,
+    IN PIRP irp,
+    IN PSCSI_REQUEST_BLOCK srb,
+    IN PCDB cdb,
+    OUT PBOOLEAN completion
+  ) {
+    UCHAR list[WVL_M_DISK_SCSI_LUN_HEADER + WVL_M_DISK_SCSI_LUN_SIZE];
+    UINT32 len;
+
+    RtlZeroMemory(list, sizeof list);
+    /* The LUN list's length, in bytes.  LUN 0 is all zeroes */
+    list[3] = WVL_M_DISK_SCSI_LUN_SIZE;
+
+    /* Only as much as was asked for and as fits. */
+    REVERSE_BYTES(&len, cdb->AsByte + 6);
+    if (len > sizeof list)
+      len = sizeof list;
+    if (len > srb->DataTransferLength)
+      len = srb->DataTransferLength;
+    RtlCopyMemory(srb->DataBuffer, list, len);
+    srb->DataTransferLength = len;
+    irp->IoStatus.Information = len;
+    srb->SrbStatus = SRB_STATUS_SUCCESS;
+    return STATUS_SUCCESS;
+  }
+
 /**
  * Handle a disk SCSI IRP.
  *
@@ -411,9 +792,13 @@ WVL_M_LIB NTSTATUS STDCALL WvlDiskScsi(
                 srb->SrbStatus = SRB_STATUS_SUCCESS;
                 break;
 
+              case SCSIOP_READ6:
               case SCSIOP_READ:
+              case SCSIOP_READ12:
               case SCSIOP_READ16:
+              case SCSIOP_WRITE6:
               case SCSIOP_WRITE:
+              case SCSIOP_WRITE12:
               case SCSIOP_WRITE16:
                 status = WvlDiskScsiReadWrite_(
                     disk,
@@ -425,6 +810,7 @@ WVL_M_LIB NTSTATUS STDCALL WvlDiskScsi(
                 break;
 
               case SCSIOP_VERIFY:
+              case SCSIOP_VERIFY12:
               case SCSIOP_VERIFY16:
                 status = WvlDiskScsiVerify_(
                     disk,
@@ -466,6 +852,46 @@ WVL_M_LIB NTSTATUS STDCALL WvlDiskScsi(
                 break;
 
               case SCSIOP_INQUIRY:
+                status = WvlDiskScsiInquiry_(
+                    disk,
+                    irp,
+                    srb,
+                    cdb,
+                    &completion
+                  );
+                break;
+
+              case SCSIOP_UNMAP:
+                status = WvlDiskScsiUnmap_(
+                    disk,
+                    irp,
+                    srb,
+                    cdb,
+                    &completion
+                  );
+                break;
+
+              case SCSIOP_WRITE_SAME:
+              case SCSIOP_WRITE_SAME16:
+                status = WvlDiskScsiWriteSame_(
+                    disk,
+                    irp,
+                    srb,
+                    cdb,
+                    &completion
+                  );
+                break;
+
+              case SCSIOP_REPORT_LUNS:
+                status = WvlDiskScsiReportLuns_(
+                    disk,
+                    irp,
+                    srb,
+                    cdb,
+                    &completion
+                  );
+                break;
+
               case SCSIOP_MEDIUM_REMOVAL:
                 irp->IoStatus.Information = 0;
                 srb->SrbStatus = SRB_STATUS_SUCCESS;
@@ -482,6 +908,17 @@ WVL_M_LIB NTSTATUS STDCALL WvlDiskScsi(
                   );
                 break;
 
+              case SCSIOP_SYNCHRONIZE_CACHE:
+              case SCSIOP_SYNCHRONIZE_CACHE16:
+                status = WvlDiskScsiSynchronizeCache_(
+                    disk,
+                    irp,
+                    srb,
+                    cdb,
+                    &completion
+                  );
+                break;
+
               default:
                 DBG("Invalid SCSIOP (%02x)!!\n", cdb->AsByte[0]);
                 srb->SrbStatus = SRB_STATUS_ERROR;
@@ -503,7 +940,13 @@ WVL_M_LIB NTSTATUS STDCALL WvlDiskScsi(
 
         case SRB_FUNCTION_SHUTDOWN:
         case SRB_FUNCTION_FLUSH:
-          srb->SrbStatus = SRB_STATUS_SUCCESS;
+          status = WvlDiskScsiSynchronizeCache_(
+              disk,
+              irp,
+              srb,
+              cdb,
+              &completion
+            );
           break;
 
         default:
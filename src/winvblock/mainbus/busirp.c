@@ -47,6 +47,7 @@
 #include "x86.h"
 #include "safehook.h"
 #include "filedisk.h"
+#include "ramdisk.h"
 #include "dummy.h"
 #include "memdisk.h"
 #include "debug.h"
@@ -85,6 +86,10 @@ static __drv_dispatchType(IRP_MN_START_DEVICE) DRIVER_DISPATCH
 /** Device control handlers */
 static __drv_dispatchType(IRP_MJ_DEVICE_CONTROL) DRIVER_DISPATCH
   WvMainBusDeviceControlDetach;
+static __drv_dispatchType(IRP_MJ_DEVICE_CONTROL) DRIVER_DISPATCH
+  WvMainBusDeviceControlSnapshot;
+static __drv_dispatchType(IRP_MJ_DEVICE_CONTROL) DRIVER_DISPATCH
+  WvMainBusDeviceControlRamStats;
 
 /** Objects */
 static A_WVL_MJ_DISPATCH_TABLE WvMainBusMajorDispatchTable;
@@ -665,12 +670,24 @@ static NTSTATUS STDCALL WvMainBusDispatchDeviceControlIrp(
     code = io_stack_loc->Parameters.DeviceIoControl.IoControlCode;
     switch (code) {
         case IOCTL_FILE_ATTACH:
+        case IOCTL_FILE_ATTACH_SNAPSHOT:
+        case IOCTL_FILE_ATTACH_EX:
         status = WvFilediskAttach(irp);
         break;
 
+        case IOCTL_RAM_ATTACH:
+        status = WvRamdiskAttach(irp);
+        break;
+
         case IOCTL_FILE_DETACH:
         return WvMainBusDeviceControlDetach(dev_obj, irp);
 
+        case IOCTL_FILE_SNAPSHOT:
+        return WvMainBusDeviceControlSnapshot(dev_obj, irp);
+
+        case IOCTL_RAM_STATS:
+        return WvMainBusDeviceControlRamStats(dev_obj, irp);
+
         case IOCTL_WV_DUMMY:
         return WvDummyIoctl(dev_obj, irp);
 
@@ -776,6 +793,175 @@ static NTSTATUS STDCALL WvMainBusDeviceControlDetach(
     return status;
   }
 
+/**
+ * Commit or discard the overlay of a user-specified snapshot
+ *
+ * @param DeviceObject
+ *   The main bus device
+ *
+ * @param Irp
+ *   The IRP for the request
+ *
+ * @param Irp->AssociatedIrp.SystemBuffer
+ *   Points to a WV_S_MOUNT_SNAPSHOT
+ *
+ * @retval STATUS_SUCCESS
+ * @retval STATUS_INVALID_PARAMETER
+ *   The unit is not a file-backed disk
+ * @retval STATUS_INVALID_DEVICE_REQUEST
+ *   The disk is not a snapshot
+ */
+static NTSTATUS STDCALL WvMainBusDeviceControlSnapshot(
+    IN DEVICE_OBJECT * dev_obj,
+    IN IRP * irp
+  ) {
+    IO_STACK_LOCATION * io_stack_loc;
+    WV_SP_MOUNT_SNAPSHOT params;
+    NTSTATUS status;
+    WVL_SP_BUS_NODE walker;
+    WV_SP_FILEDISK_T filedisk = NULL;
+
+    WvlUnusedParameter(dev_obj);
+    ASSERT(irp);
+    io_stack_loc = IoGetCurrentIrpStackLocation(irp);
+    ASSERT(io_stack_loc);
+
+    /* Check the buffer */
+    params = irp->AssociatedIrp.SystemBuffer;
+    if (
+        io_stack_loc->Parameters.DeviceIoControl.InputBufferLength <
+          sizeof *params ||
+        !params
+      ) {
+        DBG("Invalid request buffer\n");
+        status = STATUS_INVALID_PARAMETER;
+        goto err_buf;
+      }
+    DBG(
+        "Request for snapshot action %u on unit %u...\n",
+        params->action,
+        params->unit_num
+      );
+
+    /* Find the filedisk */
+    walker = NULL;
+    WvlBusLock(&WvBus);
+    while (walker = WvlBusGetNextNode(&WvBus, walker)) {
+        if (WvlBusGetNodeNum(walker) == params->unit_num) {
+            filedisk = WvFilediskFromDev(
+                WvDevFromDevObj(WvlBusGetNodePdo(walker))
+              );
+            break;
+          }
+      }
+    WvlBusUnlock(&WvBus);
+    if (!filedisk) {
+        DBG("Unit %u is not a file-backed disk\n", params->unit_num);
+        status = STATUS_INVALID_PARAMETER;
+        goto err_dev;
+      }
+
+    status = WvFilediskSnapshotControl(filedisk, params->action);
+
+    err_dev:
+
+    err_buf:
+
+    irp->IoStatus.Status = status;
+    irp->IoStatus.Information = 0;
+    WvlPassIrpUp(dev_obj, irp, IO_NO_INCREMENT);
+    return status;
+  }
+
+/**
+ * Fetch the statistics of a user-specified compressed RAM disk
+ *
+ * @param DeviceObject
+ *   The main bus device
+ *
+ * @param Irp
+ *   The IRP for the request
+ *
+ * @param Irp->AssociatedIrp.SystemBuffer
+ *   Points to a WV_S_MOUNT_RAMDISK_STATS, which receives the statistics
+ *
+ * @retval STATUS_SUCCESS
+ * @retval STATUS_INVALID_PARAMETER
+ *   The unit is not a RAM disk allocated at runtime
+ * @retval STATUS_INVALID_DEVICE_REQUEST
+ *   The RAM disk is not compressed
+ */
+static NTSTATUS STDCALL WvMainBusDeviceControlRamStats(
+    IN DEVICE_OBJECT * dev_obj,
+    IN IRP * irp
+  ) {
+    IO_STACK_LOCATION * io_stack_loc;
+    WV_SP_MOUNT_RAMDISK_STATS stats;
+    NTSTATUS status;
+    WVL_SP_BUS_NODE walker;
+    WV_SP_RAMDISK_T ramdisk = NULL;
+    ULONG_PTR info = 0;
+
+    WvlUnusedParameter(dev_obj);
+    ASSERT(irp);
+    io_stack_loc = IoGetCurrentIrpStackLocation(irp);
+    ASSERT(io_stack_loc);
+
+    /* Check the buffer */
+    stats = irp->AssociatedIrp.SystemBuffer;
+    if (
+        io_stack_loc->Parameters.DeviceIoControl.InputBufferLength <
+          sizeof stats->unit_num ||
+        io_stack_loc->Parameters.DeviceIoControl.OutputBufferLength <
+          sizeof *stats ||
+        !stats
+      ) {
+        DBG("Invalid request buffer\n");
+        status = STATUS_INVALID_PARAMETER;
+        goto err_buf;
+      }
+
+    /* Find the RAM disk */
+    walker = NULL;
+    WvlBusLock(&WvBus);
+    while (walker = WvlBusGetNextNode(&WvBus, walker)) {
+        if (WvlBusGetNodeNum(walker) == stats->unit_num) {
+            ramdisk = WvRamdiskFromDev(
+                WvDevFromDevObj(WvlBusGetNodePdo(walker))
+              );
+            break;
+          }
+      }
+    if (!ramdisk) {
+        WvlBusUnlock(&WvBus);
+        DBG("Unit %u is not a runtime RAM disk\n", stats->unit_num);
+        status = STATUS_INVALID_PARAMETER;
+        goto err_dev;
+      }
+    if (!ramdisk->ZStore) {
+        WvlBusUnlock(&WvBus);
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        goto err_zstore;
+      }
+
+    /* The bus lock keeps the RAM disk from being freed meanwhile */
+    WvRamdiskZStats(ramdisk, stats);
+    WvlBusUnlock(&WvBus);
+    info = sizeof *stats;
+    status = STATUS_SUCCESS;
+
+    err_zstore:
+
+    err_dev:
+
+    err_buf:
+
+    irp->IoStatus.Status = status;
+    irp->IoStatus.Information = info;
+    WvlPassIrpUp(dev_obj, irp, IO_NO_INCREMENT);
+    return status;
+  }
+
 static NTSTATUS STDCALL WvMainBusDispatchPowerIrp(
     IN DEVICE_OBJECT * dev_obj,
     IN IRP * irp
@@ -408,6 +408,14 @@ NTSTATUS WvMemdiskCreateDisk(
     ramdisk->disk->Media = media_type;
     ramdisk->disk->SectorSize = sector_size;
     ramdisk->Dev->Boot = TRUE;
+    status = WvRamdiskVerifyOpen(ramdisk);
+    if (status == STATUS_NOT_FOUND)
+      status = STATUS_SUCCESS;
+    if (!NT_SUCCESS(status)) {
+        DBG("MEMDISK disk failed verification!\n");
+        WvDevFree(ramdisk->Dev);
+        goto err_verify;
+      }
 
     /* Add the ramdisk to the bus */
     ramdisk->Dev->Parent = ramdisk->disk->ParentBus = parent;
@@ -419,6 +427,8 @@ NTSTATUS WvMemdiskCreateDisk(
     if (pdo)
       *pdo = ramdisk->Dev->Self;
 
+    err_verify:
+
     WvlMapUnmapLowMemory(phys_mem);
     err_phys_mem:
 
@@ -0,0 +1,517 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * Compressed RAM disks.
+ *
+ * A compressed RAM disk keeps each page of its contents as zpage.c
+ * packs it, in that file's slab allocator.  The page table is
+ * two-level, and its leaves are allocated upon the first write which
+ * needs them.
+ *
+ * Pages are locked in stripes, so transfers of different pages can run
+ * concurrently.  Each stripe keeps the statistics for its pages.
+ */
+
+#include <ntddk.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "wv_stdlib.h"
+#include "wv_string.h"
+#include "bus.h"
+#include "device.h"
+#include "disk.h"
+#include "mount.h"
+#include "ramdisk.h"
+#include "debug.h"
+#include "zpage.h"
+
+/** Macros */
+
+/* How many page entries each page table leaf holds */
+#define WV_M_ZRAM_LEAF_ENTRIES 512
+
+/* The number of page lock stripes */
+#define WV_M_ZRAM_STRIPES 64
+
+/** Object types */
+typedef struct WV_ZRAM_STRIPE_ WV_S_ZRAM_STRIPE_, * WV_SP_ZRAM_STRIPE_;
+typedef struct WV_ZRAM_CLASS_ WV_S_ZRAM_CLASS_, * WV_SP_ZRAM_CLASS_;
+typedef struct WV_ZRAM_SCRATCH_ WV_S_ZRAM_SCRATCH_, * WV_SP_ZRAM_SCRATCH_;
+
+/** Struct/union type definitions */
+
+/* A page lock stripe and the statistics for its pages */
+struct WV_ZRAM_STRIPE_ {
+    KSPIN_LOCK Lock;
+    LONGLONG Pages[WvZpageKinds];
+    LONGLONG PackedBytes;
+  };
+
+/* A slab size class and its lock */
+struct WV_ZRAM_CLASS_ {
+    KSPIN_LOCK Lock;
+    WV_S_ZPAGE_CLASS Class;
+  };
+
+/* A compressed RAM disk's store */
+struct WV_RAMDISK_ZSTORE {
+    ULONGLONG PageCount;
+    ULONGLONG LeafCount;
+    WV_SP_ZPAGE * Leaves;
+    LONG LeavesUsed;
+    WV_S_ZRAM_STRIPE_ Stripes[WV_M_ZRAM_STRIPES];
+    WV_S_ZRAM_CLASS_ Classes[WV_M_ZPAGE_CLASSES];
+  };
+
+/* Per-transfer scratch space */
+struct WV_ZRAM_SCRATCH_ {
+    UCHAR Page[WV_M_ZPAGE_SIZE];
+    UCHAR Packed[WV_M_ZPAGE_SIZE];
+    unsigned int Table[WV_M_ZPAGE_TABLE_ENTRIES];
+  };
+
+/** Private function declarations */
+static PVOID STDCALL WvZramAlloc_(IN WV_SP_RAMDISK_ZSTORE, IN ULONG);
+static VOID STDCALL WvZramFree_(IN WV_SP_RAMDISK_ZSTORE, IN PVOID, IN ULONG);
+static NTSTATUS STDCALL WvZramReadPage_(IN WV_SP_ZPAGE, OUT PUCHAR);
+static NTSTATUS STDCALL WvZramWritePage_(
+    IN WV_SP_RAMDISK_ZSTORE,
+    IN ULONGLONG,
+    IN UINT32,
+    IN UINT32,
+    IN PUCHAR,
+    IN WV_SP_ZRAM_SCRATCH_
+  );
+
+/** Exported function definitions */
+
+/**
+ * Create the store for a compressed RAM disk.
+ *
+ * @v ramdisk           The RAM disk, whose size is set.
+ * @ret NTSTATUS        The status of the operation.
+ */
+NTSTATUS STDCALL WvRamdiskZCreate(IN WV_SP_RAMDISK_T ramdisk) {
+    WV_SP_RAMDISK_ZSTORE zstore;
+    ULONGLONG page_count;
+    ULONGLONG leaf_count;
+    ULONG i;
+
+    page_count = (
+        ramdisk->DiskSize * ramdisk->disk->SectorSize +
+        WV_M_ZPAGE_SIZE - 1
+      ) / WV_M_ZPAGE_SIZE;
+    leaf_count =
+      (page_count + WV_M_ZRAM_LEAF_ENTRIES - 1) / WV_M_ZRAM_LEAF_ENTRIES;
+    if (leaf_count > (SIZE_T) -1 / sizeof *zstore->Leaves)
+      return STATUS_INVALID_PARAMETER;
+
+    zstore = wv_mallocz(sizeof *zstore);
+    if (!zstore)
+      goto err_zstore;
+    zstore->Leaves = wv_mallocz((SIZE_T) leaf_count * sizeof *zstore->Leaves);
+    if (!zstore->Leaves)
+      goto err_leaves;
+    zstore->PageCount = page_count;
+    zstore->LeafCount = leaf_count;
+    for (i = 0; i < WV_M_ZRAM_STRIPES; ++i)
+      KeInitializeSpinLock(&zstore->Stripes[i].Lock);
+    for (i = 0; i < WV_M_ZPAGE_CLASSES; ++i)
+      KeInitializeSpinLock(&zstore->Classes[i].Lock);
+
+    ramdisk->ZStore = zstore;
+    /* Partial pages must be unpacked and packed again. */
+    ramdisk->disk->XferGranularity = WV_M_ZPAGE_SIZE;
+    return STATUS_SUCCESS;
+
+    wv_free(zstore->Leaves);
+    err_leaves:
+
+    wv_free(zstore);
+    err_zstore:
+
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+
+/**
+ * Free the store for a compressed RAM disk.
+ *
+ * @v ramdisk           The RAM disk, which has a store.
+ */
+VOID STDCALL WvRamdiskZFree(IN WV_SP_RAMDISK_T ramdisk) {
+    WV_SP_RAMDISK_ZSTORE zstore = ramdisk->ZStore;
+    PVOID slab;
+    ULONGLONG i;
+
+    for (i = 0; i < WV_M_ZPAGE_CLASSES; ++i) {
+        while (slab = WvZpageTakeSlab(&zstore->Classes[i].Class))
+          wv_free(slab);
+      }
+    for (i = 0; i < zstore->LeafCount; ++i)
+      wv_free(zstore->Leaves[i]);
+    wv_free(zstore->Leaves);
+    wv_free(zstore);
+    ramdisk->ZStore = NULL;
+  }
+
+/**
+ * Copy to or from a compressed RAM disk.
+ *
+ * @v ramdisk           The RAM disk to transfer with.
+ * @v mode              The direction of the transfer.
+ * @v offset            The byte offset within the disk.
+ * @v length            The number of bytes to transfer.
+ * @v buffer            The buffer to transfer with.
+ * @ret NTSTATUS        The status of the operation.
+ */
+NTSTATUS STDCALL WvRamdiskZIo(
+    IN WV_SP_RAMDISK_T ramdisk,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN ULONGLONG offset,
+    IN UINT32 length,
+    IN OUT PUCHAR buffer
+  ) {
+    WV_SP_RAMDISK_ZSTORE zstore = ramdisk->ZStore;
+    WV_SP_ZRAM_SCRATCH_ scratch;
+    WV_SP_ZPAGE leaf;
+    WV_SP_ZRAM_STRIPE_ stripe;
+    ULONGLONG index;
+    UINT32 within;
+    UINT32 len;
+    PUCHAR page;
+    KIRQL irql;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    scratch = wv_malloc(sizeof *scratch);
+    if (!scratch)
+      return STATUS_INSUFFICIENT_RESOURCES;
+
+    while (length) {
+        index = offset / WV_M_ZPAGE_SIZE;
+        within = (UINT32) (offset % WV_M_ZPAGE_SIZE);
+        len = WV_M_ZPAGE_SIZE - within;
+        if (len > length)
+          len = length;
+
+        if (mode == WvlDiskIoModeWrite) {
+            status = WvZramWritePage_(
+                zstore,
+                index,
+                within,
+                len,
+                buffer,
+                scratch
+              );
+            if (!NT_SUCCESS(status))
+              break;
+          } else {
+            leaf = zstore->Leaves[index / WV_M_ZRAM_LEAF_ENTRIES];
+            if (!leaf) {
+                RtlZeroMemory(buffer, len);
+              } else {
+                /* A whole page can be read straight into the buffer. */
+                page = len == WV_M_ZPAGE_SIZE ? buffer : scratch->Page;
+                stripe = zstore->Stripes + index % WV_M_ZRAM_STRIPES;
+                KeAcquireSpinLock(&stripe->Lock, &irql);
+                status = WvZramReadPage_(
+                    leaf + index % WV_M_ZRAM_LEAF_ENTRIES,
+                    page
+                  );
+                KeReleaseSpinLock(&stripe->Lock, irql);
+                if (!NT_SUCCESS(status))
+                  break;
+                if (page != buffer)
+                  RtlCopyMemory(buffer, page + within, len);
+              }
+          }
+
+        offset += len;
+        buffer += len;
+        length -= len;
+      }
+
+    wv_free(scratch);
+    return status;
+  }
+
+/**
+ * Drop the pages of a compressed RAM disk within a range.
+ *
+ * @v ramdisk           The RAM disk, which has a store.
+ * @v offset            The byte offset of the start of the range.
+ * @v end               The byte offset of the end of the range.
+ *
+ * A dropped page is empty again, and its data goes back to its size
+ * class.  Pages only partly within the range are left as they are.
+ */
+VOID STDCALL WvRamdiskZUnmap(
+    IN WV_SP_RAMDISK_T ramdisk,
+    IN ULONGLONG offset,
+    IN ULONGLONG end
+  ) {
+    WV_SP_RAMDISK_ZSTORE zstore = ramdisk->ZStore;
+    WV_SP_ZPAGE leaf;
+    WV_SP_ZPAGE entry;
+    WV_SP_ZRAM_STRIPE_ stripe;
+    ULONGLONG index;
+    ULONGLONG end_index;
+    KIRQL irql;
+
+    index = (offset + WV_M_ZPAGE_SIZE - 1) / WV_M_ZPAGE_SIZE;
+    /* The last page might be short, but it's still whole. */
+    if (end >= ramdisk->DiskSize * ramdisk->disk->SectorSize)
+      end_index = zstore->PageCount;
+      else
+      end_index = end / WV_M_ZPAGE_SIZE;
+    for (; index < end_index; ++index) {
+        leaf = zstore->Leaves[index / WV_M_ZRAM_LEAF_ENTRIES];
+        if (!leaf) {
+            /* Skip to the next leaf. */
+            index |= WV_M_ZRAM_LEAF_ENTRIES - 1;
+            continue;
+          }
+        entry = leaf + index % WV_M_ZRAM_LEAF_ENTRIES;
+        stripe = zstore->Stripes + index % WV_M_ZRAM_STRIPES;
+
+        KeAcquireSpinLock(&stripe->Lock, &irql);
+        if (
+            entry->Kind == WvZpageKindPacked ||
+            entry->Kind == WvZpageKindStored
+          )
+          WvZramFree_(zstore, entry->Value.Data, entry->Length);
+        --stripe->Pages[entry->Kind];
+        if (entry->Kind == WvZpageKindPacked)
+          stripe->PackedBytes -= entry->Length;
+        RtlZeroMemory(entry, sizeof *entry);
+        ++stripe->Pages[WvZpageKindEmpty];
+        KeReleaseSpinLock(&stripe->Lock, irql);
+      }
+    return;
+  }
+
+/**
+ * Fetch the statistics of a compressed RAM disk.
+ *
+ * @v ramdisk           The RAM disk, which has a store.
+ * @v stats             Populated with the statistics.
+ */
+VOID STDCALL WvRamdiskZStats(
+    IN WV_SP_RAMDISK_T ramdisk,
+    OUT WV_SP_MOUNT_RAMDISK_STATS stats
+  ) {
+    WV_SP_RAMDISK_ZSTORE zstore = ramdisk->ZStore;
+    LONGLONG pages[WvZpageKinds] = {0};
+    LONGLONG packed_bytes = 0;
+    ULONGLONG slabs = 0;
+    KIRQL irql;
+    ULONG i, j;
+
+    for (i = 0; i < WV_M_ZRAM_STRIPES; ++i) {
+        KeAcquireSpinLock(&zstore->Stripes[i].Lock, &irql);
+        for (j = 0; j < WvZpageKinds; ++j)
+          pages[j] += zstore->Stripes[i].Pages[j];
+        packed_bytes += zstore->Stripes[i].PackedBytes;
+        KeReleaseSpinLock(&zstore->Stripes[i].Lock, irql);
+      }
+    for (i = 0; i < WV_M_ZPAGE_CLASSES; ++i)
+      slabs += zstore->Classes[i].Class.SlabCount;
+
+    stats->same_pages = pages[WvZpageKindSame];
+    stats->packed_pages = pages[WvZpageKindPacked];
+    stats->stored_pages = pages[WvZpageKindStored];
+    stats->orig_bytes =
+      (pages[WvZpageKindPacked] + pages[WvZpageKindStored]) *
+      WV_M_ZPAGE_SIZE;
+    stats->compr_bytes =
+      packed_bytes + pages[WvZpageKindStored] * WV_M_ZPAGE_SIZE;
+    stats->mem_used =
+      slabs * WV_M_ZPAGE_SLAB_SIZE +
+      (ULONGLONG) zstore->LeavesUsed *
+        WV_M_ZRAM_LEAF_ENTRIES *
+        sizeof (WV_S_ZPAGE) +
+      zstore->LeafCount * sizeof *zstore->Leaves;
+  }
+
+/** Private function definitions */
+
+/**
+ * Allocate a slab object.
+ *
+ * @v zstore            The store to allocate from.
+ * @v size              The size of the object, up to a page.
+ * @ret PVOID           The object, or NULL.
+ */
+static PVOID STDCALL WvZramAlloc_(
+    IN WV_SP_RAMDISK_ZSTORE zstore,
+    IN ULONG size
+  ) {
+    WV_SP_ZRAM_CLASS_ zclass = zstore->Classes + WV_M_ZPAGE_CLASS(size);
+    PVOID slab;
+    PVOID obj;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&zclass->Lock, &irql);
+    obj = WvZpageAlloc(&zclass->Class, size);
+    if (!obj) {
+        slab = wv_malloc(WV_M_ZPAGE_SLAB_SIZE);
+        if (slab) {
+            WvZpageAddSlab(&zclass->Class, slab);
+            obj = WvZpageAlloc(&zclass->Class, size);
+          }
+      }
+    KeReleaseSpinLock(&zclass->Lock, irql);
+    return obj;
+  }
+
+/* Return a slab object to its size class. */
+static VOID STDCALL WvZramFree_(
+    IN WV_SP_RAMDISK_ZSTORE zstore,
+    IN PVOID obj,
+    IN ULONG size
+  ) {
+    WV_SP_ZRAM_CLASS_ zclass = zstore->Classes + WV_M_ZPAGE_CLASS(size);
+    KIRQL irql;
+
+    KeAcquireSpinLock(&zclass->Lock, &irql);
+    WvZpageFree(&zclass->Class, obj);
+    KeReleaseSpinLock(&zclass->Lock, irql);
+  }
+
+/**
+ * Produce a page's contents.  The page's stripe must be locked.
+ *
+ * @v entry             The page's entry.
+ * @v page              Populated with the page's contents.
+ * @ret NTSTATUS        The status of the operation.
+ */
+static NTSTATUS STDCALL WvZramReadPage_(
+    IN WV_SP_ZPAGE entry,
+    OUT PUCHAR page
+  ) {
+    if (WvZpageUnpack(entry, page)) {
+        DBG("Corrupt compressed page!\n");
+        return STATUS_DEVICE_DATA_ERROR;
+      }
+    return STATUS_SUCCESS;
+  }
+
+/**
+ * Write to a page.
+ *
+ * @v zstore            The store to write to.
+ * @v index             The index of the page.
+ * @v within            The offset of the write within the page.
+ * @v len               The length of the write.
+ * @v buffer            The data to write.
+ * @v scratch           Scratch space.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * A whole page is compressed before the page is locked.  A partial
+ * write has to merge with what's there, so it's compressed under the
+ * lock.  If there's no memory for the new data, the page is unchanged.
+ */
+static NTSTATUS STDCALL WvZramWritePage_(
+    IN WV_SP_RAMDISK_ZSTORE zstore,
+    IN ULONGLONG index,
+    IN UINT32 within,
+    IN UINT32 len,
+    IN PUCHAR buffer,
+    IN WV_SP_ZRAM_SCRATCH_ scratch
+  ) {
+    WV_SP_ZPAGE * leaf_ptr;
+    WV_SP_ZPAGE leaf;
+    WV_SP_ZPAGE other_leaf;
+    WV_SP_ZPAGE entry;
+    WV_SP_ZRAM_STRIPE_ stripe;
+    WV_S_ZPAGE new_entry;
+    PUCHAR page = buffer;
+    PVOID obj = NULL;
+    KIRQL irql;
+    NTSTATUS status;
+
+    leaf_ptr = zstore->Leaves + index / WV_M_ZRAM_LEAF_ENTRIES;
+    leaf = *leaf_ptr;
+    if (!leaf) {
+        leaf = wv_mallocz(sizeof *leaf * WV_M_ZRAM_LEAF_ENTRIES);
+        if (!leaf)
+          return STATUS_DISK_FULL;
+        other_leaf = InterlockedCompareExchangePointer(
+            (PVOID *) leaf_ptr,
+            leaf,
+            NULL
+          );
+        if (other_leaf) {
+            wv_free(leaf);
+            leaf = other_leaf;
+          } else {
+            InterlockedIncrement(&zstore->LeavesUsed);
+          }
+      }
+    entry = leaf + index % WV_M_ZRAM_LEAF_ENTRIES;
+    stripe = zstore->Stripes + index % WV_M_ZRAM_STRIPES;
+
+    if (len == WV_M_ZPAGE_SIZE)
+      WvZpagePack(page, scratch->Packed, scratch->Table, &new_entry);
+    KeAcquireSpinLock(&stripe->Lock, &irql);
+    if (len != WV_M_ZPAGE_SIZE) {
+        page = scratch->Page;
+        status = WvZramReadPage_(entry, page);
+        if (!NT_SUCCESS(status))
+          goto err_read;
+        RtlCopyMemory(page + within, buffer, len);
+        WvZpagePack(page, scratch->Packed, scratch->Table, &new_entry);
+      }
+
+    if (new_entry.Kind != WvZpageKindSame) {
+        obj = WvZramAlloc_(zstore, new_entry.Length);
+        if (!obj) {
+            DBG("No memory for compressed page!\n");
+            status = STATUS_DISK_FULL;
+            goto err_alloc;
+          }
+        RtlCopyMemory(
+            obj,
+            new_entry.Kind == WvZpageKindPacked ? scratch->Packed : page,
+            new_entry.Length
+          );
+        new_entry.Value.Data = obj;
+      }
+
+    /* Swap the entries and account for the change. */
+    if (entry->Kind == WvZpageKindPacked || entry->Kind == WvZpageKindStored)
+      WvZramFree_(zstore, entry->Value.Data, entry->Length);
+    --stripe->Pages[entry->Kind];
+    if (entry->Kind == WvZpageKindPacked)
+      stripe->PackedBytes -= entry->Length;
+    *entry = new_entry;
+    ++stripe->Pages[entry->Kind];
+    if (entry->Kind == WvZpageKindPacked)
+      stripe->PackedBytes += entry->Length;
+    status = STATUS_SUCCESS;
+
+    err_alloc:
+
+    err_read:
+
+    KeReleaseSpinLock(&stripe->Lock, irql);
+    return status;
+  }
@@ -0,0 +1,393 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * RAM disks allocated at runtime.
+ *
+ * Such a RAM disk's memory is a table of chunks, each of which is
+ * allocated upon the first write to it.  A missing chunk reads as
+ * zeroes, so an unwritten disk costs only its table, and an unmap
+ * frees whole chunks again.  A compressed RAM disk keeps its contents
+ * in a store of its own instead, and an unmap drops whole pages.
+ */
+
+#include <stdio.h>
+#include <ntddk.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "wv_stdlib.h"
+#include "wv_string.h"
+#include "irp.h"
+#include "driver.h"
+#include "bus.h"
+#include "device.h"
+#include "disk.h"
+#include "mount.h"
+#include "ramdisk.h"
+#include "debug.h"
+
+/** Private function declarations */
+static WV_F_DEV_FREE WvRamdiskDynamicFree_;
+static WVL_F_DISK_UNMAP WvRamdiskUnmap_;
+static PUCHAR STDCALL WvRamdiskChunk_(IN WV_SP_RAMDISK_T, IN ULONGLONG);
+static VOID STDCALL WvRamdiskChunkUnmap_(
+    IN WV_SP_RAMDISK_T,
+    IN ULONGLONG,
+    IN ULONGLONG
+  );
+
+/** Exported function definitions */
+
+/**
+ * Create a RAM disk of a given size, based on an IRP.
+ *
+ * @v irp               The IOCTL_RAM_ATTACH IRP, carrying a
+ *                      WV_S_MOUNT_RAMDISK.
+ * @ret NTSTATUS        The status of the operation.
+ */
+NTSTATUS STDCALL WvRamdiskAttach(IN PIRP irp) {
+    PIO_STACK_LOCATION io_stack_loc = IoGetCurrentIrpStackLocation(irp);
+    WV_SP_MOUNT_RAMDISK params = irp->AssociatedIrp.SystemBuffer;
+    WVL_E_DISK_MEDIA_TYPE media_type;
+    UINT32 sector_size;
+    WV_SP_RAMDISK_T ramdisk;
+    ULONGLONG chunk_count;
+    int i;
+    NTSTATUS status;
+
+    if (
+        io_stack_loc->Parameters.DeviceIoControl.InputBufferLength <
+          sizeof *params ||
+        !params
+      ) {
+        DBG("Invalid RAM disk request!\n");
+        status = STATUS_INVALID_PARAMETER;
+        goto err_params;
+      }
+
+    switch (params->disk.type) {
+        case 'f':
+          media_type = WvlDiskMediaTypeFloppy;
+          sector_size = 512;
+          break;
+
+        case 'c':
+          media_type = WvlDiskMediaTypeOptical;
+          sector_size = 2048;
+          break;
+
+        default:
+          media_type = WvlDiskMediaTypeHard;
+          sector_size = 512;
+          break;
+      }
+    if (params->size < sector_size) {
+        DBG("RAM disk too small!\n");
+        status = STATUS_INVALID_PARAMETER;
+        goto err_params;
+      }
+
+    /* The chunk table is allocated up-front, and must fit. */
+    chunk_count =
+      (params->size + WV_M_RAMDISK_CHUNK_SIZE - 1) / WV_M_RAMDISK_CHUNK_SIZE;
+    if (
+        !(params->flags & WvMountFlagCompressed) &&
+        chunk_count > (SIZE_T) -1 / sizeof (PUCHAR)
+      ) {
+        DBG("RAM disk too large!\n");
+        status = STATUS_INVALID_PARAMETER;
+        goto err_params;
+      }
+
+    ramdisk = WvRamdiskCreatePdo(media_type);
+    if (!ramdisk) {
+        DBG("Could not create RAM disk!\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_pdo;
+      }
+
+    ramdisk->disk->LBADiskSize = ramdisk->DiskSize =
+      params->size / sector_size;
+    ramdisk->disk->Media = media_type;
+    ramdisk->disk->SectorSize = sector_size;
+
+    if (params->flags & WvMountFlagCompressed) {
+        status = WvRamdiskZCreate(ramdisk);
+        if (!NT_SUCCESS(status)) {
+            DBG("Could not create compressed RAM disk store!\n");
+            goto err_chunks;
+          }
+      } else {
+        ramdisk->Chunks = wv_mallocz(
+            (SIZE_T) chunk_count * sizeof (PUCHAR)
+          );
+        ramdisk->ChunkUsers = wv_mallocz(
+            (SIZE_T) chunk_count * sizeof (LONG)
+          );
+        if (!ramdisk->Chunks || !ramdisk->ChunkUsers) {
+            DBG("Could not allocate RAM disk chunk table!\n");
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto err_chunks;
+          }
+        ramdisk->ChunkCount = chunk_count;
+        for (i = 0; i < WV_M_RAMDISK_CHUNK_STRIPES; ++i)
+          KeInitializeSpinLock(ramdisk->ChunkLocks + i);
+      }
+    ramdisk->disk->disk_ops.Unmap = WvRamdiskUnmap_;
+    ramdisk->prev_free = ramdisk->Dev->Ops.Free;
+    ramdisk->Dev->Ops.Free = WvRamdiskDynamicFree_;
+
+    ramdisk->disk->Cylinders = params->disk.cylinders;
+    ramdisk->disk->Heads = params->disk.heads;
+    ramdisk->disk->Sectors = params->disk.sectors;
+    DBG(
+        "RAM disk %p: %I64u bytes in %I64u chunks\n",
+        (PVOID) ramdisk,
+        ramdisk->DiskSize * sector_size,
+        chunk_count
+      );
+
+    /* Add the RAM disk to the bus. */
+    ramdisk->disk->ParentBus = WvBus.Fdo;
+    if (!WvBusAddDev(ramdisk->Dev)) {
+        status = STATUS_UNSUCCESSFUL;
+        goto err_add_child;
+      }
+
+    return STATUS_SUCCESS;
+
+    err_add_child:
+
+    /* The chunk table or store is freed with the RAM disk. */
+    err_chunks:
+
+    WvDevFree(ramdisk->Dev);
+    err_pdo:
+
+    err_params:
+
+    return status;
+  }
+
+/**
+ * Copy to or from a RAM disk allocated at runtime.
+ *
+ * @v ramdisk           The RAM disk to transfer with.
+ * @v mode              The direction of the transfer.
+ * @v offset            The byte offset within the disk.
+ * @v length            The number of bytes to transfer.
+ * @v buffer            The buffer to transfer with.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Reads of missing chunks produce zeroes.  A write which can't get
+ * memory for its chunk fails with STATUS_DISK_FULL.  A chunk is only
+ * looked at while it's counted as in use, so that an unmap leaves it.
+ */
+NTSTATUS STDCALL WvRamdiskChunkIo(
+    IN WV_SP_RAMDISK_T ramdisk,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN ULONGLONG offset,
+    IN UINT32 length,
+    IN OUT PUCHAR buffer
+  ) {
+    ULONGLONG index;
+    UINT32 within;
+    UINT32 len;
+    PKSPIN_LOCK lock;
+    KIRQL irql;
+    PUCHAR chunk;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (ramdisk->ZStore)
+      return WvRamdiskZIo(ramdisk, mode, offset, length, buffer);
+
+    while (length) {
+        index = offset / WV_M_RAMDISK_CHUNK_SIZE;
+        within = (UINT32) (offset % WV_M_RAMDISK_CHUNK_SIZE);
+        len = WV_M_RAMDISK_CHUNK_SIZE - within;
+        if (len > length)
+          len = length;
+
+        lock = ramdisk->ChunkLocks + index % WV_M_RAMDISK_CHUNK_STRIPES;
+        KeAcquireSpinLock(lock, &irql);
+        ramdisk->ChunkUsers[index]++;
+        chunk = ramdisk->Chunks[index];
+        KeReleaseSpinLock(lock, irql);
+
+        if (mode == WvlDiskIoModeWrite) {
+            if (!chunk)
+              chunk = WvRamdiskChunk_(ramdisk, index);
+            if (chunk)
+              RtlCopyMemory(chunk + within, buffer, len);
+              else
+              status = STATUS_DISK_FULL;
+          } else if (chunk) {
+            RtlCopyMemory(buffer, chunk + within, len);
+          } else {
+            RtlZeroMemory(buffer, len);
+          }
+
+        KeAcquireSpinLock(lock, &irql);
+        ramdisk->ChunkUsers[index]--;
+        KeReleaseSpinLock(lock, irql);
+        if (!NT_SUCCESS(status))
+          return status;
+
+        offset += len;
+        buffer += len;
+        length -= len;
+      }
+    return STATUS_SUCCESS;
+  }
+
+/**
+ * Find the RAM disk for a device.
+ *
+ * @v dev                       The device.
+ * @ret WV_SP_RAMDISK_T         The RAM disk, or NULL if the device
+ *                              isn't one allocated at runtime.
+ */
+WV_SP_RAMDISK_T STDCALL WvRamdiskFromDev(IN WV_SP_DEV_T dev) {
+    if (dev->Ops.Free != WvRamdiskDynamicFree_)
+      return NULL;
+    return CONTAINING_RECORD(dev, WV_S_RAMDISK_T, Dev[0]);
+  }
+
+/** Private function definitions */
+
+/**
+ * Populate a chunk of a RAM disk.
+ *
+ * @v ramdisk           The RAM disk needing the chunk.
+ * @v index             The index of the chunk.
+ * @ret PUCHAR          The chunk, or NULL if there's no memory for it.
+ *
+ * The chunk is allocated by the processor writing to it, so that a
+ * NUMA system takes it from that processor's node.  Concurrent writers
+ * might both allocate; the loser frees its own.
+ */
+static PUCHAR STDCALL WvRamdiskChunk_(
+    IN WV_SP_RAMDISK_T ramdisk,
+    IN ULONGLONG index
+  ) {
+    PUCHAR chunk;
+    PUCHAR other_chunk;
+
+    chunk = wv_mallocz(WV_M_RAMDISK_CHUNK_SIZE);
+    if (!chunk) {
+        DBG("No memory for RAM disk %p chunk!\n", (PVOID) ramdisk);
+        return NULL;
+      }
+    other_chunk = InterlockedCompareExchangePointer(
+        (PVOID *) (ramdisk->Chunks + index),
+        chunk,
+        NULL
+      );
+    if (other_chunk) {
+        wv_free(chunk);
+        chunk = other_chunk;
+      }
+    return chunk;
+  }
+
+/* RAM disk unmap routine. */
+static NTSTATUS STDCALL WvRamdiskUnmap_(
+    IN WVL_SP_DISK_T disk,
+    IN WVL_SP_DISK_RANGE ranges,
+    IN UINT32 count,
+    IN PIRP irp
+  ) {
+    WV_SP_RAMDISK_T ramdisk = CONTAINING_RECORD(
+        disk,
+        WV_S_RAMDISK_T,
+        disk[0]
+      );
+    WVL_SP_DISK_RANGE range;
+    ULONGLONG offset;
+    ULONGLONG end;
+
+    for (range = ranges; range < ranges + count; range++) {
+        offset = range->StartSector * disk->SectorSize;
+        end = offset + (ULONGLONG) range->SectorCount * disk->SectorSize;
+        if (ramdisk->ZStore)
+          WvRamdiskZUnmap(ramdisk, offset, end);
+          else
+          WvRamdiskChunkUnmap_(ramdisk, offset, end);
+      }
+    return WvlIrpComplete(irp, 0, STATUS_SUCCESS);
+  }
+
+/**
+ * Free the chunks of a RAM disk within a range.
+ *
+ * @v ramdisk           The RAM disk allocated at runtime.
+ * @v offset            The byte offset of the start of the range.
+ * @v end               The byte offset of the end of the range.
+ *
+ * Chunks only partly within the range are left as they are, as are
+ * those a transfer is using; either way, they're still correct.
+ */
+static VOID STDCALL WvRamdiskChunkUnmap_(
+    IN WV_SP_RAMDISK_T ramdisk,
+    IN ULONGLONG offset,
+    IN ULONGLONG end
+  ) {
+    ULONGLONG index;
+    ULONGLONG end_index;
+    PKSPIN_LOCK lock;
+    KIRQL irql;
+    PUCHAR chunk;
+
+    index = (offset + WV_M_RAMDISK_CHUNK_SIZE - 1) / WV_M_RAMDISK_CHUNK_SIZE;
+    /* The last chunk might be short, but it's still whole. */
+    if (end >= ramdisk->DiskSize * ramdisk->disk->SectorSize)
+      end_index = ramdisk->ChunkCount;
+      else
+      end_index = end / WV_M_RAMDISK_CHUNK_SIZE;
+    for (; index < end_index; ++index) {
+        lock = ramdisk->ChunkLocks + index % WV_M_RAMDISK_CHUNK_STRIPES;
+        chunk = NULL;
+        KeAcquireSpinLock(lock, &irql);
+        if (!ramdisk->ChunkUsers[index]) {
+            chunk = ramdisk->Chunks[index];
+            ramdisk->Chunks[index] = NULL;
+          }
+        KeReleaseSpinLock(lock, irql);
+        wv_free(chunk);
+      }
+    return;
+  }
+
+/* Return a RAM disk's memory, then free the RAM disk. */
+static VOID STDCALL WvRamdiskDynamicFree_(IN WV_SP_DEV_T dev) {
+    WV_SP_RAMDISK_T ramdisk = CONTAINING_RECORD(dev, WV_S_RAMDISK_T, Dev[0]);
+    ULONGLONG i;
+
+    if (ramdisk->ZStore)
+      WvRamdiskZFree(ramdisk);
+    for (i = 0; i < ramdisk->ChunkCount; ++i)
+      wv_free(ramdisk->Chunks[i]);
+    wv_free(ramdisk->Chunks);
+    ramdisk->Chunks = NULL;
+    wv_free(ramdisk->ChunkUsers);
+    ramdisk->ChunkUsers = NULL;
+    ramdisk->prev_free(dev);
+  }
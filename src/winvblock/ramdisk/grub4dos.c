@@ -37,16 +37,18 @@
 #include "debug.h"
 #include "x86.h"
 #include "safehook.h"
+#include "g4dmap.h"
 #include "grub4dos.h"
 
 /** Create a GRUB4DOS RAM disk and set its parent bus */
 DEVICE_OBJECT * WvRamdiskCreateG4dDisk(
-    SP_WV_G4D_DRIVE_MAPPING slot,
+    WV_SP_G4D_MAP map,
     DEVICE_OBJECT * bus_dev_obj,
     WVL_E_DISK_MEDIA_TYPE media_type,
     UINT32 sector_size
   ) {
     WV_SP_RAMDISK_T ramdisk;
+    NTSTATUS status;
 
     ramdisk = WvRamdiskCreatePdo(media_type);
     if (!ramdisk) {
@@ -55,11 +57,11 @@ DEVICE_OBJECT * WvRamdiskCreateG4dDisk(
       }
     DBG("RAM Drive is type: %d\n", media_type);
 
-    ramdisk->DiskBuf = (UINT32) (slot->SectorStart * 512);
+    ramdisk->DiskBuf = map->Offset;
     ramdisk->disk->LBADiskSize = ramdisk->DiskSize =
-      (UINT32) slot->SectorCount;
-    ramdisk->disk->Heads = slot->MaxHead + 1;
-    ramdisk->disk->Sectors = slot->DestMaxSector;
+      map->Length / sector_size;
+    ramdisk->disk->Heads = map->Heads;
+    ramdisk->disk->Sectors = map->Sectors;
     ramdisk->disk->Cylinders = (
         ramdisk->disk->LBADiskSize /
         (ramdisk->disk->Heads * ramdisk->disk->Sectors)
@@ -67,6 +69,12 @@ DEVICE_OBJECT * WvRamdiskCreateG4dDisk(
     ramdisk->disk->Media = media_type;
     ramdisk->disk->SectorSize = sector_size;
     ramdisk->Dev->Boot = TRUE;
+    status = WvRamdiskVerifyOpen(ramdisk);
+    if (!NT_SUCCESS(status) && status != STATUS_NOT_FOUND) {
+        DBG("GRUB4DOS disk failed verification!\n");
+        WvDevFree(ramdisk->Dev);
+        return NULL;
+      }
      /* Add the ramdisk to the bus. */
     ramdisk->disk->ParentBus = bus_dev_obj;
     WvlBusInitNode(&ramdisk->Dev->BusNode, ramdisk->Dev->Self);
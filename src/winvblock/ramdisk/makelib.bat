@@ -2,7 +2,7 @@
 
 set libname=ramdisk
 
-set c=ramdisk.c memdisk.c grub4dos.c
+set c=ramdisk.c memdisk.c grub4dos.c dynamic.c compress.c zpage.c verify.c ramhash.c ..\..\lz4\lz4.c
 
 echo !INCLUDE $(NTMAKEENV)\makefile.def	> makefile
 
@@ -51,6 +51,7 @@ static BOOLEAN STDCALL WvMemdiskCheckMbft_(
     WVL_E_DISK_MEDIA_TYPE media_type;
     UINT32 sector_size;
     WV_SP_RAMDISK_T ramdisk;
+    NTSTATUS status;
 
     if (offset >= 0x100000) {
         DBG("mBFT physical pointer too high!\n");
@@ -104,6 +105,12 @@ static BOOLEAN STDCALL WvMemdiskCheckMbft_(
     ramdisk->disk->Media = media_type;
     ramdisk->disk->SectorSize = sector_size;
     ramdisk->Dev->Boot = TRUE;
+    status = WvRamdiskVerifyOpen(ramdisk);
+    if (!NT_SUCCESS(status) && status != STATUS_NOT_FOUND) {
+        DBG("MEMDISK disk failed verification!\n");
+        WvDevFree(ramdisk->Dev);
+        return FALSE;
+      }
 
     /* Add the ramdisk to the bus. */
     ramdisk->disk->ParentBus = WvBus.Fdo;
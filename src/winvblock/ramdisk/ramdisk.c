@@ -25,6 +25,7 @@
 
 #include <stdio.h>
 #include <ntddk.h>
+#include <emmintrin.h>
 
 #include "portable.h"
 #include "winvblock.h"
@@ -35,11 +36,53 @@
 #include "device.h"
 #include "disk.h"
 #include "ramdisk.h"
+#include "thread.h"
 #include "debug.h"
 
+/** Macros */
+
+/* Transfers at least this large are copied by the shared worker pool */
+#define WV_M_RAMDISK_POOL_MIN_XFER (64 * 1024)
+
+/*
+ * How many windows may be mapped at once, across all RAM disks.  A
+ * 32-bit system has little address space to spare, so the remainder
+ * of a large disk is mapped per transfer.
+ */
+#ifdef _WIN64
+#  define WV_M_RAMDISK_MAX_WINDOWS MAXLONG
+#else
+#  define WV_M_RAMDISK_MAX_WINDOWS 64
+#endif
+
+/* Writes at least this large don't displace the processor's caches */
+#define WV_M_RAMDISK_STREAM_MIN_XFER (256 * 1024)
+
+/* An unmapped caller's buffer is mapped this much at a time */
+#define WV_M_RAMDISK_MDL_PIECE (64 * 1024)
+
 /** Private. */
 static WV_F_DEV_FREE WvRamdiskFree_;
 static WVL_F_DISK_IO WvRamdiskIo_;
+static WVL_F_DISK_IO_MDL WvRamdiskIoMdl_;
+static WVL_F_THREAD_ITEM WvRamdiskIoInPool_;
+
+/* How many windows are mapped */
+static LONG WvRamdiskWindowsMapped_;
+
+/* A RAM disk transfer for the worker pool */
+typedef struct WV_RAMDISK_IO_ {
+    WVL_S_THREAD_ITEM item[1];
+    WVL_SP_DISK_T disk;
+    WVL_E_DISK_IO_MODE mode;
+    LONGLONG start_sector;
+    UINT32 sector_count;
+    PUCHAR buffer;
+    /* For a buffer which isn't mapped */
+    PMDL mdl;
+    UINT32 mdl_offset;
+    PIRP irp;
+  } WV_S_RAMDISK_IO_, * WV_SP_RAMDISK_IO_;
 
 /* With thanks to karyonix, who makes FiraDisk. */
 static __inline VOID STDCALL WvRamdiskFastCopy_(
@@ -50,8 +93,225 @@ static __inline VOID STDCALL WvRamdiskFastCopy_(
     __movsd(dest, src, count >> 2);
   }
 
-/* RAM disk I/O routine. */
-static NTSTATUS STDCALL WvRamdiskIo_(
+/* Copy with non-temporal stores, so the destination isn't cached. */
+static VOID STDCALL WvRamdiskStreamCopy_(
+    PVOID dest,
+    const VOID * src,
+    size_t count
+  ) {
+    int * d = dest;
+    const int * s = src;
+
+    for (count >>= 2; count; --count)
+      _mm_stream_si32(d++, *s++);
+    _mm_sfence();
+  }
+
+/* The size of the RAM disk's memory, in bytes. */
+static ULONGLONG STDCALL WvRamdiskBytes_(IN WV_SP_RAMDISK_T ramdisk) {
+    return (ULONGLONG) ramdisk->DiskSize * ramdisk->disk->SectorSize;
+  }
+
+/* The number of windows covering the RAM disk's memory. */
+static UINT32 STDCALL WvRamdiskWindowCount_(IN WV_SP_RAMDISK_T ramdisk) {
+    return (UINT32) (
+        (WvRamdiskBytes_(ramdisk) + WV_M_RAMDISK_WINDOW_SIZE - 1) /
+        WV_M_RAMDISK_WINDOW_SIZE
+      );
+  }
+
+/* The length of one window, which is short for the last one. */
+static SIZE_T STDCALL WvRamdiskWindowLen_(
+    IN WV_SP_RAMDISK_T ramdisk,
+    IN UINT32 index
+  ) {
+    ULONGLONG left;
+
+    left = WvRamdiskBytes_(ramdisk) -
+      (ULONGLONG) index * WV_M_RAMDISK_WINDOW_SIZE;
+    if (left > WV_M_RAMDISK_WINDOW_SIZE)
+      return WV_M_RAMDISK_WINDOW_SIZE;
+    return (SIZE_T) left;
+  }
+
+/**
+ * Fetch a window onto the RAM disk's memory, mapping it if needed.
+ *
+ * @v ramdisk           The RAM disk whose memory is wanted.
+ * @v index             The index of the window.
+ * @ret PUCHAR          The mapped window, or NULL.
+ *
+ * A window stays mapped until the RAM disk is freed.  Concurrent
+ * callers might both map a window; the loser unmaps its own.
+ */
+PUCHAR STDCALL WvRamdiskWindow(
+    IN WV_SP_RAMDISK_T ramdisk,
+    IN UINT32 index
+  ) {
+    PUCHAR * windows;
+    PUCHAR * other_windows;
+    PUCHAR window;
+    PUCHAR other_window;
+    PHYSICAL_ADDRESS phys_addr;
+    SIZE_T len;
+
+    windows = ramdisk->Windows;
+    if (!windows) {
+        windows = wv_mallocz(
+            sizeof *windows * WvRamdiskWindowCount_(ramdisk)
+          );
+        if (!windows)
+          return NULL;
+        other_windows = InterlockedCompareExchangePointer(
+            (PVOID *) &ramdisk->Windows,
+            windows,
+            NULL
+          );
+        if (other_windows) {
+            wv_free(windows);
+            windows = other_windows;
+          }
+      }
+
+    window = windows[index];
+    if (window)
+      return window;
+
+    if (
+        InterlockedIncrement(&WvRamdiskWindowsMapped_) >
+        WV_M_RAMDISK_MAX_WINDOWS
+      ) {
+        InterlockedDecrement(&WvRamdiskWindowsMapped_);
+        return NULL;
+      }
+    len = WvRamdiskWindowLen_(ramdisk, index);
+    phys_addr.QuadPart =
+      ramdisk->DiskBuf + (ULONGLONG) index * WV_M_RAMDISK_WINDOW_SIZE;
+    window = MmMapIoSpace(phys_addr, len, MmCached);
+    if (!window) {
+        InterlockedDecrement(&WvRamdiskWindowsMapped_);
+        return NULL;
+      }
+    other_window = InterlockedCompareExchangePointer(
+        (PVOID *) (windows + index),
+        window,
+        NULL
+      );
+    if (other_window) {
+        MmUnmapIoSpace(window, len);
+        InterlockedDecrement(&WvRamdiskWindowsMapped_);
+        window = other_window;
+      }
+    return window;
+  }
+
+/* Unmap any windows onto the RAM disk's memory. */
+static VOID STDCALL WvRamdiskUnmapWindows_(IN WV_SP_RAMDISK_T ramdisk) {
+    UINT32 i;
+
+    if (!ramdisk->Windows)
+      return;
+    for (i = 0; i < WvRamdiskWindowCount_(ramdisk); ++i) {
+        if (ramdisk->Windows[i]) {
+            MmUnmapIoSpace(
+                ramdisk->Windows[i],
+                WvRamdiskWindowLen_(ramdisk, i)
+              );
+            InterlockedDecrement(&WvRamdiskWindowsMapped_);
+          }
+      }
+    wv_free(ramdisk->Windows);
+    ramdisk->Windows = NULL;
+  }
+
+/**
+ * Copy to or from the RAM disk.
+ *
+ * @v ramdisk           The RAM disk to copy to or from.
+ * @v mode              Read/write mode.
+ * @v offset            The byte offset into the disk.
+ * @v left              The number of bytes to copy.
+ * @v buffer            The caller's buffer.
+ * @v stream            Whether to write with non-temporal stores.
+ * @ret NTSTATUS        The status of the operation.
+ */
+static NTSTATUS STDCALL WvRamdiskMove_(
+    IN WV_SP_RAMDISK_T ramdisk,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN ULONGLONG offset,
+    IN UINT32 left,
+    IN PUCHAR buffer,
+    IN BOOLEAN stream
+  ) {
+    PHYSICAL_ADDRESS phys_addr;
+    PUCHAR phys_mem;
+    PUCHAR window;
+    UINT32 within;
+    UINT32 len;
+    NTSTATUS status;
+
+    /* A RAM disk allocated at runtime has no physical memory to map. */
+    if (ramdisk->Chunks || ramdisk->ZStore)
+      return WvRamdiskChunkIo(ramdisk, mode, offset, left, buffer);
+
+    /* Before writes, too, or a written block could never match again. */
+    status = WvRamdiskVerifyRange(ramdisk, offset, left);
+    if (!NT_SUCCESS(status))
+      return status;
+
+    while (left) {
+        within = (UINT32) (offset % WV_M_RAMDISK_WINDOW_SIZE);
+        len = WV_M_RAMDISK_WINDOW_SIZE - within;
+        if (len > left)
+          len = left;
+
+        window = WvRamdiskWindow(
+            ramdisk,
+            (UINT32) (offset / WV_M_RAMDISK_WINDOW_SIZE)
+          );
+        if (window) {
+            phys_mem = window + within;
+          } else {
+            /* Out of windows, so just map what's needed. */
+            phys_addr.QuadPart = ramdisk->DiskBuf + offset;
+            phys_mem = MmMapIoSpace(phys_addr, len, MmCached);
+            if (!phys_mem) {
+                DBG("Could not map memory for RAM disk!\n");
+                return STATUS_INSUFFICIENT_RESOURCES;
+              }
+          }
+
+        if (stream)
+          WvRamdiskStreamCopy_(phys_mem, buffer, len);
+          else if (mode == WvlDiskIoModeWrite)
+          WvRamdiskFastCopy_(phys_mem, buffer, len);
+          else
+          WvRamdiskFastCopy_(buffer, phys_mem, len);
+
+        if (!window)
+          MmUnmapIoSpace(phys_mem, len);
+        offset += len;
+        buffer += len;
+        left -= len;
+      }
+    return STATUS_SUCCESS;
+  }
+
+/* Should a transfer's writes bypass the processor's caches? */
+static BOOLEAN STDCALL WvRamdiskStream_(
+    IN WV_SP_RAMDISK_T ramdisk,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN UINT32 len
+  ) {
+    return (BOOLEAN) (
+        ramdisk->Stream &&
+        mode == WvlDiskIoModeWrite &&
+        len >= WV_M_RAMDISK_STREAM_MIN_XFER
+      );
+  }
+
+/* Copy to or from the RAM disk and complete the IRP. */
+static NTSTATUS STDCALL WvRamdiskCopy_(
     IN WVL_SP_DISK_T disk,
     IN WVL_E_DISK_IO_MODE mode,
     IN LONGLONG start_sector,
@@ -59,14 +319,146 @@ static NTSTATUS STDCALL WvRamdiskIo_(
     IN PUCHAR buffer,
     IN PIRP irp
   ) {
-    PHYSICAL_ADDRESS phys_addr;
-    PUCHAR phys_mem;
     WV_SP_RAMDISK_T ramdisk;
+    UINT32 len;
+    NTSTATUS status;
 
     /* Establish pointer to the RAM disk. */
     ramdisk = CONTAINING_RECORD(disk, WV_S_RAMDISK_T, disk);
 
-    if (sector_count < 1) {
+    len = sector_count * disk->SectorSize;
+    status = WvRamdiskMove_(
+        ramdisk,
+        mode,
+        start_sector * disk->SectorSize,
+        len,
+        buffer,
+        WvRamdiskStream_(ramdisk, mode, len)
+      );
+    return WvlIrpComplete(irp, NT_SUCCESS(status) ? len : 0, status);
+  }
+
+/*
+ * Copy to or from the RAM disk through an MDL and complete the IRP.
+ * Unless the caller's buffer is already mapped, it is mapped a piece
+ * at a time, so a large transfer needs few system PTEs at once.
+ */
+static NTSTATUS STDCALL WvRamdiskCopyMdl_(
+    IN WVL_SP_DISK_T disk,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count,
+    IN PMDL mdl,
+    IN UINT32 mdl_offset,
+    IN PIRP irp
+  ) {
+    WV_SP_RAMDISK_T ramdisk;
+    PUCHAR va;
+    PMDL piece;
+    PUCHAR buffer;
+    ULONGLONG offset;
+    UINT32 total;
+    UINT32 done;
+    UINT32 len;
+    BOOLEAN stream;
+    NTSTATUS status;
+
+    if (
+        mdl->MdlFlags &
+        (MDL_MAPPED_TO_SYSTEM_VA | MDL_SOURCE_IS_NONPAGED_POOL)
+      ) {
+        buffer = MmGetSystemAddressForMdlSafe(mdl, HighPagePriority);
+        if (!buffer)
+          return WvlIrpComplete(irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+        return WvRamdiskCopy_(
+            disk,
+            mode,
+            start_sector,
+            sector_count,
+            buffer + mdl_offset,
+            irp
+          );
+      }
+
+    ramdisk = CONTAINING_RECORD(disk, WV_S_RAMDISK_T, disk);
+    va = (PUCHAR) MmGetMdlVirtualAddress(mdl) + mdl_offset;
+    offset = start_sector * disk->SectorSize;
+    total = sector_count * disk->SectorSize;
+    stream = WvRamdiskStream_(ramdisk, mode, total);
+
+    /* Every piece starts at the same offset within a page. */
+    len = total < WV_M_RAMDISK_MDL_PIECE ? total : WV_M_RAMDISK_MDL_PIECE;
+    piece = IoAllocateMdl(va, len, FALSE, FALSE, NULL);
+    if (!piece)
+      return WvlIrpComplete(irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+
+    status = STATUS_SUCCESS;
+    for (done = 0; done < total; done += len) {
+        len = total - done;
+        if (len > WV_M_RAMDISK_MDL_PIECE)
+          len = WV_M_RAMDISK_MDL_PIECE;
+        IoBuildPartialMdl(mdl, piece, va + done, len);
+        buffer = MmGetSystemAddressForMdlSafe(piece, HighPagePriority);
+        if (!buffer) {
+            DBG("Could not map caller's buffer!\n");
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+          }
+        status = WvRamdiskMove_(
+            ramdisk,
+            mode,
+            offset + done,
+            len,
+            buffer,
+            stream
+          );
+        MmPrepareMdlForReuse(piece);
+        if (!NT_SUCCESS(status))
+          break;
+      }
+    IoFreeMdl(piece);
+    return WvlIrpComplete(irp, NT_SUCCESS(status) ? total : 0, status);
+  }
+
+/* Perform a RAM disk transfer and complete its IRP. */
+static NTSTATUS STDCALL WvRamdiskRun_(IN WV_SP_RAMDISK_IO_ io) {
+    if (io->mdl) {
+        return WvRamdiskCopyMdl_(
+            io->disk,
+            io->mode,
+            io->start_sector,
+            io->sector_count,
+            io->mdl,
+            io->mdl_offset,
+            io->irp
+          );
+      }
+    return WvRamdiskCopy_(
+        io->disk,
+        io->mode,
+        io->start_sector,
+        io->sector_count,
+        io->buffer,
+        io->irp
+      );
+  }
+
+/* Perform a RAM disk transfer in a pool worker. */
+static VOID STDCALL WvRamdiskIoInPool_(IN OUT WVL_SP_THREAD_ITEM item) {
+    WV_SP_RAMDISK_IO_ io = CONTAINING_RECORD(item, WV_S_RAMDISK_IO_, item[0]);
+
+    WvRamdiskRun_(io);
+    wv_free(io);
+    return;
+  }
+
+/* Start a RAM disk transfer, here or in the pool. */
+static NTSTATUS STDCALL WvRamdiskStart_(IN WV_SP_RAMDISK_IO_ now) {
+    WVL_SP_DISK_T disk = now->disk;
+    PIRP irp = now->irp;
+    WV_SP_RAMDISK_IO_ io;
+
+    if (now->sector_count < 1) {
         /* A silly request. */
         DBG("sector_count < 1; cancelling\n");
         irp->IoStatus.Information = 0;
@@ -75,28 +467,73 @@ static NTSTATUS STDCALL WvRamdiskIo_(
         return STATUS_CANCELLED;
       }
 
-    phys_addr.QuadPart =
-      ramdisk->DiskBuf + (start_sector * disk->SectorSize);
-    /* Possible precision loss. */
-    phys_mem = MmMapIoSpace(
-        phys_addr,
-        sector_count * disk->SectorSize,
-  		  MmNonCached
-      );
-    if (!phys_mem) {
-        DBG("Could not map memory for RAM disk!\n");
-        return WvlIrpComplete(irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+    /*
+     * Small copies are cheaper to do right here.  Large ones go to the
+     * pool, so that concurrent requests are copied on several processors.
+     */
+    if (now->sector_count * disk->SectorSize < WV_M_RAMDISK_POOL_MIN_XFER)
+      goto copy_now;
+
+    io = wv_malloc(sizeof *io);
+    if (!io)
+      goto copy_now;
+    *io = *now;
+    io->item->Func = WvRamdiskIoInPool_;
+    IoMarkIrpPending(irp);
+    if (!WvlThreadPoolAddItem(io->item)) {
+        /* The IRP was marked pending, so we still return STATUS_PENDING. */
+        wv_free(io);
+        WvRamdiskRun_(now);
       }
-    if (mode == WvlDiskIoModeWrite)
-      WvRamdiskFastCopy_(phys_mem, buffer, sector_count * disk->SectorSize);
-      else
-      WvRamdiskFastCopy_(buffer, phys_mem, sector_count * disk->SectorSize);
-    MmUnmapIoSpace(phys_mem, sector_count * disk->SectorSize);
-    return WvlIrpComplete(
-        irp,
-        sector_count * disk->SectorSize,
-        STATUS_SUCCESS
-      );
+    return STATUS_PENDING;
+
+    copy_now:
+    return WvRamdiskRun_(now);
+  }
+
+/* RAM disk I/O routine. */
+static NTSTATUS STDCALL WvRamdiskIo_(
+    IN WVL_SP_DISK_T disk,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count,
+    IN PUCHAR buffer,
+    IN PIRP irp
+  ) {
+    WV_S_RAMDISK_IO_ io;
+
+    io.disk = disk;
+    io.mode = mode;
+    io.start_sector = start_sector;
+    io.sector_count = sector_count;
+    io.buffer = buffer;
+    io.mdl = NULL;
+    io.mdl_offset = 0;
+    io.irp = irp;
+    return WvRamdiskStart_(&io);
+  }
+
+/* RAM disk I/O routine for a buffer which might not be mapped. */
+static NTSTATUS STDCALL WvRamdiskIoMdl_(
+    IN WVL_SP_DISK_T disk,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count,
+    IN PMDL mdl,
+    IN UINT32 mdl_offset,
+    IN PIRP irp
+  ) {
+    WV_S_RAMDISK_IO_ io;
+
+    io.disk = disk;
+    io.mode = mode;
+    io.start_sector = start_sector;
+    io.sector_count = sector_count;
+    io.buffer = NULL;
+    io.mdl = mdl;
+    io.mdl_offset = mdl_offset;
+    io.irp = irp;
+    return WvRamdiskStart_(&io);
   }
 
 /* Copy RAM disk IDs to the provided buffer. */
@@ -132,7 +569,15 @@ static NTSTATUS STDCALL WvRamdiskPnpQueryId_(
 
         case BusQueryInstanceID:
         	/* "Location". */
-          swprintf(*buf, L"RAM_at_%08X", ramdisk->DiskBuf);
+          if (ramdisk->Chunks || ramdisk->ZStore) {
+              swprintf(
+                  *buf,
+                  L"RAM_dynamic_%u",
+                  WvlBusGetNodeNum(&ramdisk->Dev->BusNode)
+                );
+              break;
+            }
+          swprintf(*buf, L"RAM_at_%08I64X", ramdisk->DiskBuf);
           break;
 
         case BusQueryHardwareIDs:
@@ -264,11 +709,16 @@ WV_SP_RAMDISK_T STDCALL WvRamdiskCreatePdo(
     ramdisk->Dev->Ops.Free = WvRamdiskFree_;
     ramdisk->Dev->ext = ramdisk->disk;
     ramdisk->disk->disk_ops.Io = WvRamdiskIo_;
+    ramdisk->disk->disk_ops.IoMdl = WvRamdiskIoMdl_;
     ramdisk->disk->disk_ops.UnitNum = WvRamdiskUnitNum_;
     ramdisk->disk->disk_ops.PnpQueryId = WvRamdiskPnpQueryId_;
     ramdisk->disk->disk_ops.PnpQueryDevText = WvDiskPnpQueryDevText;
     ramdisk->disk->ext = ramdisk;
     ramdisk->disk->DriverObj = WvDriverObj;
+    ramdisk->disk->NonRotational = TRUE;
+    ramdisk->Stream = ExIsProcessorFeaturePresent(
+        PF_XMMI64_INSTRUCTIONS_AVAILABLE
+      );
 
     /* Set associations for the PDO, device, disk. */
     WvDevForDevObj(pdo, ramdisk->Dev);
@@ -289,5 +739,9 @@ WV_SP_RAMDISK_T STDCALL WvRamdiskCreatePdo(
  * @v dev               Points to the RAM disk device to delete.
  */
 static VOID STDCALL WvRamdiskFree_(IN WV_SP_DEV_T dev) {
+    WV_SP_RAMDISK_T ramdisk = CONTAINING_RECORD(dev, WV_S_RAMDISK_T, Dev[0]);
+
+    WvRamdiskVerifyFree(ramdisk);
+    WvRamdiskUnmapWindows_(ramdisk);
     IoDeleteDevice(dev->Self);
   }
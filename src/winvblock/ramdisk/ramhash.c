@@ -0,0 +1,148 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * XXH64, for RAM disk hash manifests.
+ *
+ * A plain C rendition of Yann Collet's XXH64.  Four independent lanes
+ * keep a superscalar processor busy without any vector instructions.
+ */
+
+#include "ramhash.h"
+
+/** Macros */
+
+#define WV_M_RAMHASH_PRIME1 0x9E3779B185EBCA87ULL
+#define WV_M_RAMHASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define WV_M_RAMHASH_PRIME3 0x165667B19E3779F9ULL
+#define WV_M_RAMHASH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define WV_M_RAMHASH_PRIME5 0x27D4EB2F165667C5ULL
+
+#define WV_M_RAMHASH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/** Private function declarations */
+static unsigned long long WvRamhashGet64_(const unsigned char *);
+static unsigned long WvRamhashGet32_(const unsigned char *);
+static unsigned long long WvRamhashRound_(
+    unsigned long long,
+    unsigned long long
+  );
+static unsigned long long WvRamhashMerge_(
+    unsigned long long,
+    unsigned long long
+  );
+
+/** Private function definitions */
+
+/* Fetch a little-endian 64-bit value */
+static unsigned long long WvRamhashGet64_(const unsigned char * p) {
+    return (unsigned long long) WvRamhashGet32_(p) |
+      (unsigned long long) WvRamhashGet32_(p + 4) << 32;
+  }
+
+/* Fetch a little-endian 32-bit value */
+static unsigned long WvRamhashGet32_(const unsigned char * p) {
+    return (unsigned long) p[0] |
+      (unsigned long) p[1] << 8 |
+      (unsigned long) p[2] << 16 |
+      (unsigned long) p[3] << 24;
+  }
+
+/* Mix eight bytes of input into a lane */
+static unsigned long long WvRamhashRound_(
+    unsigned long long acc,
+    unsigned long long input
+  ) {
+    acc += input * WV_M_RAMHASH_PRIME2;
+    acc = WV_M_RAMHASH_ROTL(acc, 31);
+    return acc * WV_M_RAMHASH_PRIME1;
+  }
+
+/* Fold a lane into the hash */
+static unsigned long long WvRamhashMerge_(
+    unsigned long long hash,
+    unsigned long long lane
+  ) {
+    hash ^= WvRamhashRound_(0, lane);
+    return hash * WV_M_RAMHASH_PRIME1 + WV_M_RAMHASH_PRIME4;
+  }
+
+/** Exported function definitions */
+
+/* See the header for details. */
+unsigned long long WvRamhashXxh64(
+    const void * buf,
+    unsigned long len,
+    unsigned long long seed
+  ) {
+    const unsigned char * p = buf;
+    const unsigned char * end = p + len;
+    unsigned long long v1, v2, v3, v4;
+    unsigned long long hash;
+
+    if (len >= 32) {
+        v1 = seed + WV_M_RAMHASH_PRIME1 + WV_M_RAMHASH_PRIME2;
+        v2 = seed + WV_M_RAMHASH_PRIME2;
+        v3 = seed;
+        v4 = seed - WV_M_RAMHASH_PRIME1;
+        do {
+            v1 = WvRamhashRound_(v1, WvRamhashGet64_(p));
+            v2 = WvRamhashRound_(v2, WvRamhashGet64_(p + 8));
+            v3 = WvRamhashRound_(v3, WvRamhashGet64_(p + 16));
+            v4 = WvRamhashRound_(v4, WvRamhashGet64_(p + 24));
+            p += 32;
+          } while (end - p >= 32);
+        hash = WV_M_RAMHASH_ROTL(v1, 1) +
+          WV_M_RAMHASH_ROTL(v2, 7) +
+          WV_M_RAMHASH_ROTL(v3, 12) +
+          WV_M_RAMHASH_ROTL(v4, 18);
+        hash = WvRamhashMerge_(hash, v1);
+        hash = WvRamhashMerge_(hash, v2);
+        hash = WvRamhashMerge_(hash, v3);
+        hash = WvRamhashMerge_(hash, v4);
+      } else {
+        hash = seed + WV_M_RAMHASH_PRIME5;
+      }
+    hash += len;
+
+    for (; end - p >= 8; p += 8) {
+        hash ^= WvRamhashRound_(0, WvRamhashGet64_(p));
+        hash = WV_M_RAMHASH_ROTL(hash, 27) * WV_M_RAMHASH_PRIME1 +
+          WV_M_RAMHASH_PRIME4;
+      }
+    if (end - p >= 4) {
+        hash ^= WvRamhashGet32_(p) * WV_M_RAMHASH_PRIME1;
+        hash = WV_M_RAMHASH_ROTL(hash, 23) * WV_M_RAMHASH_PRIME2 +
+          WV_M_RAMHASH_PRIME3;
+        p += 4;
+      }
+    for (; p < end; ++p) {
+        hash ^= *p * WV_M_RAMHASH_PRIME5;
+        hash = WV_M_RAMHASH_ROTL(hash, 11) * WV_M_RAMHASH_PRIME1;
+      }
+
+    /* Avalanche */
+    hash ^= hash >> 33;
+    hash *= WV_M_RAMHASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= WV_M_RAMHASH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+  }
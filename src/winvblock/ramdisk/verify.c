@@ -0,0 +1,417 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * RAM disk verification against a hash manifest.
+ *
+ * A boot loader's RAM disk image may end with a manifest holding one
+ * XXH64 per block (see ramhash.h).  When it does, no block is read or
+ * written until it has been hashed and found to match.  A transfer
+ * hashes whichever of its blocks haven't been checked yet, while a few
+ * pool items work through the rest of the disk in short slices, so
+ * that most blocks have been checked before anyone asks for them.
+ * Each block is checked only once: a matching block gets its bit set
+ * in the Good bitmap and is trusted from then on.
+ */
+
+#include <ntddk.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "wv_stdlib.h"
+#include "wv_string.h"
+#include "bus.h"
+#include "device.h"
+#include "disk.h"
+#include "ramdisk.h"
+#include "ramhash.h"
+#include "thread.h"
+#include "debug.h"
+
+/** Macros */
+
+/* How many pool items check blocks in the background */
+#define WV_M_RAMDISK_VERIFY_WORKERS 4
+
+/* How long a pool item checks blocks before re-queueing, in 100 ns units */
+#define WV_M_RAMDISK_VERIFY_SLICE 10000
+
+/** Object types */
+typedef struct WV_RAMDISK_VERIFY_WORKER_
+  WV_S_RAMDISK_VERIFY_WORKER_, * WV_SP_RAMDISK_VERIFY_WORKER_;
+
+/** Struct/union type definitions */
+
+/* A background pool item */
+struct WV_RAMDISK_VERIFY_WORKER_ {
+    WVL_S_THREAD_ITEM item[1];
+    WV_SP_RAMDISK_VERIFY Verify;
+    /* Whether the item is with the pool */
+    LONG Busy;
+  };
+
+struct WV_RAMDISK_VERIFY {
+    WV_SP_RAMDISK_T Ramdisk;
+    UINT32 BlockShift;
+    ULONG BlockCount;
+    /* The expected hash of each block */
+    PULONGLONG Hashes;
+    /* One bit per block.  A set bit means the block has matched */
+    LONG * Good;
+    /* The next block for the background items */
+    LONG Next;
+    /* Set when the RAM disk is going away */
+    LONG Stop;
+    /* Busy background items, biased by one until the RAM disk is freed */
+    LONG Workers;
+    KEVENT Idle;
+    WV_S_RAMDISK_VERIFY_WORKER_ Worker[WV_M_RAMDISK_VERIFY_WORKERS];
+  };
+
+/** Private function declarations */
+static NTSTATUS STDCALL WvRamdiskVerifyCheck_(
+    IN WV_SP_RAMDISK_VERIFY,
+    IN ULONG
+  );
+static BOOLEAN STDCALL WvRamdiskVerifyKick_(IN WV_SP_RAMDISK_VERIFY);
+static WVL_F_THREAD_ITEM WvRamdiskVerifyWork_;
+
+/** Private function definitions */
+
+/* Has a block already matched? */
+static __inline BOOLEAN STDCALL WvRamdiskVerifyIsGood_(
+    IN WV_SP_RAMDISK_VERIFY verify,
+    IN ULONG block
+  ) {
+    return (verify->Good[block / 32] & (1L << (block % 32))) != 0;
+  }
+
+/**
+ * Check one block against its hash.
+ *
+ * @v verify            The RAM disk's verification state.
+ * @v block             The index of the block to check.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * A mismatch while someone else has marked the block as good is the
+ * other party's write landing during the hash, so it doesn't count.
+ */
+static NTSTATUS STDCALL WvRamdiskVerifyCheck_(
+    IN WV_SP_RAMDISK_VERIFY verify,
+    IN ULONG block
+  ) {
+    WV_SP_RAMDISK_T ramdisk = verify->Ramdisk;
+    ULONGLONG offset;
+    ULONG len;
+    PHYSICAL_ADDRESS phys_addr;
+    PUCHAR window;
+    PUCHAR data;
+    ULONGLONG hash;
+
+    if (WvRamdiskVerifyIsGood_(verify, block))
+      return STATUS_SUCCESS;
+
+    /* Blocks are no larger than windows, so never straddle two. */
+    offset = (ULONGLONG) block << verify->BlockShift;
+    len = 1UL << verify->BlockShift;
+    window = WvRamdiskWindow(
+        ramdisk,
+        (UINT32) (offset / WV_M_RAMDISK_WINDOW_SIZE)
+      );
+    if (window) {
+        data = window + (ULONG) (offset % WV_M_RAMDISK_WINDOW_SIZE);
+      } else {
+        phys_addr.QuadPart = ramdisk->DiskBuf + offset;
+        data = MmMapIoSpace(phys_addr, len, MmCached);
+        if (!data)
+          return STATUS_INSUFFICIENT_RESOURCES;
+      }
+    hash = WvRamhashXxh64(data, len, 0);
+    if (!window)
+      MmUnmapIoSpace(data, len);
+
+    if (hash == verify->Hashes[block]) {
+        InterlockedOr(verify->Good + block / 32, 1L << (block % 32));
+        return STATUS_SUCCESS;
+      }
+    if (WvRamdiskVerifyIsGood_(verify, block))
+      return STATUS_SUCCESS;
+    DBG("RAM disk %p block %u does not match its hash!\n", ramdisk, block);
+    return STATUS_DEVICE_DATA_ERROR;
+  }
+
+/**
+ * Hand any idle background items to the pool.
+ *
+ * @v verify            The RAM disk's verification state.
+ * @ret BOOLEAN         FALSE if the pool took none of them.
+ */
+static BOOLEAN STDCALL WvRamdiskVerifyKick_(IN WV_SP_RAMDISK_VERIFY verify) {
+    WV_SP_RAMDISK_VERIFY_WORKER_ worker;
+    BOOLEAN kicked = FALSE;
+    UINT32 i;
+
+    for (i = 0; i < WV_M_RAMDISK_VERIFY_WORKERS; ++i) {
+        worker = verify->Worker + i;
+        if (InterlockedCompareExchange(&worker->Busy, 1, 0))
+          continue;
+        InterlockedIncrement(&verify->Workers);
+        if (!WvlThreadPoolAddItem(worker->item)) {
+            /* No pool yet.  The first transfer will try again. */
+            InterlockedDecrement(&verify->Workers);
+            InterlockedExchange(&worker->Busy, 0);
+            break;
+          }
+        kicked = TRUE;
+      }
+    return kicked;
+  }
+
+/*
+ * Check blocks in the background for a time slice, then re-queue.  The
+ * pool's workers are shared, so this runs at their usual priority and
+ * keeps out of the way by giving up its worker often.
+ */
+static VOID STDCALL WvRamdiskVerifyWork_(IN OUT WVL_SP_THREAD_ITEM item) {
+    WV_SP_RAMDISK_VERIFY_WORKER_ worker;
+    WV_SP_RAMDISK_VERIFY verify;
+    ULONGLONG end;
+    ULONG block;
+
+    worker = CONTAINING_RECORD(item, WV_S_RAMDISK_VERIFY_WORKER_, item[0]);
+    verify = worker->Verify;
+
+    end = KeQueryInterruptTime() + WV_M_RAMDISK_VERIFY_SLICE;
+    while (!verify->Stop) {
+        /* Blocks are taken one at a time, so a slice leaves none out. */
+        block = (ULONG) InterlockedIncrement(&verify->Next) - 1;
+        if (block >= verify->BlockCount)
+          break;
+        WvRamdiskVerifyCheck_(verify, block);
+
+        /* Go to the back of the line, so other work gets a turn. */
+        if (KeQueryInterruptTime() >= end) {
+            if (WvlThreadPoolAddItem(item))
+              return;
+            break;
+          }
+      }
+
+    /* The RAM disk might be freed once the count drops to zero. */
+    InterlockedExchange(&worker->Busy, 0);
+    if (!InterlockedDecrement(&verify->Workers))
+      KeSetEvent(&verify->Idle, 0, FALSE);
+    return;
+  }
+
+/** Exported function definitions */
+
+/**
+ * Look for a hash manifest at the end of a RAM disk.
+ *
+ * @v ramdisk           The RAM disk, with its DiskBuf and DiskSize set.
+ * @ret NTSTATUS        STATUS_NOT_FOUND if there is no manifest.
+ *
+ * Upon success, transfers to and from the RAM disk are verified and
+ * background checking has begun.  A manifest which is present but
+ * inconsistent is an error, since the image can't be trusted.
+ */
+NTSTATUS STDCALL WvRamdiskVerifyOpen(IN WV_SP_RAMDISK_T ramdisk) {
+    ULONGLONG bytes;
+    PHYSICAL_ADDRESS phys_addr;
+    WV_SP_RAMHASH_FOOTER footer;
+    WV_S_RAMHASH_FOOTER copy;
+    ULONGLONG data_len;
+    ULONG hashes_len;
+    PUCHAR hashes;
+    WV_SP_RAMDISK_VERIFY verify;
+    NTSTATUS status;
+    UINT32 i;
+
+    bytes = ramdisk->DiskSize * ramdisk->disk->SectorSize;
+    if (bytes < WV_M_RAMHASH_FOOTER_SIZE)
+      return STATUS_NOT_FOUND;
+
+    phys_addr.QuadPart = ramdisk->DiskBuf + bytes - WV_M_RAMHASH_FOOTER_SIZE;
+    footer = MmMapIoSpace(phys_addr, sizeof *footer, MmCached);
+    if (!footer) {
+        DBG("Could not map RAM disk footer!\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+      }
+    RtlCopyMemory(&copy, footer, sizeof copy);
+    MmUnmapIoSpace(footer, sizeof *footer);
+
+    if (!wv_memcmpeq(
+        copy.Magic,
+        WV_M_RAMHASH_MAGIC,
+        WV_M_RAMHASH_MAGIC_LEN
+      ))
+      return STATUS_NOT_FOUND;
+    DBG("RAM disk %p has a hash manifest\n", ramdisk);
+
+    /* The hashes must lie between the data and the footer. */
+    data_len = (ULONGLONG) copy.BlockCount << copy.BlockShift;
+    hashes_len = copy.BlockCount * sizeof (ULONGLONG);
+    if (
+        copy.Version != WV_M_RAMHASH_VERSION ||
+        copy.BlockShift < WV_M_RAMHASH_MIN_BLOCK_SHIFT ||
+        copy.BlockShift > WV_M_RAMHASH_MAX_BLOCK_SHIFT ||
+        !copy.BlockCount ||
+        copy.BlockCount > WV_M_RAMHASH_MAX_BLOCKS ||
+        data_len + hashes_len > bytes - WV_M_RAMHASH_FOOTER_SIZE
+      ) {
+        DBG("Bad RAM disk hash manifest!\n");
+        return STATUS_DEVICE_DATA_ERROR;
+      }
+
+    verify = wv_mallocz(sizeof *verify);
+    if (!verify) {
+        DBG("Couldn't allocate RAM disk verification state!\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+      }
+    verify->Ramdisk = ramdisk;
+    verify->BlockShift = copy.BlockShift;
+    verify->BlockCount = copy.BlockCount;
+    verify->Workers = 1;
+    KeInitializeEvent(&verify->Idle, NotificationEvent, FALSE);
+    for (i = 0; i < WV_M_RAMDISK_VERIFY_WORKERS; ++i) {
+        verify->Worker[i].item->Func = WvRamdiskVerifyWork_;
+        verify->Worker[i].Verify = verify;
+      }
+
+    verify->Good = wv_mallocz(
+        (copy.BlockCount + 31) / 32 * sizeof *verify->Good
+      );
+    if (!verify->Good) {
+        DBG("Couldn't allocate RAM disk block bitmap!\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_good;
+      }
+
+    verify->Hashes = wv_malloc(hashes_len);
+    if (!verify->Hashes) {
+        DBG("Couldn't allocate RAM disk hashes!\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_hashes;
+      }
+    phys_addr.QuadPart = ramdisk->DiskBuf + data_len;
+    hashes = MmMapIoSpace(phys_addr, hashes_len, MmCached);
+    if (!hashes) {
+        DBG("Could not map RAM disk hashes!\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_map;
+      }
+    RtlCopyMemory(verify->Hashes, hashes, hashes_len);
+    MmUnmapIoSpace(hashes, hashes_len);
+
+    /* The manifest might itself have been damaged. */
+    if (
+        WvRamhashXxh64(verify->Hashes, hashes_len, 0) != copy.ManifestHash
+      ) {
+        DBG("RAM disk hash manifest does not match its hash!\n");
+        status = STATUS_DEVICE_DATA_ERROR;
+        goto err_manifest_hash;
+      }
+
+    ramdisk->Verify = verify;
+    WvRamdiskVerifyKick_(verify);
+    DBG(
+        "Verifying %u blocks of %u bytes\n",
+        verify->BlockCount,
+        1UL << verify->BlockShift
+      );
+    return STATUS_SUCCESS;
+
+    err_manifest_hash:
+
+    err_map:
+
+    wv_free(verify->Hashes);
+    err_hashes:
+
+    wv_free(verify->Good);
+    err_good:
+
+    wv_free(verify);
+    return status;
+  }
+
+/**
+ * Check the blocks covering a range of a RAM disk.
+ *
+ * @v ramdisk           The RAM disk about to be read or written.
+ * @v offset            The byte offset of the range.
+ * @v len               The length of the range, in bytes.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Anything past the last block, such as the manifest, isn't checked.
+ */
+NTSTATUS STDCALL WvRamdiskVerifyRange(
+    IN WV_SP_RAMDISK_T ramdisk,
+    IN ULONGLONG offset,
+    IN UINT32 len
+  ) {
+    WV_SP_RAMDISK_VERIFY verify = ramdisk->Verify;
+    ULONGLONG block;
+    ULONGLONG end;
+    NTSTATUS status;
+
+    if (!verify || !len)
+      return STATUS_SUCCESS;
+
+    /* In case the pool wasn't running when the disk was found. */
+    if (
+        !verify->Worker[0].Busy &&
+        (ULONG) verify->Next < verify->BlockCount
+      )
+      WvRamdiskVerifyKick_(verify);
+
+    block = offset >> verify->BlockShift;
+    end = ((offset + len - 1) >> verify->BlockShift) + 1;
+    if (end > verify->BlockCount)
+      end = verify->BlockCount;
+    for (; block < end; ++block) {
+        status = WvRamdiskVerifyCheck_(verify, (ULONG) block);
+        if (!NT_SUCCESS(status))
+          return status;
+      }
+    return STATUS_SUCCESS;
+  }
+
+/**
+ * Stop verifying a RAM disk and free its verification state.
+ *
+ * @v ramdisk           The RAM disk being freed.
+ */
+VOID STDCALL WvRamdiskVerifyFree(IN WV_SP_RAMDISK_T ramdisk) {
+    WV_SP_RAMDISK_VERIFY verify = ramdisk->Verify;
+
+    if (!verify)
+      return;
+
+    InterlockedExchange(&verify->Stop, 1);
+    if (InterlockedDecrement(&verify->Workers))
+      KeWaitForSingleObject(&verify->Idle, Executive, KernelMode, FALSE, NULL);
+
+    ramdisk->Verify = NULL;
+    wv_free(verify->Hashes);
+    wv_free(verify->Good);
+    wv_free(verify);
+  }
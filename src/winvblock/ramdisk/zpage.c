@@ -0,0 +1,147 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * Compressed RAM disk pages and their slab allocator.
+ */
+
+#include "zpage.h"
+#include "lz4.h"
+
+/** Exported function definitions */
+
+/* See the header for details. */
+void WvZpagePack(
+    const unsigned char * page,
+    unsigned char * packed,
+    unsigned int * table,
+    WV_SP_ZPAGE entry
+  ) {
+    const unsigned int * word = (const unsigned int *) page;
+    unsigned int i;
+    int len;
+
+    for (i = 1; i < WV_M_ZPAGE_SIZE / sizeof *word; ++i) {
+        if (word[i] != word[0])
+          break;
+      }
+    if (i == WV_M_ZPAGE_SIZE / sizeof *word) {
+        entry->Kind = WvZpageKindSame;
+        entry->Value.Fill = word[0];
+        entry->Length = 0;
+        return;
+      }
+
+    len = Lz4Compress(
+        page,
+        WV_M_ZPAGE_SIZE,
+        packed,
+        WV_M_ZPAGE_MAX_PACKED,
+        table,
+        WV_M_ZPAGE_HASH_BITS
+      );
+    if (len < 0) {
+        entry->Kind = WvZpageKindStored;
+        entry->Length = WV_M_ZPAGE_SIZE;
+      } else {
+        entry->Kind = WvZpageKindPacked;
+        entry->Length = (unsigned short) len;
+      }
+    entry->Value.Data = 0;
+  }
+
+/* See the header for details. */
+int WvZpageUnpack(const WV_S_ZPAGE * entry, unsigned char * page) {
+    unsigned int * word = (unsigned int *) page;
+    const unsigned int * from;
+    unsigned int fill = 0;
+    unsigned int i;
+
+    switch (entry->Kind) {
+        case WvZpageKindSame:
+          fill = entry->Value.Fill;
+          /* Fall through. */
+        case WvZpageKindEmpty:
+          for (i = 0; i < WV_M_ZPAGE_SIZE / sizeof *word; ++i)
+            word[i] = fill;
+          break;
+
+        case WvZpageKindPacked:
+          if (
+              Lz4Decompress(
+                  entry->Value.Data,
+                  entry->Length,
+                  page,
+                  WV_M_ZPAGE_SIZE
+                ) != WV_M_ZPAGE_SIZE
+            )
+            return -1;
+          break;
+
+        case WvZpageKindStored:
+          from = entry->Value.Data;
+          for (i = 0; i < WV_M_ZPAGE_SIZE / sizeof *word; ++i)
+            word[i] = from[i];
+          break;
+      }
+    return 0;
+  }
+
+/* See the header for details. */
+void * WvZpageAlloc(WV_SP_ZPAGE_CLASS zclass, unsigned int size) {
+    unsigned int obj_size =
+      (WV_M_ZPAGE_CLASS(size) + 1) * WV_M_ZPAGE_CLASS_SIZE;
+    void * obj;
+
+    obj = zclass->Free;
+    if (obj) {
+        zclass->Free = *(void **) obj;
+        return obj;
+      }
+    if (zclass->End - zclass->Next < (long) obj_size)
+      return 0;
+    obj = zclass->Next;
+    zclass->Next += obj_size;
+    return obj;
+  }
+
+/* See the header for details. */
+void WvZpageAddSlab(WV_SP_ZPAGE_CLASS zclass, void * slab) {
+    *(void **) slab = zclass->Slabs;
+    zclass->Slabs = slab;
+    zclass->Next = (unsigned char *) slab + WV_M_ZPAGE_CLASS_SIZE;
+    zclass->End = (unsigned char *) slab + WV_M_ZPAGE_SLAB_SIZE;
+    ++zclass->SlabCount;
+  }
+
+/* See the header for details. */
+void WvZpageFree(WV_SP_ZPAGE_CLASS zclass, void * obj) {
+    *(void **) obj = zclass->Free;
+    zclass->Free = obj;
+  }
+
+/* See the header for details. */
+void * WvZpageTakeSlab(WV_SP_ZPAGE_CLASS zclass) {
+    void * slab = zclass->Slabs;
+
+    if (slab)
+      zclass->Slabs = *(void **) slab;
+    return slab;
+  }
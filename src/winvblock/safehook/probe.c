@@ -43,6 +43,7 @@
 #include "bus.h"
 #include "ramdisk.h"
 #include "x86.h"
+#include "g4dmap.h"
 #include "grub4dos.h"
 #include "thread.h"
 #include "filedisk.h"
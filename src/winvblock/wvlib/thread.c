@@ -459,3 +459,479 @@ WVL_M_LIB VOID WvlThreadTestMsg(IN PCHAR Message) {
     WvlThreadTest(&test->ThreadItem);
     return;
   }
+
+/*** The shared worker pool */
+
+static WVL_S_THREAD WvlThreadPool[WVL_M_THREAD_POOL_MAX_WORKERS];
+/*
+ * The workers running.  The first WvlThreadPoolBase slots hold the
+ * workers started for the processors, which are never reaped.
+ */
+static ULONG WvlThreadPoolWorkers;
+static ULONG WvlThreadPoolBase;
+/* Reservations held, each of which wants a worker on top of the base */
+static ULONG WvlThreadPoolReserved;
+static BOOLEAN WvlThreadPoolStopping;
+/* Starts workers for reservations, from a system worker thread */
+static WORK_QUEUE_ITEM WvlThreadPoolGrowItem;
+static BOOLEAN WvlThreadPoolGrowScheduled;
+/* Signalled while WvlThreadPoolGrowItem isn't scheduled */
+static KEVENT WvlThreadPoolGrowIdle;
+/* Protects the above and the run list, which every worker pulls from */
+static LIST_ENTRY WvlThreadPoolItems;
+static KSPIN_LOCK WvlThreadPoolLock;
+/* Counts the items on the run list */
+static KSEMAPHORE WvlThreadPoolWork;
+
+/* A pool worker's thread routine. */
+static VOID STDCALL WvlThreadPoolWorker_(IN OUT WVL_SP_THREAD_ITEM item) {
+    WVL_SP_THREAD thread = CONTAINING_RECORD(item, WVL_S_THREAD, Main);
+    PVOID objects[2];
+    WVL_SP_THREAD_ITEM work_item;
+    PLIST_ENTRY link;
+    LARGE_INTEGER timeout;
+    BOOLEAN reap;
+    KIRQL irql;
+    NTSTATUS status;
+
+    /* A worker started for a reservation may be reaped once it idles. */
+    timeout.QuadPart = WVL_M_THREAD_POOL_IDLE_SECONDS * -10000000LL;
+
+    /* Run list work comes first, so it is drained before we stop. */
+    objects[0] = &WvlThreadPoolWork;
+    objects[1] = &thread->Signal;
+    while (
+        (thread->State == WvlThreadStateStarted) ||
+        (thread->State == WvlThreadStateStopping)
+      ) {
+        status = KeWaitForMultipleObjects(
+            sizeof objects / sizeof *objects,
+            objects,
+            WaitAny,
+            Executive,
+            KernelMode,
+            FALSE,
+            &timeout,
+            NULL
+          );
+
+        if (status == STATUS_WAIT_0) {
+            /* The semaphore promises us one item. */
+            KeAcquireSpinLock(&WvlThreadPoolLock, &irql);
+            link = RemoveHeadList(&WvlThreadPoolItems);
+            KeReleaseSpinLock(&WvlThreadPoolLock, irql);
+            ASSERT(link != &WvlThreadPoolItems);
+            work_item = CONTAINING_RECORD(link, WVL_S_THREAD_ITEM, Link);
+            work_item->Func(work_item);
+            continue;
+          }
+
+        if (status == STATUS_TIMEOUT) {
+            /* Go, if the pool has more workers than it wants. */
+            KeAcquireSpinLock(&WvlThreadPoolLock, &irql);
+            reap = (
+                !WvlThreadPoolStopping &&
+                thread >= WvlThreadPool + WvlThreadPoolBase &&
+                WvlThreadPoolWorkers >
+                WvlThreadPoolBase + WvlThreadPoolReserved
+              );
+            if (reap) {
+                WvlThreadPoolWorkers--;
+                thread->State = WvlThreadStateStopping;
+              }
+            KeReleaseSpinLock(&WvlThreadPoolLock, irql);
+            if (reap) {
+                DBG("Reaping pool worker %p.\n", (PVOID) thread);
+                return;
+              }
+            continue;
+          }
+
+        /* Our own items: only the stopper. */
+        while (work_item = WvlThreadGetItem(thread))
+          work_item->Func(work_item);
+
+        if (thread->State == WvlThreadStateStopping)
+          thread->State = WvlThreadStateStopped;
+      } /* while thread started or stopping. */
+    return;
+  }
+
+/* Start a pool worker in a slot which is free.  Internal use. */
+static NTSTATUS STDCALL WvlThreadPoolStartWorker_(IN WVL_SP_THREAD thread) {
+    /* A reaped worker's thread has exited, but its handle is open. */
+    if (thread->Handle)
+      ZwClose(thread->Handle);
+    thread->Handle = NULL;
+    thread->Main.Func = WvlThreadPoolWorker_;
+    thread->State = WvlThreadStateNotStarted;
+    return WvlThreadStart(thread);
+  }
+
+/*
+ * Start workers until there's one for each reservation, in a system
+ * worker thread, so that it can be done however busy the pool is.
+ * Internal use.
+ */
+static VOID WvlThreadPoolGrow_(IN PVOID context) {
+    WVL_SP_THREAD thread = WvlThreadPool + WvlThreadPoolBase;
+    KIRQL irql;
+    NTSTATUS status;
+
+    while (TRUE) {
+        /* Find a slot whose thread never started or has exited. */
+        while (
+            thread < WvlThreadPool + WVL_M_THREAD_POOL_MAX_WORKERS &&
+            thread->State != WvlThreadStateNotStarted &&
+            thread->State != WvlThreadStateStopped
+          )
+          thread++;
+
+        KeAcquireSpinLock(&WvlThreadPoolLock, &irql);
+        if (
+            WvlThreadPoolStopping ||
+            thread == WvlThreadPool + WVL_M_THREAD_POOL_MAX_WORKERS ||
+            WvlThreadPoolWorkers >= WvlThreadPoolBase + WvlThreadPoolReserved
+          ) {
+            WvlThreadPoolGrowScheduled = FALSE;
+            KeSetEvent(&WvlThreadPoolGrowIdle, 0, FALSE);
+            KeReleaseSpinLock(&WvlThreadPoolLock, irql);
+            return;
+          }
+        WvlThreadPoolWorkers++;
+        KeReleaseSpinLock(&WvlThreadPoolLock, irql);
+
+        status = WvlThreadPoolStartWorker_(thread);
+        if (!NT_SUCCESS(status)) {
+            DBG("Couldn't start a pool worker: 0x%08X\n", status);
+            KeAcquireSpinLock(&WvlThreadPoolLock, &irql);
+            WvlThreadPoolWorkers--;
+            WvlThreadPoolGrowScheduled = FALSE;
+            KeSetEvent(&WvlThreadPoolGrowIdle, 0, FALSE);
+            KeReleaseSpinLock(&WvlThreadPoolLock, irql);
+            return;
+          }
+        thread++;
+      }
+  }
+
+/**
+ * Start the shared worker pool.
+ *
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * One worker is started per processor.  Workers for items which block
+ * in synchronous I/O are started for WvlThreadPoolReserve().
+ * Must be called at PASSIVE_LEVEL.
+ */
+WVL_M_LIB NTSTATUS STDCALL WvlThreadPoolStart(void) {
+    ULONG count;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (WvlThreadPoolWorkers)
+      return STATUS_SUCCESS;
+
+    InitializeListHead(&WvlThreadPoolItems);
+    KeInitializeSpinLock(&WvlThreadPoolLock);
+    KeInitializeSemaphore(&WvlThreadPoolWork, 0, MAXLONG);
+    ExInitializeWorkItem(&WvlThreadPoolGrowItem, WvlThreadPoolGrow_, NULL);
+    KeInitializeEvent(&WvlThreadPoolGrowIdle, NotificationEvent, TRUE);
+    WvlThreadPoolGrowScheduled = FALSE;
+    WvlThreadPoolStopping = FALSE;
+    WvlThreadPoolReserved = 0;
+
+    count = KeNumberProcessors;
+    if (count > WVL_M_THREAD_POOL_MAX_BASE_WORKERS)
+      count = WVL_M_THREAD_POOL_MAX_BASE_WORKERS;
+
+    while (WvlThreadPoolWorkers < count) {
+        status = WvlThreadPoolStartWorker_(
+            WvlThreadPool + WvlThreadPoolWorkers
+          );
+        if (!NT_SUCCESS(status))
+          break;
+        WvlThreadPoolWorkers++;
+      }
+    /* As long as we have one worker, we can go on. */
+    if (!WvlThreadPoolWorkers) {
+        DBG("Couldn't start any pool workers!\n");
+        return status;
+      }
+    WvlThreadPoolBase = WvlThreadPoolWorkers;
+    DBG("Started %d pool workers.\n", WvlThreadPoolWorkers);
+    return STATUS_SUCCESS;
+  }
+
+/**
+ * Stop the shared worker pool.
+ *
+ * Items already enqueued are run before the workers stop.
+ */
+WVL_M_LIB VOID STDCALL WvlThreadPoolStop(void) {
+    WVL_SP_THREAD thread;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&WvlThreadPoolLock, &irql);
+    WvlThreadPoolStopping = TRUE;
+    WvlThreadPoolWorkers = 0;
+    KeReleaseSpinLock(&WvlThreadPoolLock, irql);
+    KeWaitForSingleObject(
+        &WvlThreadPoolGrowIdle,
+        Executive,
+        KernelMode,
+        FALSE,
+        NULL
+      );
+
+    for (
+        thread = WvlThreadPool;
+        thread < WvlThreadPool + WVL_M_THREAD_POOL_MAX_WORKERS;
+        thread++
+      ) {
+        if (thread->State == WvlThreadStateStarted) {
+            WvlThreadSendStopAndWait(thread);
+          } else if (thread->Handle) {
+            /* Reaped.  Its thread might still be on its way out. */
+            ZwWaitForSingleObject(thread->Handle, FALSE, NULL);
+            ZwClose(thread->Handle);
+          }
+        thread->Handle = NULL;
+        thread->State = WvlThreadStateNotStarted;
+      }
+    return;
+  }
+
+/**
+ * Reserve a pool worker for items which block in synchronous I/O.
+ *
+ * A worker blocked in synchronous I/O might be waiting for another
+ * WinVBlock disk, whose work is on the same run list.  So an owner of
+ * such items holds a reservation while it has one of them enqueued or
+ * running, and the pool starts a worker for every reservation on top
+ * of its per-processor workers.  However many owners block, the
+ * per-processor workers remain to run the work they are waiting for.
+ * A queue initialized as blocking holds a reservation for as long as
+ * it's scheduled, without its owner's help.
+ *
+ * Workers are started by a system worker thread, shortly after the
+ * reservation is made, and those no reservation wants any more are
+ * stopped once they have idled for WVL_M_THREAD_POOL_IDLE_SECONDS.
+ * Once WVL_M_THREAD_POOL_MAX_WORKERS are running, a reservation
+ * doesn't get a worker of its own and shares those there are.
+ * Must be called at or below DISPATCH_LEVEL.
+ */
+WVL_M_LIB VOID STDCALL WvlThreadPoolReserve(void) {
+    BOOLEAN grow;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&WvlThreadPoolLock, &irql);
+    WvlThreadPoolReserved++;
+    grow = (
+        !WvlThreadPoolStopping &&
+        !WvlThreadPoolGrowScheduled &&
+        WvlThreadPoolWorkers < WvlThreadPoolBase + WvlThreadPoolReserved &&
+        WvlThreadPoolWorkers < WVL_M_THREAD_POOL_MAX_WORKERS
+      );
+    if (grow) {
+        WvlThreadPoolGrowScheduled = TRUE;
+        KeClearEvent(&WvlThreadPoolGrowIdle);
+      }
+    KeReleaseSpinLock(&WvlThreadPoolLock, irql);
+
+    if (grow)
+      ExQueueWorkItem(&WvlThreadPoolGrowItem, DelayedWorkQueue);
+    return;
+  }
+
+/**
+ * Release a reservation made by WvlThreadPoolReserve().
+ *
+ * The caller must no longer have any blocking items enqueued or running
+ * for the reservation.  Must be called at or below DISPATCH_LEVEL.
+ */
+WVL_M_LIB VOID STDCALL WvlThreadPoolRelease(void) {
+    KIRQL irql;
+
+    KeAcquireSpinLock(&WvlThreadPoolLock, &irql);
+    ASSERT(WvlThreadPoolReserved);
+    WvlThreadPoolReserved--;
+    KeReleaseSpinLock(&WvlThreadPoolLock, irql);
+    return;
+  }
+
+/**
+ * Enqueue an item for the shared worker pool.
+ *
+ * @v Item              The item to enqueue.
+ * @ret BOOLEAN         FALSE for failure, TRUE for success.
+ *
+ * The item goes on the run list, which the next idle worker pulls it
+ * from.  Items enqueued this way may run concurrently and in any order;
+ * use a WVL_S_THREAD_QUEUE for items which must be run in order.  An
+ * item which might block in synchronous I/O must be covered by a
+ * WvlThreadPoolReserve() reservation.
+ */
+WVL_M_LIB BOOLEAN STDCALL WvlThreadPoolAddItem(IN WVL_SP_THREAD_ITEM Item) {
+    KIRQL irql;
+
+    if (!WvlThreadPoolWorkers || !Item) {
+        DBG("No pool or no item.\n");
+        return FALSE;
+      }
+
+    KeAcquireSpinLock(&WvlThreadPoolLock, &irql);
+    InsertTailList(&WvlThreadPoolItems, &Item->Link);
+    KeReleaseSpinLock(&WvlThreadPoolLock, irql);
+    KeReleaseSemaphore(&WvlThreadPoolWork, 0, 1, FALSE);
+    return TRUE;
+  }
+
+/* Run a queue's items in a pool worker.  Internal use. */
+static VOID STDCALL WvlThreadQueueRun_(IN OUT WVL_SP_THREAD_ITEM item) {
+    WVL_SP_THREAD_QUEUE queue = CONTAINING_RECORD(
+        item,
+        WVL_S_THREAD_QUEUE,
+        Main
+      );
+    KIRQL irql;
+    PLIST_ENTRY link;
+    PKEVENT idle;
+    BOOLEAN blocking = queue->Blocking;
+    ULONG count;
+
+    for (count = 0; count < WVL_M_THREAD_QUEUE_BATCH; count++) {
+        KeAcquireSpinLock(&queue->Lock, &irql);
+        link = RemoveHeadList(&queue->Items);
+        if (link == &queue->Items) {
+            /* Empty.  We mustn't touch the queue after this. */
+            queue->Scheduled = FALSE;
+            idle = queue->Idle;
+            queue->Idle = NULL;
+            KeReleaseSpinLock(&queue->Lock, irql);
+            if (blocking)
+              WvlThreadPoolRelease();
+            if (idle)
+              KeSetEvent(idle, 0, FALSE);
+            return;
+          }
+        KeReleaseSpinLock(&queue->Lock, irql);
+
+        item = CONTAINING_RECORD(link, WVL_S_THREAD_ITEM, Link);
+        item->Func(item);
+      }
+
+    /* Give other work a turn; we're still scheduled. */
+    if (!WvlThreadPoolAddItem(&queue->Main)) {
+        DBG("Couldn't re-enqueue queue %p!\n", (PVOID) queue);
+        KeAcquireSpinLock(&queue->Lock, &irql);
+        queue->Scheduled = FALSE;
+        idle = queue->Idle;
+        queue->Idle = NULL;
+        KeReleaseSpinLock(&queue->Lock, irql);
+        if (blocking)
+          WvlThreadPoolRelease();
+        if (idle)
+          KeSetEvent(idle, 0, FALSE);
+      }
+    return;
+  }
+
+/**
+ * Initialize an ordered queue of items for the shared worker pool.
+ *
+ * @v Queue             The queue to initialize.
+ * @v Blocking          Whether the queue's items might block in
+ *                      synchronous I/O.
+ *
+ * A blocking queue holds a WvlThreadPoolReserve() reservation while it
+ * has items enqueued or running.
+ */
+WVL_M_LIB VOID STDCALL WvlThreadQueueInit(
+    OUT WVL_SP_THREAD_QUEUE Queue,
+    IN BOOLEAN Blocking
+  ) {
+    Queue->Main.Func = WvlThreadQueueRun_;
+    InitializeListHead(&Queue->Items);
+    KeInitializeSpinLock(&Queue->Lock);
+    Queue->Scheduled = FALSE;
+    Queue->Blocking = Blocking;
+    Queue->Idle = NULL;
+    return;
+  }
+
+/**
+ * Enqueue an item on an ordered queue.
+ *
+ * @v Queue             The queue to add the item to.
+ * @v Item              The item to enqueue.
+ * @ret BOOLEAN         FALSE for failure, TRUE for success.
+ *
+ * A queue's items are run by pool workers one at a time, in the order
+ * they were added, but not necessarily all by the same worker.  So a
+ * blocking queue needs just one reservation, however many items it
+ * has.
+ */
+WVL_M_LIB BOOLEAN STDCALL WvlThreadQueueAddItem(
+    IN WVL_SP_THREAD_QUEUE Queue,
+    IN WVL_SP_THREAD_ITEM Item
+  ) {
+    KIRQL irql;
+    BOOLEAN schedule;
+    BOOLEAN release;
+
+    if (!Queue || !Item) {
+        DBG("No queue or no item.\n");
+        return FALSE;
+      }
+    if (!WvlThreadPoolWorkers) {
+        DBG("No pool.\n");
+        return FALSE;
+      }
+
+    KeAcquireSpinLock(&Queue->Lock, &irql);
+    InsertTailList(&Queue->Items, &Item->Link);
+    schedule = !Queue->Scheduled;
+    Queue->Scheduled = TRUE;
+    KeReleaseSpinLock(&Queue->Lock, irql);
+
+    if (schedule && Queue->Blocking)
+      WvlThreadPoolReserve();
+    if (schedule && !WvlThreadPoolAddItem(&Queue->Main)) {
+        KeAcquireSpinLock(&Queue->Lock, &irql);
+        RemoveEntryList(&Item->Link);
+        Queue->Scheduled = !IsListEmpty(&Queue->Items);
+        release = Queue->Blocking && !Queue->Scheduled;
+        KeReleaseSpinLock(&Queue->Lock, irql);
+        if (release)
+          WvlThreadPoolRelease();
+        return FALSE;
+      }
+    return TRUE;
+  }
+
+/**
+ * Wait for an ordered queue to become idle.
+ *
+ * @v Queue             The queue to wait for.
+ *
+ * Upon return, every item added to the queue beforehand has been run
+ * and the pool no longer references the queue, so it may be freed.
+ * The caller must prevent further additions.  Must be called at
+ * PASSIVE_LEVEL and not from one of the queue's own items.
+ */
+WVL_M_LIB VOID STDCALL WvlThreadQueueFlush(IN WVL_SP_THREAD_QUEUE Queue) {
+    KEVENT idle;
+    KIRQL irql;
+
+    KeInitializeEvent(&idle, NotificationEvent, FALSE);
+    KeAcquireSpinLock(&Queue->Lock, &irql);
+    if (!Queue->Scheduled) {
+        KeReleaseSpinLock(&Queue->Lock, irql);
+        return;
+      }
+    Queue->Idle = &idle;
+    KeReleaseSpinLock(&Queue->Lock, irql);
+
+    KeWaitForSingleObject(&idle, Executive, KernelMode, FALSE, NULL);
+    return;
+  }
@@ -0,0 +1,356 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Large transfer test for WinVBlock disks.
+ *
+ * Reads, and optionally writes, a disk in single requests larger than
+ * the 1 MiB which a disk takes by default, so that each is split into
+ * parts, and checks every one against the same data moved in 64 KiB
+ * requests.  A request which doesn't complete within the timeout is
+ * reported as hung.  With -w, each region is written with a pattern,
+ * checked both ways and then restored with small writes; nothing else
+ * should be using the disk meanwhile.  This is a Win32 console program:
+ *
+ *   cl /DWIN32_LEAN_AND_MEAN xfertest.c
+ */
+
+#define _WIN32_WINNT 0x0500
+
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_TIMEOUT_S   30
+#define DEFAULT_OFFSET_MB   1
+
+/* Below the default maximum transfer, so never split */
+#define SMALL_XFER          (64 * 1024)
+
+static DWORD Timeout = DEFAULT_TIMEOUT_S * 1000;
+
+int XferTestSyntax(void)
+{
+    fprintf(stderr, "syntax:\n");
+    fprintf(stderr, "xfertest [-w] [-o:<offset_mb>] [-t:<timeout_s>] <disk> [<xfer_kb>...]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "-w     also writes each region, then restores it.\n");
+    fprintf(stderr, "-o     sets where on the disk to start (default %u MiB).\n", DEFAULT_OFFSET_MB);
+    fprintf(stderr, "-t     sets how long a request may take (default %u s).\n", DEFAULT_TIMEOUT_S);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "example:\n");
+    fprintf(stderr, "xfertest -w \\\\.\\PhysicalDrive1 1028 4096\n");
+
+    return -1;
+}
+
+/*
+ * Wait for an overlapped request.  A request which doesn't complete in
+ * time still owns its buffer, so that ends the program.
+ */
+static BOOL Wait(HANDLE Disk, BOOL Ok, OVERLAPPED* Ov, DWORD* Done, const char* What)
+{
+    DWORD   Error;
+
+    if (!Ok && GetLastError() != ERROR_IO_PENDING)
+    {
+        Error = GetLastError();
+        CloseHandle(Ov->hEvent);
+        SetLastError(Error);
+        return FALSE;
+    }
+    if (WaitForSingleObject(Ov->hEvent, Timeout) == WAIT_TIMEOUT)
+    {
+        fprintf(stderr, "%s: Hung for %lu s!\n", What, Timeout / 1000);
+        exit(2);
+    }
+    Ok = GetOverlappedResult(Disk, Ov, Done, FALSE);
+    Error = GetLastError();
+    CloseHandle(Ov->hEvent);
+    SetLastError(Error);
+
+    return Ok;
+}
+
+static BOOL Ioctl(HANDLE Disk, DWORD Code, void* Out, DWORD OutLen)
+{
+    OVERLAPPED  Ov;
+    DWORD       Done;
+
+    memset(&Ov, 0, sizeof Ov);
+    Ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!Ov.hEvent)
+    {
+        return FALSE;
+    }
+
+    return Wait(Disk, DeviceIoControl(Disk, Code, NULL, 0, Out, OutLen, &Done, &Ov), &Ov, &Done,
+        "IOCTL");
+}
+
+/* Move Len bytes at Offset in one request, or in small ones */
+static int Xfer(HANDLE Disk, BOOL Write, BOOL Small, unsigned char* Buf, DWORD Len,
+    ULONGLONG Offset)
+{
+    OVERLAPPED  Ov;
+    DWORD       Part;
+    DWORD       Done;
+    char        What[64];
+    BOOL        Ok;
+
+    for (; Len; Len -= Part, Buf += Part, Offset += Part)
+    {
+        Part = Small && Len > SMALL_XFER ? SMALL_XFER : Len;
+        sprintf(What, "%s of %lu KiB at %I64u", Write ? "Write" : "Read", Part / 1024, Offset);
+
+        memset(&Ov, 0, sizeof Ov);
+        Ov.Offset = (DWORD) Offset;
+        Ov.OffsetHigh = (DWORD) (Offset >> 32);
+        Ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (!Ov.hEvent)
+        {
+            return -1;
+        }
+        if (Write)
+        {
+            Ok = WriteFile(Disk, Buf, Part, &Done, &Ov);
+        }
+        else
+        {
+            Ok = ReadFile(Disk, Buf, Part, &Done, &Ov);
+        }
+        if (!Wait(Disk, Ok, &Ov, &Done, What) || Done != Part)
+        {
+            fprintf(stderr, "%s: Failed with error %lu.\n", What, GetLastError());
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static double Now(void)
+{
+    LARGE_INTEGER   Count;
+    LARGE_INTEGER   Freq;
+
+    QueryPerformanceCounter(&Count);
+    QueryPerformanceFrequency(&Freq);
+    return (double) Count.QuadPart / Freq.QuadPart;
+}
+
+/* Test one transfer size.  Ref holds the region's data on return */
+static int Test(HANDLE Disk, BOOL Write, DWORD Len, ULONGLONG Offset, unsigned char* Ref,
+    unsigned char* Buf)
+{
+    unsigned char*  Pattern = Buf;
+    unsigned char*  Check = Buf + Len;
+    ULONGLONG       Value;
+    double          Start;
+    double          Read;
+    double          Written = 0;
+    DWORD           i;
+
+    if (Xfer(Disk, FALSE, TRUE, Ref, Len, Offset))
+    {
+        return -1;
+    }
+
+    Start = Now();
+    if (Xfer(Disk, FALSE, FALSE, Check, Len, Offset))
+    {
+        return -1;
+    }
+    Read = Now() - Start;
+    if (memcmp(Check, Ref, Len))
+    {
+        fprintf(stderr, "%lu KiB read: Data differs from small reads!\n", Len / 1024);
+        return -1;
+    }
+
+    if (Write)
+    {
+        for (i = 0; i < Len; i += sizeof Value)
+        {
+            Value = (Offset + i) ^ ((ULONGLONG) Len << 40);
+            memcpy(Pattern + i, &Value, sizeof Value);
+        }
+
+        Start = Now();
+        if (Xfer(Disk, TRUE, FALSE, Pattern, Len, Offset))
+        {
+            return -1;
+        }
+        Written = Now() - Start;
+        if (Xfer(Disk, FALSE, TRUE, Check, Len, Offset) || memcmp(Check, Pattern, Len))
+        {
+            fprintf(stderr, "%lu KiB write: Small reads differ!\n", Len / 1024);
+            Xfer(Disk, TRUE, TRUE, Ref, Len, Offset);
+            return -1;
+        }
+        if (Xfer(Disk, FALSE, FALSE, Check, Len, Offset) || memcmp(Check, Pattern, Len))
+        {
+            fprintf(stderr, "%lu KiB write: Reading it back differs!\n", Len / 1024);
+            Xfer(Disk, TRUE, TRUE, Ref, Len, Offset);
+            return -1;
+        }
+        if (Xfer(Disk, TRUE, TRUE, Ref, Len, Offset))
+        {
+            fprintf(stderr, "%lu KiB write: Couldn't restore %I64u!\n", Len / 1024, Offset);
+            return -1;
+        }
+    }
+
+    printf("%10lu %12.0f", Len / 1024, Len / Read / 1e6);
+    if (Write)
+    {
+        printf(" %12.0f", Len / Written / 1e6);
+    }
+    printf("  ok\n");
+
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    static const unsigned int DefaultXfers[] = { 1028, 2048, 4096, 8192 };
+    const char*             Path = NULL;
+    DISK_GEOMETRY           Geometry;
+    GET_LENGTH_INFORMATION  Length;
+    unsigned int            Xfers[32];
+    unsigned int            XferCount = 0;
+    ULONGLONG               Offset = DEFAULT_OFFSET_MB * 1024 * 1024;
+    DWORD                   MaxLen = 0;
+    DWORD                   Len;
+    unsigned char*          Ref;
+    unsigned char*          Buf;
+    HANDLE                  Disk;
+    BOOL                    Write = FALSE;
+    unsigned int            i;
+    int                     Failures = 0;
+    int                     a;
+
+    for (a = 1; a < argc; a++)
+    {
+        if (!strcmp(argv[a], "-w"))
+        {
+            Write = TRUE;
+        }
+        else if (!strncmp(argv[a], "-o:", 3) && atol(argv[a] + 3) >= 0)
+        {
+            Offset = (ULONGLONG) atol(argv[a] + 3) * 1024 * 1024;
+        }
+        else if (!strncmp(argv[a], "-t:", 3) && atol(argv[a] + 3) > 0)
+        {
+            Timeout = (DWORD) atol(argv[a] + 3) * 1000;
+        }
+        else if (argv[a][0] != '-' && !Path)
+        {
+            Path = argv[a];
+        }
+        else if (argv[a][0] != '-' && atol(argv[a]) > 0 && atol(argv[a]) <= 256 * 1024 &&
+            XferCount < sizeof Xfers / sizeof *Xfers)
+        {
+            Xfers[XferCount++] = (unsigned int) atol(argv[a]);
+        }
+        else
+        {
+            return XferTestSyntax();
+        }
+    }
+    if (!Path)
+    {
+        return XferTestSyntax();
+    }
+    if (!XferCount)
+    {
+        memcpy(Xfers, DefaultXfers, sizeof DefaultXfers);
+        XferCount = sizeof DefaultXfers / sizeof *DefaultXfers;
+    }
+
+    Disk = CreateFile(Path, GENERIC_READ | (Write ? GENERIC_WRITE : 0),
+        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+        FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL);
+    if (Disk == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "%s: Couldn't open it: %lu\n", Path, GetLastError());
+        return -1;
+    }
+    if (!Ioctl(Disk, IOCTL_DISK_GET_DRIVE_GEOMETRY, &Geometry, sizeof Geometry) ||
+        !Ioctl(Disk, IOCTL_DISK_GET_LENGTH_INFO, &Length, sizeof Length))
+    {
+        fprintf(stderr, "%s: Couldn't get its size: %lu\n", Path, GetLastError());
+        return -1;
+    }
+
+    for (i = 0; i < XferCount; i++)
+    {
+        Len = Xfers[i] * 1024;
+        if (Len % Geometry.BytesPerSector || Offset % Geometry.BytesPerSector)
+        {
+            fprintf(stderr, "%u: Not a whole number of %lu-byte sectors.\n", Xfers[i],
+                Geometry.BytesPerSector);
+            return -1;
+        }
+        if (Offset + Len > (ULONGLONG) Length.Length.QuadPart)
+        {
+            fprintf(stderr, "%u: Beyond the end of the disk.\n", Xfers[i]);
+            return -1;
+        }
+        if (Len > MaxLen)
+        {
+            MaxLen = Len;
+        }
+    }
+
+    /* Sector-aligned, for unbuffered I/O */
+    Ref = VirtualAlloc(NULL, MaxLen, MEM_COMMIT, PAGE_READWRITE);
+    Buf = VirtualAlloc(NULL, MaxLen * 2, MEM_COMMIT, PAGE_READWRITE);
+    if (!Ref || !Buf)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+
+    printf("%s: %lu-byte sectors, %I64u MiB, starting at %I64u MiB\n", Path,
+        Geometry.BytesPerSector, Length.Length.QuadPart >> 20, Offset >> 20);
+    printf("%10s %12s", "xfer KiB", "read MB/s");
+    if (Write)
+    {
+        printf(" %12s", "write MB/s");
+    }
+    printf("\n");
+
+    for (i = 0; i < XferCount; i++)
+    {
+        if (Test(Disk, Write, Xfers[i] * 1024, Offset, Ref, Buf))
+        {
+            Failures++;
+        }
+    }
+
+    VirtualFree(Buf, 0, MEM_RELEASE);
+    VirtualFree(Ref, 0, MEM_RELEASE);
+    CloseHandle(Disk);
+    printf("%d failure(s)\n", Failures);
+
+    return Failures ? 1 : 0;
+}
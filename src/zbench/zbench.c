@@ -0,0 +1,562 @@
+/**
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Compressed RAM disk codec and slab benchmark.
+ *
+ * Runs the page codec and slab allocator which compressed RAM disks
+ * use, from winvblock/ramdisk/zpage.c, and the LZ4 code beneath them,
+ * over corpora of differing compressibility or over a disk image.
+ * Each thread has its own store, as each processor effectively does
+ * between lock hand-offs in the driver, and the threads run each phase
+ * together.  It reports the throughput per core of:
+ *
+ *   lz4 c      Lz4Compress() of every page
+ *   lz4 d      Lz4Decompress() of every compressed page
+ *   pack       WvZpagePack() of every page
+ *   store      packing every page into an empty store
+ *   rewrite    packing every page over another, freeing the old data
+ *   load       WvZpageUnpack() of every page
+ *
+ * along with the ratio of the data's size to the slab memory holding
+ * it.  Every page is checked after each pass.  This is a portable,
+ * user-land program for POSIX:
+ *
+ *   cc -O2 -I../include -o zbench zbench.c \
+ *     ../winvblock/ramdisk/zpage.c ../lz4/lz4.c -lpthread
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "zpage.h"
+#include "lz4.h"
+
+#define DEFAULT_MB          32
+#define MAX_THREADS         64
+
+enum
+{
+    PhaseLz4Compress,
+    PhaseLz4Decompress,
+    PhasePack,
+    PhaseStore,
+    PhaseRewrite,
+    PhaseLoad,
+    Phases
+};
+
+static const char* PhaseNames[Phases] = { "lz4 c", "lz4 d", "pack", "store", "rewrite", "load" };
+
+typedef struct ZBENCH_THREAD
+{
+    pthread_t           Thread;
+    unsigned int        Index;
+    const char*         Corpus;
+    size_t              PageCount;
+    unsigned char*      Data;
+    unsigned char*      Out;
+    WV_S_ZPAGE*         Pages;
+    WV_S_ZPAGE_CLASS    Classes[WV_M_ZPAGE_CLASSES];
+    unsigned long       Kinds[WvZpageKinds];
+    unsigned long       Slabs;
+    double              Rate[Phases];
+    int                 Failed;
+} ZBENCH_THREAD;
+
+static pthread_barrier_t    Barrier;
+static unsigned char*       FileData;
+
+static const char* Words[] =
+{
+    "the", "disk", "of", "and", "a", "to", "in", "is", "sector", "that", "for", "it",
+    "driver", "with", "as", "was", "on", "be", "at", "by", "this", "had", "not", "are",
+    "but", "from", "or", "have", "an", "they", "which", "one", "you", "were", "her", "all",
+    "she", "there", "would", "their", "we", "him", "been", "has", "when", "who", "will", "more",
+    "no", "if", "out", "so", "said", "what", "up", "its", "about", "into", "than", "them",
+    "can", "only", "other", "new"
+};
+
+int ZBenchSyntax(void)
+{
+    fprintf(stderr, "syntax:\n");
+    fprintf(stderr, "zbench [-m:<mb>] [-t:<threads>] [<image>]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "-m     sets how much data each thread packs (default %u MiB).\n", DEFAULT_MB);
+    fprintf(stderr, "-t     sets the number of threads (default 1, at most %u).\n", MAX_THREADS);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "With an image, its start is the data.  Otherwise, the corpora are\n");
+    fprintf(stderr, "zeroes, text, random bytes and a mix of these.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "example:\n");
+    fprintf(stderr, "zbench -t:4 disk.img\n");
+
+    return -1;
+}
+
+static double Now(void)
+{
+    struct timespec Time;
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return Time.tv_sec + Time.tv_nsec / 1e9;
+}
+
+/* xorshift64* */
+static unsigned long long Rand(unsigned long long* State)
+{
+    *State ^= *State >> 12;
+    *State ^= *State << 25;
+    *State ^= *State >> 27;
+
+    return *State * 0x2545F4914F6CDD1DULL;
+}
+
+/* Fill a page with words and numbers, which LZ4 packs to about half */
+static void FillText(unsigned char* Page, unsigned long long* State)
+{
+    char            Word[24];
+    size_t          Len;
+    size_t          Done = 0;
+    unsigned long   r;
+
+    while (Done < WV_M_ZPAGE_SIZE)
+    {
+        r = (unsigned long) (Rand(State) >> 32);
+        if (r % 8)
+        {
+            Len = (size_t) sprintf(Word, "%s ", Words[r / 8 % (sizeof Words / sizeof *Words)]);
+        }
+        else
+        {
+            Len = (size_t) sprintf(Word, "%lu\n", r / 8 % 100000);
+        }
+        if (Len > WV_M_ZPAGE_SIZE - Done)
+        {
+            Len = WV_M_ZPAGE_SIZE - Done;
+        }
+        memcpy(Page + Done, Word, Len);
+        Done += Len;
+    }
+}
+
+static void FillRandom(unsigned char* Page, unsigned long long* State)
+{
+    unsigned long long  r;
+    size_t              i;
+
+    for (i = 0; i < WV_M_ZPAGE_SIZE; i += sizeof r)
+    {
+        r = Rand(State);
+        memcpy(Page + i, &r, sizeof r);
+    }
+}
+
+static void MakeCorpus(ZBENCH_THREAD* T)
+{
+    unsigned long long  State = 0x9E3779B97F4A7C15ULL * (T->Index + 1);
+    unsigned char*      Page;
+    unsigned int        Fill;
+    unsigned long       r;
+    size_t              i;
+
+    if (!strcmp(T->Corpus, "image"))
+    {
+        memcpy(T->Data, FileData, T->PageCount * WV_M_ZPAGE_SIZE);
+        return;
+    }
+    for (i = 0; i < T->PageCount; i++)
+    {
+        Page = T->Data + i * WV_M_ZPAGE_SIZE;
+        r = (unsigned long) (Rand(&State) >> 32) % 20;
+        if (!strcmp(T->Corpus, "zero") || (!strcmp(T->Corpus, "mixed") && r < 5))
+        {
+            memset(Page, 0, WV_M_ZPAGE_SIZE);
+        }
+        else if (!strcmp(T->Corpus, "mixed") && r < 7)
+        {
+            Fill = (unsigned int) Rand(&State);
+            for (r = 0; r < WV_M_ZPAGE_SIZE; r += sizeof Fill)
+            {
+                memcpy(Page + r, &Fill, sizeof Fill);
+            }
+        }
+        else if (!strcmp(T->Corpus, "text") || (!strcmp(T->Corpus, "mixed") && r < 15))
+        {
+            FillText(Page, &State);
+        }
+        else
+        {
+            FillRandom(Page, &State);
+        }
+    }
+}
+
+/*
+ * Pack every page into the store, as WvZramWritePage_() does for a
+ * whole page.  Page i of the store gets page (i + Shift) of the data.
+ */
+static int Store(ZBENCH_THREAD* T, size_t Shift)
+{
+    static __thread unsigned char   Packed[WV_M_ZPAGE_MAX_PACKED];
+    static __thread unsigned int    Table[WV_M_ZPAGE_TABLE_ENTRIES];
+    const unsigned char*            Page;
+    WV_SP_ZPAGE_CLASS               Class;
+    WV_S_ZPAGE                      New;
+    WV_SP_ZPAGE                     Entry;
+    void*                           Obj;
+    void*                           Slab;
+    size_t                          i;
+
+    for (i = 0; i < T->PageCount; i++)
+    {
+        Page = T->Data + (i + Shift) % T->PageCount * WV_M_ZPAGE_SIZE;
+        WvZpagePack(Page, Packed, Table, &New);
+        if (New.Kind != WvZpageKindSame)
+        {
+            Class = T->Classes + WV_M_ZPAGE_CLASS(New.Length);
+            Obj = WvZpageAlloc(Class, New.Length);
+            if (!Obj)
+            {
+                Slab = malloc(WV_M_ZPAGE_SLAB_SIZE);
+                if (!Slab)
+                {
+                    return -1;
+                }
+                WvZpageAddSlab(Class, Slab);
+                Obj = WvZpageAlloc(Class, New.Length);
+            }
+            memcpy(Obj, New.Kind == WvZpageKindPacked ? Packed : Page, New.Length);
+            New.Value.Data = Obj;
+        }
+
+        Entry = T->Pages + i;
+        if (Entry->Kind == WvZpageKindPacked || Entry->Kind == WvZpageKindStored)
+        {
+            WvZpageFree(T->Classes + WV_M_ZPAGE_CLASS(Entry->Length), Entry->Value.Data);
+        }
+        *Entry = New;
+    }
+
+    return 0;
+}
+
+/* Unpack every page, and check each against page (i + Shift) of the data */
+static int Load(ZBENCH_THREAD* T, size_t Shift, double* Rate)
+{
+    double  Start;
+    size_t  i;
+
+    Start = Now();
+    for (i = 0; i < T->PageCount; i++)
+    {
+        if (WvZpageUnpack(T->Pages + i, T->Out + i * WV_M_ZPAGE_SIZE))
+        {
+            return -1;
+        }
+    }
+    if (Rate)
+    {
+        *Rate = T->PageCount * WV_M_ZPAGE_SIZE / (Now() - Start) / 1e6;
+    }
+
+    for (i = 0; i < T->PageCount; i++)
+    {
+        if (memcmp(T->Out + i * WV_M_ZPAGE_SIZE,
+            T->Data + (i + Shift) % T->PageCount * WV_M_ZPAGE_SIZE, WV_M_ZPAGE_SIZE))
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void* Worker(void* Arg)
+{
+    static __thread unsigned char   Packed[WV_M_ZPAGE_MAX_PACKED];
+    static __thread unsigned int    Table[WV_M_ZPAGE_TABLE_ENTRIES];
+    ZBENCH_THREAD*                  T = Arg;
+    volatile int                    Sink = 0;
+    size_t                          Len = T->PageCount * WV_M_ZPAGE_SIZE;
+    size_t                          LzPages = 0;
+    WV_S_ZPAGE                      Entry;
+    void*                           Slab;
+    double                          Start;
+    size_t                          i;
+    unsigned int                    c;
+
+    MakeCorpus(T);
+    memset(T->Out, 0, Len);
+
+    pthread_barrier_wait(&Barrier);
+    Start = Now();
+    for (i = 0; i < T->PageCount; i++)
+    {
+        Sink += Lz4Compress(T->Data + i * WV_M_ZPAGE_SIZE, WV_M_ZPAGE_SIZE, Packed,
+            WV_M_ZPAGE_MAX_PACKED, Table, WV_M_ZPAGE_HASH_BITS);
+    }
+    T->Rate[PhaseLz4Compress] = Len / (Now() - Start) / 1e6;
+
+    pthread_barrier_wait(&Barrier);
+    Start = Now();
+    for (i = 0; i < T->PageCount; i++)
+    {
+        WvZpagePack(T->Data + i * WV_M_ZPAGE_SIZE, Packed, Table, &Entry);
+        Sink += Entry.Length;
+    }
+    T->Rate[PhasePack] = Len / (Now() - Start) / 1e6;
+
+    pthread_barrier_wait(&Barrier);
+    Start = Now();
+    if (Store(T, 0))
+    {
+        T->Failed = 1;
+    }
+    T->Rate[PhaseStore] = Len / (Now() - Start) / 1e6;
+    for (c = 0; c < WV_M_ZPAGE_CLASSES; c++)
+    {
+        T->Slabs += T->Classes[c].SlabCount;
+    }
+    for (i = 0; i < T->PageCount; i++)
+    {
+        T->Kinds[T->Pages[i].Kind]++;
+    }
+
+    pthread_barrier_wait(&Barrier);
+    Start = Now();
+    for (i = 0; i < T->PageCount; i++)
+    {
+        if (T->Pages[i].Kind == WvZpageKindPacked)
+        {
+            Sink += Lz4Decompress(T->Pages[i].Value.Data, T->Pages[i].Length,
+                T->Out + i * WV_M_ZPAGE_SIZE, WV_M_ZPAGE_SIZE);
+            LzPages++;
+        }
+    }
+    T->Rate[PhaseLz4Decompress] = LzPages * WV_M_ZPAGE_SIZE / (Now() - Start) / 1e6;
+
+    pthread_barrier_wait(&Barrier);
+    if (!T->Failed && Load(T, 0, T->Rate + PhaseLoad))
+    {
+        T->Failed = 1;
+    }
+
+    /* Each page now gets the next page's data, changing many sizes */
+    pthread_barrier_wait(&Barrier);
+    Start = Now();
+    if (!T->Failed && Store(T, 1))
+    {
+        T->Failed = 1;
+    }
+    T->Rate[PhaseRewrite] = Len / (Now() - Start) / 1e6;
+    if (!T->Failed && Load(T, 1, NULL))
+    {
+        T->Failed = 1;
+    }
+
+    for (c = 0; c < WV_M_ZPAGE_CLASSES; c++)
+    {
+        while ((Slab = WvZpageTakeSlab(T->Classes + c)))
+        {
+            free(Slab);
+        }
+    }
+    memset(T->Classes, 0, sizeof T->Classes);
+    (void) Sink;
+
+    return NULL;
+}
+
+static int Run(const char* Corpus, ZBENCH_THREAD* Threads, unsigned int ThreadCount)
+{
+    unsigned long long  Slabs = 0;
+    unsigned long long  Kinds[WvZpageKinds] = { 0 };
+    unsigned long long  Pages = 0;
+    double              Rate[Phases] = { 0 };
+    unsigned int        i;
+    int                 p;
+
+    for (i = 0; i < ThreadCount; i++)
+    {
+        Threads[i].Corpus = Corpus;
+        Threads[i].Slabs = 0;
+        Threads[i].Failed = 0;
+        memset(Threads[i].Kinds, 0, sizeof Threads[i].Kinds);
+        memset(Threads[i].Pages, 0, Threads[i].PageCount * sizeof *Threads[i].Pages);
+        if (pthread_create(&Threads[i].Thread, NULL, Worker, Threads + i))
+        {
+            fprintf(stderr, "Couldn't start a thread.\n");
+            exit(-1);
+        }
+    }
+    for (i = 0; i < ThreadCount; i++)
+    {
+        pthread_join(Threads[i].Thread, NULL);
+        if (Threads[i].Failed)
+        {
+            fprintf(stderr, "%s: Pages didn't survive the store!\n", Corpus);
+            return -1;
+        }
+        for (p = 0; p < Phases; p++)
+        {
+            Rate[p] += Threads[i].Rate[p];
+        }
+        for (p = 0; p < WvZpageKinds; p++)
+        {
+            Kinds[p] += Threads[i].Kinds[p];
+        }
+        Slabs += Threads[i].Slabs;
+        Pages += Threads[i].PageCount;
+    }
+
+    printf("%-8s", Corpus);
+    if (Slabs)
+    {
+        printf(" %7.2f", (double) Pages * WV_M_ZPAGE_SIZE / (Slabs * WV_M_ZPAGE_SLAB_SIZE));
+    }
+    else
+    {
+        printf(" %7s", "-");
+    }
+    printf(" %6.1f %6.1f %6.1f", 100.0 * Kinds[WvZpageKindSame] / Pages,
+        100.0 * Kinds[WvZpageKindPacked] / Pages, 100.0 * Kinds[WvZpageKindStored] / Pages);
+    for (p = 0; p < Phases; p++)
+    {
+        if (Rate[p] > 0)
+        {
+            printf(" %8.0f", Rate[p] / ThreadCount);
+        }
+        else
+        {
+            printf(" %8s", "-");
+        }
+    }
+    if (ThreadCount > 1)
+    {
+        printf("  (x%u: %.0f store, %.0f load)", ThreadCount, Rate[PhaseStore], Rate[PhaseLoad]);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    static const char*  Corpora[] = { "zero", "text", "random", "mixed" };
+    static ZBENCH_THREAD Threads[MAX_THREADS];
+    const char*         Image = NULL;
+    size_t              Len = DEFAULT_MB * 1024UL * 1024;
+    unsigned int        ThreadCount = 1;
+    FILE*               File;
+    unsigned int        i;
+    int                 a;
+    int                 p;
+    int                 Result = 0;
+
+    for (a = 1; a < argc; a++)
+    {
+        if (!strncmp(argv[a], "-m:", 3) && atol(argv[a] + 3) > 0)
+        {
+            Len = (size_t) atol(argv[a] + 3) * 1024 * 1024;
+        }
+        else if (!strncmp(argv[a], "-t:", 3) && atoi(argv[a] + 3) > 0 && atoi(argv[a] + 3) <= MAX_THREADS)
+        {
+            ThreadCount = (unsigned int) atoi(argv[a] + 3);
+        }
+        else if (argv[a][0] != '-' && !Image)
+        {
+            Image = argv[a];
+        }
+        else
+        {
+            return ZBenchSyntax();
+        }
+    }
+
+    if (Image)
+    {
+        File = fopen(Image, "rb");
+        FileData = malloc(Len);
+        if (!File || !FileData)
+        {
+            fprintf(stderr, "%s: Couldn't open it.\n", Image);
+            return -1;
+        }
+        Len = fread(FileData, 1, Len, File) / WV_M_ZPAGE_SIZE * WV_M_ZPAGE_SIZE;
+        fclose(File);
+        if (!Len)
+        {
+            fprintf(stderr, "%s: Smaller than a page.\n", Image);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < ThreadCount; i++)
+    {
+        Threads[i].Index = i;
+        Threads[i].PageCount = Len / WV_M_ZPAGE_SIZE;
+        Threads[i].Data = aligned_alloc(4096, Len);
+        Threads[i].Out = aligned_alloc(4096, Len);
+        Threads[i].Pages = malloc(Threads[i].PageCount * sizeof *Threads[i].Pages);
+        if (!Threads[i].Data || !Threads[i].Out || !Threads[i].Pages)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            return -1;
+        }
+    }
+    pthread_barrier_init(&Barrier, NULL, ThreadCount);
+
+    printf("%u thread(s), %zu MiB each; MB/s per core\n", ThreadCount, Len >> 20);
+    printf("%-8s %7s %6s %6s %6s", "corpus", "ratio", "same%", "lz4%", "raw%");
+    for (p = 0; p < Phases; p++)
+    {
+        printf(" %8s", PhaseNames[p]);
+    }
+    printf("\n");
+
+    if (Image)
+    {
+        Result = Run("image", Threads, ThreadCount);
+    }
+    else
+    {
+        for (i = 0; i < sizeof Corpora / sizeof *Corpora && !Result; i++)
+        {
+            Result = Run(Corpora[i], Threads, ThreadCount);
+        }
+    }
+
+    pthread_barrier_destroy(&Barrier);
+    for (i = 0; i < ThreadCount; i++)
+    {
+        free(Threads[i].Pages);
+        free(Threads[i].Out);
+        free(Threads[i].Data);
+    }
+    free(FileData);
+
+    return Result;
+}